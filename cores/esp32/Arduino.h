@@ -140,8 +140,26 @@ void initArduino(void);
 unsigned long pulseIn(uint8_t pin, uint8_t state, unsigned long timeout);
 unsigned long pulseInLong(uint8_t pin, uint8_t state, unsigned long timeout);
 
+#define PULSE_CAPTURE_DEFAULT_DEPTH 32
+
+typedef struct {
+    uint32_t start;     // micros() at the leading edge
+    uint32_t width;     // pulse length in microseconds
+    uint8_t level;      // HIGH or LOW
+} pulse_t;
+
+bool pulseCaptureBegin(uint8_t pin, size_t depth);   // false if the pin already has an interrupt attached
+void pulseCaptureEnd(uint8_t pin);
+uint32_t pulseCaptureOverruns(uint8_t pin);
+size_t readPulses(uint8_t pin, pulse_t * pulses, size_t count);
+// non-blocking pulseIn on a capture; the first call on a pin starts the capture with
+// PULSE_CAPTURE_DEFAULT_DEPTH and returns false, call pulseCaptureBegin() first to avoid that
+bool pulseInAsync(uint8_t pin, uint8_t state, unsigned long * width);
+
+#define SHIFT_PULSE_WIDTH_DEFAULT 100 // ns, clock high and low time of shiftIn/shiftOut
 uint8_t shiftIn(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder);
 void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, uint8_t val);
+void shiftSetPulseWidth(uint32_t ns); // minimum clock high and low time, 0: as fast as possible
 
 #ifdef __cplusplus
 }
@@ -60,6 +60,31 @@ void HardwareSerial::setDebugOutput(bool en)
     }
 }
 
+bool HardwareSerial::setFrameMode(uint8_t frames, uint16_t frameSize, uint8_t gap)
+{
+    return uartSetFrameMode(_uart, frames, frameSize, gap);
+}
+
+size_t HardwareSerial::readFrame(uint8_t *buffer, size_t size, uart_frame_info_t *info, uint32_t timeout)
+{
+    return uartReadFrame(_uart, buffer, size, info, timeout);
+}
+
+int HardwareSerial::framesAvailable(void)
+{
+    return uartFramesAvailable(_uart);
+}
+
+uint32_t HardwareSerial::framesDropped(void)
+{
+    return uartFramesDropped(_uart);
+}
+
+void HardwareSerial::setRS485(int8_t dePin, bool activeHigh)
+{
+    uartSetRS485(_uart, dePin, activeHigh);
+}
+
 int HardwareSerial::available(void)
 {
     return uartAvailable(_uart);
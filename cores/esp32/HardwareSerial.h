@@ -72,6 +72,15 @@ public:
 
     void setDebugOutput(bool);
 
+    // frame mode: bytes are grouped into frames ended by `gap` idle symbol times,
+    // call after begin(), 0 frames turns it off
+    bool setFrameMode(uint8_t frames, uint16_t frameSize = 256, uint8_t gap = 4);
+    size_t readFrame(uint8_t *buffer, size_t size, uart_frame_info_t *info = NULL, uint32_t timeout = 0);
+    int framesAvailable(void);
+    uint32_t framesDropped(void);
+    // RS-485 driver enable pin, held active while transmitting, -1 turns it off
+    void setRS485(int8_t dePin, bool activeHigh = true);
+
 protected:
     int _uart_nr;
     uart_t* _uart;
@@ -765,14 +765,15 @@ void String::replace(const String& find, const String& replace)
         char *writeTo = buffer;
         while((foundAt = strstr(readFrom, find.buffer)) != NULL) {
             unsigned int n = foundAt - readFrom;
-            memcpy(writeTo, readFrom, n);
+            // writeTo trails readFrom by less than n, the ranges overlap
+            memmove(writeTo, readFrom, n);
             writeTo += n;
             memcpy(writeTo, replace.buffer, replace.len);
             writeTo += replace.len;
             readFrom = foundAt + find.len;
             len += diff;
         }
-        strcpy(writeTo, readFrom);
+        memmove(writeTo, readFrom, strlen(readFrom) + 1);
     } else {
         unsigned int size = len; // compute size needed for result
         while((foundAt = strstr(readFrom, find.buffer)) != NULL) {
@@ -21,12 +21,18 @@
 #include "soc/rtc_io_reg.h"
 #include "soc/rtc_cntl_reg.h"
 #include "soc/sens_reg.h"
+#include "soc/syscon_reg.h"
+#include "freertos/semphr.h"
+#include "freertos/ringbuf.h"
+#include "driver/i2s.h"
+#include "esp_adc_cal.h"
 
 static uint8_t __analogAttenuation = 3;//11db
 static uint8_t __analogWidth = 3;//12 bits
 static uint8_t __analogCycles = 8;
 static uint8_t __analogSamples = 0;//1 sample
 static uint8_t __analogClockDiv = 1;
+static bool __analogInitialized = false;
 
 // Width of returned answer ()
 static uint8_t __analogReturnedWidth = 12;
@@ -83,8 +89,7 @@ void __analogSetAttenuation(adc_attenuation_t attenuation)
 }
 
 void IRAM_ATTR __analogInit(){
-    static bool initialized = false;
-    if(initialized){
+    if(__analogInitialized){
         return;
     }
 
@@ -111,7 +116,7 @@ void IRAM_ATTR __analogInit(){
     SET_PERI_REG_BITS(SENS_SAR_MEAS_WAIT2_REG, SENS_SAR_AMP_WAIT3, 0x1, SENS_SAR_AMP_WAIT3_S);
     while (GET_PERI_REG_BITS2(SENS_SAR_SLAVE_ADDR1_REG, 0x7, SENS_MEAS_STATUS_S) != 0); //wait det_fsm==
 
-    initialized = true;
+    __analogInitialized = true;
 }
 
 void __analogSetPinAttenuation(uint8_t pin, adc_attenuation_t attenuation)
@@ -257,6 +262,527 @@ int __hallRead()    //hall sensor without LNA
     return (Sens_Vp1 - Sens_Vp0) - (Sens_Vn1 - Sens_Vn0);
 }
 
+/*
+ * Continuous sampling
+ *
+ * I2S0 clocks the ADC1 digital controller and moves its results into a DMA
+ * ring. The controller walks a pattern table with one entry per pin, so all
+ * pins are scanned round robin at sample_rate conversions per second in total.
+ * Every DMA word carries the channel in bits 15:12 and the code in bits 11:0,
+ * and the I2S unit stores the two 16 bit halves of each 32 bit word swapped.
+ * */
+
+#define ADC_STREAM_I2S          I2S_NUM_0
+#define ADC_STREAM_DMA_LEN      512     //samples per DMA buffer
+#define ADC_STREAM_DMA_COUNT    4
+#define ADC_STREAM_LP_FRAC      4       //fraction bits kept by the low-pass state
+#define ADC_STREAM_RESYNC       0xFF    //waiting for the first pin of the next scan
+#define ADC_STREAM_READ_SLICE   20      //ms a reader waits on the ring before checking for adcStreamEnd()
+
+typedef struct {
+    adc_stream_config_t config;
+    uint8_t count;
+    uint8_t slot[16];           //channel -> pattern slot, 0xFF when not scanned
+    uint8_t next;               //slot expected next, ADC_STREAM_RESYNC after a lost conversion
+    uint16_t scan[ADC_STREAM_MAX_PINS]; //codes of the current scan, filtered once it is complete
+    uint16_t rounds;            //scans accumulated for the next output frame
+    uint8_t avgShift;           //log2(decimation) when it is a power of two, else 0xFF
+    uint32_t acc[ADC_STREAM_MAX_PINS];
+    uint16_t * block;
+    size_t blockLen;            //frames in block
+    uint16_t * dma;
+    RingbufHandle_t ring;
+    TaskHandle_t task;
+    SemaphoreHandle_t done;     //given by the task when it stops, then by the last reader after the end
+    uint8_t readers;            //tasks in adcStreamRead(), under __adcStreamMux
+    volatile bool ended;
+    volatile bool running;
+    volatile uint32_t overruns;
+    volatile uint32_t dropped;
+} adc_stream_t;
+
+static adc_stream_t * __adcStream = NULL;
+static portMUX_TYPE __adcStreamMux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint8_t __adcStreamPattern(const int8_t * channels, const uint8_t * attens, uint8_t count, uint32_t table[4])
+{
+    if(!count || count > 16){
+        return 0;
+    }
+    memset(table, 0, 4 * sizeof(uint32_t));
+    for(uint8_t i = 0; i < count; i++){
+        //entry is channel[7:4] width[3:2] attenuation[1:0], first entry in the top byte
+        uint32_t entry = ((channels[i] & 0xF) << 4) | (3 << 2) | (attens[i] & 3);
+        table[i / 4] |= entry << (24 - ((i % 4) * 8));
+    }
+    return count;
+}
+
+static inline void __adcStreamAccumulate(adc_stream_t * s, uint8_t slot, uint16_t value)
+{
+    if(s->config.filter == ADC_FILTER_LOWPASS){
+        int32_t y = s->acc[slot];
+        y += (((int32_t)value << ADC_STREAM_LP_FRAC) - y) >> s->config.lowpass_shift;
+        s->acc[slot] = y;
+    } else if(s->config.filter == ADC_FILTER_AVERAGE){
+        s->acc[slot] += value;
+    } else {
+        s->acc[slot] = value;
+    }
+}
+
+static inline uint16_t __adcStreamOutput(adc_stream_t * s, uint8_t slot)
+{
+    uint32_t v = s->acc[slot];
+    if(s->config.filter == ADC_FILTER_LOWPASS){
+        return v >> ADC_STREAM_LP_FRAC;
+    }
+    if(s->config.filter == ADC_FILTER_AVERAGE){
+        s->acc[slot] = 0;
+        if(s->avgShift != 0xFF){
+            return v >> s->avgShift;
+        }
+        return v / s->config.decimation;
+    }
+    return v;
+}
+
+static void __adcStreamFlush(adc_stream_t * s)
+{
+    if(!s->blockLen){
+        return;
+    }
+    if(s->config.callback){
+        s->config.callback(s->block, s->blockLen, s->config.arg);
+    } else if(xRingbufferSend(s->ring, s->block, s->blockLen * s->count * sizeof(uint16_t), 0) != pdTRUE){
+        s->overruns++;
+    }
+    s->blockLen = 0;
+}
+
+static void __adcStreamSample(adc_stream_t * s, uint16_t word)
+{
+    uint8_t slot = s->slot[word >> 12];
+    if(slot == 0xFF){
+        return;
+    }
+    if(slot != s->next){
+        //a conversion was lost, drop the scan and wait for its first pin so frames stay aligned
+        if(s->next != ADC_STREAM_RESYNC){
+            s->dropped++;
+        }
+        s->next = ADC_STREAM_RESYNC;
+        if(slot != 0){
+            return;
+        }
+    }
+    s->scan[slot] = word & 0xFFF;
+    if(++slot < s->count){
+        s->next = slot;
+        return;
+    }
+    s->next = 0;
+    for(uint8_t i = 0; i < s->count; i++){
+        __adcStreamAccumulate(s, i, s->scan[i]);
+    }
+    if(++s->rounds < s->config.decimation){
+        return;
+    }
+    s->rounds = 0;
+    uint16_t * frame = s->block + (s->blockLen * s->count);
+    for(uint8_t i = 0; i < s->count; i++){
+        frame[i] = __adcStreamOutput(s, i);
+    }
+    if(++s->blockLen == s->config.block_frames){
+        __adcStreamFlush(s);
+    }
+}
+
+static void __adcStreamTask(void * arg)
+{
+    adc_stream_t * s = (adc_stream_t *)arg;
+    size_t bytes = 0;
+    while(s->running){
+        if(i2s_read(ADC_STREAM_I2S, s->dma, ADC_STREAM_DMA_LEN * sizeof(uint16_t), &bytes, pdMS_TO_TICKS(100)) != ESP_OK){
+            continue;
+        }
+        size_t len = bytes / sizeof(uint16_t);
+        for(size_t i = 0; i + 1 < len; i += 2){
+            __adcStreamSample(s, s->dma[i + 1]);
+            __adcStreamSample(s, s->dma[i]);
+        }
+    }
+    xSemaphoreGive(s->done);
+    vTaskDelete(NULL);
+}
+
+static void __adcStreamFree(adc_stream_t * s)
+{
+    if(s->ring){
+        vRingbufferDelete(s->ring);
+    }
+    if(s->done){
+        vSemaphoreDelete(s->done);
+    }
+    free(s->dma);
+    free(s->block);
+    free(s);
+}
+
+static void __adcStreamRelease()
+{
+    i2s_adc_disable(ADC_STREAM_I2S);
+    i2s_driver_uninstall(ADC_STREAM_I2S);
+    //hand SAR ADC1 back to the RTC controller used by analogRead()
+    CLEAR_PERI_REG_MASK(SENS_SAR_READ_CTRL_REG, SENS_SAR1_DIG_FORCE);
+    __analogInitialized = false;
+    __analogInit();
+}
+
+bool __adcStreamBegin(const uint8_t * pins, uint8_t count, const adc_stream_config_t * config)
+{
+    if(__adcStream){
+        log_e("ADC stream already running");
+        return false;
+    }
+    if(!pins || !count || count > ADC_STREAM_MAX_PINS || !config || !config->sample_rate || !config->block_frames){
+        log_e("invalid ADC stream arguments");
+        return false;
+    }
+
+    int8_t channels[ADC_STREAM_MAX_PINS];
+    uint8_t attens[ADC_STREAM_MAX_PINS];
+    for(uint8_t i = 0; i < count; i++){
+        channels[i] = digitalPinToAnalogChannel(pins[i]);
+        if(channels[i] < 0 || channels[i] > 7){
+            log_e("pin %u is not an ADC1 pin", pins[i]);
+            return false;
+        }
+        __adcAttachPin(pins[i]);
+        attens[i] = (READ_PERI_REG(SENS_SAR_ATTEN1_REG) >> (channels[i] * 2)) & 3;
+    }
+
+    adc_stream_t * s = (adc_stream_t *)calloc(1, sizeof(adc_stream_t));
+    if(!s){
+        return false;
+    }
+    s->config = *config;
+    if(!s->config.decimation){
+        s->config.decimation = 1;
+    }
+    if(s->config.filter == ADC_FILTER_LOWPASS && (!s->config.lowpass_shift || s->config.lowpass_shift > 12)){
+        s->config.lowpass_shift = 4;
+    }
+    s->avgShift = 0xFF;
+    if(!(s->config.decimation & (s->config.decimation - 1))){
+        s->avgShift = __builtin_ctz(s->config.decimation);
+    }
+    s->count = count;
+    memset(s->slot, 0xFF, sizeof(s->slot));
+    for(uint8_t i = 0; i < count; i++){
+        if(s->slot[channels[i]] != 0xFF){
+            log_e("pin %u is listed twice", pins[i]);
+            free(s);
+            return false;
+        }
+        s->slot[channels[i]] = i;
+    }
+
+    s->block = (uint16_t *)malloc(s->config.block_frames * count * sizeof(uint16_t));
+    s->dma = (uint16_t *)malloc(ADC_STREAM_DMA_LEN * sizeof(uint16_t));
+    s->done = xSemaphoreCreateBinary();
+    if(!s->config.callback){
+        size_t frames = s->config.buffer_frames;
+        if(frames < s->config.block_frames * 2){
+            frames = s->config.block_frames * 2;
+        }
+        s->ring = xRingbufferCreate(frames * count * sizeof(uint16_t), RINGBUF_TYPE_BYTEBUF);
+    }
+    if(!s->block || !s->dma || !s->done || (!s->config.callback && !s->ring)){
+        log_e("not enough memory for the ADC stream");
+        __adcStreamFree(s);
+        return false;
+    }
+
+    i2s_config_t i2s_config = {
+        .mode = I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN,
+        .sample_rate = s->config.sample_rate,
+        .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
+        .channel_format = I2S_CHANNEL_FMT_ONLY_RIGHT,
+        .communication_format = I2S_COMM_FORMAT_I2S_MSB,
+        .intr_alloc_flags = 0,
+        .dma_buf_count = ADC_STREAM_DMA_COUNT,
+        .dma_buf_len = ADC_STREAM_DMA_LEN,
+        .use_apll = false,
+        .fixed_mclk = 0
+    };
+    if(i2s_driver_install(ADC_STREAM_I2S, &i2s_config, 0, NULL) != ESP_OK){
+        log_e("I2S driver install failed");
+        __adcStreamFree(s);
+        return false;
+    }
+    if(i2s_set_adc_mode(ADC_UNIT_1, (adc1_channel_t)channels[0]) != ESP_OK || i2s_adc_enable(ADC_STREAM_I2S) != ESP_OK){
+        log_e("I2S ADC mode failed");
+        __adcStreamRelease();
+        __adcStreamFree(s);
+        return false;
+    }
+
+    //the driver programs a single channel pattern, replace it with the scan
+    uint32_t table[4];
+    __adcStreamPattern(channels, attens, count, table);
+    WRITE_PERI_REG(SYSCON_SARADC_SAR1_PATT_TAB1_REG, table[0]);
+    WRITE_PERI_REG(SYSCON_SARADC_SAR1_PATT_TAB2_REG, table[1]);
+    WRITE_PERI_REG(SYSCON_SARADC_SAR1_PATT_TAB3_REG, table[2]);
+    WRITE_PERI_REG(SYSCON_SARADC_SAR1_PATT_TAB4_REG, table[3]);
+    SET_PERI_REG_BITS(SYSCON_SARADC_CTRL_REG, SYSCON_SARADC_SAR1_PATT_LEN, count - 1, SYSCON_SARADC_SAR1_PATT_LEN_S);
+    SET_PERI_REG_MASK(SYSCON_SARADC_CTRL_REG, SYSCON_SARADC_SAR1_PATT_P_CLEAR);
+    CLEAR_PERI_REG_MASK(SYSCON_SARADC_CTRL_REG, SYSCON_SARADC_SAR1_PATT_P_CLEAR);
+    i2s_zero_dma_buffer(ADC_STREAM_I2S);
+
+    s->running = true;
+    uint32_t stack = s->config.task_stack ? s->config.task_stack : ADC_STREAM_TASK_STACK;
+    if(xTaskCreatePinnedToCore(__adcStreamTask, "adc_stream", stack, s, ADC_STREAM_TASK_PRIORITY, &s->task, tskNO_AFFINITY) != pdPASS){
+        log_e("ADC stream task failed");
+        __adcStreamRelease();
+        __adcStreamFree(s);
+        return false;
+    }
+    portENTER_CRITICAL(&__adcStreamMux);
+    __adcStream = s;
+    portEXIT_CRITICAL(&__adcStreamMux);
+    return true;
+}
+
+/*
+ * The stream is unpublished first, so no new reader or overrun query can
+ * reach it, then freed once its task and the readers already in
+ * adcStreamRead() are gone. Readers wait on the ring in slices of
+ * ADC_STREAM_READ_SLICE ms and leave as soon as they see it ended.
+ * */
+void __adcStreamEnd()
+{
+    portENTER_CRITICAL(&__adcStreamMux);
+    adc_stream_t * s = __adcStream;
+    __adcStream = NULL;
+    portEXIT_CRITICAL(&__adcStreamMux);
+    if(!s){
+        return;
+    }
+    s->running = false;
+    xSemaphoreTake(s->done, portMAX_DELAY);
+    __adcStreamRelease();
+
+    portENTER_CRITICAL(&__adcStreamMux);
+    s->ended = true;
+    bool busy = s->readers != 0;
+    portEXIT_CRITICAL(&__adcStreamMux);
+    if(busy){
+        xSemaphoreTake(s->done, portMAX_DELAY);
+    }
+    __adcStreamFree(s);
+}
+
+size_t __adcStreamRead(uint16_t * frames, size_t count, uint32_t timeout_ms)
+{
+    if(!frames || !count){
+        return 0;
+    }
+    portENTER_CRITICAL(&__adcStreamMux);
+    adc_stream_t * s = __adcStream;
+    if(s && s->ring){
+        s->readers++;
+    }
+    portEXIT_CRITICAL(&__adcStreamMux);
+    if(!s || !s->ring){
+        return 0;
+    }
+    size_t frameSize = s->count * sizeof(uint16_t);
+    size_t want = count * frameSize;
+    size_t got = 0;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+    //frames are written whole, so the byte ring only splits them at its wrap point
+    while(got < want && !s->ended){
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        TickType_t ticks = (elapsed < wait) ? (wait - elapsed) : 0;
+        if(ticks > pdMS_TO_TICKS(ADC_STREAM_READ_SLICE)){
+            ticks = pdMS_TO_TICKS(ADC_STREAM_READ_SLICE);
+        }
+        size_t len = 0;
+        uint8_t * data = (uint8_t *)xRingbufferReceiveUpTo(s->ring, &len, ticks, want - got);
+        if(!data){
+            if(elapsed >= wait){
+                break;
+            }
+            continue;
+        }
+        memcpy((uint8_t *)frames + got, data, len);
+        vRingbufferReturnItem(s->ring, data);
+        got += len;
+    }
+
+    portENTER_CRITICAL(&__adcStreamMux);
+    bool last = !--s->readers && s->ended;
+    portEXIT_CRITICAL(&__adcStreamMux);
+    if(last){
+        xSemaphoreGive(s->done);
+    }
+    return got / frameSize;
+}
+
+uint32_t __adcStreamOverruns()
+{
+    portENTER_CRITICAL(&__adcStreamMux);
+    adc_stream_t * s = __adcStream;
+    uint32_t overruns = s ? (s->overruns + s->dropped) : 0;
+    portEXIT_CRITICAL(&__adcStreamMux);
+    return overruns;
+}
+
+/*
+ * Calibrated conversion
+ *
+ * One lookup table per ADC unit and attenuation maps every 12 bit code to
+ * millivolts using the eFuse characterization (two point, eFuse Vref or the
+ * default Vref, whichever the chip has). Tables are built on first use.
+ * */
+
+#define ADC_CAL_DEFAULT_VREF    1100
+#define ADC_CAL_CODES           4096
+
+static uint16_t * __adcCalLut[2][4] = {{NULL}};
+static portMUX_TYPE __adcCalMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const uint16_t * __adcCalTable(uint8_t unit, uint8_t atten)
+{
+    if(__adcCalLut[unit][atten]){
+        return __adcCalLut[unit][atten];
+    }
+    esp_adc_cal_characteristics_t chars;
+    esp_adc_cal_characterize(unit ? ADC_UNIT_2 : ADC_UNIT_1, (adc_atten_t)atten, ADC_WIDTH_BIT_12, ADC_CAL_DEFAULT_VREF, &chars);
+    uint16_t * lut = (uint16_t *)malloc(ADC_CAL_CODES * sizeof(uint16_t));
+    if(!lut){
+        log_e("not enough memory for the ADC calibration table");
+        return NULL;
+    }
+    for(uint32_t code = 0; code < ADC_CAL_CODES; code++){
+        lut[code] = esp_adc_cal_raw_to_voltage(code, &chars);
+    }
+    portENTER_CRITICAL(&__adcCalMux);
+    if(__adcCalLut[unit][atten]){
+        //built by another task in the meantime
+        portEXIT_CRITICAL(&__adcCalMux);
+        free(lut);
+        return __adcCalLut[unit][atten];
+    }
+    __adcCalLut[unit][atten] = lut;
+    portEXIT_CRITICAL(&__adcCalMux);
+    return lut;
+}
+
+static const uint16_t * __adcCalPinTable(uint8_t pin)
+{
+    int8_t channel = digitalPinToAnalogChannel(pin);
+    if(channel < 0){
+        return NULL;
+    }
+    __analogInit();
+    if(channel > 9){
+        return __adcCalTable(1, (READ_PERI_REG(SENS_SAR_ATTEN2_REG) >> ((channel - 10) * 2)) & 3);
+    }
+    return __adcCalTable(0, (READ_PERI_REG(SENS_SAR_ATTEN1_REG) >> (channel * 2)) & 3);
+}
+
+bool __adcCalInit(adc_cal_pipeline_t * cal, const uint8_t * pins, uint8_t count, uint16_t oversample)
+{
+    if(!cal || !pins || !count || count > ADC_STREAM_MAX_PINS){
+        log_e("invalid ADC calibration arguments");
+        return false;
+    }
+    memset(cal, 0, sizeof(adc_cal_pipeline_t));
+    for(uint8_t i = 0; i < count; i++){
+        cal->lut[i] = __adcCalPinTable(pins[i]);
+        if(!cal->lut[i]){
+            log_e("no calibration for pin %u", pins[i]);
+            return false;
+        }
+    }
+    cal->count = count;
+    //largest power of two not above oversample, 256 at most so sums stay in 32 bits
+    while(oversample > 1 && cal->oversample_shift < 8){
+        oversample >>= 1;
+        cal->oversample_shift++;
+    }
+    return true;
+}
+
+static void __adcCalConvertOne(const uint16_t * __restrict lut, uint8_t shift, const uint16_t * __restrict in, size_t out, uint16_t * __restrict mv)
+{
+    const uint32_t n = 1 << shift;
+    for(size_t o = 0; o < out; o++){
+        uint32_t acc = n >> 1;
+        for(uint32_t k = 0; k < n; k++){
+            acc += lut[in[k] & 0xFFF];
+        }
+        mv[o] = acc >> shift;
+        in += n;
+    }
+}
+
+size_t __adcCalConvert(const adc_cal_pipeline_t * cal, const uint16_t * frames, size_t count, uint16_t * millivolts)
+{
+    if(!cal || !cal->count || !frames || !millivolts){
+        return 0;
+    }
+    const uint8_t shift = cal->oversample_shift;
+    const uint32_t n = 1 << shift;
+    const uint8_t width = cal->count;
+    size_t out = count >> shift;
+
+    if(width == 1){
+        __adcCalConvertOne(cal->lut[0], shift, frames, out, millivolts);
+        return out;
+    }
+
+    const uint16_t * lut[ADC_STREAM_MAX_PINS];
+    memcpy(lut, cal->lut, sizeof(lut));
+    for(size_t o = 0; o < out; o++){
+        uint32_t acc[ADC_STREAM_MAX_PINS];
+        for(uint8_t c = 0; c < width; c++){
+            acc[c] = n >> 1;
+        }
+        for(uint32_t k = 0; k < n; k++){
+            const uint16_t * f = frames + (k * width);
+            for(uint8_t c = 0; c < width; c++){
+                acc[c] += lut[c][f[c] & 0xFFF];
+            }
+        }
+        for(uint8_t c = 0; c < width; c++){
+            millivolts[c] = acc[c] >> shift;
+        }
+        frames += n * width;
+        millivolts += width;
+    }
+    return out;
+}
+
+uint32_t __analogReadMilliVolts(uint8_t pin)
+{
+    const uint16_t * lut = __adcCalPinTable(pin);
+    if(!lut){
+        return 0;
+    }
+    uint32_t value = __analogRead(pin);
+    //back to the 12 bit scale the table is indexed by
+    if(__analogReturnedWidth > 12){
+        value >>= (__analogReturnedWidth - 12);
+    } else if(__analogReturnedWidth < 12){
+        value <<= (12 - __analogReturnedWidth);
+    }
+    return lut[value & 0xFFF];
+}
+
 extern uint16_t analogRead(uint8_t pin) __attribute__ ((weak, alias("__analogRead")));
 extern void analogReadResolution(uint8_t bits) __attribute__ ((weak, alias("__analogReadResolution")));
 extern void analogSetWidth(uint8_t bits) __attribute__ ((weak, alias("__analogSetWidth")));
@@ -271,3 +797,12 @@ extern bool adcAttachPin(uint8_t pin) __attribute__ ((weak, alias("__adcAttachPi
 extern bool adcStart(uint8_t pin) __attribute__ ((weak, alias("__adcStart")));
 extern bool adcBusy(uint8_t pin) __attribute__ ((weak, alias("__adcBusy")));
 extern uint16_t adcEnd(uint8_t pin) __attribute__ ((weak, alias("__adcEnd")));
+
+extern bool adcStreamBegin(const uint8_t * pins, uint8_t count, const adc_stream_config_t * config) __attribute__ ((weak, alias("__adcStreamBegin")));
+extern size_t adcStreamRead(uint16_t * frames, size_t count, uint32_t timeout_ms) __attribute__ ((weak, alias("__adcStreamRead")));
+extern void adcStreamEnd() __attribute__ ((weak, alias("__adcStreamEnd")));
+extern uint32_t adcStreamOverruns() __attribute__ ((weak, alias("__adcStreamOverruns")));
+
+extern bool adcCalInit(adc_cal_pipeline_t * cal, const uint8_t * pins, uint8_t count, uint16_t oversample) __attribute__ ((weak, alias("__adcCalInit")));
+extern size_t adcCalConvert(const adc_cal_pipeline_t * cal, const uint16_t * frames, size_t count, uint16_t * millivolts) __attribute__ ((weak, alias("__adcCalConvert")));
+extern uint32_t analogReadMilliVolts(uint8_t pin) __attribute__ ((weak, alias("__analogReadMilliVolts")));
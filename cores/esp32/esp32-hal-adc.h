@@ -25,6 +25,7 @@ extern "C" {
 #endif
 
 #include "esp32-hal.h"
+#include "esp_task.h"
 
 typedef enum {
     ADC_0db,
@@ -126,6 +127,114 @@ bool adcBusy(uint8_t pin);
  * */
 uint16_t adcEnd(uint8_t pin);
 
+/*
+ * Continuous sampling API
+ *
+ * Scans up to 8 ADC1 pins at a fixed, hardware paced rate using I2S0 and DMA.
+ * Results are 12 bit codes grouped in frames of one value per pin, in the
+ * order the pins were given. Blocks of frames go to the callback, or when no
+ * callback is set, to a ring buffer that is drained with adcStreamRead().
+ *
+ * Note: while the stream runs, ADC1 is owned by the digital controller, so
+ *       analogRead() must not be used on ADC1 pins and I2S0 is not available.
+ *       Attenuation is taken from analogSetPinAttenuation() when starting.
+ * */
+
+#define ADC_STREAM_MAX_PINS         8
+//below lwIP and WiFi, the DMA buffers cover ADC_STREAM_DMA_COUNT * 512 conversions of latency
+#ifndef ADC_STREAM_TASK_PRIORITY
+#define ADC_STREAM_TASK_PRIORITY    (ESP_TASK_TCPIP_PRIO - 1)
+#endif
+#ifndef ADC_STREAM_TASK_STACK
+#define ADC_STREAM_TASK_STACK       4096
+#endif
+
+typedef enum {
+    ADC_FILTER_NONE,        //keep every decimation-th frame
+    ADC_FILTER_AVERAGE,     //average decimation frames into one
+    ADC_FILTER_LOWPASS      //first order IIR, y += (x - y) >> lowpass_shift, then decimate
+} adc_filter_t;
+
+typedef void (*adc_stream_cb_t)(const uint16_t * frames, size_t count, void * arg);
+
+typedef struct {
+    uint32_t sample_rate;       //conversions per second, shared by all pins
+    adc_filter_t filter;
+    uint16_t decimation;        //scans per output frame, 1 keeps the full rate
+    uint8_t lowpass_shift;      //1 - 12, for ADC_FILTER_LOWPASS
+    size_t block_frames;        //frames per callback or ring write
+    size_t buffer_frames;       //ring size when there is no callback
+    adc_stream_cb_t callback;   //runs in the stream task
+    void * arg;
+    uint32_t task_stack;        //stack of the stream task, which runs the callback, 0 for ADC_STREAM_TASK_STACK
+} adc_stream_config_t;
+
+#define ADC_STREAM_CONFIG_DEFAULT() { \
+    .sample_rate = 40000, \
+    .filter = ADC_FILTER_NONE, \
+    .decimation = 1, \
+    .lowpass_shift = 4, \
+    .block_frames = 64, \
+    .buffer_frames = 1024, \
+    .callback = NULL, \
+    .arg = NULL, \
+    .task_stack = ADC_STREAM_TASK_STACK \
+}
+
+/*
+ * Start sampling the pins
+ * */
+bool adcStreamBegin(const uint8_t * pins, uint8_t count, const adc_stream_config_t * config);
+
+/*
+ * Copy up to count frames (count * pins values) from the ring buffer,
+ * waiting up to timeout_ms for them. Returns the number of frames read
+ * */
+size_t adcStreamRead(uint16_t * frames, size_t count, uint32_t timeout_ms);
+
+/*
+ * Stop sampling and return ADC1 to analogRead(). Readers waiting in
+ * adcStreamRead() on other tasks return what they have got so far
+ * */
+void adcStreamEnd();
+
+/*
+ * Number of blocks lost to a full ring buffer plus scans dropped after a lost conversion
+ * */
+uint32_t adcStreamOverruns();
+
+/*
+ * Calibrated conversion
+ *
+ * Converts 12 bit codes to millivolts through per chip calibration tables
+ * (8 KB for each ADC unit and attenuation in use, built once on first use).
+ * Attenuation is taken from analogSetPinAttenuation() at init time.
+ * */
+
+typedef struct {
+    uint8_t count;              //values per frame
+    uint8_t oversample_shift;   //log2 of the frames averaged into one output
+    const uint16_t * lut[ADC_STREAM_MAX_PINS];
+} adc_cal_pipeline_t;
+
+/*
+ * Get calibrated value for pin in millivolts
+ * */
+uint32_t analogReadMilliVolts(uint8_t pin);
+
+/*
+ * Prepare the conversion of frames laid out like the adcStream API delivers
+ * them, one value per pin. oversample is rounded down to a power of two
+ * Range is 1 - 256
+ * */
+bool adcCalInit(adc_cal_pipeline_t * cal, const uint8_t * pins, uint8_t count, uint16_t oversample);
+
+/*
+ * Convert count frames to millivolts, averaging every oversample frames
+ * into one. Returns the number of frames written (count / oversample)
+ * */
+size_t adcCalConvert(const adc_cal_pipeline_t * cal, const uint16_t * frames, size_t count, uint16_t * millivolts);
+
 #ifdef __cplusplus
 }
 #endif
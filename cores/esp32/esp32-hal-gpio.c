@@ -15,6 +15,7 @@
 #include "esp32-hal-gpio.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "rom/ets_sys.h"
 #include "esp_attr.h"
 #include "esp_intr.h"
@@ -72,10 +73,14 @@ const DRAM_ATTR esp32_gpioMux_t esp32_gpioMux[GPIO_PIN_COUNT]={
 typedef void (*voidFuncPtr)(void);
 typedef void (*voidFuncPtrArg)(void*);
 typedef struct {
-    voidFuncPtr fn;
+    voidFuncPtrArg fn;
     void* arg;
 } InterruptHandle_t;
 static InterruptHandle_t __pinInterruptHandlers[GPIO_PIN_COUNT] = {0,};
+static InterruptHandle_t __pinDeferredHandlers[GPIO_PIN_COUNT] = {0,};
+static gpio_isr_stats_t __pinInterruptStats[GPIO_PIN_COUNT] = {0,};
+static xQueueHandle __pinEventQueue = NULL;
+static TaskHandle_t __pinEventTask = NULL;
 
 #include "driver/rtc_io.h"
 
@@ -196,10 +201,216 @@ extern int IRAM_ATTR __digitalRead(uint8_t pin)
     return 0;
 }
 
+bool gpioBusInit(gpio_bus_t * bus, const uint8_t * pins, uint8_t count)
+{
+    if(!bus || !pins || !count || count > GPIO_BUS_MAX_PINS) {
+        return false;
+    }
+    //runs[] past run_count are never read, so a small bus stays cheap to set up
+    bus->mask[0] = 0;
+    bus->mask[1] = 0;
+    bus->run_count = 0;
+    bus->lut = NULL;
+    gpio_bus_run_t * run = NULL;
+    for(uint8_t i = 0; i < count; i++) {
+        uint8_t pin = pins[i];
+        if(!digitalPinIsValid(pin)) {
+            log_e("Invalid bus pin %u", pin);
+            return false;
+        }
+        uint8_t bank = pin >> 5;
+        uint8_t bit = pin & 0x1F;
+        if(bus->mask[bank] & ((uint32_t)1 << bit)) {
+            log_e("Duplicate bus pin %u", pin);
+            return false;
+        }
+        bus->mask[bank] |= ((uint32_t)1 << bit);
+        //extend the current run while pins keep ascending by one
+        if(run && run->bank == bank && (run->src + (i - run->dst)) == bit) {
+            run->mask = (run->mask << 1) | 1;
+        } else {
+            run = &bus->runs[bus->run_count++];
+            run->bank = bank;
+            run->src = bit;
+            run->dst = i;
+            run->mask = 1;
+        }
+    }
+    bus->width = count;
+    return true;
+}
+
+void gpioBusEnd(gpio_bus_t * bus)
+{
+    if(bus && bus->lut) {
+        free(bus->lut);
+        bus->lut = NULL;
+    }
+}
+
+void gpioBusMode(gpio_bus_t * bus, uint8_t mode)
+{
+    for(uint8_t r = 0; r < bus->run_count; r++) {
+        const gpio_bus_run_t * run = &bus->runs[r];
+        for(uint8_t b = 0; b < 32 && (run->mask >> b); b++) {
+            pinMode((run->bank << 5) + run->src + b, mode);
+        }
+    }
+}
+
+static inline void IRAM_ATTR __gpioBusExpand(const gpio_bus_t * bus, uint32_t value, uint32_t * set)
+{
+    set[0] = 0;
+    set[1] = 0;
+    if(bus->lut) {
+        for(uint8_t byte = 0; byte < ((bus->width + 7) >> 3); byte++) {
+            const uint32_t * masks = bus->lut[(byte << 8) | ((value >> (byte << 3)) & 0xFF)];
+            set[0] |= masks[0];
+            set[1] |= masks[1];
+        }
+        return;
+    }
+    for(uint8_t r = 0; r < bus->run_count; r++) {
+        const gpio_bus_run_t * run = &bus->runs[r];
+        set[run->bank] |= ((value >> run->dst) & run->mask) << run->src;
+    }
+}
+
+bool gpioBusEnableLUT(gpio_bus_t * bus)
+{
+    if(bus->lut) {
+        return true;
+    }
+    size_t tables = (bus->width + 7) >> 3;
+    uint32_t (*lut)[2] = (uint32_t (*)[2])malloc(tables * 256 * sizeof(uint32_t[2]));
+    if(!lut) {
+        log_e("No memory for bus LUT");
+        return false;
+    }
+    for(size_t byte = 0; byte < tables; byte++) {
+        for(uint32_t v = 0; v < 256; v++) {
+            __gpioBusExpand(bus, v << (byte << 3), lut[(byte << 8) | v]);
+        }
+    }
+    bus->lut = lut;
+    return true;
+}
+
+void IRAM_ATTR gpioBusWrite(const gpio_bus_t * bus, uint32_t value)
+{
+    uint32_t set[2];
+    __gpioBusExpand(bus, value, set);
+    if(bus->mask[0]) {
+        GPIO.out_w1tc = bus->mask[0] & ~set[0];
+        GPIO.out_w1ts = set[0];
+    }
+    if(bus->mask[1]) {
+        GPIO.out1_w1tc.val = bus->mask[1] & ~set[1];
+        GPIO.out1_w1ts.val = set[1];
+    }
+}
+
+void IRAM_ATTR gpioBusWriteMasked(const gpio_bus_t * bus, uint32_t value, uint32_t mask)
+{
+    uint32_t set[2], sel[2];
+    __gpioBusExpand(bus, value & mask, set);
+    __gpioBusExpand(bus, mask, sel);
+    if(sel[0]) {
+        GPIO.out_w1tc = sel[0] & ~set[0];
+        GPIO.out_w1ts = set[0];
+    }
+    if(sel[1]) {
+        GPIO.out1_w1tc.val = sel[1] & ~set[1];
+        GPIO.out1_w1ts.val = set[1];
+    }
+}
+
+void IRAM_ATTR gpioBusSet(const gpio_bus_t * bus, uint32_t bits)
+{
+    uint32_t set[2];
+    __gpioBusExpand(bus, bits, set);
+    if(set[0]) {
+        GPIO.out_w1ts = set[0];
+    }
+    if(set[1]) {
+        GPIO.out1_w1ts.val = set[1];
+    }
+}
+
+void IRAM_ATTR gpioBusClear(const gpio_bus_t * bus, uint32_t bits)
+{
+    uint32_t clr[2];
+    __gpioBusExpand(bus, bits, clr);
+    if(clr[0]) {
+        GPIO.out_w1tc = clr[0];
+    }
+    if(clr[1]) {
+        GPIO.out1_w1tc.val = clr[1];
+    }
+}
+
+uint32_t IRAM_ATTR gpioBusRead(const gpio_bus_t * bus)
+{
+    uint32_t in[2] = {0, 0};
+    uint32_t value = 0;
+    if(bus->mask[0]) {
+        in[0] = GPIO.in;
+    }
+    if(bus->mask[1]) {
+        in[1] = GPIO.in1.val;
+    }
+    for(uint8_t r = 0; r < bus->run_count; r++) {
+        const gpio_bus_run_t * run = &bus->runs[r];
+        value |= ((in[run->bank] >> run->src) & run->mask) << run->dst;
+    }
+    return value;
+}
+
 static intr_handle_t gpio_intr_handle = NULL;
 
+//plain attachInterrupt handlers are stored with this thunk so every pin is called the same way
+static void IRAM_ATTR __onPinInterruptNoArg(void * arg)
+{
+    ((voidFuncPtr)arg)();
+}
+
+//deferred pins only queue the event, the handler runs in __pinEventTaskFn
+static void IRAM_ATTR __onPinInterruptDeferred(void * arg)
+{
+    uint8_t pin = (uint8_t)(uint32_t)arg;
+    BaseType_t woken = pdFALSE;
+    if(xQueueSendFromISR(__pinEventQueue, &pin, &woken) != pdTRUE) {
+        __pinInterruptStats[pin].dropped++;
+    }
+    if(woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+static inline void IRAM_ATTR __dispatchPin(uint8_t pin, uint32_t entry)
+{
+    const InterruptHandle_t * handler = &__pinInterruptHandlers[pin];
+    if(!handler->fn) {
+        return;
+    }
+    gpio_isr_stats_t * stats = &__pinInterruptStats[pin];
+    uint32_t start = xthal_get_ccount();
+    handler->fn(handler->arg);
+    uint32_t cycles = xthal_get_ccount() - start;
+    uint32_t latency = start - entry;
+    stats->count++;
+    stats->cycles_total += cycles;
+    if(cycles > stats->cycles_max) {
+        stats->cycles_max = cycles;
+    }
+    if(latency > stats->latency_max) {
+        stats->latency_max = latency;
+    }
+}
+
 static void IRAM_ATTR __onPinInterrupt()
 {
+    uint32_t entry = xthal_get_ccount();
     uint32_t gpio_intr_status_l=0;
     uint32_t gpio_intr_status_h=0;
 
@@ -208,37 +419,34 @@ static void IRAM_ATTR __onPinInterrupt()
     GPIO.status_w1tc = gpio_intr_status_l;//Clear intr for gpio0-gpio31
     GPIO.status1_w1tc.val = gpio_intr_status_h;//Clear intr for gpio32-39
 
-    uint8_t pin=0;
-    if(gpio_intr_status_l) {
-        do {
-            if(gpio_intr_status_l & ((uint32_t)1 << pin)) {
-                if(__pinInterruptHandlers[pin].fn) {
-                    if(__pinInterruptHandlers[pin].arg){
-                        ((voidFuncPtrArg)__pinInterruptHandlers[pin].fn)(__pinInterruptHandlers[pin].arg);
-                    } else {
-                        __pinInterruptHandlers[pin].fn();
-                    }
-                }
-            }
-        } while(++pin<32);
-    }
-    if(gpio_intr_status_h) {
-        pin=32;
-        do {
-            if(gpio_intr_status_h & ((uint32_t)1 << (pin - 32))) {
-                if(__pinInterruptHandlers[pin].fn) {
-                    if(__pinInterruptHandlers[pin].arg){
-                        ((voidFuncPtrArg)__pinInterruptHandlers[pin].fn)(__pinInterruptHandlers[pin].arg);
-                    } else {
-                        __pinInterruptHandlers[pin].fn();
-                    }
-                }
-            }
-        } while(++pin<GPIO_PIN_COUNT);
+    //visit only the pins that fired, lowest first
+    while(gpio_intr_status_l) {
+        uint8_t pin = __builtin_ctz(gpio_intr_status_l);
+        gpio_intr_status_l &= gpio_intr_status_l - 1;
+        __dispatchPin(pin, entry);
+    }
+    while(gpio_intr_status_h) {
+        uint8_t pin = 32 + __builtin_ctz(gpio_intr_status_h);
+        gpio_intr_status_h &= gpio_intr_status_h - 1;
+        __dispatchPin(pin, entry);
     }
 }
 
-extern void __attachInterruptArg(uint8_t pin, voidFuncPtrArg userFunc, void * arg, int intr_type)
+static void __pinEventTaskFn(void * arg)
+{
+    uint8_t pin;
+    for(;;) {
+        if(xQueueReceive(__pinEventQueue, &pin, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        const InterruptHandle_t * handler = &__pinDeferredHandlers[pin];
+        if(handler->fn) {
+            handler->fn(handler->arg);
+        }
+    }
+}
+
+static void __attachInterruptHandler(uint8_t pin, voidFuncPtrArg fn, void * arg, int intr_type)
 {
     static bool interrupt_initialized = false;
     
@@ -246,9 +454,9 @@ extern void __attachInterruptArg(uint8_t pin, voidFuncPtrArg userFunc, void * ar
         interrupt_initialized = true;
         esp_intr_alloc(ETS_GPIO_INTR_SOURCE, (int)ESP_INTR_FLAG_IRAM, __onPinInterrupt, NULL, &gpio_intr_handle);
     }
-    __pinInterruptHandlers[pin].fn = (voidFuncPtr)userFunc;
-    __pinInterruptHandlers[pin].arg = arg;
     esp_intr_disable(gpio_intr_handle);
+    __pinInterruptHandlers[pin].fn = fn;
+    __pinInterruptHandlers[pin].arg = arg;
     if(esp_intr_get_cpu(gpio_intr_handle)) { //APP_CPU
         GPIO.pin[pin].int_ena = 1;
     } else { //PRO_CPU
@@ -258,8 +466,36 @@ extern void __attachInterruptArg(uint8_t pin, voidFuncPtrArg userFunc, void * ar
     esp_intr_enable(gpio_intr_handle);
 }
 
+extern void __attachInterruptArg(uint8_t pin, voidFuncPtrArg userFunc, void * arg, int intr_type)
+{
+    __pinDeferredHandlers[pin].fn = NULL;
+    __attachInterruptHandler(pin, userFunc, arg, intr_type);
+}
+
 extern void __attachInterrupt(uint8_t pin, voidFuncPtr userFunc, int intr_type) {
-    __attachInterruptArg(pin, (voidFuncPtrArg)userFunc, NULL, intr_type);
+    __pinDeferredHandlers[pin].fn = NULL;
+    __attachInterruptHandler(pin, __onPinInterruptNoArg, (void *)userFunc, intr_type);
+}
+
+extern void __attachInterruptDeferred(uint8_t pin, voidFuncPtrArg userFunc, void * arg, int intr_type)
+{
+    if(!__pinEventQueue) {
+        __pinEventQueue = xQueueCreate(GPIO_EVENT_QUEUE_SIZE, sizeof(uint8_t));
+        if(!__pinEventQueue) {
+            log_e("GPIO event queue creation failed");
+            return;
+        }
+        xTaskCreate(__pinEventTaskFn, "gpio_event", 2048, NULL, GPIO_EVENT_TASK_PRIORITY, &__pinEventTask);
+        if(!__pinEventTask) {
+            log_e("GPIO event task creation failed");
+            vQueueDelete(__pinEventQueue);
+            __pinEventQueue = NULL;
+            return;
+        }
+    }
+    __pinDeferredHandlers[pin].fn = userFunc;
+    __pinDeferredHandlers[pin].arg = arg;
+    __attachInterruptHandler(pin, __onPinInterruptDeferred, (void *)(uint32_t)pin, intr_type);
 }
 
 extern void __detachInterrupt(uint8_t pin)
@@ -267,16 +503,35 @@ extern void __detachInterrupt(uint8_t pin)
     esp_intr_disable(gpio_intr_handle);
     __pinInterruptHandlers[pin].fn = NULL;
     __pinInterruptHandlers[pin].arg = NULL;
+    __pinDeferredHandlers[pin].fn = NULL;
+    __pinDeferredHandlers[pin].arg = NULL;
     GPIO.pin[pin].int_ena = 0;
     GPIO.pin[pin].int_type = 0;
     esp_intr_enable(gpio_intr_handle);
 }
 
+bool gpioGetInterruptStats(uint8_t pin, gpio_isr_stats_t * stats)
+{
+    if(pin >= GPIO_PIN_COUNT || !stats) {
+        return false;
+    }
+    *stats = __pinInterruptStats[pin];
+    return true;
+}
+
+void gpioResetInterruptStats(uint8_t pin)
+{
+    if(pin < GPIO_PIN_COUNT) {
+        memset(&__pinInterruptStats[pin], 0, sizeof(gpio_isr_stats_t));
+    }
+}
+
 
 extern void pinMode(uint8_t pin, uint8_t mode) __attribute__ ((weak, alias("__pinMode")));
 extern void digitalWrite(uint8_t pin, uint8_t val) __attribute__ ((weak, alias("__digitalWrite")));
 extern int digitalRead(uint8_t pin) __attribute__ ((weak, alias("__digitalRead")));
 extern void attachInterrupt(uint8_t pin, voidFuncPtr handler, int mode) __attribute__ ((weak, alias("__attachInterrupt")));
 extern void attachInterruptArg(uint8_t pin, voidFuncPtr handler, void * arg, int mode) __attribute__ ((weak, alias("__attachInterruptArg")));
+extern void attachInterruptDeferred(uint8_t pin, voidFuncPtrArg handler, void * arg, int mode) __attribute__ ((weak, alias("__attachInterruptDeferred")));
 extern void detachInterrupt(uint8_t pin) __attribute__ ((weak, alias("__detachInterrupt")));
 
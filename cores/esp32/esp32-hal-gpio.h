@@ -78,10 +78,67 @@ void pinMode(uint8_t pin, uint8_t mode);
 void digitalWrite(uint8_t pin, uint8_t val);
 int digitalRead(uint8_t pin);
 
+/*
+ * GPIO bus: a group of up to 32 pins written and read as one value.
+ * pins[0] maps to bit 0 of the value. Set/clear masks and the bit-gather
+ * for reads are precomputed by gpioBusInit, so a write costs two register
+ * stores per GPIO bank and a read one load per bank.
+ * */
+#define GPIO_BUS_MAX_PINS 32
+
+typedef struct {
+    uint32_t mask;      /*!< run mask, right aligned */
+    uint8_t bank;       /*!< 0: GPIO0-31, 1: GPIO32-39 */
+    uint8_t src;        /*!< first bit of the run inside the bank register */
+    uint8_t dst;        /*!< first bit of the run inside the bus value */
+} gpio_bus_run_t;
+
+typedef struct {
+    uint32_t mask[2];   /*!< pins of the bus in each bank */
+    uint8_t width;
+    uint8_t run_count;
+    gpio_bus_run_t runs[GPIO_BUS_MAX_PINS];
+    uint32_t (*lut)[2]; /*!< optional byte to set mask tables, 256 entries per value byte */
+} gpio_bus_t;
+
+bool gpioBusInit(gpio_bus_t * bus, const uint8_t * pins, uint8_t count);
+void gpioBusEnd(gpio_bus_t * bus);
+void gpioBusMode(gpio_bus_t * bus, uint8_t mode);
+bool gpioBusEnableLUT(gpio_bus_t * bus);
+void gpioBusWrite(const gpio_bus_t * bus, uint32_t value);
+void gpioBusWriteMasked(const gpio_bus_t * bus, uint32_t value, uint32_t mask);
+void gpioBusSet(const gpio_bus_t * bus, uint32_t bits);
+void gpioBusClear(const gpio_bus_t * bus, uint32_t bits);
+uint32_t gpioBusRead(const gpio_bus_t * bus);
+
 void attachInterrupt(uint8_t pin, void (*)(void), int mode);
 void attachInterruptArg(uint8_t pin, void (*)(void), void * arg, int mode);
 void detachInterrupt(uint8_t pin);
 
+/*
+ * Deferred interrupts: the ISR only queues the pin number and the handler
+ * is called from the "gpio_event" task, so it may block or take locks.
+ * */
+#ifndef GPIO_EVENT_QUEUE_SIZE
+#define GPIO_EVENT_QUEUE_SIZE 32
+#endif
+#ifndef GPIO_EVENT_TASK_PRIORITY
+#define GPIO_EVENT_TASK_PRIORITY (configMAX_PRIORITIES - 2)
+#endif
+
+void attachInterruptDeferred(uint8_t pin, void (*)(void*), void * arg, int mode);
+
+typedef struct {
+    uint32_t count;         /*!< handler invocations */
+    uint32_t dropped;       /*!< deferred events lost to a full queue */
+    uint32_t latency_max;   /*!< cycles from ISR entry to handler call */
+    uint32_t cycles_max;    /*!< longest handler run in cycles */
+    uint32_t cycles_total;  /*!< cycles spent in the handler */
+} gpio_isr_stats_t;
+
+bool gpioGetInterruptStats(uint8_t pin, gpio_isr_stats_t * stats);
+void gpioResetInterruptStats(uint8_t pin);
+
 #ifdef __cplusplus
 }
 #endif
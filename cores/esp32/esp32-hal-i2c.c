@@ -156,6 +156,15 @@ struct i2c_struct_t {
     uint16_t queuePos;
     uint16_t byteCnt;
     uint32_t exitCode;
+    uint16_t queueSize;    // allocated dq elements, kept between transactions
+    uint32_t setupCycles;  // CPU cycles from i2cProcQueue() entry to trans_start
+};
+
+// prebuilt dq for i2cTransactionRun(), at most write + 10bit dummy write + read
+#define I2C_TRANSACTION_MAX_DQ 3
+struct i2c_transaction_s {
+    I2C_DATA_QUEUE_t dq[I2C_TRANSACTION_MAX_DQ];
+    uint16_t count;
 };
 
 enum {
@@ -171,16 +180,16 @@ enum {
 #define I2C_MUTEX_UNLOCK()
 
 static i2c_t _i2c_bus_array[2] = {
-    {(volatile i2c_dev_t *)(DR_REG_I2C_EXT_BASE_FIXED), 0, -1, -1,I2C_NONE,I2C_NONE,I2C_ERROR_OK,NULL,NULL,NULL,0,0,0,0},
-    {(volatile i2c_dev_t *)(DR_REG_I2C1_EXT_BASE_FIXED), 1, -1, -1,I2C_NONE,I2C_NONE,I2C_ERROR_OK,NULL,NULL,NULL,0,0,0,0}
+    {(volatile i2c_dev_t *)(DR_REG_I2C_EXT_BASE_FIXED), 0, -1, -1,I2C_NONE,I2C_NONE,I2C_ERROR_OK,NULL,NULL,NULL,0,0,0,0,0,0},
+    {(volatile i2c_dev_t *)(DR_REG_I2C1_EXT_BASE_FIXED), 1, -1, -1,I2C_NONE,I2C_NONE,I2C_ERROR_OK,NULL,NULL,NULL,0,0,0,0,0,0}
 };
 #else
 #define I2C_MUTEX_LOCK()    do {} while (xSemaphoreTake(i2c->lock, portMAX_DELAY) != pdPASS)
 #define I2C_MUTEX_UNLOCK()  xSemaphoreGive(i2c->lock)
 
 static i2c_t _i2c_bus_array[2] = {
-    {(volatile i2c_dev_t *)(DR_REG_I2C_EXT_BASE_FIXED), NULL, 0, -1, -1, I2C_NONE,I2C_NONE,I2C_ERROR_OK,NULL,NULL,NULL,0,0,0,0},
-    {(volatile i2c_dev_t *)(DR_REG_I2C1_EXT_BASE_FIXED), NULL, 1, -1, -1,I2C_NONE,I2C_NONE,I2C_ERROR_OK,NULL,NULL,NULL,0,0,0,0}
+    {(volatile i2c_dev_t *)(DR_REG_I2C_EXT_BASE_FIXED), NULL, 0, -1, -1, I2C_NONE,I2C_NONE,I2C_ERROR_OK,NULL,NULL,NULL,0,0,0,0,0,0},
+    {(volatile i2c_dev_t *)(DR_REG_I2C1_EXT_BASE_FIXED), NULL, 1, -1, -1,I2C_NONE,I2C_NONE,I2C_ERROR_OK,NULL,NULL,NULL,0,0,0,0,0,0}
 };
 #endif
 
@@ -726,6 +735,46 @@ static void IRAM_ATTR i2c_isr_handler_default(void* arg)
 /* Stickbreaker added for ISR 11/2017
 functional with Silicon date=0x16042000
  */
+static void i2cInitQueueEntry(I2C_DATA_QUEUE_t *dqx, uint8_t mode, uint16_t i2cDeviceAddr, uint8_t *dataPtr, uint16_t dataLen, bool sendStop, EventGroupHandle_t event)
+{
+    dqx->data = dataPtr;
+    dqx->length = dataLen;
+    dqx->position = 0;
+    dqx->cmdBytesNeeded = dataLen;
+    dqx->ctrl.val = 0;
+    dqx->ctrl.mode = mode;
+    dqx->ctrl.stop= sendStop;
+    dqx->ctrl.addrReq = ((i2cDeviceAddr&0xFC00)==0x7800)?2:1; // 10bit or 7bit address
+    // convert address field to required I2C format once, so the dq can be replayed
+    if(dqx->ctrl.addrReq == 2) { // 10bit address
+        dqx->ctrl.addr = ((((i2cDeviceAddr >> 7) & 0xFE) | mode) << 8) | (i2cDeviceAddr & 0xFF);
+    } else { // 7bit address
+        dqx->ctrl.addr = ((i2cDeviceAddr << 1) & 0xFE) | mode;
+    }
+    dqx->queueLength = dataLen + dqx->ctrl.addrReq;
+    dqx->queueEvent = event;
+}
+
+/* build a complete write and/or read sequence into dq[], returns the number of
+ * elements used (0 on bad arguments). The read follows the write with a ReSTART,
+ * a 10bit read without write gets the dummy 0 byte write i2cAddQueueRead() uses.
+ */
+static uint16_t i2cBuildWriteRead(I2C_DATA_QUEUE_t *dq, uint16_t address, uint8_t *txBuff, uint16_t txSize, uint8_t *rxBuff, uint16_t rxSize)
+{
+    uint16_t count = 0;
+    bool tenBit = (address & 0xFC00) == 0x7800;
+    if(!txSize && !rxSize) {
+        return 0;
+    }
+    if(txSize || (rxSize && tenBit)) {
+        i2cInitQueueEntry(&dq[count++], 0, address, txBuff, txSize, !rxSize, NULL);
+    }
+    if(rxSize) {
+        i2cInitQueueEntry(&dq[count++], 1, tenBit?(address >> 8):address, rxBuff, rxSize, true, NULL);
+    }
+    return count;
+}
+
 static i2c_err_t i2cAddQueue(i2c_t * i2c,uint8_t mode, uint16_t i2cDeviceAddr, uint8_t *dataPtr, uint16_t dataLen,bool sendStop, EventGroupHandle_t event)
 {
     // need to grab a MUTEX for exclusive Queue,
@@ -735,44 +784,21 @@ static i2c_err_t i2cAddQueue(i2c_t * i2c,uint8_t mode, uint16_t i2cDeviceAddr, u
         return I2C_ERROR_DEV;
     }
 
-    I2C_DATA_QUEUE_t dqx;
-    dqx.data = dataPtr;
-    dqx.length = dataLen;
-    dqx.position = 0;
-    dqx.cmdBytesNeeded = dataLen;
-    dqx.ctrl.val = 0;
-    dqx.ctrl.addr = i2cDeviceAddr;
-    dqx.ctrl.mode = mode;
-    dqx.ctrl.stop= sendStop;
-    dqx.ctrl.addrReq = ((i2cDeviceAddr&0xFC00)==0x7800)?2:1; // 10bit or 7bit address
-    dqx.queueLength = dataLen + dqx.ctrl.addrReq;
-    dqx.queueEvent = event;
-
     if(event) { // an eventGroup exist, so, initialize it
         xEventGroupClearBits(event, EVENT_MASK); // all of them
     }
 
-    if(i2c->dq!=NULL) { // expand
+    if(i2c->queueCount >= i2c->queueSize) { // expand, the allocation is reused by later transactions
         //log_i("expand");
         I2C_DATA_QUEUE_t* tq =(I2C_DATA_QUEUE_t*)realloc(i2c->dq,sizeof(I2C_DATA_QUEUE_t)*(i2c->queueCount +1));
-        if(tq!=NULL) { // ok
-            i2c->dq = tq;
-            memmove(&i2c->dq[i2c->queueCount++],&dqx,sizeof(I2C_DATA_QUEUE_t));
-        } else { // bad stuff, unable to allocate more memory!
+        if(tq==NULL) { // bad stuff, unable to allocate more memory!
             log_e("realloc Failure");
             return I2C_ERROR_MEMORY;
         }
-    } else { // first Time
-        //log_i("new");
-        i2c->queueCount=0;
-        i2c->dq =(I2C_DATA_QUEUE_t*)malloc(sizeof(I2C_DATA_QUEUE_t));
-        if(i2c->dq!=NULL) {
-            memmove(&i2c->dq[i2c->queueCount++],&dqx,sizeof(I2C_DATA_QUEUE_t));
-        } else {
-            log_e("malloc failure");
-            return I2C_ERROR_MEMORY;
-        }
+        i2c->dq = tq;
+        i2c->queueSize = i2c->queueCount + 1;
     }
+    i2cInitQueueEntry(&i2c->dq[i2c->queueCount++], mode, i2cDeviceAddr, dataPtr, dataLen, sendStop, event);
     return I2C_ERROR_OK;
 }
 
@@ -832,6 +858,7 @@ i2c_err_t i2cProcQueue(i2c_t * i2c, uint32_t *readCount, uint16_t timeOutMillis)
     }
 
     I2C_MUTEX_LOCK();
+    uint32_t setupStart = xthal_get_ccount(); // bus contention is not setup time
     /* what about co-existence with SLAVE mode?
     Should I check if a slaveMode xfer is in progress and hang
     until it completes?
@@ -888,19 +915,17 @@ i2c_err_t i2cProcQueue(i2c_t * i2c, uint32_t *readCount, uint16_t timeOutMillis)
     i2c->queuePos=0;
     i2c->byteCnt=0;
     uint32_t totalBytes=0; // total number of bytes to be Moved!
-    // convert address field to required I2C format
-    while(i2c->queuePos < i2c->queueCount) { // need to push these address modes upstream, to AddQueue
+    // addresses are converted when queued, only rewind the progress of each dq
+    // so a retry or a prebuilt transaction starts from the beginning
+    while(i2c->queuePos < i2c->queueCount) {
         I2C_DATA_QUEUE_t *tdq = &i2c->dq[i2c->queuePos++];
-        uint16_t taddr=0;
-        if(tdq->ctrl.addrReq ==2) { // 10bit address
-            taddr =((tdq->ctrl.addr >> 7) & 0xFE)
-                   |tdq->ctrl.mode;
-            taddr = (taddr <<8) || (tdq->ctrl.addr&0xFF);
-        } else { // 7bit address
-            taddr =  ((tdq->ctrl.addr<<1)&0xFE)
-                     |tdq->ctrl.mode;
-        }
-        tdq->ctrl.addr = taddr; // all fixed with R/W bit
+        tdq->position = 0;
+        tdq->cmdBytesNeeded = tdq->length;
+        tdq->ctrl.startCmdSent = 0;
+        tdq->ctrl.addrCmdSent = 0;
+        tdq->ctrl.dataCmdSent = 0;
+        tdq->ctrl.stopCmdSent = 0;
+        tdq->ctrl.addrSent = 0;
         totalBytes += tdq->queueLength; // total number of byte to be moved!
     }
     i2c->queuePos=0;
@@ -957,6 +982,7 @@ i2c_err_t i2cProcQueue(i2c_t * i2c, uint32_t *readCount, uint16_t timeOutMillis)
 
     //log_e("before startup @tick=%d will wait=%d",xTaskGetTickCount(),ticksTimeOut);
 
+    i2c->setupCycles = xthal_get_ccount() - setupStart;
     i2c->dev->ctr.trans_start=1; // go for it
 
 #if ARDUHAL_LOG_LEVEL >= ARDUHAL_LOG_LEVEL_ERROR
@@ -1250,6 +1276,9 @@ void i2cRelease(i2c_t *i2c)  // release all resources, power down peripheral
     }
 
     i2cFlush(i2c);
+    free(i2c->dq);
+    i2c->dq = NULL;
+    i2c->queueSize = 0;
 
     // reset the I2C hardware and shut off the clock, power it down.
     if(i2c->num == 0) {
@@ -1271,12 +1300,7 @@ i2c_err_t i2cFlush(i2c_t * i2c)
     // need to grab a MUTEX for exclusive Queue,
     // what out if ISR is running?
     i2c_err_t rc=I2C_ERROR_OK;
-    if(i2c->dq!=NULL) {
-        //  log_i("free");
-        // what about EventHandle?
-        free(i2c->dq);
-        i2c->dq = NULL;
-    }
+    // the dq allocation is kept for the next transaction, i2cRelease() frees it
     i2c->queueCount=0;
     i2c->queuePos=0;
     // release Mutex
@@ -1321,6 +1345,89 @@ i2c_err_t i2cRead(i2c_t * i2c, uint16_t address, uint8_t* buff, uint16_t size, b
     return last_error;
 }
 
+/* run a dq that is not owned by the bus, the queue built by i2cAddQueue*() is
+ * parked meanwhile. Refused while a repeated START sequence is still pending.
+ */
+static i2c_err_t i2cRunQueue(i2c_t * i2c, I2C_DATA_QUEUE_t *dq, uint16_t count, uint16_t timeOutMillis, uint32_t *readCount)
+{
+    if(readCount){
+        *readCount = 0;
+    }
+    if(i2c == NULL) {
+        return I2C_ERROR_DEV;
+    }
+    if(i2c->queueCount) {
+        log_e("transaction pending, end it with sendStop first");
+        return I2C_ERROR_BUSY;
+    }
+    I2C_DATA_QUEUE_t *ownDq = i2c->dq;
+    i2c->dq = dq;
+    i2c->queueCount = count;
+    i2c_err_t last_error = i2cProcQueue(i2c, readCount, timeOutMillis);
+    if(last_error == I2C_ERROR_BUSY) { // try to clear the bus
+        if(i2cInit(i2c->num, i2c->sda, i2c->scl, 0)) {
+            last_error = i2cProcQueue(i2c, readCount, timeOutMillis);
+        }
+    }
+    i2c->dq = ownDq;
+    i2c->queueCount = 0;
+    i2c->queuePos = 0;
+    return last_error;
+}
+
+i2c_err_t i2cWriteRead(i2c_t * i2c, uint16_t address, uint8_t* txBuff, uint16_t txSize, uint8_t* rxBuff, uint16_t rxSize, uint16_t timeOutMillis, uint32_t *readCount)
+{
+    I2C_DATA_QUEUE_t dq[I2C_TRANSACTION_MAX_DQ];
+    uint16_t count = i2cBuildWriteRead(dq, address, txBuff, txSize, rxBuff, rxSize);
+    if(!count) {
+        if(readCount){
+            *readCount = 0;
+        }
+        return I2C_ERROR_DEV;
+    }
+    return i2cRunQueue(i2c, dq, count, timeOutMillis, readCount);
+}
+
+i2c_transaction_t * i2cTransactionNew(uint16_t address, uint8_t* txBuff, uint16_t txSize, uint8_t* rxBuff, uint16_t rxSize)
+{
+    i2c_transaction_t * t = (i2c_transaction_t *)malloc(sizeof(i2c_transaction_t));
+    if(t == NULL) {
+        log_e("malloc failure");
+        return NULL;
+    }
+    t->count = i2cBuildWriteRead(t->dq, address, txBuff, txSize, rxBuff, rxSize);
+    if(!t->count) {
+        log_e("empty transaction");
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+i2c_err_t i2cTransactionRun(i2c_t * i2c, i2c_transaction_t * t, uint16_t timeOutMillis, uint32_t *readCount)
+{
+    if(t == NULL) {
+        if(readCount){
+            *readCount = 0;
+        }
+        return I2C_ERROR_DEV;
+    }
+    return i2cRunQueue(i2c, t->dq, t->count, timeOutMillis, readCount);
+}
+
+void i2cTransactionFree(i2c_transaction_t * t)
+{
+    free(t);
+}
+
+uint32_t i2cGetSetupCycles(i2c_t * i2c)
+{
+    if(i2c == NULL) {
+        return 0;
+    }
+    return i2c->setupCycles;
+}
+
 i2c_err_t i2cSetFrequency(i2c_t * i2c, uint32_t clk_speed)
 {
     if(i2c == NULL) {
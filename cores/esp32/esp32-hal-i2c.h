@@ -49,6 +49,19 @@ i2c_err_t i2cFlush(i2c_t *i2c);
 i2c_err_t i2cSetFrequency(i2c_t * i2c, uint32_t clk_speed);
 uint32_t i2cGetFrequency(i2c_t * i2c);
 
+// write then read with a ReSTART as one queued sequence, without queue allocation
+i2c_err_t i2cWriteRead(i2c_t * i2c, uint16_t address, uint8_t* txBuff, uint16_t txSize, uint8_t* rxBuff, uint16_t rxSize, uint16_t timeOutMillis, uint32_t *readCount);
+
+// prebuilt write/read sequence with fixed address and buffers, re-run without any setup
+struct i2c_transaction_s;
+typedef struct i2c_transaction_s i2c_transaction_t;
+i2c_transaction_t * i2cTransactionNew(uint16_t address, uint8_t* txBuff, uint16_t txSize, uint8_t* rxBuff, uint16_t rxSize);
+i2c_err_t i2cTransactionRun(i2c_t * i2c, i2c_transaction_t * t, uint16_t timeOutMillis, uint32_t *readCount);
+void i2cTransactionFree(i2c_transaction_t * t);
+
+// CPU cycles the last transaction spent from queue processing to trans_start
+uint32_t i2cGetSetupCycles(i2c_t * i2c);
+
 //Functions below should be used only if well understood
 //Might be deprecated and removed in future
 i2c_err_t i2cAttachSCL(i2c_t * i2c, int8_t scl);
@@ -21,6 +21,7 @@
 #include "soc/dport_reg.h"
 #include "soc/ledc_reg.h"
 #include "soc/ledc_struct.h"
+#include "esp_intr.h"
 
 #if CONFIG_DISABLE_HAL_LOCKS
 #define LEDC_MUTEX_LOCK()
@@ -155,15 +156,57 @@ double ledcSetup(uint8_t chan, double freq, uint8_t bit_num)
     return res_freq;
 }
 
-void ledcWrite(uint8_t chan, uint32_t duty)
+#define LEDC_FADE_MAX       LEDC_DUTY_NUM_HSCH0_V   //10 bit duty_num, duty_cycle and duty_scale
+#define LEDC_FADE_INT(chan) BIT(8 + (chan))         //duty_chng_end, hsch0-7 then lsch0-7
+
+static intr_handle_t _ledc_intr_handle = NULL;
+static portMUX_TYPE _ledc_intr_mux = portMUX_INITIALIZER_UNLOCKED;
+static ledc_fade_cb_t _ledc_fade_cb[16];
+static void * _ledc_fade_arg[16];
+static volatile uint16_t _ledc_fading = 0;
+static uint16_t _ledc_faded = 0;                    //duty register holds a fade start, not the duty
+
+//stop watching a running fade, the next duty_start replaces it
+static void _ledcCancelFade(uint8_t chan)
 {
-    if(chan > 15) {
+    if(!(_ledc_fading & BIT(chan))){
         return;
     }
+    portENTER_CRITICAL(&_ledc_intr_mux);
+    LEDC.int_ena.val &= ~LEDC_FADE_INT(chan);
+    LEDC.int_clr.val = LEDC_FADE_INT(chan);
+    _ledc_fading &= ~BIT(chan);
+    portEXIT_CRITICAL(&_ledc_intr_mux);
+}
+
+//duty the channel outputs: the live one while faded, else the one written last,
+//duty_rd only follows a write on the next PWM period
+static uint32_t _ledcDuty(uint8_t chan)
+{
     uint8_t group=(chan/8), channel=(chan%8);
-    LEDC_MUTEX_LOCK();
+    if(_ledc_faded & BIT(chan)) {
+        return LEDC_CHAN(group, channel).duty_rd.duty_read >> 4;
+    }
+    return LEDC_CHAN(group, channel).duty.duty >> 4;
+}
+
+//load duty and a single step, the change is applied by _ledcStart()
+static void _ledcLoad(uint8_t chan, uint32_t duty)
+{
+    uint8_t group=(chan/8), channel=(chan%8);
+    _ledcCancelFade(chan);
+    _ledc_faded &= ~BIT(chan);
     LEDC_CHAN(group, channel).duty.duty = duty << 4;//25 bit (21.4)
-    if(duty) {
+    LEDC_CHAN(group, channel).conf1.val = 0;
+    LEDC_CHAN(group, channel).conf1.duty_inc = 1;
+    LEDC_CHAN(group, channel).conf1.duty_num = 1;
+    LEDC_CHAN(group, channel).conf1.duty_cycle = 1;
+}
+
+static void _ledcStart(uint8_t chan, bool enable)
+{
+    uint8_t group=(chan/8), channel=(chan%8);
+    if(enable) {
         LEDC_CHAN(group, channel).conf0.sig_out_en = 1;//This is the output enable control bit for channel
         LEDC_CHAN(group, channel).conf1.duty_start = 1;//When duty_num duty_cycle and duty_scale has been configured. these register won't take effect until set duty_start. this bit is automatically cleared by hardware.
         if(group) {
@@ -180,15 +223,181 @@ void ledcWrite(uint8_t chan, uint32_t duty)
             LEDC_CHAN(group, channel).conf0.clk_en = 0;
         }
     }
+}
+
+void ledcWrite(uint8_t chan, uint32_t duty)
+{
+    if(chan > 15) {
+        return;
+    }
+    LEDC_MUTEX_LOCK();
+    _ledcLoad(chan, duty);
+    _ledcStart(chan, duty != 0);
+    LEDC_MUTEX_UNLOCK();
+}
+
+void ledcWriteMulti(uint16_t mask, const uint32_t * duties)
+{
+    if(!mask || !duties) {
+        return;
+    }
+    uint16_t pending = mask;
+    uint8_t i = 0;
+    LEDC_MUTEX_LOCK();
+    while(pending) {
+        uint8_t chan = __builtin_ctz(pending);
+        pending &= pending - 1;
+        _ledcLoad(chan, duties[i++]);
+    }
+    //start all channels back to back so they switch on the same PWM periods
+    pending = mask;
+    i = 0;
+    while(pending) {
+        uint8_t chan = __builtin_ctz(pending);
+        pending &= pending - 1;
+        _ledcStart(chan, duties[i++] != 0);
+    }
     LEDC_MUTEX_UNLOCK();
 }
 
+/*
+ * The fade engine adds or subtracts duty_scale every duty_cycle PWM periods,
+ * duty_num times, all fields limited to 10 bits. Whole periods per step
+ * rarely divide the time, nor whole steps the duty change, so step counts
+ * from the most the time allows down to an eighth of that are tried and the
+ * one that misses the duration and the start duty the least (relative to
+ * each, a jump at the start counting double) is kept. The ramp starts at
+ * target -/+ num * scale so it always ends exactly on the target.
+ * Returns false when there is nothing to fade.
+ * */
+bool ledcFadeParams(uint32_t from, uint32_t to, uint32_t periods, ledc_fade_params_t * params)
+{
+    uint32_t delta = (to > from) ? (to - from) : (from - to);
+    if(!delta || !periods || !params) {
+        return false;
+    }
+    uint32_t most = delta;
+    if(most > periods) {
+        most = periods;
+    }
+    if(most > LEDC_FADE_MAX) {
+        most = LEDC_FADE_MAX;
+    }
+    uint64_t best = UINT64_MAX;
+    for(uint32_t num = most; num && (num * 8) >= most; num--) {
+        uint32_t scale = delta / num;
+        if(scale > LEDC_FADE_MAX) {
+            scale = LEDC_FADE_MAX;
+        }
+        uint32_t cycle = (periods + (num / 2)) / num;
+        if(cycle < 1) {
+            cycle = 1;
+        } else if(cycle > LEDC_FADE_MAX) {
+            cycle = LEDC_FADE_MAX;
+        }
+        uint32_t late = (num * cycle > periods) ? (num * cycle - periods) : (periods - num * cycle);
+        //late / periods + 2 * jump / delta, cross multiplied
+        uint64_t miss = ((uint64_t)late * delta) + ((uint64_t)(delta - num * scale) * periods * 2);
+        if(miss >= best) {
+            continue;
+        }
+        best = miss;
+        params->num = num;
+        params->cycle = cycle;
+        params->scale = scale;
+        if(!miss) {
+            break;
+        }
+    }
+    params->increase = (to > from);
+    params->start = params->increase ? (to - (params->num * params->scale)) : (to + (params->num * params->scale));
+    return true;
+}
+
+static void IRAM_ATTR _ledcFadeISR(void * arg)
+{
+    uint32_t status = LEDC.int_st.val & (0xFFFF << 8);
+    LEDC.int_clr.val = status;
+    status >>= 8;
+    while(status) {
+        uint8_t chan = __builtin_ctz(status);
+        status &= status - 1;
+        portENTER_CRITICAL_ISR(&_ledc_intr_mux);
+        LEDC.int_ena.val &= ~LEDC_FADE_INT(chan);
+        _ledc_fading &= ~BIT(chan);
+        portEXIT_CRITICAL_ISR(&_ledc_intr_mux);
+        if(_ledc_fade_cb[chan]) {
+            _ledc_fade_cb[chan](chan, _ledc_fade_arg[chan]);
+        }
+    }
+}
+
+bool ledcFadeWithCallback(uint8_t chan, uint32_t target, uint32_t ms, ledc_fade_cb_t cb, void * arg)
+{
+    if(chan > 15) {
+        return false;
+    }
+    uint8_t group=(chan/8), channel=(chan%8);
+    uint32_t periods = (uint32_t)((_ledcTimerRead(chan) * ms) / 1000);
+    ledc_fade_params_t params;
+
+    LEDC_MUTEX_LOCK();
+    //a previous fade may still be running
+    uint32_t current = _ledcDuty(chan);
+    if(!ledcFadeParams(current, target, periods, &params)) {
+        //already there or no time to fade, just set it
+        _ledcLoad(chan, target);
+        _ledcStart(chan, target != 0);
+        LEDC_MUTEX_UNLOCK();
+        if(cb) {
+            cb(chan, arg);
+        }
+        return true;
+    }
+    if(!_ledc_intr_handle && esp_intr_alloc(ETS_LEDC_INTR_SOURCE, (int)ESP_INTR_FLAG_IRAM, _ledcFadeISR, NULL, &_ledc_intr_handle) != ESP_OK) {
+        LEDC_MUTEX_UNLOCK();
+        log_e("LEDC interrupt allocation failed");
+        return false;
+    }
+    _ledcCancelFade(chan);
+    _ledc_fade_cb[chan] = cb;
+    _ledc_fade_arg[chan] = arg;
+    _ledc_faded |= BIT(chan);
+    LEDC_CHAN(group, channel).duty.duty = params.start << 4;
+    LEDC_CHAN(group, channel).conf1.val = 0;
+    LEDC_CHAN(group, channel).conf1.duty_inc = params.increase;
+    LEDC_CHAN(group, channel).conf1.duty_num = params.num;
+    LEDC_CHAN(group, channel).conf1.duty_cycle = params.cycle;
+    LEDC_CHAN(group, channel).conf1.duty_scale = params.scale;
+    portENTER_CRITICAL(&_ledc_intr_mux);
+    _ledc_fading |= BIT(chan);
+    LEDC.int_clr.val = LEDC_FADE_INT(chan);
+    LEDC.int_ena.val |= LEDC_FADE_INT(chan);
+    portEXIT_CRITICAL(&_ledc_intr_mux);
+    _ledcStart(chan, true);
+    LEDC_MUTEX_UNLOCK();
+    return true;
+}
+
+bool ledcFade(uint8_t chan, uint32_t target, uint32_t ms)
+{
+    return ledcFadeWithCallback(chan, target, ms, NULL, NULL);
+}
+
+bool ledcFading(uint8_t chan)
+{
+    if(chan > 15) {
+        return false;
+    }
+    return (_ledc_fading & BIT(chan)) != 0;
+}
+
 uint32_t ledcRead(uint8_t chan)
 {
     if(chan > 15) {
         return 0;
     }
-    return LEDC.channel_group[chan/8].channel[chan%8].duty.duty >> 4;
+    return _ledcDuty(chan);
 }
 
 double ledcReadFreq(uint8_t chan)
@@ -36,6 +36,28 @@ double      ledcReadFreq(uint8_t channel);
 void        ledcAttachPin(uint8_t pin, uint8_t channel);
 void        ledcDetachPin(uint8_t pin);
 
+//update the channels set in mask under one lock and start them together,
+//duties holds one value per set bit, lowest channel first
+void        ledcWriteMulti(uint16_t mask, const uint32_t * duties);
+
+//ramp to target duty in ms using the hardware fade engine,
+//the callback runs in interrupt context when the fade is done
+typedef void (*ledc_fade_cb_t)(uint8_t channel, void * arg);
+bool        ledcFade(uint8_t channel, uint32_t target, uint32_t ms);
+bool        ledcFadeWithCallback(uint8_t channel, uint32_t target, uint32_t ms, ledc_fade_cb_t cb, void * arg);
+bool        ledcFading(uint8_t channel);
+
+typedef struct {
+    uint32_t start;     //duty the ramp starts from
+    uint16_t num;       //steps
+    uint16_t cycle;     //PWM periods per step
+    uint16_t scale;     //duty change per step
+    bool increase;
+} ledc_fade_params_t;
+
+//fade engine settings for a ramp from -> to lasting the given number of PWM periods
+bool        ledcFadeParams(uint32_t from, uint32_t to, uint32_t periods, ledc_fade_params_t * params);
+
 
 #ifdef __cplusplus
 }
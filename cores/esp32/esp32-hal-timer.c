@@ -16,6 +16,7 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/xtensa_api.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "rom/ets_sys.h"
 #include "soc/timer_group_struct.h"
 #include "soc/dport_reg.h"
@@ -291,3 +292,324 @@ double timerAlarmReadSeconds(hw_timer_t *timer){
     uint16_t div = timerGetDivider(timer);
     return (double)timer_val * div / 80000000;
 }
+
+/*
+ * Timer service
+ *
+ * Any number of one-shot and periodic events share one hardware timer
+ * counting microseconds. Pending events sit in a binary min-heap ordered by
+ * deadline, and the alarm is always armed for the root. The ISR runs every
+ * event that is due, reinserts periodic ones and rearms for the next one.
+ * Deferred events are handed to a task instead of running in the ISR.
+ * */
+
+#define TIMER_SERVICE_MARGIN        5       //us, never arm closer than this to now
+#define TIMER_SERVICE_CAPACITY      16      //initial heap size, grows from task context
+#define TIMER_SERVICE_QUEUE_LEN     32
+#define TIMER_EVENT_DEFERRED        0x01
+#define TIMER_EVENT_QUEUED          0x02
+
+typedef struct {
+    hw_timer_t * timer;
+    hw_timer_event_t ** heap;
+    uint32_t count;
+    uint32_t capacity;
+    portMUX_TYPE lock;
+    xQueueHandle queue;
+    TaskHandle_t task;
+    uint32_t missed;
+} timer_service_t;
+
+static timer_service_t __timerService = {NULL, NULL, 0, 0, portMUX_INITIALIZER_UNLOCKED, NULL, NULL, 0};
+
+#define SERVICE_LOCK()      portENTER_CRITICAL(&__timerService.lock)
+#define SERVICE_UNLOCK()    portEXIT_CRITICAL(&__timerService.lock)
+
+static inline uint64_t IRAM_ATTR __timerServiceNow(){
+    hw_timer_reg_t * dev = __timerService.timer->dev;
+    dev->update = 1;
+    uint64_t h = dev->cnt_high;
+    uint64_t l = dev->cnt_low;
+    return (h << 32) | l;
+}
+
+static inline void IRAM_ATTR __timerHeapSet(uint32_t i, hw_timer_event_t * ev){
+    __timerService.heap[i] = ev;
+    ev->index = i;
+}
+
+static void IRAM_ATTR __timerHeapUp(uint32_t i){
+    hw_timer_event_t ** heap = __timerService.heap;
+    hw_timer_event_t * ev = heap[i];
+    while(i){
+        uint32_t parent = (i - 1) >> 1;
+        if(heap[parent]->deadline <= ev->deadline){
+            break;
+        }
+        __timerHeapSet(i, heap[parent]);
+        i = parent;
+    }
+    __timerHeapSet(i, ev);
+}
+
+static void IRAM_ATTR __timerHeapDown(uint32_t i){
+    hw_timer_event_t ** heap = __timerService.heap;
+    uint32_t count = __timerService.count;
+    hw_timer_event_t * ev = heap[i];
+    for(;;){
+        uint32_t child = (i << 1) + 1;
+        if(child >= count){
+            break;
+        }
+        if(child + 1 < count && heap[child + 1]->deadline < heap[child]->deadline){
+            child++;
+        }
+        if(ev->deadline <= heap[child]->deadline){
+            break;
+        }
+        __timerHeapSet(i, heap[child]);
+        i = child;
+    }
+    __timerHeapSet(i, ev);
+}
+
+static void IRAM_ATTR __timerHeapPush(hw_timer_event_t * ev){
+    __timerService.heap[__timerService.count] = ev;
+    __timerHeapUp(__timerService.count++);
+}
+
+static void IRAM_ATTR __timerHeapRemove(hw_timer_event_t * ev){
+    uint32_t i = ev->index;
+    uint32_t last = --__timerService.count;
+    ev->index = -1;
+    if(i == last){
+        return;
+    }
+    __timerHeapSet(i, __timerService.heap[last]);
+    if(i && __timerService.heap[(i - 1) >> 1]->deadline > __timerService.heap[i]->deadline){
+        __timerHeapUp(i);
+    } else {
+        __timerHeapDown(i);
+    }
+}
+
+static void IRAM_ATTR __timerServiceArm(uint64_t now){
+    hw_timer_t * timer = __timerService.timer;
+    if(!__timerService.count){
+        timer->dev->config.alarm_en = 0;
+        return;
+    }
+    uint64_t alarm = __timerService.heap[0]->deadline;
+    if(alarm < now + TIMER_SERVICE_MARGIN){
+        alarm = now + TIMER_SERVICE_MARGIN;
+    }
+    timer->dev->alarm_high = (uint32_t) (alarm >> 32);
+    timer->dev->alarm_low = (uint32_t) alarm;
+    timer->dev->config.alarm_en = 1;
+}
+
+static void IRAM_ATTR __timerServiceISR(){
+    BaseType_t woken = pdFALSE;
+    SERVICE_LOCK();
+    uint64_t now = __timerServiceNow();
+    //an event that outruns its period must not keep the ISR to itself,
+    //no more runs in one pass than there were events pending
+    uint32_t budget = __timerService.count;
+    while(budget-- && __timerService.count && __timerService.heap[0]->deadline <= now){
+        hw_timer_event_t * ev = __timerService.heap[0];
+        __timerHeapRemove(ev);
+        if(ev->period){
+            ev->deadline += ev->period;
+            if(ev->deadline <= now){
+                //fell behind, skip the missed periods instead of bursting
+                ev->deadline += ((now - ev->deadline) / ev->period + 1) * ev->period;
+            }
+            __timerHeapPush(ev);
+        }
+        if(ev->flags & TIMER_EVENT_DEFERRED){
+            if(!(ev->flags & TIMER_EVENT_QUEUED)){
+                ev->flags |= TIMER_EVENT_QUEUED;
+                if(xQueueSendFromISR(__timerService.queue, &ev, &woken) != pdTRUE){
+                    ev->flags &= ~TIMER_EVENT_QUEUED;
+                    __timerService.missed++;
+                }
+            } else {
+                __timerService.missed++;
+            }
+        } else {
+            hw_timer_event_cb_t cb = ev->cb;
+            void * arg = ev->arg;
+            SERVICE_UNLOCK();
+            cb(arg);
+            SERVICE_LOCK();
+        }
+        now = __timerServiceNow();
+    }
+    __timerServiceArm(now);
+    SERVICE_UNLOCK();
+    if(woken){
+        portYIELD_FROM_ISR();
+    }
+}
+
+static void __timerServiceTask(void * arg){
+    hw_timer_event_t * ev;
+    for(;;){
+        if(xQueueReceive(__timerService.queue, &ev, portMAX_DELAY) != pdTRUE){
+            continue;
+        }
+        SERVICE_LOCK();
+        //stopped while it was queued
+        bool run = (ev->flags & TIMER_EVENT_QUEUED) != 0;
+        ev->flags &= ~TIMER_EVENT_QUEUED;
+        hw_timer_event_cb_t cb = ev->cb;
+        void * cb_arg = ev->arg;
+        SERVICE_UNLOCK();
+        if(run){
+            cb(cb_arg);
+        }
+    }
+}
+
+bool timerServiceBegin(uint8_t num){
+    if(__timerService.timer){
+        return true;
+    }
+    __timerService.heap = (hw_timer_event_t **)malloc(TIMER_SERVICE_CAPACITY * sizeof(hw_timer_event_t *));
+    __timerService.queue = xQueueCreate(TIMER_SERVICE_QUEUE_LEN, sizeof(hw_timer_event_t *));
+    if(!__timerService.heap || !__timerService.queue
+        || xTaskCreatePinnedToCore(__timerServiceTask, "timer_svc", TIMER_SERVICE_TASK_STACK, NULL, TIMER_SERVICE_TASK_PRIORITY, &__timerService.task, tskNO_AFFINITY) != pdPASS){
+        log_e("timer service init failed");
+        free(__timerService.heap);
+        __timerService.heap = NULL;
+        if(__timerService.queue){
+            vQueueDelete(__timerService.queue);
+            __timerService.queue = NULL;
+        }
+        __timerService.task = NULL;
+        return false;
+    }
+    __timerService.capacity = TIMER_SERVICE_CAPACITY;
+    __timerService.count = 0;
+    __timerService.missed = 0;
+    hw_timer_t * timer = timerBegin(num, 80, true);//1 tick per us
+    if(!timer){
+        timerServiceEnd();
+        return false;
+    }
+    timerAttachInterrupt(timer, &__timerServiceISR, true);
+    __timerService.timer = timer;
+    return true;
+}
+
+void timerServiceEnd(){
+    SERVICE_LOCK();
+    hw_timer_t * timer = __timerService.timer;
+    __timerService.timer = NULL;
+    while(__timerService.count){
+        __timerService.heap[--__timerService.count]->index = -1;
+    }
+    SERVICE_UNLOCK();
+    if(timer){
+        timerEnd(timer);
+    }
+    if(__timerService.task){
+        vTaskDelete(__timerService.task);
+        __timerService.task = NULL;
+    }
+    if(__timerService.queue){
+        vQueueDelete(__timerService.queue);
+        __timerService.queue = NULL;
+    }
+    free(__timerService.heap);
+    __timerService.heap = NULL;
+    __timerService.capacity = 0;
+}
+
+uint64_t timerServiceMicros(){
+    if(!__timerService.timer){
+        return 0;
+    }
+    return timerRead(__timerService.timer);
+}
+
+uint32_t timerServiceMissed(){
+    return __timerService.missed;
+}
+
+void timerEventInit(hw_timer_event_t * ev, hw_timer_event_cb_t cb, void * arg, bool deferred){
+    ev->deadline = 0;
+    ev->period = 0;
+    ev->cb = cb;
+    ev->arg = arg;
+    ev->index = -1;
+    ev->flags = deferred ? TIMER_EVENT_DEFERRED : 0;
+}
+
+//make room for one more event, the old heap is freed outside the lock
+static bool __timerServiceGrow(){
+    if(xPortInIsrContext()){
+        return false;
+    }
+    uint32_t capacity = __timerService.capacity * 2;
+    hw_timer_event_t ** heap = (hw_timer_event_t **)malloc(capacity * sizeof(hw_timer_event_t *));
+    if(!heap){
+        return false;
+    }
+    SERVICE_LOCK();
+    hw_timer_event_t ** old = __timerService.heap;
+    memcpy(heap, old, __timerService.count * sizeof(hw_timer_event_t *));
+    __timerService.heap = heap;
+    __timerService.capacity = capacity;
+    SERVICE_UNLOCK();
+    free(old);
+    return true;
+}
+
+bool IRAM_ATTR timerEventStart(hw_timer_event_t * ev, uint64_t us, bool periodic){
+    if(!__timerService.timer || !ev || !ev->cb || (periodic && !us)){
+        return false;
+    }
+    if(ev->index < 0 && __timerService.count >= __timerService.capacity && !__timerServiceGrow()){
+        return false;
+    }
+    SERVICE_LOCK();
+    //moving the first event later moves the alarm too
+    bool first = (ev->index == 0);
+    if(ev->index >= 0){
+        __timerHeapRemove(ev);
+    } else if(__timerService.count == __timerService.capacity){
+        //filled up by an ISR since the check
+        SERVICE_UNLOCK();
+        return false;
+    }
+    uint64_t now = __timerServiceNow();
+    ev->deadline = now + us;
+    ev->period = periodic ? us : 0;
+    __timerHeapPush(ev);
+    if(first || __timerService.heap[0] == ev){
+        __timerServiceArm(now);
+    }
+    SERVICE_UNLOCK();
+    return true;
+}
+
+void IRAM_ATTR timerEventStop(hw_timer_event_t * ev){
+    if(!ev){
+        return;
+    }
+    SERVICE_LOCK();
+    ev->flags &= ~TIMER_EVENT_QUEUED;
+    if(ev->index >= 0 && __timerService.timer){
+        bool first = (ev->index == 0);
+        __timerHeapRemove(ev);
+        if(first){
+            __timerServiceArm(__timerServiceNow());
+        }
+    }
+    SERVICE_UNLOCK();
+}
+
+bool timerEventActive(hw_timer_event_t * ev){
+    return ev && ev->index >= 0;
+}
@@ -26,6 +26,7 @@ extern "C" {
 
 #include "esp32-hal.h"
 #include "freertos/FreeRTOS.h"
+#include "esp_task.h"
 
 struct hw_timer_s;
 typedef struct hw_timer_s hw_timer_t;
@@ -64,6 +65,41 @@ uint64_t timerAlarmRead(hw_timer_t *timer);
 uint64_t timerAlarmReadMicros(hw_timer_t *timer);
 double timerAlarmReadSeconds(hw_timer_t *timer);
 
+/*
+ * Timer service: any number of one-shot and periodic events with microsecond
+ * resolution, multiplexed on one hardware timer. Events are owned by the
+ * caller and must stay valid while they are active. Callbacks run in the
+ * timer ISR (keep them short and in IRAM) or, when deferred, in the
+ * "timer_svc" task. Events can be started and stopped from either context.
+ * */
+//above loop() and lwIP, level with the IDF event task and below the esp_timer and WiFi tasks
+#ifndef TIMER_SERVICE_TASK_PRIORITY
+#define TIMER_SERVICE_TASK_PRIORITY (ESP_TASK_PRIO_MAX - 5)
+#endif
+#ifndef TIMER_SERVICE_TASK_STACK
+#define TIMER_SERVICE_TASK_STACK    4096
+#endif
+
+typedef void (*hw_timer_event_cb_t)(void * arg);
+
+typedef struct {
+    uint64_t deadline;          //us on the service clock
+    uint64_t period;            //0 for one-shot
+    hw_timer_event_cb_t cb;
+    void * arg;
+    int32_t index;              //position in the pending heap, -1 when idle
+    uint8_t flags;
+} hw_timer_event_t;
+
+bool timerServiceBegin(uint8_t timer);
+void timerServiceEnd();
+uint64_t timerServiceMicros();
+uint32_t timerServiceMissed();  //deferred runs dropped because the task was behind
+
+void timerEventInit(hw_timer_event_t * event, hw_timer_event_cb_t cb, void * arg, bool deferred);
+bool timerEventStart(hw_timer_event_t * event, uint64_t us, bool periodic);
+void timerEventStop(hw_timer_event_t * event);
+bool timerEventActive(hw_timer_event_t * event);
 
 #ifdef __cplusplus
 }
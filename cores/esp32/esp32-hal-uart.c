@@ -28,13 +28,36 @@
 #include "soc/gpio_sig_map.h"
 #include "soc/dport_reg.h"
 #include "esp_intr_alloc.h"
+#include "esp_timer.h"
 
 #define UART_REG_BASE(u)    ((u==0)?DR_REG_UART_BASE:(      (u==1)?DR_REG_UART1_BASE:(    (u==2)?DR_REG_UART2_BASE:0)))
 #define UART_RXD_IDX(u)     ((u==0)?U0RXD_IN_IDX:(          (u==1)?U1RXD_IN_IDX:(         (u==2)?U2RXD_IN_IDX:0)))
 #define UART_TXD_IDX(u)     ((u==0)?U0TXD_OUT_IDX:(         (u==1)?U1TXD_OUT_IDX:(        (u==2)?U2TXD_OUT_IDX:0)))
 #define UART_INTR_SOURCE(u) ((u==0)?ETS_UART0_INTR_SOURCE:( (u==1)?ETS_UART1_INTR_SOURCE:((u==2)?ETS_UART2_INTR_SOURCE:0)))
 
+#define UART_FIFO_LEN           128
+#define UART_FRAME_FULL_THRHD   (UART_FIFO_LEN - 8)
+
 static int s_uart_debug_nr = 0;
+static portMUX_TYPE s_uart_int_mux = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct {
+    uint8_t * data;             //(count + 1) slots of size bytes, one is always being filled
+    uart_frame_info_t * info;
+    uint16_t size;
+    uint8_t count;
+    volatile uint8_t head;      //slot the ISR fills
+    volatile uint8_t tail;      //oldest complete frame
+    uint16_t fill;
+    uint8_t flags;
+    uint8_t gap;                //idle time that ends a frame, in symbols
+    uint32_t gap_us;
+    volatile uint32_t dropped;
+    xSemaphoreHandle ready;
+    uint8_t readers;            //tasks in uartReadFrame() and a closing uartSetFrameMode(), under s_uart_int_mux
+    uint8_t giving;             //ISRs between taking the frames and giving ready
+    volatile bool closed;       //replaced by uartSetFrameMode(), freed by its last user
+} uart_frames_t;
 
 struct uart_struct_t {
     uart_dev_t * dev;
@@ -44,6 +67,10 @@ struct uart_struct_t {
     uint8_t num;
     xQueueHandle queue;
     intr_handle_t intr_handle;
+    uart_frames_t * frames;
+    bool rs485;
+    uint8_t de_pin;
+    uint8_t de_level;
 };
 
 #if CONFIG_DISABLE_HAL_LOCKS
@@ -51,25 +78,78 @@ struct uart_struct_t {
 #define UART_MUTEX_UNLOCK()
 
 static uart_t _uart_bus_array[3] = {
-    {(volatile uart_dev_t *)(DR_REG_UART_BASE), 0, NULL, NULL},
-    {(volatile uart_dev_t *)(DR_REG_UART1_BASE), 1, NULL, NULL},
-    {(volatile uart_dev_t *)(DR_REG_UART2_BASE), 2, NULL, NULL}
+    {(volatile uart_dev_t *)(DR_REG_UART_BASE), 0, NULL, NULL, NULL, false, 0, 0},
+    {(volatile uart_dev_t *)(DR_REG_UART1_BASE), 1, NULL, NULL, NULL, false, 0, 0},
+    {(volatile uart_dev_t *)(DR_REG_UART2_BASE), 2, NULL, NULL, NULL, false, 0, 0}
 };
 #else
 #define UART_MUTEX_LOCK()    do {} while (xSemaphoreTake(uart->lock, portMAX_DELAY) != pdPASS)
 #define UART_MUTEX_UNLOCK()  xSemaphoreGive(uart->lock)
 
 static uart_t _uart_bus_array[3] = {
-    {(volatile uart_dev_t *)(DR_REG_UART_BASE), NULL, 0, NULL, NULL},
-    {(volatile uart_dev_t *)(DR_REG_UART1_BASE), NULL, 1, NULL, NULL},
-    {(volatile uart_dev_t *)(DR_REG_UART2_BASE), NULL, 2, NULL, NULL}
+    {(volatile uart_dev_t *)(DR_REG_UART_BASE), NULL, 0, NULL, NULL, NULL, false, 0, 0},
+    {(volatile uart_dev_t *)(DR_REG_UART1_BASE), NULL, 1, NULL, NULL, NULL, false, 0, 0},
+    {(volatile uart_dev_t *)(DR_REG_UART2_BASE), NULL, 2, NULL, NULL, NULL, false, 0, 0}
 };
 #endif
 
+//runs under s_uart_int_mux, returns true when a frame was completed
+static bool IRAM_ATTR _uart_frame_rx(uart_t* uart, uart_frames_t * f, uint32_t status)
+{
+    bool idle = (status & UART_RXFIFO_TOUT_INT_ST) != 0;
+    uint32_t n = uart->dev->status.rxfifo_cnt;
+    if(!idle && n) {
+        n--;//the idle timeout only fires while the fifo holds data
+    }
+    if(status & (UART_FRM_ERR_INT_ST | UART_PARITY_ERR_INT_ST)) {
+        f->flags |= UART_FRAME_ERROR;
+    }
+    uint8_t * slot = f->data + (f->head * f->size);
+    while(n--) {
+        uint8_t c = uart->dev->fifo.rw_byte;
+        if(f->fill < f->size) {
+            slot[f->fill++] = c;
+        } else {
+            f->flags |= UART_FRAME_TRUNCATED;
+        }
+    }
+    if(!idle || (!f->fill && !f->flags)) {
+        return false;
+    }
+    bool done = false;
+    uint8_t next = (f->head + 1) % (f->count + 1);
+    if(next == f->tail) {
+        f->dropped++;
+    } else {
+        uart_frame_info_t * info = &f->info[f->head];
+        info->len = f->fill;
+        info->flags = f->flags;
+        info->timestamp = esp_timer_get_time() - f->gap_us;
+        f->head = next;
+        done = true;
+    }
+    f->fill = 0;
+    f->flags = 0;
+    return done;
+}
+
+static void IRAM_ATTR _uart_tx_done(uart_t* uart)
+{
+    //clear first, a transfer that ends after this sets the event again
+    uart->dev->int_clr.tx_done = 1;
+    if(uart->dev->status.txfifo_cnt || uart->dev->status.st_utx_out) {
+        return;
+    }
+    portENTER_CRITICAL_ISR(&s_uart_int_mux);
+    uart->dev->int_ena.tx_done = 0;
+    portEXIT_CRITICAL_ISR(&s_uart_int_mux);
+    digitalWrite(uart->de_pin, !uart->de_level);
+}
+
 static void IRAM_ATTR _uart_isr(void *arg)
 {
     uint8_t i, c;
-    BaseType_t xHigherPriorityTaskWoken;
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
     uart_t* uart;
 
     for(i=0;i<3;i++){
@@ -77,9 +157,33 @@ static void IRAM_ATTR _uart_isr(void *arg)
         if(uart->intr_handle == NULL){
             continue;
         }
+        uint32_t status = uart->dev->int_st.val;
         uart->dev->int_clr.rxfifo_full = 1;
         uart->dev->int_clr.frm_err = 1;
+        uart->dev->int_clr.parity_err = 1;
         uart->dev->int_clr.rxfifo_tout = 1;
+        if(uart->rs485 && (status & UART_TX_DONE_INT_ST)) {
+            _uart_tx_done(uart);
+        }
+        if(uart->frames != NULL) {
+            //uartSetFrameMode() swaps and frees the frames under the same lock
+            portENTER_CRITICAL_ISR(&s_uart_int_mux);
+            uart_frames_t * f = uart->frames;
+            bool done = f != NULL && _uart_frame_rx(uart, f, status);
+            if(done) {
+                f->giving++;
+            }
+            portEXIT_CRITICAL_ISR(&s_uart_int_mux);
+            if(done) {
+                xSemaphoreGiveFromISR(f->ready, &xHigherPriorityTaskWoken);
+                portENTER_CRITICAL_ISR(&s_uart_int_mux);
+                f->giving--;
+                portEXIT_CRITICAL_ISR(&s_uart_int_mux);
+            }
+            if(f != NULL) {
+                continue;
+            }
+        }
         while(uart->dev->status.rxfifo_cnt) {
             c = uart->dev->fifo.rw_byte;
             if(uart->queue != NULL && !xQueueIsQueueFullFromISR(uart->queue)) {
@@ -96,27 +200,42 @@ static void IRAM_ATTR _uart_isr(void *arg)
 void uartEnableInterrupt(uart_t* uart)
 {
     UART_MUTEX_LOCK();
-    uart->dev->conf1.rxfifo_full_thrhd = 1;
-    uart->dev->conf1.rx_tout_thrhd = 2;
+    if(uart->frames != NULL) {
+        //keep bytes in the fifo so the idle timeout marks the end of the frame
+        uart->dev->conf1.rxfifo_full_thrhd = UART_FRAME_FULL_THRHD;
+        uart->dev->conf1.rx_tout_thrhd = uart->frames->gap;
+        uart->dev->int_ena.parity_err = 1;
+    } else {
+        uart->dev->conf1.rxfifo_full_thrhd = 1;
+        uart->dev->conf1.rx_tout_thrhd = 2;
+    }
     uart->dev->conf1.rx_tout_en = 1;
     uart->dev->int_ena.rxfifo_full = 1;
     uart->dev->int_ena.frm_err = 1;
     uart->dev->int_ena.rxfifo_tout = 1;
     uart->dev->int_clr.val = 0xffffffff;
 
-    esp_intr_alloc(UART_INTR_SOURCE(uart->num), (int)ESP_INTR_FLAG_IRAM, _uart_isr, NULL, &uart->intr_handle);
+    if(uart->intr_handle == NULL) {
+        esp_intr_alloc(UART_INTR_SOURCE(uart->num), (int)ESP_INTR_FLAG_IRAM, _uart_isr, NULL, &uart->intr_handle);
+    }
     UART_MUTEX_UNLOCK();
 }
 
+//an RS-485 driver enable still needs tx_done, so then only RX is turned off
 void uartDisableInterrupt(uart_t* uart)
 {
     UART_MUTEX_LOCK();
     uart->dev->conf1.val = 0;
-    uart->dev->int_ena.val = 0;
-    uart->dev->int_clr.val = 0xffffffff;
+    portENTER_CRITICAL(&s_uart_int_mux);
+    bool rs485 = uart->rs485;
+    uart->dev->int_ena.val &= rs485 ? UART_TX_DONE_INT_ENA : 0;
+    portEXIT_CRITICAL(&s_uart_int_mux);
+    uart->dev->int_clr.val = rs485 ? ~UART_TX_DONE_INT_CLR : 0xffffffff;
 
-    esp_intr_free(uart->intr_handle);
-    uart->intr_handle = NULL;
+    if(!rs485) {
+        esp_intr_free(uart->intr_handle);
+        uart->intr_handle = NULL;
+    }
 
     UART_MUTEX_UNLOCK();
 }
@@ -236,8 +355,10 @@ void uartEnd(uart_t* uart)
 
     UART_MUTEX_UNLOCK();
 
+    uartSetRS485(uart, -1, true);
     uartDetachRx(uart);
     uartDetachTx(uart);
+    uartSetFrameMode(uart, 0, 0, 0);
 }
 
 uint32_t uartAvailable(uart_t* uart)
@@ -280,14 +401,39 @@ uint8_t uartPeek(uart_t* uart)
     return 0;
 }
 
+//drive DE before the first byte, the tx_done interrupt releases it after the last
+static void _uartTxBegin(uart_t* uart)
+{
+    if(!uart->rs485) {
+        return;
+    }
+    portENTER_CRITICAL(&s_uart_int_mux);
+    uart->dev->int_ena.tx_done = 0;
+    portEXIT_CRITICAL(&s_uart_int_mux);
+    uart->dev->int_clr.tx_done = 1;
+    digitalWrite(uart->de_pin, uart->de_level);
+}
+
+static void _uartTxEnd(uart_t* uart)
+{
+    if(!uart->rs485) {
+        return;
+    }
+    portENTER_CRITICAL(&s_uart_int_mux);
+    uart->dev->int_ena.tx_done = 1;
+    portEXIT_CRITICAL(&s_uart_int_mux);
+}
+
 void uartWrite(uart_t* uart, uint8_t c)
 {
     if(uart == NULL) {
         return;
     }
     UART_MUTEX_LOCK();
+    _uartTxBegin(uart);
     while(uart->dev->status.txfifo_cnt == 0x7F);
     uart->dev->fifo.rw_byte = c;
+    _uartTxEnd(uart);
     UART_MUTEX_UNLOCK();
 }
 
@@ -297,12 +443,14 @@ void uartWriteBuf(uart_t* uart, const uint8_t * data, size_t len)
         return;
     }
     UART_MUTEX_LOCK();
+    _uartTxBegin(uart);
     while(len) {
         while(len && uart->dev->status.txfifo_cnt < 0x7F) {
             uart->dev->fifo.rw_byte = *data++;
             len--;
         }
     }
+    _uartTxEnd(uart);
     UART_MUTEX_UNLOCK();
 }
 
@@ -326,6 +474,191 @@ void uartFlush(uart_t* uart)
     UART_MUTEX_UNLOCK();
 }
 
+static uint32_t _uartGapMicros(uart_t* uart, uint8_t gap)
+{
+    uint32_t bits = 1 + (uart->dev->conf0.bit_num + 5) + uart->dev->conf0.parity_en;
+    bits += (uart->dev->conf0.stop_bit_num == 1) ? 1 : 2;
+    bits += uart->dev->rs485_conf.dl1_en;
+    return ((uint64_t)gap * bits * 1000000) / uartGetBaudRate(uart);
+}
+
+static void _uartFramesFree(uart_frames_t * f)
+{
+    free(f->data);
+    free(f->info);
+    vSemaphoreDelete(f->ready);
+    free(f);
+}
+
+/*
+ * Frames taken out of uart->frames: wait for an ISR still giving ready on
+ * the other core, then wake one blocked reader, which passes the wake-up
+ * on. The last one to leave frees them.
+ * */
+static void _uartFramesClose(uart_frames_t * f)
+{
+    bool giving = true;
+    while(giving) {
+        portENTER_CRITICAL(&s_uart_int_mux);
+        giving = f->giving != 0;
+        portEXIT_CRITICAL(&s_uart_int_mux);
+    }
+    xSemaphoreGive(f->ready);
+    portENTER_CRITICAL(&s_uart_int_mux);
+    bool last = --f->readers == 0;
+    portEXIT_CRITICAL(&s_uart_int_mux);
+    if(last) {
+        _uartFramesFree(f);
+    }
+}
+
+bool uartSetFrameMode(uart_t* uart, uint8_t count, uint16_t size, uint8_t gap)
+{
+    if(uart == NULL) {
+        return false;
+    }
+    if(count && (!size || !gap || gap > 126 || count == 0xFF)) {
+        log_e("invalid frame mode arguments");
+        return false;
+    }
+    uart_frames_t * f = NULL;
+    if(count) {
+        f = (uart_frames_t *)calloc(1, sizeof(uart_frames_t));
+        if(f == NULL) {
+            return false;
+        }
+        f->data = (uint8_t *)malloc((count + 1) * size);
+        f->info = (uart_frame_info_t *)calloc(count + 1, sizeof(uart_frame_info_t));
+        f->ready = xSemaphoreCreateCounting(count, 0);
+        if(f->data == NULL || f->info == NULL || f->ready == NULL) {
+            log_e("not enough memory for %u frames of %u bytes", count, size);
+            free(f->data);
+            free(f->info);
+            if(f->ready) {
+                vSemaphoreDelete(f->ready);
+            }
+            free(f);
+            return false;
+        }
+        f->size = size;
+        f->count = count;
+        f->gap = gap;
+        f->gap_us = _uartGapMicros(uart, gap);
+    }
+
+    portENTER_CRITICAL(&s_uart_int_mux);
+    uart_frames_t * old = uart->frames;
+    uart->frames = f;
+    if(old) {
+        old->closed = true;
+        old->readers++;//held by _uartFramesClose()
+    }
+    portEXIT_CRITICAL(&s_uart_int_mux);
+    if(uart->intr_handle) {
+        uartEnableInterrupt(uart);
+    }
+    if(old) {
+        _uartFramesClose(old);
+    }
+    return true;
+}
+
+uint32_t uartFramesAvailable(uart_t* uart)
+{
+    if(uart == NULL) {
+        return 0;
+    }
+    uint32_t n = 0;
+    portENTER_CRITICAL(&s_uart_int_mux);
+    uart_frames_t * f = uart->frames;
+    if(f != NULL) {
+        n = (f->head + f->count + 1 - f->tail) % (f->count + 1);
+    }
+    portEXIT_CRITICAL(&s_uart_int_mux);
+    return n;
+}
+
+size_t uartReadFrame(uart_t* uart, uint8_t * buf, size_t len, uart_frame_info_t * info, uint32_t timeout_ms)
+{
+    if(uart == NULL) {
+        return 0;
+    }
+    portENTER_CRITICAL(&s_uart_int_mux);
+    uart_frames_t * f = uart->frames;
+    if(f != NULL) {
+        f->readers++;
+    }
+    portEXIT_CRITICAL(&s_uart_int_mux);
+    if(f == NULL) {
+        return 0;
+    }
+    uart_frame_info_t frame = { 0 };
+    if(xSemaphoreTake(f->ready, timeout_ms / portTICK_PERIOD_MS) == pdTRUE) {
+        if(f->closed) {
+            //woken by uartSetFrameMode(), wake the next reader too
+            xSemaphoreGive(f->ready);
+        } else {
+            frame = f->info[f->tail];
+            if(frame.len > len) {
+                frame.flags |= UART_FRAME_TRUNCATED;
+                frame.len = len;
+            }
+            if(buf) {
+                memcpy(buf, f->data + (f->tail * f->size), frame.len);
+            }
+            f->tail = (f->tail + 1) % (f->count + 1);
+            if(info) {
+                *info = frame;
+            }
+        }
+    }
+    portENTER_CRITICAL(&s_uart_int_mux);
+    bool last = --f->readers == 0 && f->closed;
+    portEXIT_CRITICAL(&s_uart_int_mux);
+    if(last) {
+        _uartFramesFree(f);
+    }
+    return frame.len;
+}
+
+uint32_t uartFramesDropped(uart_t* uart)
+{
+    if(uart == NULL) {
+        return 0;
+    }
+    portENTER_CRITICAL(&s_uart_int_mux);
+    uint32_t dropped = uart->frames ? uart->frames->dropped : 0;
+    portEXIT_CRITICAL(&s_uart_int_mux);
+    return dropped;
+}
+
+void uartSetRS485(uart_t* uart, int8_t dePin, bool activeHigh)
+{
+    if(uart == NULL) {
+        return;
+    }
+    if(dePin < 0 || dePin > 33) {
+        if(uart->rs485) {
+            portENTER_CRITICAL(&s_uart_int_mux);
+            uart->dev->int_ena.tx_done = 0;
+            uart->rs485 = false;
+            portEXIT_CRITICAL(&s_uart_int_mux);
+            digitalWrite(uart->de_pin, !uart->de_level);
+        }
+        return;
+    }
+    UART_MUTEX_LOCK();
+    uart->de_pin = dePin;
+    uart->de_level = activeHigh ? HIGH : LOW;
+    pinMode(dePin, OUTPUT);
+    digitalWrite(dePin, !uart->de_level);
+    uart->rs485 = true;
+    UART_MUTEX_UNLOCK();
+    if(uart->intr_handle == NULL) {
+        esp_intr_alloc(UART_INTR_SOURCE(uart->num), (int)ESP_INTR_FLAG_IRAM, _uart_isr, NULL, &uart->intr_handle);
+    }
+}
+
 void uartSetBaudRate(uart_t* uart, uint32_t baud_rate)
 {
     if(uart == NULL) {
@@ -335,6 +668,9 @@ void uartSetBaudRate(uart_t* uart, uint32_t baud_rate)
     uint32_t clk_div = ((UART_CLK_FREQ<<4)/baud_rate);
     uart->dev->clk_div.div_int = clk_div>>4 ;
     uart->dev->clk_div.div_frag = clk_div & 0xf;
+    if(uart->frames != NULL) {
+        uart->frames->gap_us = _uartGapMicros(uart, uart->frames->gap);
+    }
     UART_MUTEX_UNLOCK();
 }
 
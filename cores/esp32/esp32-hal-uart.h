@@ -67,6 +67,37 @@ void uartFlush(uart_t* uart);
 void uartSetBaudRate(uart_t* uart, uint32_t baud_rate);
 uint32_t uartGetBaudRate(uart_t* uart);
 
+/*
+ * Frame mode
+ *
+ * Instead of queuing bytes, the ISR collects them into one of count
+ * preallocated frames of size bytes and closes the frame when the line has
+ * been idle for gap symbol times (e.g. 4 for the Modbus RTU 3.5 character
+ * gap). While frame mode is on, uartAvailable() and uartRead() return nothing.
+ * count 0 turns frame mode off. Changing the mode drops unread frames and
+ * makes uartReadFrame() calls waiting on other tasks return 0.
+ * */
+#define UART_FRAME_TRUNCATED    0x01    //longer than the frame or read buffer
+#define UART_FRAME_ERROR        0x02    //framing or parity error inside the frame
+
+typedef struct {
+    uint16_t len;
+    uint8_t flags;
+    int64_t timestamp;      //esp_timer time the last byte ended, in us
+} uart_frame_info_t;
+
+bool uartSetFrameMode(uart_t* uart, uint8_t count, uint16_t size, uint8_t gap);
+uint32_t uartFramesAvailable(uart_t* uart);
+size_t uartReadFrame(uart_t* uart, uint8_t * buf, size_t len, uart_frame_info_t * info, uint32_t timeout_ms);
+uint32_t uartFramesDropped(uart_t* uart);
+
+/*
+ * Drive an RS-485 transceiver's driver enable pin while transmitting,
+ * it is released when the last stop bit has left. dePin -1 turns it off.
+ * It keeps working while RX is detached.
+ * */
+void uartSetRS485(uart_t* uart, int8_t dePin, bool activeHigh);
+
 void uartSetDebug(uart_t* uart);
 int uartGetDebug();
 
@@ -17,8 +17,262 @@
 //#include <limits.h>
 #include "wiring_private.h"
 #include "pins_arduino.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "soc/gpio_struct.h"
 
 
+/*
+ * Interrupt driven pulse capture
+ *
+ * pulseCaptureBegin() attaches a CHANGE interrupt to the pin through the
+ * regular GPIO interrupt dispatcher. The ISR only timestamps the edge and
+ * pushes it into a per-pin single producer/single consumer ring, so any
+ * number of pins can be captured at once without pinning a core.
+ * readPulses() and pulseInAsync() pair the edges into pulses from task
+ * context and never block. Each pin has one reader at a time.
+ * */
+
+#define PULSE_EDGE_LEVEL    0x01
+#define PULSE_EDGE_GAP      0x02    //edges were lost right before this one
+
+typedef struct {
+    uint32_t time;
+    uint8_t flags;
+} pulse_edge_t;
+
+typedef struct {
+    pulse_edge_t * edges;
+    uint32_t mask;
+    volatile uint32_t head;         //written by the ISR
+    volatile uint32_t tail;         //written by the reader
+    volatile uint32_t overruns;
+    volatile bool gap;
+    uint8_t pin;
+    uint8_t users;                  //readers inside the capture, under __pulseMux
+    bool ended;                     //pulseCaptureEnd() left freeing it to the last reader
+    bool has_last;                  //reader side: last edge that started a pulse
+    pulse_edge_t last;
+} pulse_capture_t;
+
+static pulse_capture_t * __pulseCaptures[GPIO_PIN_COUNT] = {0,};
+//the ISR may still run on the other core while a capture ends, it only
+//touches the capture through __pulseCaptures[] with this lock held.
+//Tasks take a reference under it instead, see __pulseCaptureGet()
+static portMUX_TYPE __pulseMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void __pulseCaptureFree(pulse_capture_t * cap)
+{
+    free(cap->edges);
+    free(cap);
+}
+
+//pulseCaptureEnd() on another task can not free the capture until it is put back
+static pulse_capture_t * __pulseCaptureGet(uint8_t pin)
+{
+    if(pin >= GPIO_PIN_COUNT) {
+        return NULL;
+    }
+    portENTER_CRITICAL(&__pulseMux);
+    pulse_capture_t * cap = __pulseCaptures[pin];
+    if(cap) {
+        cap->users++;
+    }
+    portEXIT_CRITICAL(&__pulseMux);
+    return cap;
+}
+
+static void __pulseCapturePut(pulse_capture_t * cap)
+{
+    portENTER_CRITICAL(&__pulseMux);
+    bool last = !--cap->users && cap->ended;
+    portEXIT_CRITICAL(&__pulseMux);
+    if(last) {
+        __pulseCaptureFree(cap);
+    }
+}
+
+static void IRAM_ATTR __onPulseEdge(void * arg)
+{
+    uint8_t pin = (uint32_t)arg;
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    portENTER_CRITICAL_ISR(&__pulseMux);
+    pulse_capture_t * cap = __pulseCaptures[pin];
+    if(!cap) {
+        portEXIT_CRITICAL_ISR(&__pulseMux);
+        return;
+    }
+    uint32_t head = cap->head;
+    if((head - cap->tail) > cap->mask) {
+        cap->overruns++;
+        cap->gap = true;
+        portEXIT_CRITICAL_ISR(&__pulseMux);
+        return;
+    }
+    pulse_edge_t * edge = &cap->edges[head & cap->mask];
+    edge->time = now;
+    edge->flags = digitalRead(pin) ? PULSE_EDGE_LEVEL : 0;
+    if(cap->gap) {
+        edge->flags |= PULSE_EDGE_GAP;
+        cap->gap = false;
+    }
+    cap->head = head + 1;
+    portEXIT_CRITICAL_ISR(&__pulseMux);
+}
+
+bool pulseCaptureBegin(uint8_t pin, size_t depth)
+{
+    if(!digitalPinIsValid(pin) || !depth) {
+        return false;
+    }
+    if(__pulseCaptures[pin]) {
+        return true;
+    }
+    if(GPIO.pin[pin].int_ena) {
+        log_e("pin %u already has an interrupt attached", pin);
+        return false;
+    }
+    uint32_t size = 1;
+    while(size < depth) {
+        size <<= 1;
+    }
+    pulse_capture_t * cap = (pulse_capture_t *)calloc(1, sizeof(pulse_capture_t));
+    if(!cap) {
+        return false;
+    }
+    cap->edges = (pulse_edge_t *)malloc(size * sizeof(pulse_edge_t));
+    if(!cap->edges) {
+        free(cap);
+        return false;
+    }
+    cap->mask = size - 1;
+    cap->pin = pin;
+    portENTER_CRITICAL(&__pulseMux);
+    bool raced = __pulseCaptures[pin] != NULL;
+    if(!raced) {
+        __pulseCaptures[pin] = cap;
+    }
+    portEXIT_CRITICAL(&__pulseMux);
+    if(raced) { //another task started it meanwhile
+        __pulseCaptureFree(cap);
+        return true;
+    }
+    attachInterruptArg(pin, (void (*)(void))__onPulseEdge, (void *)(uint32_t)pin, CHANGE);
+    return true;
+}
+
+void pulseCaptureEnd(uint8_t pin)
+{
+    if(pin >= GPIO_PIN_COUNT) {
+        return;
+    }
+    portENTER_CRITICAL(&__pulseMux);
+    pulse_capture_t * cap = __pulseCaptures[pin];
+    __pulseCaptures[pin] = NULL;
+    bool idle = cap && !cap->users;
+    if(cap) {
+        cap->ended = true;
+    }
+    portEXIT_CRITICAL(&__pulseMux);
+    if(!cap) {
+        return;
+    }
+    detachInterrupt(pin);
+    if(idle) {
+        __pulseCaptureFree(cap);
+    }
+}
+
+uint32_t pulseCaptureOverruns(uint8_t pin)
+{
+    pulse_capture_t * cap = __pulseCaptureGet(pin);
+    if(!cap) {
+        return 0;
+    }
+    uint32_t overruns = cap->overruns;
+    __pulseCapturePut(cap);
+    return overruns;
+}
+
+size_t readPulses(uint8_t pin, pulse_t * pulses, size_t count)
+{
+    if(!pulses) {
+        return 0;
+    }
+    pulse_capture_t * cap = __pulseCaptureGet(pin);
+    if(!cap) {
+        return 0;
+    }
+    size_t found = 0;
+    uint32_t tail = cap->tail;
+    uint32_t head = cap->head;
+    while(found < count && tail != head) {
+        pulse_edge_t edge = cap->edges[tail & cap->mask];
+        tail++;
+        if(edge.flags & PULSE_EDGE_GAP) {
+            cap->has_last = false;
+        }
+        if(cap->has_last && (cap->last.flags & PULSE_EDGE_LEVEL) == (edge.flags & PULSE_EDGE_LEVEL)) {
+            //the level was sampled after a bounce, keep the older edge
+            continue;
+        }
+        if(cap->has_last) {
+            pulses[found].level = cap->last.flags & PULSE_EDGE_LEVEL;
+            pulses[found].start = cap->last.time;
+            pulses[found].width = edge.time - cap->last.time;
+            found++;
+        }
+        cap->last = edge;
+        cap->has_last = true;
+    }
+    cap->tail = tail;
+    __pulseCapturePut(cap);
+    return found;
+}
+
+//the first call on a pin only starts the capture and returns false, as no
+//edge has been seen yet. pulseCaptureBegin() in setup() avoids that
+bool pulseInAsync(uint8_t pin, uint8_t state, unsigned long * width)
+{
+    pulse_t pulse;
+    if(pin >= GPIO_PIN_COUNT) {
+        return false;
+    }
+    if(!__pulseCaptures[pin] && !pulseCaptureBegin(pin, PULSE_CAPTURE_DEFAULT_DEPTH)) {
+        return false;
+    }
+    while(readPulses(pin, &pulse, 1)) {
+        if(pulse.level == !!state) {
+            if(width) {
+                *width = pulse.width;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * pulseIn on a captured pin waits for the first matching pulse that starts
+ * after the call, sleeping between polls instead of spinning.
+ * */
+static unsigned long __pulseInCaptured(uint8_t pin, uint8_t state, unsigned long timeout)
+{
+    pulse_t pulse;
+    const uint32_t start = micros();
+    //drop pulses that completed before the call
+    while(readPulses(pin, &pulse, 1));
+    do {
+        while(readPulses(pin, &pulse, 1)) {
+            if(pulse.level == !!state && (int32_t)(pulse.start - start) >= 0) {
+                return pulse.width;
+            }
+        }
+        delay(1);
+    } while((micros() - start) < timeout);
+    return 0;
+}
+
 extern uint32_t xthal_get_ccount();
 
 #define WAIT_FOR_PIN_STATE(state) \
@@ -31,6 +285,9 @@ extern uint32_t xthal_get_ccount();
 // max timeout is 27 seconds at 160MHz clock and 54 seconds at 80MHz clock
 unsigned long pulseIn(uint8_t pin, uint8_t state, unsigned long timeout)
 {
+    if(pin < GPIO_PIN_COUNT && __pulseCaptures[pin]) {
+        return __pulseInCaptured(pin, state, timeout);
+    }
     const uint32_t max_timeout_us = clockCyclesToMicroseconds(UINT_MAX);
     if (timeout > max_timeout_us) {
         timeout = max_timeout_us;
@@ -19,10 +19,64 @@
  
 #include "esp32-hal.h"
 #include "wiring_private.h"
+#include "freertos/FreeRTOS.h"
+#include "rom/ets_sys.h"
+
+/*
+ * Both pins are treated as a two bit GPIO bus (bit 0: data, bit 1: clock)
+ * so every data and clock edge is a single register store instead of a
+ * digitalWrite call. Pins that can not output fall back to digitalWrite.
+ *
+ * Without a delay the clock would toggle within a few CPU cycles, too fast
+ * for e.g. a 74HC595 at 3.3V, so the clock is held high and low for at
+ * least the pulse width set with shiftSetPulseWidth(). The wait counts CPU
+ * cycles at the current CPU frequency.
+ * */
+static uint32_t __shiftPulseNs = SHIFT_PULSE_WIDTH_DEFAULT;
+
+void shiftSetPulseWidth(uint32_t ns)
+{
+    __shiftPulseNs = ns;
+}
+
+static inline uint32_t __shiftPulseCycles(void)
+{
+    return (uint32_t)(((uint64_t)__shiftPulseNs * ets_get_cpu_frequency() + 999) / 1000);
+}
+
+static inline void __shiftWait(uint32_t since, uint32_t cycles)
+{
+    while((uint32_t)(xthal_get_ccount() - since) < cycles);
+}
+
+static bool __shiftBusInit(gpio_bus_t * bus, uint8_t dataPin, uint8_t clockPin)
+{
+    uint8_t pins[2] = {dataPin, clockPin};
+    return dataPin != clockPin && digitalPinCanOutput(clockPin) && gpioBusInit(bus, pins, 2);
+}
 
 uint8_t shiftIn(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder) {
     uint8_t value = 0;
     uint8_t i;
+    gpio_bus_t bus;
+
+    if(__shiftBusInit(&bus, dataPin, clockPin)) {
+        uint32_t cycles = __shiftPulseCycles();
+        uint32_t edge = xthal_get_ccount();
+        for(i = 0; i < 8; ++i) {
+            __shiftWait(edge, cycles);
+            gpioBusSet(&bus, 2);
+            edge = xthal_get_ccount();
+            if(bitOrder == LSBFIRST)
+                value |= (gpioBusRead(&bus) & 1) << i;
+            else
+                value |= (gpioBusRead(&bus) & 1) << (7 - i);
+            __shiftWait(edge, cycles);
+            gpioBusClear(&bus, 2);
+            edge = xthal_get_ccount();
+        }
+        return value;
+    }
 
     for(i = 0; i < 8; ++i) {
         digitalWrite(clockPin, HIGH);
@@ -38,6 +92,28 @@ uint8_t shiftIn(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder) {
 void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, uint8_t val) {
     uint8_t i;
 
+    gpio_bus_t bus;
+
+    if(digitalPinCanOutput(dataPin) && __shiftBusInit(&bus, dataPin, clockPin)) {
+        uint32_t cycles = __shiftPulseCycles();
+        uint32_t edge = xthal_get_ccount();
+        for(i = 0; i < 8; i++) {
+            uint8_t bit = (bitOrder == LSBFIRST) ? (val >> i) & 1 : (val >> (7 - i)) & 1;
+            if(bit)
+                gpioBusSet(&bus, 1);
+            else
+                gpioBusClear(&bus, 1);
+
+            __shiftWait(edge, cycles); // clock low time, data setup
+            gpioBusSet(&bus, 2);
+            edge = xthal_get_ccount();
+            __shiftWait(edge, cycles); // clock high time
+            gpioBusClear(&bus, 2);
+            edge = xthal_get_ccount();
+        }
+        return;
+    }
+
     for(i = 0; i < 8; i++) {
         if(bitOrder == LSBFIRST)
             digitalWrite(dataPin, !!(val & (1 << i)));
@@ -19,6 +19,9 @@
 #include <cstring>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "cbuf.h"
 
 
 #if defined(CONFIG_BT_ENABLED) && defined(CONFIG_BLUEDROID_ENABLED)
@@ -42,9 +45,134 @@
 
 const char * _spp_server_name = "ESP32_SPP_SERVER";
 
-#define QUEUE_SIZE 256
+#ifndef SPP_RX_BUFFER_SIZE
+#define SPP_RX_BUFFER_SIZE 8192
+#endif
+#ifndef SPP_TX_BUFFER_SIZE
+#define SPP_TX_BUFFER_SIZE 4096
+#endif
+#define SPP_TX_MAX          330     //bytes per esp_spp_write, fits the default L2CAP MTU
+#define SPP_TX_COALESCE_MS  5       //how long small writes wait for more data before being sent
+
+#define SPP_CONNECTED       BIT0    //client connected
+#define SPP_NOT_CONGESTED   BIT1    //stack is accepting data
+#define SPP_TX_IDLE         BIT2    //no esp_spp_write in flight
+#define SPP_TX_SPACE        BIT3    //TX buffer was drained
+#define SPP_RX_DATA         BIT4    //RX buffer received data
+
 static uint32_t _spp_client = 0;
-static xQueueHandle _spp_queue = NULL;
+static EventGroupHandle_t _spp_event_group = NULL;
+static xSemaphoreHandle _spp_rx_lock = NULL;
+static xSemaphoreHandle _spp_tx_lock = NULL;
+static cbuf * _spp_rx_buf = NULL;
+static cbuf * _spp_tx_buf = NULL;
+static TaskHandle_t _spp_tx_task_handle = NULL;
+static TaskHandle_t _spp_tx_task_joiner = NULL;  //set to stop the TX task, notified when it is gone
+static uint8_t _spp_tx_chunk[SPP_TX_MAX];
+static bt_serial_stats_t _spp_stats;
+
+#define SPP_RX_LOCK()       do {} while (xSemaphoreTake(_spp_rx_lock, portMAX_DELAY) != pdPASS)
+#define SPP_RX_UNLOCK()     xSemaphoreGive(_spp_rx_lock)
+#define SPP_TX_LOCK()       do {} while (xSemaphoreTake(_spp_tx_lock, portMAX_DELAY) != pdPASS)
+#define SPP_TX_UNLOCK()     xSemaphoreGive(_spp_tx_lock)
+
+static size_t _spp_rx_available()
+{
+    if (_spp_rx_buf == NULL){
+        return 0;
+    }
+    SPP_RX_LOCK();
+    size_t len = _spp_rx_buf->available();
+    SPP_RX_UNLOCK();
+    return len;
+}
+
+static size_t _spp_rx_read(uint8_t * data, size_t len, bool peek)
+{
+    if (_spp_rx_buf == NULL){
+        return 0;
+    }
+    SPP_RX_LOCK();
+    len = peek ? _spp_rx_buf->peek((char *)data, len) : _spp_rx_buf->read((char *)data, len);
+    SPP_RX_UNLOCK();
+    return len;
+}
+
+static void _spp_rx_push(const uint8_t * data, size_t len)
+{
+    if (_spp_rx_buf == NULL){
+        log_e("SerialQueueBT ERROR");
+        return;
+    }
+    SPP_RX_LOCK();
+    size_t written = _spp_rx_buf->write((const char *)data, len);
+    _spp_stats.rx_bytes += written;
+    _spp_stats.rx_dropped += len - written;
+    SPP_RX_UNLOCK();
+    if (written < len){
+        log_w("RX buffer full, dropped %u bytes", len - written);
+    }
+    xEventGroupSetBits(_spp_event_group, SPP_RX_DATA);
+}
+
+static size_t _spp_tx_pending()
+{
+    SPP_TX_LOCK();
+    size_t len = _spp_tx_buf->available();
+    SPP_TX_UNLOCK();
+    return len;
+}
+
+static void _spp_tx_reset()
+{
+    if (_spp_tx_buf != NULL){
+        SPP_TX_LOCK();
+        _spp_tx_buf->flush();
+        SPP_TX_UNLOCK();
+    }
+    xEventGroupSetBits(_spp_event_group, SPP_NOT_CONGESTED | SPP_TX_IDLE | SPP_TX_SPACE);
+}
+
+/*
+ * Drains the TX buffer into the stack one chunk at a time. A new chunk is only
+ * handed to esp_spp_write once the previous one has been reported by
+ * ESP_SPP_WRITE_EVT and the link is not congested. Writes smaller than a chunk
+ * are held for SPP_TX_COALESCE_MS so that byte-wise prints go out together.
+ * */
+static void _spp_tx_task(void * arg)
+{
+    while (!_spp_tx_task_joiner){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!_spp_tx_task_joiner && _spp_tx_pending() < SPP_TX_MAX){
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SPP_TX_COALESCE_MS));
+        }
+        while (!_spp_tx_task_joiner && _spp_tx_pending()){
+            xEventGroupWaitBits(_spp_event_group, SPP_NOT_CONGESTED | SPP_TX_IDLE, pdFALSE, pdTRUE, portMAX_DELAY);
+            if (!(xEventGroupGetBits(_spp_event_group) & SPP_CONNECTED)){
+                break;
+            }
+            //busy before the buffer drains, so flush() cannot see it empty and idle in between
+            xEventGroupClearBits(_spp_event_group, SPP_TX_IDLE);
+            SPP_TX_LOCK();
+            size_t len = _spp_tx_buf->read((char *)_spp_tx_chunk, SPP_TX_MAX);
+            SPP_TX_UNLOCK();
+            if (!len){
+                xEventGroupSetBits(_spp_event_group, SPP_TX_IDLE);
+                break;
+            }
+            xEventGroupSetBits(_spp_event_group, SPP_TX_SPACE);
+            if (esp_spp_write(_spp_client, len, _spp_tx_chunk) != ESP_OK){
+                log_e("esp_spp_write failed");
+                _spp_stats.tx_dropped += len;
+                xEventGroupSetBits(_spp_event_group, SPP_TX_IDLE);
+            } else {
+                _spp_stats.tx_bytes += len;
+            }
+        }
+    }
+    xTaskNotifyGive(_spp_tx_task_joiner);
+    vTaskDelete(NULL);
+}
 
 static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
 {
@@ -63,6 +191,8 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
         break;
     case ESP_SPP_CLOSE_EVT://Client connection closed
         _spp_client = 0;
+        xEventGroupClearBits(_spp_event_group, SPP_CONNECTED);
+        _spp_tx_reset();
         log_i("ESP_SPP_CLOSE_EVT");
         break;
     case ESP_SPP_START_EVT://server started
@@ -74,22 +204,29 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
     case ESP_SPP_DATA_IND_EVT://connection received data
         log_v("ESP_SPP_DATA_IND_EVT len=%d handle=%d", param->data_ind.len, param->data_ind.handle);
         //esp_log_buffer_hex("",param->data_ind.data,param->data_ind.len); //for low level debug
-
-        if (_spp_queue != NULL){
-            for (int i = 0; i < param->data_ind.len; i++)
-                xQueueSend(_spp_queue, param->data_ind.data + i, (TickType_t)0);
-        } else {
-            log_e("SerialQueueBT ERROR");
-        }
+        _spp_rx_push(param->data_ind.data, param->data_ind.len);
         break;
     case ESP_SPP_CONG_EVT://connection congestion status changed
-        log_i("ESP_SPP_CONG_EVT");
+        log_i("ESP_SPP_CONG_EVT cong=%d", param->cong.cong);
+        if (param->cong.cong){
+            _spp_stats.congestion_events++;
+            xEventGroupClearBits(_spp_event_group, SPP_NOT_CONGESTED);
+        } else {
+            xEventGroupSetBits(_spp_event_group, SPP_NOT_CONGESTED);
+        }
         break;
     case ESP_SPP_WRITE_EVT://write operation completed
-        log_v("ESP_SPP_WRITE_EVT");
+        log_v("ESP_SPP_WRITE_EVT len=%d cong=%d", param->write.len, param->write.cong);
+        if (param->write.cong){
+            _spp_stats.congestion_events++;
+            xEventGroupClearBits(_spp_event_group, SPP_NOT_CONGESTED);
+        }
+        xEventGroupSetBits(_spp_event_group, SPP_TX_IDLE);
         break;
     case ESP_SPP_SRV_OPEN_EVT://Server connection open
         _spp_client = param->open.handle;
+        _spp_tx_reset();
+        xEventGroupSetBits(_spp_event_group, SPP_CONNECTED);
         log_i("ESP_SPP_SRV_OPEN_EVT");
         break;
     default:
@@ -97,6 +234,65 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
     }
 }
 
+static bool _init_buffers()
+{
+    if (_spp_event_group == NULL){
+        _spp_event_group = xEventGroupCreate();
+        if (_spp_event_group == NULL){
+            return false;
+        }
+        xEventGroupSetBits(_spp_event_group, SPP_NOT_CONGESTED | SPP_TX_IDLE);
+    }
+    if (_spp_rx_lock == NULL && (_spp_rx_lock = xSemaphoreCreateMutex()) == NULL){
+        return false;
+    }
+    if (_spp_tx_lock == NULL && (_spp_tx_lock = xSemaphoreCreateMutex()) == NULL){
+        return false;
+    }
+    if (_spp_rx_buf == NULL && (_spp_rx_buf = new cbuf(SPP_RX_BUFFER_SIZE)) == NULL){
+        return false;
+    }
+    if (_spp_tx_buf == NULL && (_spp_tx_buf = new cbuf(SPP_TX_BUFFER_SIZE)) == NULL){
+        return false;
+    }
+    if (_spp_tx_task_handle == NULL){
+        xTaskCreate(_spp_tx_task, "spp_tx", 2048, NULL, configMAX_PRIORITIES - 2, &_spp_tx_task_handle);
+        if (_spp_tx_task_handle == NULL){
+            return false;
+        }
+    }
+    return true;
+}
+
+static void _free_buffers()
+{
+    if (_spp_tx_task_handle){
+        //the task may hold _spp_tx_lock, so let it leave its loop and wait for it
+        _spp_tx_task_joiner = xTaskGetCurrentTaskHandle();
+        xEventGroupSetBits(_spp_event_group, SPP_NOT_CONGESTED | SPP_TX_IDLE);
+        xTaskNotifyGive(_spp_tx_task_handle);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        _spp_tx_task_handle = NULL;
+        _spp_tx_task_joiner = NULL;
+    }
+    delete _spp_rx_buf;
+    _spp_rx_buf = NULL;
+    delete _spp_tx_buf;
+    _spp_tx_buf = NULL;
+    if (_spp_rx_lock){
+        vSemaphoreDelete(_spp_rx_lock);
+        _spp_rx_lock = NULL;
+    }
+    if (_spp_tx_lock){
+        vSemaphoreDelete(_spp_tx_lock);
+        _spp_tx_lock = NULL;
+    }
+    if (_spp_event_group){
+        vEventGroupDelete(_spp_event_group);
+        _spp_event_group = NULL;
+    }
+}
+
 static bool _init_bt(const char *deviceName)
 {
     if (!btStarted() && !btStart()){
@@ -119,6 +315,11 @@ static bool _init_bt(const char *deviceName)
         }
     }
 
+    if (!_init_buffers()){
+        log_e("%s buffer allocation failed\n", __func__);
+        return false;
+    }
+
     if (esp_spp_register_callback(esp_spp_cb) != ESP_OK){
         log_e("%s spp register failed\n", __func__);
         return false;
@@ -129,11 +330,6 @@ static bool _init_bt(const char *deviceName)
         return false;
     }
 
-    _spp_queue = xQueueCreate(QUEUE_SIZE, sizeof(uint8_t)); //initialize the queue
-    if (_spp_queue == NULL){
-        log_e("%s Queue creation error\n", __func__);
-        return false;
-    }
     esp_bt_dev_set_device_name(deviceName);
 
     // the default BTA_DM_COD_LOUDSPEAKER does not work with the macOS BT stack
@@ -156,6 +352,8 @@ static bool _stop_bt()
         esp_bluedroid_deinit();
         btStop();
     }
+    _spp_client = 0;
+    _free_buffers();
     return true;
 }
 
@@ -184,23 +382,17 @@ bool BluetoothSerial::begin(String localName)
 
 int BluetoothSerial::available(void)
 {
-    if (!_spp_client || _spp_queue == NULL){
+    if (!_spp_client){
         return 0;
     }
-    return uxQueueMessagesWaiting(_spp_queue);
+    return _spp_rx_available();
 }
 
 int BluetoothSerial::peek(void)
 {
-    if (available()){
-        if (!_spp_client || _spp_queue == NULL){
-            return 0;
-        }
-
-        uint8_t c;
-        if (xQueuePeek(_spp_queue, &c, 0)){
-            return c;
-        }
+    uint8_t c;
+    if (_spp_client && _spp_rx_read(&c, 1, true)){
+        return c;
     }
     return -1;
 }
@@ -215,29 +407,32 @@ bool BluetoothSerial::hasClient(void)
 
 int BluetoothSerial::read(void)
 {
-    if (available()){
-        if (!_spp_client || _spp_queue == NULL){
-            return 0;
-        }
+    uint8_t c;
+    if (_spp_client && _spp_rx_read(&c, 1, false)){
+        return c;
+    }
+    return -1;
+}
 
-        uint8_t c;
-        if (xQueueReceive(_spp_queue, &c, 0)){
-            return c;
+size_t BluetoothSerial::readBytes(uint8_t *buffer, size_t length)
+{
+    size_t count = 0;
+    _startMillis = millis();
+    while (_spp_client && count < length){
+        xEventGroupClearBits(_spp_event_group, SPP_RX_DATA);
+        count += _spp_rx_read(buffer + count, length - count, false);
+        unsigned long elapsed = millis() - _startMillis;
+        if (count == length || elapsed >= _timeout){
+            break;
         }
+        xEventGroupWaitBits(_spp_event_group, SPP_RX_DATA, pdTRUE, pdTRUE, pdMS_TO_TICKS(_timeout - elapsed));
     }
-    return 0;
+    return count;
 }
 
 size_t BluetoothSerial::write(uint8_t c)
 {
-    if (!_spp_client){
-        return 0;
-    }
-
-    uint8_t buffer[1];
-    buffer[0] = c;
-    esp_err_t err = esp_spp_write(_spp_client, 1, buffer);
-    return (err == ESP_OK) ? 1 : 0;
+    return write(&c, 1);
 }
 
 size_t BluetoothSerial::write(const uint8_t *buffer, size_t size)
@@ -246,19 +441,60 @@ size_t BluetoothSerial::write(const uint8_t *buffer, size_t size)
         return 0;
     }
 
-    esp_err_t err = esp_spp_write(_spp_client, size, (uint8_t *)buffer);
-    return (err == ESP_OK) ? size : 0;
+    size_t written = 0;
+    _startMillis = millis();
+    while (written < size){
+        xEventGroupClearBits(_spp_event_group, SPP_TX_SPACE);
+        SPP_TX_LOCK();
+        size_t pending = _spp_tx_buf->available();
+        size_t len = _spp_tx_buf->write((const char *)buffer + written, size - written);
+        SPP_TX_UNLOCK();
+        written += len;
+        //wake the TX task when data arrives and again once a full chunk is ready
+        if ((!pending && len) || (pending < SPP_TX_MAX && pending + len >= SPP_TX_MAX)){
+            xTaskNotifyGive(_spp_tx_task_handle);
+        }
+        unsigned long elapsed = millis() - _startMillis;
+        if (written == size || !_spp_client || elapsed >= _timeout){
+            break;
+        }
+        xTaskNotifyGive(_spp_tx_task_handle);
+        xEventGroupWaitBits(_spp_event_group, SPP_TX_SPACE, pdTRUE, pdTRUE, pdMS_TO_TICKS(_timeout - elapsed));
+    }
+    if (written < size){
+        _spp_stats.tx_dropped += size - written;
+        log_w("TX buffer full, dropped %u bytes", size - written);
+    }
+    return written;
 }
 
 void BluetoothSerial::flush()
 {
-    if (_spp_client){
-        int qsize = available();
-        uint8_t buffer[qsize];
-        esp_spp_write(_spp_client, qsize, buffer);
+    if (!_spp_client){
+        return;
+    }
+    xTaskNotifyGive(_spp_tx_task_handle);
+    while (_spp_client){
+        xEventGroupClearBits(_spp_event_group, SPP_TX_SPACE);
+        if (!_spp_tx_pending() && (xEventGroupGetBits(_spp_event_group) & SPP_TX_IDLE)){
+            break;
+        }
+        xEventGroupWaitBits(_spp_event_group, SPP_TX_SPACE, pdTRUE, pdTRUE, pdMS_TO_TICKS(10));
+    }
+}
+
+void BluetoothSerial::getStats(bt_serial_stats_t * stats)
+{
+    if (stats){
+        *stats = _spp_stats;
     }
 }
 
+void BluetoothSerial::resetStats()
+{
+    memset(&_spp_stats, 0, sizeof(_spp_stats));
+}
+
 void BluetoothSerial::end()
 {
     _stop_bt();
@@ -22,6 +22,14 @@
 #include "Arduino.h"
 #include "Stream.h"
 
+typedef struct {
+    uint32_t rx_bytes;          //bytes stored in the RX buffer
+    uint32_t rx_dropped;        //bytes received while the RX buffer was full
+    uint32_t tx_bytes;          //bytes handed to the SPP stack
+    uint32_t tx_dropped;        //bytes that did not fit in the TX buffer or failed to send
+    uint32_t congestion_events; //times the stack reported congestion
+} bt_serial_stats_t;
+
 class BluetoothSerial: public Stream
 {
     public:
@@ -34,10 +42,17 @@ class BluetoothSerial: public Stream
         int peek(void);
         bool hasClient(void);
         int read(void);
+        size_t readBytes(uint8_t *buffer, size_t length);
+        size_t readBytes(char *buffer, size_t length)
+        {
+            return readBytes((uint8_t *) buffer, length);
+        }
         size_t write(uint8_t c);
         size_t write(const uint8_t *buffer, size_t size);
         void flush();
         void end(void);
+        void getStats(bt_serial_stats_t * stats);
+        void resetStats(void);
 
     private:
         String local_name;
@@ -0,0 +1,47 @@
+/*
+ LEDC Hardware Fade
+
+ This example shows how to fade a LED with the LEDC fade engine
+ using the ledcFadeWithCallback function. The CPU is free while
+ the LED fades, the callback starts the fade in the other direction.
+
+ This example code is in the public domain.
+ */
+
+// use first channel of 16 channels (started from zero)
+#define LEDC_CHANNEL_0     0
+
+// use 13 bit precission for LEDC timer
+#define LEDC_TIMER_13_BIT  13
+
+// use 5000 Hz as a LEDC base frequency
+#define LEDC_BASE_FREQ     5000
+
+// fade LED PIN (replace with LED_BUILTIN constant for built-in LED)
+#define LED_PIN            5
+
+// time of one fade in ms
+#define FADE_TIME          1500
+
+volatile bool fadeDone = false;
+
+// runs in interrupt context, keep it short
+void IRAM_ATTR onFadeDone(uint8_t channel, void * arg) {
+  fadeDone = true;
+}
+
+void setup() {
+  // Setup timer and attach timer to a led pin
+  ledcSetup(LEDC_CHANNEL_0, LEDC_BASE_FREQ, LEDC_TIMER_13_BIT);
+  ledcAttachPin(LED_PIN, LEDC_CHANNEL_0);
+  ledcFadeWithCallback(LEDC_CHANNEL_0, (1 << LEDC_TIMER_13_BIT) - 1, FADE_TIME, onFadeDone, NULL);
+}
+
+void loop() {
+  if (fadeDone) {
+    fadeDone = false;
+    uint32_t target = ledcRead(LEDC_CHANNEL_0) ? 0 : (1 << LEDC_TIMER_13_BIT) - 1;
+    ledcFadeWithCallback(LEDC_CHANNEL_0, target, FADE_TIME, onFadeDone, NULL);
+  }
+  delay(10);
+}
@@ -0,0 +1,42 @@
+//Continuous sampling of two ADC1 pins at 20 kHz each, averaged
+//down to 1 kHz and printed as min/max/mean every second.
+
+const uint8_t pins[] = {34, 35};
+
+void setup() {
+  Serial.begin(115200);
+  adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+  config.sample_rate = 40000;   //shared by both pins
+  config.filter = ADC_FILTER_AVERAGE;
+  config.decimation = 20;
+  config.block_frames = 100;
+  if(!adcStreamBegin(pins, 2, &config)){
+    Serial.println("ADC stream failed to start");
+  }
+}
+
+void loop() {
+  static uint16_t frames[100][2];
+  uint32_t sum[2] = {0, 0};
+  uint16_t lo[2] = {4095, 4095}, hi[2] = {0, 0};
+  size_t total = 0;
+  while(total < 1000){
+    size_t n = adcStreamRead(&frames[0][0], 100, 200);
+    if(!n){
+      break;
+    }
+    for(size_t i = 0; i < n; i++){
+      for(uint8_t p = 0; p < 2; p++){
+        uint16_t v = frames[i][p];
+        sum[p] += v;
+        lo[p] = min(lo[p], v);
+        hi[p] = max(hi[p], v);
+      }
+    }
+    total += n;
+  }
+  for(uint8_t p = 0; p < 2 && total; p++){
+    Serial.printf("pin %u: min %u max %u mean %u\n", pins[p], lo[p], hi[p], sum[p] / total);
+  }
+  Serial.printf("overruns: %u\n", adcStreamOverruns());
+}
@@ -23,12 +23,106 @@
 
 using namespace fs;
 
+struct fs::FileBuffer {
+    uint8_t* data;
+    size_t size;
+    size_t rpos;    // next unread byte of the read window
+    size_t rlen;    // bytes in the read window
+    size_t wlen;    // bytes waiting to be written
+    size_t wcap;    // room up to the next aligned boundary
+    FileImplPtr p;  // so the last File going out of scope still writes the tail
+
+    FileBuffer(size_t n, FileImplPtr impl) : data((uint8_t*)malloc(n)), size(n), rpos(0), rlen(0), wlen(0), wcap(0), p(impl) { }
+    ~FileBuffer()
+    {
+        if (wlen && p) {
+            p->writeFrom(data, wlen);
+        }
+        free(data);
+    }
+};
+
+bool File::setBufferSize(size_t size)
+{
+    if (!_p) {
+        return false;
+    }
+    if (_buf) {
+        if (!_flushBuffer()) {
+            setWriteError();
+        }
+        _dropReadBuffer();
+        _buf = nullptr;
+    }
+    if (!size) {
+        return true;
+    }
+    FileBufferPtr buf = std::make_shared<FileBuffer>(size, _p);
+    if (!buf->data) {
+        return false;
+    }
+    _buf = buf;
+    return true;
+}
+
+// false if the pending data could not be written completely, the rest is
+// dropped like the tail of a short unbuffered write and counted in *lost
+bool File::_flushBuffer(size_t* lost) const
+{
+    size_t failed = 0;
+    if (_buf && _buf->wlen) {
+        size_t done = _p->writeFrom(_buf->data, _buf->wlen);
+        if (done < _buf->wlen) {
+            failed = _buf->wlen - done;
+        } else if (done != _buf->wlen) {
+            failed = _buf->wlen;
+        }
+        _buf->wlen = 0;
+    }
+    if (lost) {
+        *lost = failed;
+    }
+    return !failed;
+}
+
+// move the implementation back to the logical position before switching to writes or seeking
+void File::_dropReadBuffer()
+{
+    if (_buf && _buf->rlen) {
+        size_t unread = _buf->rlen - _buf->rpos;
+        if (unread) {
+            _p->seek(_p->position() - unread, SeekSet);
+        }
+        _buf->rpos = 0;
+        _buf->rlen = 0;
+    }
+}
+
+bool File::_fillBuffer()
+{
+    if (!_flushBuffer()) {
+        setWriteError();
+    }
+    // read up to the next aligned boundary so later refills stay aligned
+    size_t len = _buf->size - (_p->position() % _buf->size);
+    _buf->rpos = 0;
+    _buf->rlen = _p->readInto(_buf->data, len);
+    if (_buf->rlen == (size_t)-1) {
+        _buf->rlen = 0;
+    }
+    return _buf->rlen != 0;
+}
+
 size_t File::write(uint8_t c)
 {
     if (!_p) {
         return 0;
     }
 
+    if (_buf) {
+        return write(&c, 1);
+    }
+
     return _p->write(&c, 1);
 }
 
@@ -38,6 +132,7 @@ time_t File::getLastWrite()
         return 0;
     }
 
+    _flushBuffer();
     return _p->getLastWrite();
 }
 
@@ -47,7 +142,42 @@ size_t File::write(const uint8_t *buf, size_t size)
         return 0;
     }
 
-    return _p->write(buf, size);
+    if (!_buf) {
+        return _p->write(buf, size);
+    }
+
+    _dropReadBuffer();
+    if (size >= _buf->size) {
+        if (!_flushBuffer()) {
+            setWriteError();
+            return 0;
+        }
+        return _p->writeFrom(buf, size);
+    }
+    size_t written = 0;
+    size_t pending = 0; // bytes of this call still in the buffer
+    while (written < size) {
+        if (!_buf->wlen) {
+            _buf->wcap = _buf->size - (_p->position() % _buf->size);
+        }
+        size_t len = _buf->wcap - _buf->wlen;
+        if (len > (size - written)) {
+            len = size - written;
+        }
+        memcpy(_buf->data + _buf->wlen, buf + written, len);
+        _buf->wlen += len;
+        written += len;
+        pending += len;
+        if (_buf->wlen == _buf->wcap) {
+            size_t lost;
+            if (!_flushBuffer(&lost)) {
+                setWriteError();
+                return written - ((lost < pending) ? lost : pending);
+            }
+            pending = 0;
+        }
+    }
+    return written;
 }
 
 int File::available()
@@ -56,7 +186,7 @@ int File::available()
         return false;
     }
 
-    return _p->size() - _p->position();
+    return size() - position();
 }
 
 int File::read()
@@ -65,6 +195,13 @@ int File::read()
         return -1;
     }
 
+    if (_buf) {
+        if (_buf->rpos == _buf->rlen && !_fillBuffer()) {
+            return -1;
+        }
+        return _buf->data[_buf->rpos++];
+    }
+
     uint8_t result;
     if (_p->read(&result, 1) != 1) {
         return -1;
@@ -79,7 +216,37 @@ size_t File::read(uint8_t* buf, size_t size)
         return -1;
     }
 
-    return _p->read(buf, size);
+    if (!_buf) {
+        return _p->read(buf, size);
+    }
+
+    size_t count = 0;
+    while (count < size) {
+        size_t avail = _buf->rlen - _buf->rpos;
+        if (avail) {
+            size_t len = (avail < (size - count)) ? avail : (size - count);
+            memcpy(buf + count, _buf->data + _buf->rpos, len);
+            _buf->rpos += len;
+            count += len;
+        } else if ((size - count) >= _buf->size) {
+            // large remainder goes straight into the caller's memory
+            if (!_flushBuffer()) {
+                setWriteError();
+            }
+            // the window is used up and no longer ends at _p's position
+            _buf->rpos = 0;
+            _buf->rlen = 0;
+            size_t len = _p->readInto(buf + count, size - count);
+            if (len == (size_t)-1) {
+                break;
+            }
+            count += len;
+            break;
+        } else if (!_fillBuffer()) {
+            break;
+        }
+    }
+    return count;
 }
 
 int File::peek()
@@ -88,6 +255,13 @@ int File::peek()
         return -1;
     }
 
+    if (_buf) {
+        if (_buf->rpos == _buf->rlen && !_fillBuffer()) {
+            return -1;
+        }
+        return _buf->data[_buf->rpos];
+    }
+
     size_t curPos = _p->position();
     int result = read();
     seek(curPos, SeekSet);
@@ -100,6 +274,9 @@ void File::flush()
         return;
     }
 
+    if (!_flushBuffer()) {
+        setWriteError();
+    }
     _p->flush();
 }
 
@@ -109,6 +286,25 @@ bool File::seek(uint32_t pos, SeekMode mode)
         return false;
     }
 
+    if (_buf) {
+        if (!_flushBuffer()) {
+            setWriteError();
+            return false;
+        }
+        if (_buf->rlen && mode != SeekEnd) {
+            // stay inside the read window when possible
+            size_t end = _p->position();
+            size_t start = end - _buf->rlen;
+            size_t target = (mode == SeekCur) ? (start + _buf->rpos + (int32_t)pos) : pos;
+            if (target >= start && target <= end) {
+                _buf->rpos = target - start;
+                return true;
+            }
+        }
+        // leaves _p at the logical position, so SeekCur and SeekEnd stay correct
+        _dropReadBuffer();
+    }
+
     return _p->seek(pos, mode);
 }
 
@@ -118,6 +314,10 @@ size_t File::position() const
         return 0;
     }
 
+    if (_buf) {
+        return _p->position() - (_buf->rlen - _buf->rpos) + _buf->wlen;
+    }
+
     return _p->position();
 }
 
@@ -127,12 +327,15 @@ size_t File::size() const
         return 0;
     }
 
+    _flushBuffer();
     return _p->size();
 }
 
 void File::close()
 {
     if (_p) {
+        _flushBuffer();
+        _buf = nullptr;
         _p->close();
         _p = nullptr;
     }
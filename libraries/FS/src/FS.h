@@ -35,6 +35,8 @@ class File;
 
 class FileImpl;
 typedef std::shared_ptr<FileImpl> FileImplPtr;
+struct FileBuffer;
+typedef std::shared_ptr<FileBuffer> FileBufferPtr;
 class FSImpl;
 typedef std::shared_ptr<FSImpl> FSImplPtr;
 
@@ -79,10 +81,27 @@ public:
     File openNextFile(const char* mode = FILE_READ);
     void rewindDirectory(void);
 
+    // Serve small reads, peek() and small writes from a RAM buffer of the
+    // given size (0 turns it off). Reads are refilled and writes flushed in
+    // blocks aligned to the buffer size, so use the flash page or sector
+    // size (e.g. 256 for SPIFFS, 512 for FAT).
+    bool setBufferSize(size_t size);
+
 protected:
+    bool _fillBuffer();
+    bool _flushBuffer(size_t* lost = nullptr) const;
+    void _dropReadBuffer();
+
     FileImplPtr _p;
+    FileBufferPtr _buf;
 };
 
+/*
+ * File systems on VFS remember stat() results for a short while. Changes made
+ * through this object are seen at once; changes made behind it (another FS
+ * object on the same mount, raw POSIX calls, a swapped card) can take up to
+ * VFS_STAT_CACHE_TTL_MS to show in exists() and open().
+ * */
 class FS
 {
 public:
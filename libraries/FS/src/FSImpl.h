@@ -43,6 +43,10 @@ public:
     virtual FileImplPtr openNextFile(const char* mode) = 0;
     virtual void rewindDirectory(void) = 0;
     virtual operator bool() = 0;
+    // bulk transfers for callers that keep their own buffer, so the data
+    // does not have to pass through another buffer inside the implementation
+    virtual size_t readInto(uint8_t* buf, size_t size) { return read(buf, size); }
+    virtual size_t writeFrom(const uint8_t* buf, size_t size) { return write(buf, size); }
 };
 
 class FSImpl
@@ -58,7 +62,7 @@ public:
     virtual bool remove(const char* path) = 0;
     virtual bool mkdir(const char *path) = 0;
     virtual bool rmdir(const char *path) = 0;
-    void mountpoint(const char *);
+    virtual void mountpoint(const char *);
     const char * mountpoint();
 };
 
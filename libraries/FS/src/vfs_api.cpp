@@ -16,6 +16,154 @@
 
 using namespace fs;
 
+VFSPath::VFSPath(const char * mountpoint, const char * path)
+    : _len(0)
+{
+    _buf[0] = 0;
+    if(!mountpoint || !path) {
+        return;
+    }
+    size_t mlen = strlen(mountpoint);
+    size_t plen = strlen(path);
+    if((mlen + plen) >= VFS_PATH_MAX) {
+        log_e("path too long: %s%s", mountpoint, path);
+        return;
+    }
+    memcpy(_buf, mountpoint, mlen);
+    memcpy(_buf + mlen, path, plen + 1);
+    _len = mlen + plen;
+}
+
+uint64_t VFSPath::hash() const
+{
+    //FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < _len; i++) {
+        h = (h ^ (uint8_t)_buf[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+VFSImpl::VFSImpl()
+    : _cacheClock(0)
+{
+    memset(_cache, 0, sizeof(_cache));
+    vPortCPUInitializeMutex(&_cacheMux);
+}
+
+void VFSImpl::mountpoint(const char * mp)
+{
+    FSImpl::mountpoint(mp);
+    invalidateCache();
+}
+
+void VFSImpl::invalidateCache()
+{
+    portENTER_CRITICAL(&_cacheMux);
+    memset(_cache, 0, sizeof(_cache));
+    portEXIT_CRITICAL(&_cacheMux);
+}
+
+void VFSImpl::_invalidate(uint64_t hash)
+{
+    portENTER_CRITICAL(&_cacheMux);
+    for(size_t i = 0; i < VFS_STAT_CACHE_SIZE; i++) {
+        if(_cache[i].used && _cache[i].hash == hash) {
+            _cache[i].used = 0;
+        }
+    }
+    portEXIT_CRITICAL(&_cacheMux);
+}
+
+/*
+ * stat() through a small LRU cache keyed by the hash of the full path.
+ * Misses are cached too, and so is a failed _opendir() on them, so probing
+ * for a missing file (e.g. a .gz sibling) costs its lookups only once.
+ * Anything that changes a path through this class invalidates its entry;
+ * changes made around it (another FS object, raw open() or the card swapped)
+ * are only seen once the entry is VFS_STAT_CACHE_TTL_MS old.
+ * */
+bool VFSImpl::_stat(const VFSPath& path, struct stat * st)
+{
+    uint64_t hash = path.hash();
+    uint32_t now = millis();
+    memset(st, 0, sizeof(struct stat));
+
+    portENTER_CRITICAL(&_cacheMux);
+    for(size_t i = 0; i < VFS_STAT_CACHE_SIZE; i++) {
+        vfs_stat_cache_t * e = &_cache[i];
+        if(_fresh(e, hash, now)) {
+            bool exists = e->exists;
+            st->st_mode = e->mode;
+            st->st_size = e->size;
+            st->st_mtime = e->mtime;
+            e->used = ++_cacheClock;
+            portEXIT_CRITICAL(&_cacheMux);
+            return exists;
+        }
+    }
+    portEXIT_CRITICAL(&_cacheMux);
+
+    bool exists = !stat(path.c_str(), st);
+    if(!VFS_STAT_CACHE_SIZE) {
+        return exists;
+    }
+
+    portENTER_CRITICAL(&_cacheMux);
+    vfs_stat_cache_t * victim = &_cache[0];
+    for(size_t i = 0; i < VFS_STAT_CACHE_SIZE; i++) {
+        if(_cache[i].used && _cache[i].hash == hash) {
+            victim = &_cache[i];    //a stale entry for the same path
+            break;
+        }
+        if(_cache[i].used < victim->used) {
+            victim = &_cache[i];
+        }
+    }
+    victim->hash = hash;
+    victim->used = ++_cacheClock;
+    victim->filled = now;
+    victim->exists = exists;
+    victim->notDir = false;
+    victim->mode = exists ? st->st_mode : 0;
+    victim->size = exists ? st->st_size : 0;
+    victim->mtime = exists ? st->st_mtime : 0;
+    portEXIT_CRITICAL(&_cacheMux);
+    return exists;
+}
+
+/*
+ * opendir() for a path that did not stat, which may still be a directory
+ * (the mount point, or any prefix on SPIFFS). A failure is remembered in
+ * the cache entry _stat() left for the path.
+ * */
+DIR * VFSImpl::_opendir(const VFSPath& path)
+{
+    uint64_t hash = path.hash();
+    uint32_t now = millis();
+    portENTER_CRITICAL(&_cacheMux);
+    for(size_t i = 0; i < VFS_STAT_CACHE_SIZE; i++) {
+        if(_fresh(&_cache[i], hash, now) && _cache[i].notDir) {
+            portEXIT_CRITICAL(&_cacheMux);
+            return NULL;
+        }
+    }
+    portEXIT_CRITICAL(&_cacheMux);
+
+    DIR * d = opendir(path.c_str());
+    if(d) {
+        return d;
+    }
+    portENTER_CRITICAL(&_cacheMux);
+    for(size_t i = 0; i < VFS_STAT_CACHE_SIZE; i++) {
+        if(_fresh(&_cache[i], hash, now) && !_cache[i].exists) {
+            _cache[i].notDir = true;
+        }
+    }
+    portEXIT_CRITICAL(&_cacheMux);
+    return NULL;
+}
+
 FileImplPtr VFSImpl::open(const char* path, const char* mode)
 {
     if(!_mountpoint) {
@@ -28,41 +176,29 @@ FileImplPtr VFSImpl::open(const char* path, const char* mode)
         return FileImplPtr();
     }
 
-    char * temp = (char *)malloc(strlen(path)+strlen(_mountpoint)+2);
+    VFSPath temp(_mountpoint, path);
     if(!temp) {
-        log_e("malloc failed");
         return FileImplPtr();
     }
 
-    sprintf(temp,"%s%s", _mountpoint, path);
-
     struct stat st;
-    //file lound
-    if(!stat(temp, &st)) {
-        free(temp);
+    //file found
+    if(_stat(temp, &st)) {
         if (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)) {
-            return std::make_shared<VFSFileImpl>(this, path, mode);
+            return std::make_shared<VFSFileImpl>(this, path, temp, mode, &st);
         }
         log_e("%s has wrong mode 0x%08X", path, st.st_mode);
         return FileImplPtr();
     }
 
     //file not found but mode permits creation
-    if(mode && mode[0] != 'r') {
-        free(temp);
-        return std::make_shared<VFSFileImpl>(this, path, mode);
-    }
-
-    //try to open this as directory (might be mount point)
-    DIR * d = opendir(temp);
-    if(d) {
-        closedir(d);
-        free(temp);
-        return std::make_shared<VFSFileImpl>(this, path, mode);
+    //or it might be a directory that does not stat (e.g. the mount point)
+    std::shared_ptr<VFSFileImpl> file = std::make_shared<VFSFileImpl>(this, path, temp, mode, (const struct stat *)NULL);
+    if(*file) {
+        return file;
     }
 
-    log_e("%s does not exist", temp);
-    free(temp);
+    log_e("%s does not exist", temp.c_str());
     return FileImplPtr();
 }
 
@@ -73,9 +209,19 @@ bool VFSImpl::exists(const char* path)
         return false;
     }
 
-    VFSFileImpl f(this, path, "r");
-    if(f) {
-        f.close();
+    if(!path || path[0] != '/') {
+        return false;
+    }
+
+    VFSPath temp(_mountpoint, path);
+    struct stat st;
+    if(temp && _stat(temp, &st)) {
+        return true;
+    }
+    //the mount point itself does not stat on every file system
+    DIR * d = temp ? _opendir(temp) : NULL;
+    if(d) {
+        closedir(d);
         return true;
     }
     return false;
@@ -96,22 +242,21 @@ bool VFSImpl::rename(const char* pathFrom, const char* pathTo)
         log_e("%s does not exists", pathFrom);
         return false;
     }
-    char * temp1 = (char *)malloc(strlen(pathFrom)+strlen(_mountpoint)+1);
-    if(!temp1) {
-        log_e("malloc failed");
+    VFSPath temp1(_mountpoint, pathFrom);
+    VFSPath temp2(_mountpoint, pathTo);
+    if(!temp1 || !temp2) {
         return false;
     }
-    char * temp2 = (char *)malloc(strlen(pathTo)+strlen(_mountpoint)+1);
-    if(!temp2) {
-        free(temp1);
-        log_e("malloc failed");
-        return false;
+    //renaming a directory moves every cached entry below it
+    struct stat st;
+    bool dir = !_stat(temp1, &st) || S_ISDIR(st.st_mode);
+    auto rc = ::rename(temp1.c_str(), temp2.c_str());
+    if(dir) {
+        invalidateCache();
+    } else {
+        _invalidate(temp1.hash());
+        _invalidate(temp2.hash());
     }
-    sprintf(temp1,"%s%s", _mountpoint, pathFrom);
-    sprintf(temp2,"%s%s", _mountpoint, pathTo);
-    auto rc = ::rename(temp1, temp2);
-    free(temp1);
-    free(temp2);
     return rc == 0;
 }
 
@@ -127,24 +272,15 @@ bool VFSImpl::remove(const char* path)
         return false;
     }
 
-    VFSFileImpl f(this, path, "r");
-    if(!f || f.isDirectory()) {
-        if(f) {
-            f.close();
-        }
+    VFSPath temp(_mountpoint, path);
+    struct stat st;
+    if(!temp || !_stat(temp, &st) || S_ISDIR(st.st_mode)) {
         log_e("%s does not exists or is directory", path);
         return false;
     }
-    f.close();
 
-    char * temp = (char *)malloc(strlen(path)+strlen(_mountpoint)+1);
-    if(!temp) {
-        log_e("malloc failed");
-        return false;
-    }
-    sprintf(temp,"%s%s", _mountpoint, path);
-    auto rc = unlink(temp);
-    free(temp);
+    auto rc = unlink(temp.c_str());
+    _invalidate(temp.hash());
     return rc == 0;
 }
 
@@ -166,14 +302,12 @@ bool VFSImpl::mkdir(const char *path)
         return false;
     }
 
-    char * temp = (char *)malloc(strlen(path)+strlen(_mountpoint)+1);
+    VFSPath temp(_mountpoint, path);
     if(!temp) {
-        log_e("malloc failed");
         return false;
     }
-    sprintf(temp,"%s%s", _mountpoint, path);
-    auto rc = ::mkdir(temp, ACCESSPERMS);
-    free(temp);
+    auto rc = ::mkdir(temp.c_str(), ACCESSPERMS);
+    _invalidate(temp.hash());
     return rc == 0;
 }
 
@@ -194,14 +328,12 @@ bool VFSImpl::rmdir(const char *path)
     }
     f.close();
 
-    char * temp = (char *)malloc(strlen(path)+strlen(_mountpoint)+1);
+    VFSPath temp(_mountpoint, path);
     if(!temp) {
-        log_e("malloc failed");
         return false;
     }
-    sprintf(temp,"%s%s", _mountpoint, path);
-    auto rc = unlink(temp);
-    free(temp);
+    auto rc = unlink(temp.c_str());
+    _invalidate(temp.hash());
     return rc == 0;
 }
 
@@ -209,33 +341,52 @@ bool VFSImpl::rmdir(const char *path)
 
 
 VFSFileImpl::VFSFileImpl(VFSImpl* fs, const char* path, const char* mode)
+    : VFSFileImpl(fs, path, VFSPath(fs->_mountpoint, path), mode, (const struct stat *)NULL)
+{
+}
+
+/*
+ * st is the result of a stat() already done by the caller, or NULL if the
+ * path did not stat. Either way no further lookup is made here.
+ * */
+VFSFileImpl::VFSFileImpl(VFSImpl* fs, const char* path, const VFSPath& fullPath, const char* mode, const struct stat * st)
     : _fs(fs)
     , _f(NULL)
     , _d(NULL)
     , _path(NULL)
+    , _hash(0)
     , _isDirectory(false)
     , _written(false)
+    , _unbuffered(false)
 {
-    char * temp = (char *)malloc(strlen(path)+strlen(_fs->_mountpoint)+1);
-    if(!temp) {
+    if(!fullPath) {
         return;
     }
-    sprintf(temp,"%s%s", _fs->_mountpoint, path);
+    const char * temp = fullPath.c_str();
+    _hash = fullPath.hash();
 
     _path = strdup(path);
     if(!_path) {
         log_e("strdup(%s) failed", path);
-        free(temp);
         return;
     }
 
-    if(!stat(temp, &_stat)) {
+    struct stat found;
+    if(!st && _fs->_stat(fullPath, &found)) {
+        st = &found;
+    }
+
+    if(st) {
         //file found
+        _stat = *st;
         if (S_ISREG(_stat.st_mode)) {
             _isDirectory = false;
             _f = fopen(temp, mode);
             if(!_f) {
                 log_e("fopen(%s) failed", temp);
+            } else if(mode && mode[0] != 'r') {
+                _fs->_invalidate(_hash);
+                _written = true;
             }
         } else if(S_ISDIR(_stat.st_mode)) {
             _isDirectory = true;
@@ -248,9 +399,10 @@ VFSFileImpl::VFSFileImpl(VFSImpl* fs, const char* path, const char* mode)
         }
     } else {
         //file not found
+        memset(&_stat, 0, sizeof(_stat));
         if(!mode || mode[0] == 'r') {
             //try to open as directory
-            _d = opendir(temp);
+            _d = _fs->_opendir(fullPath);
             if(_d) {
                 _isDirectory = true;
             } else {
@@ -263,10 +415,12 @@ VFSFileImpl::VFSFileImpl(VFSImpl* fs, const char* path, const char* mode)
             _f = fopen(temp, mode);
             if(!_f) {
                 log_e("fopen(%s) failed", temp);
+            } else {
+                _fs->_invalidate(_hash);
+                _written = true;
             }
         }
     }
-    free(temp);
 }
 
 VFSFileImpl::~VFSFileImpl()
@@ -276,6 +430,9 @@ VFSFileImpl::~VFSFileImpl()
 
 void VFSFileImpl::close()
 {
+    if(_written && _hash) {
+        _fs->_invalidate(_hash);
+    }
     if(_path) {
         free(_path);
         _path = NULL;
@@ -296,7 +453,10 @@ VFSFileImpl::operator bool()
 }
 
 time_t VFSFileImpl::getLastWrite() {
-    _getStat() ;
+    //unless written since, the stat taken at open is current
+    if (_written) {
+        _getStat();
+    }
     return _stat.st_mtime;
 }
 
@@ -305,15 +465,10 @@ void VFSFileImpl::_getStat() const
     if(!_path) {
         return;
     }
-    char * temp = (char *)malloc(strlen(_path)+strlen(_fs->_mountpoint)+1);
-    if(!temp) {
-        return;
-    }
-    sprintf(temp,"%s%s", _fs->_mountpoint, _path);
-    if(!stat(temp, &_stat)) {
+    VFSPath temp(_fs->_mountpoint, _path);
+    if(temp && !stat(temp.c_str(), &_stat)) {
         _written = false;
     }
-    free(temp);
 }
 
 size_t VFSFileImpl::write(const uint8_t *buf, size_t size)
@@ -322,6 +477,7 @@ size_t VFSFileImpl::write(const uint8_t *buf, size_t size)
         return 0;
     }
     _written = true;
+    _fs->_invalidate(_hash);
     return fwrite(buf, 1, size, _f);
 }
 
@@ -334,6 +490,42 @@ size_t VFSFileImpl::read(uint8_t* buf, size_t size)
     return fread(buf, 1, size, _f);
 }
 
+/*
+ * fs::File keeps its own aligned buffer when setBufferSize() is used, so the
+ * stdio buffer is switched off to avoid copying every byte twice. setvbuf()
+ * drops read-ahead, hence the position is restored afterwards.
+ * */
+void VFSFileImpl::_unbuffer()
+{
+    if(_unbuffered) {
+        return;
+    }
+    long pos = ftell(_f);
+    setvbuf(_f, NULL, _IONBF, 0);
+    if(pos >= 0) {
+        fseek(_f, pos, SEEK_SET);
+    }
+    _unbuffered = true;
+}
+
+size_t VFSFileImpl::readInto(uint8_t* buf, size_t size)
+{
+    if(_isDirectory || !_f || !buf || !size) {
+        return 0;
+    }
+    _unbuffer();
+    return fread(buf, 1, size, _f);
+}
+
+size_t VFSFileImpl::writeFrom(const uint8_t *buf, size_t size)
+{
+    if(_isDirectory || !_f || !buf || !size) {
+        return 0;
+    }
+    _unbuffer();
+    return write(buf, size);
+}
+
 void VFSFileImpl::flush()
 {
     if(_isDirectory || !_f) {
@@ -365,7 +557,14 @@ size_t VFSFileImpl::size() const
         return 0;
     }
     if (_written) {
-        _getStat();
+        //the open descriptor answers without another path lookup
+        struct stat st;
+        fflush(_f);
+        if(!fstat(fileno(_f), &st)) {
+            _stat.st_size = st.st_size;
+        } else {
+            _getStat();
+        }
     }
     return _stat.st_size;
 }
@@ -22,19 +22,75 @@ extern "C" {
 #include <sys/unistd.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include "freertos/FreeRTOS.h"
 }
 
+//longest mountpoint + path that can be opened
+#ifndef VFS_PATH_MAX
+#define VFS_PATH_MAX 272
+#endif
+
+//number of stat results remembered per file system, 0 disables the cache
+#ifndef VFS_STAT_CACHE_SIZE
+#define VFS_STAT_CACHE_SIZE 32
+#endif
+
+//how long a cached stat result is trusted, for changes made behind this object
+#ifndef VFS_STAT_CACHE_TTL_MS
+#define VFS_STAT_CACHE_TTL_MS 1000
+#endif
+
 using namespace fs;
 
 class VFSFileImpl;
 
+//mountpoint + path built on the stack instead of malloc + sprintf
+class VFSPath
+{
+public:
+    VFSPath(const char * mountpoint, const char * path);
+    operator bool() const { return _len != 0; }
+    const char * c_str() const { return _buf; }
+    uint64_t hash() const;
+protected:
+    char _buf[VFS_PATH_MAX];
+    size_t _len;
+};
+
+typedef struct {
+    uint64_t hash;      //64bit so that two cached paths do not collide in practice
+    uint32_t used;      //LRU stamp, 0 for a free entry
+    uint32_t filled;    //millis() when stat() was asked
+    bool     exists;
+    bool     notDir;    //a miss that did not open as a directory either
+    mode_t   mode;
+    off_t    size;
+    time_t   mtime;
+} vfs_stat_cache_t;
+
 class VFSImpl : public FSImpl
 {
 
 protected:
     friend class VFSFileImpl;
+    vfs_stat_cache_t _cache[VFS_STAT_CACHE_SIZE ? VFS_STAT_CACHE_SIZE : 1];
+    uint32_t _cacheClock;
+    portMUX_TYPE _cacheMux;
+
+    bool _fresh(const vfs_stat_cache_t * e, uint64_t hash, uint32_t now) const
+    {
+        return e->used && e->hash == hash && (now - e->filled) < VFS_STAT_CACHE_TTL_MS;
+    }
+
+    bool _stat(const VFSPath& path, struct stat * st);
+    DIR * _opendir(const VFSPath& path);
+    void _invalidate(uint64_t hash);
 
 public:
+    VFSImpl();
+    using FSImpl::mountpoint;
+    void        mountpoint(const char * mp) override;
+    void        invalidateCache();
     FileImplPtr open(const char* path, const char* mode) override;
     bool        exists(const char* path) override;
     bool        rename(const char* pathFrom, const char* pathTo) override;
@@ -50,17 +106,23 @@ protected:
     FILE *              _f;
     DIR *               _d;
     char *              _path;
+    uint64_t            _hash;
     bool                _isDirectory;
     mutable struct stat _stat;
     mutable bool        _written;
+    bool                _unbuffered;
 
     void _getStat() const;
+    void _unbuffer();
 
 public:
     VFSFileImpl(VFSImpl* fs, const char* path, const char* mode);
+    VFSFileImpl(VFSImpl* fs, const char* path, const VFSPath& fullPath, const char* mode, const struct stat * st);
     ~VFSFileImpl() override;
     size_t      write(const uint8_t *buf, size_t size) override;
     size_t      read(uint8_t* buf, size_t size) override;
+    size_t      readInto(uint8_t* buf, size_t size) override;
+    size_t      writeFrom(const uint8_t* buf, size_t size) override;
     void        flush() override;
     bool        seek(uint32_t pos, SeekMode mode) override;
     size_t      position() const override;
@@ -0,0 +1,83 @@
+/**
+ * ParallelDownload.ino
+ *
+ * Downloads the same file once over a single connection and once with
+ * HTTPDownload over several Range requests, stores it on SPIFFS and
+ * prints the throughput of both.
+ *
+ */
+
+#include <Arduino.h>
+
+#include <WiFi.h>
+#include <WiFiMulti.h>
+
+#include <FS.h>
+#include <SPIFFS.h>
+
+#include <HTTPClient.h>
+#include <HTTPDownload.h>
+
+#define USE_SERIAL Serial
+
+// any large file on a server that supports Range requests
+#define DOWNLOAD_URL "http://192.168.1.12/large.bin"
+
+WiFiMulti wifiMulti;
+
+void report(const char * name, int ret, uint32_t ms) {
+    if(ret < 0) {
+        USE_SERIAL.printf("[%s] failed, error: %s\n", name, HTTPClient::errorToString(ret).c_str());
+        return;
+    }
+    USE_SERIAL.printf("[%s] %d bytes in %u ms, %.1f KB/s\n", name, ret, ms, ms ? (float)ret / ms : 0.0);
+}
+
+void singleConnection() {
+    File file = SPIFFS.open("/single.bin", FILE_WRITE);
+    HTTPClient http;
+    http.begin(DOWNLOAD_URL);
+
+    uint32_t start = millis();
+    int ret = http.GET();
+    if(ret == HTTP_CODE_OK) {
+        ret = http.writeToStream(&file);
+    } else if(ret > 0) {
+        ret = HTTPC_ERROR_UNEXPECTED_STATUS;
+    }
+    report("single", ret, millis() - start);
+    http.end();
+    file.close();
+}
+
+void parallel(uint8_t connections) {
+    File file = SPIFFS.open("/parallel.bin", FILE_WRITE);
+    HTTPDownload download(connections);
+
+    uint32_t start = millis();
+    int ret = download.download(DOWNLOAD_URL, file);
+    report("parallel", ret, millis() - start);
+    file.close();
+}
+
+void setup() {
+
+    USE_SERIAL.begin(115200);
+    USE_SERIAL.println();
+
+    if(!SPIFFS.begin(true)) {
+        USE_SERIAL.println("SPIFFS mount failed");
+        return;
+    }
+
+    wifiMulti.addAP("SSID", "PASSWORD");
+    while(wifiMulti.run() != WL_CONNECTED) {
+        delay(100);
+    }
+
+    singleConnection();
+    parallel(HTTP_DOWNLOAD_CONNECTIONS);
+}
+
+void loop() {
+}
@@ -0,0 +1,174 @@
+/**
+ * HTTPBodyDecoder.cpp
+ *
+ * Incremental decoder for the identity and chunked transfer codings of an
+ * HTTP/1.1 message body.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <string.h>
+#include "HTTPBodyDecoder.h"
+
+/// chunk sizes above 0x7FFFFFF would overflow _remaining
+#define HTTP_CHUNK_SIZE_DIGITS (7)
+
+static int hexValue(uint8_t c)
+{
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if(c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+void HTTPBodyDecoder::begin(bool chunked, int length)
+{
+    _total = 0;
+    _digits = 0;
+    if(chunked) {
+        _state = BODY_CHUNK_SIZE;
+        _remaining = 0;
+    } else {
+        _state = length ? BODY_IDENTITY : BODY_DONE;
+        _remaining = length;
+    }
+}
+
+size_t HTTPBodyDecoder::want(size_t max) const
+{
+    if((_state == BODY_IDENTITY || _state == BODY_CHUNK_DATA) && _remaining >= 0) {
+        // for chunks also take the CRLF and the next size line, they are small
+        size_t left = (_state == BODY_CHUNK_DATA) ? (size_t) _remaining + 2 : (size_t) _remaining;
+        return (left < max) ? left : max;
+    }
+    if(_state == BODY_DONE || _state == BODY_ERROR) {
+        return 0;
+    }
+    return max;
+}
+
+void HTTPBodyDecoder::eof()
+{
+    if(untilClose()) {
+        _state = BODY_DONE;
+    } else if(_state != BODY_DONE) {
+        _state = BODY_ERROR;
+    }
+}
+
+size_t HTTPBodyDecoder::decode(uint8_t * data, size_t len, size_t * payload)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while(in < len && _state != BODY_DONE && _state != BODY_ERROR) {
+        switch(_state) {
+        case BODY_IDENTITY:
+        case BODY_CHUNK_DATA: {
+            size_t n = len - in;
+            if(_remaining >= 0 && n > (size_t) _remaining) {
+                n = _remaining;
+            }
+            if(out != in) {
+                memmove(data + out, data + in, n);
+            }
+            in += n;
+            out += n;
+            if(_remaining >= 0) {
+                _remaining -= n;
+                if(_remaining == 0) {
+                    _state = (_state == BODY_IDENTITY) ? BODY_DONE : BODY_CHUNK_CR;
+                }
+            }
+            break;
+        }
+
+        case BODY_CHUNK_SIZE: {
+            uint8_t c = data[in++];
+            int v = hexValue(c);
+            if(v >= 0) {
+                if(++_digits > HTTP_CHUNK_SIZE_DIGITS) {
+                    _state = BODY_ERROR;
+                    break;
+                }
+                _remaining = (_remaining << 4) | v;
+            } else if(!_digits) {
+                _state = BODY_ERROR;
+            } else if(c == '\n') {
+                _state = _remaining ? BODY_CHUNK_DATA : BODY_TRAILER_START;
+            } else {
+                // ';' extensions and whitespace up to the end of the line are ignored
+                _state = BODY_CHUNK_EXT;
+            }
+            break;
+        }
+
+        case BODY_CHUNK_EXT:
+            if(data[in++] == '\n') {
+                _state = _remaining ? BODY_CHUNK_DATA : BODY_TRAILER_START;
+            }
+            break;
+
+        case BODY_CHUNK_CR:
+            if(data[in] == '\r') {
+                in++;
+                _state = BODY_CHUNK_LF;
+                break;
+            }
+            // a bare LF is accepted as well
+            _state = BODY_CHUNK_LF;
+            // fall through
+        case BODY_CHUNK_LF:
+            if(data[in++] != '\n') {
+                _state = BODY_ERROR;
+                break;
+            }
+            _state = BODY_CHUNK_SIZE;
+            _remaining = 0;
+            _digits = 0;
+            break;
+
+        case BODY_TRAILER_START: {
+            uint8_t c = data[in++];
+            if(c == '\n') {
+                _state = BODY_DONE;
+            } else if(c != '\r') {
+                _state = BODY_TRAILER;
+            }
+            break;
+        }
+
+        case BODY_TRAILER:
+            if(data[in++] == '\n') {
+                _state = BODY_TRAILER_START;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    _total += out;
+    if(payload) {
+        *payload = out;
+    }
+    return in;
+}
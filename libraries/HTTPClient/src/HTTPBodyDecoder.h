@@ -0,0 +1,85 @@
+/**
+ * HTTPBodyDecoder.h
+ *
+ * Incremental decoder for the identity and chunked transfer codings of an
+ * HTTP/1.1 message body.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef HTTPBodyDecoder_H_
+#define HTTPBodyDecoder_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * The decoder keeps no buffer of its own. decode() is fed the raw bytes as
+ * they come from the connection, in pieces of any size, and moves the payload
+ * bytes to the front of the same buffer, dropping chunk sizes, extensions,
+ * CRLFs and trailers. It does not depend on the network, so it can be fed
+ * recorded responses.
+ */
+class HTTPBodyDecoder
+{
+public:
+    typedef enum {
+        BODY_IDENTITY,          // payload up to the length or the end of the connection
+        BODY_CHUNK_SIZE,        // hex digits of the chunk size
+        BODY_CHUNK_EXT,         // ";ext=value" up to the end of the size line
+        BODY_CHUNK_DATA,
+        BODY_CHUNK_CR,          // CRLF after the chunk data
+        BODY_CHUNK_LF,
+        BODY_TRAILER_START,     // start of a trailer line, an empty one ends the body
+        BODY_TRAILER,
+        BODY_DONE,
+        BODY_ERROR
+    } state_t;
+
+    /// length is the Content-Length, -1 when the body ends with the connection
+    void begin(bool chunked, int length);
+
+    /**
+     * decode raw bytes in place
+     * @param data raw bytes, the payload is written back to its start
+     * @param len number of raw bytes
+     * @param payload number of payload bytes now at the start of data
+     * @return raw bytes consumed, less than len only when the body ended
+     */
+    size_t decode(uint8_t * data, size_t len, size_t * payload);
+
+    /// most raw bytes worth reading now without reading past the body
+    size_t want(size_t max) const;
+
+    /// connection was closed by the server, completes a body without length
+    void eof();
+
+    bool done() const { return _state == BODY_DONE; }
+    bool failed() const { return _state == BODY_ERROR; }
+    state_t state() const { return _state; }
+    bool untilClose() const { return _state == BODY_IDENTITY && _remaining < 0; }
+
+    /// payload bytes decoded since begin()
+    uint32_t total() const { return _total; }
+
+protected:
+    state_t _state = BODY_DONE;
+    int32_t _remaining = 0;     // of the identity body or the current chunk, -1 for unknown
+    uint8_t _digits = 0;        // in the current chunk size
+    uint32_t _total = 0;
+};
+
+#endif /* HTTPBodyDecoder_H_ */
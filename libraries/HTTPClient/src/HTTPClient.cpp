@@ -26,6 +26,7 @@
 
 #include <Arduino.h>
 #include <esp32-hal-log.h>  
+#include <lwip/sockets.h>
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <StreamString.h>
@@ -49,6 +50,11 @@ public:
     {
         return true;
     }
+
+    virtual String poolKey(const String& host, uint16_t port)
+    {
+        return String("http://") + host + ':' + String(port);
+    }
 };
 
 class TLSTraits : public TransportTraits
@@ -57,6 +63,9 @@ public:
     TLSTraits(const char* CAcert, const char* clicert = nullptr, const char* clikey = nullptr) :
         _cacert(CAcert), _clicert(clicert), _clikey(clikey)
     {
+        _tlsHash[0] = _pemHash(CAcert);
+        _tlsHash[1] = _pemHash(clicert);
+        _tlsHash[2] = _pemHash(clikey);
     }
 
     std::unique_ptr<WiFiClient> create() override
@@ -73,10 +82,33 @@ public:
          return true;
     }
 
+    String poolKey(const String& host, uint16_t port) override
+    {
+        // connections are only shared between clients with the same credentials,
+        // wherever their PEM strings are kept
+        char tls[30];
+        snprintf(tls, sizeof(tls), "#%08x:%08x:%08x", (unsigned)_tlsHash[0], (unsigned)_tlsHash[1], (unsigned)_tlsHash[2]);
+        return String("https://") + host + ':' + String(port) + tls;
+    }
+
 protected:
+    // FNV-1a of a PEM string, 0 when there is none
+    static uint32_t _pemHash(const char* pem)
+    {
+        if(!pem) {
+            return 0;
+        }
+        uint32_t hash = 2166136261UL;
+        while(*pem) {
+            hash = (hash ^ (uint8_t)*pem++) * 16777619UL;
+        }
+        return hash;
+    }
+
     const char* _cacert;
     const char* _clicert;
     const char* _clikey;
+    uint32_t _tlsHash[3];
 };
 
 /**
@@ -91,12 +123,15 @@ HTTPClient::HTTPClient()
  */
 HTTPClient::~HTTPClient()
 {
-    if(_tcp) {
+    if(_tcp && !returnToPool()) {
         _tcp->stop();
     }
     if(_currentHeaders) {
         delete[] _currentHeaders;
     }
+    if(_bodyBuffer) {
+        free(_bodyBuffer);
+    }
 }
 
 void HTTPClient::clear()
@@ -230,6 +265,10 @@ bool HTTPClient::begin(String host, uint16_t port, String uri, const char* CAcer
 void HTTPClient::end(void)
 {
     if(connected()) {
+        if(!(_reuse && _canReuse) && returnToPool()) {
+            log_d("tcp returned to pool");
+            return;
+        }
         if(_tcp->available() > 0) {
             log_d("still data in buffer (%d), clean up.", _tcp->available());
             _tcp->flush();
@@ -245,6 +284,22 @@ void HTTPClient::end(void)
     }
 }
 
+/**
+ * hand the connection to HTTPConnectionPool if the response was read completely
+ * @return true if the pool took it
+ */
+bool HTTPClient::returnToPool()
+{
+    if(!_tcp || !_transportTraits || !_canReuse || !_responseDone || !HTTPConnectionPool::enabled()) {
+        return false;
+    }
+    if(!_tcp->connected() || _tcp->available() > 0) {
+        return false;
+    }
+    _pooled = false;
+    return HTTPConnectionPool::give(_transportTraits->poolKey(_host, _port), _tcp);
+}
+
 /**
  * connected
  * @return connected status
@@ -600,73 +655,145 @@ int HTTPClient::writeToStream(Stream * stream)
         return returnError(HTTPC_ERROR_NOT_CONNECTED);
     }
 
-    // get length of document (is -1 when Server sends no Content-Length header)
-    int len = _size;
-    int ret = 0;
+    if(_transferEncoding != HTTPC_TE_IDENTITY && _transferEncoding != HTTPC_TE_CHUNKED) {
+        return returnError(HTTPC_ERROR_ENCODING);
+    }
 
-    if(_transferEncoding == HTTPC_TE_IDENTITY) {
-        ret = writeToStreamDataBlock(stream, len);
+    if(!_bodyBuffer) {
+        _bodyBuffer = (uint8_t *) malloc(HTTP_TCP_BUFFER_SIZE);
+        if(!_bodyBuffer) {
+            log_w("too less ram! need %d", HTTP_TCP_BUFFER_SIZE);
+            return returnError(HTTPC_ERROR_TOO_LESS_RAM);
+        }
+    }
 
-        // have we an error?
-        if(ret < 0) {
-            return returnError(ret);
+    int ret = 0;
+    while(1) {
+        int len = readBody(_bodyBuffer, HTTP_TCP_BUFFER_SIZE);
+        if(len < 0) {
+            // readBody closed the connection already
+            return len;
         }
-    } else if(_transferEncoding == HTTPC_TE_CHUNKED) {
-        int size = 0;
-        while(1) {
-            if(!connected()) {
-                return returnError(HTTPC_ERROR_CONNECTION_LOST);
-            }
-            String chunkHeader = _tcp->readStringUntil('\n');
+        if(len == 0) {
+            break;
+        }
+        int r = writeToStreamDataBlock(stream, _bodyBuffer, len);
+        if(r < 0) {
+            return returnError(r);
+        }
+        ret += r;
+    }
 
-            if(chunkHeader.length() <= 0) {
-                return returnError(HTTPC_ERROR_READ_TIMEOUT);
-            }
+    // if no length Header use global chunk size
+    if(_transferEncoding == HTTPC_TE_CHUNKED && _size <= 0) {
+        _size = ret;
+    }
 
-            chunkHeader.trim(); // remove \r
+    // the decoder stops identity bodies at their length, a chunked one may disagree with it
+    if(_transferEncoding == HTTPC_TE_CHUNKED && ret != _size) {
+        log_d("bytesWritten %d and size %d mismatch!.", ret, _size);
+        return returnError(HTTPC_ERROR_STREAM_WRITE);
+    }
 
-            // read size of chunk
-            len = (uint32_t) strtol((const char *) chunkHeader.c_str(), NULL, 16);
-            size += len;
-            log_d(" read chunk len: %d", len);
+    end();
+    return ret;
+}
 
-            // data left?
-            if(len > 0) {
-                int r = writeToStreamDataBlock(stream, len);
-                if(r < 0) {
-                    // error in writeToStreamDataBlock
-                    return returnError(r);
-                }
-                ret += r;
-            } else {
+/**
+ * read the next part of the message body, with the transfer coding removed
+ * the payload is read straight into buff, nothing is allocated
+ * @param buff uint8_t *
+ * @param size size_t
+ * @return bytes read, 0 at the end of the body ( negative values are error codes )
+ */
+int HTTPClient::readBody(uint8_t * buff, size_t size)
+{
+    if(!buff || !size) {
+        return 0;
+    }
 
-                // if no length Header use global chunk size
-                if(_size <= 0) {
-                    _size = size;
-                }
+    unsigned long start = millis();
+    while(!_body.done()) {
+        if(_body.failed()) {
+            return returnError(HTTPC_ERROR_ENCODING);
+        }
+        if(!_tcp) {
+            return returnError(HTTPC_ERROR_NOT_CONNECTED);
+        }
 
-                // check if we have write all data out
-                if(ret != _size) {
-                    return returnError(HTTPC_ERROR_STREAM_WRITE);
+        int sizeAvailable = _tcp->available();
+        if(sizeAvailable <= 0) {
+            if(!_tcp->connected()) {
+                // completes a body without length, anything else was cut short
+                _body.eof();
+                if(_body.done()) {
+                    break;
                 }
-                break;
+                return returnError(HTTPC_ERROR_CONNECTION_LOST);
             }
-
-            // read trailing \r\n at the end of the chunk
-            char buf[2];
-            auto trailing_seq_len = _tcp->readBytes((uint8_t*)buf, 2);
-            if (trailing_seq_len != 2 || buf[0] != '\r' || buf[1] != '\n') {
+            unsigned long waited = millis() - start;
+            if(waited >= _tcpTimeout) {
                 return returnError(HTTPC_ERROR_READ_TIMEOUT);
             }
+            waitForData(_tcpTimeout - waited);
+            continue;
+        }
 
-            delay(0);
+        size_t readBytes = _body.want(size);
+        if(readBytes > (size_t) sizeAvailable) {
+            readBytes = sizeAvailable;
         }
-    } else {
-        return returnError(HTTPC_ERROR_ENCODING);
+        int bytesRead = _tcp->read(buff, readBytes);
+        if(bytesRead <= 0) {
+            continue;
+        }
+
+        size_t payload = 0;
+        size_t used = _body.decode(buff, bytesRead, &payload);
+        if(used < (size_t) bytesRead) {
+            log_w("dropped %d bytes after the end of the body", bytesRead - used);
+            _canReuse = false;
+        }
+        if(payload) {
+            return payload;
+        }
+        start = millis();
     }
 
-    end();
-    return ret;
+    _responseDone = true;
+    return 0;
+}
+
+/**
+ * wait until the connection has data or was closed
+ * @param timeout ms
+ * @return true if there is something to read
+ */
+bool HTTPClient::waitForData(uint32_t timeout)
+{
+    int fd = _tcp->fd();
+    if(fd < 0) {
+        // TLS connections buffer inside mbedtls, there is no socket to wait on
+        delay(1);
+        return _tcp->available() > 0;
+    }
+
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(fd, &readSet);
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if(select(fd + 1, &readSet, NULL, NULL, &tv) <= 0) {
+        return false;
+    }
+    if(_tcp->available() <= 0) {
+        // readable with nothing to read, the server closed the connection
+        log_d("connection closed by server");
+        _tcp->stop();
+        return false;
+    }
+    return true;
 }
 
 /**
@@ -719,6 +846,8 @@ String HTTPClient::errorToString(int error)
         return F("Stream write error");
     case HTTPC_ERROR_READ_TIMEOUT:
         return F("read Timeout");
+    case HTTPC_ERROR_UNEXPECTED_STATUS:
+        return F("unexpected status code");
     default:
         return String();
     }
@@ -833,6 +962,14 @@ bool HTTPClient::connect(void)
         return false;
     }
 
+    _tcp = HTTPConnectionPool::take(_transportTraits->poolKey(_host, _port));
+    if(_tcp) {
+        _pooled = true;
+        setTimeout(_tcpTimeout);
+        return true;
+    }
+    _pooled = false;
+
     _tcp = _transportTraits->create();
 	
 
@@ -887,7 +1024,7 @@ bool HTTPClient::sendHeader(const char * type)
     header += String(F("\r\nUser-Agent: ")) + _userAgent +
               F("\r\nConnection: ");
 
-    if(_reuse) {
+    if(_reuse || HTTPConnectionPool::enabled()) {
         header += F("keep-alive");
     } else {
         header += F("close");
@@ -907,7 +1044,18 @@ bool HTTPClient::sendHeader(const char * type)
 
     header += _headers + "\r\n";
 
-    return (_tcp->write((const uint8_t *) header.c_str(), header.length()) == header.length());
+    if(_tcp->write((const uint8_t *) header.c_str(), header.length()) == header.length()) {
+        return true;
+    }
+    if(_pooled) {
+        // the server dropped the idle connection in the meantime, use a new one
+        log_d("pooled connection failed, reconnecting");
+        _tcp->stop();
+        _tcp.reset();
+        _pooled = false;
+        return connect() && (_tcp->write((const uint8_t *) header.c_str(), header.length()) == header.length());
+    }
+    return false;
 }
 
 /**
@@ -924,6 +1072,8 @@ int HTTPClient::handleHeaderResponse()
     String transferEncoding;
     _returnCode = -1;
     _size = -1;
+    _canReuse = false;
+    _responseDone = false;
     _transferEncoding = HTTPC_TE_IDENTITY;
     unsigned long lastDataTime = millis();
 
@@ -939,6 +1089,8 @@ int HTTPClient::handleHeaderResponse()
 
             if(headerLine.startsWith("HTTP/1.")) {
                 _returnCode = headerLine.substring(9, headerLine.indexOf(' ', 9)).toInt();
+                // HTTP/1.1 connections are persistent unless the server says otherwise
+                _canReuse = !_useHTTP10 && headerLine.startsWith("HTTP/1.1");
             } else if(headerLine.indexOf(':')) {
                 String headerName = headerLine.substring(0, headerLine.indexOf(':'));
                 String headerValue = headerLine.substring(headerLine.indexOf(':') + 1);
@@ -949,7 +1101,11 @@ int HTTPClient::handleHeaderResponse()
                 }
 
                 if(headerName.equalsIgnoreCase("Connection")) {
-                    _canReuse = headerValue.equalsIgnoreCase("keep-alive");
+                    if(headerValue.equalsIgnoreCase("keep-alive")) {
+                        _canReuse = true;
+                    } else if(headerValue.equalsIgnoreCase("close")) {
+                        _canReuse = false;
+                    }
                 }
 
                 if(headerName.equalsIgnoreCase("Transfer-Encoding")) {
@@ -982,6 +1138,11 @@ int HTTPClient::handleHeaderResponse()
                     _transferEncoding = HTTPC_TE_IDENTITY;
                 }
 
+                // 204 and 304 never have a body, whatever the header says
+                bool noBody = (_returnCode == HTTP_CODE_NO_CONTENT || _returnCode == HTTP_CODE_NOT_MODIFIED);
+                _body.begin(!noBody && _transferEncoding == HTTPC_TE_CHUNKED, noBody ? 0 : _size);
+                _responseDone = _body.done();
+
                 if(_returnCode) {
                     return _returnCode;
                 } else {
@@ -991,10 +1152,12 @@ int HTTPClient::handleHeaderResponse()
             }
 
         } else {
-            if((millis() - lastDataTime) > _tcpTimeout) {
+            unsigned long waited = millis() - lastDataTime;
+            if(waited > _tcpTimeout) {
                 return HTTPC_ERROR_READ_TIMEOUT;
             }
-            delay(10);
+            // wake up as soon as the response comes in rather than polling
+            waitForData(_tcpTimeout - waited);
         }
     }
 
@@ -1004,110 +1167,47 @@ int HTTPClient::handleHeaderResponse()
 /**
  * write one Data Block to Stream
  * @param stream Stream *
- * @param size int
+ * @param buff const uint8_t *
+ * @param len int
  * @return < 0 = error >= 0 = size written
  */
-int HTTPClient::writeToStreamDataBlock(Stream * stream, int size)
+int HTTPClient::writeToStreamDataBlock(Stream * stream, const uint8_t * buff, int len)
 {
-    int buff_size = HTTP_TCP_BUFFER_SIZE;
-    int len = size;
-    int bytesWritten = 0;
-
-    // if possible create smaller buffer then HTTP_TCP_BUFFER_SIZE
-    if((len > 0) && (len < HTTP_TCP_BUFFER_SIZE)) {
-        buff_size = len;
-    }
-
-    // create buffer for read
-    uint8_t * buff = (uint8_t *) malloc(buff_size);
-
-    if(buff) {
-        // read all data from server
-        while(connected() && (len > 0 || len == -1)) {
-
-            // get available data size
-            size_t sizeAvailable = _tcp->available();
-
-            if(sizeAvailable) {
-
-                int readBytes = sizeAvailable;
-
-                // read only the asked bytes
-                if(len > 0 && readBytes > len) {
-                    readBytes = len;
-                }
-
-                // not read more the buffer can handle
-                if(readBytes > buff_size) {
-                    readBytes = buff_size;
-                }
-
-                // read data
-                int bytesRead = _tcp->readBytes(buff, readBytes);
-
-                // write it to Stream
-                int bytesWrite = stream->write(buff, bytesRead);
-                bytesWritten += bytesWrite;
-
-                // are all Bytes a writen to stream ?
-                if(bytesWrite != bytesRead) {
-                    log_d("short write asked for %d but got %d retry...", bytesRead, bytesWrite);
-
-                    // check for write error
-                    if(stream->getWriteError()) {
-                        log_d("stream write error %d", stream->getWriteError());
-
-                        //reset write error for retry
-                        stream->clearWriteError();
-                    }
+    // write it to Stream
+    int bytesWritten = stream->write(buff, len);
 
-                    // some time for the stream
-                    delay(1);
+    // are all Bytes a writen to stream ?
+    if(bytesWritten != len) {
+        log_d("short write asked for %d but got %d retry...", len, bytesWritten);
 
-                    int leftBytes = (readBytes - bytesWrite);
-
-                    // retry to send the missed bytes
-                    bytesWrite = stream->write((buff + bytesWrite), leftBytes);
-                    bytesWritten += bytesWrite;
+        // check for write error
+        if(stream->getWriteError()) {
+            log_d("stream write error %d", stream->getWriteError());
 
-                    if(bytesWrite != leftBytes) {
-                        // failed again
-                        log_w("short write asked for %d but got %d failed.", leftBytes, bytesWrite);
-                        free(buff);
-                        return HTTPC_ERROR_STREAM_WRITE;
-                    }
-                }
-
-                // check for write error
-                if(stream->getWriteError()) {
-                    log_w("stream write error %d", stream->getWriteError());
-                    free(buff);
-                    return HTTPC_ERROR_STREAM_WRITE;
-                }
-
-                // count bytes to read left
-                if(len > 0) {
-                    len -= readBytes;
-                }
-
-                delay(0);
-            } else {
-                delay(1);
-            }
+            //reset write error for retry
+            stream->clearWriteError();
         }
 
-        free(buff);
+        // some time for the stream
+        delay(1);
+
+        int leftBytes = (len - bytesWritten);
 
-        log_d("connection closed or file end (written: %d).", bytesWritten);
+        // retry to send the missed bytes
+        int bytesWrite = stream->write((buff + bytesWritten), leftBytes);
+        bytesWritten += bytesWrite;
 
-        if((size > 0) && (size != bytesWritten)) {
-            log_d("bytesWritten %d and size %d mismatch!.", bytesWritten, size);
+        if(bytesWrite != leftBytes) {
+            // failed again
+            log_w("short write asked for %d but got %d failed.", leftBytes, bytesWrite);
             return HTTPC_ERROR_STREAM_WRITE;
         }
+    }
 
-    } else {
-        log_w("too less ram! need %d", HTTP_TCP_BUFFER_SIZE);
-        return HTTPC_ERROR_TOO_LESS_RAM;
+    // check for write error
+    if(stream->getWriteError()) {
+        log_w("stream write error %d", stream->getWriteError());
+        return HTTPC_ERROR_STREAM_WRITE;
     }
 
     return bytesWritten;
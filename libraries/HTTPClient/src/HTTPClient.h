@@ -31,6 +31,8 @@
 #include <Arduino.h>
 #include <WiFiClient.h>
 #include <WiFiClientSecure.h>
+#include "HTTPConnectionPool.h"
+#include "HTTPBodyDecoder.h"
 
 #define HTTPCLIENT_DEFAULT_TCP_TIMEOUT (5000)
 
@@ -46,6 +48,7 @@
 #define HTTPC_ERROR_ENCODING            (-9)
 #define HTTPC_ERROR_STREAM_WRITE        (-10)
 #define HTTPC_ERROR_READ_TIMEOUT        (-11)
+#define HTTPC_ERROR_UNEXPECTED_STATUS   (-12)
 
 /// size for the stream handling
 #define HTTP_TCP_BUFFER_SIZE (1460)
@@ -171,6 +174,7 @@ public:
     WiFiClient* getStreamPtr(void);
     int writeToStream(Stream* stream);
     String getString(void);
+    int readBody(uint8_t * buff, size_t size);
 
     static String errorToString(int error);
 
@@ -186,7 +190,9 @@ protected:
     bool connect(void);
     bool sendHeader(const char * type);
     int handleHeaderResponse();
-    int writeToStreamDataBlock(Stream * stream, int len);
+    int writeToStreamDataBlock(Stream * stream, const uint8_t * buff, int len);
+    bool waitForData(uint32_t timeout);
+    bool returnToPool();
 
 
     TransportTraitsPtr _transportTraits;
@@ -213,7 +219,11 @@ protected:
     int _returnCode = 0;
     int _size = -1;
     bool _canReuse = false;
+    bool _responseDone = false;     // whole body was read, the connection can carry another request
+    bool _pooled = false;           // connection was taken from HTTPConnectionPool
     transferEncoding_t _transferEncoding = HTTPC_TE_IDENTITY;
+    HTTPBodyDecoder _body;
+    uint8_t * _bodyBuffer = nullptr;  // HTTP_TCP_BUFFER_SIZE, kept for the life of the client
 };
 
 
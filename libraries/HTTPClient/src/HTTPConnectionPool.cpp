@@ -0,0 +1,211 @@
+/**
+ * HTTPConnectionPool.cpp
+ *
+ * Process wide pool of idle keep-alive connections shared by all HTTPClient
+ * instances.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "HTTPConnectionPool.h"
+
+#include <esp32-hal-log.h>
+#include <lwip/sockets.h>
+#include <errno.h>
+
+#define POOL_LOCK()    do {} while (xSemaphoreTake(s_lock, portMAX_DELAY) != pdPASS)
+#define POOL_UNLOCK()  xSemaphoreGive(s_lock)
+
+struct PoolEntry {
+    String key;
+    std::unique_ptr<WiFiClient> client;
+    unsigned long idleSince;
+};
+
+static PoolEntry s_entries[HTTP_POOL_SIZE];
+static SemaphoreHandle_t s_lock = NULL;
+static uint8_t s_max = 0;
+static uint32_t s_idleTimeout = HTTP_POOL_IDLE_TIMEOUT;
+static http_pool_stats_t s_stats;
+
+/**
+ * a pooled connection is only usable if the server has neither closed it
+ * nor sent anything since the last response
+ */
+static bool poolAlive(WiFiClient& client)
+{
+    if(!client.connected() || client.available() > 0) {
+        return false;
+    }
+    int fd = client.fd();
+    if(fd >= 0) {
+        uint8_t dummy;
+        int res = recv(fd, &dummy, 1, MSG_PEEK | MSG_DONTWAIT);
+        if(res >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * move timed out connections to expired, called with the lock held
+ */
+static void poolSweep(std::unique_ptr<WiFiClient> expired[HTTP_POOL_SIZE])
+{
+    unsigned long now = millis();
+    for(uint8_t i = 0; i < HTTP_POOL_SIZE; i++) {
+        if(s_entries[i].client && (now - s_entries[i].idleSince) > s_idleTimeout) {
+            expired[i] = std::move(s_entries[i].client);
+            s_stats.evicted++;
+        }
+    }
+}
+
+static void poolClose(std::unique_ptr<WiFiClient> clients[HTTP_POOL_SIZE])
+{
+    for(uint8_t i = 0; i < HTTP_POOL_SIZE; i++) {
+        if(clients[i]) {
+            clients[i]->stop();
+            clients[i].reset();
+        }
+    }
+}
+
+void HTTPConnectionPool::begin(uint8_t maxConnections, uint32_t idleTimeout)
+{
+    if(!s_lock) {
+        s_lock = xSemaphoreCreateMutex();
+        if(!s_lock) {
+            log_e("could not create the pool lock");
+            return;
+        }
+    }
+    POOL_LOCK();
+    s_max = (maxConnections > HTTP_POOL_SIZE) ? HTTP_POOL_SIZE : maxConnections;
+    s_idleTimeout = idleTimeout;
+    POOL_UNLOCK();
+}
+
+void HTTPConnectionPool::end()
+{
+    if(!s_lock) {
+        return;
+    }
+    std::unique_ptr<WiFiClient> closed[HTTP_POOL_SIZE];
+    POOL_LOCK();
+    s_max = 0;
+    for(uint8_t i = 0; i < HTTP_POOL_SIZE; i++) {
+        closed[i] = std::move(s_entries[i].client);
+    }
+    POOL_UNLOCK();
+    poolClose(closed);
+}
+
+bool HTTPConnectionPool::enabled()
+{
+    return s_max != 0;
+}
+
+void HTTPConnectionPool::getStats(http_pool_stats_t * stats)
+{
+    if(stats) {
+        *stats = s_stats;
+    }
+}
+
+void HTTPConnectionPool::resetStats()
+{
+    memset(&s_stats, 0, sizeof(s_stats));
+}
+
+std::unique_ptr<WiFiClient> HTTPConnectionPool::take(const String& key)
+{
+    std::unique_ptr<WiFiClient> client;
+    if(!enabled()) {
+        return client;
+    }
+    std::unique_ptr<WiFiClient> expired[HTTP_POOL_SIZE];
+    for(;;) {
+        POOL_LOCK();
+        poolSweep(expired);
+        // newest first, it is the least likely to have been closed by the server
+        int found = -1;
+        for(uint8_t i = 0; i < HTTP_POOL_SIZE; i++) {
+            if(s_entries[i].client && s_entries[i].key == key &&
+               (found < 0 || s_entries[i].idleSince > s_entries[found].idleSince)) {
+                found = i;
+            }
+        }
+        if(found >= 0) {
+            client = std::move(s_entries[found].client);
+        }
+        POOL_UNLOCK();
+
+        if(!client) {
+            s_stats.misses++;
+            break;
+        }
+        if(poolAlive(*client)) {
+            s_stats.hits++;
+            log_d("reusing pooled connection to %s", key.c_str());
+            break;
+        }
+        s_stats.stale++;
+        client->stop();
+        client.reset();
+    }
+    poolClose(expired);
+    return client;
+}
+
+bool HTTPConnectionPool::give(const String& key, std::unique_ptr<WiFiClient>& client)
+{
+    if(!enabled() || !client) {
+        return false;
+    }
+    std::unique_ptr<WiFiClient> expired[HTTP_POOL_SIZE];
+    POOL_LOCK();
+    poolSweep(expired);
+    int slot = -1;
+    int oldest = -1;
+    uint8_t used = 0;
+    for(uint8_t i = 0; i < HTTP_POOL_SIZE; i++) {
+        if(!s_entries[i].client) {
+            if(slot < 0) {
+                slot = i;
+            }
+        } else {
+            used++;
+            if(oldest < 0 || s_entries[i].idleSince < s_entries[oldest].idleSince) {
+                oldest = i;
+            }
+        }
+    }
+    if(used >= s_max) {
+        // full, make room by closing the connection idle for longest
+        expired[oldest] = std::move(s_entries[oldest].client);
+        s_stats.evicted++;
+        slot = oldest;
+    }
+    s_entries[slot].key = key;
+    s_entries[slot].client = std::move(client);
+    s_entries[slot].idleSince = millis();
+    s_stats.returned++;
+    POOL_UNLOCK();
+    poolClose(expired);
+    return true;
+}
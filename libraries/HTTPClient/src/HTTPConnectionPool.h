@@ -0,0 +1,67 @@
+/**
+ * HTTPConnectionPool.h
+ *
+ * Process wide pool of idle keep-alive connections shared by all HTTPClient
+ * instances.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef HTTPConnectionPool_H_
+#define HTTPConnectionPool_H_
+
+#include <memory>
+#include <Arduino.h>
+#include <WiFiClient.h>
+
+/// most idle connections that can be kept
+#ifndef HTTP_POOL_SIZE
+#define HTTP_POOL_SIZE (4)
+#endif
+
+/// ms an idle connection is kept before it is closed
+#define HTTP_POOL_IDLE_TIMEOUT (30000)
+
+typedef struct {
+    uint32_t hits;          // requests that got a pooled connection
+    uint32_t misses;        // requests that had to connect
+    uint32_t stale;         // pooled connections found closed by the server
+    uint32_t returned;      // connections put back after a complete response
+    uint32_t evicted;       // idle connections closed for timeout or room
+} http_pool_stats_t;
+
+/**
+ * Once begin() was called every HTTPClient asks for keep-alive, takes an idle
+ * connection to the same scheme, host, port and TLS settings from the pool
+ * when there is one, and puts its connection back after the response was
+ * read completely (writeToStream()/getString() followed by end()).
+ */
+class HTTPConnectionPool
+{
+public:
+    static void begin(uint8_t maxConnections = HTTP_POOL_SIZE, uint32_t idleTimeout = HTTP_POOL_IDLE_TIMEOUT);
+    static void end();
+    static bool enabled();
+
+    static void getStats(http_pool_stats_t * stats);
+    static void resetStats();
+
+    /// used by HTTPClient
+    static std::unique_ptr<WiFiClient> take(const String& key);
+    static bool give(const String& key, std::unique_ptr<WiFiClient>& client);
+};
+
+#endif /* HTTPConnectionPool_H_ */
@@ -0,0 +1,376 @@
+/**
+ * HTTPDownload.cpp
+ *
+ * Downloads a large resource over several connections with Range requests
+ * and writes it in order to a Stream or a callback.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "HTTPDownload.h"
+
+#include <esp32-hal-log.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define JOB_LOCK(j)    do {} while (xSemaphoreTake((j)->lock, portMAX_DELAY) != pdPASS)
+#define JOB_UNLOCK(j)  xSemaphoreGive((j)->lock)
+
+#define HTTP_DOWNLOAD_MAX_SLOTS (2 * HTTP_DOWNLOAD_MAX_CONNECTIONS)
+
+typedef struct {
+    uint8_t * data;
+    size_t len;
+    int32_t segment;        // -1 when free
+    bool ready;             // filled, waiting to be written
+} HTTPDownloadSlot;
+
+struct HTTPDownloadJob {
+    HTTPDownload * owner;
+    String url;
+    uint32_t total;
+    uint32_t segments;
+    uint32_t next;          // next segment to hand to a worker
+    volatile int error;     // first error, stops the workers
+    HTTPDownloadSlot slots[HTTP_DOWNLOAD_MAX_SLOTS];
+    uint8_t slotCount;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t freeSlots;    // counts slots a worker can fill
+    SemaphoreHandle_t ready;        // given when a slot was filled or a worker failed
+    SemaphoreHandle_t exited;       // counts finished workers
+};
+
+HTTPDownload::HTTPDownload(uint8_t connections, size_t segmentSize)
+{
+    _connections = (connections < 1) ? 1 : ((connections > HTTP_DOWNLOAD_MAX_CONNECTIONS) ? HTTP_DOWNLOAD_MAX_CONNECTIONS : connections);
+    _segmentSize = segmentSize ? segmentSize : HTTP_DOWNLOAD_SEGMENT_SIZE;
+}
+
+void HTTPDownload::setCACert(const char * CAcert)
+{
+    _cacert = CAcert;
+}
+
+void HTTPDownload::setRetries(uint8_t retries)
+{
+    _retries = retries;
+}
+
+void HTTPDownload::setTimeout(uint16_t timeout)
+{
+    _timeout = timeout;
+}
+
+void HTTPDownload::onStart(HTTPDownloadStartCb cb)
+{
+    _start = cb;
+}
+
+bool HTTPDownload::beginClient(HTTPClient& http, const String& url)
+{
+    bool ok = _cacert ? http.begin(url, _cacert) : http.begin(url);
+    if(ok) {
+        http.setReuse(true);
+        http.setTimeout(_timeout);
+    }
+    return ok;
+}
+
+int HTTPDownload::download(const String& url, Stream& sink)
+{
+    return download(url, [&sink](const uint8_t * data, size_t len) {
+        return sink.write(data, len) == len;
+    });
+}
+
+/**
+ * the server ignored the Range header, read the body it sent instead
+ */
+int HTTPDownload::downloadSingle(HTTPClient& http, HTTPDownloadSinkCb& sink)
+{
+    _size = http.getSize();
+    if(_start && !_start(_size)) {
+        http.end();
+        return HTTPC_ERROR_STREAM_WRITE;
+    }
+
+    uint8_t * buff = (uint8_t *) malloc(_segmentSize);
+    if(!buff) {
+        log_e("too less ram! need %u", (unsigned)_segmentSize);
+        http.end();
+        return HTTPC_ERROR_TOO_LESS_RAM;
+    }
+    int written = 0;
+    int len;
+    while((len = http.readBody(buff, _segmentSize)) > 0) {
+        if(!sink(buff, len)) {
+            len = HTTPC_ERROR_STREAM_WRITE;
+            break;
+        }
+        written += len;
+    }
+    free(buff);
+    http.end();
+    return (len < 0) ? len : written;
+}
+
+/**
+ * fill buff with len bytes from offset, on failure only the missing part is requested again
+ * @return len or an HTTPC_ERROR_* code
+ */
+int HTTPDownload::fetchRange(HTTPDownloadJob * job, HTTPClient& http, uint32_t offset, uint8_t * buff, size_t len)
+{
+    size_t got = 0;
+    uint8_t attempt = 0;
+    int error = 0;
+
+    while(got < len) {
+        if(job->error) {
+            return job->error;
+        }
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%u-%u", (unsigned)(offset + got), (unsigned)(offset + len - 1));
+        http.addHeader("Range", range, false, true);
+
+        int code = http.GET();
+        if(code == HTTP_CODE_PARTIAL_CONTENT) {
+            int ret = 0;
+            while(got < len && (ret = http.readBody(buff + got, len - got)) > 0) {
+                got += ret;
+            }
+            error = (ret < 0) ? ret : HTTPC_ERROR_CONNECTION_LOST;
+        } else {
+            error = (code < 0) ? code : HTTPC_ERROR_UNEXPECTED_STATUS;
+        }
+        if(got == len) {
+            break;
+        }
+
+        // drop the connection, the rest of a broken response must not be read as the next one
+        http.setReuse(false);
+        http.end();
+        http.setReuse(true);
+        if(++attempt > job->owner->_retries) {
+            log_e("range %s failed: %s", range, HTTPClient::errorToString(error).c_str());
+            return error;
+        }
+        log_w("range %s failed, retry %u", range, attempt);
+    }
+    http.end();
+    return len;
+}
+
+void HTTPDownload::workerTask(void * arg)
+{
+    HTTPDownloadJob * job = (HTTPDownloadJob *) arg;
+    {
+        HTTPClient http;
+        if(!job->owner->beginClient(http, job->url)) {
+            job->error = HTTPC_ERROR_CONNECTION_REFUSED;
+            xSemaphoreGive(job->ready);
+        }
+        while(!job->error) {
+            // a slow sink keeps every slot busy, wait for the writer
+            if(xSemaphoreTake(job->freeSlots, pdMS_TO_TICKS(100)) != pdTRUE) {
+                continue;
+            }
+            JOB_LOCK(job);
+            if(job->error || job->next >= job->segments) {
+                JOB_UNLOCK(job);
+                xSemaphoreGive(job->freeSlots);
+                break;
+            }
+            uint32_t segment = job->next++;
+            HTTPDownloadSlot * slot = NULL;
+            for(uint8_t i = 0; i < job->slotCount; i++) {
+                if(job->slots[i].segment < 0) {
+                    slot = &job->slots[i];
+                    break;
+                }
+            }
+            slot->segment = segment;
+            slot->ready = false;
+            JOB_UNLOCK(job);
+
+            uint32_t offset = segment * job->owner->_segmentSize;
+            size_t len = job->total - offset;
+            if(len > job->owner->_segmentSize) {
+                len = job->owner->_segmentSize;
+            }
+            int ret = fetchRange(job, http, offset, slot->data, len);
+
+            JOB_LOCK(job);
+            if(ret < 0) {
+                if(!job->error) {
+                    job->error = ret;
+                }
+            } else {
+                slot->len = len;
+                slot->ready = true;
+            }
+            JOB_UNLOCK(job);
+            xSemaphoreGive(job->ready);
+        }
+    }
+    xSemaphoreGive(job->exited);
+    vTaskDelete(NULL);
+}
+
+int HTTPDownload::download(const String& url, HTTPDownloadSinkCb sink)
+{
+    _size = -1;
+    if(!sink) {
+        return HTTPC_ERROR_NO_STREAM;
+    }
+
+    // ask for the first byte to learn the size and whether ranges work
+    HTTPClient http;
+    if(!beginClient(http, url)) {
+        return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+    const char * headerKeys[] = { "Content-Range" };
+    http.collectHeaders(headerKeys, 1);
+    http.addHeader("Range", "bytes=0-0");
+    int code = http.GET();
+    if(code < 0) {
+        return code;
+    }
+    if(code == HTTP_CODE_OK) {
+        log_d("no range support, single connection");
+        return downloadSingle(http, sink);
+    }
+    String contentRange = http.header("Content-Range");
+    int slash = contentRange.indexOf('/');
+    int total = (slash > 0) ? contentRange.substring(slash + 1).toInt() : 0;
+    // the workers open their own connections
+    http.setReuse(false);
+    http.end();
+    if(code != HTTP_CODE_PARTIAL_CONTENT || total <= 0) {
+        log_e("unexpected response %d, Content-Range: %s", code, contentRange.c_str());
+        return HTTPC_ERROR_UNEXPECTED_STATUS;
+    }
+
+    _size = total;
+    if(_start && !_start(_size)) {
+        return HTTPC_ERROR_STREAM_WRITE;
+    }
+
+    HTTPDownloadJob * job = new HTTPDownloadJob();
+    job->owner = this;
+    job->url = url;
+    job->total = total;
+    job->segments = (total + _segmentSize - 1) / _segmentSize;
+    job->next = 0;
+    job->error = 0;
+
+    // two slots per connection so a worker can fetch while its last segment is written
+    uint8_t connections = (job->segments < _connections) ? job->segments : _connections;
+    uint8_t slots = (job->segments < (uint32_t)(2 * connections)) ? job->segments : (2 * connections);
+    job->slotCount = 0;
+    for(uint8_t i = 0; i < slots; i++) {
+        job->slots[i].data = (uint8_t *) malloc(_segmentSize);
+        if(!job->slots[i].data) {
+            break;
+        }
+        job->slots[i].segment = -1;
+        job->slots[i].ready = false;
+        job->slotCount++;
+    }
+    if(job->slotCount < connections) {
+        log_w("memory for %u segments only", job->slotCount);
+        connections = job->slotCount;
+    }
+
+    job->lock = xSemaphoreCreateMutex();
+    job->freeSlots = xSemaphoreCreateCounting(HTTP_DOWNLOAD_MAX_SLOTS, job->slotCount);
+    job->ready = xSemaphoreCreateBinary();
+    job->exited = xSemaphoreCreateCounting(HTTP_DOWNLOAD_MAX_CONNECTIONS, 0);
+
+    uint8_t workers = 0;
+    if(connections && job->lock && job->freeSlots && job->ready && job->exited) {
+        for(uint8_t i = 0; i < connections; i++) {
+            if(xTaskCreate(workerTask, "http_download", HTTP_DOWNLOAD_TASK_STACK, job, uxTaskPriorityGet(NULL), NULL) != pdPASS) {
+                break;
+            }
+            workers++;
+        }
+    }
+
+    int written = 0;
+    if(!workers) {
+        log_e("could not start the download");
+        job->error = HTTPC_ERROR_TOO_LESS_RAM;
+    }
+
+    // write the segments in order as they complete
+    for(uint32_t segment = 0; segment < job->segments && !job->error; segment++) {
+        HTTPDownloadSlot * slot = NULL;
+        while(1) {
+            JOB_LOCK(job);
+            for(uint8_t i = 0; i < job->slotCount; i++) {
+                if(job->slots[i].segment == (int32_t) segment && job->slots[i].ready) {
+                    slot = &job->slots[i];
+                    break;
+                }
+            }
+            JOB_UNLOCK(job);
+            if(slot || job->error) {
+                break;
+            }
+            xSemaphoreTake(job->ready, portMAX_DELAY);
+        }
+        if(!slot) {
+            break;
+        }
+
+        if(!sink(slot->data, slot->len)) {
+            job->error = HTTPC_ERROR_STREAM_WRITE;
+            break;
+        }
+        written += slot->len;
+
+        JOB_LOCK(job);
+        slot->segment = -1;
+        slot->ready = false;
+        JOB_UNLOCK(job);
+        xSemaphoreGive(job->freeSlots);
+    }
+
+    for(uint8_t i = 0; i < workers; i++) {
+        xSemaphoreTake(job->exited, portMAX_DELAY);
+    }
+
+    int error = job->error;
+    for(uint8_t i = 0; i < job->slotCount; i++) {
+        free(job->slots[i].data);
+    }
+    if(job->lock) {
+        vSemaphoreDelete(job->lock);
+    }
+    if(job->freeSlots) {
+        vSemaphoreDelete(job->freeSlots);
+    }
+    if(job->ready) {
+        vSemaphoreDelete(job->ready);
+    }
+    if(job->exited) {
+        vSemaphoreDelete(job->exited);
+    }
+    delete job;
+
+    return error ? error : written;
+}
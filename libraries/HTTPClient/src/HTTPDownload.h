@@ -0,0 +1,102 @@
+/**
+ * HTTPDownload.h
+ *
+ * Downloads a large resource over several connections with Range requests
+ * and writes it in order to a Stream or a callback.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef HTTPDownload_H_
+#define HTTPDownload_H_
+
+#include <functional>
+#include <Arduino.h>
+#include "HTTPClient.h"
+
+/// connections used when the server supports ranges
+#define HTTP_DOWNLOAD_CONNECTIONS (3)
+#define HTTP_DOWNLOAD_MAX_CONNECTIONS (8)
+
+/// bytes per Range request, every connection buffers two of them
+#define HTTP_DOWNLOAD_SEGMENT_SIZE (8192)
+
+/// attempts for one range before the download fails
+#define HTTP_DOWNLOAD_RETRIES (3)
+
+/// stack of the download tasks, TLS needs most of it
+#define HTTP_DOWNLOAD_TASK_STACK (8192)
+
+/// called once with the total size (-1 if unknown) before the first write, return false to abort
+typedef std::function<bool(int total)> HTTPDownloadStartCb;
+/// called with the resource in order, return false to abort
+typedef std::function<bool(const uint8_t * data, size_t len)> HTTPDownloadSinkCb;
+
+struct HTTPDownloadJob;
+
+/**
+ * Splits the resource into segments and fetches them with Range requests on
+ * up to `connections` keep-alive connections, one task each. Segments are
+ * written to the sink strictly in order by the calling task; a slow sink
+ * holds the workers back once every segment buffer is waiting to be written.
+ * A failed range is requested again from the first byte that is missing,
+ * everything already received is kept.
+ *
+ * Servers that do not answer a Range request with 206 are downloaded over a
+ * single connection, like HTTPClient::writeToStream().
+ *
+ * Writing into Update:
+ *
+ *     HTTPDownload dl;
+ *     dl.onStart([](int total) { return Update.begin(total > 0 ? total : UPDATE_SIZE_UNKNOWN); });
+ *     int ret = dl.download(url, [](const uint8_t * data, size_t len) {
+ *         return Update.write((uint8_t *) data, len) == len;
+ *     });
+ *     if(ret > 0 && Update.end()) ESP.restart();
+ */
+class HTTPDownload
+{
+public:
+    HTTPDownload(uint8_t connections = HTTP_DOWNLOAD_CONNECTIONS, size_t segmentSize = HTTP_DOWNLOAD_SEGMENT_SIZE);
+
+    void setCACert(const char * CAcert);
+    void setRetries(uint8_t retries);
+    void setTimeout(uint16_t timeout);
+    void onStart(HTTPDownloadStartCb cb);
+
+    /// @return bytes written to the sink ( negative values are HTTPC_ERROR_* codes )
+    int download(const String& url, HTTPDownloadSinkCb sink);
+    int download(const String& url, Stream& sink);
+
+    /// size reported by the server for the last download, -1 if unknown
+    int size() { return _size; }
+
+protected:
+    bool beginClient(HTTPClient& http, const String& url);
+    int downloadSingle(HTTPClient& http, HTTPDownloadSinkCb& sink);
+    static void workerTask(void * arg);
+    static int fetchRange(HTTPDownloadJob * job, HTTPClient& http, uint32_t offset, uint8_t * buff, size_t len);
+
+    uint8_t _connections;
+    size_t _segmentSize;
+    uint8_t _retries = HTTP_DOWNLOAD_RETRIES;
+    uint16_t _timeout = HTTPCLIENT_DEFAULT_TCP_TIMEOUT;
+    const char * _cacert = nullptr;
+    HTTPDownloadStartCb _start = nullptr;
+    int _size = -1;
+};
+
+#endif /* HTTPDownload_H_ */
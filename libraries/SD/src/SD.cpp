@@ -20,7 +20,7 @@
 
 using namespace fs;
 
-SDFS::SDFS(FSImplPtr impl): FS(impl), _pdrv(0xFF) {}
+SDFS::SDFS(FSImplPtr impl): FS(impl), _pdrv(0xFF), _cacheSectors(0), _cacheReadahead(0), _cachePsram(false) {}
 
 bool SDFS::begin(uint8_t ssPin, SPIClass &spi, uint32_t frequency, const char * mountpoint)
 {
@@ -35,6 +35,10 @@ bool SDFS::begin(uint8_t ssPin, SPIClass &spi, uint32_t frequency, const char *
         return false;
     }
 
+    if((_cacheSectors || _cacheReadahead) && !sdcard_cache(_pdrv, _cacheSectors, _cacheReadahead, _cachePsram)) {
+        log_w("SD cache disabled");
+    }
+
     if(!sdcard_mount(_pdrv, mountpoint)){
         sdcard_unmount(_pdrv);
         sdcard_uninit(_pdrv);
@@ -57,6 +61,17 @@ void SDFS::end()
     }
 }
 
+bool SDFS::setCache(uint16_t sectors, uint16_t readahead, bool psram)
+{
+    _cacheSectors = sectors;
+    _cacheReadahead = readahead;
+    _cachePsram = psram;
+    if(_pdrv == 0xFF) {
+        return true;
+    }
+    return sdcard_cache(_pdrv, sectors, readahead, psram);
+}
+
 sdcard_type_t SDFS::cardType()
 {
     if(_pdrv == 0xFF) {
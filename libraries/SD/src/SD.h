@@ -25,11 +25,18 @@ class SDFS : public FS
 {
 protected:
     uint8_t _pdrv;
+    uint16_t _cacheSectors;
+    uint16_t _cacheReadahead;
+    bool _cachePsram;
 
 public:
     SDFS(FSImplPtr impl);
     bool begin(uint8_t ssPin=SS, SPIClass &spi=SPI, uint32_t frequency=4000000, const char * mountpoint="/sd");
     void end();
+    // Write-back cache of `sectors` x 512 bytes for FAT/directory sectors and
+    // a `readahead` sector window for sequential reads. Dirty sectors are
+    // written on file close/flush. Can be called before or after begin().
+    bool setCache(uint16_t sectors, uint16_t readahead=8, bool psram=false);
     sdcard_type_t cardType();
     uint64_t cardSize();
     uint64_t totalBytes();
@@ -22,6 +22,8 @@ extern "C" {
     unsigned short CRC16(const char* data, int length);
 }
 
+#define SD_POLL_BYTES   8   //bytes clocked per SPI call while waiting for a token or busy
+
 typedef enum {
     GO_IDLE_STATE           = 0,
     SEND_OP_COND            = 1,
@@ -55,24 +57,52 @@ typedef struct {
     unsigned long sectors;
     bool supports_crc;
     int status;
+    unsigned long fat_start;
+    unsigned long fat_end;
+    struct sd_cache_s * cache;
 } ardu_sdcard_t;
 
 static ardu_sdcard_t* s_cards[FF_VOLUMES] = { NULL };
 
+typedef struct {
+    DWORD sector;
+    uint32_t used;      //LRU stamp, 0 for a free line
+    bool dirty;
+    bool pinned;        //holds a FAT sector
+} sd_cache_line_t;
+
+typedef struct sd_cache_s {
+    uint8_t * data;             //lines * 512 bytes, followed by the read-ahead window
+    sd_cache_line_t * lines;
+    uint16_t count;
+    uint16_t pinned;
+    uint32_t clock;
+    uint8_t * window;           //read-ahead window, holds window_count sectors from window_sector
+    uint16_t window_size;
+    uint16_t window_count;
+    DWORD window_sector;
+    DWORD next_sector;          //sector following the previous read
+    uint8_t run;                //sequential single sector reads seen so far
+    DWORD fat_start;            //sectors [fat_start, fat_end) are FAT sectors
+    DWORD fat_end;
+} sd_cache_t;
+
 /*
  * SD SPI
  * */
 
 bool sdWait(uint8_t pdrv, int timeout)
 {
-    char resp;
+    uint8_t resp[SD_POLL_BYTES];
     uint32_t start = millis();
 
+    //the card holds the line low while busy and releases it for good, so
+    //only the last byte of each burst matters
     do {
-        resp = s_cards[pdrv]->spi->transfer(0xFF);
-    } while (resp == 0x00 && (millis() - start) < (unsigned int)timeout);
+        s_cards[pdrv]->spi->transferBytes(NULL, resp, SD_POLL_BYTES);
+    } while (resp[SD_POLL_BYTES - 1] == 0x00 && (millis() - start) < (unsigned int)timeout);
 
-    return (resp > 0x00);
+    return (resp[SD_POLL_BYTES - 1] > 0x00);
 }
 
 void sdStop(uint8_t pdrv)
@@ -164,22 +194,36 @@ char sdCommand(uint8_t pdrv, char cmd, unsigned int arg, unsigned int* resp)
 
 bool sdReadBytes(uint8_t pdrv, char* buffer, int length)
 {
-    char token;
-    unsigned short crc;
+    uint8_t poll[SD_POLL_BYTES];
+    uint8_t crc[2];
     ardu_sdcard_t * card = s_cards[pdrv];
 
+    //never clock past the end of this block, the next one may follow right away
+    int chunk = (length + 3 < SD_POLL_BYTES) ? length + 3 : SD_POLL_BYTES;
+    int i = chunk;
+
     uint32_t start = millis();
     do {
-        token = card->spi->transfer(0xFF);
-    } while (token == 0xFF && (millis() - start) < 500);
+        card->spi->transferBytes(NULL, poll, chunk);
+        for (i = 0; i < chunk && poll[i] == 0xFF; i++);
+    } while (i == chunk && (millis() - start) < 500);
 
-    if (token != 0xFE) {
+    if (i == chunk || poll[i] != 0xFE) {
         return false;
     }
 
-    card->spi->transferBytes(NULL, (uint8_t*)buffer, length);
-    crc = card->spi->transfer16(0xFFFF);
-    return (!card->supports_crc || crc == CRC16(buffer, length));
+    //bytes that came in after the token belong to the block and its crc
+    int got = chunk - i - 1;
+    int data = (got < length) ? got : length;
+    memcpy(buffer, poll + i + 1, data);
+    memcpy(crc, poll + i + 1 + data, got - data);
+    if (data < length) {
+        card->spi->transferBytes(NULL, (uint8_t*)buffer + data, length - data);
+    }
+    if ((got - data) < 2) {
+        card->spi->transferBytes(NULL, crc + (got - data), 2 - (got - data));
+    }
+    return (!card->supports_crc || ((crc[0] << 8) | crc[1]) == CRC16(buffer, length));
 }
 
 char sdWriteBytes(uint8_t pdrv, const char* buffer, char token)
@@ -417,6 +461,241 @@ unsigned long sdGetSectorsCount(uint8_t pdrv)
 }
 
 
+/*
+ * SD Sector Cache
+ *
+ * FAT and directory sectors are read over and over by FatFs, so single
+ * sector reads and writes go through a small write-back LRU cache. FAT
+ * sectors are kept in preference to others (up to half of the lines).
+ * Sequential single sector reads switch to CMD18 read-ahead into a separate
+ * window, so streaming a file does not flush the cache.
+ * */
+
+#define SD_CACHE_READ_RUN   2   //sequential reads before read-ahead starts
+
+static sd_cache_line_t * sdCacheFind(sd_cache_t * cache, DWORD sector)
+{
+    for (uint16_t i = 0; i < cache->count; i++) {
+        if (cache->lines[i].used && cache->lines[i].sector == sector) {
+            return &cache->lines[i];
+        }
+    }
+    return NULL;
+}
+
+static inline uint8_t * sdCacheData(sd_cache_t * cache, sd_cache_line_t * line)
+{
+    return cache->data + ((line - cache->lines) << 9);
+}
+
+static bool sdCacheWriteBack(uint8_t pdrv, sd_cache_t * cache, sd_cache_line_t * line)
+{
+    if (!line->dirty) {
+        return true;
+    }
+    if (!sdWriteSector(pdrv, (const char *)sdCacheData(cache, line), line->sector)) {
+        log_e("write back of sector %u failed", line->sector);
+        return false;
+    }
+    line->dirty = false;
+    return true;
+}
+
+//free line, else the least recently used unpinned line, else the least recently used line
+static sd_cache_line_t * sdCacheVictim(uint8_t pdrv, sd_cache_t * cache)
+{
+    sd_cache_line_t * victim = NULL;
+    sd_cache_line_t * pinned = NULL;
+    if (!cache->count) {
+        return NULL;
+    }
+    for (uint16_t i = 0; i < cache->count; i++) {
+        sd_cache_line_t * line = &cache->lines[i];
+        if (!line->used) {
+            return line;
+        }
+        if (line->pinned) {
+            if (!pinned || line->used < pinned->used) {
+                pinned = line;
+            }
+        } else if (!victim || line->used < victim->used) {
+            victim = line;
+        }
+    }
+    if (!victim) {
+        victim = pinned;
+    }
+    if (!sdCacheWriteBack(pdrv, cache, victim)) {
+        return NULL;
+    }
+    if (victim->pinned) {
+        cache->pinned--;
+    }
+    victim->used = 0;
+    return victim;
+}
+
+static sd_cache_line_t * sdCacheInsert(uint8_t pdrv, sd_cache_t * cache, DWORD sector)
+{
+    sd_cache_line_t * line = sdCacheVictim(pdrv, cache);
+    if (!line) {
+        return NULL;
+    }
+    line->sector = sector;
+    line->used = ++cache->clock;
+    line->dirty = false;
+    line->pinned = sector >= cache->fat_start && sector < cache->fat_end && cache->pinned < (cache->count / 2);
+    if (line->pinned) {
+        cache->pinned++;
+    }
+    return line;
+}
+
+static bool sdCacheFlush(uint8_t pdrv, sd_cache_t * cache)
+{
+    //write in ascending sector order, the card handles that best
+    for (;;) {
+        sd_cache_line_t * next = NULL;
+        for (uint16_t i = 0; i < cache->count; i++) {
+            sd_cache_line_t * line = &cache->lines[i];
+            if (line->used && line->dirty && (!next || line->sector < next->sector)) {
+                next = line;
+            }
+        }
+        if (!next) {
+            return true;
+        }
+        if (!sdCacheWriteBack(pdrv, cache, next)) {
+            return false;
+        }
+    }
+}
+
+//keep cached copies in step with sectors that were transferred around the cache
+static void sdCacheUpdate(sd_cache_t * cache, const uint8_t * buffer, DWORD sector, UINT count, bool written)
+{
+    for (uint16_t i = 0; i < cache->count; i++) {
+        sd_cache_line_t * line = &cache->lines[i];
+        if (!line->used || line->sector < sector || line->sector >= (sector + count)) {
+            continue;
+        }
+        uint8_t * data = (uint8_t *)buffer + ((line->sector - sector) << 9);
+        if (written) {
+            memcpy(sdCacheData(cache, line), data, 512);
+            line->dirty = false;
+        } else if (line->dirty) {
+            memcpy(data, sdCacheData(cache, line), 512);
+        }
+    }
+    if (written && cache->window_count) {
+        for (UINT i = 0; i < count; i++) {
+            if ((sector + i) >= cache->window_sector && (sector + i) < (cache->window_sector + cache->window_count)) {
+                memcpy(cache->window + ((sector + i - cache->window_sector) << 9), buffer + (i << 9), 512);
+            }
+        }
+    }
+}
+
+static bool sdCacheRead(uint8_t pdrv, sd_cache_t * cache, uint8_t * buffer, DWORD sector)
+{
+    bool sequential = (sector == cache->next_sector);
+    cache->next_sector = sector + 1;
+    cache->run = sequential ? ((cache->run < SD_CACHE_READ_RUN) ? cache->run + 1 : cache->run) : 0;
+
+    sd_cache_line_t * line = sdCacheFind(cache, sector);
+    if (line) {
+        line->used = ++cache->clock;
+        memcpy(buffer, sdCacheData(cache, line), 512);
+        return true;
+    }
+
+    if (cache->window_count && sector >= cache->window_sector && sector < (cache->window_sector + cache->window_count)) {
+        memcpy(buffer, cache->window + ((sector - cache->window_sector) << 9), 512);
+        return true;
+    }
+
+    if (cache->window_size && cache->run >= SD_CACHE_READ_RUN) {
+        unsigned long left = s_cards[pdrv]->sectors - sector;
+        uint16_t count = (left < cache->window_size) ? left : cache->window_size;
+        cache->window_count = 0;
+        if (count > 1) {
+            if (!sdReadSectors(pdrv, (char *)cache->window, sector, count)) {
+                return false;
+            }
+            //dirty lines are newer than the card, the window must not go stale when they are evicted
+            sdCacheUpdate(cache, cache->window, sector, count, false);
+            cache->window_sector = sector;
+            cache->window_count = count;
+            memcpy(buffer, cache->window, 512);
+            return true;
+        }
+    }
+
+    line = sdCacheInsert(pdrv, cache, sector);
+    if (!line) {
+        return sdReadSector(pdrv, (char *)buffer, sector);
+    }
+    if (!sdReadSector(pdrv, (char *)sdCacheData(cache, line), sector)) {
+        if (line->pinned) {
+            cache->pinned--;
+        }
+        line->used = 0;
+        return false;
+    }
+    memcpy(buffer, sdCacheData(cache, line), 512);
+    return true;
+}
+
+static bool sdCacheWrite(uint8_t pdrv, sd_cache_t * cache, const uint8_t * buffer, DWORD sector)
+{
+    sd_cache_line_t * line = sdCacheFind(cache, sector);
+    if (!line) {
+        line = sdCacheInsert(pdrv, cache, sector);
+    }
+    if (line) {
+        line->used = ++cache->clock;
+        line->dirty = true;
+        memcpy(sdCacheData(cache, line), buffer, 512);
+    } else if (!sdWriteSector(pdrv, (const char *)buffer, sector)) {
+        return false;
+    }
+    //written through or not, the read-ahead window must not go stale
+    if (cache->window_count && sector >= cache->window_sector && sector < (cache->window_sector + cache->window_count)) {
+        memcpy(cache->window + ((sector - cache->window_sector) << 9), buffer, 512);
+    }
+    return true;
+}
+
+static void sdCacheFree(sd_cache_t * cache)
+{
+    if (cache) {
+        free(cache->data);
+        free(cache->lines);
+        free(cache);
+    }
+}
+
+static sd_cache_t * sdCacheAlloc(uint16_t sectors, uint16_t readahead, bool psram)
+{
+    sd_cache_t * cache = (sd_cache_t *)calloc(1, sizeof(sd_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    size_t size = ((size_t)sectors + readahead) << 9;
+    cache->data = (uint8_t *)((psram && psramFound()) ? ps_malloc(size) : malloc(size));
+    cache->lines = (sd_cache_line_t *)calloc(sectors ? sectors : 1, sizeof(sd_cache_line_t));
+    if (!cache->data || !cache->lines) {
+        sdCacheFree(cache);
+        return NULL;
+    }
+    cache->count = sectors;
+    cache->window = cache->data + ((size_t)sectors << 9);
+    cache->window_size = readahead;
+    cache->next_sector = (DWORD)-1;
+    return cache;
+}
+
+
 namespace
 {
 
@@ -583,11 +862,19 @@ DRESULT ff_sd_read(uint8_t pdrv, uint8_t* buffer, DWORD sector, UINT count)
 
     AcquireSPI lock(card);
 
+    if (card->cache && count == 1) {
+        return sdCacheRead(pdrv, card->cache, buffer, sector) ? RES_OK : RES_ERROR;
+    }
+
     if (count > 1) {
         res = sdReadSectors(pdrv, (char*)buffer, sector, count) ? RES_OK : RES_ERROR;
     } else {
         res = sdReadSector(pdrv, (char*)buffer, sector) ? RES_OK : RES_ERROR;
     }
+    if (card->cache && res == RES_OK) {
+        sdCacheUpdate(card->cache, buffer, sector, count, false);
+        card->cache->next_sector = sector + count;
+    }
     return res;
 }
 
@@ -605,10 +892,18 @@ DRESULT ff_sd_write(uint8_t pdrv, const uint8_t* buffer, DWORD sector, UINT coun
 
     AcquireSPI lock(card);
 
+    if (card->cache && count == 1) {
+        return sdCacheWrite(pdrv, card->cache, buffer, sector) ? RES_OK : RES_ERROR;
+    }
+
     if (count > 1) {
         res = sdWriteSectors(pdrv, (const char*)buffer, sector, count) ? RES_OK : RES_ERROR;
+    } else {
+        res = sdWriteSector(pdrv, (const char*)buffer, sector) ? RES_OK : RES_ERROR;
+    }
+    if (card->cache && res == RES_OK) {
+        sdCacheUpdate(card->cache, buffer, sector, count, true);
     }
-    res = sdWriteSector(pdrv, (const char*)buffer, sector) ? RES_OK : RES_ERROR;
     return res;
 }
 
@@ -618,6 +913,9 @@ DRESULT ff_sd_ioctl(uint8_t pdrv, uint8_t cmd, void* buff)
     case CTRL_SYNC:
         {
             AcquireSPI lock(s_cards[pdrv]);
+            if (s_cards[pdrv]->cache && !sdCacheFlush(pdrv, s_cards[pdrv]->cache)) {
+                return RES_ERROR;
+            }
             if (sdSelectCard(pdrv)) {
                 sdDeselectCard(pdrv);
                 return RES_OK;
@@ -654,6 +952,7 @@ uint8_t sdcard_uninit(uint8_t pdrv)
     if (card->base_path) {
         err = esp_vfs_fat_unregister_path(card->base_path);
     }
+    sdCacheFree(card->cache);
     free(card);
     return err;
 }
@@ -679,6 +978,9 @@ uint8_t sdcard_init(uint8_t cs, SPIClass * spi, int hz)
     card->supports_crc = true;
     card->type = CARD_NONE;
     card->status = STA_NOINIT;
+    card->fat_start = 0;
+    card->fat_end = 0;
+    card->cache = NULL;
 
     pinMode(card->ssPin, OUTPUT);
     digitalWrite(card->ssPin, HIGH);
@@ -703,6 +1005,10 @@ uint8_t sdcard_unmount(uint8_t pdrv)
     if (pdrv >= FF_VOLUMES || card == NULL) {
         return 1;
     }
+    if (card->cache && !(card->status & STA_NOINIT)) {
+        AcquireSPI lock(card);
+        sdCacheFlush(pdrv, card->cache);
+    }
     card->status |= STA_NOINIT;
     card->type = CARD_NONE;
 
@@ -742,6 +1048,44 @@ bool sdcard_mount(uint8_t pdrv, const char* path)
     }
     AcquireSPI lock(card);
     card->sectors = sdGetSectorsCount(pdrv);
+    card->fat_start = fs->fatbase;
+    card->fat_end = fs->fatbase + fs->fsize * fs->n_fats;
+    if (card->cache) {
+        card->cache->fat_start = card->fat_start;
+        card->cache->fat_end = card->fat_end;
+    }
+    return true;
+}
+
+bool sdcard_cache(uint8_t pdrv, uint16_t sectors, uint16_t readahead, bool psram)
+{
+    ardu_sdcard_t * card = s_cards[pdrv];
+    if(pdrv >= FF_VOLUMES || card == NULL){
+        return false;
+    }
+
+    sd_cache_t * cache = NULL;
+    if (sectors || readahead) {
+        cache = sdCacheAlloc(sectors, readahead, psram);
+        if (!cache) {
+            log_e("could not allocate %u cache sectors", sectors + readahead);
+            return false;
+        }
+    }
+
+    AcquireSPI lock(card);
+    if (card->cache) {
+        if (!(card->status & STA_NOINIT) && !sdCacheFlush(pdrv, card->cache)) {
+            sdCacheFree(cache);
+            return false;
+        }
+        sdCacheFree(card->cache);
+    }
+    if (cache) {
+        cache->fat_start = card->fat_start;
+        cache->fat_end = card->fat_end;
+    }
+    card->cache = cache;
     return true;
 }
 
@@ -23,6 +23,7 @@ uint8_t sdcard_uninit(uint8_t pdrv);
 
 bool sdcard_mount(uint8_t pdrv, const char* path);
 uint8_t sdcard_unmount(uint8_t pdrv);
+bool sdcard_cache(uint8_t pdrv, uint16_t sectors, uint16_t readahead, bool psram);
 
 sdcard_type_t sdcard_type(uint8_t pdrv);
 uint32_t sdcard_num_sectors(uint8_t pdrv);
@@ -0,0 +1,87 @@
+/*
+ * Write throughput test for data logging on SD_MMC
+ *
+ * Writes LOG_SIZE bytes in randomly sized chunks, the way sensor data
+ * usually arrives, once unbuffered and once with a cluster sized File
+ * buffer on a preallocated file, and prints the throughput of both.
+ *
+ * Connect the SD card to the following pins:
+ *
+ * SD Card | ESP32
+ *    D2       12
+ *    D3       13
+ *    CMD      15
+ *    VSS      GND
+ *    VDD      3.3V
+ *    CLK      14
+ *    VSS      GND
+ *    D0       2  (add 1K pull up after flashing)
+ *    D1       4
+ */
+
+#include "FS.h"
+#include "SD_MMC.h"
+
+#define LOG_SIZE    (4 * 1024 * 1024)
+#define MAX_CHUNK   700
+
+static uint8_t chunk[MAX_CHUNK];
+
+void writeLog(const char * path, bool buffered){
+    if(buffered){
+        if(!SD_MMC.preallocate(path, LOG_SIZE)){
+            Serial.println("Preallocation failed");
+            return;
+        }
+    }
+    File file = SD_MMC.open(path, buffered ? "r+" : FILE_WRITE);
+    if(!file){
+        Serial.println("Failed to open file for writing");
+        return;
+    }
+    if(buffered && !file.setBufferSize(SD_MMC.clusterSize())){
+        Serial.println("Not enough memory for the file buffer");
+    }
+
+    size_t written = 0;
+    uint32_t start = millis();
+    while(written < LOG_SIZE){
+        size_t len = random(1, MAX_CHUNK);
+        if(len > LOG_SIZE - written){
+            len = LOG_SIZE - written;
+        }
+        if(file.write(chunk, len) != len){
+            Serial.println("Write failed");
+            break;
+        }
+        written += len;
+    }
+    file.close();
+    uint32_t end = millis() - start;
+    if(buffered){
+        SD_MMC.truncate(path, written);
+    }
+    Serial.printf("%s: %u bytes in %u ms, %.2f MB/s\n", buffered ? "buffered" : "unbuffered",
+                  written, end, (float)written / 1048.576 / end);
+}
+
+void setup(){
+    Serial.begin(115200);
+    if(!SD_MMC.begin("/sdcard", false, false, SDMMC_FREQ_HIGHSPEED, 2)){
+        Serial.println("Card Mount Failed");
+        return;
+    }
+    Serial.printf("Cluster size: %u bytes\n", SD_MMC.clusterSize());
+
+    for(size_t i = 0; i < MAX_CHUNK; i++){
+        chunk[i] = i;
+    }
+    SD_MMC.remove("/log_plain.bin");
+    SD_MMC.remove("/log_buffered.bin");
+    writeLog("/log_plain.bin", false);
+    writeLog("/log_buffered.bin", true);
+}
+
+void loop(){
+
+}
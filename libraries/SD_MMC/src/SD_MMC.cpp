@@ -32,10 +32,10 @@ using namespace fs;
 */
 
 SDMMCFS::SDMMCFS(FSImplPtr impl)
-    : FS(impl), _card(NULL)
+    : FS(impl), _card(NULL), _clusterSize(0)
 {}
 
-bool SDMMCFS::begin(const char * mountpoint, bool mode1bit)
+bool SDMMCFS::begin(const char * mountpoint, bool mode1bit, bool format_if_mount_failed, int sdmmc_frequency, uint8_t maxOpenFiles, size_t allocationUnit)
 {
     if(_card) {
         return true;
@@ -57,7 +57,7 @@ bool SDMMCFS::begin(const char * mountpoint, bool mode1bit)
         .io_int_wait = sdmmc_host_io_int_wait,
         .command_timeout_ms = 0,
     };
-    host.max_freq_khz = SDMMC_FREQ_HIGHSPEED;
+    host.max_freq_khz = sdmmc_frequency;
 #ifdef BOARD_HAS_1BIT_SDMMC
     mode1bit = true;
 #endif
@@ -66,9 +66,9 @@ bool SDMMCFS::begin(const char * mountpoint, bool mode1bit)
     }
 
     esp_vfs_fat_sdmmc_mount_config_t mount_config = {
-        .format_if_mount_failed = false,
-        .max_files = 5,
-        .allocation_unit_size = 0
+        .format_if_mount_failed = format_if_mount_failed,
+        .max_files = maxOpenFiles,
+        .allocation_unit_size = allocationUnit
     };
 
     esp_err_t ret = esp_vfs_fat_sdmmc_mount(mountpoint, &host, &slot_config, &mount_config, &_card);
@@ -95,9 +95,69 @@ void SDMMCFS::end()
         esp_vfs_fat_sdmmc_unmount();
         _impl->mountpoint(NULL);
         _card = NULL;
+        _clusterSize = 0;
     }
 }
 
+size_t SDMMCFS::clusterSize()
+{
+    if(!_card) {
+        return 0;
+    }
+    if(!_clusterSize) {
+        FATFS* fsinfo;
+        DWORD fre_clust;
+        if(f_getfree("0:", &fre_clust, &fsinfo) != 0) {
+            return 0;
+        }
+#if _MAX_SS != 512
+        _clusterSize = (size_t)fsinfo->csize * fsinfo->ssize;
+#else
+        _clusterSize = (size_t)fsinfo->csize * 512;
+#endif
+    }
+    return _clusterSize;
+}
+
+bool SDMMCFS::preallocate(const char* path, uint64_t size)
+{
+    if(!_card || !size) {
+        return false;
+    }
+    File file = open(path, exists(path) ? "r+" : "w");
+    if(!file) {
+        return false;
+    }
+    bool ok = true;
+    if(file.size() < size) {
+        //seeking past the end and writing makes FatFs allocate the whole chain at once
+        ok = file.seek(size - 1, SeekSet) && file.write((uint8_t)0) == 1;
+    }
+    file.close();
+    if(!ok) {
+        log_e("could not allocate %llu bytes for %s", size, path);
+    }
+    return ok;
+}
+
+bool SDMMCFS::truncate(const char* path, uint64_t size)
+{
+    if(!_card) {
+        return false;
+    }
+    VFSPath temp(_impl->mountpoint(), path);
+    if(!temp) {
+        return false;
+    }
+    //goes around VFSImpl, so its cached stat of the file would be stale
+    static_cast<VFSImpl*>(_impl.get())->invalidateCache();
+    if(::truncate(temp.c_str(), size) != 0) {
+        log_e("truncate %s to %llu failed", path, size);
+        return false;
+    }
+    return true;
+}
+
 sdcard_type_t SDMMCFS::cardType()
 {
     if(!_card) {
@@ -25,11 +25,19 @@ class SDMMCFS : public FS
 {
 protected:
     sdmmc_card_t* _card;
+    size_t _clusterSize;
 
 public:
     SDMMCFS(FSImplPtr impl);
-    bool begin(const char * mountpoint="/sdcard", bool mode1bit=false);
+    bool begin(const char * mountpoint="/sdcard", bool mode1bit=false, bool format_if_mount_failed=false, int sdmmc_frequency=SDMMC_FREQ_HIGHSPEED, uint8_t maxOpenFiles=5, size_t allocationUnit=0);
     void end();
+    // FAT cluster size in bytes, a good File::setBufferSize() for fast writes
+    size_t clusterSize();
+    // Allocate the clusters of a file up front so that writing it later does
+    // not have to extend the FAT chain. Use truncate() on the closed file to
+    // drop the unused tail.
+    bool preallocate(const char* path, uint64_t size);
+    bool truncate(const char* path, uint64_t size);
     sdcard_type_t cardType();
     uint64_t cardSize();
     uint64_t totalBytes();
@@ -66,6 +66,8 @@ void SPIFFSFS::end()
 bool SPIFFSFS::format()
 {
     esp_err_t err = esp_spiffs_format(NULL);
+    //the cached stat results describe files that may be gone now
+    static_cast<VFSImpl*>(_impl.get())->invalidateCache();
     if(err){
         log_e("Formatting SPIFFS failed! Error: %d", err);
         return false;
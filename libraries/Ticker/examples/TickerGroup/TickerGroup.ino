@@ -0,0 +1,41 @@
+#include <Arduino.h>
+#include <TickerGroup.h>
+
+#define SENSOR_COUNT 200
+
+// all tickers share one esp_timer, callbacks due within 10 ms run together
+TickerGroup tickers(10);
+GroupTicker * polls[SENSOR_COUNT];
+GroupTicker report(tickers);
+
+volatile uint32_t samples[SENSOR_COUNT];
+
+void pollSensor(int index) {
+  samples[index]++;
+}
+
+void printReport() {
+  uint32_t total = 0;
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    total += samples[i];
+  }
+  Serial.printf("tickers: %u, batches: %u, samples: %u\n", tickers.count(), tickers.runs(), total);
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  // run the callbacks from loop() instead of the esp_timer task
+  tickers.setDispatchTask(xTaskGetCurrentTaskHandle());
+
+  for (int i = 0; i < SENSOR_COUNT; i++) {
+    polls[i] = new GroupTicker(tickers);
+    polls[i]->attach_ms(100 + i * 5, pollSensor, i);
+  }
+  report.attach(5, printReport);
+}
+
+void loop() {
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  tickers.handle();
+}
@@ -0,0 +1,297 @@
+/*
+  TickerGroup.cpp - many logical tickers multiplexed on one esp_timer
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <string.h>
+#include "TickerGroup.h"
+
+#define WHEEL_MASK      (TICKER_WHEEL_SLOTS - 1)
+#define WHEEL_SPAN(l)   (1ULL << (TICKER_WHEEL_BITS * (l)))
+#define WHEEL_RANGE     WHEEL_SPAN(TICKER_WHEEL_LEVELS)
+#define WHEEL_DUE       0xFF
+
+#define GROUP_LOCK(g)   do {} while (xSemaphoreTake((g)->_lock, portMAX_DELAY) != pdPASS)
+#define GROUP_UNLOCK(g) xSemaphoreGive((g)->_lock)
+
+GroupTicker::GroupTicker(TickerGroup& group) :
+  _group(group), _next(nullptr), _pprev(nullptr), _expires(0), _deadline_us(0), _period_us(0),
+  _level(0), _slot(0), _callback(nullptr), _arg(nullptr) {}
+
+GroupTicker::~GroupTicker() {
+  detach();
+}
+
+void GroupTicker::_attach_ms(uint32_t milliseconds, bool repeat, callback_with_arg_t callback, uint32_t arg) {
+  if (!_group._init()) {
+    return;
+  }
+  TickerGroup& g = _group;
+  GROUP_LOCK(&g);
+  if (_pprev) {
+    g._unlink(this);
+  }
+  uint64_t interval_us = (uint64_t)milliseconds * 1000;
+  _period_us = repeat ? (interval_us ? interval_us : 1) : 0;
+  _callback = callback;
+  _arg = reinterpret_cast<void*>(arg);
+  // round the deadline up to a tick boundary so callbacks never run early
+  _deadline_us = (esp_timer_get_time() - g._start_us) + interval_us;
+  _expires = (_deadline_us + g._slack_us - 1) / g._slack_us;
+  if (_expires <= g._now) {
+    _expires = g._now + 1;
+  }
+  g._insert(this);
+  g._arm();
+  GROUP_UNLOCK(&g);
+}
+
+void GroupTicker::detach() {
+  if (!_group._lock) {
+    return;
+  }
+  GROUP_LOCK(&_group);
+  if (_pprev) {
+    _group._unlink(this);
+  }
+  GROUP_UNLOCK(&_group);
+}
+
+bool GroupTicker::active() {
+  return _pprev != nullptr;
+}
+
+TickerGroup::TickerGroup(uint32_t slack_ms) :
+  _slack_us((slack_ms ? slack_ms : 1) * 1000), _start_us(0), _now(0), _armed(0),
+  _count(0), _runs(0), _timer(nullptr), _lock(nullptr), _task(nullptr), _due(nullptr) {
+  memset(_slots, 0, sizeof(_slots));
+  memset(_occupied, 0, sizeof(_occupied));
+}
+
+TickerGroup::~TickerGroup() {
+  if (_timer) {
+    esp_timer_stop(_timer);
+    esp_timer_delete(_timer);
+    _timer = nullptr;
+  }
+  // leave the remaining tickers detached rather than pointing into freed slots
+  for (uint8_t level = 0; level < TICKER_WHEEL_LEVELS; level++) {
+    for (uint8_t slot = 0; slot < TICKER_WHEEL_SLOTS; slot++) {
+      for (GroupTicker* t = _slots[level][slot]; t; t = t->_next) {
+        t->_pprev = nullptr;
+      }
+    }
+  }
+  for (GroupTicker* t = _due; t; t = t->_next) {
+    t->_pprev = nullptr;
+  }
+  if (_lock) {
+    vSemaphoreDelete(_lock);
+    _lock = nullptr;
+  }
+}
+
+bool TickerGroup::_init() {
+  if (_timer) {
+    return true;
+  }
+  if (!_lock && !(_lock = xSemaphoreCreateMutex())) {
+    return false;
+  }
+  esp_timer_create_args_t timerConfig;
+  timerConfig.arg = this;
+  timerConfig.callback = _onTimer;
+  timerConfig.dispatch_method = ESP_TIMER_TASK;
+  timerConfig.name = "TickerGroup";
+  if (esp_timer_create(&timerConfig, &_timer) != ESP_OK) {
+    _timer = nullptr;
+    return false;
+  }
+  _start_us = esp_timer_get_time();
+  return true;
+}
+
+void TickerGroup::setDispatchTask(TaskHandle_t task) {
+  _task = task;
+}
+
+uint64_t TickerGroup::_elapsedTicks() {
+  return (esp_timer_get_time() - _start_us) / _slack_us;
+}
+
+void TickerGroup::_insert(GroupTicker* ticker) {
+  uint64_t expires = ticker->_expires;
+  uint64_t delta = expires - _now;
+  if (delta >= WHEEL_RANGE) {
+    // park it in the last slot reachable, it is re-filed when that slot cascades
+    delta = WHEEL_RANGE - 1;
+    expires = _now + delta;
+  }
+  uint8_t level = 0;
+  while (level < TICKER_WHEEL_LEVELS - 1 && delta >= WHEEL_SPAN(level + 1)) {
+    level++;
+  }
+  uint8_t slot = (expires >> (TICKER_WHEEL_BITS * level)) & WHEEL_MASK;
+  GroupTicker** head = &_slots[level][slot];
+  ticker->_next = *head;
+  if (*head) {
+    (*head)->_pprev = &ticker->_next;
+  }
+  *head = ticker;
+  ticker->_pprev = head;
+  ticker->_level = level;
+  ticker->_slot = slot;
+  _occupied[level] |= (1ULL << slot);
+  _count++;
+}
+
+void TickerGroup::_unlink(GroupTicker* ticker) {
+  *ticker->_pprev = ticker->_next;
+  if (ticker->_next) {
+    ticker->_next->_pprev = ticker->_pprev;
+  }
+  if (ticker->_level != WHEEL_DUE && !_slots[ticker->_level][ticker->_slot]) {
+    _occupied[ticker->_level] &= ~(1ULL << ticker->_slot);
+  }
+  ticker->_next = nullptr;
+  ticker->_pprev = nullptr;
+  _count--;
+}
+
+void TickerGroup::_cascade(uint8_t level) {
+  uint8_t slot = (_now >> (TICKER_WHEEL_BITS * level)) & WHEEL_MASK;
+  GroupTicker* t = _slots[level][slot];
+  _slots[level][slot] = nullptr;
+  _occupied[level] &= ~(1ULL << slot);
+  while (t) {
+    GroupTicker* next = t->_next;
+    _count--;
+    _insert(t);
+    t = next;
+  }
+}
+
+// first tick after _now that has an occupied level 0 slot or a cascade to run
+uint64_t TickerGroup::_nextTick() {
+  uint64_t next = UINT64_MAX;
+  if (_occupied[0]) {
+    uint8_t pos = (_now + 1) & WHEEL_MASK;
+    uint64_t rotated = pos ? ((_occupied[0] >> pos) | (_occupied[0] << (64 - pos))) : _occupied[0];
+    next = _now + 1 + __builtin_ctzll(rotated);
+  }
+  for (uint8_t level = 1; level < TICKER_WHEEL_LEVELS; level++) {
+    if (_occupied[level]) {
+      uint64_t boundary = (_now | (WHEEL_SPAN(level) - 1)) + 1;
+      if (boundary < next) {
+        next = boundary;
+      }
+    }
+  }
+  return next;
+}
+
+void TickerGroup::_arm() {
+  if (!_count) {
+    if (_armed) {
+      esp_timer_stop(_timer);
+      _armed = 0;
+    }
+    return;
+  }
+  uint64_t next = _nextTick();
+  if (next == _armed) {
+    return;
+  }
+  int64_t wait = (_start_us + (int64_t)(next * _slack_us)) - esp_timer_get_time();
+  esp_timer_stop(_timer);
+  esp_timer_start_once(_timer, wait > 0 ? wait : 0);
+  _armed = next;
+}
+
+void TickerGroup::_onTimer(void* arg) {
+  TickerGroup* group = static_cast<TickerGroup*>(arg);
+  GROUP_LOCK(group);
+  group->_armed = 0;
+  GROUP_UNLOCK(group);
+  if (group->_task) {
+    xTaskNotifyGive(group->_task);
+  } else {
+    group->handle();
+  }
+}
+
+void TickerGroup::handle() {
+  if (!_timer) {
+    return;
+  }
+  GROUP_LOCK(this);
+  uint64_t target = _elapsedTicks();
+  for (;;) {
+    uint64_t next = _nextTick();
+    if (next > target) {
+      _now = target;
+      break;
+    }
+    _now = next;
+    for (uint8_t level = 1; level < TICKER_WHEEL_LEVELS; level++) {
+      if (_now & (WHEEL_SPAN(level) - 1)) {
+        break;
+      }
+      _cascade(level);
+    }
+    uint8_t slot = _now & WHEEL_MASK;
+    GroupTicker* t = _slots[0][slot];
+    _slots[0][slot] = nullptr;
+    _occupied[0] &= ~(1ULL << slot);
+    while (t) {
+      GroupTicker* next_ticker = t->_next;
+      t->_next = _due;
+      if (_due) {
+        _due->_pprev = &t->_next;
+      }
+      _due = t;
+      t->_pprev = &_due;
+      t->_level = WHEEL_DUE;
+      t = next_ticker;
+    }
+  }
+  if (_due) {
+    _runs++;
+  }
+  while (_due) {
+    GroupTicker* t = _due;
+    _unlink(t);
+    GroupTicker::callback_with_arg_t callback = t->_callback;
+    void* arg = t->_arg;
+    if (t->_period_us) {
+      // advance the exact deadline and round only that, so periods that are
+      // not a multiple of the slack do not drift
+      uint64_t now_us = _now * _slack_us;
+      t->_deadline_us += t->_period_us;
+      if (t->_deadline_us <= now_us) {
+        // fell behind, skip the missed periods instead of bursting
+        t->_deadline_us += ((now_us - t->_deadline_us) / t->_period_us + 1) * t->_period_us;
+      }
+      t->_expires = (t->_deadline_us + _slack_us - 1) / _slack_us;
+      _insert(t);
+    }
+    GROUP_UNLOCK(this);
+    callback(arg);
+    GROUP_LOCK(this);
+  }
+  _arm();
+  GROUP_UNLOCK(this);
+}
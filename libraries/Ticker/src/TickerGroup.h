@@ -0,0 +1,166 @@
+/*
+  TickerGroup.h - many logical tickers multiplexed on one esp_timer
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TICKERGROUP_H
+#define TICKERGROUP_H
+
+extern "C" {
+  #include "esp_timer.h"
+  #include "freertos/FreeRTOS.h"
+  #include "freertos/task.h"
+  #include "freertos/semphr.h"
+}
+
+#define TICKER_WHEEL_BITS   6
+#define TICKER_WHEEL_SLOTS  (1 << TICKER_WHEEL_BITS)
+#define TICKER_WHEEL_LEVELS 4
+
+class TickerGroup;
+
+/*
+  A GroupTicker has the same attach/once interface as Ticker but does not
+  own an esp_timer. It is an intrusive node of its TickerGroup's timer wheel,
+  so attaching, re-attaching and detaching are O(1) and never allocate.
+*/
+class GroupTicker
+{
+public:
+  GroupTicker(TickerGroup& group);
+  ~GroupTicker();
+  typedef void (*callback_t)(void);
+  typedef void (*callback_with_arg_t)(void*);
+
+  void attach(float seconds, callback_t callback)
+  {
+    _attach_ms(seconds * 1000, true, reinterpret_cast<callback_with_arg_t>(callback), 0);
+  }
+
+  void attach_ms(uint32_t milliseconds, callback_t callback)
+  {
+    _attach_ms(milliseconds, true, reinterpret_cast<callback_with_arg_t>(callback), 0);
+  }
+
+  template<typename TArg>
+  void attach(float seconds, void (*callback)(TArg), TArg arg)
+  {
+    static_assert(sizeof(TArg) <= sizeof(uint32_t), "attach() callback argument size must be <= 4 bytes");
+    uint32_t arg32 = (uint32_t)arg;
+    _attach_ms(seconds * 1000, true, reinterpret_cast<callback_with_arg_t>(callback), arg32);
+  }
+
+  template<typename TArg>
+  void attach_ms(uint32_t milliseconds, void (*callback)(TArg), TArg arg)
+  {
+    static_assert(sizeof(TArg) <= sizeof(uint32_t), "attach_ms() callback argument size must be <= 4 bytes");
+    uint32_t arg32 = (uint32_t)arg;
+    _attach_ms(milliseconds, true, reinterpret_cast<callback_with_arg_t>(callback), arg32);
+  }
+
+  void once(float seconds, callback_t callback)
+  {
+    _attach_ms(seconds * 1000, false, reinterpret_cast<callback_with_arg_t>(callback), 0);
+  }
+
+  void once_ms(uint32_t milliseconds, callback_t callback)
+  {
+    _attach_ms(milliseconds, false, reinterpret_cast<callback_with_arg_t>(callback), 0);
+  }
+
+  template<typename TArg>
+  void once(float seconds, void (*callback)(TArg), TArg arg)
+  {
+    static_assert(sizeof(TArg) <= sizeof(uint32_t), "attach() callback argument size must be <= 4 bytes");
+    uint32_t arg32 = (uint32_t)(arg);
+    _attach_ms(seconds * 1000, false, reinterpret_cast<callback_with_arg_t>(callback), arg32);
+  }
+
+  template<typename TArg>
+  void once_ms(uint32_t milliseconds, void (*callback)(TArg), TArg arg)
+  {
+    static_assert(sizeof(TArg) <= sizeof(uint32_t), "attach_ms() callback argument size must be <= 4 bytes");
+    uint32_t arg32 = (uint32_t)(arg);
+    _attach_ms(milliseconds, false, reinterpret_cast<callback_with_arg_t>(callback), arg32);
+  }
+
+  void detach();
+  bool active();
+
+protected:
+  friend class TickerGroup;
+  void _attach_ms(uint32_t milliseconds, bool repeat, callback_with_arg_t callback, uint32_t arg);
+
+  TickerGroup& _group;
+  GroupTicker* _next;
+  GroupTicker** _pprev;     // link that points at this node, nullptr when not queued
+  uint64_t _expires;        // in group ticks
+  uint64_t _deadline_us;    // exact due time since the group started, _expires rounds it up
+  uint64_t _period_us;      // 0 for once()
+  uint8_t _level;           // wheel position, used to keep the occupancy bitmap exact
+  uint8_t _slot;
+  callback_with_arg_t _callback;
+  void* _arg;
+};
+
+/*
+  Hierarchical timer wheel driving any number of GroupTickers from a single
+  esp_timer. Time is counted in ticks of `slack_ms`: every ticker due within
+  the same tick is run in one batch, and the esp_timer is only armed for the
+  next tick that has work, so idle groups do not wake the CPU.
+
+  By default callbacks run in the esp_timer task like Ticker. After
+  setDispatchTask(task) the group only notifies that task, which then has to
+  call handle() (e.g. from loop() or after ulTaskNotifyTake()).
+*/
+class TickerGroup
+{
+public:
+  TickerGroup(uint32_t slack_ms = 1);
+  ~TickerGroup();
+
+  void setDispatchTask(TaskHandle_t task);
+  void handle();
+
+  uint32_t count() { return _count; }
+  uint32_t runs() { return _runs; }
+
+protected:
+  friend class GroupTicker;
+  bool _init();
+  void _insert(GroupTicker* ticker);
+  void _unlink(GroupTicker* ticker);
+  void _cascade(uint8_t level);
+  uint64_t _nextTick();
+  uint64_t _elapsedTicks();
+  void _arm();
+  static void _onTimer(void* arg);
+
+  uint32_t _slack_us;
+  int64_t _start_us;
+  uint64_t _now;            // last processed tick
+  uint64_t _armed;          // tick the esp_timer is armed for, 0 when idle
+  uint32_t _count;          // queued tickers
+  uint32_t _runs;           // batches processed
+  esp_timer_handle_t _timer;
+  SemaphoreHandle_t _lock;
+  TaskHandle_t _task;
+  GroupTicker* _due;        // tickers expired in the batch being run
+  GroupTicker* _slots[TICKER_WHEEL_LEVELS][TICKER_WHEEL_SLOTS];
+  uint64_t _occupied[TICKER_WHEEL_LEVELS];
+};
+
+#endif  // TICKERGROUP_H
@@ -125,12 +125,7 @@ bool WebServer::_parseRequest(WiFiClient& client) {
 #endif
 
   //attach handler
-  RequestHandler* handler;
-  for (handler = _firstHandler; handler; handler = handler->next()) {
-    if (handler->canHandle(_currentMethod, _currentUri))
-      break;
-  }
-  _currentHandler = handler;
+  _currentHandler = _router.find(_currentMethod, _currentUri, _pathArgs);
 
   String formData;
   // below is needed only when POST type request
@@ -345,44 +340,150 @@ void WebServer::_parseArguments(String data) {
 
 }
 
-void WebServer::_uploadWriteByte(uint8_t b){
-  if (_currentUpload->currentSize == HTTP_UPLOAD_BUFLEN){
-    if(_currentHandler && _currentHandler->canUpload(_currentUri))
-      _currentHandler->upload(*this, _currentUri, *_currentUpload);
-    _currentUpload->totalSize += _currentUpload->currentSize;
-    _currentUpload->currentSize = 0;
+// Reads the multipart body in blocks into HTTPUpload::buf, so file data can be
+// passed to the upload handler where it was read instead of byte by byte
+struct FormReader {
+  WiFiClient& client;
+  uint8_t* buf;
+  size_t pos;           // unread data is buf[pos..len)
+  size_t len;
+  uint32_t remaining;   // body bytes still in the client
+
+  FormReader(WiFiClient& c, uint8_t* b, uint32_t bodyLength)
+  : client(c), buf(b), pos(0), len(0), remaining(bodyLength ? bodyLength : UINT32_MAX) {}
+
+  // move the unread data to the start of buf
+  void compact() {
+    if (pos) {
+      memmove(buf, buf + pos, len - pos);
+      len -= pos;
+      pos = 0;
+    }
+  }
+
+  // append what the client has to buf, false when nothing arrives in time
+  bool fill() {
+    compact();
+    if (len == HTTP_UPLOAD_BUFLEN || !remaining)
+      return false;
+    int tries = HTTP_MAX_POST_WAIT;
+    size_t avail;
+    while (!(avail = client.available()) && client.connected() && tries--) delay(1);
+    if (!avail)
+      return false;
+    size_t want = HTTP_UPLOAD_BUFLEN - len;
+    if (want > avail) want = avail;
+    if (want > remaining) want = remaining;
+    int got = client.read(buf + len, want);
+    if (got <= 0)
+      return false;
+    len += got;
+    remaining -= got;
+    return true;
+  }
+
+  // next line without CRLF
+  bool readLine(String& line) {
+    line = "";
+    while (true) {
+      uint8_t* nl = (uint8_t*) memchr(buf + pos, '\n', len - pos);
+      size_t end = nl ? (nl - buf) : len;
+      for (size_t i = pos; i < end; i++) line += (char) buf[i];
+      if (nl) {
+        pos = end + 1;
+        if (line.endsWith("\r"))
+          line.remove(line.length() - 1);
+        return true;
+      }
+      pos = len;
+      if (!fill())
+        return false;
+    }
   }
-  _currentUpload->buf[_currentUpload->currentSize++] = b;
+};
+
+// Boyer-Moore-Horspool search for the part delimiter
+static int findDelimiter(const uint8_t* data, size_t len, const uint8_t* delim, size_t m, const uint8_t* skip)
+{
+  size_t i = 0;
+  while (i + m <= len) {
+    uint8_t last = data[i + m - 1];
+    if (last == delim[m - 1] && memcmp(data + i, delim, m - 1) == 0)
+      return i;
+    i += skip[last];
+  }
+  return -1;
 }
 
-uint8_t WebServer::_uploadReadByte(WiFiClient& client){
-  int res = client.read();
-  if(res == -1){
-    while(!client.available() && client.connected())
-      delay(2);
-    res = client.read();
+// read the rest of the current part, handing every span before the delimiter to emit
+// with the span at the start of buf, false when the body ends without a delimiter
+template<typename TEmit>
+static bool readPart(FormReader& reader, const String& delimiter, const uint8_t* skip, TEmit emit)
+{
+  const uint8_t* delim = (const uint8_t*) delimiter.c_str();
+  size_t m = delimiter.length();
+  while (true) {
+    reader.compact();
+    int found = findDelimiter(reader.buf, reader.len, delim, m, skip);
+    if (found >= 0) {
+      if (found)
+        emit(reader.buf, found);
+      reader.pos = found + m;
+      return true;
+    }
+    // the tail may be the start of a delimiter, keep it for the next round
+    size_t safe = (reader.len > m - 1) ? reader.len - (m - 1) : 0;
+    if (safe) {
+      emit(reader.buf, safe);
+      reader.pos = safe;
+    }
+    if (!reader.fill())
+      return false;
   }
-  return (uint8_t)res;
+}
+
+static String headerParam(const String& line, const char* param)
+{
+  String key = String(param) + "=\"";
+  int start = line.indexOf(key);
+  // skip matches inside a longer parameter name, name= in filename=
+  while (start > 0 && line[start - 1] != ' ' && line[start - 1] != ';')
+    start = line.indexOf(key, start + 1);
+  if (start == -1)
+    return String();
+  start += key.length();
+  int end = line.indexOf('"', start);
+  return line.substring(start, end == -1 ? line.length() : end);
 }
 
 bool WebServer::_parseForm(WiFiClient& client, String boundary, uint32_t len){
-  (void) len;
 #ifdef DEBUG_ESP_HTTP_SERVER
   DEBUG_OUTPUT.print("Parse Form: Boundary: ");
   DEBUG_OUTPUT.print(boundary);
   DEBUG_OUTPUT.print(" Length: ");
   DEBUG_OUTPUT.println(len);
 #endif
+  // the upload buffer doubles as read buffer for the whole form
+  _currentUpload.reset(new HTTPUpload());
+  FormReader reader(client, _currentUpload->buf, len);
+
   String line;
   int retry = 0;
+  bool ok;
   do {
-    line = client.readStringUntil('\r');
+    ok = reader.readLine(line);
     ++retry;
-  } while (line.length() == 0 && retry < 3);
+  } while (ok && line.length() == 0 && retry < 3);
 
-  client.readStringUntil('\n');
   //start reading the form
-  if (line == ("--"+boundary)){
+  if (line == ("--"+boundary) && boundary.length() <= 70){
+    String delimiter = "\r\n--" + boundary;
+    uint8_t skip[256];
+    size_t m = delimiter.length();
+    memset(skip, m, sizeof(skip));
+    for (size_t i = 0; i < m - 1; i++)
+      skip[(uint8_t) delimiter[i]] = m - 1 - i;
+
     RequestArgument* postArgs = new RequestArgument[32];
     int postArgsLen = 0;
     while(1){
@@ -392,18 +493,19 @@ bool WebServer::_parseForm(WiFiClient& client, String boundary, uint32_t len){
       String argFilename;
       bool argIsFile = false;
 
-      line = client.readStringUntil('\r');
-      client.readStringUntil('\n');
-      if (line.length() > 19 && line.substring(0, 19).equalsIgnoreCase(F("Content-Disposition"))){
-        int nameStart = line.indexOf('=');
-        if (nameStart != -1){
-          argName = line.substring(nameStart+2);
-          nameStart = argName.indexOf('=');
-          if (nameStart == -1){
-            argName = argName.substring(0, argName.length() - 1);
-          } else {
-            argFilename = argName.substring(nameStart+2, argName.length() - 1);
-            argName = argName.substring(0, argName.indexOf('"'));
+      using namespace mime;
+      argType = FPSTR(mimeTable[txt].mimeType);
+      while (1) {
+        if (!reader.readLine(line)) {
+          delete[] postArgs;
+          return false;
+        }
+        if (line.length() == 0)
+          break;
+        if (line.length() > 19 && line.substring(0, 19).equalsIgnoreCase(F("Content-Disposition"))){
+          argName = headerParam(line, "name");
+          if (line.indexOf(F("filename=")) != -1){
+            argFilename = headerParam(line, "filename");
             argIsFile = true;
 #ifdef DEBUG_ESP_HTTP_SERVER
             DEBUG_OUTPUT.print("PostArg FileName: ");
@@ -413,141 +515,90 @@ bool WebServer::_parseForm(WiFiClient& client, String boundary, uint32_t len){
             if (argFilename == F("blob") && hasArg(FPSTR(filename))) 
               argFilename = arg(FPSTR(filename));
           }
+        } else if (line.length() > 12 && line.substring(0, 12).equalsIgnoreCase(FPSTR(Content_Type))){
+          argType = line.substring(line.indexOf(':') + 1);
+          argType.trim();
+        }
+      }
 #ifdef DEBUG_ESP_HTTP_SERVER
-          DEBUG_OUTPUT.print("PostArg Name: ");
-          DEBUG_OUTPUT.println(argName);
-#endif
-          using namespace mime;
-          argType = FPSTR(mimeTable[txt].mimeType);
-          line = client.readStringUntil('\r');
-          client.readStringUntil('\n');
-          if (line.length() > 12 && line.substring(0, 12).equalsIgnoreCase(FPSTR(Content_Type))){
-            argType = line.substring(line.indexOf(':')+2);
-            //skip next line
-            client.readStringUntil('\r');
-            client.readStringUntil('\n');
-          }
-#ifdef DEBUG_ESP_HTTP_SERVER
-          DEBUG_OUTPUT.print("PostArg Type: ");
-          DEBUG_OUTPUT.println(argType);
-#endif
-          if (!argIsFile){
-            while(1){
-              line = client.readStringUntil('\r');
-              client.readStringUntil('\n');
-              if (line.startsWith("--"+boundary)) break;
-              if (argValue.length() > 0) argValue += "\n";
-              argValue += line;
-            }
-#ifdef DEBUG_ESP_HTTP_SERVER
-            DEBUG_OUTPUT.print("PostArg Value: ");
-            DEBUG_OUTPUT.println(argValue);
-            DEBUG_OUTPUT.println();
+      DEBUG_OUTPUT.print("PostArg Name: ");
+      DEBUG_OUTPUT.println(argName);
+      DEBUG_OUTPUT.print("PostArg Type: ");
+      DEBUG_OUTPUT.println(argType);
 #endif
 
-            RequestArgument& arg = postArgs[postArgsLen++];
-            arg.key = argName;
-            arg.value = argValue;
-
-            if (line == ("--"+boundary+"--")){
+      if (!argIsFile){
+        bool found = readPart(reader, delimiter, skip, [&argValue](uint8_t* data, size_t n) {
+          // n is always short of the end of the buffer, terminate the span in place
+          uint8_t c = data[n];
+          data[n] = 0;
+          argValue += (const char*) data;
+          data[n] = c;
+        });
+        if (!found) {
+          delete[] postArgs;
+          return false;
+        }
+        argValue.replace("\r\n", "\n");
 #ifdef DEBUG_ESP_HTTP_SERVER
-              DEBUG_OUTPUT.println("Done Parsing POST");
+        DEBUG_OUTPUT.print("PostArg Value: ");
+        DEBUG_OUTPUT.println(argValue);
+        DEBUG_OUTPUT.println();
 #endif
-              break;
-            }
-          } else {
-            _currentUpload.reset(new HTTPUpload());
-            _currentUpload->status = UPLOAD_FILE_START;
-            _currentUpload->name = argName;
-            _currentUpload->filename = argFilename;
-            _currentUpload->type = argType;
-            _currentUpload->totalSize = 0;
-            _currentUpload->currentSize = 0;
+        if (postArgsLen < 32) {
+          RequestArgument& arg = postArgs[postArgsLen++];
+          arg.key = argName;
+          arg.value = argValue;
+        }
+      } else {
+        _currentUpload->status = UPLOAD_FILE_START;
+        _currentUpload->name = argName;
+        _currentUpload->filename = argFilename;
+        _currentUpload->type = argType;
+        _currentUpload->totalSize = 0;
+        _currentUpload->currentSize = 0;
 #ifdef DEBUG_ESP_HTTP_SERVER
-            DEBUG_OUTPUT.print("Start File: ");
-            DEBUG_OUTPUT.print(_currentUpload->filename);
-            DEBUG_OUTPUT.print(" Type: ");
-            DEBUG_OUTPUT.println(_currentUpload->type);
+        DEBUG_OUTPUT.print("Start File: ");
+        DEBUG_OUTPUT.print(_currentUpload->filename);
+        DEBUG_OUTPUT.print(" Type: ");
+        DEBUG_OUTPUT.println(_currentUpload->type);
 #endif
-            if(_currentHandler && _currentHandler->canUpload(_currentUri))
-              _currentHandler->upload(*this, _currentUri, *_currentUpload);
-            _currentUpload->status = UPLOAD_FILE_WRITE;
-            uint8_t argByte = _uploadReadByte(client);
-readfile:
-            while(argByte != 0x0D){
-              if (!client.connected()) return _parseFormUploadAborted();
-              _uploadWriteByte(argByte);
-              argByte = _uploadReadByte(client);
-            }
-
-            argByte = _uploadReadByte(client);
-            if (!client.connected()) return _parseFormUploadAborted();
-            if (argByte == 0x0A){
-              argByte = _uploadReadByte(client);
-              if (!client.connected()) return _parseFormUploadAborted();
-              if ((char)argByte != '-'){
-                //continue reading the file
-                _uploadWriteByte(0x0D);
-                _uploadWriteByte(0x0A);
-                goto readfile;
-              } else {
-                argByte = _uploadReadByte(client);
-                if (!client.connected()) return _parseFormUploadAborted();
-                if ((char)argByte != '-'){
-                  //continue reading the file
-                  _uploadWriteByte(0x0D);
-                  _uploadWriteByte(0x0A);
-                  _uploadWriteByte((uint8_t)('-'));
-                  goto readfile;
-                }
-              }
-
-              uint8_t endBuf[boundary.length()];
-              client.readBytes(endBuf, boundary.length());
-
-              if (strstr((const char*)endBuf, boundary.c_str()) != NULL){
-                if(_currentHandler && _currentHandler->canUpload(_currentUri))
-                  _currentHandler->upload(*this, _currentUri, *_currentUpload);
-                _currentUpload->totalSize += _currentUpload->currentSize;
-                _currentUpload->status = UPLOAD_FILE_END;
-                if(_currentHandler && _currentHandler->canUpload(_currentUri))
-                  _currentHandler->upload(*this, _currentUri, *_currentUpload);
+        if(_currentHandler && _currentHandler->canUpload(_currentUri))
+          _currentHandler->upload(*this, _currentUri, *_currentUpload);
+        _currentUpload->status = UPLOAD_FILE_WRITE;
+
+        bool found = readPart(reader, delimiter, skip, [this](uint8_t* data, size_t n) {
+          // data is _currentUpload->buf, the handler gets the span without a copy
+          (void) data;
+          _currentUpload->currentSize = n;
+          if(_currentHandler && _currentHandler->canUpload(_currentUri))
+            _currentHandler->upload(*this, _currentUri, *_currentUpload);
+          _currentUpload->totalSize += n;
+        });
+        _currentUpload->currentSize = 0;
+        if (!found) {
+          delete[] postArgs;
+          return _parseFormUploadAborted();
+        }
+        _currentUpload->status = UPLOAD_FILE_END;
+        if(_currentHandler && _currentHandler->canUpload(_currentUri))
+          _currentHandler->upload(*this, _currentUri, *_currentUpload);
 #ifdef DEBUG_ESP_HTTP_SERVER
-                DEBUG_OUTPUT.print("End File: ");
-                DEBUG_OUTPUT.print(_currentUpload->filename);
-                DEBUG_OUTPUT.print(" Type: ");
-                DEBUG_OUTPUT.print(_currentUpload->type);
-                DEBUG_OUTPUT.print(" Size: ");
-                DEBUG_OUTPUT.println(_currentUpload->totalSize);
+        DEBUG_OUTPUT.print("End File: ");
+        DEBUG_OUTPUT.print(_currentUpload->filename);
+        DEBUG_OUTPUT.print(" Type: ");
+        DEBUG_OUTPUT.print(_currentUpload->type);
+        DEBUG_OUTPUT.print(" Size: ");
+        DEBUG_OUTPUT.println(_currentUpload->totalSize);
 #endif
-                line = client.readStringUntil(0x0D);
-                client.readStringUntil(0x0A);
-                if (line == "--"){
+      }
+
+      // "--" after the delimiter closes the form, otherwise the next part follows
+      if (!reader.readLine(line) || line.startsWith("--")){
 #ifdef DEBUG_ESP_HTTP_SERVER
-                  DEBUG_OUTPUT.println("Done Parsing POST");
+        DEBUG_OUTPUT.println("Done Parsing POST");
 #endif
-                  break;
-                }
-                continue;
-              } else {
-                _uploadWriteByte(0x0D);
-                _uploadWriteByte(0x0A);
-                _uploadWriteByte((uint8_t)('-'));
-                _uploadWriteByte((uint8_t)('-'));
-                uint32_t i = 0;
-                while(i < boundary.length()){
-                  _uploadWriteByte(endBuf[i++]);
-                }
-                argByte = _uploadReadByte(client);
-                goto readfile;
-              }
-            } else {
-              _uploadWriteByte(0x0D);
-              goto readfile;
-            }
-            break;
-          }
-        }
+        break;
       }
     }
 
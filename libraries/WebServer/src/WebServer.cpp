@@ -29,6 +29,8 @@
 #include "FS.h"
 #include "detail/RequestHandlersImpl.h"
 #include "mbedtls/md5.h"
+#include <lwip/sockets.h>
+#include <errno.h>
 
 //#define DEBUG_ESP_HTTP_SERVER
 #ifdef DEBUG_ESP_PORT
@@ -38,9 +40,16 @@
 #endif
 
 static const char AUTHORIZATION_HEADER[] = "Authorization";
+// always collected, StaticRequestHandler answers conditional and range requests
+static const char* const RESERVED_HEADERS[] = { AUTHORIZATION_HEADER, "If-None-Match", "If-Modified-Since", "Range" };
+#define RESERVED_HEADERS_COUNT (sizeof(RESERVED_HEADERS) / sizeof(RESERVED_HEADERS[0]))
 static const char qop_auth[] = "qop=auth";
 static const char WWW_Authenticate[] = "WWW-Authenticate";
 static const char Content_Length[] = "Content-Length";
+static const char Content_Type[] = "Content-Type";
+// fixed response headers, copied as they are
+static const char HEADER_CONNECTION_CLOSE[] = "Connection: close\r\n";
+static const char HEADER_CHUNKED[] = "Accept-Ranges: none\r\nTransfer-Encoding: chunked\r\n";
 
 
 WebServer::WebServer(IPAddress addr, int port)
@@ -57,7 +66,10 @@ WebServer::WebServer(IPAddress addr, int port)
 , _headerKeysCount(0)
 , _currentHeaders(nullptr)
 , _contentLength(0)
+, _responseHeadersLen(0)
 , _chunked(false)
+, _streamChunkSize(HTTP_STREAM_CHUNK_SIZE)
+, _streamPsram(false)
 {
 }
 
@@ -75,7 +87,10 @@ WebServer::WebServer(int port)
 , _headerKeysCount(0)
 , _currentHeaders(nullptr)
 , _contentLength(0)
+, _responseHeadersLen(0)
 , _chunked(false)
+, _streamChunkSize(HTTP_STREAM_CHUNK_SIZE)
+, _streamPsram(false)
 {
 }
 
@@ -261,7 +276,9 @@ void WebServer::on(const String &uri, HTTPMethod method, WebServer::THandlerFunc
 }
 
 void WebServer::on(const String &uri, HTTPMethod method, WebServer::THandlerFunction fn, WebServer::THandlerFunction ufn) {
-  _addRequestHandler(new FunctionRequestHandler(fn, ufn, uri, method));
+  RequestHandler* handler = new FunctionRequestHandler(fn, ufn, uri, method);
+  _linkRequestHandler(handler);
+  _router.add(uri, method, handler);
 }
 
 void WebServer::addHandler(RequestHandler* handler) {
@@ -269,6 +286,11 @@ void WebServer::addHandler(RequestHandler* handler) {
 }
 
 void WebServer::_addRequestHandler(RequestHandler* handler) {
+    _linkRequestHandler(handler);
+    _router.addHandler(handler);
+}
+
+void WebServer::_linkRequestHandler(RequestHandler* handler) {
     if (!_lastHandler) {
       _firstHandler = handler;
       _lastHandler = handler;
@@ -360,60 +382,157 @@ void WebServer::stop() {
 }
 
 void WebServer::sendHeader(const String& name, const String& value, bool first) {
-  String headerLine = name;
-  headerLine += F(": ");
-  headerLine += value;
-  headerLine += "\r\n";
+  _appendHeader(name.c_str(), name.length(), value.c_str(), value.length(), first, HTTP_HEADER_RESERVED);
+}
+
+void WebServer::sendHeader(const char* name, const char* value, bool first) {
+  _appendHeader(name, strlen(name), value, strlen(value), first, HTTP_HEADER_RESERVED);
+}
 
+// room for len bytes of headers at the end, or at the start when first is set,
+// leaving keep bytes free for the headers still to come; nullptr once the
+// headers have spilled over into _responseHeadersSpill
+char* WebServer::_reserveHeader(size_t len, bool first, size_t keep) {
+  // keep two bytes for the empty line that ends the block
+  if (_responseHeadersSpill.length() || HTTP_STATUS_LINE_MAX + _responseHeadersLen + len + keep + 2 > HTTP_HEADER_BUFLEN) {
+    return nullptr;
+  }
+  char* headers = _responseHeaders + HTTP_STATUS_LINE_MAX;
+  char* line = headers + _responseHeadersLen;
   if (first) {
-    _responseHeaders = headerLine + _responseHeaders;
+    memmove(headers + len, headers, _responseHeadersLen);
+    line = headers;
   }
-  else {
-    _responseHeaders += headerLine;
+  _responseHeadersLen += len;
+  return line;
+}
+
+// slow path for headers that do not fit in HTTP_HEADER_BUFLEN: the ones
+// buffered so far move to a String, and all later ones go there too
+void WebServer::_spillHeader(const String& line, bool first) {
+  if (!_responseHeadersSpill.length()) {
+    log_w("response headers exceed HTTP_HEADER_BUFLEN (%u)", (unsigned)HTTP_HEADER_BUFLEN);
+    char* headers = _responseHeaders + HTTP_STATUS_LINE_MAX;
+    headers[_responseHeadersLen] = 0;
+    _responseHeadersSpill = headers;
+    _responseHeadersLen = 0;
+  }
+  if (first) {
+    _responseHeadersSpill = line + _responseHeadersSpill;
+  } else {
+    _responseHeadersSpill += line;
   }
 }
 
+void WebServer::_appendHeader(const char* name, size_t nameLen, const char* value, size_t valueLen, bool first, size_t keep) {
+  size_t len = nameLen + valueLen + 4;
+  char* line = _reserveHeader(len, first, keep);
+  if (!line) {
+    String spill;
+    spill.reserve(len);
+    spill += name;
+    spill += ": ";
+    spill += value;
+    spill += "\r\n";
+    _spillHeader(spill, first);
+    return;
+  }
+  memcpy(line, name, nameLen);
+  line += nameLen;
+  *line++ = ':';
+  *line++ = ' ';
+  memcpy(line, value, valueLen);
+  line += valueLen;
+  *line++ = '\r';
+  *line = '\n';
+}
+
+void WebServer::_appendHeaderLine(const char* text, size_t len) {
+  char* line = _reserveHeader(len, false);
+  if (!line) {
+    _spillHeader(String(text), false);
+    return;
+  }
+  memcpy(line, text, len);
+}
+
 void WebServer::setContentLength(const size_t contentLength) {
     _contentLength = contentLength;
 }
 
-void WebServer::_prepareHeader(String& response, int code, const char* content_type, size_t contentLength) {
-    response = String(F("HTTP/1.")) + String(_currentVersion) + ' ';
-    response += String(code);
-    response += ' ';
-    response += _responseCodeToString(code);
-    response += "\r\n";
-
+// builds status line and headers in _responseHeaders, block points at the result
+size_t WebServer::_prepareHeader(char*& block, int code, const char* content_type, size_t contentLength) {
     using namespace mime;
     if (!content_type)
         content_type = mimeTable[html].mimeType;
 
-    sendHeader(String(F("Content-Type")), String(FPSTR(content_type)), true);
+    _appendHeader(Content_Type, sizeof(Content_Type) - 1, content_type, strlen(content_type), true);
+    char number[11];
     if (_contentLength == CONTENT_LENGTH_NOT_SET) {
-        sendHeader(String(FPSTR(Content_Length)), String(contentLength));
+        _appendHeader(Content_Length, sizeof(Content_Length) - 1, number, sprintf(number, "%u", (unsigned)contentLength), false);
     } else if (_contentLength != CONTENT_LENGTH_UNKNOWN) {
-        sendHeader(String(FPSTR(Content_Length)), String(_contentLength));
+        _appendHeader(Content_Length, sizeof(Content_Length) - 1, number, sprintf(number, "%u", (unsigned)_contentLength), false);
     } else if(_contentLength == CONTENT_LENGTH_UNKNOWN && _currentVersion){ //HTTP/1.1 or above client
       //let's do chunked
       _chunked = true;
-      sendHeader(String(F("Accept-Ranges")),String(F("none")));
-      sendHeader(String(F("Transfer-Encoding")),String(F("chunked")));
+      _appendHeaderLine(HEADER_CHUNKED, sizeof(HEADER_CHUNKED) - 1);
+    }
+    _appendHeaderLine(HEADER_CONNECTION_CLOSE, sizeof(HEADER_CONNECTION_CLOSE) - 1);
+
+    char* end = _responseHeaders + HTTP_STATUS_LINE_MAX + _responseHeadersLen;
+    end[0] = '\r';
+    end[1] = '\n';
+
+    // the status line goes right in front of the headers
+    char status[HTTP_STATUS_LINE_MAX + 1];
+    int statusLen = snprintf(status, sizeof(status), "HTTP/1.%d %d %s\r\n", _currentVersion, code, _responseCodeText(code));
+    if (statusLen > HTTP_STATUS_LINE_MAX)
+        statusLen = HTTP_STATUS_LINE_MAX;
+    block = _responseHeaders + HTTP_STATUS_LINE_MAX - statusLen;
+    memcpy(block, status, statusLen);
+
+    if (_responseHeadersSpill.length()) {
+        // send them now, which leaves the whole buffer to the body
+        _currentClientWrite(block, statusLen);
+        _responseHeadersSpill += "\r\n";
+        _currentClientWrite(_responseHeadersSpill.c_str(), _responseHeadersSpill.length());
+        _responseHeadersSpill = String();
+        block = _responseHeaders;
+        return 0;
     }
-    sendHeader(String(F("Connection")), String(F("close")));
 
-    response += _responseHeaders;
-    response += "\r\n";
-    _responseHeaders = "";
+    size_t len = statusLen + _responseHeadersLen + 2;
+    _responseHeadersLen = 0;
+    return len;
+}
+
+// writes the header, and the body in the same write when it fits behind it
+// returns false if only the header was written
+bool WebServer::_sendHeaderAndContent(char* header, size_t headerLen, const char* content, size_t len) {
+    char* body = header + headerLen;
+    size_t room = (_responseHeaders + HTTP_HEADER_BUFLEN) - body;
+    char chunkSize[11];
+    size_t frame = _chunked ? sprintf(chunkSize, "%x\r\n", (unsigned)len) : 0;
+    size_t footer = _chunked ? 2 : 0;
+    if (!content || !len || frame + len + footer > room) {
+        if (headerLen)
+            _currentClientWrite(header, headerLen);
+        return !len;
+    }
+    memcpy(body, chunkSize, frame);
+    memcpy_P(body + frame, content, len);
+    memcpy(body + frame + len, "\r\n", footer);
+    _currentClientWrite(header, headerLen + frame + len + footer);
+    return true;
 }
 
 void WebServer::send(int code, const char* content_type, const String& content) {
-    String header;
+    char* header;
     // Can we asume the following?
     //if(code == 200 && content.length() == 0 && _contentLength == CONTENT_LENGTH_NOT_SET)
     //  _contentLength = CONTENT_LENGTH_UNKNOWN;
-    _prepareHeader(header, code, content_type, content.length());
-    _currentClientWrite(header.c_str(), header.length());
-    if(content.length())
+    size_t headerLen = _prepareHeader(header, code, content_type, content.length());
+    if (!_sendHeaderAndContent(header, headerLen, content.c_str(), content.length()))
       sendContent(content);
 }
 
@@ -424,21 +543,16 @@ void WebServer::send_P(int code, PGM_P content_type, PGM_P content) {
         contentLength = strlen_P(content);
     }
 
-    String header;
-    char type[64];
-    memccpy_P((void*)type, (PGM_VOID_P)content_type, 0, sizeof(type));
-    _prepareHeader(header, code, (const char* )type, contentLength);
-    _currentClientWrite(header.c_str(), header.length());
-    sendContent_P(content);
+    send_P(code, content_type, content, contentLength);
 }
 
 void WebServer::send_P(int code, PGM_P content_type, PGM_P content, size_t contentLength) {
-    String header;
+    char* header;
     char type[64];
     memccpy_P((void*)type, (PGM_VOID_P)content_type, 0, sizeof(type));
-    _prepareHeader(header, code, (const char* )type, contentLength);
-    sendContent(header);
-    sendContent_P(content, contentLength);
+    size_t headerLen = _prepareHeader(header, code, (const char* )type, contentLength);
+    if (!_sendHeaderAndContent(header, headerLen, content, contentLength))
+      sendContent_P(content, contentLength);
 }
 
 void WebServer::send(int code, char* content_type, const String& content) {
@@ -453,16 +567,12 @@ void WebServer::sendContent(const String& content) {
   const char * footer = "\r\n";
   size_t len = content.length();
   if(_chunked) {
-    char * chunkSize = (char *)malloc(11);
-    if(chunkSize){
-      sprintf(chunkSize, "%x%s", len, footer);
-      _currentClientWrite(chunkSize, strlen(chunkSize));
-      free(chunkSize);
-    }
+    char chunkSize[11];
+    _currentClientWrite(chunkSize, sprintf(chunkSize, "%x%s", (unsigned)len, footer));
   }
   _currentClientWrite(content.c_str(), len);
   if(_chunked){
-    _currentClient.write(footer, 2);
+    _currentClientWrite(footer, 2);
     if (len == 0) {
       _chunked = false;
     }
@@ -476,16 +586,12 @@ void WebServer::sendContent_P(PGM_P content) {
 void WebServer::sendContent_P(PGM_P content, size_t size) {
   const char * footer = "\r\n";
   if(_chunked) {
-    char * chunkSize = (char *)malloc(11);
-    if(chunkSize){
-      sprintf(chunkSize, "%x%s", size, footer);
-      _currentClientWrite(chunkSize, strlen(chunkSize));
-      free(chunkSize);
-    }
+    char chunkSize[11];
+    _currentClientWrite(chunkSize, sprintf(chunkSize, "%x%s", (unsigned)size, footer));
   }
   _currentClientWrite_P(content, size);
   if(_chunked){
-    _currentClient.write(footer, 2);
+    _currentClientWrite(footer, 2);
     if (size == 0) {
       _chunked = false;
     }
@@ -506,6 +612,130 @@ void WebServer::_streamFileCore(const size_t fileSize, const String & fileName,
 }
 
 
+void WebServer::setStreamBuffer(size_t chunkSize, bool psram) {
+  _streamChunkSize = chunkSize ? chunkSize : HTTP_STREAM_CHUNK_SIZE;
+  _streamPsram = psram;
+}
+
+// >0 bytes taken by the socket, 0 if it is full, -1 on error
+int WebServer::_streamSend(const uint8_t* buf, size_t len) {
+  int fd = _currentClient.fd();
+  if (fd < 0) {
+    size_t sent = _currentClientWrite((const char*)buf, len);
+    return sent ? sent : -1;
+  }
+  int res = ::send(fd, buf, len, MSG_DONTWAIT);
+  if (res > 0) {
+    return res;
+  }
+  if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    log_e("send failed: %d", errno);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Reads the source in blocks of _streamChunkSize and hands each to the
+ * socket without blocking, waiting in select() only while its send buffer
+ * is full. Reading and sending alternate in this task; the network keeps
+ * transmitting what the send buffer holds while the next block is read.
+ * With chunked encoding each block is framed in place, so a chunk is one send.
+ * */
+size_t WebServer::_streamContent(TStreamReader read, size_t size) {
+  const size_t head = _chunked ? 10 : 0;  // room for "<hex>\r\n"
+  const size_t tail = _chunked ? 2 : 0;
+  size_t cap = _streamChunkSize;
+
+  uint8_t* buf = NULL;
+  if (_streamPsram && psramFound()) {
+    buf = (uint8_t*)ps_malloc(head + cap + tail);
+  }
+  if (!buf) {
+    buf = (uint8_t*)malloc(head + cap + tail);
+  }
+  if (!buf) {
+    cap = HTTP_DOWNLOAD_UNIT_SIZE;
+    buf = (uint8_t*)malloc(head + cap + tail);
+    if (!buf) {
+      log_e("no memory for the stream buffer");
+      return 0;
+    }
+  }
+
+  size_t remaining = size;
+  size_t written = 0;
+  bool failed = false;
+  while (remaining) {
+    size_t want = (remaining != CONTENT_LENGTH_UNKNOWN && remaining < cap) ? remaining : cap;
+    size_t got = read(buf + head, want);
+    if (!got || got == (size_t)-1) {
+      break;
+    }
+    if (remaining != CONTENT_LENGTH_UNKNOWN) {
+      remaining -= got;
+    }
+    size_t off = head;
+    size_t end = head + got;
+    if (_chunked) {
+      char prefix[11];
+      int len = snprintf(prefix, sizeof(prefix), "%x\r\n", (unsigned int)got);
+      off = head - len;
+      memcpy(buf + off, prefix, len);
+      memcpy(buf + end, "\r\n", 2);
+      end += 2;
+    }
+
+    unsigned long stalled = 0;
+    while (off < end) {
+      int res = _streamSend(buf + off, end - off);
+      if (res < 0) {
+        failed = true;
+        break;
+      }
+      if (res == 0) {
+        // socket full, wait for room
+        if (!stalled) {
+          stalled = millis();
+        } else if (millis() - stalled > HTTP_MAX_SEND_WAIT) {
+          log_e("stream send timeout");
+          failed = true;
+          break;
+        }
+        fd_set set;
+        struct timeval tv = { 0, 100000 };
+        FD_ZERO(&set);
+        FD_SET(_currentClient.fd(), &set);
+        select(_currentClient.fd() + 1, NULL, &set, NULL, &tv);
+        continue;
+      }
+      stalled = 0;
+      off += res;
+    }
+    if (failed) {
+      break;
+    }
+    written += got;
+  }
+  free(buf);
+
+  if (_chunked && !failed && remaining == CONTENT_LENGTH_UNKNOWN) {
+    _currentClientWrite("0\r\n\r\n", 5);
+    _chunked = false;
+  }
+  return written;
+}
+
+String WebServer::pathArg(unsigned int i) {
+  if (i < _pathArgs.size())
+    return _pathArgs[i];
+  return "";
+}
+
+int WebServer::pathArgs() {
+  return _pathArgs.size();
+}
+
 String WebServer::arg(String name) {
   for (int i = 0; i < _currentArgCount; ++i) {
     if ( _currentArgs[i].key == name )
@@ -548,13 +778,15 @@ String WebServer::header(String name) {
 }
 
 void WebServer::collectHeaders(const char* headerKeys[], const size_t headerKeysCount) {
-  _headerKeysCount = headerKeysCount + 1;
+  _headerKeysCount = headerKeysCount + RESERVED_HEADERS_COUNT;
   if (_currentHeaders)
      delete[]_currentHeaders;
   _currentHeaders = new RequestArgument[_headerKeysCount];
-  _currentHeaders[0].key = FPSTR(AUTHORIZATION_HEADER);
-  for (int i = 1; i < _headerKeysCount; i++){
-    _currentHeaders[i].key = headerKeys[i-1];
+  for (size_t i = 0; i < RESERVED_HEADERS_COUNT; i++){
+    _currentHeaders[i].key = FPSTR(RESERVED_HEADERS[i]);
+  }
+  for (int i = RESERVED_HEADERS_COUNT; i < _headerKeysCount; i++){
+    _currentHeaders[i].key = headerKeys[i-RESERVED_HEADERS_COUNT];
   }
 }
 
@@ -632,47 +864,51 @@ void WebServer::_finalizeResponse() {
 }
 
 String WebServer::_responseCodeToString(int code) {
+  return String(_responseCodeText(code));
+}
+
+const char* WebServer::_responseCodeText(int code) {
   switch (code) {
-    case 100: return F("Continue");
-    case 101: return F("Switching Protocols");
-    case 200: return F("OK");
-    case 201: return F("Created");
-    case 202: return F("Accepted");
-    case 203: return F("Non-Authoritative Information");
-    case 204: return F("No Content");
-    case 205: return F("Reset Content");
-    case 206: return F("Partial Content");
-    case 300: return F("Multiple Choices");
-    case 301: return F("Moved Permanently");
-    case 302: return F("Found");
-    case 303: return F("See Other");
-    case 304: return F("Not Modified");
-    case 305: return F("Use Proxy");
-    case 307: return F("Temporary Redirect");
-    case 400: return F("Bad Request");
-    case 401: return F("Unauthorized");
-    case 402: return F("Payment Required");
-    case 403: return F("Forbidden");
-    case 404: return F("Not Found");
-    case 405: return F("Method Not Allowed");
-    case 406: return F("Not Acceptable");
-    case 407: return F("Proxy Authentication Required");
-    case 408: return F("Request Time-out");
-    case 409: return F("Conflict");
-    case 410: return F("Gone");
-    case 411: return F("Length Required");
-    case 412: return F("Precondition Failed");
-    case 413: return F("Request Entity Too Large");
-    case 414: return F("Request-URI Too Large");
-    case 415: return F("Unsupported Media Type");
-    case 416: return F("Requested range not satisfiable");
-    case 417: return F("Expectation Failed");
-    case 500: return F("Internal Server Error");
-    case 501: return F("Not Implemented");
-    case 502: return F("Bad Gateway");
-    case 503: return F("Service Unavailable");
-    case 504: return F("Gateway Time-out");
-    case 505: return F("HTTP Version not supported");
-    default:  return F("");
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 203: return "Non-Authoritative Information";
+    case 204: return "No Content";
+    case 205: return "Reset Content";
+    case 206: return "Partial Content";
+    case 300: return "Multiple Choices";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 305: return "Use Proxy";
+    case 307: return "Temporary Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 402: return "Payment Required";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 406: return "Not Acceptable";
+    case 407: return "Proxy Authentication Required";
+    case 408: return "Request Time-out";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 411: return "Length Required";
+    case 412: return "Precondition Failed";
+    case 413: return "Request Entity Too Large";
+    case 414: return "Request-URI Too Large";
+    case 415: return "Unsupported Media Type";
+    case 416: return "Requested range not satisfiable";
+    case 417: return "Expectation Failed";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Time-out";
+    case 505: return "HTTP Version not supported";
+    default:  return "";
   }
 }
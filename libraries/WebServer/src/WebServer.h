@@ -36,10 +36,20 @@ enum HTTPAuthMethod { BASIC_AUTH, DIGEST_AUTH };
 
 #define HTTP_DOWNLOAD_UNIT_SIZE 1436
 
+#ifndef HTTP_STREAM_CHUNK_SIZE
+#define HTTP_STREAM_CHUNK_SIZE 4096 //bytes read from a file per socket write, allocated while streaming
+#endif
+
 #ifndef HTTP_UPLOAD_BUFLEN
 #define HTTP_UPLOAD_BUFLEN 1436
 #endif
 
+#ifndef HTTP_HEADER_BUFLEN
+#define HTTP_HEADER_BUFLEN 1024 //status line and response headers, small bodies are sent from here in the same write; more headers go through a String
+#endif
+#define HTTP_STATUS_LINE_MAX 48 //reserved in front of the headers for the status line
+#define HTTP_HEADER_RESERVED 160 //kept free by sendHeader() for Content-Type, Content-Length or chunked, and Connection
+
 #define HTTP_MAX_DATA_WAIT 5000 //ms to wait for the client to send the request
 #define HTTP_MAX_POST_WAIT 5000 //ms to wait for POST data to arrive
 #define HTTP_MAX_SEND_WAIT 5000 //ms to wait for data chunk to be ACKed
@@ -61,6 +71,7 @@ typedef struct {
 } HTTPUpload;
 
 #include "detail/RequestHandler.h"
+#include "detail/UriRouter.h"
 
 namespace fs {
 class FS;
@@ -84,6 +95,8 @@ public:
   void requestAuthentication(HTTPAuthMethod mode = BASIC_AUTH, const char* realm = NULL, const String& authFailMsg = String("") );
 
   typedef std::function<void(void)> THandlerFunction;
+  // uri may contain {name} segments and end in /*, e.g. "/api/sensor/{id}",
+  // the matched parts are available with pathArg()
   void on(const String &uri, THandlerFunction handler);
   void on(const String &uri, HTTPMethod method, THandlerFunction fn);
   void on(const String &uri, HTTPMethod method, THandlerFunction fn, THandlerFunction ufn);
@@ -97,6 +110,8 @@ public:
   virtual WiFiClient client() { return _currentClient; }
   HTTPUpload& upload() { return *_currentUpload; }
 
+  String pathArg(unsigned int i); // get request path argument by number, see on()
+  int pathArgs();                 // get path argument count
   String arg(String name);        // get request argument value by name
   String arg(int i);              // get request argument value by number
   String argName(int i);          // get request argument name by number
@@ -123,35 +138,56 @@ public:
 
   void setContentLength(const size_t contentLength);
   void sendHeader(const String& name, const String& value, bool first = false);
+  void sendHeader(const char* name, const char* value, bool first = false);
   void sendContent(const String& content);
   void sendContent_P(PGM_P content);
   void sendContent_P(PGM_P content, size_t size);
 
   static String urlDecode(const String& text);
 
+  // buffer size used by streamFile()/streamContent(), optionally taken from PSRAM
+  void setStreamBuffer(size_t chunkSize, bool psram = false);
+
   template<typename T> 
   size_t streamFile(T &file, const String& contentType) {
     _streamFileCore(file.size(), file.name(), contentType);
-    return _currentClient.write(file);
+    return streamContent(file, file.size());
+  }
+
+  // Send `size` bytes read from source (anything with read(uint8_t*, size_t),
+  // e.g. File) as the body after send() wrote the headers. With
+  // CONTENT_LENGTH_UNKNOWN it reads to the end and uses chunked encoding
+  // when the response was started that way.
+  template<typename T>
+  size_t streamContent(T &source, size_t size = CONTENT_LENGTH_UNKNOWN) {
+    return _streamContent([&source](uint8_t* buf, size_t len) -> size_t { return source.read(buf, len); }, size);
   }
   
 protected:
   virtual size_t _currentClientWrite(const char* b, size_t l) { return _currentClient.write( b, l ); }
   virtual size_t _currentClientWrite_P(PGM_P b, size_t l) { return _currentClient.write_P( b, l ); }
   void _addRequestHandler(RequestHandler* handler);
+  void _linkRequestHandler(RequestHandler* handler);
   void _handleRequest();
   void _finalizeResponse();
   bool _parseRequest(WiFiClient& client);
   void _parseArguments(String data);
   static String _responseCodeToString(int code);
+  static const char* _responseCodeText(int code);
   bool _parseForm(WiFiClient& client, String boundary, uint32_t len);
   bool _parseFormUploadAborted();
-  void _uploadWriteByte(uint8_t b);
-  uint8_t _uploadReadByte(WiFiClient& client);
-  void _prepareHeader(String& response, int code, const char* content_type, size_t contentLength);
+  size_t _prepareHeader(char*& block, int code, const char* content_type, size_t contentLength);
+  char* _reserveHeader(size_t len, bool first, size_t keep = 0);
+  void _appendHeader(const char* name, size_t nameLen, const char* value, size_t valueLen, bool first, size_t keep = 0);
+  void _appendHeaderLine(const char* text, size_t len);
+  void _spillHeader(const String& line, bool first);
+  bool _sendHeaderAndContent(char* header, size_t headerLen, const char* content, size_t len);
   bool _collectHeader(const char* headerName, const char* headerValue);
  
   void _streamFileCore(const size_t fileSize, const String & fileName, const String & contentType);
+  typedef std::function<size_t(uint8_t*, size_t)> TStreamReader;
+  size_t _streamContent(TStreamReader read, size_t size);
+  int _streamSend(const uint8_t* buf, size_t len);
 
   String _getRandomHexString();
   // for extracting Auth parameters
@@ -174,6 +210,8 @@ protected:
   RequestHandler*  _currentHandler;
   RequestHandler*  _firstHandler;
   RequestHandler*  _lastHandler;
+  UriRouter        _router;
+  std::vector<String> _pathArgs;
   THandlerFunction _notFoundHandler;
   THandlerFunction _fileUploadHandler;
 
@@ -184,10 +222,14 @@ protected:
   int              _headerKeysCount;
   RequestArgument* _currentHeaders;
   size_t           _contentLength;
-  String           _responseHeaders;
+  char             _responseHeaders[HTTP_HEADER_BUFLEN]; // headers start at HTTP_STATUS_LINE_MAX
+  size_t           _responseHeadersLen;
+  String           _responseHeadersSpill; // all headers once they outgrow _responseHeaders
 
   String           _hostHeader;
   bool             _chunked;
+  size_t           _streamChunkSize;
+  bool             _streamPsram;
 
   String           _snonce;  // Store noance and opaque for future comparison
   String           _sopaque;
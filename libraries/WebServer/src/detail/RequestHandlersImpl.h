@@ -2,8 +2,10 @@
 #define REQUESTHANDLERSIMPL_H
 
 #include "RequestHandler.h"
+#include "UriRouter.h"
 #include "mimetable.h"
 #include "WString.h"
+#include <vector>
 
 using namespace mime;
 
@@ -14,6 +16,7 @@ public:
     , _ufn(ufn)
     , _uri(uri)
     , _method(method)
+    , _pattern(UriRouter::isPattern(uri))
     {
     }
 
@@ -21,7 +24,7 @@ public:
         if (_method != HTTP_ANY && _method != requestMethod)
             return false;
 
-        if (requestUri != _uri)
+        if (_pattern ? !UriRouter::matches(_uri, requestUri) : requestUri != _uri)
             return false;
 
         return true;
@@ -55,6 +58,24 @@ protected:
     WebServer::THandlerFunction _ufn;
     String _uri;
     HTTPMethod _method;
+    bool _pattern;
+};
+
+#ifndef STATIC_INDEX_MAX_ASSETS
+#define STATIC_INDEX_MAX_ASSETS 128     // files indexed per serveStatic() call, the rest are looked up per request
+#endif
+
+// what serveStatic() knows about a file without touching the file system
+struct StaticAsset {
+    String key;         // request path relative to the handler's uri
+    String path;        // file to send, may be the .gz variant
+    size_t size;
+    time_t mtime;       // 0 when the file system keeps no times (SPIFFS)
+    uint32_t hash;      // FNV-1a of the content, only for the ETag when mtime is 0
+    mime::type type;
+    bool gz;
+    bool hashed;        // hash is valid for this size and mtime
+    int next;           // next asset in the same bucket, -1 at the end
 };
 
 class StaticRequestHandler : public RequestHandler {
@@ -65,9 +86,16 @@ public:
     , _path(path)
     , _cache_header(cache_header)
     {
-        _isFile = fs.exists(path);
+        File f = fs.open(path, "r");
+        _isFile = f && !f.isDirectory();
         log_v("StaticRequestHandler: path=%s uri=%s isFile=%d, cache_header=%s\r\n", path, uri, _isFile, cache_header);
         _baseUriLength = _uri.length();
+        if (_isFile) {
+            _index(f, String(), false);
+        } else if (f) {
+            _indexDir(f);
+        }
+        log_v("StaticRequestHandler: %u assets indexed\r\n", _assets.size());
     }
 
     bool canHandle(HTTPMethod requestMethod, String requestUri) override  {
@@ -86,8 +114,7 @@ public:
 
         log_v("StaticRequestHandler::handle: request=%s _uri=%s\r\n", requestUri.c_str(), _uri.c_str());
 
-        String path(_path);
-
+        String rel;
         if (!_isFile) {
             // Base URI doesn't point to a file.
             // If a directory is requested, look for index file.
@@ -95,21 +122,91 @@ public:
               requestUri += "index.htm";
 
             // Append whatever follows this URI in request to get the file path.
-            path += requestUri.substring(_baseUriLength);
+            rel = requestUri.substring(_baseUriLength);
         }
+
+        StaticAsset* asset = _find(rel);
+        if (!asset)
+            return _handleUnindexed(server, rel);
+
+        File f = _fs.open(asset->path, "r");
+        if (!f)
+            return false;
+
+        // the index is built once, catch files that were replaced since
+        _stat(f, asset);
+
+        // without a modification time the content is hashed on the first
+        // request and again when the size changes; a same size replacement
+        // on such a file system keeps the old tag until the next restart
+        char etag[24];
+        if (asset->mtime) {
+            snprintf(etag, sizeof(etag), "\"%lx-%x\"", (unsigned long)asset->mtime, (unsigned)asset->size);
+        } else {
+            if (!asset->hashed && !_hashFile(f, asset))
+                return false;
+            snprintf(etag, sizeof(etag), "\"%08x-%x\"", asset->hash, (unsigned)asset->size);
+        }
+        String lastModified = _httpDate(asset->mtime);
+
+        if (_cache_header.length() != 0)
+            server.sendHeader("Cache-Control", _cache_header);
+        server.sendHeader("ETag", etag);
+        if (lastModified.length())
+            server.sendHeader("Last-Modified", lastModified);
+
+        String ifNoneMatch = server.header("If-None-Match");
+        bool notModified = ifNoneMatch.length() ? _etagMatches(ifNoneMatch, etag) :
+                           (lastModified.length() && server.header("If-Modified-Since") == lastModified);
+        if (notModified) {
+            server.send(304);
+            return true;
+        }
+
+        String contentType = FPSTR(mimeTable[asset->type].mimeType);
+        if (asset->gz && asset->type != gz && asset->type != none)
+            server.sendHeader(F("Content-Encoding"), F("gzip"));
+        server.sendHeader(F("Accept-Ranges"), F("bytes"));
+
+        String range = server.header("Range");
+        if (!range.length()) {
+            server.setContentLength(asset->size);
+            server.send(200, contentType, "");
+            server.streamContent(f, asset->size);
+            return true;
+        }
+
+        size_t start, end;
+        if (!_parseRange(range, asset->size, start, end)) {
+            server.sendHeader(F("Content-Range"), String(F("bytes */")) + String(asset->size));
+            server.send(416);
+            return true;
+        }
+        server.sendHeader(F("Content-Range"), String(F("bytes ")) + String(start) + '-' + String(end) + '/' + String(asset->size));
+        server.setContentLength(end - start + 1);
+        server.send(206, contentType, "");
+        if (f.seek(start, SeekSet))
+            server.streamContent(f, end - start + 1);
+        return true;
+    }
+
+    static String getContentType(const String& path) {
+        return String(FPSTR(mimeTable[lookup(path.c_str())].mimeType));
+    }
+
+protected:
+    // files that were not there when the index was built
+    bool _handleUnindexed(WebServer& server, const String& rel) {
+        String path = _path + rel;
         log_v("StaticRequestHandler::handle: path=%s, isFile=%d\r\n", path.c_str(), _isFile);
 
         String contentType = getContentType(path);
 
         // look for gz file, only if the original specified path is not a gz.  So part only works to send gzip via content encoding when a non compressed is asked for
         // if you point the the path to gzip you will serve the gzip as content type "application/x-gzip", not text or javascript etc...
-        if (!path.endsWith(FPSTR(mimeTable[gz].endsWith)) && !_fs.exists(path))  {
-            String pathWithGz = path + FPSTR(mimeTable[gz].endsWith);
-            if(_fs.exists(pathWithGz))
-                path += FPSTR(mimeTable[gz].endsWith);
-        }
-
         File f = _fs.open(path, "r");
+        if (!f && !path.endsWith(FPSTR(mimeTable[gz].endsWith)))
+            f = _fs.open(path + FPSTR(mimeTable[gz].endsWith), "r");
         if (!f)
             return false;
 
@@ -120,28 +217,152 @@ public:
         return true;
     }
 
-    static String getContentType(const String& path) {
-        char buff[sizeof(mimeTable[0].mimeType)];
-        // Check all entries but last one for match, return if found
-        for (size_t i=0; i < sizeof(mimeTable)/sizeof(mimeTable[0])-1; i++) {
-            strcpy_P(buff, mimeTable[i].endsWith);
-            if (path.endsWith(buff)) {
-                strcpy_P(buff, mimeTable[i].mimeType);
-                return String(buff);
+    void _indexDir(File& dir) {
+        File f;
+        while (_assets.size() < STATIC_INDEX_MAX_ASSETS && (f = dir.openNextFile())) {
+            if (f.isDirectory()) {
+                _indexDir(f);
+                continue;
+            }
+            String name = f.name();
+            if (!name.startsWith(_path))
+                continue;
+            // same string the request path is appended to _path with
+            String rel = name.substring(_path.length());
+            if (rel.endsWith(FPSTR(mimeTable[gz].endsWith))) {
+                // a .gz sibling answers for the plain name unless that exists too
+                rel.remove(rel.length() - strlen(mimeTable[gz].endsWith));
+                if (!_find(rel) && !_fs.exists(name.substring(0, name.length() - strlen(mimeTable[gz].endsWith))))
+                    _index(f, rel, true);
+                continue;
             }
+            StaticAsset* compressed = _find(rel);
+            if (compressed)
+                _fill(f, compressed, rel, false);
+            else
+                _index(f, rel, false);
         }
-        // Fall-through and just return default type
-        strcpy_P(buff, mimeTable[sizeof(mimeTable)/sizeof(mimeTable[0])-1].mimeType);
-        return String(buff);
     }
 
-protected:
+    void _index(File& f, const String& rel, bool gz) {
+        StaticAsset asset;
+        _fill(f, &asset, rel, gz);
+        if (_buckets.empty())
+            _buckets.assign(STATIC_INDEX_MAX_ASSETS / 2, -1);
+        uint32_t bucket = _hash(rel.c_str(), rel.length()) % _buckets.size();
+        asset.next = _buckets[bucket];
+        _buckets[bucket] = _assets.size();
+        _assets.push_back(asset);
+    }
+
+    void _fill(File& f, StaticAsset* asset, const String& rel, bool gz) {
+        asset->key = rel;
+        asset->path = f.name();
+        asset->gz = gz;
+        asset->type = lookup(gz ? rel.c_str() : asset->path.c_str());
+        asset->hashed = false;
+        _stat(f, asset);
+    }
+
+    static void _stat(File& f, StaticAsset* asset) {
+        size_t size = f.size();
+        time_t mtime = f.getLastWrite();
+        if (size != asset->size || mtime != asset->mtime)
+            asset->hashed = false;
+        asset->size = size;
+        asset->mtime = mtime;
+    }
+
+    static bool _hashFile(File& f, StaticAsset* asset) {
+        uint8_t buf[256];
+        size_t len;
+        asset->hash = 2166136261UL;
+        while ((len = f.read(buf, sizeof(buf))) > 0 && len != (size_t)-1)
+            asset->hash = _hash(buf, len, asset->hash);
+        asset->hashed = true;
+        return f.seek(0, SeekSet);
+    }
+
+    StaticAsset* _find(const String& rel) {
+        if (_buckets.empty())
+            return nullptr;
+        for (int i = _buckets[_hash(rel.c_str(), rel.length()) % _buckets.size()]; i >= 0; i = _assets[i].next) {
+            if (_assets[i].key == rel)
+                return &_assets[i];
+        }
+        return nullptr;
+    }
+
+    static uint32_t _hash(const void* data, size_t len, uint32_t hash = 2166136261UL) {
+        const uint8_t* p = (const uint8_t*)data;
+        while (len--)
+            hash = (hash ^ *p++) * 16777619UL;
+        return hash;
+    }
+
+    // If-None-Match is * or a comma separated list of tags, compared weakly
+    static bool _etagMatches(const String& header, const char* etag) {
+        int start = 0;
+        while (start <= (int)header.length()) {
+            int comma = header.indexOf(',', start);
+            if (comma < 0)
+                comma = header.length();
+            String tag = header.substring(start, comma);
+            tag.trim();
+            if (tag.startsWith("W/"))
+                tag.remove(0, 2);
+            if (tag == "*" || tag == etag)
+                return true;
+            start = comma + 1;
+        }
+        return false;
+    }
+
+    // single "bytes=a-b", "bytes=a-" or "bytes=-n" range, end is inclusive
+    static bool _parseRange(const String& header, size_t size, size_t& start, size_t& end) {
+        if (!header.startsWith("bytes=") || header.indexOf(',') >= 0 || !size)
+            return false;
+        int dash = header.indexOf('-');
+        if (dash < 0)
+            return false;
+        String first = header.substring(6, dash);
+        String last = header.substring(dash + 1);
+        first.trim();
+        last.trim();
+        if (!first.length()) {
+            size_t suffix = last.toInt();
+            if (!suffix)
+                return false;
+            start = (suffix < size) ? size - suffix : 0;
+            end = size - 1;
+            return true;
+        }
+        start = first.toInt();
+        end = last.length() ? (size_t)last.toInt() : size - 1;
+        if (end >= size)
+            end = size - 1;
+        return start <= end;
+    }
+
+    static String _httpDate(time_t t) {
+        // files written without a set clock carry 1970 dates, don't advertise those
+        if (t < 946684800)
+            return String();
+        char buf[32];
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return String(buf);
+    }
+
     FS _fs;
     String _uri;
     String _path;
     String _cache_header;
     bool _isFile;
     size_t _baseUriLength;
+    std::vector<StaticAsset> _assets;
+    std::vector<int> _buckets;
 };
 
 
@@ -0,0 +1,220 @@
+#include "../WebServer.h"
+#include "UriRouter.h"
+#include <string.h>
+
+// compare a request segment with a node segment, the order used to sort children
+static int segmentCompare(const char* segment, size_t len, const String& other)
+{
+    size_t otherLen = other.length();
+    int c = strncmp(segment, other.c_str(), len < otherLen ? len : otherLen);
+    if (c)
+        return c;
+    return (len < otherLen) ? -1 : (len > otherLen);
+}
+
+static size_t segmentLength(const char* path)
+{
+    const char* end = strchr(path, '/');
+    return end ? (size_t)(end - path) : strlen(path);
+}
+
+static bool isParam(const char* segment, size_t len)
+{
+    return len >= 2 && segment[0] == '{' && segment[len - 1] == '}';
+}
+
+static bool isWildcard(const char* segment, size_t len)
+{
+    return len == 1 && segment[0] == '*' && segment[1] == 0;
+}
+
+UriRouter::UriRouter()
+: _root(new Node())
+, _order(0)
+{
+}
+
+UriRouter::~UriRouter()
+{
+    _free(_root);
+}
+
+void UriRouter::_free(Node* node)
+{
+    for (Node* child : node->children)
+        _free(child);
+    if (node->param)
+        _free(node->param);
+    for (Route* list : { node->routes, node->wildcard }) {
+        while (list) {
+            Route* next = list->next;
+            delete list;
+            list = next;
+        }
+    }
+    delete node;
+}
+
+void UriRouter::_append(Route*& list, Route* route)
+{
+    Route** tail = &list;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = route;
+}
+
+bool UriRouter::isPattern(const String& uri)
+{
+    return uri.indexOf('{') >= 0 || uri.endsWith("/*") || uri == "*";
+}
+
+// binary search of node's literal children, a missing one is added when name is given
+UriRouter::Node* UriRouter::_child(Node* node, const char* segment, size_t len, const String* name)
+{
+    size_t lo = 0;
+    size_t hi = node->children.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = segmentCompare(segment, len, node->children[mid]->segment);
+        if (c == 0)
+            return node->children[mid];
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (!name)
+        return nullptr;
+    Node* child = new Node();
+    child->segment = *name;
+    node->children.insert(node->children.begin() + lo, child);
+    return child;
+}
+
+void UriRouter::add(const String& pattern, HTTPMethod method, RequestHandler* handler)
+{
+    Route* route = new Route{ method, handler, _order++, nullptr };
+    Node* node = _root;
+    const char* path = pattern.c_str();
+    while (true) {
+        size_t len = segmentLength(path);
+        if (isWildcard(path, len)) {
+            _append(node->wildcard, route);
+            return;
+        }
+        if (isParam(path, len)) {
+            if (!node->param)
+                node->param = new Node();
+            node = node->param;
+        } else {
+            size_t start = path - pattern.c_str();
+            String name = pattern.substring(start, start + len);
+            node = _child(node, path, len, &name);
+        }
+        if (!path[len])
+            break;
+        path += len + 1;
+    }
+    _append(node->routes, route);
+}
+
+void UriRouter::addHandler(RequestHandler* handler)
+{
+    _fallback.push_back(Fallback{ handler, _order++ });
+}
+
+UriRouter::Route* UriRouter::_accept(Route* route, HTTPMethod method)
+{
+    for (; route; route = route->next) {
+        if (route->method == HTTP_ANY || route->method == method)
+            return route;
+    }
+    return nullptr;
+}
+
+// path points at the start of the segment to match against node's children
+UriRouter::Route* UriRouter::_match(Node* node, HTTPMethod method, const char* path, Capture* captures, uint8_t count, uint8_t& captured)
+{
+    size_t len = segmentLength(path);
+    bool last = !path[len];
+
+    Node* child = _child(node, path, len, nullptr);
+    if (child) {
+        Route* route;
+        if (last) {
+            route = _accept(child->routes, method);
+            captured = count;
+        } else {
+            route = _match(child, method, path + len + 1, captures, count, captured);
+        }
+        if (route)
+            return route;
+    }
+
+    if (node->param && len && count < URI_ROUTER_MAX_PARAMS) {
+        captures[count] = Capture{ path, len };
+        Route* route;
+        if (last) {
+            route = _accept(node->param->routes, method);
+            captured = count + 1;
+        } else {
+            route = _match(node->param, method, path + len + 1, captures, count + 1, captured);
+        }
+        if (route)
+            return route;
+    }
+
+    Route* route = _accept(node->wildcard, method);
+    captured = count;
+    if (route && count < URI_ROUTER_MAX_PARAMS) {
+        captures[count] = Capture{ path, strlen(path) };
+        captured = count + 1;
+    }
+    return route;
+}
+
+RequestHandler* UriRouter::find(HTTPMethod method, const String& uri, std::vector<String>& args)
+{
+    Capture captures[URI_ROUTER_MAX_PARAMS];
+    uint8_t captured = 0;
+    Route* route = _match(_root, method, uri.c_str(), captures, 0, captured);
+    uint32_t order = route ? route->order : UINT32_MAX;
+
+    args.clear();
+    for (const Fallback& f : _fallback) {
+        if (f.order > order)
+            break;
+        if (f.handler->canHandle(method, uri))
+            return f.handler;
+    }
+    if (!route)
+        return nullptr;
+
+    for (uint8_t i = 0; i < captured; i++) {
+        size_t start = captures[i].start - uri.c_str();
+        args.push_back(uri.substring(start, start + captures[i].len));
+    }
+    return route->handler;
+}
+
+bool UriRouter::matches(const String& pattern, const String& uri)
+{
+    const char* p = pattern.c_str();
+    const char* u = uri.c_str();
+    while (true) {
+        size_t plen = segmentLength(p);
+        size_t ulen = segmentLength(u);
+        if (isWildcard(p, plen))
+            return true;
+        if (isParam(p, plen)) {
+            if (!ulen)
+                return false;
+        } else if (plen != ulen || strncmp(p, u, plen)) {
+            return false;
+        }
+        if (!p[plen] || !u[ulen])
+            return !p[plen] && !u[ulen];
+        p += plen + 1;
+        u += ulen + 1;
+    }
+}
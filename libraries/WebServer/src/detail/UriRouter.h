@@ -0,0 +1,76 @@
+#ifndef URIROUTER_H
+#define URIROUTER_H
+
+#include <stdint.h>
+#include <vector>
+#include "WString.h"
+#include "../HTTP_Method.h"
+
+class RequestHandler;
+
+#define URI_ROUTER_MAX_PARAMS 8     // {name} and * captures per route
+
+/*
+  Handlers registered with on() are indexed in a tree of URI path segments,
+  so finding one costs one walk down the request path instead of a String
+  comparison per handler. A pattern segment can be
+    literal   "/api/sensor"
+    {name}    "/api/sensor/{id}"     matches one non-empty segment
+    *         "/files/" + "*"        as the last segment, matches the rest
+  Captures are returned in order and read with WebServer::pathArg(i).
+  Literal segments are tried before {name}, and {name} before *.
+
+  Other handlers (addHandler(), serveStatic()) are still asked canHandle()
+  in registration order, and a handler registered earlier still wins over
+  a later one, whichever way it was found.
+*/
+class UriRouter {
+public:
+    UriRouter();
+    ~UriRouter();
+
+    void add(const String& pattern, HTTPMethod method, RequestHandler* handler);
+    void addHandler(RequestHandler* handler);
+    RequestHandler* find(HTTPMethod method, const String& uri, std::vector<String>& args);
+
+    static bool isPattern(const String& uri);
+    static bool matches(const String& pattern, const String& uri);
+
+protected:
+    struct Route {
+        HTTPMethod method;
+        RequestHandler* handler;
+        uint32_t order;
+        Route* next;
+    };
+
+    struct Node {
+        String segment;
+        std::vector<Node*> children;    // literal segments, sorted
+        Node* param = nullptr;          // {name}
+        Route* routes = nullptr;        // ending at this node
+        Route* wildcard = nullptr;      // ending in * below this node
+    };
+
+    struct Fallback {
+        RequestHandler* handler;
+        uint32_t order;
+    };
+
+    struct Capture {
+        const char* start;
+        size_t len;
+    };
+
+    Node* _child(Node* node, const char* segment, size_t len, const String* name);
+    Route* _match(Node* node, HTTPMethod method, const char* path, Capture* captures, uint8_t count, uint8_t& captured);
+    static Route* _accept(Route* route, HTTPMethod method);
+    static void _append(Route*& list, Route* route);
+    static void _free(Node* node);
+
+    Node* _root;
+    std::vector<Fallback> _fallback;
+    uint32_t _order;
+};
+
+#endif //URIROUTER_H
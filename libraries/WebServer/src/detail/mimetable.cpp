@@ -1,5 +1,7 @@
 #include "mimetable.h"
 #include "pgmspace.h"
+#include <stdint.h>
+#include <string.h>
 
 namespace mime
 {
@@ -32,4 +34,51 @@ const Entry mimeTable[maxType] =
     { "", "application/octet-stream" } 
 };
 
+// open addressed extension -> type table, filled on first lookup
+#define MIME_INDEX_SIZE 64
+
+static uint8_t s_index[MIME_INDEX_SIZE];
+static bool s_indexed = false;
+
+static uint32_t hashExtension(const char* ext)
+{
+    uint32_t hash = 2166136261UL;
+    while (*ext) {
+        hash = (hash ^ (uint8_t)*ext++) * 16777619UL;
+    }
+    return hash;
+}
+
+static void buildIndex()
+{
+    memset(s_index, none, sizeof(s_index));
+    for (int i = 0; i < none; i++) {
+        uint32_t slot = hashExtension(mimeTable[i].endsWith) % MIME_INDEX_SIZE;
+        while (s_index[slot] != none) {
+            slot = (slot + 1) % MIME_INDEX_SIZE;
+        }
+        s_index[slot] = i;
+    }
+    s_indexed = true;
+}
+
+type lookup(const char* path)
+{
+    const char* ext = strrchr(path, '.');
+    if (!ext) {
+        return none;
+    }
+    if (!s_indexed) {
+        buildIndex();
+    }
+    uint32_t slot = hashExtension(ext) % MIME_INDEX_SIZE;
+    while (s_index[slot] != none) {
+        if (!strcmp(mimeTable[s_index[slot]].endsWith, ext)) {
+            return (type)s_index[slot];
+        }
+        slot = (slot + 1) % MIME_INDEX_SIZE;
+    }
+    return none;
+}
+
 }
@@ -41,6 +41,9 @@ struct Entry
 
 
 extern const Entry mimeTable[maxType];
+
+// type for the extension of path (the part from the last '.'), none if unknown
+type lookup(const char* path);
 }
 
 
@@ -0,0 +1,222 @@
+/*
+  NetLoop.cpp - wait on many sockets at once and dispatch their events
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "NetLoop.h"
+#include <lwip/sockets.h>
+
+#undef write
+#undef close
+
+NetLoop::NetLoop(bool wakeable)
+  :_count(0)
+  ,_wakeable(wakeable)
+  ,_wakeFd(-1)
+  ,_wakePort(0)
+{
+  for(uint8_t i = 0; i < NETLOOP_MAX_SOCKETS; i++){
+    _entries[i].fd = -1;
+  }
+}
+
+NetLoop::~NetLoop(){
+  if(_wakeFd >= 0){
+    lwip_close_r(_wakeFd);
+  }
+}
+
+NetLoop::Entry* NetLoop::_find(int fd){
+  if(fd < 0)
+    return NULL;
+  for(uint8_t i = 0; i < NETLOOP_MAX_SOCKETS; i++){
+    if(_entries[i].fd == fd)
+      return &_entries[i];
+  }
+  return NULL;
+}
+
+NetLoop::Entry* NetLoop::_add(int fd){
+  if(fd < 0){
+    log_e("invalid socket");
+    return NULL;
+  }
+  Entry* e = _find(fd);
+  if(!e){
+    for(uint8_t i = 0; i < NETLOOP_MAX_SOCKETS && !e; i++){
+      if(_entries[i].fd < 0)
+        e = &_entries[i];
+    }
+    if(!e){
+      log_e("no room for socket %d", fd);
+      return NULL;
+    }
+    _count++;
+  }
+  e->fd = fd;
+  e->server = NULL;
+  e->onAccept = nullptr;
+  e->onReadable = nullptr;
+  e->onWritable = nullptr;
+  e->writable = false;
+  return e;
+}
+
+bool NetLoop::addServer(WiFiServer& server, TAcceptFunction onAccept){
+  Entry* e = _add(server.fd());
+  if(!e)
+    return false;
+  e->server = &server;
+  e->onAccept = onAccept;
+  return true;
+}
+
+bool NetLoop::addSocket(int fd, TSocketFunction onReadable, TSocketFunction onWritable){
+  Entry* e = _add(fd);
+  if(!e)
+    return false;
+  e->onReadable = onReadable;
+  e->onWritable = onWritable;
+  return true;
+}
+
+void NetLoop::setWritable(int fd, bool writable){
+  Entry* e = _find(fd);
+  if(e)
+    e->writable = writable;
+}
+
+void NetLoop::remove(int fd){
+  Entry* e = _find(fd);
+  if(!e)
+    return;
+  e->fd = -1;
+  e->onAccept = nullptr;
+  e->onReadable = nullptr;
+  e->onWritable = nullptr;
+  _count--;
+}
+
+bool NetLoop::_openWake(){
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(fd < 0)
+    return false;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(fd, (struct sockaddr*)&addr, &len) < 0){
+    lwip_close_r(fd);
+    return false;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  _wakePort = ntohs(addr.sin_port);
+  _wakeFd = fd;
+  return true;
+}
+
+void NetLoop::wake(){
+  if(_wakeFd < 0)
+    return;
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(_wakePort);
+  uint8_t b = 0;
+  sendto(_wakeFd, &b, 1, 0, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+int NetLoop::run(uint32_t timeout){
+  if(_wakeable && _wakeFd < 0 && !_openWake()){
+    log_e("could not open the wake socket");
+    _wakeable = false;
+  }
+
+  fd_set rset, wset;
+  FD_ZERO(&rset);
+  FD_ZERO(&wset);
+  int maxfd = -1;
+  for(uint8_t i = 0; i < NETLOOP_MAX_SOCKETS; i++){
+    Entry& e = _entries[i];
+    if(e.fd < 0)
+      continue;
+    FD_SET(e.fd, &rset);
+    if(e.writable && e.onWritable)
+      FD_SET(e.fd, &wset);
+    if(e.fd > maxfd)
+      maxfd = e.fd;
+  }
+  if(_wakeFd >= 0){
+    FD_SET(_wakeFd, &rset);
+    if(_wakeFd > maxfd)
+      maxfd = _wakeFd;
+  }
+  if(maxfd < 0){
+    if(timeout != NETLOOP_FOREVER)
+      delay(timeout);
+    return 0;
+  }
+
+  struct timeval tv;
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  int res = select(maxfd + 1, &rset, &wset, NULL, (timeout == NETLOOP_FOREVER) ? NULL : &tv);
+  if(res < 0){
+    log_e("select: %d", errno);
+    return -1;
+  }
+  if(res == 0)
+    return 0;
+
+  if(_wakeFd >= 0 && FD_ISSET(_wakeFd, &rset)){
+    uint8_t buf[8];
+    while(recv(_wakeFd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+  }
+
+  // entries can change from the callbacks, only dispatch to sockets that are still registered
+  int dispatched = 0;
+  for(uint8_t i = 0; i < NETLOOP_MAX_SOCKETS; i++){
+    int fd = _entries[i].fd;
+    if(fd < 0)
+      continue;
+    if(FD_ISSET(fd, &rset)){
+      if(_entries[i].server){
+        // take everything in the backlog, select reports it once
+        WiFiServer* server = _entries[i].server;
+        TAcceptFunction onAccept = _entries[i].onAccept;
+        WiFiClient client;
+        while(server->fd() == fd && (client = server->available())){
+          onAccept(client);
+          dispatched++;
+        }
+        continue;
+      }
+      if(_entries[i].onReadable){
+        TSocketFunction onReadable = _entries[i].onReadable;
+        onReadable(fd);
+        dispatched++;
+      }
+    }
+    if(FD_ISSET(fd, &wset) && _entries[i].fd == fd && _entries[i].writable && _entries[i].onWritable){
+      TSocketFunction onWritable = _entries[i].onWritable;
+      onWritable(fd);
+      dispatched++;
+    }
+  }
+  return dispatched;
+}
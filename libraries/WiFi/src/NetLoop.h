@@ -0,0 +1,95 @@
+/*
+  NetLoop.h - wait on many sockets at once and dispatch their events
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef _NETLOOP_H_
+#define _NETLOOP_H_
+
+#include <functional>
+#include "Arduino.h"
+#include "WiFiServer.h"
+#include "WiFiClient.h"
+
+#ifndef NETLOOP_MAX_SOCKETS
+#define NETLOOP_MAX_SOCKETS CONFIG_LWIP_MAX_SOCKETS
+#endif
+
+#define NETLOOP_FOREVER 0xFFFFFFFF
+
+/*
+  Registers listening servers and connected sockets and waits for all of
+  them with a single select(), so the calling task sleeps until one has
+  something to do instead of polling every server from loop():
+
+    NetLoop net;
+    net.addServer(http, [](WiFiClient client) { ... });
+    net.addServer(telnet, onTelnet);
+    void loop() { net.run(1000); }
+
+  accept callbacks get every pending connection of a server. readable and
+  writable callbacks get the socket; writable is only waited for while
+  setWritable() is on, e.g. while output is queued. Callbacks may add and
+  remove sockets. All calls must come from the task that runs the loop,
+  except wake() on a loop created with wakeable = true, which any task can
+  use to end a run() early (it uses one more socket over loopback).
+*/
+class NetLoop {
+  public:
+    typedef std::function<void(WiFiClient client)> TAcceptFunction;
+    typedef std::function<void(int fd)> TSocketFunction;
+
+    NetLoop(bool wakeable = false);
+    ~NetLoop();
+
+    bool addServer(WiFiServer& server, TAcceptFunction onAccept);
+    bool addSocket(int fd, TSocketFunction onReadable, TSocketFunction onWritable = nullptr);
+    bool addClient(WiFiClient& client, TSocketFunction onReadable, TSocketFunction onWritable = nullptr){
+      return addSocket(client.fd(), onReadable, onWritable);
+    }
+    void setWritable(int fd, bool writable);
+    void remove(int fd);
+    void remove(WiFiServer& server){ remove(server.fd()); }
+    void remove(WiFiClient& client){ remove(client.fd()); }
+
+    // wait up to timeout ms (NETLOOP_FOREVER for no limit) and dispatch,
+    // returns the number of callbacks run or -1 on error
+    int run(uint32_t timeout = NETLOOP_FOREVER);
+    void wake();
+
+    uint8_t count(){ return _count; }
+
+  private:
+    struct Entry {
+      int fd;
+      WiFiServer* server;
+      TAcceptFunction onAccept;
+      TSocketFunction onReadable;
+      TSocketFunction onWritable;
+      bool writable;
+    };
+
+    Entry* _find(int fd);
+    Entry* _add(int fd);
+    bool _openWake();
+
+    Entry _entries[NETLOOP_MAX_SOCKETS];
+    uint8_t _count;
+    bool _wakeable;
+    int _wakeFd;
+    uint16_t _wakePort;
+};
+
+#endif /* _NETLOOP_H_ */
@@ -32,6 +32,41 @@ extern "C" {
 #include "Wire.h"
 #include "Arduino.h"
 
+I2CTransaction::I2CTransaction(uint16_t address, uint8_t reg, uint16_t size)
+    :_t(NULL)
+    ,_reg(reg)
+    ,_rxBuff(NULL)
+    ,_ownsRx(true)
+    ,_readCount(0)
+{
+    if(size) {
+        _rxBuff = (uint8_t*)malloc(size);
+        if(!_rxBuff) {
+            log_e("malloc failure");
+            return;
+        }
+    }
+    _t = i2cTransactionNew(address, &_reg, 1, _rxBuff, size);
+}
+
+I2CTransaction::I2CTransaction(uint16_t address, uint8_t* txBuff, uint16_t txSize, uint8_t* rxBuff, uint16_t rxSize)
+    :_t(NULL)
+    ,_reg(0)
+    ,_rxBuff(rxBuff)
+    ,_ownsRx(false)
+    ,_readCount(0)
+{
+    _t = i2cTransactionNew(address, txBuff, txSize, rxBuff, rxSize);
+}
+
+I2CTransaction::~I2CTransaction()
+{
+    i2cTransactionFree(_t);
+    if(_ownsRx) {
+        free(_rxBuff);
+    }
+}
+
 TwoWire::TwoWire(uint8_t bus_num)
     :num(bus_num & 1)
     ,sda(-1)
@@ -139,6 +174,42 @@ i2c_err_t TwoWire::readTransmission(uint16_t address, uint8_t *buff, uint16_t si
     return last_error;
 }
 
+i2c_err_t TwoWire::readRegisters(uint16_t address, uint8_t reg, uint8_t* buff, uint16_t size, uint32_t *readCount)
+{
+    last_error = i2cWriteRead(i2c, address, &reg, 1, buff, size, _timeOutMillis, readCount);
+    return last_error;
+}
+
+i2c_err_t TwoWire::writeRegisters(uint16_t address, uint8_t reg, const uint8_t* buff, uint16_t size)
+{
+    // register and data have to go out in one write, so stage them in txBuffer
+    if(transmitting || txQueued) {
+        log_e("transmission in progress");
+        last_error = I2C_ERROR_BUSY;
+        return last_error;
+    }
+    if(size >= I2C_BUFFER_LENGTH) {
+        log_e("txBuff overflow %d", size + 1);
+        last_error = I2C_ERROR_MEMORY;
+        return last_error;
+    }
+    txBuffer[0] = reg;
+    memcpy(&txBuffer[1], buff, size);
+    last_error = i2cWriteRead(i2c, address, txBuffer, size + 1, NULL, 0, _timeOutMillis, NULL);
+    return last_error;
+}
+
+i2c_err_t TwoWire::execute(I2CTransaction &transaction)
+{
+    last_error = i2cTransactionRun(i2c, transaction._t, _timeOutMillis, &transaction._readCount);
+    return last_error;
+}
+
+uint32_t TwoWire::lastSetupCycles()
+{
+    return i2cGetSetupCycles(i2c);
+}
+
 void TwoWire::beginTransmission(uint16_t address)
 {
     transmitting = 1;
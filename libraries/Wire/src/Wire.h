@@ -35,6 +35,44 @@
 typedef void(*user_onRequest)(void);
 typedef void(*user_onReceive)(uint8_t*, int);
 
+/* A write/read sequence with fixed address, register and length, built once
+ * and handed to TwoWire::execute() as often as needed, e.g. polling a sensor.
+ * Re-executing it does not allocate or re-encode anything.
+ */
+class I2CTransaction
+{
+public:
+    // write reg, ReSTART, read size bytes into data()
+    I2CTransaction(uint16_t address, uint8_t reg, uint16_t size);
+    // generic write then read on caller owned buffers, either size may be 0
+    I2CTransaction(uint16_t address, uint8_t* txBuff, uint16_t txSize, uint8_t* rxBuff, uint16_t rxSize);
+    ~I2CTransaction();
+
+    operator bool() const
+    {
+        return _t != NULL;
+    }
+    uint8_t * data()
+    {
+        return _rxBuff;
+    }
+    uint32_t readCount()
+    {
+        return _readCount;
+    }
+
+protected:
+    friend class TwoWire;
+    I2CTransaction(const I2CTransaction&);
+    I2CTransaction& operator=(const I2CTransaction&);
+
+    i2c_transaction_t * _t;
+    uint8_t _reg;
+    uint8_t * _rxBuff;
+    bool _ownsRx;
+    uint32_t _readCount;
+};
+
 class TwoWire: public Stream
 {
 protected:
@@ -82,6 +120,12 @@ public:
     i2c_err_t writeTransmission(uint16_t address, uint8_t* buff, uint16_t size, bool sendStop=true);
     i2c_err_t readTransmission(uint16_t address, uint8_t* buff, uint16_t size, bool sendStop=true, uint32_t *readCount=NULL);
 
+    // register access as one queued write + ReSTART + read, bypasses rx/txBuffer queueing
+    i2c_err_t readRegisters(uint16_t address, uint8_t reg, uint8_t* buff, uint16_t size, uint32_t *readCount=NULL);
+    i2c_err_t writeRegisters(uint16_t address, uint8_t reg, const uint8_t* buff, uint16_t size);
+    i2c_err_t execute(I2CTransaction &transaction);
+    uint32_t lastSetupCycles(); // CPU cycles the last transaction needed before the bus started
+
     void beginTransmission(uint16_t address);
     void beginTransmission(uint8_t address);
     void beginTransmission(int address);
@@ -0,0 +1,87 @@
+/*
+ * The parts of esp32-hal-misc.c and the IDF runtime the code under test
+ * calls, on top of the host clock.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <sched.h>
+
+#include "host.h"
+#include "freertos/FreeRTOS.h"
+
+int64_t esp_timer_get_time(void)
+{
+    return hostClockNow();
+}
+
+unsigned long micros(void)
+{
+    return (unsigned long)hostClockNow();
+}
+
+unsigned long millis(void)
+{
+    return (unsigned long)(hostClockNow() / 1000);
+}
+
+void delay(uint32_t ms)
+{
+    vTaskDelay(ms);
+}
+
+void delayMicroseconds(uint32_t us)
+{
+    int64_t end = hostClockNow() + us;
+    while (hostClockNow() < end) {
+        sched_yield();
+    }
+}
+
+void yield(void)
+{
+    sched_yield();
+}
+
+unsigned xthal_get_ccount(void)
+{
+    return (unsigned)(hostClockNow() * 240);
+}
+
+uint32_t ets_get_cpu_frequency(void)
+{
+    return 240;
+}
+
+int log_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = getenv("HOST_LOG") ? vfprintf(stderr, fmt, ap) : 0;
+    va_end(ap);
+    return n;
+}
+
+/* newlib has these; glibc does not */
+char *ltoa(long value, char *result, int base);
+char *ultoa(unsigned long value, char *result, int base);
+
+char *itoa(int value, char *result, int base)
+{
+    return ltoa(value, result, base);
+}
+
+char *utoa(unsigned value, char *result, int base)
+{
+    return ultoa(value, result, base);
+}
+
+/* no PSRAM on the host, ps_malloc() falls back like the core's without it */
+bool psramFound(void)
+{
+    return false;
+}
+
+void *ps_malloc(size_t size)
+{
+    return malloc(size);
+}
@@ -0,0 +1,98 @@
+/*
+ * The FatFs and VFS entry points a disk driver calls, for testing the
+ * driver on its own: drives register their diskio functions as in
+ * diskio.c, and f_mount() initialises the drive and takes the FAT layout
+ * from the BPB in sector 0, which is all the drivers read back from the
+ * FATFS object. f_getfree() returns that object as the test set it up.
+ */
+#include <string.h>
+
+#include "host.h"
+#include "diskio.h"
+#include "ff.h"
+#include "esp_vfs_fat.h"
+
+static const ff_diskio_impl_t *drives[FF_VOLUMES];
+static FATFS *volumes[FF_VOLUMES];
+static FATFS fatfs[FF_VOLUMES];
+static bool registered[FF_VOLUMES];
+
+esp_err_t ff_diskio_get_drive(BYTE *out_pdrv)
+{
+    for (BYTE i = 0; i < FF_VOLUMES; i++) {
+        if (!drives[i]) {
+            *out_pdrv = i;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+void ff_diskio_register(BYTE pdrv, const ff_diskio_impl_t *discio_impl)
+{
+    if (pdrv < FF_VOLUMES) {
+        drives[pdrv] = discio_impl;
+    }
+}
+
+esp_err_t esp_vfs_fat_register(const char *base_path, const char *fat_drive, size_t max_files, FATFS **out_fs)
+{
+    (void)base_path;
+    (void)max_files;
+    BYTE pdrv = fat_drive[0] - '0';
+    if (pdrv >= FF_VOLUMES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    registered[pdrv] = true;
+    *out_fs = &fatfs[pdrv];
+    return ESP_OK;
+}
+
+esp_err_t esp_vfs_fat_unregister_path(const char *base_path)
+{
+    (void)base_path;
+    return ESP_OK;
+}
+
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt)
+{
+    (void)opt;
+    BYTE pdrv = path[0] - '0';
+    if (pdrv >= FF_VOLUMES || !drives[pdrv]) {
+        return FR_INVALID_DRIVE;
+    }
+    volumes[pdrv] = fs;
+    if (!fs) {
+        return FR_OK;
+    }
+    if (drives[pdrv]->init(pdrv) & STA_NOINIT) {
+        return FR_NOT_READY;
+    }
+    BYTE bs[512];
+    if (drives[pdrv]->read(pdrv, bs, 0, 1) != RES_OK) {
+        return FR_DISK_ERR;
+    }
+    if (bs[510] != 0x55 || bs[511] != 0xAA) {
+        return FR_NO_FILESYSTEM;
+    }
+    DWORD fsize = bs[22] | (bs[23] << 8);
+    if (!fsize) {
+        fsize = bs[36] | (bs[37] << 8) | ((DWORD)bs[38] << 16) | ((DWORD)bs[39] << 24);
+    }
+    fs->fatbase = bs[14] | (bs[15] << 8);
+    fs->n_fats = bs[16];
+    fs->fsize = fsize;
+    return FR_OK;
+}
+
+/* the volume esp_vfs_fat_register() handed out for the drive */
+FRESULT f_getfree(const TCHAR *path, DWORD *nclst, FATFS **fatfs_out)
+{
+    BYTE pdrv = path[0] - '0';
+    if (pdrv >= FF_VOLUMES || !registered[pdrv]) {
+        return FR_NOT_ENABLED;
+    }
+    *fatfs_out = &fatfs[pdrv];
+    *nclst = fatfs[pdrv].free_clst;
+    return FR_OK;
+}
@@ -0,0 +1,601 @@
+/*
+ * pthread implementation of include/freertos/FreeRTOS.h.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+#include "host.h"
+
+static pthread_mutex_t critical_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static __thread int in_isr;
+
+void hostCriticalEnter(void) { pthread_mutex_lock(&critical_lock); }
+void hostCriticalExit(void)  { pthread_mutex_unlock(&critical_lock); }
+
+BaseType_t xPortInIsrContext(void) { return in_isr; }
+BaseType_t xPortGetCoreID(void) { return 1; }
+void vPortYield(void) { sched_yield(); }
+
+void hostIsrEnter(void) { hostCriticalEnter(); in_isr++; }
+void hostIsrExit(void)  { in_isr--; hostCriticalExit(); }
+
+static struct timespec deadline(TickType_t ticks)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ticks / 1000;
+    ts.tv_nsec += (long)(ticks % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+static void cond_init(pthread_cond_t *c)
+{
+    pthread_condattr_t a;
+    pthread_condattr_init(&a);
+    pthread_condattr_setclock(&a, CLOCK_MONOTONIC);
+    pthread_cond_init(c, &a);
+    pthread_condattr_destroy(&a);
+}
+
+static host_block_hook_t block_hook;
+static void *block_arg;
+static __thread int in_block_hook;
+
+void hostBlockHook(host_block_hook_t hook, void *arg)
+{
+    block_arg = arg;
+    block_hook = hook;
+}
+
+/* Wait on c until ready(arg) holds; m is held on entry and exit. */
+static int wait_until(pthread_cond_t *c, pthread_mutex_t *m, TickType_t ticks,
+                      int (*ready)(void *), void *arg)
+{
+    if (ready(arg)) {
+        return 1;
+    }
+    if (!ticks) {
+        return 0;
+    }
+    while (block_hook && !in_block_hook) {
+        pthread_mutex_unlock(m);
+        in_block_hook = 1;
+        bool more = block_hook(block_arg);
+        in_block_hook = 0;
+        pthread_mutex_lock(m);
+        if (ready(arg)) {
+            return 1;
+        }
+        if (!more) {
+            break;
+        }
+    }
+    struct timespec ts = deadline(ticks);
+    int ok = 1;
+    /* a task deleted while it waits leaves m unlocked */
+    pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, m);
+    while (!ready(arg)) {
+        if (ticks == portMAX_DELAY) {
+            pthread_cond_wait(c, m);
+        } else if (pthread_cond_timedwait(c, m, &ts) == ETIMEDOUT) {
+            ok = ready(arg);
+            break;
+        }
+    }
+    pthread_cleanup_pop(0);
+    return ok;
+}
+
+/* ---------------------------------------------------------------- tasks */
+
+struct host_task {
+    pthread_t thread;
+    TaskFunction_t fn;
+    void *arg;
+    UBaseType_t prio;
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    uint32_t notify;
+};
+
+static __thread struct host_task *current;
+
+static struct host_task *task_new(void)
+{
+    struct host_task *t = calloc(1, sizeof(*t));
+    pthread_mutex_init(&t->m, NULL);
+    cond_init(&t->c);
+    return t;
+}
+
+static void *task_main(void *p)
+{
+    struct host_task *t = p;
+    current = t;
+    t->fn(t->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+                                   void *arg, UBaseType_t prio, TaskHandle_t *out, BaseType_t core)
+{
+    (void)name; (void)stack; (void)core;
+    struct host_task *t = task_new();
+    t->fn = fn;
+    t->arg = arg;
+    t->prio = prio;
+    if (out) {
+        *out = t;
+    }
+    if (pthread_create(&t->thread, NULL, task_main, t)) {
+        free(t);
+        return pdFAIL;
+    }
+    return pdPASS;
+}
+
+/* another task is gone once this returns, as it is on the ESP32 */
+void vTaskDelete(TaskHandle_t task)
+{
+    if (!task || task == current) {
+        pthread_detach(pthread_self());
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+    pthread_join(task->thread, NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = { ticks / 1000, (long)(ticks % 1000) * 1000000L };
+    if (!ticks) {
+        sched_yield();
+        return;
+    }
+    while (nanosleep(&ts, &ts) && errno == EINTR) {
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+TickType_t xTaskGetTickCountFromISR(void) { return xTaskGetTickCount(); }
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (!current) {
+        current = task_new();
+        current->thread = pthread_self();
+    }
+    return current;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    return (task ? task : xTaskGetCurrentTaskHandle())->prio;
+}
+
+void vTaskSuspend(TaskHandle_t task) { (void)task; }
+void vTaskResume(TaskHandle_t task) { (void)task; }
+
+BaseType_t xTaskNotifyGive(TaskHandle_t t)
+{
+    pthread_mutex_lock(&t->m);
+    t->notify++;
+    pthread_cond_broadcast(&t->c);
+    pthread_mutex_unlock(&t->m);
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t t, BaseType_t *woken)
+{
+    xTaskNotifyGive(t);
+    if (woken) {
+        *woken = pdTRUE;
+    }
+}
+
+static int notified(void *p) { return ((struct host_task *)p)->notify != 0; }
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct host_task *t = xTaskGetCurrentTaskHandle();
+    pthread_mutex_lock(&t->m);
+    wait_until(&t->c, &t->m, ticks, notified, t);
+    uint32_t v = t->notify;
+    if (v) {
+        t->notify = clear ? 0 : v - 1;
+    }
+    pthread_mutex_unlock(&t->m);
+    return v;
+}
+
+/* ----------------------------------------------------------- semaphores */
+
+struct host_sem {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    UBaseType_t count, max;
+    TaskHandle_t holder;
+    UBaseType_t depth;
+};
+
+static SemaphoreHandle_t sem_new(UBaseType_t max, UBaseType_t initial)
+{
+    struct host_sem *s = calloc(1, sizeof(*s));
+    pthread_mutex_init(&s->m, NULL);
+    cond_init(&s->c);
+    s->max = max;
+    s->count = initial;
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) { return sem_new(1, 1); }
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void) { return sem_new(1, 1); }
+SemaphoreHandle_t xSemaphoreCreateBinary(void) { return sem_new(1, 0); }
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) { return sem_new(max, initial); }
+
+void vSemaphoreDelete(SemaphoreHandle_t s)
+{
+    if (s) {
+        pthread_mutex_destroy(&s->m);
+        pthread_cond_destroy(&s->c);
+        free(s);
+    }
+}
+
+static int sem_ready(void *p) { return ((struct host_sem *)p)->count != 0; }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks)
+{
+    pthread_mutex_lock(&s->m);
+    int ok = wait_until(&s->c, &s->m, ticks, sem_ready, s);
+    if (ok) {
+        s->count--;
+    }
+    pthread_mutex_unlock(&s->m);
+    return ok ? pdPASS : pdFAIL;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+    BaseType_t r = pdFAIL;
+    pthread_mutex_lock(&s->m);
+    if (s->count < s->max) {
+        s->count++;
+        r = pdPASS;
+        pthread_cond_signal(&s->c);
+    }
+    pthread_mutex_unlock(&s->m);
+    return r;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t s, TickType_t ticks)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    if (s->holder == self) {
+        s->depth++;
+        return pdPASS;
+    }
+    if (xSemaphoreTake(s, ticks) != pdPASS) {
+        return pdFAIL;
+    }
+    s->holder = self;
+    s->depth = 1;
+    return pdPASS;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t s)
+{
+    if (s->holder != xTaskGetCurrentTaskHandle()) {
+        return pdFAIL;
+    }
+    if (--s->depth == 0) {
+        s->holder = NULL;
+        xSemaphoreGive(s);
+    }
+    return pdPASS;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t s, BaseType_t *woken)
+{
+    if (woken) {
+        *woken = pdTRUE;
+    }
+    return xSemaphoreGive(s);
+}
+
+BaseType_t xSemaphoreTakeFromISR(SemaphoreHandle_t s, BaseType_t *woken)
+{
+    (void)woken;
+    return xSemaphoreTake(s, 0);
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t s) { return s->count; }
+
+/* --------------------------------------------------------------- queues */
+
+struct host_queue {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    UBaseType_t length, size, head, used;
+    uint8_t *items;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size)
+{
+    struct host_queue *q = calloc(1, sizeof(*q));
+    pthread_mutex_init(&q->m, NULL);
+    cond_init(&q->c);
+    q->length = length;
+    q->size = size;
+    q->items = calloc(length, size ? size : 1);
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+    if (q) {
+        free(q->items);
+        free(q);
+    }
+}
+
+static int q_has_space(void *p) { struct host_queue *q = p; return q->used < q->length; }
+static int q_has_item(void *p)  { return ((struct host_queue *)p)->used != 0; }
+
+static BaseType_t q_send(QueueHandle_t q, const void *item, TickType_t ticks, int front)
+{
+    pthread_mutex_lock(&q->m);
+    int ok = wait_until(&q->c, &q->m, ticks, q_has_space, q);
+    if (ok) {
+        UBaseType_t slot;
+        if (front) {
+            q->head = (q->head + q->length - 1) % q->length;
+            slot = q->head;
+        } else {
+            slot = (q->head + q->used) % q->length;
+        }
+        memcpy(q->items + slot * q->size, item, q->size);
+        q->used++;
+        pthread_cond_broadcast(&q->c);
+    }
+    pthread_mutex_unlock(&q->m);
+    return ok ? pdPASS : errQUEUE_FULL;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks) { return q_send(q, item, ticks, 0); }
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t ticks) { return q_send(q, item, ticks, 1); }
+
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken)
+{
+    if (woken) {
+        *woken = pdTRUE;
+    }
+    return q_send(q, item, 0, 0);
+}
+
+static BaseType_t q_recv(QueueHandle_t q, void *item, TickType_t ticks, int peek)
+{
+    pthread_mutex_lock(&q->m);
+    int ok = wait_until(&q->c, &q->m, ticks, q_has_item, q);
+    if (ok) {
+        memcpy(item, q->items + q->head * q->size, q->size);
+        if (!peek) {
+            q->head = (q->head + 1) % q->length;
+            q->used--;
+            pthread_cond_broadcast(&q->c);
+        }
+    }
+    pthread_mutex_unlock(&q->m);
+    return ok ? pdPASS : pdFAIL;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks) { return q_recv(q, item, ticks, 0); }
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t ticks) { return q_recv(q, item, ticks, 1); }
+
+BaseType_t xQueueReceiveFromISR(QueueHandle_t q, void *item, BaseType_t *woken)
+{
+    (void)woken;
+    return q_recv(q, item, 0, 0);
+}
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+    pthread_mutex_lock(&q->m);
+    q->head = q->used = 0;
+    pthread_cond_broadcast(&q->c);
+    pthread_mutex_unlock(&q->m);
+    return pdPASS;
+}
+
+BaseType_t xQueueIsQueueFullFromISR(QueueHandle_t q) { return q->used == q->length; }
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) { return q->used; }
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q) { return q->length - q->used; }
+
+/* --------------------------------------------------------- event groups */
+
+struct host_group {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    EventBits_t bits;
+    EventBits_t want;
+    BaseType_t all;
+};
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    struct host_group *g = calloc(1, sizeof(*g));
+    pthread_mutex_init(&g->m, NULL);
+    cond_init(&g->c);
+    return g;
+}
+
+void vEventGroupDelete(EventGroupHandle_t g) { free(g); }
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits)
+{
+    pthread_mutex_lock(&g->m);
+    g->bits |= bits;
+    EventBits_t r = g->bits;
+    pthread_cond_broadcast(&g->c);
+    pthread_mutex_unlock(&g->m);
+    return r;
+}
+
+BaseType_t xEventGroupSetBitsFromISR(EventGroupHandle_t g, EventBits_t bits, BaseType_t *woken)
+{
+    if (woken) {
+        *woken = pdTRUE;
+    }
+    xEventGroupSetBits(g, bits);
+    return pdPASS;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits)
+{
+    pthread_mutex_lock(&g->m);
+    EventBits_t r = g->bits;
+    g->bits &= ~bits;
+    pthread_mutex_unlock(&g->m);
+    return r;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g) { return g->bits; }
+
+struct group_wait { struct host_group *g; EventBits_t bits; BaseType_t all; };
+
+static int group_ready(void *p)
+{
+    struct group_wait *w = p;
+    EventBits_t hit = w->g->bits & w->bits;
+    return w->all ? hit == w->bits : hit != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clear,
+                                BaseType_t all, TickType_t ticks)
+{
+    struct group_wait w = { g, bits, all };
+    pthread_mutex_lock(&g->m);
+    int ok = wait_until(&g->c, &g->m, ticks, group_ready, &w);
+    EventBits_t r = g->bits;
+    if (ok && clear) {
+        g->bits &= ~bits;
+    }
+    pthread_mutex_unlock(&g->m);
+    return r;
+}
+
+/* --------------------------------------------------------- ring buffers */
+
+struct host_ring {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+    size_t size, head, used;
+    uint8_t *data;
+    uint8_t *out;
+};
+
+RingbufHandle_t xRingbufferCreate(size_t size, ringbuf_type_t type)
+{
+    (void)type;
+    struct host_ring *r = calloc(1, sizeof(*r));
+    pthread_mutex_init(&r->m, NULL);
+    cond_init(&r->c);
+    r->size = size;
+    r->data = malloc(size);
+    r->out = malloc(size);
+    return r;
+}
+
+void vRingbufferDelete(RingbufHandle_t r)
+{
+    if (r) {
+        free(r->data);
+        free(r->out);
+        free(r);
+    }
+}
+
+struct ring_send { struct host_ring *r; size_t len; };
+
+static int ring_fits(void *p)
+{
+    struct ring_send *s = p;
+    return s->r->size - s->r->used >= s->len;
+}
+
+BaseType_t xRingbufferSend(RingbufHandle_t r, const void *data, size_t size, TickType_t ticks)
+{
+    struct ring_send s = { r, size };
+    if (size > r->size) {
+        return pdFALSE;
+    }
+    pthread_mutex_lock(&r->m);
+    int ok = wait_until(&r->c, &r->m, ticks, ring_fits, &s);
+    if (ok) {
+        for (size_t i = 0; i < size; i++) {
+            r->data[(r->head + r->used + i) % r->size] = ((const uint8_t *)data)[i];
+        }
+        r->used += size;
+        pthread_cond_broadcast(&r->c);
+    }
+    pthread_mutex_unlock(&r->m);
+    return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xRingbufferSendFromISR(RingbufHandle_t r, const void *data, size_t size, BaseType_t *woken)
+{
+    (void)woken;
+    return xRingbufferSend(r, data, size, 0);
+}
+
+static int ring_has(void *p) { return ((struct host_ring *)p)->used != 0; }
+
+void *xRingbufferReceiveUpTo(RingbufHandle_t r, size_t *size, TickType_t ticks, size_t max)
+{
+    void *item = NULL;
+    pthread_mutex_lock(&r->m);
+    if (wait_until(&r->c, &r->m, ticks, ring_has, r)) {
+        /* like the real byte buffer, never wrap within one item */
+        size_t n = r->used;
+        if (n > r->size - r->head) {
+            n = r->size - r->head;
+        }
+        if (n > max) {
+            n = max;
+        }
+        memcpy(r->out, r->data + r->head, n);
+        r->head = (r->head + n) % r->size;
+        r->used -= n;
+        *size = n;
+        item = r->out;
+        pthread_cond_broadcast(&r->c);
+    }
+    pthread_mutex_unlock(&r->m);
+    return item;
+}
+
+void *xRingbufferReceive(RingbufHandle_t r, size_t *size, TickType_t ticks)
+{
+    return xRingbufferReceiveUpTo(r, size, ticks, r->size);
+}
+
+void vRingbufferReturnItem(RingbufHandle_t r, void *item) { (void)r; (void)item; }
+
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t r) { return r->size - r->used; }
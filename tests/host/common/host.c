@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "host.h"
+
+int host_failures;
+
+uint64_t hostNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned hostIterations(unsigned full)
+{
+    if (getenv("HOST_QUICK")) {
+        full /= 20;
+    }
+    return full ? full : 1;
+}
+
+/* ---------------------------------------------------------------- clock */
+
+static bool clock_manual;
+static int64_t clock_us;
+
+void hostClockManual(bool manual)
+{
+    clock_us = (int64_t)(hostNowNs() / 1000);
+    clock_manual = manual;
+}
+
+void hostClockSet(int64_t us) { __atomic_store_n(&clock_us, us, __ATOMIC_SEQ_CST); }
+void hostClockAdvance(int64_t us) { __atomic_add_fetch(&clock_us, us, __ATOMIC_SEQ_CST); }
+
+int64_t hostClockNow(void)
+{
+    if (clock_manual) {
+        return __atomic_load_n(&clock_us, __ATOMIC_SEQ_CST);
+    }
+    return (int64_t)(hostNowNs() / 1000);
+}
+
+/* ----------------------------------------------------------- interrupts */
+
+#define HOST_INTR_SOURCES 128
+
+static struct {
+    host_isr_t fn;
+    void *arg;
+} host_intr[HOST_INTR_SOURCES];
+
+int hostIntrAttach(int source, host_isr_t fn, void *arg)
+{
+    if (source < 0 || source >= HOST_INTR_SOURCES) {
+        return -1;
+    }
+    host_intr[source].fn = fn;
+    host_intr[source].arg = arg;
+    return 0;
+}
+
+void hostIntrDetach(int source)
+{
+    if (source >= 0 && source < HOST_INTR_SOURCES) {
+        host_intr[source].fn = NULL;
+    }
+}
+
+bool hostIntrRegistered(int source)
+{
+    return source >= 0 && source < HOST_INTR_SOURCES && host_intr[source].fn;
+}
+
+void hostIntrFire(int source)
+{
+    if (!hostIntrRegistered(source)) {
+        return;
+    }
+    hostIsrEnter();
+    host_intr[source].fn(host_intr[source].arg);
+    hostIsrExit();
+}
+
+/* ----------------------------------------------------- peripheral space */
+
+static const struct {
+    uintptr_t base;
+    size_t size;
+} host_regions[] = {
+    { 0x3ff00000, 0x80000 },    /* DPORT .. PWM3, what esp32.peripherals.ld names */
+    { 0x60000000, 0x40000 },    /* AHB aliases used for FIFO access */
+};
+
+__attribute__((constructor)) static void host_map_peripherals(void)
+{
+    for (size_t i = 0; i < sizeof(host_regions) / sizeof(host_regions[0]); i++) {
+        void *p = mmap((void *)host_regions[i].base, host_regions[i].size, PROT_READ | PROT_WRITE,
+                       MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != (void *)host_regions[i].base) {
+            fprintf(stderr, "cannot map peripheral space at %#lx\n", (unsigned long)host_regions[i].base);
+            abort();
+        }
+    }
+}
+
+#define PAGE(a) ((a) & ~(uintptr_t)0xfff)
+
+static uintptr_t trace_start, trace_end, trace_fault;
+static bool trace_write;
+static host_store_hook_t trace_hook;
+static host_load_hook_t trace_load_hook;
+static void *trace_arg;
+static unsigned trace_stores;
+
+/* closed to stores, and to loads too while a load hook is set */
+static void trace_protect(bool open)
+{
+    int prot = open ? PROT_READ | PROT_WRITE : trace_load_hook ? PROT_NONE : PROT_READ;
+    mprotect((void *)PAGE(trace_start), PAGE(trace_end + 0xfff) - PAGE(trace_start), prot);
+}
+
+/*
+ * An access hit a traced page: open the range for one instruction. Hooks
+ * run with the whole range open, so they may touch any register in it.
+ */
+static void trace_segv(int sig, siginfo_t *si, void *ctx)
+{
+    ucontext_t *uc = ctx;
+    uintptr_t addr = (uintptr_t)si->si_addr;
+    if (!trace_hook || addr < PAGE(trace_start) || addr >= PAGE(trace_end + 0xfff)) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+    trace_fault = addr;
+    /* bit 1 of the page fault error code: the access was a store */
+    trace_write = (uc->uc_mcontext.gregs[REG_ERR] & 2) != 0;
+    trace_protect(true);
+    if (!trace_write && trace_load_hook && addr >= trace_start && addr < trace_end) {
+        trace_load_hook(addr & ~(uintptr_t)3, trace_arg);
+    }
+    uc->uc_mcontext.gregs[REG_EFL] |= 0x100;
+}
+
+/* The access has retired: report a store and close the range again. */
+static void trace_step(int sig, siginfo_t *si, void *ctx)
+{
+    (void)sig; (void)si;
+    ((ucontext_t *)ctx)->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+    uintptr_t addr = trace_fault & ~(uintptr_t)3;
+    if (trace_write && addr >= trace_start && addr < trace_end) {
+        trace_stores++;
+        trace_hook(addr, *(volatile uint32_t *)addr, trace_arg);
+    }
+    trace_protect(false);
+}
+
+void hostPeriphTrace(uintptr_t start, uintptr_t end, host_store_hook_t hook, void *arg)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sa.sa_sigaction = trace_segv;
+    sigaction(SIGSEGV, &sa, NULL);
+    sa.sa_sigaction = trace_step;
+    sigaction(SIGTRAP, &sa, NULL);
+    trace_start = start;
+    trace_end = end;
+    trace_hook = hook;
+    trace_load_hook = NULL;
+    trace_arg = arg;
+    trace_stores = 0;
+    trace_protect(false);
+}
+
+void hostPeriphTraceLoads(host_load_hook_t hook)
+{
+    trace_load_hook = hook;
+    trace_protect(false);
+}
+
+unsigned hostPeriphUntrace(void)
+{
+    trace_protect(true);
+    trace_hook = NULL;
+    trace_load_hook = NULL;
+    signal(SIGSEGV, SIG_DFL);
+    signal(SIGTRAP, SIG_DFL);
+    return trace_stores;
+}
@@ -0,0 +1,122 @@
+/*
+ * Host test support: assertions, timing, a fake interrupt controller,
+ * a controllable clock and the peripheral register space.
+ *
+ * The peripheral blocks are mapped at their real addresses (the link uses
+ * tools/sdk/ld/esp32.peripherals.ld and -no-pie), so GPIO, UART0, LEDC and
+ * friends are plain memory a test can preload, and every store the code
+ * under test makes to a range can be observed with hostPeriphTrace().
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Failed checks are counted; only the first 20 are printed. */
+extern int host_failures;
+
+#define TEST_ASSERT(cond) do { \
+        if (!(cond)) { \
+            if (host_failures++ < 20) \
+                fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+#define TEST_ASSERT_EQ(a, b) do { \
+        long long _a = (long long)(a), _b = (long long)(b); \
+        if (_a != _b) { \
+            if (host_failures++ < 20) \
+                fprintf(stderr, "%s:%d: %s == %s failed: %lld != %lld\n", \
+                        __FILE__, __LINE__, #a, #b, _a, _b); \
+        } \
+    } while (0)
+
+#define TEST_RUN(fn) do { \
+        int _before = host_failures; \
+        fn(); \
+        printf("%-44s %s\n", #fn, host_failures == _before ? "ok" : "FAILED"); \
+    } while (0)
+
+#define TEST_EXIT() (host_failures ? (fprintf(stderr, "%d failure(s)\n", host_failures), 1) : 0)
+
+/* Benchmark lines all look alike so they can be grepped out of a run. */
+#define BENCH(fmt, ...) printf("  bench: " fmt "\n", ##__VA_ARGS__)
+
+/* wall clock, nanoseconds */
+uint64_t hostNowNs(void);
+
+/* Set HOST_QUICK in the environment to shrink benchmark loops. */
+unsigned hostIterations(unsigned full);
+
+/*
+ * esp_timer_get_time(), micros(), millis() and the cycle counter follow
+ * the real clock until hostClockManual() is called; from then on they only
+ * move with hostClockAdvance()/hostClockSet(). The cycle counter runs at
+ * 240 MHz against that clock.
+ */
+void hostClockManual(bool manual);
+void hostClockSet(int64_t us);
+void hostClockAdvance(int64_t us);
+int64_t hostClockNow(void);
+
+/*
+ * esp_timer alarms never fire on their own: hostTimerRun() steps the manual
+ * clock to each alarm due up to `until`, in order, and runs its callback in
+ * the calling thread the way the esp_timer task would, then leaves the clock
+ * at `until`. Only one thread may drive the timers. hostTimerStats() counts
+ * the calls made to the timer service.
+ */
+typedef struct {
+    unsigned created, deleted, started, stopped, fired;
+} host_timer_stats_t;
+void hostTimerRun(int64_t until);
+void hostTimerStats(host_timer_stats_t *stats, bool reset);
+
+/* Interrupts registered through esp_intr_alloc(), by interrupt source. */
+typedef void (*host_isr_t)(void *);
+int hostIntrAttach(int source, host_isr_t fn, void *arg);
+void hostIntrDetach(int source);
+bool hostIntrRegistered(int source);
+void hostIntrFire(int source);
+void hostIsrEnter(void);
+void hostIsrExit(void);
+
+/*
+ * Called on a thread about to sleep in a FreeRTOS wait, with no lock held,
+ * until what it waits for is there or the hook returns false. A test can
+ * run hardware there that makes progress while the code under test waits,
+ * e.g. fire the interrupts that end the wait. NULL removes it.
+ */
+typedef bool (*host_block_hook_t)(void *arg);
+void hostBlockHook(host_block_hook_t hook, void *arg);
+
+/*
+ * Calls hook after every 32-bit store the current thread makes into
+ * [start, end). Only one range can be traced at a time, and only from one
+ * thread. The hook runs in a signal handler, so whatever it shares with
+ * the test must be volatile. hostPeriphUntrace() returns the number of
+ * stores seen.
+ */
+typedef void (*host_store_hook_t)(uintptr_t addr, uint32_t value, void *arg);
+void hostPeriphTrace(uintptr_t start, uintptr_t end, host_store_hook_t hook, void *arg);
+unsigned hostPeriphUntrace(void);
+
+/*
+ * Also calls hook before every load from the traced range, with the
+ * address of the 32-bit register read, so a test can put there what a
+ * FIFO or status register would return. Needs hostPeriphTrace() first;
+ * hostPeriphUntrace() ends both.
+ */
+typedef void (*host_load_hook_t)(uintptr_t addr, void *arg);
+void hostPeriphTraceLoads(host_load_hook_t hook);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,255 @@
+/*
+ * ESP-IDF driver calls the core makes, reduced to what a host test needs:
+ * interrupt allocation feeds hostIntrFire(), the ROM routing calls are
+ * no-ops, the RTC pad table marks no pin as an RTC pad and esp_timer alarms
+ * wait in a heap until hostTimerRun() reaches them. esp_random() is
+ * random(3).
+ */
+#define _DEFAULT_SOURCE /* random() under -std=c99 */
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "esp_intr_alloc.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "driver/rtc_io.h"
+
+const rtc_gpio_desc_t rtc_gpio_desc[GPIO_PIN_COUNT];
+
+struct intr_handle_data_t {
+    int source;
+    bool enabled;
+    intr_handler_t fn;
+    void *arg;
+};
+
+static void intr_trampoline(void *arg)
+{
+    struct intr_handle_data_t *h = arg;
+    if (h->enabled) {
+        h->fn(h->arg);
+    }
+}
+
+esp_err_t esp_intr_alloc(int source, int flags, intr_handler_t handler, void *arg, intr_handle_t *ret_handle)
+{
+    struct intr_handle_data_t *h = calloc(1, sizeof(*h));
+    h->source = source;
+    h->enabled = !(flags & ESP_INTR_FLAG_INTRDISABLED);
+    h->fn = handler;
+    h->arg = arg;
+    if (hostIntrAttach(source, intr_trampoline, h)) {
+        free(h);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (ret_handle) {
+        *ret_handle = h;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_intr_alloc_intrstatus(int source, int flags, uint32_t reg, uint32_t mask,
+                                    intr_handler_t handler, void *arg, intr_handle_t *ret_handle)
+{
+    return esp_intr_alloc(source, flags, handler, arg, ret_handle);
+}
+
+esp_err_t esp_intr_free(intr_handle_t handle)
+{
+    if (!handle) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    hostIntrDetach(handle->source);
+    free(handle);
+    return ESP_OK;
+}
+
+esp_err_t esp_intr_enable(intr_handle_t handle)
+{
+    handle->enabled = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_intr_disable(intr_handle_t handle)
+{
+    handle->enabled = false;
+    return ESP_OK;
+}
+
+int esp_intr_get_cpu(intr_handle_t handle)
+{
+    return 1;
+}
+
+int esp_intr_get_intno(intr_handle_t handle)
+{
+    return handle->source;
+}
+
+/* ------------------------------------------------------------- esp_timer */
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    int64_t alarm;
+    uint64_t period;
+    int slot;               /* index in the alarm heap, -1 when not armed */
+};
+
+static struct esp_timer **alarms;
+static int alarms_len, alarms_cap;
+static host_timer_stats_t timer_stats;
+
+static void alarm_place(struct esp_timer *t, int slot)
+{
+    alarms[slot] = t;
+    t->slot = slot;
+}
+
+static void alarm_sift(int slot)
+{
+    struct esp_timer *t = alarms[slot];
+    while (slot > 0 && alarms[(slot - 1) / 2]->alarm > t->alarm) {
+        alarm_place(alarms[(slot - 1) / 2], slot);
+        slot = (slot - 1) / 2;
+    }
+    for (;;) {
+        int child = 2 * slot + 1;
+        if (child >= alarms_len) {
+            break;
+        }
+        if (child + 1 < alarms_len && alarms[child + 1]->alarm < alarms[child]->alarm) {
+            child++;
+        }
+        if (alarms[child]->alarm >= t->alarm) {
+            break;
+        }
+        alarm_place(alarms[child], slot);
+        slot = child;
+    }
+    alarm_place(t, slot);
+}
+
+static void alarm_push(struct esp_timer *t)
+{
+    if (alarms_len == alarms_cap) {
+        alarms_cap = alarms_cap ? alarms_cap * 2 : 64;
+        alarms = realloc(alarms, alarms_cap * sizeof(*alarms));
+    }
+    alarm_place(t, alarms_len++);
+    alarm_sift(t->slot);
+}
+
+static void alarm_remove(struct esp_timer *t)
+{
+    int slot = t->slot;
+    struct esp_timer *last = alarms[--alarms_len];
+    t->slot = -1;
+    if (last != t) {
+        alarm_place(last, slot);
+        alarm_sift(slot);
+    }
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out)
+{
+    if (!args || !args->callback || !out) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct esp_timer *t = calloc(1, sizeof(*t));
+    t->callback = args->callback;
+    t->arg = args->arg;
+    t->slot = -1;
+    timer_stats.created++;
+    *out = t;
+    return ESP_OK;
+}
+
+static esp_err_t timer_start(struct esp_timer *t, uint64_t timeout_us, uint64_t period)
+{
+    if (!t) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (t->slot >= 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    t->alarm = hostClockNow() + (int64_t)timeout_us;
+    t->period = period;
+    alarm_push(t);
+    timer_stats.started++;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return timer_start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    return timer_start(timer, period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    if (!timer || timer->slot < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    alarm_remove(timer);
+    timer_stats.stopped++;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    if (!timer) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (timer->slot >= 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    free(timer);
+    timer_stats.deleted++;
+    return ESP_OK;
+}
+
+int64_t esp_timer_get_next_alarm(void)
+{
+    return alarms_len ? alarms[0]->alarm : INT64_MAX;
+}
+
+void hostTimerRun(int64_t until)
+{
+    while (alarms_len && alarms[0]->alarm <= until) {
+        struct esp_timer *t = alarms[0];
+        alarm_remove(t);
+        if (t->alarm > hostClockNow()) {
+            hostClockSet(t->alarm);
+        }
+        if (t->period) {
+            t->alarm += t->period;
+            alarm_push(t);
+        }
+        timer_stats.fired++;
+        t->callback(t->arg);
+    }
+    if (until > hostClockNow()) {
+        hostClockSet(until);
+    }
+}
+
+void hostTimerStats(host_timer_stats_t *stats, bool reset)
+{
+    if (stats) {
+        *stats = timer_stats;
+    }
+    if (reset) {
+        memset(&timer_stats, 0, sizeof(timer_stats));
+    }
+}
+
+uint32_t esp_random(void)
+{
+    return ((uint32_t)random() << 16) ^ (uint32_t)random();
+}
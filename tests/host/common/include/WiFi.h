@@ -0,0 +1,30 @@
+/*
+ * What the network libraries take from WiFi.h, without the station, AP
+ * and event loop behind it: the socket classes, and a WiFi object whose
+ * hostByName() asks the host resolver. Defines the real header's guard,
+ * so the library sources that include "WiFi.h" get this one.
+ */
+#ifndef WiFi_h
+#define WiFi_h
+
+#include <stdint.h>
+
+#include "Print.h"
+#include "IPAddress.h"
+
+#include "WiFiClient.h"
+#include "WiFiServer.h"
+
+class WiFiGenericClass
+{
+  public:
+    static int hostByName(const char *aHostname, IPAddress &aResult);
+};
+
+class WiFiClass : public WiFiGenericClass
+{
+};
+
+extern WiFiClass WiFi;
+
+#endif
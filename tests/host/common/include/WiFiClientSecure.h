@@ -0,0 +1,23 @@
+/*
+ * WiFiClientSecure without mbedtls: it keeps the certificates it is given
+ * and connects in the clear, which is all the HTTP tests need to tell TLS
+ * connections apart.
+ */
+#ifndef WiFiClientSecure_h
+#define WiFiClientSecure_h
+
+#include "WiFiClient.h"
+
+class WiFiClientSecure : public WiFiClient
+{
+public:
+    const char *_CA_cert = NULL;
+    const char *_cert = NULL;
+    const char *_private_key = NULL;
+
+    void setCACert(const char *rootCA) { _CA_cert = rootCA; }
+    void setCertificate(const char *client_ca) { _cert = client_ca; }
+    void setPrivateKey(const char *private_key) { _private_key = private_key; }
+};
+
+#endif
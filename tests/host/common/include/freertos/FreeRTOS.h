@@ -0,0 +1,151 @@
+/*
+ * Host stand-in for the FreeRTOS API used by the core and libraries.
+ *
+ * Tasks are pthreads, one tick is one millisecond of CLOCK_MONOTONIC,
+ * and every critical section (task or ISR flavour, whatever the mux) takes
+ * one process-wide recursive lock, so an "ISR" fired from another thread
+ * with hostIntrFire() is serialised against them the way the real
+ * interrupt would be on its core.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint32_t EventBits_t;
+typedef TickType_t portTickType;
+typedef BaseType_t portBASE_TYPE;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdTRUE           1
+#define pdFALSE          0
+#define pdPASS           1
+#define pdFAIL           0
+#define errQUEUE_FULL    0
+#define portMAX_DELAY    ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define portTICK_RATE_MS portTICK_PERIOD_MS
+#define configTICK_RATE_HZ 1000
+#define configMAX_PRIORITIES 25
+#define configMINIMAL_STACK_SIZE 768
+#define tskIDLE_PRIORITY 0
+#define tskNO_AFFINITY   0x7fffffff
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portNUM_PROCESSORS 2
+
+typedef struct host_sem  *SemaphoreHandle_t;
+typedef struct host_queue *QueueHandle_t;
+typedef struct host_task *TaskHandle_t;
+typedef struct host_group *EventGroupHandle_t;
+typedef struct host_ring *RingbufHandle_t;
+typedef SemaphoreHandle_t xSemaphoreHandle;
+typedef QueueHandle_t xQueueHandle;
+typedef TaskHandle_t xTaskHandle;
+typedef EventGroupHandle_t xEventGroupHandle;
+
+typedef struct { int owner; int count; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { 0, 0 }
+
+/* the cycle counter, from xtensa/hal.h; runs at 240 MHz on the host clock */
+unsigned xthal_get_ccount(void);
+
+/* critical sections */
+void hostCriticalEnter(void);
+void hostCriticalExit(void);
+#define portENTER_CRITICAL(m)     ((void)(m), hostCriticalEnter())
+#define portEXIT_CRITICAL(m)      ((void)(m), hostCriticalExit())
+#define portENTER_CRITICAL_ISR(m) portENTER_CRITICAL(m)
+#define portEXIT_CRITICAL_ISR(m)  portEXIT_CRITICAL(m)
+#define taskENTER_CRITICAL(m)     portENTER_CRITICAL(m)
+#define taskEXIT_CRITICAL(m)      portEXIT_CRITICAL(m)
+#define vPortCPUInitializeMutex(m) ((void)(m))
+#define portYIELD_FROM_ISR()      ((void)0)
+#define portYIELD()               vPortYield()
+#define taskYIELD()               vPortYield()
+BaseType_t xPortInIsrContext(void);
+BaseType_t xPortGetCoreID(void);
+void vPortYield(void);
+
+/* tasks */
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack,
+                                   void *arg, UBaseType_t prio, TaskHandle_t *out, BaseType_t core);
+#define xTaskCreate(fn, name, stack, arg, prio, out) \
+    xTaskCreatePinnedToCore(fn, name, stack, arg, prio, out, tskNO_AFFINITY)
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TickType_t xTaskGetTickCountFromISR(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task);
+void vTaskSuspend(TaskHandle_t task);
+void vTaskResume(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+/* semaphores */
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+void vSemaphoreDelete(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken);
+BaseType_t xSemaphoreTakeFromISR(SemaphoreHandle_t sem, BaseType_t *woken);
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t sem);
+
+/* queues */
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size);
+void vQueueDelete(QueueHandle_t q);
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t ticks);
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t ticks);
+BaseType_t xQueuePeek(QueueHandle_t q, void *item, TickType_t ticks);
+BaseType_t xQueueReset(QueueHandle_t q);
+BaseType_t xQueueSendFromISR(QueueHandle_t q, const void *item, BaseType_t *woken);
+BaseType_t xQueueReceiveFromISR(QueueHandle_t q, void *item, BaseType_t *woken);
+BaseType_t xQueueIsQueueFullFromISR(QueueHandle_t q);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q);
+#define xQueueSendToBack(q, i, t) xQueueSend(q, i, t)
+#define xQueueSendToBackFromISR(q, i, w) xQueueSendFromISR(q, i, w)
+#define xQueueOverwrite(q, i) (xQueueReset(q), xQueueSend(q, i, 0))
+
+/* event groups */
+EventGroupHandle_t xEventGroupCreate(void);
+void vEventGroupDelete(EventGroupHandle_t g);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clear,
+                                BaseType_t all, TickType_t ticks);
+BaseType_t xEventGroupSetBitsFromISR(EventGroupHandle_t g, EventBits_t bits, BaseType_t *woken);
+#define xEventGroupGetBitsFromISR(g) xEventGroupGetBits(g)
+#define xEventGroupClearBitsFromISR(g, b) xEventGroupClearBits(g, b)
+
+/* byte ring buffers (RINGBUF_TYPE_BYTEBUF semantics only) */
+typedef enum { RINGBUF_TYPE_NOSPLIT, RINGBUF_TYPE_ALLOWSPLIT, RINGBUF_TYPE_BYTEBUF } ringbuf_type_t;
+RingbufHandle_t xRingbufferCreate(size_t size, ringbuf_type_t type);
+void vRingbufferDelete(RingbufHandle_t rb);
+BaseType_t xRingbufferSend(RingbufHandle_t rb, const void *data, size_t size, TickType_t ticks);
+BaseType_t xRingbufferSendFromISR(RingbufHandle_t rb, const void *data, size_t size, BaseType_t *woken);
+void *xRingbufferReceiveUpTo(RingbufHandle_t rb, size_t *size, TickType_t ticks, size_t max);
+void *xRingbufferReceive(RingbufHandle_t rb, size_t *size, TickType_t ticks);
+void vRingbufferReturnItem(RingbufHandle_t rb, void *item);
+size_t xRingbufferGetCurFreeSize(RingbufHandle_t rb);
+
+#ifdef __cplusplus
+}
+#endif
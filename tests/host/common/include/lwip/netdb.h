@@ -0,0 +1,4 @@
+/* lwIP's resolver API is the POSIX one. */
+#pragma once
+
+#include <netdb.h>
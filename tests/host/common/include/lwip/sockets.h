@@ -0,0 +1,47 @@
+/*
+ * lwIP's BSD socket API is the POSIX one; the _r calls the WiFi library
+ * uses are lwIP's names for the plain calls. lwIP's socklen_t is 32 bits
+ * like size_t on the ESP32, and the libraries mix the two.
+ */
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static inline int lwip_accept_r(int s, struct sockaddr *addr, socklen_t *addrlen)
+{
+    return accept(s, addr, addrlen);
+}
+
+static inline int lwip_connect_r(int s, const struct sockaddr *name, socklen_t namelen)
+{
+    return connect(s, name, namelen);
+}
+
+static inline int lwip_close_r(int s)
+{
+    return close(s);
+}
+
+static inline int lwip_ioctl_r(int s, long cmd, void *argp)
+{
+    return ioctl(s, cmd, argp);
+}
+
+#ifdef __cplusplus
+static inline int getsockopt(int s, int level, int optname, void *optval, size_t *optlen)
+{
+    socklen_t len = *optlen;
+    int res = getsockopt(s, level, optname, optval, &len);
+    *optlen = len;
+    return res;
+}
+#endif
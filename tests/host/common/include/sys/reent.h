@@ -0,0 +1,12 @@
+/*
+ * newlib's per-thread state, only passed around by pointer in the IDF
+ * headers. Those headers also check that fd_set came from newlib's
+ * sys/types.h; glibc's comes from sys/select.h.
+ */
+#pragma once
+
+#include <sys/select.h>
+
+struct _reent;
+
+#define _SYS_TYPES_FD_SET
@@ -0,0 +1,523 @@
+/*
+ * The SD card model behind SPIClass, see sdcard_sim.h.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "sdcard_sim.h"
+#include "SPI.h"
+
+sdsim_timing_t sdsim_timing = {
+    2000,       /* call_ns */
+    200000,     /* read_access_ns */
+    20000,      /* read_next_ns */
+    500000,     /* write_single_ns */
+    100000,     /* write_multi_ns */
+    500000,     /* write_stop_ns */
+};
+
+/* Reference CRCs, bit by bit, so the driver's table code is checked against them. */
+static uint8_t crc7(const uint8_t *p, int n)
+{
+    uint8_t crc = 0;
+    for (int i = 0; i < n; i++) {
+        for (int b = 7; b >= 0; b--) {
+            uint8_t bit = ((p[i] >> b) & 1) ^ ((crc >> 6) & 1);
+            crc = (crc << 1) & 0x7f;
+            if (bit) {
+                crc ^= 0x09;
+            }
+        }
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t *p, int n)
+{
+    uint16_t crc = 0;
+    for (int i = 0; i < n; i++) {
+        crc ^= (uint16_t)p[i] << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+enum sd_mode {
+    M_IDLE,         /* waiting for a command */
+    M_READ,         /* sending data blocks */
+    M_WRITE,        /* waiting for data tokens (CMD24 / CMD25) */
+    M_WRITE_DATA,   /* receiving a block */
+    M_BUSY,         /* programming, sends 0x00 */
+};
+
+static struct {
+    uint8_t *data;
+    uint32_t sectors;
+    bool sdhc;
+    bool selected;
+    bool idle;              /* R1 idle bit, until ACMD41 completes */
+    bool crc_on;
+    bool app;               /* previous command was CMD55 */
+    unsigned op_cond_polls;
+
+    uint8_t cmd[6];
+    int cmd_len;
+
+    uint8_t out[16];        /* response bytes queued ahead of any data */
+    int out_head, out_len;
+
+    enum sd_mode mode;
+    enum sd_mode after_busy;
+    uint64_t ready_ns;      /* data available / busy until */
+
+    /* M_READ */
+    bool multi;
+    uint32_t sector;
+    uint8_t block[512 + 3];  /* token, data, crc */
+    int block_len, block_pos;
+
+    /* M_WRITE / M_WRITE_DATA */
+    uint8_t rx[512 + 2];
+    int rx_len;
+
+    unsigned corrupt;
+    uint64_t ns;
+    uint64_t byte_ns;
+    int64_t clock_base;
+    sdsim_stats_t stats;
+} sd;
+
+void sdsimInsert(uint32_t sectors, bool sdhc)
+{
+    free(sd.data);
+    memset(&sd, 0, sizeof(sd));
+    sd.data = (uint8_t *)calloc(sectors, 512);
+    sd.sectors = sectors;
+    sd.sdhc = sdhc;
+    sd.idle = true;
+    sd.byte_ns = 8000 / 4;   /* 4 MHz until a transaction says otherwise */
+    sd.clock_base = hostClockNow();
+}
+
+void sdsimFormat(uint16_t reserved, uint32_t fat_sectors)
+{
+    uint8_t *bs = sd.data;
+    memset(bs, 0, 512);
+    bs[0] = 0xEB;
+    bs[1] = 0x58;
+    bs[2] = 0x90;
+    memcpy(bs + 3, "MSDOS5.0", 8);
+    bs[11] = 0x00;      /* 512 bytes per sector */
+    bs[12] = 0x02;
+    bs[13] = 8;         /* sectors per cluster */
+    bs[14] = reserved;
+    bs[15] = reserved >> 8;
+    bs[16] = 2;         /* FATs */
+    bs[21] = 0xF8;
+    for (int i = 0; i < 4; i++) {
+        bs[32 + i] = sd.sectors >> (8 * i);
+        bs[36 + i] = fat_sectors >> (8 * i);
+    }
+    bs[44] = 2;         /* root directory cluster */
+    memcpy(bs + 82, "FAT32   ", 8);
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+}
+
+uint8_t *sdsimSector(uint32_t sector)
+{
+    return sector < sd.sectors ? sd.data + (size_t)sector * 512 : NULL;
+}
+
+void sdsimStats(sdsim_stats_t *stats, bool reset)
+{
+    if (stats) {
+        *stats = sd.stats;
+        stats->ns = sd.ns;
+    }
+    if (reset) {
+        memset(&sd.stats, 0, sizeof(sd.stats));
+        sd.ns = 0;
+        sd.clock_base = hostClockNow();
+    }
+}
+
+void sdsimCorruptReads(unsigned count)
+{
+    sd.corrupt = count;
+}
+
+static void advance(uint64_t ns)
+{
+    sd.ns += ns;
+    hostClockSet(sd.clock_base + (int64_t)(sd.ns / 1000));
+}
+
+static void queue(uint8_t b)
+{
+    if (sd.out_len < (int)sizeof(sd.out)) {
+        sd.out[(sd.out_head + sd.out_len++) % sizeof(sd.out)] = b;
+    }
+}
+
+static uint8_t r1(uint8_t flags)
+{
+    return flags | (sd.idle ? 0x01 : 0x00);
+}
+
+/* queues the token, data and crc of one block */
+static void load_block(const uint8_t *data, int len)
+{
+    sd.block[0] = 0xFE;
+    memcpy(sd.block + 1, data, len);
+    uint16_t crc = crc16(data, len);
+    sd.block[1 + len] = crc >> 8;
+    sd.block[2 + len] = crc;
+    if (sd.corrupt) {
+        sd.corrupt--;
+        sd.block[1 + len / 2] ^= 0x10;
+    }
+    sd.block_len = len + 3;
+    sd.block_pos = 0;
+}
+
+static bool load_sector(void)
+{
+    if (sd.sector >= sd.sectors) {
+        return false;
+    }
+    load_block(sd.data + (size_t)sd.sector * 512, 512);
+    return true;
+}
+
+static uint32_t address(uint32_t arg)
+{
+    return sd.sdhc ? arg : arg >> 9;
+}
+
+static void execute(void)
+{
+    uint8_t index = sd.cmd[0] & 0x3f;
+    uint32_t arg = ((uint32_t)sd.cmd[1] << 24) | ((uint32_t)sd.cmd[2] << 16) | ((uint32_t)sd.cmd[3] << 8) | sd.cmd[4];
+    bool app = sd.app;
+    sd.app = false;
+    sd.stats.cmd[index]++;
+
+    if ((sd.crc_on || index == 0 || index == 8) && (sd.cmd[5] >> 1) != crc7(sd.cmd, 5)) {
+        sd.stats.crc_errors++;
+        queue(0xFF);
+        queue(r1(0x08));
+        return;
+    }
+
+    queue(0xFF);    /* Ncr */
+    switch (index) {
+    case 0:
+        sd.idle = true;
+        sd.crc_on = false;
+        sd.mode = M_IDLE;
+        queue(0x01);
+        break;
+    case 8:
+        queue(r1(0));
+        queue(0x00);
+        queue(0x00);
+        queue((arg >> 8) & 0x0f);
+        queue(arg & 0xff);
+        break;
+    case 58: {
+        uint32_t ocr = 0x00FF8000 | (sd.idle ? 0 : 0x80000000) | (sd.sdhc && !sd.idle ? 0x40000000 : 0);
+        queue(r1(0));
+        queue(ocr >> 24);
+        queue(ocr >> 16);
+        queue(ocr >> 8);
+        queue(ocr);
+        break;
+    }
+    case 59:
+        sd.crc_on = arg & 1;
+        queue(r1(0));
+        break;
+    case 55:
+        sd.app = true;
+        queue(r1(0));
+        break;
+    case 41:
+        if (!app) {
+            queue(r1(0x04));
+            break;
+        }
+        if (++sd.op_cond_polls >= 3) {
+            sd.idle = false;
+        }
+        queue(r1(0));
+        break;
+    case 42:
+    case 23:
+    case 16:
+        queue(r1(app || index == 16 ? 0 : 0x04));
+        break;
+    case 13:
+        queue(r1(0));
+        queue(0x00);
+        break;
+    case 9: {
+        uint8_t csd[16] = { 0x40, 0x0e, 0x00, 0x32, 0x5b, 0x59, 0x00, 0x00, 0x00, 0x00, 0x7f, 0x80, 0x0a, 0x40, 0x00, 0x01 };
+        uint32_t c_size = sd.sectors / 1024 - 1;
+        csd[7] = (c_size >> 16) & 0x3f;
+        csd[8] = c_size >> 8;
+        csd[9] = c_size;
+        queue(r1(0));
+        load_block(csd, 16);
+        sd.mode = M_READ;
+        sd.multi = false;
+        sd.sector = UINT32_MAX;
+        sd.ready_ns = sd.ns + 2000;
+        break;
+    }
+    case 17:
+    case 18:
+        sd.sector = address(arg);
+        if (sd.sector >= sd.sectors) {
+            queue(r1(0x40));
+            break;
+        }
+        queue(r1(0));
+        load_sector();
+        sd.mode = M_READ;
+        sd.multi = index == 18;
+        sd.ready_ns = sd.ns + sdsim_timing.read_access_ns;
+        break;
+    case 12:
+        sd.mode = M_IDLE;
+        queue(0xFF);    /* stuff byte */
+        queue(r1(0));
+        break;
+    case 24:
+    case 25:
+        sd.sector = address(arg);
+        if (sd.sector >= sd.sectors) {
+            queue(r1(0x40));
+            break;
+        }
+        queue(r1(0));
+        sd.mode = M_WRITE;
+        sd.multi = index == 25;
+        break;
+    default:
+        queue(r1(0x04));
+        break;
+    }
+}
+
+static uint8_t exchange(uint8_t in)
+{
+    advance(sd.byte_ns);
+    sd.stats.bus_bytes++;
+    if (!sd.selected) {
+        return 0xFF;
+    }
+
+    /* data the card is receiving is not parsed for commands */
+    if (sd.mode == M_WRITE_DATA) {
+        sd.rx[sd.rx_len++] = in;
+        if (sd.rx_len < (int)sizeof(sd.rx)) {
+            return 0xFF;
+        }
+        uint16_t crc = ((uint16_t)sd.rx[512] << 8) | sd.rx[513];
+        if (sd.crc_on && crc != crc16(sd.rx, 512)) {
+            sd.stats.crc_errors++;
+            queue(0x0B);
+            sd.mode = sd.multi ? M_WRITE : M_IDLE;
+            return 0xFF;
+        }
+        memcpy(sd.data + (size_t)sd.sector * 512, sd.rx, 512);
+        sd.stats.blocks_written++;
+        sd.sector++;
+        queue(0x05);
+        sd.mode = M_BUSY;
+        sd.after_busy = sd.multi ? M_WRITE : M_IDLE;
+        sd.ready_ns = sd.ns + (sd.multi ? sdsim_timing.write_multi_ns : sdsim_timing.write_single_ns);
+        return 0xFF;
+    }
+    if (sd.mode == M_WRITE && !sd.out_len) {
+        if (in == (sd.multi ? 0xFC : 0xFE)) {
+            if (sd.sector >= sd.sectors) {
+                queue(0x0D);
+                sd.mode = M_IDLE;
+                return 0xFF;
+            }
+            sd.rx_len = 0;
+            sd.mode = M_WRITE_DATA;
+            return 0xFF;
+        }
+        if (sd.multi && in == 0xFD) {
+            sd.mode = M_BUSY;
+            sd.after_busy = M_IDLE;
+            sd.ready_ns = sd.ns + sdsim_timing.write_stop_ns;
+            return 0xFF;
+        }
+    }
+
+    /* commands are recognised while idle and while sending data (CMD12) */
+    if (sd.cmd_len || ((in & 0xC0) == 0x40 && (sd.mode == M_IDLE || sd.mode == M_READ))) {
+        sd.cmd[sd.cmd_len++] = in;
+        if (sd.cmd_len == 6) {
+            /* the response starts with the next byte */
+            sd.cmd_len = 0;
+            execute();
+            return 0xFF;
+        }
+    }
+
+    if (sd.out_len) {
+        uint8_t b = sd.out[sd.out_head];
+        sd.out_head = (sd.out_head + 1) % sizeof(sd.out);
+        sd.out_len--;
+        return b;
+    }
+    switch (sd.mode) {
+    case M_READ:
+        if (sd.ns < sd.ready_ns) {
+            return 0xFF;
+        }
+        if (sd.block_pos < sd.block_len) {
+            uint8_t b = sd.block[sd.block_pos++];
+            if (sd.block_pos == sd.block_len) {
+                if (sd.sector != UINT32_MAX) {
+                    sd.stats.blocks_read++;
+                }
+                if (sd.multi) {
+                    sd.sector++;
+                    if (load_sector()) {
+                        sd.ready_ns = sd.ns + sdsim_timing.read_next_ns;
+                    } else {
+                        sd.mode = M_IDLE;
+                    }
+                } else {
+                    sd.mode = M_IDLE;
+                }
+            }
+            return b;
+        }
+        return 0xFF;
+    case M_BUSY:
+        if (sd.ns < sd.ready_ns) {
+            return 0x00;
+        }
+        sd.mode = sd.after_busy;
+        return 0xFF;
+    default:
+        return 0xFF;
+    }
+}
+
+static void call(void)
+{
+    sd.stats.spi_calls++;
+    advance(sdsim_timing.call_ns);
+}
+
+/* ------------------------------------------------------------- SPIClass */
+
+SPIClass::SPIClass(uint8_t spi_bus) : _spi_num(spi_bus), _spi(NULL), _use_hw_ss(false), _sck(-1), _miso(-1),
+    _mosi(-1), _ss(-1), _div(0), _freq(1000000), _inTransaction(false) {}
+
+void SPIClass::beginTransaction(SPISettings settings)
+{
+    _inTransaction = true;
+    sd.byte_ns = 8000000000ULL / settings._clock;
+}
+
+void SPIClass::endTransaction(void)
+{
+    _inTransaction = false;
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+    call();
+    return exchange(data);
+}
+
+uint16_t SPIClass::transfer16(uint16_t data)
+{
+    call();
+    uint16_t r = exchange(data >> 8) << 8;
+    return r | exchange(data);
+}
+
+uint32_t SPIClass::transfer32(uint32_t data)
+{
+    call();
+    uint32_t r = 0;
+    for (int i = 3; i >= 0; i--) {
+        r = (r << 8) | exchange(data >> (8 * i));
+    }
+    return r;
+}
+
+void SPIClass::transferBytes(uint8_t *data, uint8_t *out, uint32_t size)
+{
+    call();
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t r = exchange(data ? data[i] : 0xFF);
+        if (out) {
+            out[i] = r;
+        }
+    }
+}
+
+void SPIClass::write(uint8_t data)
+{
+    call();
+    exchange(data);
+}
+
+void SPIClass::write16(uint16_t data)
+{
+    call();
+    exchange(data >> 8);
+    exchange(data);
+}
+
+void SPIClass::write32(uint32_t data)
+{
+    call();
+    for (int i = 3; i >= 0; i--) {
+        exchange(data >> (8 * i));
+    }
+}
+
+void SPIClass::writeBytes(uint8_t *data, uint32_t size)
+{
+    call();
+    for (uint32_t i = 0; i < size; i++) {
+        exchange(data[i]);
+    }
+}
+
+SPIClass SPI(VSPI);
+
+/* chip select: any pin driven low selects the card */
+extern "C" __attribute__((weak)) void digitalWrite(uint8_t pin, uint8_t val)
+{
+    (void)pin;
+    sd.selected = !val;
+    if (!sd.selected) {
+        sd.cmd_len = 0;
+        sd.out_len = 0;
+        if (sd.mode == M_READ) {
+            sd.mode = M_IDLE;
+        }
+    }
+}
+
+extern "C" __attribute__((weak)) void pinMode(uint8_t pin, uint8_t mode)
+{
+    (void)pin;
+    (void)mode;
+}
@@ -0,0 +1,60 @@
+/*
+ * An SD card in SPI mode behind SPIClass.
+ *
+ * common/sdcard_sim.cpp implements the SPIClass members the SD library
+ * uses on top of a byte-level card model: command packets with CRC7,
+ * R1/R3/R7 responses, CMD17/18 data blocks with start token and CRC16,
+ * CMD24/25 data reception with data response and busy, CMD12, ACMD23,
+ * the CSD register and the init sequence. Chip select is whatever pin is
+ * driven through digitalWrite().
+ *
+ * Time is simulated: every byte on the bus costs 8 bits at the
+ * transaction's clock, every SPIClass call a fixed overhead, and the card
+ * answers reads and finishes writes after the latencies below by sending
+ * 0xFF (not ready) or 0x00 (busy) until then. With hostClockManual(true)
+ * millis()/micros() follow the simulated time, so the driver's timeouts
+ * behave as on the device.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t call_ns;           /* per SPIClass call: driver, HAL and queueing */
+    uint32_t read_access_ns;    /* CMD17/CMD18 until the first data block */
+    uint32_t read_next_ns;      /* between CMD18 blocks */
+    uint32_t write_single_ns;   /* busy after a CMD24 block */
+    uint32_t write_multi_ns;    /* busy after each CMD25 block */
+    uint32_t write_stop_ns;     /* busy after the CMD25 stop token */
+} sdsim_timing_t;
+
+typedef struct {
+    unsigned cmd[64];           /* commands received, by index (ACMDs count under their own index) */
+    unsigned blocks_read;       /* 512 byte blocks sent */
+    unsigned blocks_written;    /* 512 byte blocks programmed */
+    unsigned crc_errors;        /* commands or data blocks rejected for a bad CRC */
+    unsigned spi_calls;
+    uint64_t bus_bytes;
+    uint64_t ns;                /* simulated time */
+} sdsim_stats_t;
+
+extern sdsim_timing_t sdsim_timing;
+
+/* A fresh card of `sectors` 512 byte sectors, zero-filled and uninitialised. */
+void sdsimInsert(uint32_t sectors, bool sdhc);
+/* Write a boot sector for a volume with two FATs of `fat_sectors` after `reserved` sectors. */
+void sdsimFormat(uint16_t reserved, uint32_t fat_sectors);
+/* The card's storage, to preload or check. */
+uint8_t *sdsimSector(uint32_t sector);
+void sdsimStats(sdsim_stats_t *stats, bool reset);
+/* Flip a bit in the next `count` data blocks the card sends. */
+void sdsimCorruptReads(unsigned count);
+
+#ifdef __cplusplus
+}
+#endif
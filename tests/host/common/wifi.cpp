@@ -0,0 +1,22 @@
+/*
+ * The WiFi object of the host WiFi.h, see include/WiFi.h.
+ */
+#include <WiFi.h>
+#include <lwip/netdb.h>
+#include <lwip/sockets.h>
+#include <string.h>
+
+WiFiClass WiFi;
+
+int WiFiGenericClass::hostByName(const char *aHostname, IPAddress &aResult)
+{
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    if (getaddrinfo(aHostname, NULL, &hints, &res) || !res) {
+        return 0;
+    }
+    aResult = IPAddress((uint32_t)((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr);
+    freeaddrinfo(res);
+    return 1;
+}
@@ -0,0 +1,291 @@
+/*
+ * Calibrated millivolt conversion through per unit and attenuation tables.
+ *
+ * esp_adc_cal is faked with the linear model of the IDF characterization
+ * (coefficients from the default Vref, rounding of the 16.16 gain) and a
+ * bend at the top of the 11 dB range like its lookup curve, so every code
+ * the tables hold can be compared with what the IDF call returns.
+ *
+ * The benchmark converts blocks of raw codes to millivolts and compares
+ * the table pipeline with calling esp_adc_cal_raw_to_voltage() for every
+ * sample and with per-sample floating-point math.
+ */
+#include "host.h"
+#include "../../cores/esp32/esp32-hal-gpio.c"
+#include "../../cores/esp32/esp32-hal-adc.c"
+
+/* the stream is not used here */
+esp_err_t i2s_driver_install(i2s_port_t port, const i2s_config_t * config, int queue_size, void * queue)
+{
+    (void)port; (void)config; (void)queue_size; (void)queue;
+    return ESP_FAIL;
+}
+esp_err_t i2s_driver_uninstall(i2s_port_t port) { (void)port; return ESP_OK; }
+esp_err_t i2s_zero_dma_buffer(i2s_port_t port) { (void)port; return ESP_OK; }
+esp_err_t i2s_adc_enable(i2s_port_t port) { (void)port; return ESP_OK; }
+esp_err_t i2s_adc_disable(i2s_port_t port) { (void)port; return ESP_OK; }
+esp_err_t i2s_set_adc_mode(adc_unit_t unit, adc1_channel_t channel) { (void)unit; (void)channel; return ESP_OK; }
+esp_err_t i2s_read(i2s_port_t port, void * dest, size_t size, size_t * bytes_read, TickType_t ticks)
+{
+    (void)port; (void)dest; (void)size; (void)ticks;
+    *bytes_read = 0;
+    return ESP_FAIL;
+}
+
+static const uint32_t ATTEN_SCALE[4] = { 57431, 76236, 105481, 196602 };
+static const uint32_t ATTEN_OFFSET[4] = { 75, 78, 107, 142 };
+#define CAL_BEND_CODE   2880
+
+static unsigned characterized[2][4];
+
+esp_adc_cal_value_t esp_adc_cal_characterize(adc_unit_t unit, adc_atten_t atten, adc_bits_width_t width,
+                                             uint32_t vref, esp_adc_cal_characteristics_t * chars)
+{
+    memset(chars, 0, sizeof(*chars));
+    chars->adc_num = unit;
+    chars->atten = atten;
+    chars->bit_width = width;
+    chars->vref = vref;
+    /* ADC2 of this chip reads a little higher */
+    chars->coeff_a = vref * ATTEN_SCALE[atten] / 4096 + (unit == ADC_UNIT_2 ? 300 : 0);
+    chars->coeff_b = ATTEN_OFFSET[atten];
+    characterized[unit == ADC_UNIT_2][atten]++;
+    return ESP_ADC_CAL_VAL_DEFAULT_VREF;
+}
+
+uint32_t esp_adc_cal_raw_to_voltage(uint32_t code, const esp_adc_cal_characteristics_t * chars)
+{
+    uint32_t mv = (chars->coeff_a * code + 32768) / 65536 + chars->coeff_b;
+    if (chars->atten == ADC_ATTEN_DB_11 && code > CAL_BEND_CODE)
+        mv -= ((code - CAL_BEND_CODE) * (code - CAL_BEND_CODE)) >> 14;
+    return mv;
+}
+
+static uint32_t reference(adc_unit_t unit, uint8_t atten, uint16_t code)
+{
+    esp_adc_cal_characteristics_t chars;
+    esp_adc_cal_characterize(unit, atten, ADC_WIDTH_BIT_12, ADC_CAL_DEFAULT_VREF, &chars);
+    characterized[unit == ADC_UNIT_2][atten]--;
+    return esp_adc_cal_raw_to_voltage(code, &chars);
+}
+
+static uint32_t rng = 46;
+
+static uint32_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* ----------------------------------------------------------------- tests */
+
+static void test_tables(void)
+{
+    /* 36 and 39 share the 11 dB table, 25 is on ADC2 */
+    const uint8_t pins[5] = { 36, 39, 32, 33, 25 };
+    analogSetPinAttenuation(36, ADC_11db);
+    analogSetPinAttenuation(39, ADC_11db);
+    analogSetPinAttenuation(32, ADC_0db);
+    analogSetPinAttenuation(33, ADC_6db);
+    analogSetPinAttenuation(25, ADC_11db);
+    adc_cal_pipeline_t cal;
+    TEST_ASSERT(adcCalInit(&cal, pins, 5, 1));
+    TEST_ASSERT_EQ(cal.count, 5);
+    TEST_ASSERT_EQ(cal.oversample_shift, 0);
+    TEST_ASSERT(cal.lut[0] == cal.lut[1]);
+    TEST_ASSERT(cal.lut[0] != cal.lut[2] && cal.lut[0] != cal.lut[4]);
+
+    static const struct { adc_unit_t unit; uint8_t atten; } expect[5] = {
+        { ADC_UNIT_1, 3 }, { ADC_UNIT_1, 3 }, { ADC_UNIT_1, 0 }, { ADC_UNIT_1, 2 }, { ADC_UNIT_2, 3 }
+    };
+    for (int i = 0; i < 5; i++)
+        for (uint32_t code = 0; code < 4096; code++)
+            TEST_ASSERT_EQ(cal.lut[i][code], reference(expect[i].unit, expect[i].atten, code));
+    TEST_ASSERT(cal.lut[0][4095] < cal.lut[4][4095]);
+
+    /* tables are built once */
+    TEST_ASSERT(adcCalInit(&cal, pins, 5, 1));
+    TEST_ASSERT_EQ(characterized[0][3], 1u);
+    TEST_ASSERT_EQ(characterized[0][0], 1u);
+    TEST_ASSERT_EQ(characterized[0][2], 1u);
+    TEST_ASSERT_EQ(characterized[1][3], 1u);
+    TEST_ASSERT_EQ(characterized[0][1], 0u);
+
+    /* invalid layouts */
+    const uint8_t bad[2] = { 36, 20 };
+    TEST_ASSERT(!adcCalInit(&cal, bad, 2, 1));
+    TEST_ASSERT(!adcCalInit(&cal, pins, 0, 1));
+    TEST_ASSERT(!adcCalInit(&cal, pins, 9, 1));
+    TEST_ASSERT(!adcCalInit(NULL, pins, 1, 1));
+    TEST_ASSERT_EQ(adcCalConvert(NULL, NULL, 1, NULL), 0u);
+
+    /* oversampling rounds down to a power of two, 256 at most */
+    static const uint16_t over[] = { 0, 1, 2, 3, 16, 255, 256, 300, 65535 };
+    static const uint8_t shifts[] = { 0, 0, 1, 1, 4, 7, 8, 8, 8 };
+    for (int i = 0; i < 9; i++) {
+        TEST_ASSERT(adcCalInit(&cal, pins, 1, over[i]));
+        TEST_ASSERT_EQ(cal.oversample_shift, shifts[i]);
+    }
+}
+
+static void test_convert(void)
+{
+    static uint16_t frames[1024 * 8];
+    static uint16_t mv[1024 * 8];
+    const uint8_t pins[8] = { 36, 37, 38, 39, 32, 33, 34, 35 };
+    static const adc_attenuation_t attens[4] = { ADC_0db, ADC_2_5db, ADC_6db, ADC_11db };
+    for (int i = 0; i < 8; i++)
+        analogSetPinAttenuation(pins[i], attens[i % 4]);
+
+    static const uint16_t over[] = { 1, 2, 4, 16, 256 };
+    for (uint8_t width = 1; width <= 8; width++) {
+        for (int o = 0; o < 5; o++) {
+            adc_cal_pipeline_t cal;
+            TEST_ASSERT(adcCalInit(&cal, pins, width, over[o]));
+            /* a partial group at the end is left alone */
+            size_t count = 1024 - (next_random() % 8);
+            for (size_t i = 0; i < count * width; i++)
+                frames[i] = next_random() & 0xFFFF;     /* the channel bits are masked off */
+            memset(mv, 0xAA, sizeof(mv));
+            size_t out = adcCalConvert(&cal, frames, count, mv);
+            TEST_ASSERT_EQ(out, count / over[o]);
+            for (size_t f = 0; f < out; f++) {
+                for (uint8_t c = 0; c < width; c++) {
+                    uint32_t sum = 0;
+                    for (uint16_t k = 0; k < over[o]; k++)
+                        sum += reference(ADC_UNIT_1, attens[c % 4], frames[((f * over[o]) + k) * width + c] & 0xFFF);
+                    /* rounded to the nearest millivolt */
+                    TEST_ASSERT_EQ(mv[f * width + c], (sum + over[o] / 2) / over[o]);
+                }
+            }
+            TEST_ASSERT_EQ(mv[out * width], 0xAAAA);
+        }
+    }
+    for (int i = 0; i < 8; i++)
+        analogSetPinAttenuation(pins[i], ADC_11db);
+}
+
+/* the RTC controller result register: done flag and the code at the set width */
+static void conversion(uint32_t code)
+{
+    WRITE_PERI_REG(SENS_SAR_MEAS_START1_REG, SENS_MEAS1_DONE_SAR | (code << SENS_MEAS1_DATA_SAR_S));
+}
+
+static void test_read_millivolts(void)
+{
+    analogSetPinAttenuation(34, ADC_11db);
+    analogReadResolution(12);
+    for (uint32_t code = 0; code < 4096; code += 13) {
+        conversion(code);
+        TEST_ASSERT_EQ(analogReadMilliVolts(34), reference(ADC_UNIT_1, 3, code));
+    }
+
+    /* other widths are scaled back to the 12 bit table */
+    analogReadResolution(10);
+    conversion(1000);
+    TEST_ASSERT_EQ(analogReadMilliVolts(34), reference(ADC_UNIT_1, 3, 4000));
+    analogReadResolution(16);
+    conversion(3000);
+    TEST_ASSERT_EQ(analogReadMilliVolts(34), reference(ADC_UNIT_1, 3, 3000));
+    analogReadResolution(12);
+
+    analogSetPinAttenuation(34, ADC_0db);
+    conversion(2048);
+    TEST_ASSERT_EQ(analogReadMilliVolts(34), reference(ADC_UNIT_1, 0, 2048));
+    analogSetPinAttenuation(34, ADC_11db);
+
+    TEST_ASSERT_EQ(analogReadMilliVolts(20), 0u);
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+/* what a sketch does without the tables: the IDF call for every sample */
+static void convert_idf(const esp_adc_cal_characteristics_t * chars, uint8_t width, uint16_t over,
+                        const uint16_t * frames, size_t count, uint16_t * mv)
+{
+    for (size_t f = 0; f + over <= count; f += over) {
+        for (uint8_t c = 0; c < width; c++) {
+            uint32_t sum = 0;
+            for (uint16_t k = 0; k < over; k++)
+                sum += esp_adc_cal_raw_to_voltage(frames[(f + k) * width + c] & 0xFFF, &chars[c]);
+            *mv++ = (sum + over / 2) / over;
+        }
+    }
+}
+
+/* or the same curve in floating point */
+static void convert_float(const esp_adc_cal_characteristics_t * chars, uint8_t width, uint16_t over,
+                          const uint16_t * frames, size_t count, uint16_t * mv)
+{
+    float gain[ADC_STREAM_MAX_PINS], offset[ADC_STREAM_MAX_PINS];
+    for (uint8_t c = 0; c < width; c++) {
+        gain[c] = chars[c].coeff_a / 65536.0f;
+        offset[c] = chars[c].coeff_b;
+    }
+    for (size_t f = 0; f + over <= count; f += over) {
+        for (uint8_t c = 0; c < width; c++) {
+            float sum = 0;
+            for (uint16_t k = 0; k < over; k++) {
+                float code = frames[(f + k) * width + c] & 0xFFF;
+                float v = code * gain[c] + offset[c];
+                if (chars[c].atten == ADC_ATTEN_DB_11 && code > CAL_BEND_CODE)
+                    v -= (code - CAL_BEND_CODE) * (code - CAL_BEND_CODE) / 16384.0f;
+                sum += v;
+            }
+            *mv++ = (uint16_t)(sum / over + 0.5f);
+        }
+    }
+}
+
+static void bench_convert(void)
+{
+    enum { FRAMES = 4096 };
+    static uint16_t frames[FRAMES * 8];
+    static uint16_t mv[FRAMES * 8];
+    const uint8_t pins[8] = { 36, 37, 38, 39, 32, 33, 34, 35 };
+    for (size_t i = 0; i < FRAMES * 8; i++)
+        frames[i] = (i & 7) << 12 | (next_random() & 0xFFF);
+    static const uint8_t widths[] = { 1, 4, 8 };
+    static const uint16_t overs[] = { 1, 16 };
+    for (int o = 0; o < 2; o++) {
+        for (int w = 0; w < 3; w++) {
+            uint8_t width = widths[w];
+            uint16_t over = overs[o];
+            adc_cal_pipeline_t cal;
+            esp_adc_cal_characteristics_t chars[8];
+            TEST_ASSERT(adcCalInit(&cal, pins, width, over));
+            for (uint8_t c = 0; c < width; c++)
+                esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, ADC_CAL_DEFAULT_VREF, &chars[c]);
+
+            double rate[3];
+            unsigned n = hostIterations(width == 1 ? 4000 : 1000);
+            uint32_t check = 0;
+            for (int m = 0; m < 3; m++) {
+                uint64_t t0 = hostNowNs();
+                for (unsigned i = 0; i < n; i++) {
+                    if (m == 0)
+                        convert_float(chars, width, over, frames, FRAMES, mv);
+                    else if (m == 1)
+                        convert_idf(chars, width, over, frames, FRAMES, mv);
+                    else
+                        adcCalConvert(&cal, frames, FRAMES, mv);
+                    check += mv[i % (FRAMES / over)];
+                }
+                rate[m] = (double)n * FRAMES * width / ((hostNowNs() - t0) / 1e9);
+            }
+            BENCH("%u pin%s, oversample %3u   float %6.1f M/s, esp_adc_cal %6.1f M/s, table %6.1f M/s  samples (%u)",
+                  width, width > 1 ? "s" : " ", over, rate[0] / 1e6, rate[1] / 1e6, rate[2] / 1e6, check & 1);
+        }
+    }
+}
+
+int main(void)
+{
+    TEST_RUN(test_tables);
+    TEST_RUN(test_convert);
+    TEST_RUN(test_read_millivolts);
+    TEST_RUN(bench_convert);
+    return TEST_EXIT();
+}
@@ -0,0 +1,562 @@
+/*
+ * Continuous ADC1 sampling against a fake of the I2S ADC driver.
+ *
+ * The fake i2s_read() plays the digital controller: it walks the pattern
+ * table the stream wrote to the SYSCON registers, emits one DMA word per
+ * conversion with the channel in bits 15:12, swaps the 16 bit halves of
+ * each 32 bit word like the I2S unit and can lose chosen conversions. The
+ * codes encode the scan number, so every frame can be checked for values
+ * that belong to one scan of the pins.
+ *
+ * The benchmarks replay a prepared DMA buffer as fast as the stream task
+ * takes it, measuring the demux and filter kernel in conversions per
+ * second, and time the pattern table builder.
+ */
+#include "host.h"
+#include "../../cores/esp32/esp32-hal-gpio.c"
+#include "../../cores/esp32/esp32-hal-adc.c"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+typedef uint16_t (*signal_fn)(uint8_t channel, uint32_t scan);
+
+static struct {
+    uint32_t sample_rate;
+    signal_fn signal;
+    uint32_t lose_every;        //lose conversion n when n % lose_every == lose_at
+    uint32_t lose_at;
+    uint32_t n;                 //conversions made by the controller
+    _Atomic uint32_t budget;    //words left to store
+    _Atomic uint32_t lost;
+    _Atomic bool drained;       //i2s_read() found the budget used up
+    const uint16_t * replay;    //bench: DMA buffer returned as is
+} fake;
+
+esp_err_t i2s_driver_install(i2s_port_t port, const i2s_config_t * config, int queue_size, void * queue)
+{
+    (void)port; (void)queue_size; (void)queue;
+    fake.sample_rate = config->sample_rate;
+    return ESP_OK;
+}
+
+esp_err_t i2s_driver_uninstall(i2s_port_t port) { (void)port; return ESP_OK; }
+esp_err_t i2s_zero_dma_buffer(i2s_port_t port) { (void)port; return ESP_OK; }
+esp_err_t i2s_adc_enable(i2s_port_t port) { (void)port; return ESP_OK; }
+esp_err_t i2s_adc_disable(i2s_port_t port) { (void)port; return ESP_OK; }
+
+esp_err_t i2s_set_adc_mode(adc_unit_t unit, adc1_channel_t channel)
+{
+    (void)unit; (void)channel;
+    SET_PERI_REG_MASK(SENS_SAR_READ_CTRL_REG, SENS_SAR1_DIG_FORCE);
+    return ESP_OK;
+}
+
+/* the scan the controller runs, as programmed in the registers */
+static uint8_t pattern(uint8_t channels[16], uint8_t attens[16])
+{
+    uint32_t table[4] = {
+        READ_PERI_REG(SYSCON_SARADC_SAR1_PATT_TAB1_REG), READ_PERI_REG(SYSCON_SARADC_SAR1_PATT_TAB2_REG),
+        READ_PERI_REG(SYSCON_SARADC_SAR1_PATT_TAB3_REG), READ_PERI_REG(SYSCON_SARADC_SAR1_PATT_TAB4_REG)
+    };
+    uint8_t len = GET_PERI_REG_BITS2(SYSCON_SARADC_CTRL_REG, SYSCON_SARADC_SAR1_PATT_LEN, SYSCON_SARADC_SAR1_PATT_LEN_S) + 1;
+    for (uint8_t i = 0; i < len; i++) {
+        uint8_t entry = table[i / 4] >> (24 - (i % 4) * 8);
+        channels[i] = entry >> 4;
+        attens[i] = entry & 3;
+    }
+    return len;
+}
+
+esp_err_t i2s_read(i2s_port_t port, void * dest, size_t size, size_t * bytes_read, TickType_t ticks)
+{
+    (void)port; (void)ticks;
+    uint16_t * dma = (uint16_t *)dest;
+    size_t want = size / sizeof(uint16_t);
+    uint32_t budget = fake.budget;
+    if (!budget) {
+        fake.drained = true;
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+        *bytes_read = 0;
+        return ESP_ERR_TIMEOUT;
+    }
+    if (want > budget)
+        want = budget;
+    if (fake.replay) {
+        memcpy(dma, fake.replay, want * sizeof(uint16_t));
+    } else {
+        uint8_t channels[16], attens[16];
+        uint8_t len = pattern(channels, attens);
+        size_t stored = 0;
+        while (stored < want) {
+            uint32_t n = fake.n++;
+            if (fake.lose_every && n % fake.lose_every == fake.lose_at) {
+                fake.lost++;
+                continue;
+            }
+            uint8_t ch = channels[n % len];
+            uint16_t word = (ch << 12) | (fake.signal(ch, n / len) & 0xFFF);
+            /* halves of each 32 bit word come out swapped */
+            dma[stored ^ 1] = word;
+            stored++;
+        }
+    }
+    fake.budget -= want;
+    *bytes_read = want * sizeof(uint16_t);
+    return ESP_OK;
+}
+
+/* the eFuse calibration is not used by the stream */
+esp_adc_cal_value_t esp_adc_cal_characterize(adc_unit_t unit, adc_atten_t atten, adc_bits_width_t width,
+                                             uint32_t vref, esp_adc_cal_characteristics_t * chars)
+{
+    (void)unit; (void)atten; (void)width; (void)vref; (void)chars;
+    return ESP_ADC_CAL_VAL_DEFAULT_VREF;
+}
+
+uint32_t esp_adc_cal_raw_to_voltage(uint32_t code, const esp_adc_cal_characteristics_t * chars)
+{
+    (void)chars;
+    return code;
+}
+
+/* ------------------------------------------------------------- helpers */
+
+#define MAX_FRAMES  4096
+
+static uint16_t got[MAX_FRAMES * ADC_STREAM_MAX_PINS];
+static _Atomic size_t got_frames;
+static uint8_t got_pins;
+
+static void collect(const uint16_t * frames, size_t count, void * arg)
+{
+    (void)arg;
+    size_t at = got_frames;
+    if (at + count > MAX_FRAMES)
+        count = MAX_FRAMES - at;
+    memcpy(got + at * got_pins, frames, count * got_pins * sizeof(uint16_t));
+    got_frames = at + count;
+}
+
+/* scan number and channel, so a frame shows which scan it came from */
+static uint16_t tagged(uint8_t channel, uint32_t scan)
+{
+    return ((scan & 0x1FF) << 3) | (channel & 7);
+}
+
+static uint16_t ramp(uint8_t channel, uint32_t scan)
+{
+    return (scan * 37 + channel * 500 + (scan * scan) % 101) % 4096;
+}
+
+static uint16_t level(uint8_t channel, uint32_t scan)
+{
+    (void)scan;
+    return 400 * channel + 100;
+}
+
+static uint16_t step(uint8_t channel, uint32_t scan)
+{
+    (void)channel;
+    return scan < 8 ? 0 : 4000;
+}
+
+static void start(signal_fn signal, uint32_t words)
+{
+    memset(&fake, 0, sizeof(fake));
+    fake.signal = signal;
+    fake.budget = words;
+    got_frames = 0;
+}
+
+static void nap(void)
+{
+    struct timespec ts = { 0, 200000 };
+    nanosleep(&ts, NULL);
+}
+
+static void wait_drained(void)
+{
+    while (!fake.drained)
+        nap();
+}
+
+/* hand the running stream more words and wait until it has taken them all */
+static void feed(uint32_t words)
+{
+    fake.budget = words;
+    while (fake.budget)
+        nap();
+    fake.drained = false;
+    wait_drained();
+}
+
+static bool run(const uint8_t * pins, uint8_t count, adc_stream_config_t * config, signal_fn signal, uint32_t scans)
+{
+    start(signal, scans * count);
+    got_pins = count;
+    config->callback = collect;
+    if (!adcStreamBegin(pins, count, config))
+        return false;
+    wait_drained();
+    adcStreamEnd();
+    return true;
+}
+
+static const uint8_t PINS[8] = { 36, 37, 38, 39, 32, 33, 34, 35 };
+static const uint8_t CHANNELS[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+/* ----------------------------------------------------------------- tests */
+
+static void test_pattern_table(void)
+{
+    /* the builder packs the first entry into the top byte */
+    int8_t channels[16];
+    uint8_t attens[16];
+    uint32_t table[4];
+    for (int i = 0; i < 16; i++) {
+        channels[i] = i & 7;
+        attens[i] = i % 4;
+    }
+    TEST_ASSERT_EQ(__adcStreamPattern(channels, attens, 0, table), 0);
+    TEST_ASSERT_EQ(__adcStreamPattern(channels, attens, 17, table), 0);
+    TEST_ASSERT_EQ(__adcStreamPattern(channels, attens, 5, table), 5);
+    TEST_ASSERT_EQ(table[0], 0x0C1D2E3Fu);
+    TEST_ASSERT_EQ(table[1], 0x4C000000u);
+    TEST_ASSERT(table[2] == 0 && table[3] == 0);
+    TEST_ASSERT_EQ(__adcStreamPattern(channels, attens, 16, table), 16);
+    TEST_ASSERT_EQ(table[3], 0x4C5D6E7Fu);
+
+    /* what begin programs: the pins' channels and attenuations, in order */
+    const uint8_t pins[4] = { 39, 32, 36, 35 };
+    analogSetPinAttenuation(39, ADC_0db);
+    analogSetPinAttenuation(32, ADC_2_5db);
+    analogSetPinAttenuation(36, ADC_6db);
+    analogSetPinAttenuation(35, ADC_11db);
+    CLEAR_PERI_REG_MASK(SENS_SAR_READ_CTRL_REG, SENS_SAR1_DIG_FORCE);
+    adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+    config.sample_rate = 100000;
+    start(tagged, 0);
+    TEST_ASSERT(adcStreamBegin(pins, 4, &config));
+    uint8_t ch[16], at[16];
+    TEST_ASSERT_EQ(pattern(ch, at), 4);
+    TEST_ASSERT(ch[0] == 3 && ch[1] == 4 && ch[2] == 0 && ch[3] == 7);
+    TEST_ASSERT(at[0] == 0 && at[1] == 1 && at[2] == 2 && at[3] == 3);
+    TEST_ASSERT_EQ(fake.sample_rate, 100000u);
+    TEST_ASSERT(READ_PERI_REG(SENS_SAR_READ_CTRL_REG) & SENS_SAR1_DIG_FORCE);
+
+    /* one stream at a time */
+    TEST_ASSERT(!adcStreamBegin(pins, 4, &config));
+    adcStreamEnd();
+
+    /* ADC1 is handed back to analogRead() */
+    TEST_ASSERT(!(READ_PERI_REG(SENS_SAR_READ_CTRL_REG) & SENS_SAR1_DIG_FORCE));
+    TEST_ASSERT_EQ(adcStreamOverruns(), 0u);
+    adcStreamEnd();
+
+    for (int i = 0; i < 8; i++)
+        analogSetPinAttenuation(PINS[i], ADC_11db);
+}
+
+static void test_begin_errors(void)
+{
+    adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+    const uint8_t adc2[2] = { 36, 25 };
+    const uint8_t twice[3] = { 36, 39, 36 };
+    const uint8_t nine[9] = { 36, 37, 38, 39, 32, 33, 34, 35, 36 };
+    TEST_ASSERT(!adcStreamBegin(adc2, 2, &config));
+    TEST_ASSERT(!adcStreamBegin(twice, 3, &config));
+    TEST_ASSERT(!adcStreamBegin(nine, 0, &config));
+    TEST_ASSERT(!adcStreamBegin(nine, 9, &config));
+    TEST_ASSERT(!adcStreamBegin(NULL, 1, &config));
+    TEST_ASSERT(!adcStreamBegin(nine, 1, NULL));
+    config.sample_rate = 0;
+    TEST_ASSERT(!adcStreamBegin(nine, 1, &config));
+    config = (adc_stream_config_t)ADC_STREAM_CONFIG_DEFAULT();
+    config.block_frames = 0;
+    TEST_ASSERT(!adcStreamBegin(nine, 1, &config));
+    /* nothing was left running */
+    TEST_ASSERT_EQ(adcStreamRead(got, 1, 0), 0u);
+}
+
+static void test_frames_without_filter(void)
+{
+    static const uint16_t decimations[] = { 1, 5 };
+    for (int d = 0; d < 2; d++) {
+        for (uint8_t count = 1; count <= 8; count += 3) {
+            adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+            config.decimation = decimations[d];
+            config.block_frames = 16;
+            uint32_t frames = 16 * 20;
+            TEST_ASSERT(run(PINS, count, &config, tagged, frames * config.decimation));
+            TEST_ASSERT_EQ(got_frames, (size_t)frames);
+            /* the last scan of every decimation-th group */
+            for (uint32_t f = 0; f < frames; f++) {
+                uint32_t scan = (f + 1) * config.decimation - 1;
+                for (uint8_t i = 0; i < count; i++)
+                    TEST_ASSERT_EQ(got[f * count + i], tagged(CHANNELS[i], scan));
+            }
+        }
+    }
+}
+
+static void test_average(void)
+{
+    /* a power of two shifts, anything else divides */
+    static const uint16_t decimations[] = { 4, 6, 1 };
+    for (int d = 0; d < 3; d++) {
+        adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+        config.filter = ADC_FILTER_AVERAGE;
+        config.decimation = decimations[d];
+        config.block_frames = 8;
+        uint32_t frames = 8 * 25;
+        TEST_ASSERT(run(PINS, 3, &config, ramp, frames * config.decimation));
+        TEST_ASSERT_EQ(got_frames, (size_t)frames);
+        for (uint32_t f = 0; f < frames; f++) {
+            for (uint8_t i = 0; i < 3; i++) {
+                uint32_t sum = 0;
+                for (uint32_t k = 0; k < config.decimation; k++)
+                    sum += ramp(CHANNELS[i], f * config.decimation + k);
+                TEST_ASSERT_EQ(got[f * 3 + i], sum / config.decimation);
+            }
+        }
+    }
+}
+
+static void test_lowpass(void)
+{
+    static const uint8_t shifts[] = { 1, 4, 12 };
+    for (int s = 0; s < 3; s++) {
+        adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+        config.filter = ADC_FILTER_LOWPASS;
+        config.lowpass_shift = shifts[s];
+        config.decimation = 3;
+        config.block_frames = 8;
+        uint32_t frames = 8 * 25;
+        TEST_ASSERT(run(PINS, 2, &config, ramp, frames * config.decimation));
+        TEST_ASSERT_EQ(got_frames, (size_t)frames);
+        for (uint8_t i = 0; i < 2; i++) {
+            int32_t y = 0;
+            for (uint32_t scan = 0; scan < frames * config.decimation; scan++) {
+                y += (((int32_t)ramp(CHANNELS[i], scan) << 4) - y) >> shifts[s];
+                if (scan % config.decimation == config.decimation - 1)
+                    TEST_ASSERT_EQ(got[(scan / config.decimation) * 2 + i], (uint16_t)(y >> 4));
+            }
+        }
+    }
+
+    /* a step settles close to the input */
+    adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+    config.filter = ADC_FILTER_LOWPASS;
+    config.lowpass_shift = 6;
+    config.block_frames = 16;
+    TEST_ASSERT(run(PINS, 1, &config, step, 16 * 64));
+    TEST_ASSERT_EQ(got[0], 0);
+    TEST_ASSERT(got[100] > 2800);
+    /* 4 fraction bits: within 2^(shift - 4) codes of the input */
+    TEST_ASSERT(got[16 * 64 - 1] >= 3996);
+
+    /* out of range shifts fall back to 4 */
+    config.lowpass_shift = 13;
+    TEST_ASSERT(run(PINS, 1, &config, step, 16 * 4));
+    TEST_ASSERT_EQ(got[8], 4000 / 16);
+}
+
+static void test_lost_conversions(void)
+{
+    /* every position in the scan is lost at some point */
+    static const uint16_t filters[] = { ADC_FILTER_NONE, ADC_FILTER_AVERAGE };
+    for (int f = 0; f < 2; f++) {
+        for (uint8_t count = 1; count <= 8; count += 3) {
+            adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+            config.filter = filters[f];
+            config.decimation = f ? 2 : 1;
+            config.block_frames = 4;
+            start(f ? level : tagged, 2000 * count);
+            fake.lose_every = 97;
+            fake.lose_at = 50;
+            got_pins = count;
+            config.callback = collect;
+            TEST_ASSERT(adcStreamBegin(PINS, count, &config));
+            wait_drained();
+            uint32_t overruns = adcStreamOverruns();
+            adcStreamEnd();
+
+            /* one lost scan per lost conversion */
+            TEST_ASSERT(fake.lost > 10);
+            TEST_ASSERT_EQ(overruns, count > 1 ? fake.lost : 0u);
+            TEST_ASSERT(got_frames > 0);
+            for (size_t n = 0; n < got_frames; n++) {
+                uint16_t * frame = got + n * count;
+                for (uint8_t i = 0; i < count; i++) {
+                    if (f) {
+                        /* averages of whole scans only */
+                        TEST_ASSERT_EQ(frame[i], level(CHANNELS[i], 0));
+                        continue;
+                    }
+                    /* the right pin, and every value from the same scan */
+                    TEST_ASSERT_EQ(frame[i] & 7, CHANNELS[i]);
+                    TEST_ASSERT_EQ(frame[i] >> 3, frame[0] >> 3);
+                }
+            }
+        }
+    }
+}
+
+static void test_ring(void)
+{
+    adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+    config.block_frames = 8;
+    config.buffer_frames = 64;
+    start(tagged, 0);
+    TEST_ASSERT(adcStreamBegin(PINS, 3, &config));
+    static uint16_t frames[256 * 3];
+    TEST_ASSERT_EQ(adcStreamRead(frames, 4, 10), 0u);
+
+    /* read as it arrives */
+    fake.budget = 40 * 3;
+    TEST_ASSERT_EQ(adcStreamRead(frames, 40, 2000), 40u);
+    for (uint32_t f = 0; f < 40; f++)
+        for (uint8_t i = 0; i < 3; i++)
+            TEST_ASSERT_EQ(frames[f * 3 + i], tagged(CHANNELS[i], f));
+    TEST_ASSERT_EQ(adcStreamOverruns(), 0u);
+
+    /* nobody reads: the ring keeps 64 frames, whole blocks are counted lost */
+    feed(200 * 3);
+    size_t n = adcStreamRead(frames, 256, 0);
+    TEST_ASSERT_EQ(n, 64u);
+    TEST_ASSERT_EQ(adcStreamOverruns(), (200u - 64) / 8);
+    for (uint32_t f = 0; f < 64; f++)
+        TEST_ASSERT_EQ(frames[f * 3], tagged(0, 40 + f));
+    adcStreamEnd();
+    TEST_ASSERT_EQ(adcStreamOverruns(), 0u);
+}
+
+static uint16_t reader_frames[64 * 3];
+static _Atomic size_t reader_got;
+static _Atomic bool reader_done;
+
+static void * reader(void * arg)
+{
+    (void)arg;
+    reader_got = adcStreamRead(reader_frames, 64, 10000);
+    reader_done = true;
+    return NULL;
+}
+
+/* adcStreamEnd() from another task while a reader waits on the ring */
+static void test_end_wakes_reader(void)
+{
+    mallopt(M_PERTURB, 0xa5);   /* a freed stream reads as garbage */
+    adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+    config.block_frames = 4;
+    config.buffer_frames = 64;
+    config.task_stack = 3072;
+    start(tagged, 0);
+    TEST_ASSERT(adcStreamBegin(PINS, 3, &config));
+    reader_got = 0;
+    reader_done = false;
+    pthread_t t;
+    pthread_create(&t, NULL, reader, NULL);
+    feed(8 * 3);                /* two blocks, then nothing more */
+    nap();
+    TEST_ASSERT(!reader_done);
+    uint64_t t0 = hostNowNs();
+    adcStreamEnd();
+    uint64_t ms = (hostNowNs() - t0) / 1000000;
+    pthread_join(t, NULL);
+    TEST_ASSERT(reader_done);
+    TEST_ASSERT_EQ(reader_got, 8u);
+    TEST_ASSERT(ms < 1000);
+    for (uint32_t f = 0; f < 8; f++)
+        TEST_ASSERT_EQ(reader_frames[f * 3], tagged(0, f));
+    TEST_ASSERT_EQ(adcStreamRead(reader_frames, 1, 10), 0u);
+    TEST_ASSERT_EQ(adcStreamOverruns(), 0u);
+    mallopt(M_PERTURB, 0);
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+static _Atomic uint64_t counted;
+
+static void count_frames(const uint16_t * frames, size_t count, void * arg)
+{
+    (void)frames; (void)arg;
+    counted += count;
+}
+
+static void bench_pattern(void)
+{
+    int8_t channels[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    uint8_t attens[8] = { 3, 3, 3, 3, 0, 1, 2, 3 };
+    uint32_t table[4], sum = 0;
+    unsigned n = hostIterations(20000000);
+    uint64_t t0 = hostNowNs();
+    for (unsigned i = 0; i < n; i++) {
+        channels[0] = i & 7;
+        sum += __adcStreamPattern(channels, attens, 8, table);
+        sum += table[i & 1];
+    }
+    double s = (hostNowNs() - t0) / 1e9;
+    BENCH("pattern table, 8 pins         %7.1f M builds/s (%u)", n / s / 1e6, sum & 1);
+}
+
+static void bench_kernel(void)
+{
+    static const struct { adc_filter_t filter; uint16_t decimation; const char * name; } modes[] = {
+        { ADC_FILTER_NONE,    1,  "none       " },
+        { ADC_FILTER_NONE,    10, "none /10   " },
+        { ADC_FILTER_AVERAGE, 8,  "average /8 " },
+        { ADC_FILTER_AVERAGE, 10, "average /10" },
+        { ADC_FILTER_LOWPASS, 1,  "lowpass    " },
+        { ADC_FILTER_LOWPASS, 10, "lowpass /10" },
+    };
+    static const uint8_t counts[] = { 1, 4, 8 };
+    static uint16_t dma[ADC_STREAM_DMA_LEN];
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        char line[160];
+        int len = snprintf(line, sizeof(line), "demux + %s", modes[m].name);
+        for (int c = 0; c < 3; c++) {
+            uint8_t count = counts[c];
+            /* 512 words hold whole scans of 1, 4 and 8 pins */
+            for (uint32_t i = 0; i < ADC_STREAM_DMA_LEN; i++)
+                dma[i ^ 1] = (CHANNELS[i % count] << 12) | ramp(CHANNELS[i % count], i / count);
+            adc_stream_config_t config = ADC_STREAM_CONFIG_DEFAULT();
+            config.filter = modes[m].filter;
+            config.decimation = modes[m].decimation;
+            config.block_frames = 64;
+            config.callback = count_frames;
+            uint32_t words = hostIterations(40000) * ADC_STREAM_DMA_LEN;
+            start(tagged, 0);
+            fake.replay = dma;
+            counted = 0;
+            TEST_ASSERT(adcStreamBegin(PINS, count, &config));
+            uint64_t t0 = hostNowNs();
+            feed(words);
+            double s = (hostNowNs() - t0) / 1e9;
+            adcStreamEnd();
+            uint64_t frames = (uint64_t)words / count / modes[m].decimation;
+            TEST_ASSERT(counted <= frames && counted + 64 > frames);
+            len += snprintf(line + len, sizeof(line) - len, "  %u pin%s %6.1f M/s", count, count > 1 ? "s" : " ", words / s / 1e6);
+        }
+        BENCH("%s  conversions", line);
+    }
+}
+
+int main(void)
+{
+    TEST_RUN(test_pattern_table);
+    TEST_RUN(test_begin_errors);
+    TEST_RUN(test_frames_without_filter);
+    TEST_RUN(test_average);
+    TEST_RUN(test_lowpass);
+    TEST_RUN(test_lost_conversions);
+    TEST_RUN(test_ring);
+    TEST_RUN(test_end_wakes_reader);
+    TEST_RUN(bench_pattern);
+    TEST_RUN(bench_kernel);
+    return TEST_EXIT();
+}
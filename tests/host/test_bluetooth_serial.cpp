@@ -0,0 +1,375 @@
+/*
+ * BluetoothSerial buffering driven by synthetic SPP events.
+ *
+ * The Bluedroid calls are replaced by a fake stack: esp_spp_write records
+ * each chunk and a "BTC task" thread reports ESP_SPP_WRITE_EVT for it after
+ * a configurable delay, the way the controller does once the data is sent.
+ */
+#include <pthread.h>
+#include <vector>
+
+#include "host.h"
+#include "../../libraries/BluetoothSerial/src/BluetoothSerial.cpp"
+
+/* ------------------------------------------------------------ fake stack */
+
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<uint8_t> stack_sent;
+static std::vector<size_t> stack_chunks;
+static SemaphoreHandle_t stack_pending;
+static volatile unsigned stack_delay_us;
+static volatile bool stack_run;
+static pthread_t stack_thread;
+
+bool btStarted() { return true; }
+bool btStart() { return true; }
+bool btStop() { return true; }
+esp_bluedroid_status_t esp_bluedroid_get_status(void) { return ESP_BLUEDROID_STATUS_ENABLED; }
+esp_err_t esp_bluedroid_init(void) { return ESP_OK; }
+esp_err_t esp_bluedroid_enable(void) { return ESP_OK; }
+esp_err_t esp_bluedroid_disable(void) { return ESP_OK; }
+esp_err_t esp_bluedroid_deinit(void) { return ESP_OK; }
+esp_err_t esp_spp_register_callback(esp_spp_cb_t callback) { return ESP_OK; }
+esp_err_t esp_spp_init(esp_spp_mode_t mode) { return ESP_OK; }
+esp_err_t esp_bt_dev_set_device_name(const char *name) { return ESP_OK; }
+esp_err_t esp_bt_gap_set_cod(esp_bt_cod_t cod, esp_bt_cod_mode_t mode) { return ESP_OK; }
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_scan_mode_t mode) { return ESP_OK; }
+esp_err_t esp_spp_start_srv(esp_spp_sec_t sec_mask, esp_spp_role_t role, uint8_t local_scn, const char *name) { return ESP_OK; }
+
+esp_err_t esp_spp_write(uint32_t handle, int len, uint8_t *p_data)
+{
+    pthread_mutex_lock(&stack_lock);
+    stack_sent.insert(stack_sent.end(), p_data, p_data + len);
+    stack_chunks.push_back(len);
+    pthread_mutex_unlock(&stack_lock);
+    xSemaphoreGive(stack_pending);
+    return ESP_OK;
+}
+
+static void spp_event(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
+{
+    esp_spp_cb(event, param);
+}
+
+static void *stack_main(void *)
+{
+    while (stack_run) {
+        if (xSemaphoreTake(stack_pending, 10) != pdPASS) {
+            continue;
+        }
+        if (stack_delay_us) {
+            delayMicroseconds(stack_delay_us);
+        }
+        esp_spp_cb_param_t p = {};
+        spp_event(ESP_SPP_WRITE_EVT, &p);
+    }
+    return NULL;
+}
+
+static void stack_start(BluetoothSerial &bt)
+{
+    stack_sent.clear();
+    stack_chunks.clear();
+    stack_delay_us = 0;
+    stack_pending = xSemaphoreCreateCounting(1000, 0);
+    stack_run = true;
+    pthread_create(&stack_thread, NULL, stack_main, NULL);
+    TEST_ASSERT(bt.begin("host"));
+    esp_spp_cb_param_t p = {};
+    p.open.handle = 0x81;
+    spp_event(ESP_SPP_SRV_OPEN_EVT, &p);
+    bt.resetStats();
+}
+
+static void stack_stop(BluetoothSerial &bt)
+{
+    stack_run = false;
+    pthread_join(stack_thread, NULL);
+    bt.end();
+    vSemaphoreDelete(stack_pending);
+}
+
+static void receive(const uint8_t *data, size_t len)
+{
+    esp_spp_cb_param_t p = {};
+    p.data_ind.handle = 0x81;
+    p.data_ind.len = len;
+    p.data_ind.data = (uint8_t *)data;
+    spp_event(ESP_SPP_DATA_IND_EVT, &p);
+}
+
+static void congestion(bool cong)
+{
+    esp_spp_cb_param_t p = {};
+    p.cong.cong = cong;
+    spp_event(ESP_SPP_CONG_EVT, &p);
+}
+
+static uint8_t pattern(size_t i)
+{
+    return (uint8_t)(i * 131 + (i >> 8));
+}
+
+/* ----------------------------------------------------------------- tests */
+
+struct rx_feed {
+    size_t total;
+    size_t event;
+};
+
+static void *rx_feeder(void *arg)
+{
+    rx_feed *f = (rx_feed *)arg;
+    static uint8_t block[4096];
+    for (size_t off = 0; off < f->total; off += f->event) {
+        size_t n = f->total - off < f->event ? f->total - off : f->event;
+        for (size_t i = 0; i < n; i++) {
+            block[i] = pattern(off + i);
+        }
+        /* the stack hands over data about as fast as the reader drains it */
+        while (_spp_rx_available() + n > SPP_RX_BUFFER_SIZE) {
+            sched_yield();
+        }
+        receive(block, n);
+    }
+    return NULL;
+}
+
+static void test_rx_bulk_in_order()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+
+    rx_feed f = { 256 * 1024, 990 };
+    pthread_t t;
+    pthread_create(&t, NULL, rx_feeder, &f);
+    std::vector<uint8_t> got(f.total);
+    bt.setTimeout(2000);
+    size_t n = bt.readBytes(got.data(), got.size());
+    pthread_join(t, NULL);
+
+    TEST_ASSERT_EQ(n, f.total);
+    size_t bad = 0;
+    for (size_t i = 0; i < n; i++) {
+        bad += got[i] != pattern(i);
+    }
+    TEST_ASSERT_EQ(bad, 0);
+    bt_serial_stats_t s;
+    bt.getStats(&s);
+    TEST_ASSERT_EQ(s.rx_bytes, f.total);
+    TEST_ASSERT_EQ(s.rx_dropped, 0);
+    stack_stop(bt);
+}
+
+static void test_rx_overflow_is_counted()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+
+    static uint8_t block[1000];
+    for (size_t i = 0; i < sizeof(block); i++) {
+        block[i] = pattern(i);
+    }
+    for (int i = 0; i < 10; i++) {
+        receive(block, sizeof(block));
+    }
+    bt_serial_stats_t s;
+    bt.getStats(&s);
+    TEST_ASSERT_EQ(bt.available(), SPP_RX_BUFFER_SIZE);
+    TEST_ASSERT_EQ(s.rx_bytes, SPP_RX_BUFFER_SIZE);
+    TEST_ASSERT_EQ(s.rx_dropped, 10000 - SPP_RX_BUFFER_SIZE);
+
+    /* what was kept is the head of the stream, untouched */
+    TEST_ASSERT_EQ(bt.peek(), pattern(0));
+    TEST_ASSERT_EQ(bt.read(), pattern(0));
+    TEST_ASSERT_EQ(bt.read(), pattern(1));
+    stack_stop(bt);
+}
+
+static void test_tx_coalesces_byte_writes()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+
+    const size_t total = 2000;
+    for (size_t i = 0; i < total; i++) {
+        TEST_ASSERT_EQ(bt.write(pattern(i)), 1);
+    }
+    bt.flush();
+
+    pthread_mutex_lock(&stack_lock);
+    TEST_ASSERT_EQ(stack_sent.size(), total);
+    size_t bad = 0;
+    for (size_t i = 0; i < stack_sent.size(); i++) {
+        bad += stack_sent[i] != pattern(i);
+    }
+    TEST_ASSERT_EQ(bad, 0);
+    size_t biggest = 0;
+    for (size_t c : stack_chunks) {
+        biggest = c > biggest ? c : biggest;
+    }
+    TEST_ASSERT(biggest <= SPP_TX_MAX);
+    /* one esp_spp_write per byte was the old behaviour */
+    TEST_ASSERT(stack_chunks.size() <= total / 50);
+    BENCH("2000 single-byte writes -> %zu esp_spp_write calls", stack_chunks.size());
+    pthread_mutex_unlock(&stack_lock);
+
+    bt_serial_stats_t s;
+    bt.getStats(&s);
+    TEST_ASSERT_EQ(s.tx_bytes, total);
+    TEST_ASSERT_EQ(s.tx_dropped, 0);
+    stack_stop(bt);
+}
+
+static void test_tx_waits_for_write_completion()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+    stack_delay_us = 2000;
+
+    static uint8_t data[SPP_TX_MAX * 4];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = pattern(i);
+    }
+    TEST_ASSERT_EQ(bt.write(data, sizeof(data)), sizeof(data));
+    vTaskDelay(1);
+    /* the first chunk is in flight; the others wait for ESP_SPP_WRITE_EVT */
+    pthread_mutex_lock(&stack_lock);
+    TEST_ASSERT_EQ(stack_chunks.size(), 1);
+    pthread_mutex_unlock(&stack_lock);
+
+    bt.flush();
+    TEST_ASSERT_EQ(stack_chunks.size(), 4);
+    TEST_ASSERT_EQ(stack_sent.size(), sizeof(data));
+    stack_stop(bt);
+}
+
+static void test_tx_holds_while_congested()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+
+    congestion(true);
+    static uint8_t data[1000];
+    TEST_ASSERT_EQ(bt.write(data, sizeof(data)), sizeof(data));
+    vTaskDelay(SPP_TX_COALESCE_MS * 4);
+    TEST_ASSERT_EQ(stack_chunks.size(), 0);
+
+    congestion(false);
+    bt.flush();
+    TEST_ASSERT_EQ(stack_sent.size(), sizeof(data));
+    bt_serial_stats_t s;
+    bt.getStats(&s);
+    TEST_ASSERT_EQ(s.congestion_events, 1);
+    stack_stop(bt);
+}
+
+static void test_tx_overflow_times_out_and_is_counted()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+
+    congestion(true);
+    bt.setTimeout(20);
+    static uint8_t data[SPP_TX_BUFFER_SIZE + 500];
+    TEST_ASSERT_EQ(bt.write(data, sizeof(data)), SPP_TX_BUFFER_SIZE);
+    bt_serial_stats_t s;
+    bt.getStats(&s);
+    TEST_ASSERT_EQ(s.tx_dropped, 500);
+    congestion(false);
+    stack_stop(bt);
+}
+
+static void test_end_while_tx_task_is_blocked()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+
+    /* the TX task parks in xEventGroupWaitBits with data pending */
+    congestion(true);
+    static uint8_t data[100];
+    bt.write(data, sizeof(data));
+    vTaskDelay(SPP_TX_COALESCE_MS * 2);
+
+    uint64_t t0 = hostNowNs();
+    stack_stop(bt);
+    TEST_ASSERT(hostNowNs() - t0 < 100000000ULL);
+    TEST_ASSERT(_spp_tx_task_handle == NULL);
+    TEST_ASSERT(_spp_tx_lock == NULL);
+
+    /* and it can be started again */
+    BluetoothSerial again;
+    stack_start(again);
+    again.write(data, sizeof(data));
+    again.flush();
+    TEST_ASSERT_EQ(stack_sent.size(), sizeof(data));
+    stack_stop(again);
+}
+
+static void test_close_discards_pending_tx()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+
+    congestion(true);
+    static uint8_t data[500];
+    bt.write(data, sizeof(data));
+    esp_spp_cb_param_t p = {};
+    spp_event(ESP_SPP_CLOSE_EVT, &p);
+    TEST_ASSERT(!bt.hasClient());
+    TEST_ASSERT_EQ(_spp_tx_pending(), 0);
+    TEST_ASSERT_EQ(bt.write(data, sizeof(data)), 0);
+    stack_stop(bt);
+}
+
+static void bench_throughput()
+{
+    BluetoothSerial bt;
+    stack_start(bt);
+
+    rx_feed f = { hostIterations(64) * 1024 * 1024, 990 };
+    std::vector<uint8_t> buf(4096);
+    pthread_t t;
+    uint64_t t0 = hostNowNs();
+    pthread_create(&t, NULL, rx_feeder, &f);
+    for (size_t got = 0; got < f.total;) {
+        got += bt.readBytes(buf.data(), buf.size());
+    }
+    pthread_join(t, NULL);
+    double s = (hostNowNs() - t0) / 1e9;
+    BENCH("RX 990-byte events -> readBytes(4096): %.1f MB/s", f.total / s / 1e6);
+
+    size_t total = hostIterations(16) * 1024 * 1024;
+    t0 = hostNowNs();
+    for (size_t off = 0; off < total; off += 512) {
+        bt.write(buf.data(), 512);
+    }
+    bt.flush();
+    s = (hostNowNs() - t0) / 1e9;
+    BENCH("TX write(512) -> esp_spp_write: %.1f MB/s, %zu chunks",
+          total / s / 1e6, stack_chunks.size());
+
+    t0 = hostNowNs();
+    size_t bytes = hostIterations(1) * 256 * 1024;
+    for (size_t i = 0; i < bytes; i++) {
+        bt.write((uint8_t)i);
+    }
+    bt.flush();
+    s = (hostNowNs() - t0) / 1e9;
+    BENCH("TX write(uint8_t): %.2f MB/s", bytes / s / 1e6);
+    stack_stop(bt);
+}
+
+int main()
+{
+    TEST_RUN(test_rx_bulk_in_order);
+    TEST_RUN(test_rx_overflow_is_counted);
+    TEST_RUN(test_tx_coalesces_byte_writes);
+    TEST_RUN(test_tx_waits_for_write_completion);
+    TEST_RUN(test_tx_holds_while_congested);
+    TEST_RUN(test_tx_overflow_times_out_and_is_counted);
+    TEST_RUN(test_end_while_tx_task_is_blocked);
+    TEST_RUN(test_close_discards_pending_tx);
+    TEST_RUN(bench_throughput);
+    return TEST_EXIT();
+}
@@ -0,0 +1,369 @@
+/*
+ * fs::File's read-ahead/write-behind buffer.
+ *
+ * A randomized sequence of reads, peeks, writes, seeks and flushes runs on
+ * a buffered File over an in-memory FileImpl and on a plain byte array;
+ * every result and the final contents have to agree. The in-memory file
+ * also records the calls that reach the implementation, which shows how
+ * small writes are coalesced into aligned blocks. Throughput is measured
+ * through VFSImpl on a temporary directory, i.e. the real stdio path.
+ */
+#include "host.h"
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include "../../libraries/FS/src/FS.cpp"
+#include "../../libraries/FS/src/vfs_api.cpp"
+
+#define MEM_MAX (256 * 1024)
+
+class MemFileImpl : public FileImpl
+{
+public:
+    uint8_t data[MEM_MAX];
+    size_t len = 0;
+    size_t pos = 0;
+    unsigned calls = 0;         /* every call that reaches the implementation */
+    unsigned writes = 0;
+    unsigned misaligned = 0;    /* writeFrom() blocks that do not end on `align` */
+    size_t align = 0;
+
+    size_t write(const uint8_t* buf, size_t size) override
+    {
+        calls++;
+        writes++;
+        if (pos + size > MEM_MAX) {
+            size = MEM_MAX - pos;
+        }
+        if (pos > len) {
+            memset(data + len, 0, pos - len);
+        }
+        memcpy(data + pos, buf, size);
+        pos += size;
+        len = pos > len ? pos : len;
+        return size;
+    }
+    size_t writeFrom(const uint8_t* buf, size_t size) override
+    {
+        if (align && (pos + size) % align && size < align) {
+            misaligned++;
+        }
+        return write(buf, size);
+    }
+    size_t read(uint8_t* buf, size_t size) override
+    {
+        calls++;
+        size_t n = pos < len ? len - pos : 0;
+        n = n < size ? n : size;
+        memcpy(buf, data + pos, n);
+        pos += n;
+        return n;
+    }
+    bool seek(uint32_t off, SeekMode mode) override
+    {
+        calls++;
+        int64_t base = mode == SeekSet ? 0 : mode == SeekCur ? (int64_t)pos : (int64_t)len;
+        int64_t target = base + (mode == SeekSet ? (int64_t)off : (int64_t)(int32_t)off);
+        if (target < 0 || target > MEM_MAX) {
+            return false;
+        }
+        pos = target;
+        return true;
+    }
+    size_t position() const override { return pos; }
+    size_t size() const override { return len; }
+    void flush() override { calls++; }
+    void close() override { }
+    time_t getLastWrite() override { return 0; }
+    const char* name() const override { return "/mem"; }
+    boolean isDirectory(void) override { return false; }
+    FileImplPtr openNextFile(const char* mode) override { return FileImplPtr(); }
+    void rewindDirectory(void) override { }
+    operator bool() override { return true; }
+};
+
+/* the same operations on a byte array */
+static uint8_t ref[MEM_MAX];
+static size_t ref_len, ref_pos;
+
+static uint32_t rng;
+
+static uint32_t rand_below(uint32_t n)
+{
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 8) % n;
+}
+
+static void model_run(size_t bufsize, unsigned ops)
+{
+    std::shared_ptr<MemFileImpl> mem = std::make_shared<MemFileImpl>();
+    File f(mem);
+    TEST_ASSERT(f.setBufferSize(bufsize));
+    ref_len = ref_pos = 0;
+    rng = bufsize;
+    static uint8_t a[4096], b[4096];
+
+    for (unsigned op = 0; op < ops && host_failures < 5; op++) {
+        switch (rand_below(10)) {
+        case 0: {   /* one byte */
+            int c = f.read();
+            int e = ref_pos < ref_len ? ref[ref_pos++] : -1;
+            TEST_ASSERT_EQ(c, e);
+            break;
+        }
+        case 1: {
+            int c = f.peek();
+            int e = ref_pos < ref_len ? ref[ref_pos] : -1;
+            TEST_ASSERT_EQ(c, e);
+            break;
+        }
+        case 2: {   /* a block, sometimes larger than the buffer */
+            size_t n = 1 + rand_below(rand_below(4) ? 64 : sizeof(a));
+            size_t got = f.read(a, n);
+            size_t e = ref_pos < ref_len ? ref_len - ref_pos : 0;
+            e = e < n ? e : n;
+            TEST_ASSERT_EQ(got, e);
+            TEST_ASSERT(!memcmp(a, ref + ref_pos, e));
+            ref_pos += e;
+            break;
+        }
+        case 3:
+        case 4: {
+            size_t n = 1 + rand_below(rand_below(4) ? 64 : sizeof(b));
+            if (ref_pos + n > MEM_MAX / 2) {
+                break;
+            }
+            for (size_t i = 0; i < n; i++) {
+                b[i] = rand_below(256);
+            }
+            size_t put = n == 1 ? f.write(b[0]) : f.write(b, n);
+            TEST_ASSERT_EQ(put, n);
+            if (ref_pos > ref_len) {
+                memset(ref + ref_len, 0, ref_pos - ref_len);
+            }
+            memcpy(ref + ref_pos, b, n);
+            ref_pos += n;
+            ref_len = ref_pos > ref_len ? ref_pos : ref_len;
+            break;
+        }
+        case 5: {
+            int mode = rand_below(3);
+            int32_t off;
+            size_t target;
+            if (mode == SeekSet) {
+                off = rand_below(ref_len + 16);
+                target = off;
+            } else if (mode == SeekCur) {
+                off = (int32_t)rand_below(600) - 300;
+                if ((int64_t)ref_pos + off < 0) {
+                    off = -(int32_t)ref_pos;
+                }
+                target = ref_pos + off;
+            } else {
+                off = -(int32_t)rand_below(ref_len + 1);
+                target = ref_len + off;
+            }
+            TEST_ASSERT(f.seek((uint32_t)off, (SeekMode)mode));
+            ref_pos = target;
+            break;
+        }
+        case 6:
+            TEST_ASSERT_EQ(f.position(), ref_pos);
+            break;
+        case 7:
+            TEST_ASSERT_EQ(f.size(), ref_len);
+            break;
+        case 8:
+            f.flush();
+            TEST_ASSERT_EQ(mem->len, ref_len);
+            break;
+        case 9:
+            /* negative past the end, as without a buffer */
+            TEST_ASSERT_EQ(f.available(), (int)ref_len - (int)ref_pos);
+            break;
+        }
+    }
+    f.close();
+    TEST_ASSERT_EQ(mem->len, ref_len);
+    TEST_ASSERT(!memcmp(mem->data, ref, ref_len));
+}
+
+static void test_random_ops_match_model(void)
+{
+    const size_t sizes[] = { 1, 16, 256, 512 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        model_run(sizes[i], hostIterations(200000));
+    }
+}
+
+static void test_small_writes_flush_aligned(void)
+{
+    std::shared_ptr<MemFileImpl> mem = std::make_shared<MemFileImpl>();
+    File f(mem);
+    f.setBufferSize(256);
+    mem->align = 256;
+    f.write((const uint8_t*)"header", 6);   /* starts unaligned */
+    for (int i = 0; i < 10000; i++) {
+        f.write((uint8_t)i);
+    }
+    TEST_ASSERT_EQ(mem->misaligned, 0);
+    /* 10006 bytes: 39 full blocks reach the file, the tail waits */
+    TEST_ASSERT_EQ(mem->writes, 39);
+    TEST_ASSERT_EQ(f.position(), 10006);
+    TEST_ASSERT_EQ(mem->len, 39 * 256);
+    f.close();
+    TEST_ASSERT_EQ(mem->len, 10006);
+    TEST_ASSERT_EQ(mem->writes, 40);
+}
+
+static void test_last_copy_writes_the_tail(void)
+{
+    std::shared_ptr<MemFileImpl> mem = std::make_shared<MemFileImpl>();
+    {
+        File f(mem);
+        f.setBufferSize(512);
+        File copy = f;
+        copy.write((const uint8_t*)"tail", 4);
+        TEST_ASSERT_EQ(mem->len, 0);
+    }
+    TEST_ASSERT_EQ(mem->len, 4);
+    TEST_ASSERT(!memcmp(mem->data, "tail", 4));
+}
+
+static void test_peek_and_read_stay_in_ram(void)
+{
+    std::shared_ptr<MemFileImpl> mem = std::make_shared<MemFileImpl>();
+    for (int i = 0; i < 4096; i++) {
+        mem->data[i] = i;
+    }
+    mem->len = 4096;
+
+    File plain(mem);
+    mem->calls = 0;
+    while (plain.peek() >= 0) {
+        plain.read();
+    }
+    double plain_calls = mem->calls / 4096.0;
+
+    mem->pos = 0;
+    File buffered(mem);
+    buffered.setBufferSize(256);
+    mem->calls = 0;
+    while (buffered.peek() >= 0) {
+        buffered.read();
+    }
+    double buffered_calls = mem->calls / 4096.0;
+    TEST_ASSERT(buffered_calls < 0.1);
+    BENCH("peek()+read() per byte: %.2f calls into FileImpl unbuffered, %.3f with a 256 byte buffer",
+          plain_calls, buffered_calls);
+}
+
+/* ------------------------------------------------------------ throughput */
+
+static char root[64];
+static FS* disk;
+
+#define BENCH_BYTES (1024 * 1024)
+
+static double mbps(uint64_t ns, size_t bytes)
+{
+    return bytes / (ns / 1e9) / 1e6;
+}
+
+static double time_read(size_t bufsize, int how, size_t bytes)
+{
+    static uint8_t chunk[4096];
+    File f = disk->open("/bench.bin");
+    if (bufsize) {
+        f.setBufferSize(bufsize);
+    }
+    size_t total = 0;
+    uint64_t t0 = hostNowNs();
+    if (how == 0) {
+        while (total < bytes && f.read() >= 0) {
+            total++;
+        }
+    } else if (how == 1) {
+        while (total < bytes && f.peek() >= 0) {
+            f.read();
+            total++;
+        }
+    } else {
+        size_t n;
+        while (total < bytes && (n = f.read(chunk, sizeof(chunk))) > 0) {
+            total += n;
+        }
+    }
+    uint64_t ns = hostNowNs() - t0;
+    TEST_ASSERT_EQ(total, bytes);
+    return mbps(ns, total);
+}
+
+static double time_write(size_t bufsize, bool bulk, size_t bytes)
+{
+    static uint8_t chunk[4096];
+    File f = disk->open("/out.bin", FILE_WRITE);
+    if (bufsize) {
+        f.setBufferSize(bufsize);
+    }
+    uint64_t t0 = hostNowNs();
+    if (bulk) {
+        for (size_t i = 0; i < bytes; i += sizeof(chunk)) {
+            f.write(chunk, sizeof(chunk));
+        }
+    } else {
+        for (size_t i = 0; i < bytes; i++) {
+            f.write((uint8_t)i);
+        }
+    }
+    f.close();
+    uint64_t ns = hostNowNs() - t0;
+    TEST_ASSERT_EQ(disk->open("/out.bin").size(), bytes);
+    return mbps(ns, bytes);
+}
+
+static void bench_throughput(void)
+{
+    /* whole 4 KB blocks, which the bulk loops move */
+    size_t bytes = (hostIterations(20) * BENCH_BYTES / 20 * 4) & ~(size_t)4095;
+    File f = disk->open("/bench.bin", FILE_WRITE);
+    static uint8_t chunk[4096];
+    for (size_t i = 0; i < bytes; i += sizeof(chunk)) {
+        f.write(chunk, sizeof(chunk));
+    }
+    f.close();
+
+    BENCH("read() per byte:        %7.1f MB/s unbuffered, %7.1f MB/s with 512 B buffer",
+          time_read(0, 0, bytes), time_read(512, 0, bytes));
+    BENCH("peek()+read() per byte: %7.1f MB/s unbuffered, %7.1f MB/s with 512 B buffer",
+          time_read(0, 1, bytes), time_read(512, 1, bytes));
+    BENCH("read(buf, 4096):        %7.1f MB/s unbuffered, %7.1f MB/s with 512 B buffer",
+          time_read(0, 2, bytes), time_read(512, 2, bytes));
+    BENCH("write(uint8_t):         %7.1f MB/s unbuffered, %7.1f MB/s with 512 B buffer",
+          time_write(0, false, bytes), time_write(512, false, bytes));
+    BENCH("write(buf, 4096):       %7.1f MB/s unbuffered, %7.1f MB/s with 512 B buffer",
+          time_write(0, true, bytes), time_write(512, true, bytes));
+}
+
+int main(void)
+{
+    TEST_RUN(test_random_ops_match_model);
+    TEST_RUN(test_small_writes_flush_aligned);
+    TEST_RUN(test_last_copy_writes_the_tail);
+    TEST_RUN(test_peek_and_read_stay_in_ram);
+
+    strcpy(root, "/tmp/file_buffer_XXXXXX");
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    VFSImpl* vfs = new VFSImpl();
+    disk = new FS(FSImplPtr(vfs));
+    vfs->mountpoint(root);
+    TEST_RUN(bench_throughput);
+    disk->remove("/bench.bin");
+    disk->remove("/out.bin");
+    rmdir(root);
+    return TEST_EXIT();
+}
@@ -0,0 +1,282 @@
+/*
+ * GPIO bus and shiftIn/shiftOut against a register fake.
+ *
+ * Stores into the GPIO block are traced: W1TS/W1TC writes are applied to a
+ * simulated output latch and counted, so the tests check both the pin
+ * levels and how many register stores each operation costs.
+ */
+#include "host.h"
+#include "../../cores/esp32/esp32-hal-gpio.c"
+#include "../../cores/esp32/wiring_shift.c"
+
+static volatile uint32_t latch[2];
+static volatile unsigned stores;
+
+/* optional shift register model, clocked on the rising edge */
+static int sr_clock = -1, sr_data = -1;
+static volatile uint8_t sr_out, sr_in;
+static volatile int sr_bits;
+
+static uint32_t pin_level(int pin)
+{
+    return (latch[pin >> 5] >> (pin & 31)) & 1;
+}
+
+static void gpio_store(uintptr_t addr, uint32_t value, void *arg)
+{
+    int rising = sr_clock >= 0 && !pin_level(sr_clock);
+    stores++;
+    switch (addr - (uintptr_t)&GPIO) {
+    case offsetof(gpio_dev_t, out_w1ts):  latch[0] |= value; break;
+    case offsetof(gpio_dev_t, out_w1tc):  latch[0] &= ~value; break;
+    case offsetof(gpio_dev_t, out1_w1ts): latch[1] |= value; break;
+    case offsetof(gpio_dev_t, out1_w1tc): latch[1] &= ~value; break;
+    default: return;
+    }
+    if (rising && pin_level(sr_clock)) {
+        /* sample what the MCU drives, then present the next bit */
+        sr_out = (sr_out << 1) | pin_level(sr_data);
+        sr_bits++;
+        uint32_t bit = (sr_in >> 7) & 1;
+        sr_in <<= 1;
+        volatile uint32_t *in = sr_data < 32 ? &GPIO.in : &GPIO.in1.val;
+        *in = (*in & ~(1u << (sr_data & 31))) | (bit << (sr_data & 31));
+    }
+}
+
+static void trace_begin(void)
+{
+    stores = 0;
+    hostPeriphTrace((uintptr_t)&GPIO, (uintptr_t)&GPIO + sizeof(GPIO), gpio_store, NULL);
+}
+
+static unsigned trace_end(void)
+{
+    hostPeriphUntrace();
+    return stores;
+}
+
+static uint32_t lcg(void)
+{
+    static uint32_t x = 12345;
+    x = x * 1103515245 + 12345;
+    return x;
+}
+
+/* a realistic scatter: two ascending runs, a stray pin and two high pins */
+static const uint8_t scattered[] = { 12, 13, 14, 15, 25, 26, 27, 4, 32, 33 };
+static const uint8_t byte_pins[] = { 16, 17, 18, 19, 21, 22, 23, 5 };
+
+static void expect_bus(const uint8_t *pins, int count, uint32_t value)
+{
+    for (int i = 0; i < count; i++) {
+        TEST_ASSERT_EQ(pin_level(pins[i]), (value >> i) & 1); 
+    }
+}
+
+static void test_init_rejects_bad_pins(void)
+{
+    gpio_bus_t bus;
+    uint8_t dup[] = { 4, 5, 4 };
+    uint8_t bad[] = { 4, 24 };
+    TEST_ASSERT(!gpioBusInit(&bus, dup, 3));
+    TEST_ASSERT(!gpioBusInit(&bus, bad, 2));
+    TEST_ASSERT(!gpioBusInit(&bus, dup, 0));
+    TEST_ASSERT(gpioBusInit(&bus, scattered, sizeof(scattered)));
+    TEST_ASSERT_EQ(bus.run_count, 4);
+    TEST_ASSERT_EQ(bus.mask[0], 0x0e00f010);
+    TEST_ASSERT_EQ(bus.mask[1], 0x3);
+}
+
+static void check_write(bool lut)
+{
+    gpio_bus_t bus;
+    gpioBusInit(&bus, scattered, sizeof(scattered));
+    if (lut) {
+        TEST_ASSERT(gpioBusEnableLUT(&bus));
+    }
+    latch[0] = 0x00000101;  /* pins outside the bus must not move */
+    latch[1] = 0;
+    trace_begin();
+    for (int i = 0; i < 1000; i++) {
+        uint32_t v = lcg() & 0x3ff;
+        unsigned before = stores;
+        gpioBusWrite(&bus, v);
+        TEST_ASSERT_EQ(stores - before, 4);   /* set + clear, two banks */
+        expect_bus(scattered, sizeof(scattered), v);
+        TEST_ASSERT_EQ(latch[0] & ~bus.mask[0], 0x00000101);
+    }
+
+    /* masked writes leave the other bus pins alone */
+    gpioBusWrite(&bus, 0x3ff);
+    unsigned before = stores;
+    gpioBusWriteMasked(&bus, 0x000, 0x00f);
+    TEST_ASSERT_EQ(stores - before, 2);       /* bank 0 only */
+    expect_bus(scattered, sizeof(scattered), 0x3f0);
+    gpioBusClear(&bus, 0x300);
+    expect_bus(scattered, sizeof(scattered), 0x0f0);
+    gpioBusSet(&bus, 0x001);
+    expect_bus(scattered, sizeof(scattered), 0x0f1);
+    trace_end();
+    gpioBusEnd(&bus);
+}
+
+static void test_write_gather(void) { check_write(false); }
+static void test_write_lut(void) { check_write(true); }
+
+static void test_read_gathers_bits(void)
+{
+    gpio_bus_t bus;
+    gpioBusInit(&bus, scattered, sizeof(scattered));
+    for (int i = 0; i < 1000; i++) {
+        GPIO.in = lcg();
+        GPIO.in1.val = lcg() & 0xff;
+        uint32_t want = 0;
+        for (int b = 0; b < (int)sizeof(scattered); b++) {
+            int pin = scattered[b];
+            uint32_t reg = pin < 32 ? GPIO.in : GPIO.in1.val;
+            want |= ((reg >> (pin & 31)) & 1) << b;
+        }
+        TEST_ASSERT_EQ(gpioBusRead(&bus), want);
+    }
+}
+
+static void test_shift_out(void)
+{
+    for (int order = 0; order < 2; order++) {
+        sr_clock = 18;
+        sr_data = 33;
+        sr_out = 0;
+        sr_bits = 0;
+        latch[0] = latch[1] = 0;
+        trace_begin();
+        shiftOut(sr_data, sr_clock, order ? MSBFIRST : LSBFIRST, 0xa7);
+        unsigned n = trace_end();
+        TEST_ASSERT_EQ(sr_bits, 8);
+        TEST_ASSERT_EQ(sr_out, order ? 0xa7 : 0xe5);
+        /* data, clock high, clock low: three stores a bit */
+        TEST_ASSERT_EQ(n, 24);
+    }
+    sr_clock = -1;
+}
+
+/* clock edges of one shiftOut(), in ns */
+static volatile uint64_t edge_ns[16];
+static volatile int edges;
+
+static void edge_store(uintptr_t addr, uint32_t value, void *arg)
+{
+    if (addr == (uintptr_t)&GPIO.out_w1ts || addr == (uintptr_t)&GPIO.out_w1tc) {
+        if ((value & (1u << 18)) && edges < 16) {
+            edge_ns[edges++] = hostNowNs();
+        }
+    }
+}
+
+static void test_shift_pulse_width(void)
+{
+    /* the cycle counter follows the microsecond clock, allow 1 us of slack */
+    shiftSetPulseWidth(20000);
+    edges = 0;
+    hostPeriphTrace((uintptr_t)&GPIO, (uintptr_t)&GPIO + sizeof(GPIO), edge_store, NULL);
+    shiftOut(33, 18, MSBFIRST, 0x5a);
+    hostPeriphUntrace();
+    shiftSetPulseWidth(SHIFT_PULSE_WIDTH_DEFAULT);
+    TEST_ASSERT_EQ(edges, 16);
+    uint64_t shortest = UINT64_MAX;
+    for (int i = 1; i < edges; i++) {
+        uint64_t w = edge_ns[i] - edge_ns[i - 1];
+        shortest = w < shortest ? w : shortest;
+    }
+    TEST_ASSERT(shortest >= 19000);
+    BENCH("shiftOut at 20 us pulse width: shortest clock phase %.1f us", shortest / 1000.0);
+}
+
+static void test_shift_in(void)
+{
+    for (int order = 0; order < 2; order++) {
+        sr_clock = 5;
+        sr_data = 34;           /* input-only pin in bank 1 */
+        sr_in = 0x2d;
+        sr_bits = 0;
+        latch[0] = latch[1] = 0;
+        GPIO.in1.val = 0;
+        trace_begin();
+        uint8_t v = shiftIn(sr_data, sr_clock, order ? MSBFIRST : LSBFIRST);
+        unsigned n = trace_end();
+        TEST_ASSERT_EQ(sr_bits, 8);
+        /* bit i is presented by the i-th rising edge */
+        uint8_t want = 0;
+        for (int i = 0; i < 8; i++) {
+            int bit = (0x2d >> (7 - i)) & 1;
+            want |= order ? bit << (7 - i) : bit << i;
+        }
+        TEST_ASSERT_EQ(v, want);
+        TEST_ASSERT_EQ(n, 16);
+    }
+    sr_clock = -1;
+}
+
+static void bench_stores_per_byte(void)
+{
+    gpio_bus_t bus;
+    gpioBusInit(&bus, byte_pins, sizeof(byte_pins));
+
+    trace_begin();
+    for (int v = 0; v < 256; v++) {
+        for (int i = 0; i < 8; i++) {
+            digitalWrite(byte_pins[i], (v >> i) & 1);
+        }
+    }
+    unsigned per_pin = trace_end();
+    trace_begin();
+    for (int v = 0; v < 256; v++) {
+        gpioBusWrite(&bus, v);
+    }
+    unsigned bus_write = trace_end();
+    TEST_ASSERT_EQ(bus_write, 2 * 256);
+    BENCH("8-bit parallel byte: digitalWrite x8 %.1f stores, gpioBusWrite %.1f stores",
+          per_pin / 256.0, bus_write / 256.0);
+
+    trace_begin();
+    for (int v = 0; v < 256; v++) {
+        shiftOut(16, 17, MSBFIRST, v);
+    }
+    BENCH("shiftOut: %.1f stores/byte", trace_end() / 256.0);
+
+    unsigned n = hostIterations(20000000);
+    uint64_t t0 = hostNowNs();
+    for (unsigned i = 0; i < n; i++) {
+        for (int b = 0; b < 8; b++) {
+            digitalWrite(byte_pins[b], (i >> b) & 1);
+        }
+    }
+    double ns_pin = (double)(hostNowNs() - t0) / n;
+    t0 = hostNowNs();
+    for (unsigned i = 0; i < n; i++) {
+        gpioBusWrite(&bus, i);
+    }
+    double ns_bus = (double)(hostNowNs() - t0) / n;
+    gpioBusEnableLUT(&bus);
+    t0 = hostNowNs();
+    for (unsigned i = 0; i < n; i++) {
+        gpioBusWrite(&bus, i);
+    }
+    double ns_lut = (double)(hostNowNs() - t0) / n;
+    BENCH("host ns/byte: digitalWrite x8 %.1f, gpioBusWrite %.1f, with LUT %.1f",
+          ns_pin, ns_bus, ns_lut);
+    gpioBusEnd(&bus);
+}
+
+int main(void)
+{
+    TEST_RUN(test_init_rejects_bad_pins);
+    TEST_RUN(test_write_gather);
+    TEST_RUN(test_write_lut);
+    TEST_RUN(test_read_gathers_bits);
+    TEST_RUN(test_shift_out);
+    TEST_RUN(test_shift_in);
+    TEST_RUN(test_shift_pulse_width);
+    TEST_RUN(bench_stores_per_byte);
+    return TEST_EXIT();
+}
@@ -0,0 +1,550 @@
+/*
+ * HTTPBodyDecoder on recorded responses, and HTTPClient's readBody() and
+ * writeToStream() on top of it against the chunk-header-per-String loop
+ * they replaced.
+ *
+ * The recordings are chunked bodies as servers sent them: nginx, an
+ * embedded server answering with bare LFs, and one with extensions,
+ * upper-case and zero-padded sizes and trailers. They are fed to the
+ * decoder split at every offset and in random pieces. For the client the
+ * responses come from a server thread over loopback, either in one burst
+ * or paced to 2 MB/s in 1436 byte segments like a WiFi link. malloc is
+ * interposed to count the allocations the client makes per response.
+ */
+#include "host.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <WiFi.h>
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/HTTPClient/src/HTTPClient.cpp"
+#include "../../libraries/HTTPClient/src/HTTPConnectionPool.cpp"
+#include "../../libraries/HTTPClient/src/HTTPBodyDecoder.cpp"
+
+/* ---------------------------------------------------------- allocations */
+
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+
+static __thread bool counting;
+static unsigned allocs;
+
+extern "C" void* malloc(size_t n)
+{
+    if (counting)
+        allocs++;
+    return __libc_malloc(n);
+}
+
+extern "C" void* calloc(size_t n, size_t size)
+{
+    if (counting)
+        allocs++;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* p, size_t n)
+{
+    if (counting)
+        allocs++;
+    return __libc_realloc(p, n);
+}
+
+/* ----------------------------------------------------------- recordings */
+
+struct Recording {
+    const char* name;
+    const char* raw;
+    const char* payload;
+};
+
+static const Recording recordings[] = {
+    { "nginx",
+      "7b\r\n{\"id\":4711,\"name\":\"sensor-3\",\"values\":[21.5,21.7,21.6],\"unit\":\"C\","
+      "\"updated\":\"2019-03-02T10:14:07Z\",\"battery\":87,\"rssi\":-67}\r\n"
+      "2\r\n\r\n\r\n"
+      "0\r\n\r\n",
+      "{\"id\":4711,\"name\":\"sensor-3\",\"values\":[21.5,21.7,21.6],\"unit\":\"C\","
+      "\"updated\":\"2019-03-02T10:14:07Z\",\"battery\":87,\"rssi\":-67}\r\n" },
+    { "bare LF",
+      "5\nhello\n1\n \n5\nworld\n0\n\n",
+      "hello world" },
+    { "extensions and trailers",
+      "000A;name=\"first\"\r\n0123456789\r\n"
+      "1a ; last\r\nabcdefghijklmnopqrstuvwxyz\r\n"
+      "0;done\r\n"
+      "Expires: Sat, 02 Mar 2019 10:14:07 GMT\r\n"
+      "X-Checksum: 9c1185a5c5e9fc54612808977ee8f548b2258d31\r\n"
+      "\r\n",
+      "0123456789abcdefghijklmnopqrstuvwxyz" },
+    { "empty",
+      "0\r\n\r\n",
+      "" },
+};
+
+#define RECORDINGS  (sizeof(recordings) / sizeof(recordings[0]))
+
+/* raw chunked encoding of body, in chunks of the given sizes, repeating */
+static std::string chunked(const std::string& body, const std::vector<size_t>& sizes)
+{
+    std::string raw;
+    size_t at = 0;
+    for (size_t i = 0; at < body.size(); i++) {
+        size_t n = sizes[i % sizes.size()];
+        n = n < body.size() - at ? n : body.size() - at;
+        char head[16];
+        snprintf(head, sizeof(head), "%zx\r\n", n);
+        raw += head;
+        raw.append(body, at, n);
+        raw += "\r\n";
+        at += n;
+    }
+    return raw + "0\r\n\r\n";
+}
+
+static std::string text(size_t n)
+{
+    std::string s(n, 0);
+    uint32_t x = 1;
+    for (size_t i = 0; i < n; i++) {
+        x = x * 1103515245 + 12345;
+        s[i] = ' ' + (x >> 16) % 95;
+    }
+    return s;
+}
+
+/* decodes raw in the pieces given by cuts, true if all went as expected */
+static bool decode_pieces(const std::string& raw, const std::string& payload, const std::vector<size_t>& cuts)
+{
+    HTTPBodyDecoder d;
+    d.begin(true, -1);
+    std::string out;
+    std::vector<uint8_t> buf;
+    size_t at = 0;
+    for (size_t i = 0; i <= cuts.size(); i++) {
+        size_t end = i < cuts.size() ? cuts[i] : raw.size();
+        buf.assign(raw.begin() + at, raw.begin() + end);
+        size_t n = 0;
+        size_t used = d.decode(buf.data(), buf.size(), &n);
+        if (used != buf.size())
+            return false;
+        out.append((const char*)buf.data(), n);
+        at = end;
+    }
+    return d.done() && out == payload && d.total() == payload.size();
+}
+
+/* -------------------------------------------------------------- server */
+
+static int listener;
+static uint16_t port;
+static std::string response;        /* headers and raw body */
+static double link_mb_s;            /* 0 sends it in one go */
+
+static void* server_thread(void*)
+{
+    for (;;) {
+        int fd = ::accept(listener, NULL, NULL);
+        if (fd < 0)
+            return NULL;
+        std::string req;
+        char buf[1024];
+        while (req.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                break;
+            req.append(buf, n);
+        }
+        uint64_t t0 = hostNowNs();
+        size_t at = 0;
+        while (at < response.size()) {
+            size_t n = link_mb_s ? 1436 : response.size() - at;
+            n = n < response.size() - at ? n : response.size() - at;
+            if (link_mb_s) {
+                /* when the link has carried what went before */
+                int64_t wait = (int64_t)(t0 + at / link_mb_s * 1000) - (int64_t)hostNowNs();
+                if (wait > 0) {
+                    struct timespec ts = { (time_t)(wait / 1000000000), (long)(wait % 1000000000) };
+                    nanosleep(&ts, NULL);
+                }
+            }
+            ssize_t sent = ::send(fd, response.data() + at, n, MSG_NOSIGNAL);
+            if (sent <= 0)
+                break;
+            at += sent;
+        }
+        /* the client closes, the server keeps it open like a keep-alive one */
+        while (::recv(fd, buf, sizeof(buf), 0) > 0) {
+        }
+        ::close(fd);
+    }
+}
+
+static void serve_chunked(const std::string& raw)
+{
+    response = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+               "Transfer-Encoding: chunked\r\n\r\n" + raw;
+}
+
+static String url(void)
+{
+    return String("http://127.0.0.1:") + String(port) + "/data";
+}
+
+/* a Stream that keeps only a count and a checksum, allocating nothing */
+class SinkStream : public Stream
+{
+public:
+    size_t bytes = 0;
+    uint32_t sum = 0;
+
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t size) override
+    {
+        for (size_t i = 0; i < size; i++)
+            sum = sum * 31 + buf[i];
+        bytes += size;
+        return size;
+    }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override { }
+};
+
+static uint32_t checksum(const std::string& s)
+{
+    SinkStream sink;
+    sink.write((const uint8_t*)s.data(), s.size());
+    return sink.sum;
+}
+
+/*
+ * the chunked branch of writeToStream() before the decoder: a String per
+ * chunk header, a buffer per chunk, delay(1) while nothing is available
+ */
+static int legacyWriteBlock(WiFiClient* tcp, Stream* stream, int size)
+{
+    int buff_size = HTTP_TCP_BUFFER_SIZE;
+    int len = size;
+    int bytesWritten = 0;
+    if ((len > 0) && (len < HTTP_TCP_BUFFER_SIZE)) {
+        buff_size = len;
+    }
+    uint8_t* buff = (uint8_t*)malloc(buff_size);
+    if (!buff) {
+        return HTTPC_ERROR_TOO_LESS_RAM;
+    }
+    while ((tcp->connected() || tcp->available()) && (len > 0 || len == -1)) {
+        size_t sizeAvailable = tcp->available();
+        if (sizeAvailable) {
+            int readBytes = sizeAvailable;
+            if (len > 0 && readBytes > len) {
+                readBytes = len;
+            }
+            if (readBytes > buff_size) {
+                readBytes = buff_size;
+            }
+            int bytesRead = tcp->readBytes(buff, readBytes);
+            bytesWritten += stream->write(buff, bytesRead);
+            if (len > 0) {
+                len -= readBytes;
+            }
+            delay(0);
+        } else {
+            delay(1);
+        }
+    }
+    free(buff);
+    return bytesWritten;
+}
+
+static int legacyWriteToStream(HTTPClient& http, Stream* stream)
+{
+    WiFiClient* tcp = http.getStreamPtr();
+    int ret = 0;
+    while (1) {
+        String chunkHeader = tcp->readStringUntil('\n');
+        if (chunkHeader.length() <= 0) {
+            return HTTPC_ERROR_READ_TIMEOUT;
+        }
+        chunkHeader.trim();
+        int len = (uint32_t)strtol((const char*)chunkHeader.c_str(), NULL, 16);
+        if (len > 0) {
+            int r = legacyWriteBlock(tcp, stream, len);
+            if (r < 0) {
+                return r;
+            }
+            ret += r;
+        } else {
+            String trailer;
+            do {
+                trailer = tcp->readStringUntil('\n');
+                trailer.trim();
+            } while (trailer.length() > 0);
+            break;
+        }
+        char buf[2];
+        if (tcp->readBytes((uint8_t*)buf, 2) != 2 || buf[0] != '\r' || buf[1] != '\n') {
+            return HTTPC_ERROR_READ_TIMEOUT;
+        }
+        delay(0);
+    }
+    http.end();
+    return ret;
+}
+
+/* --------------------------------------------------------------- tests */
+
+static void test_recordings_split_anywhere(void)
+{
+    for (size_t r = 0; r < RECORDINGS; r++) {
+        std::string raw = recordings[r].raw, payload = recordings[r].payload;
+        for (size_t cut = 0; cut <= raw.size(); cut++) {
+            TEST_ASSERT(decode_pieces(raw, payload, std::vector<size_t>(1, cut)));
+        }
+        /* every byte on its own */
+        std::vector<size_t> cuts;
+        for (size_t i = 1; i < raw.size(); i++)
+            cuts.push_back(i);
+        TEST_ASSERT(decode_pieces(raw, payload, cuts));
+    }
+}
+
+static void test_random_pieces(void)
+{
+    std::string body = text(200000);
+    std::vector<size_t> sizes = { 1, 1436, 8192, 17, 4096, 65535 };
+    std::string raw = chunked(body, sizes);
+    srand(39);
+    for (int round = 0; round < 50; round++) {
+        std::vector<size_t> cuts;
+        for (size_t at = rand() % 3000; at < raw.size(); at += 1 + rand() % 3000)
+            cuts.push_back(at);
+        TEST_ASSERT(decode_pieces(raw, body, cuts));
+    }
+}
+
+static void test_malformed(void)
+{
+    const char* bad[] = {
+        "x\r\nhello\r\n0\r\n\r\n",          /* no size */
+        "\r\n",                             /* empty size line */
+        "5\r\nhelloXY0\r\n\r\n",            /* no CRLF after the data */
+        "10000000\r\n",                     /* 8 digits, more than fits */
+        "-5\r\nhello\r\n0\r\n\r\n",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        HTTPBodyDecoder d;
+        d.begin(true, -1);
+        std::string raw = bad[i];
+        size_t n;
+        d.decode((uint8_t*)&raw[0], raw.size(), &n);
+        TEST_ASSERT(d.failed());
+        TEST_ASSERT_EQ(d.want(100), 0);
+    }
+    /* cut short by the server */
+    HTTPBodyDecoder d;
+    d.begin(true, -1);
+    std::string raw = "5\r\nhel";
+    size_t n;
+    d.decode((uint8_t*)&raw[0], raw.size(), &n);
+    TEST_ASSERT(!d.failed() && !d.done());
+    d.eof();
+    TEST_ASSERT(d.failed());
+}
+
+static void test_identity(void)
+{
+    HTTPBodyDecoder d;
+    std::string raw = "hello worldHTTP/1.1 200 OK\r\n";
+    size_t n;
+    d.begin(false, 11);
+    TEST_ASSERT_EQ(d.want(1460), 11);
+    /* stops at the length, the next response is left alone */
+    TEST_ASSERT_EQ(d.decode((uint8_t*)&raw[0], raw.size(), &n), 11);
+    TEST_ASSERT_EQ(n, 11);
+    TEST_ASSERT(d.done());
+    TEST_ASSERT_EQ(d.want(1460), 0);
+
+    /* no length: up to the end of the connection */
+    d.begin(false, -1);
+    TEST_ASSERT(d.untilClose());
+    TEST_ASSERT_EQ(d.want(1460), 1460);
+    TEST_ASSERT_EQ(d.decode((uint8_t*)&raw[0], raw.size(), &n), raw.size());
+    TEST_ASSERT(!d.done());
+    d.eof();
+    TEST_ASSERT(d.done());
+
+    d.begin(false, 0);
+    TEST_ASSERT(d.done());
+}
+
+static void test_stops_at_the_end_of_a_chunked_body(void)
+{
+    /* a pipelined response behind the body is not consumed */
+    std::string next = "HTTP/1.1 304 Not Modified\r\n\r\n";
+    for (size_t r = 0; r < RECORDINGS; r++) {
+        std::string raw = std::string(recordings[r].raw) + next;
+        HTTPBodyDecoder d;
+        d.begin(true, -1);
+        size_t n;
+        size_t used = d.decode((uint8_t*)&raw[0], raw.size(), &n);
+        TEST_ASSERT(d.done());
+        TEST_ASSERT_EQ(used, strlen(recordings[r].raw));
+        TEST_ASSERT_EQ(n, strlen(recordings[r].payload));
+    }
+    /* want() keeps reads within the chunk and its CRLF */
+    HTTPBodyDecoder d;
+    d.begin(true, -1);
+    std::string raw = "5\r\n";
+    size_t n;
+    d.decode((uint8_t*)&raw[0], raw.size(), &n);
+    TEST_ASSERT_EQ(d.want(1460), 7);
+    TEST_ASSERT_EQ(d.want(4), 4);
+}
+
+static void test_client_pull_and_push(void)
+{
+    std::string body = text(100000);
+    serve_chunked(chunked(body, { 1436, 100, 3000, 1 }));
+    link_mb_s = 0;
+
+    /* pull in small pieces */
+    HTTPClient http;
+    http.begin(url());
+    TEST_ASSERT_EQ(http.GET(), 200);
+    std::string got;
+    uint8_t buf[100];
+    int n;
+    while ((n = http.readBody(buf, sizeof(buf))) > 0) {
+        TEST_ASSERT(n <= (int)sizeof(buf));
+        got.append((const char*)buf, n);
+    }
+    TEST_ASSERT_EQ(n, 0);
+    TEST_ASSERT(got == body);
+    http.end();
+
+    /* push: one buffer for the whole response, none per chunk */
+    SinkStream sink;
+    http.begin(url());
+    TEST_ASSERT_EQ(http.GET(), 200);
+    allocs = 0;
+    counting = true;
+    int written = http.writeToStream(&sink);
+    counting = false;
+    TEST_ASSERT_EQ(written, body.size());
+    TEST_ASSERT_EQ(sink.sum, checksum(body));
+    TEST_ASSERT(allocs <= 1);
+
+    /* and recorded bodies through the client */
+    for (size_t r = 0; r < RECORDINGS; r++) {
+        serve_chunked(recordings[r].raw);
+        http.begin(url());
+        TEST_ASSERT_EQ(http.GET(), 200);
+        TEST_ASSERT(http.getString() == recordings[r].payload);
+        http.end();
+    }
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+static void bench_decode(void)
+{
+    std::string body = text(1 << 20);
+    const size_t sizes[] = { 256, 1436, 16384 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        std::string raw = chunked(body, { sizes[s] });
+        std::vector<uint8_t> buf(raw.size());
+        unsigned rounds = hostIterations(50);
+        uint64_t ns = 0;
+        for (unsigned r = 0; r < rounds; r++) {
+            memcpy(buf.data(), raw.data(), raw.size());
+            uint64_t t0 = hostNowNs();
+            HTTPBodyDecoder d;
+            d.begin(true, -1);
+            /* as it comes off the socket, HTTP_TCP_BUFFER_SIZE at a time */
+            for (size_t at = 0; at < raw.size(); at += HTTP_TCP_BUFFER_SIZE) {
+                size_t n, len = raw.size() - at < HTTP_TCP_BUFFER_SIZE ? raw.size() - at : HTTP_TCP_BUFFER_SIZE;
+                d.decode(buf.data() + at, len, &n);
+            }
+            ns += hostNowNs() - t0;
+            TEST_ASSERT(d.done());
+        }
+        BENCH("decoder, %5zu B chunks:  %7.1f MB/s", sizes[s], (double)body.size() * rounds / (ns / 1e3));
+    }
+}
+
+static void bench_client(void)
+{
+    std::string body = text(hostIterations(20) * 1024 * 1024 / 20);
+    uint32_t sum = checksum(body);
+    const double links[] = { 0, 2.0 };
+    const size_t sizes[] = { 256, 1436 };
+    for (size_t l = 0; l < 2; l++) {
+        link_mb_s = links[l];
+        for (size_t s = 0; s < 2; s++) {
+            std::string raw = chunked(body, { sizes[s] });
+            serve_chunked(raw);
+            size_t chunks = (body.size() + sizes[s] - 1) / sizes[s];
+            for (int legacy = 1; legacy >= 0; legacy--) {
+                HTTPClient http;
+                SinkStream sink;
+                http.begin(url());
+                uint64_t t0 = hostNowNs();
+                TEST_ASSERT_EQ(http.GET(), 200);
+                allocs = 0;
+                counting = true;
+                int written = legacy ? legacyWriteToStream(http, &sink) : http.writeToStream(&sink);
+                counting = false;
+                double secs = (hostNowNs() - t0) / 1e9;
+                TEST_ASSERT_EQ(written, body.size());
+                TEST_ASSERT_EQ(sink.sum, sum);
+                BENCH("%-8s %5zu B chunks, %-21s %6.2f MB/s  %5.2f allocations/chunk",
+                      links[l] ? "2 MB/s" : "loopback", sizes[s],
+                      legacy ? "before (String/chunk)" : "writeToStream()",
+                      body.size() / secs / 1e6, (double)allocs / chunks);
+            }
+        }
+    }
+    link_mb_s = 0;
+}
+
+int main(void)
+{
+    /* lwIP reports a closed peer with an error, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listener, (struct sockaddr*)&addr, len) || listen(listener, 4) ||
+        getsockname(listener, (struct sockaddr*)&addr, &len)) {
+        perror("listen");
+        return 1;
+    }
+    port = ntohs(addr.sin_port);
+    pthread_t server;
+    pthread_create(&server, NULL, server_thread, NULL);
+
+    TEST_RUN(test_recordings_split_anywhere);
+    TEST_RUN(test_random_pieces);
+    TEST_RUN(test_malformed);
+    TEST_RUN(test_identity);
+    TEST_RUN(test_stops_at_the_end_of_a_chunked_body);
+    TEST_RUN(test_client_pull_and_push);
+    TEST_RUN(bench_decode);
+    TEST_RUN(bench_client);
+
+    shutdown(listener, SHUT_RDWR);
+    ::close(listener);
+    pthread_join(server, NULL);
+    return TEST_EXIT();
+}
@@ -0,0 +1,423 @@
+/*
+ * HTTPDownload's parallel Range requests against one HTTPClient connection.
+ *
+ * The server answers every connection in its own thread, keep-alive, with
+ * 206 for a Range request unless ranges are turned off. It can cut a
+ * response short, half way or at a given byte, to make a range fail. For the benchmark it is
+ * paced like lwIP over WiFi: each response waits one round trip, each
+ * connection moves at most one 5744 byte window per 20 ms round trip, and
+ * all of them share a 2 MB/s link. The download tasks are the host
+ * FreeRTOS tasks, which are threads.
+ */
+#include "host.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <WiFi.h>
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/HTTPClient/src/HTTPClient.cpp"
+#include "../../libraries/HTTPClient/src/HTTPConnectionPool.cpp"
+#include "../../libraries/HTTPClient/src/HTTPBodyDecoder.cpp"
+#include "../../libraries/HTTPClient/src/HTTPDownload.cpp"
+
+/* -------------------------------------------------------------- server */
+
+#define SEGMENT     1436        /* TCP segment over WiFi */
+#define WINDOW      5744        /* CONFIG_TCP_WND_DEFAULT */
+#define RTT_US      20000
+
+static std::string resource;
+static int listener;
+static uint16_t port;
+
+static volatile bool ranges = true;
+static volatile bool paced;
+static volatile uint32_t fail_at = UINT32_MAX;     /* ranges holding this byte are cut short */
+static volatile uint32_t cut_every;                /* and every n-th range request, 0 never */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned accepted, range_requests, cut;
+static size_t body_bytes;                           /* sent in all responses */
+static std::vector<std::pair<uint32_t, uint32_t> > requested;
+static uint64_t link_free;                          /* ns, when the shared link is idle again */
+
+static const double LINK_MB_S = 2.0;
+
+static void sleep_until(uint64_t ns)
+{
+    int64_t wait = (int64_t)ns - (int64_t)hostNowNs();
+    if (wait > 0) {
+        struct timespec ts = { (time_t)(wait / 1000000000), (long)(wait % 1000000000) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* sends like a connection that gets one window per round trip */
+static bool send_paced(int fd, const char* p, size_t n, uint64_t* conn_next)
+{
+    size_t at = 0;
+    while (at < n) {
+        size_t len = n - at < SEGMENT ? n - at : SEGMENT;
+        if (paced) {
+            pthread_mutex_lock(&lock);
+            uint64_t start = hostNowNs();
+            start = start > *conn_next ? start : *conn_next;
+            start = start > link_free ? start : link_free;
+            link_free = start + (uint64_t)(len * 1000 / LINK_MB_S);
+            pthread_mutex_unlock(&lock);
+            *conn_next = start + (uint64_t)len * RTT_US * 1000 / WINDOW;
+            sleep_until(start);
+        }
+        ssize_t sent = ::send(fd, p + at, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        at += sent;
+    }
+    return true;
+}
+
+static void* connection_thread(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    std::string in;
+    char buf[1024];
+    uint64_t conn_next = 0;
+    for (;;) {
+        size_t end;
+        while ((end = in.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                ::close(fd);
+                return NULL;
+            }
+            in.append(buf, n);
+        }
+        std::string req = in.substr(0, end + 4);
+        in.erase(0, end + 4);
+
+        uint32_t first = 0, last = resource.size() - 1;
+        size_t at = req.find("\r\nRange: bytes=");
+        bool range = ranges && at != std::string::npos;
+        bool cut_short = false;
+        if (range) {
+            sscanf(req.c_str() + at + 15, "%u-%u", &first, &last);
+            pthread_mutex_lock(&lock);
+            range_requests++;
+            requested.push_back(std::make_pair(first, last));
+            cut_short = (first <= fail_at && fail_at <= last) ||
+                        (cut_every && range_requests % cut_every == 0);
+            cut += cut_short;
+            pthread_mutex_unlock(&lock);
+        }
+        if (paced) {
+            usleep(RTT_US);
+        }
+        size_t len = last - first + 1;
+        char head[256];
+        if (range) {
+            snprintf(head, sizeof(head), "HTTP/1.1 206 Partial Content\r\nContent-Length: %zu\r\n"
+                     "Content-Range: bytes %u-%u/%zu\r\n\r\n", len, first, last, resource.size());
+        } else {
+            snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", len);
+        }
+        /* up to the failing byte, or half way */
+        size_t send_len = !cut_short ? len : (first <= fail_at && fail_at <= last) ? fail_at - first : len / 2;
+        bool ok = send_paced(fd, head, strlen(head), &conn_next) &&
+                  send_paced(fd, resource.data() + first, send_len, &conn_next);
+        pthread_mutex_lock(&lock);
+        body_bytes += send_len;
+        pthread_mutex_unlock(&lock);
+        if (!ok || cut_short) {
+            ::close(fd);
+            return NULL;
+        }
+    }
+}
+
+static void* server_thread(void*)
+{
+    for (;;) {
+        int fd = ::accept(listener, NULL, NULL);
+        if (fd < 0)
+            return NULL;
+        pthread_mutex_lock(&lock);
+        accepted++;
+        pthread_mutex_unlock(&lock);
+        /* the pacing decides when segments leave, not Nagle */
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t t;
+        pthread_create(&t, NULL, connection_thread, (void*)(intptr_t)fd);
+        pthread_detach(t);
+    }
+}
+
+static void reset_server(void)
+{
+    pthread_mutex_lock(&lock);
+    accepted = range_requests = cut = 0;
+    body_bytes = 0;
+    requested.clear();
+    pthread_mutex_unlock(&lock);
+    ranges = true;
+    paced = false;
+    fail_at = UINT32_MAX;
+    cut_every = 0;
+}
+
+static String url(void)
+{
+    return String("http://127.0.0.1:") + String(port) + "/firmware.bin";
+}
+
+/* ----------------------------------------------------------------- sink */
+
+struct Sink {
+    std::string data;
+    unsigned writes;
+    unsigned delay_us;          /* a slow flash write */
+    volatile uint32_t written;
+};
+
+static HTTPDownloadSinkCb into(Sink& s)
+{
+    return [&s](const uint8_t* data, size_t len) {
+        s.data.append((const char*)data, len);
+        s.writes++;
+        if (s.delay_us)
+            usleep(s.delay_us);
+        s.written = s.data.size();
+        return true;
+    };
+}
+
+/* --------------------------------------------------------------- tests */
+
+static void test_in_order_and_complete(void)
+{
+    reset_server();
+    Sink s = {};
+    int started = 0, total = 0;
+    HTTPDownload dl(3, 8192);
+    dl.onStart([&](int t) {
+        started++;
+        total = t;
+        return s.data.empty();
+    });
+    TEST_ASSERT_EQ(dl.download(url(), into(s)), resource.size());
+    TEST_ASSERT(s.data == resource);
+    TEST_ASSERT_EQ(started, 1);
+    TEST_ASSERT_EQ(total, resource.size());
+    TEST_ASSERT_EQ(dl.size(), resource.size());
+    unsigned segments = (resource.size() + 8191) / 8192;
+    TEST_ASSERT_EQ(s.writes, segments);
+    /* the probe, then one connection per worker for every segment */
+    TEST_ASSERT_EQ(accepted, 4);
+    TEST_ASSERT_EQ(range_requests, 1 + segments);
+    TEST_ASSERT_EQ(body_bytes, resource.size() + 1);
+
+    /* into a Stream, and a resource smaller than one segment */
+    StreamString out;
+    HTTPDownload one(8, resource.size() * 2);
+    TEST_ASSERT_EQ(one.download(url(), out), resource.size());
+    TEST_ASSERT(out.length() == resource.size() && !memcmp(out.c_str(), resource.data(), resource.size()));
+}
+
+static void test_without_range_support(void)
+{
+    reset_server();
+    ranges = false;
+    Sink s = {};
+    HTTPDownload dl(4, 8192);
+    TEST_ASSERT_EQ(dl.download(url(), into(s)), resource.size());
+    TEST_ASSERT(s.data == resource);
+    TEST_ASSERT_EQ(dl.size(), resource.size());
+    TEST_ASSERT_EQ(accepted, 1);
+}
+
+static void test_only_missing_bytes_are_retried(void)
+{
+    reset_server();
+    cut_every = 5;
+    Sink s = {};
+    HTTPDownload dl(3, 8192);
+    TEST_ASSERT_EQ(dl.download(url(), into(s)), resource.size());
+    TEST_ASSERT(s.data == resource);
+    TEST_ASSERT(cut > 0);
+    /* nothing was sent twice */
+    TEST_ASSERT_EQ(body_bytes, resource.size() + 1);
+    /* every cut range was picked up where it broke off */
+    unsigned resumed = 0;
+    for (size_t i = 1; i < requested.size(); i++) {
+        if (requested[i].first % 8192)
+            resumed++;
+    }
+    TEST_ASSERT_EQ(resumed, cut);
+}
+
+static void test_retries_run_out(void)
+{
+    reset_server();
+    fail_at = resource.size() / 2 + 1000;
+    Sink s = {};
+    HTTPDownload dl(3, 8192);
+    dl.setRetries(2);
+    TEST_ASSERT_EQ(dl.download(url(), into(s)), HTTPC_ERROR_CONNECTION_LOST);
+    /* the first attempt and two retries of that range */
+    unsigned attempts = 0;
+    for (size_t i = 0; i < requested.size(); i++) {
+        if (requested[i].first <= fail_at && fail_at <= requested[i].second)
+            attempts++;
+    }
+    TEST_ASSERT_EQ(attempts, 3);
+    /* what was written is the resource up to the failed segment */
+    TEST_ASSERT(s.data.size() <= fail_at);
+    TEST_ASSERT(s.data == resource.substr(0, s.data.size()));
+}
+
+static void test_slow_sink_holds_workers_back(void)
+{
+    reset_server();
+    Sink s = {};
+    s.delay_us = 2000;
+    HTTPDownload dl(3, 4096);
+    /* a worker asks for the next range before reading it, watch how far ahead */
+    pthread_t watcher;
+    static volatile bool watching;
+    static uint32_t lead;
+    watching = true;
+    lead = 0;
+    pthread_create(&watcher, NULL, [](void* arg) -> void* {
+        Sink& s = *(Sink*)arg;
+        while (watching) {
+            pthread_mutex_lock(&lock);
+            for (size_t i = 1; i < requested.size(); i++) {
+                uint32_t segment = requested[i].first / 4096, writing = s.written / 4096;
+                if (segment > writing && segment - writing > lead)
+                    lead = segment - writing;
+            }
+            pthread_mutex_unlock(&lock);
+            usleep(200);
+        }
+        return NULL;
+    }, &s);
+    TEST_ASSERT_EQ(dl.download(url(), into(s)), resource.size());
+    watching = false;
+    pthread_join(watcher, NULL);
+    TEST_ASSERT(s.data == resource);
+    /* two buffers per connection, one of them the segment being written */
+    TEST_ASSERT(lead < 2 * 3);
+    TEST_ASSERT(lead >= 3);
+}
+
+static void test_sink_aborts(void)
+{
+    reset_server();
+    HTTPDownload dl(3, 8192);
+    unsigned writes = 0;
+    TEST_ASSERT_EQ(dl.download(url(), [&](const uint8_t*, size_t) { return ++writes < 3; }),
+                   HTTPC_ERROR_STREAM_WRITE);
+    TEST_ASSERT_EQ(writes, 3);
+    /* the workers stop with at most their buffers filled */
+    TEST_ASSERT(range_requests <= 1 + 3 + 2 * 3);
+
+    reset_server();
+    HTTPDownload refused(3, 8192);
+    refused.onStart([](int) { return false; });
+    TEST_ASSERT_EQ(refused.download(url(), [](const uint8_t*, size_t) { return true; }),
+                   HTTPC_ERROR_STREAM_WRITE);
+    TEST_ASSERT_EQ(range_requests, 1);
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+class CountingStream : public Stream
+{
+public:
+    size_t bytes = 0;
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* buf, size_t size) override { bytes += size; return size; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    void flush() override { }
+};
+
+static void bench_throughput(void)
+{
+    for (int p = 0; p < 2; p++) {
+        reset_server();
+        paced = p;
+        const char* link = p ? "WiFi model" : "loopback  ";
+        double single;
+        {
+            HTTPClient http;
+            CountingStream sink;
+            uint64_t t0 = hostNowNs();
+            http.begin(url());
+            TEST_ASSERT_EQ(http.GET(), 200);
+            TEST_ASSERT_EQ(http.writeToStream(&sink), resource.size());
+            single = resource.size() / ((hostNowNs() - t0) / 1e3);
+            http.end();
+            BENCH("%s one connection, writeToStream()       %6.2f MB/s", link, single);
+        }
+        /* more connections, then larger segments on the default three */
+        const struct { uint8_t conns; size_t segment; } runs[] = {
+            { 1, 8192 }, { 2, 8192 }, { 3, 8192 }, { 4, 8192 }, { 8, 8192 }, { 3, 16384 }, { 3, 32768 },
+        };
+        for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+            reset_server();
+            paced = p;
+            HTTPDownload dl(runs[r].conns, runs[r].segment);
+            size_t got = 0;
+            uint64_t t0 = hostNowNs();
+            int ret = dl.download(url(), [&](const uint8_t*, size_t len) { got += len; return true; });
+            double mb_s = resource.size() / ((hostNowNs() - t0) / 1e3);
+            TEST_ASSERT_EQ(ret, resource.size());
+            BENCH("%s HTTPDownload, %u connection%s, %2zu KB  %6.2f MB/s  %.1fx",
+                  link, runs[r].conns, runs[r].conns > 1 ? "s" : " ", runs[r].segment / 1024, mb_s, mb_s / single);
+        }
+    }
+    paced = false;
+}
+
+int main(void)
+{
+    /* lwIP reports a closed peer with an error, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+    resource.resize(hostIterations(20) * 1024 * 1024 / 20);
+    for (size_t i = 0; i < resource.size(); i++)
+        resource[i] = (char)(i * 7 + (i >> 8));
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listener, (struct sockaddr*)&addr, len) || listen(listener, 16) ||
+        getsockname(listener, (struct sockaddr*)&addr, &len)) {
+        perror("listen");
+        return 1;
+    }
+    port = ntohs(addr.sin_port);
+    pthread_t server;
+    pthread_create(&server, NULL, server_thread, NULL);
+
+    TEST_RUN(test_in_order_and_complete);
+    TEST_RUN(test_without_range_support);
+    TEST_RUN(test_only_missing_bytes_are_retried);
+    TEST_RUN(test_retries_run_out);
+    TEST_RUN(test_slow_sink_holds_workers_back);
+    TEST_RUN(test_sink_aborts);
+    TEST_RUN(bench_throughput);
+
+    shutdown(listener, SHUT_RDWR);
+    ::close(listener);
+    pthread_join(server, NULL);
+    return TEST_EXIT();
+}
@@ -0,0 +1,445 @@
+/*
+ * HTTPConnectionPool: fresh HTTPClient instances sharing keep-alive
+ * connections to a local HTTP/1.1 server.
+ *
+ * The server is a thread with a poll() loop serving any number of
+ * listening ports ("origins") over loopback, keep-alive unless the path
+ * asks otherwise. It counts the connections it accepts and the requests
+ * each one carried, and can hold back the first response on a connection
+ * to stand in for the DNS lookup, TCP and TLS handshakes a new connection
+ * costs over WiFi. WiFiClientSecure is the host stand-in that connects in
+ * the clear, so https origins differ from http ones only in their pool key.
+ */
+#include "host.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <WiFi.h>
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/HTTPClient/src/HTTPClient.cpp"
+#include "../../libraries/HTTPClient/src/HTTPConnectionPool.cpp"
+#include "../../libraries/HTTPClient/src/HTTPBodyDecoder.cpp"
+
+/* -------------------------------------------------------------- server */
+
+#define ORIGINS     3
+#define BIG_BODY    65536
+
+struct Origin {
+    int fd;
+    uint16_t port;
+    volatile unsigned accepts;
+    volatile unsigned requests;
+};
+
+struct Conn {
+    int fd;
+    int origin;
+    unsigned served;
+    std::string in;
+};
+
+static Origin origins[ORIGINS];
+static volatile unsigned setup_us;      /* before the first response on a connection */
+static volatile bool stopping;
+static volatile bool closing_idle;     /* the keep-alive timeout of a server */
+static std::string last_request;
+static pthread_mutex_t last_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void send_all(int fd, const std::string& s)
+{
+    size_t at = 0;
+    while (at < s.size()) {
+        ssize_t n = ::send(fd, s.data() + at, s.size() - at, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        at += n;
+    }
+}
+
+/* answers one request, false if the connection is to be closed */
+static bool respond(Conn& c, const std::string& req)
+{
+    std::string path = req.substr(4, req.find(' ', 4) - 4);
+    pthread_mutex_lock(&last_lock);
+    last_request = req;
+    pthread_mutex_unlock(&last_lock);
+    if (!c.served++ && setup_us) {
+        struct timespec ts = { setup_us / 1000000, (long)(setup_us % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+    }
+    origins[c.origin].requests++;
+
+    std::string head = "HTTP/1.1 200 OK\r\n", body = "hello";
+    bool keep = true;
+    if (path == "/chunked") {
+        send_all(c.fd, head + "Transfer-Encoding: chunked\r\n\r\n3\r\nhel\r\n2\r\nlo\r\n0\r\n\r\n");
+        return true;
+    } else if (path == "/nocontent") {
+        send_all(c.fd, "HTTP/1.1 204 No Content\r\n\r\n");
+        return true;
+    } else if (path == "/big") {
+        body.assign(BIG_BODY, 'x');
+    } else if (path == "/close") {
+        head += "Connection: close\r\n";
+        keep = false;
+    }
+    send_all(c.fd, head + "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+    return keep;
+}
+
+static void* server_thread(void*)
+{
+    std::vector<Conn> conns;
+    while (!stopping) {
+        std::vector<struct pollfd> fds;
+        for (int i = 0; i < ORIGINS; i++)
+            fds.push_back({ origins[i].fd, POLLIN, 0 });
+        for (size_t i = 0; i < conns.size(); i++)
+            fds.push_back({ conns[i].fd, POLLIN, 0 });
+        if (closing_idle) {
+            for (size_t i = 0; i < conns.size(); i++)
+                ::close(conns[i].fd);
+            conns.clear();
+            closing_idle = false;
+            continue;
+        }
+        if (poll(fds.data(), fds.size(), 10) <= 0)
+            continue;
+        for (int i = 0; i < ORIGINS; i++) {
+            if (fds[i].revents & POLLIN) {
+                int fd = ::accept(origins[i].fd, NULL, NULL);
+                if (fd >= 0) {
+                    origins[i].accepts++;
+                    conns.push_back({ fd, i, 0, "" });
+                }
+            }
+        }
+        for (size_t i = 0; i < fds.size() - ORIGINS; i++) {
+            Conn& c = conns[i];
+            if (!(fds[ORIGINS + i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            char buf[2048];
+            ssize_t n = ::recv(c.fd, buf, sizeof(buf), 0);
+            bool keep = n > 0;
+            if (keep)
+                c.in.append(buf, n);
+            size_t end;
+            while (keep && (end = c.in.find("\r\n\r\n")) != std::string::npos) {
+                std::string req = c.in.substr(0, end + 4);
+                c.in.erase(0, end + 4);
+                keep = respond(c, req);
+            }
+            if (!keep) {
+                ::close(c.fd);
+                c.fd = -1;
+            }
+        }
+        for (size_t i = conns.size(); i-- > 0;) {
+            if (conns[i].fd < 0)
+                conns.erase(conns.begin() + i);
+        }
+    }
+    for (size_t i = 0; i < conns.size(); i++)
+        ::close(conns[i].fd);
+    return NULL;
+}
+
+static int listen_on(uint16_t* port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr*)&addr, len) || listen(fd, 16) ||
+        getsockname(fd, (struct sockaddr*)&addr, &len)) {
+        perror("listen");
+        exit(1);
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* has the server close every connection it holds, and waits for that */
+static void close_idle(void)
+{
+    closing_idle = true;
+    while (closing_idle) {
+        usleep(1000);
+    }
+    usleep(1000);
+}
+
+static unsigned accepts(void)
+{
+    unsigned n = 0;
+    for (int i = 0; i < ORIGINS; i++)
+        n += origins[i].accepts;
+    return n;
+}
+
+static String url(int origin, const char* path, const char* scheme = "http")
+{
+    return String(scheme) + "://127.0.0.1:" + String(origins[origin].port) + path;
+}
+
+/* one request by a fresh client, as application code makes them */
+static int get(const String& u, String* body = NULL, const char* CAcert = NULL)
+{
+    HTTPClient http;
+    if (CAcert) {
+        http.begin(u, CAcert);
+    } else {
+        http.begin(u);
+    }
+    int code = http.GET();
+    if (code > 0) {
+        String s = http.getString();
+        if (body)
+            *body = s;
+    }
+    http.end();
+    return code;
+}
+
+static http_pool_stats_t stats(void)
+{
+    http_pool_stats_t s;
+    HTTPConnectionPool::getStats(&s);
+    return s;
+}
+
+static void fresh_pool(uint8_t max = HTTP_POOL_SIZE, uint32_t idle = HTTP_POOL_IDLE_TIMEOUT)
+{
+    HTTPConnectionPool::end();
+    HTTPConnectionPool::begin(max, idle);
+    HTTPConnectionPool::resetStats();
+}
+
+/* --------------------------------------------------------------- tests */
+
+static void test_disabled_pool(void)
+{
+    HTTPConnectionPool::end();
+    HTTPConnectionPool::resetStats();
+    unsigned before = accepts();
+    for (int i = 0; i < 5; i++) {
+        String body;
+        TEST_ASSERT_EQ(get(url(0, "/hello"), &body), 200);
+        TEST_ASSERT(body == "hello");
+    }
+    TEST_ASSERT_EQ(accepts() - before, 5);
+    TEST_ASSERT(last_request.find("Connection: close\r\n") != std::string::npos);
+    http_pool_stats_t s = stats();
+    TEST_ASSERT_EQ(s.hits + s.misses + s.returned, 0);
+}
+
+static void test_one_connection_for_many_clients(void)
+{
+    fresh_pool();
+    unsigned before = accepts(), requests = origins[0].requests;
+    for (int i = 0; i < 20; i++) {
+        String body;
+        TEST_ASSERT_EQ(get(url(0, "/hello"), &body), 200);
+        TEST_ASSERT(body == "hello");
+    }
+    TEST_ASSERT_EQ(accepts() - before, 1);
+    TEST_ASSERT_EQ(origins[0].requests - requests, 20);
+    TEST_ASSERT(last_request.find("Connection: keep-alive\r\n") != std::string::npos);
+    http_pool_stats_t s = stats();
+    TEST_ASSERT_EQ(s.misses, 1);
+    TEST_ASSERT_EQ(s.hits, 19);
+    TEST_ASSERT_EQ(s.returned, 20);
+    TEST_ASSERT_EQ(s.stale + s.evicted, 0);
+}
+
+static void test_keys_keep_origins_apart(void)
+{
+    fresh_pool();
+    static const char ca_a[] = "CA a", ca_b[] = "CA b";
+    char ca_a_copy[sizeof(ca_a)];
+    memcpy(ca_a_copy, ca_a, sizeof(ca_a));
+    unsigned before = accepts();
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQ(get(url(0, "/hello")), 200);
+        TEST_ASSERT_EQ(get(url(1, "/hello")), 200);
+        TEST_ASSERT_EQ(get(url(0, "/hello", "https"), NULL, ca_a), 200);
+        TEST_ASSERT_EQ(get(url(0, "/hello", "https"), NULL, ca_b), 200);
+        /* the same CA from another buffer shares ca_a's connection */
+        TEST_ASSERT_EQ(get(url(0, "/hello", "https"), NULL, ca_a_copy), 200);
+    }
+    /* http and https to port 0, with two CAs, and http to port 1 */
+    TEST_ASSERT_EQ(accepts() - before, 4);
+    http_pool_stats_t s = stats();
+    TEST_ASSERT_EQ(s.misses, 4);
+    TEST_ASSERT_EQ(s.hits, 11);
+    TEST_ASSERT_EQ(s.evicted, 0);
+}
+
+static void test_only_complete_responses_go_back(void)
+{
+    fresh_pool();
+    unsigned before = accepts();
+    /* body left unread */
+    {
+        HTTPClient http;
+        http.begin(url(0, "/big"));
+        TEST_ASSERT_EQ(http.GET(), 200);
+        TEST_ASSERT_EQ(http.getSize(), BIG_BODY);
+        http.end();
+    }
+    TEST_ASSERT_EQ(stats().returned, 0);
+    /* body read in part, client destroyed without end() */
+    {
+        HTTPClient http;
+        http.begin(url(0, "/big"));
+        TEST_ASSERT_EQ(http.GET(), 200);
+        uint8_t buf[1000];
+        TEST_ASSERT_EQ(http.readBody(buf, sizeof(buf)), sizeof(buf));
+    }
+    TEST_ASSERT_EQ(stats().returned, 0);
+    TEST_ASSERT_EQ(accepts() - before, 2);
+
+    /* identity, chunked and bodiless responses read through all go back */
+    String body;
+    TEST_ASSERT_EQ(get(url(0, "/big"), &body), 200);
+    TEST_ASSERT_EQ(body.length(), BIG_BODY);
+    TEST_ASSERT_EQ(get(url(0, "/chunked"), &body), 200);
+    TEST_ASSERT(body == "hello");
+    TEST_ASSERT_EQ(get(url(0, "/nocontent")), 204);
+    TEST_ASSERT_EQ(get(url(0, "/hello"), &body), 200);
+    TEST_ASSERT(body == "hello");
+    TEST_ASSERT_EQ(accepts() - before, 3);
+    http_pool_stats_t s = stats();
+    TEST_ASSERT_EQ(s.returned, 4);
+    TEST_ASSERT_EQ(s.hits, 3);
+}
+
+static void test_closed_connections(void)
+{
+    fresh_pool();
+    unsigned before = accepts();
+    /* the server says it will close */
+    TEST_ASSERT_EQ(get(url(0, "/close")), 200);
+    TEST_ASSERT_EQ(stats().returned, 0);
+    TEST_ASSERT_EQ(get(url(0, "/hello")), 200);
+    TEST_ASSERT_EQ(accepts() - before, 2);
+
+    /* the server times the idle connection out: found stale and replaced */
+    TEST_ASSERT_EQ(stats().returned, 1);
+    close_idle();
+    String body;
+    TEST_ASSERT_EQ(get(url(0, "/hello"), &body), 200);
+    TEST_ASSERT(body == "hello");
+    TEST_ASSERT_EQ(accepts() - before, 3);
+    http_pool_stats_t s = stats();
+    TEST_ASSERT_EQ(s.stale, 1);
+    TEST_ASSERT_EQ(s.hits, 0);
+    TEST_ASSERT_EQ(s.misses, 3);
+    TEST_ASSERT_EQ(s.returned, 2);
+}
+
+static void test_idle_timeout(void)
+{
+    fresh_pool(HTTP_POOL_SIZE, 1000);
+    unsigned before = accepts();
+    TEST_ASSERT_EQ(get(url(0, "/hello")), 200);
+    hostClockManual(true);
+    hostClockAdvance(999 * 1000);
+    TEST_ASSERT_EQ(get(url(0, "/hello")), 200);
+    TEST_ASSERT_EQ(accepts() - before, 1);
+    hostClockAdvance(1001 * 1000);
+    TEST_ASSERT_EQ(get(url(0, "/hello")), 200);
+    hostClockManual(false);
+    TEST_ASSERT_EQ(accepts() - before, 2);
+    http_pool_stats_t s = stats();
+    TEST_ASSERT_EQ(s.evicted, 1);
+    TEST_ASSERT_EQ(s.hits, 1);
+    TEST_ASSERT_EQ(s.misses, 2);
+}
+
+static void test_max_connections(void)
+{
+    fresh_pool(2);
+    unsigned before = accepts();
+    for (int i = 0; i < ORIGINS; i++) {
+        TEST_ASSERT_EQ(get(url(i, "/hello")), 200);
+    }
+    TEST_ASSERT_EQ(stats().evicted, 1);
+    /* the oldest went, the two newest are still there */
+    TEST_ASSERT_EQ(get(url(1, "/hello")), 200);
+    TEST_ASSERT_EQ(get(url(2, "/hello")), 200);
+    TEST_ASSERT_EQ(accepts() - before, 3);
+    TEST_ASSERT_EQ(get(url(0, "/hello")), 200);
+    TEST_ASSERT_EQ(accepts() - before, 4);
+    http_pool_stats_t s = stats();
+    TEST_ASSERT_EQ(s.hits, 2);
+    TEST_ASSERT_EQ(s.misses, 4);
+
+    /* nothing is left open once the pool ends */
+    HTTPConnectionPool::end();
+    TEST_ASSERT_EQ(get(url(1, "/hello")), 200);
+    TEST_ASSERT_EQ(accepts() - before, 5);
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+static void bench_requests(void)
+{
+    const unsigned setups[] = { 0, 5000 };
+    for (size_t i = 0; i < sizeof(setups) / sizeof(setups[0]); i++) {
+        setup_us = setups[i];
+        unsigned n = setups[i] ? hostIterations(200) : hostIterations(2000);
+        for (int pooled = 0; pooled < 2; pooled++) {
+            if (pooled) {
+                fresh_pool();
+            } else {
+                HTTPConnectionPool::end();
+            }
+            unsigned before = accepts();
+            uint64_t t0 = hostNowNs();
+            for (unsigned r = 0; r < n; r++) {
+                get(url(0, "/hello"));
+            }
+            double s = (hostNowNs() - t0) / 1e9;
+            BENCH("setup %4.1f ms, pool %-3s %7.0f requests/s  %4u connections for %u requests",
+                  setups[i] / 1000.0, pooled ? "on" : "off", n / s, accepts() - before, n);
+        }
+    }
+    setup_us = 0;
+    HTTPConnectionPool::end();
+}
+
+int main(void)
+{
+    /* lwIP reports a closed peer with an error, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < ORIGINS; i++)
+        origins[i].fd = listen_on(&origins[i].port);
+    pthread_t server;
+    pthread_create(&server, NULL, server_thread, NULL);
+
+    TEST_RUN(test_disabled_pool);
+    TEST_RUN(test_one_connection_for_many_clients);
+    TEST_RUN(test_keys_keep_origins_apart);
+    TEST_RUN(test_only_complete_responses_go_back);
+    TEST_RUN(test_closed_connections);
+    TEST_RUN(test_idle_timeout);
+    TEST_RUN(test_max_connections);
+    TEST_RUN(bench_requests);
+
+    stopping = true;
+    pthread_join(server, NULL);
+    for (int i = 0; i < ORIGINS; i++)
+        ::close(origins[i].fd);
+    return TEST_EXIT();
+}
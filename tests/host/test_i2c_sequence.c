@@ -0,0 +1,742 @@
+/*
+ * I2C master command sequences against a model of the controller and bus.
+ *
+ * Loads and stores of I2C0 are traced: command[] stores are kept as the
+ * command list, fifo_data stores fill the TX FIFO and loads pop the RX
+ * FIFO, status_reg reports the FIFO counts and int_clr clears raw bits.
+ * trans_start makes the model run the command list against register-file
+ * slaves, one byte at a time, raising the interrupts the real controller
+ * raises. It runs while i2cProcQueue() waits for the ISR, on the waiting
+ * thread, and fires the ISR whenever an enabled interrupt is pending.
+ * Each run leaves the executed commands and the bus traffic as strings.
+ */
+#include "host.h"
+#include "../../cores/esp32/esp32-hal-gpio.c"
+#include "../../cores/esp32/esp32-hal-matrix.c"
+#include "../../cores/esp32/esp32-hal-i2c.c"
+
+#include <stdarg.h>
+
+/* ROM and DPORT helpers the driver links against */
+uint32_t esp_dport_access_reg_read(uint32_t reg) { return *(volatile uint32_t *)(uintptr_t)reg; }
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv)
+{
+    (void)gpio; (void)signal_idx; (void)out_inv; (void)oen_inv;
+}
+void gpio_matrix_in(uint32_t gpio, uint32_t signal_idx, bool inv) { (void)gpio; (void)signal_idx; (void)inv; }
+const char *pathToFileName(const char *path) { return path; }
+
+#define DEV         ((volatile i2c_dev_t *)DR_REG_I2C_EXT_BASE_FIXED)
+#define REG(f)      ((uintptr_t)&DEV->f)
+#define SENSOR      0x68
+#define TEN_BIT     (0x7800 | 0x3A5)
+#define ABSENT      0x50
+
+/* ---------------------------------------------------------------- slaves */
+
+/* a register pointer written first, then data written or read from it */
+typedef struct {
+    uint16_t addr;      /* 7bit, or 0x7800 | 10bit */
+    uint8_t reg[256];
+    uint8_t ptr;
+} slave_t;
+
+static slave_t slaves[2] = { { SENSOR }, { TEN_BIT } };
+
+static struct {
+    enum { BUS_ADDR, BUS_ADDR10, BUS_DATA } phase;
+    slave_t *sel, *last10;
+    bool read, first;
+    uint8_t hi;
+    unsigned reads;     /* read bytes not logged yet */
+    char log[1024];
+} bus;
+
+static void bus_log(const char *fmt, ...)
+{
+    size_t n = strlen(bus.log);
+    va_list ap;
+    if (bus.reads) {
+        unsigned r = bus.reads;
+        bus.reads = 0;
+        bus_log("R%u", r);
+        n = strlen(bus.log);
+    }
+    if (!fmt) {
+        return;
+    }
+    if (n && n < sizeof(bus.log) - 1) {
+        bus.log[n++] = ' ';
+    }
+    va_start(ap, fmt);
+    vsnprintf(bus.log + n, sizeof(bus.log) - n, fmt, ap);
+    va_end(ap);
+}
+
+static slave_t *slave_find(uint16_t addr)
+{
+    for (size_t i = 0; i < sizeof(slaves) / sizeof(slaves[0]); i++) {
+        if (slaves[i].addr == addr) {
+            return &slaves[i];
+        }
+    }
+    return NULL;
+}
+
+static void bus_start(void)
+{
+    bus_log("S");
+    bus.phase = BUS_ADDR;
+    bus.sel = NULL;
+}
+
+static void bus_stop(void)
+{
+    bus_log("P");
+    bus.sel = NULL;
+}
+
+/* one byte from the master, returns the slave's ACK */
+static bool bus_write(uint8_t b)
+{
+    bool ack = false;
+    switch (bus.phase) {
+    case BUS_ADDR:
+        if ((b & 0xF8) == 0xF0) { /* 11110xx: 10bit address */
+            bus.hi = (b >> 1) & 3;
+            if (b & 1) { /* read from the 10bit slave addressed last */
+                bus.sel = (bus.last10 && ((bus.last10->addr >> 8) & 3) == bus.hi) ? bus.last10 : NULL;
+                bus.read = true;
+                bus.phase = BUS_DATA;
+                ack = bus.sel != NULL;
+            } else {
+                bus.phase = BUS_ADDR10;
+                ack = true;
+            }
+        } else {
+            bus.sel = slave_find(b >> 1);
+            bus.read = b & 1;
+            bus.first = true;
+            bus.phase = BUS_DATA;
+            ack = bus.sel != NULL;
+        }
+        break;
+    case BUS_ADDR10:
+        bus.sel = bus.last10 = slave_find(0x7800 | (bus.hi << 8) | b);
+        bus.read = false;
+        bus.first = true;
+        bus.phase = BUS_DATA;
+        ack = bus.sel != NULL;
+        break;
+    case BUS_DATA:
+        if (bus.sel && !bus.read) {
+            if (bus.first) {
+                bus.sel->ptr = b;
+                bus.first = false;
+            } else {
+                bus.sel->reg[bus.sel->ptr++] = b;
+            }
+            ack = true;
+        }
+        break;
+    }
+    bus_log(ack ? "%02X" : "%02X!", b);
+    return ack;
+}
+
+static uint8_t bus_read(void)
+{
+    bus.reads++;
+    return bus.sel ? bus.sel->reg[bus.sel->ptr++] : 0xFF;
+}
+
+/* ------------------------------------------------------------ controller */
+
+static struct {
+    uint32_t cmd[16];
+    uint8_t tx[32], rx[32];
+    unsigned tx_head, tx_count, rx_head, rx_count;
+    uint32_t raw, ena, fifo_conf;
+    bool trans_start, running, entered;
+    unsigned pc, sub;
+    unsigned busy_reads;        /* status reads that still report bus_busy */
+    unsigned stores, setup_stores, isr_calls;
+    int64_t us_per_store;       /* manual clock step per traced store */
+    char cmds[1024];            /* executed commands */
+} hw;
+
+/* across runs */
+static unsigned tx_overflow;
+static bool livelock;
+
+static void hw_reset(void)
+{
+    memset(&hw, 0, sizeof(hw));
+    memset(&bus, 0, sizeof(bus));
+}
+
+static void cmd_log(const char *fmt, ...)
+{
+    size_t n = strlen(hw.cmds);
+    va_list ap;
+    if (n && n < sizeof(hw.cmds) - 1) {
+        hw.cmds[n++] = ' ';
+    }
+    va_start(ap, fmt);
+    vsnprintf(hw.cmds + n, sizeof(hw.cmds) - n, fmt, ap);
+    va_end(ap);
+}
+
+static void hw_store(uintptr_t addr, uint32_t value, void *arg)
+{
+    (void)arg;
+    hw.stores++;
+    if (hw.us_per_store) {
+        hostClockAdvance(hw.us_per_store);
+    }
+    if (addr >= REG(command[0]) && addr <= REG(command[15])) {
+        hw.cmd[(addr - REG(command[0])) / 4] = value;
+    } else if (addr == REG(fifo_data)) {
+        if (hw.tx_count < 32) {
+            hw.tx[(hw.tx_head + hw.tx_count++) % 32] = value;
+        } else {
+            tx_overflow++;
+        }
+    } else if (addr == REG(int_ena)) {
+        hw.ena = value;
+    } else if (addr == REG(int_clr)) {
+        hw.raw &= ~value;
+        DEV->int_clr.val = 0; /* write only */
+    } else if (addr == REG(fifo_conf)) {
+        hw.fifo_conf = value;
+        if (DEV->fifo_conf.rx_fifo_rst) {
+            hw.rx_count = 0;
+        }
+        if (DEV->fifo_conf.tx_fifo_rst) {
+            hw.tx_count = 0;
+        }
+    } else if (addr == REG(ctr)) {
+        bool start = DEV->ctr.trans_start;
+        if (start && !hw.trans_start) { /* from the top of command[] */
+            if (!hw.setup_stores) {
+                hw.setup_stores = hw.stores;
+            }
+            hw.running = true;
+            hw.entered = false;
+            hw.pc = 0;
+            hw.sub = 0;
+            hw.raw |= I2C_TRANS_START_INT_ST;
+        }
+        hw.trans_start = start;
+    }
+}
+
+static void hw_load(uintptr_t addr, void *arg)
+{
+    (void)arg;
+    if (addr == REG(int_status)) {
+        DEV->int_status.val = hw.raw & hw.ena;
+    } else if (addr == REG(int_raw)) {
+        DEV->int_raw.val = hw.raw;
+    } else if (addr == REG(int_clr)) {
+        DEV->int_clr.val = 0;
+    } else if (addr == REG(status_reg)) {
+        DEV->status_reg.tx_fifo_cnt = hw.tx_count;
+        DEV->status_reg.rx_fifo_cnt = hw.rx_count;
+        DEV->status_reg.bus_busy = hw.busy_reads != 0;
+        if (hw.busy_reads) {
+            hw.busy_reads--;
+        }
+    } else if (addr == REG(fifo_data)) {
+        uint8_t b = 0;
+        if (hw.rx_count) {
+            b = hw.rx[hw.rx_head];
+            hw.rx_head = (hw.rx_head + 1) % 32;
+            hw.rx_count--;
+        }
+        DEV->fifo_data.val = b;
+    }
+}
+
+/* FIFO threshold interrupts are levels */
+static void hw_levels(void)
+{
+    I2C_FIFO_CONF_t f = { .val = hw.fifo_conf };
+    if (hw.tx_count <= f.tx_fifo_empty_thrhd) {
+        hw.raw |= I2C_TXFIFO_EMPTY_INT_ST;
+    }
+    if (f.rx_fifo_full_thrhd && hw.rx_count >= f.rx_fifo_full_thrhd) {
+        hw.raw |= I2C_RXFIFO_FULL_INT_ST;
+    }
+}
+
+/* one command or one byte of it, false while waiting on a FIFO */
+static bool hw_step(void)
+{
+    if (hw.pc >= 16) {
+        hw.running = false;
+        return true;
+    }
+    I2C_COMMAND_t c = { .val = hw.cmd[hw.pc] };
+    static const char *const names[] = { "RSTART", "WRITE", "READ", "STOP", "END" };
+    if (!hw.entered) {
+        hw.entered = true;
+        if (c.op_code == I2C_CMD_WRITE || c.op_code == I2C_CMD_READ) {
+            cmd_log(c.ack_val ? "%s(%u,nak)" : "%s(%u)", names[c.op_code], c.byte_num);
+        } else {
+            cmd_log("%s", c.op_code <= I2C_CMD_END ? names[c.op_code] : "?");
+        }
+    }
+    switch (c.op_code) {
+    case I2C_CMD_RSTART:
+        bus_start();
+        break;
+    case I2C_CMD_WRITE:
+        if (hw.sub < c.byte_num) {
+            if (!hw.tx_count) {
+                return false;
+            }
+            uint8_t b = hw.tx[hw.tx_head];
+            hw.tx_head = (hw.tx_head + 1) % 32;
+            hw.tx_count--;
+            hw.sub++;
+            hw.raw |= I2C_MASTER_TRAN_COMP_INT_ST;
+            if (!bus_write(b) && c.ack_en) {
+                hw.raw |= I2C_ACK_ERR_INT_ST;
+                hw.running = false;
+            }
+            return true;
+        }
+        break;
+    case I2C_CMD_READ:
+        if (hw.sub < c.byte_num) {
+            if (hw.rx_count == 32) {
+                return false;
+            }
+            hw.rx[(hw.rx_head + hw.rx_count++) % 32] = bus_read();
+            hw.sub++;
+            hw.raw |= I2C_MASTER_TRAN_COMP_INT_ST;
+            return true;
+        }
+        break;
+    case I2C_CMD_STOP:
+        bus_stop();
+        hw.raw |= I2C_TRANS_COMPLETE_INT_ST;
+        hw.running = false;
+        return true;
+    case I2C_CMD_END: /* until the next trans_start */
+        hw.raw |= I2C_END_DETECT_INT_ST;
+        hw.running = false;
+        return true;
+    default:
+        hw.running = false;
+        return true;
+    }
+    hw.pc++;
+    hw.sub = 0;
+    hw.entered = false;
+    return true;
+}
+
+/* runs on the thread waiting in i2cProcQueue() */
+static bool hw_block(void *arg)
+{
+    (void)arg;
+    bool moved = false;
+    unsigned isr_calls = 0;
+    for (;;) {
+        hw_levels();
+        if (hw.raw & hw.ena) {
+            if (++isr_calls > 100000) {
+                livelock = true;
+                hw.ena = 0;
+                break;
+            }
+            hw.isr_calls++;
+            hostIntrFire(ETS_I2C_EXT0_INTR_SOURCE);
+            moved = true;
+            continue;
+        }
+        if (!hw.running || !hw_step()) {
+            break;
+        }
+        moved = true;
+    }
+    return moved;
+}
+
+/* ----------------------------------------------------------------- tests */
+
+static i2c_t *i2c;
+
+static void trace_on(void)
+{
+    hostPeriphTrace(REG(scl_low_period), (uintptr_t)(DEV + 1), hw_store, NULL);
+    hostPeriphTraceLoads(hw_load);
+    hostBlockHook(hw_block, NULL);
+}
+
+static void trace_off(void)
+{
+    hostBlockHook(NULL, NULL);
+    hostPeriphUntrace();
+}
+
+static const char *bus_trace(void)
+{
+    bus_log(NULL); /* pending reads */
+    return bus.log;
+}
+
+static void fill_sensor(void)
+{
+    for (unsigned i = 0; i < 256; i++) {
+        slaves[0].reg[i] = i ^ 0x5A;
+        slaves[1].reg[i] = i ^ 0xA5;
+    }
+}
+
+static bool check_read(const uint8_t *buf, const slave_t *s, uint8_t reg, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (buf[i] != s->reg[(uint8_t)(reg + i)]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#define TEST_ASSERT_STR(a, b) do { \
+        const char *_a = (a), *_b = (b); \
+        if (strcmp(_a, _b)) { \
+            if (host_failures++ < 20) \
+                fprintf(stderr, "%s:%d: \"%s\" != \"%s\"\n", __FILE__, __LINE__, _a, _b); \
+        } \
+    } while (0)
+
+static void test_addresses(void)
+{
+    I2C_DATA_QUEUE_t dq[I2C_TRANSACTION_MAX_DQ];
+    uint8_t tx[2], rx[4];
+
+    TEST_ASSERT_EQ(i2cBuildWriteRead(dq, SENSOR, NULL, 0, NULL, 0), 0);
+
+    /* write reg, ReSTART, read */
+    TEST_ASSERT_EQ(i2cBuildWriteRead(dq, SENSOR, tx, 1, rx, 4), 2);
+    TEST_ASSERT_EQ(dq[0].ctrl.addr, 0xD0);
+    TEST_ASSERT_EQ(dq[0].ctrl.mode, 0);
+    TEST_ASSERT_EQ(dq[0].ctrl.stop, 0);
+    TEST_ASSERT_EQ(dq[0].ctrl.addrReq, 1);
+    TEST_ASSERT_EQ(dq[0].queueLength, 2);
+    TEST_ASSERT_EQ(dq[1].ctrl.addr, 0xD1);
+    TEST_ASSERT_EQ(dq[1].ctrl.mode, 1);
+    TEST_ASSERT_EQ(dq[1].ctrl.stop, 1);
+    TEST_ASSERT_EQ(dq[1].queueLength, 5);
+
+    /* write only, read only */
+    TEST_ASSERT_EQ(i2cBuildWriteRead(dq, SENSOR, tx, 2, NULL, 0), 1);
+    TEST_ASSERT_EQ(dq[0].ctrl.stop, 1);
+    TEST_ASSERT_EQ(i2cBuildWriteRead(dq, SENSOR, NULL, 0, rx, 4), 1);
+    TEST_ASSERT_EQ(dq[0].ctrl.addr, 0xD1);
+
+    /* 10bit: 11110 A9 A8 W, A7..A0, then 11110 A9 A8 R after the ReSTART */
+    TEST_ASSERT_EQ(i2cBuildWriteRead(dq, TEN_BIT, tx, 1, rx, 4), 2);
+    TEST_ASSERT_EQ(dq[0].ctrl.addr, 0xF6A5);
+    TEST_ASSERT_EQ(dq[0].ctrl.addrReq, 2);
+    TEST_ASSERT_EQ(dq[0].queueLength, 3);
+    TEST_ASSERT_EQ(dq[1].ctrl.addr, 0xF7);
+    TEST_ASSERT_EQ(dq[1].ctrl.addrReq, 1);
+
+    /* a 10bit read alone gets the empty addressing write */
+    TEST_ASSERT_EQ(i2cBuildWriteRead(dq, TEN_BIT, NULL, 0, rx, 4), 2);
+    TEST_ASSERT_EQ(dq[0].length, 0);
+    TEST_ASSERT_EQ(dq[0].ctrl.stop, 0);
+    TEST_ASSERT_EQ(dq[1].ctrl.addr, 0xF7);
+
+    /* the queue API encodes the same way */
+    TEST_ASSERT_EQ(i2cAddQueueRead(i2c, TEN_BIT, rx, 4, true, NULL), I2C_ERROR_OK);
+    TEST_ASSERT_EQ(i2c->queueCount, 2);
+    TEST_ASSERT_EQ(i2c->dq[0].ctrl.addr, 0xF6A5);
+    TEST_ASSERT_EQ(i2c->dq[1].ctrl.addr, 0xF7);
+    i2cFlush(i2c);
+}
+
+static void test_register_read(void)
+{
+    uint8_t reg = 0x3B, buf[6];
+    uint32_t count = 0;
+
+    hw_reset();
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, SENSOR, &reg, 1, buf, sizeof(buf), 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(hw.cmds, "RSTART WRITE(1) WRITE(1) RSTART WRITE(1) READ(5) READ(1,nak) STOP");
+    TEST_ASSERT_STR(bus_trace(), "S D0 3B S D1 R6 P");
+    TEST_ASSERT_EQ(count, 6);
+    TEST_ASSERT(check_read(buf, &slaves[0], reg, sizeof(buf)));
+    TEST_ASSERT_EQ(i2c->queueCount, 0);
+
+    /* the generic queue produces the same sequence */
+    char cmds[sizeof(hw.cmds)];
+    strcpy(cmds, hw.cmds);
+    hw_reset();
+    memset(buf, 0, sizeof(buf));
+    TEST_ASSERT_EQ(i2cWrite(i2c, SENSOR, &reg, 1, false, 50), I2C_ERROR_CONTINUE);
+    TEST_ASSERT_EQ(i2cRead(i2c, SENSOR, buf, sizeof(buf), true, 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(hw.cmds, cmds);
+    TEST_ASSERT_STR(bus_trace(), "S D0 3B S D1 R6 P");
+    TEST_ASSERT(check_read(buf, &slaves[0], reg, sizeof(buf)));
+
+    /* past the RX FIFO threshold and the 255 byte READ limit */
+    uint8_t big[300];
+    reg = 0xF0;
+    hw_reset();
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, SENSOR, &reg, 1, big, sizeof(big), 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(hw.cmds, "RSTART WRITE(1) WRITE(1) RSTART WRITE(1) READ(255) READ(44) READ(1,nak) STOP");
+    TEST_ASSERT_STR(bus_trace(), "S D0 F0 S D1 R300 P");
+    TEST_ASSERT_EQ(count, sizeof(big));
+    TEST_ASSERT(check_read(big, &slaves[0], reg, sizeof(big)));
+}
+
+static void test_register_write(void)
+{
+    uint8_t tx[] = { 0x10, 1, 2, 3, 4 };
+
+    hw_reset();
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, SENSOR, tx, sizeof(tx), NULL, 0, 50, NULL), I2C_ERROR_OK);
+    TEST_ASSERT_STR(hw.cmds, "RSTART WRITE(1) WRITE(5) STOP");
+    TEST_ASSERT_STR(bus_trace(), "S D0 10 01 02 03 04 P");
+    TEST_ASSERT(!memcmp(&slaves[0].reg[0x10], &tx[1], 4));
+    fill_sensor();
+
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, SENSOR, NULL, 0, NULL, 0, 50, NULL), I2C_ERROR_DEV);
+}
+
+static void test_ten_bit(void)
+{
+    uint8_t reg = 0x20, buf[4];
+    uint32_t count = 0;
+
+    hw_reset();
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, TEN_BIT, &reg, 1, buf, sizeof(buf), 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(hw.cmds, "RSTART WRITE(2) WRITE(1) RSTART WRITE(1) READ(3) READ(1,nak) STOP");
+    TEST_ASSERT_STR(bus_trace(), "S F6 A5 20 S F7 R4 P");
+    TEST_ASSERT_EQ(count, 4);
+    TEST_ASSERT(check_read(buf, &slaves[1], reg, sizeof(buf)));
+
+    /* read on from the pointer left behind */
+    hw_reset();
+    TEST_ASSERT_EQ(i2cRead(i2c, TEN_BIT, buf, sizeof(buf), true, 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(hw.cmds, "RSTART WRITE(2) RSTART WRITE(1) READ(3) READ(1,nak) STOP");
+    TEST_ASSERT_STR(bus_trace(), "S F6 A5 S F7 R4 P");
+    TEST_ASSERT(check_read(buf, &slaves[1], reg + 4, sizeof(buf)));
+}
+
+static void test_end_continuation(void)
+{
+    /* six register writes chained by ReSTARTs need more than one command[] fill */
+    uint8_t tx[6][2];
+    hw_reset();
+    for (int i = 0; i < 6; i++) {
+        tx[i][0] = 0x80 + i;
+        tx[i][1] = 0x40 + i;
+        TEST_ASSERT_EQ(i2cWrite(i2c, SENSOR, tx[i], 2, i == 5, 50), i == 5 ? I2C_ERROR_OK : I2C_ERROR_CONTINUE);
+    }
+    TEST_ASSERT_STR(hw.cmds,
+                    "RSTART WRITE(1) WRITE(2) RSTART WRITE(1) WRITE(2) RSTART WRITE(1) WRITE(2) "
+                    "RSTART WRITE(1) WRITE(2) RSTART WRITE(1) WRITE(2) END "
+                    "RSTART WRITE(1) WRITE(2) STOP");
+    TEST_ASSERT_STR(bus_trace(),
+                    "S D0 80 40 S D0 81 41 S D0 82 42 S D0 83 43 S D0 84 44 S D0 85 45 P");
+    for (int i = 0; i < 6; i++) {
+        TEST_ASSERT_EQ(slaves[0].reg[0x80 + i], 0x40 + i);
+    }
+    fill_sensor();
+}
+
+static void test_errors(void)
+{
+    uint8_t reg = 0, buf[4];
+    uint32_t count = 7;
+
+    /* nobody answers the address */
+    hw_reset();
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, ABSENT, &reg, 1, buf, sizeof(buf), 50, &count), I2C_ERROR_ACK);
+    TEST_ASSERT_STR(bus_trace(), "S A0!");
+    TEST_ASSERT_EQ(count, 0);
+    TEST_ASSERT_EQ(i2c->queueCount, 0);
+
+    /* bus busy: reinit and replay the same sequence */
+    hw_reset();
+    hw.busy_reads = 1;
+    reg = 0x3B;
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, SENSOR, &reg, 1, buf, sizeof(buf), 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(bus_trace(), "S D0 3B S D1 R4 P");
+    TEST_ASSERT(check_read(buf, &slaves[0], reg, sizeof(buf)));
+
+    hw_reset();
+    hw.busy_reads = 1;
+    memset(buf, 0, sizeof(buf));
+    TEST_ASSERT_EQ(i2cWrite(i2c, SENSOR, &reg, 1, false, 50), I2C_ERROR_CONTINUE);
+    TEST_ASSERT_EQ(i2cRead(i2c, SENSOR, buf, sizeof(buf), true, 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(bus_trace(), "S D0 3B S D1 R4 P");
+    TEST_ASSERT(check_read(buf, &slaves[0], reg, sizeof(buf)));
+
+    /* a pending ReSTART sequence is left alone */
+    hw_reset();
+    TEST_ASSERT_EQ(i2cWrite(i2c, SENSOR, &reg, 1, false, 50), I2C_ERROR_CONTINUE);
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, SENSOR, &reg, 1, buf, sizeof(buf), 50, &count), I2C_ERROR_BUSY);
+    TEST_ASSERT_STR(bus_trace(), "");
+    TEST_ASSERT_EQ(i2c->queueCount, 1);
+    TEST_ASSERT_EQ(i2cRead(i2c, SENSOR, buf, 2, true, 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(bus_trace(), "S D0 3B S D1 R2 P");
+}
+
+static void test_transaction_reuse(void)
+{
+    uint8_t reg = 0x40, buf[8];
+    uint32_t count = 0;
+    i2c_transaction_t *t = i2cTransactionNew(SENSOR, &reg, 1, buf, sizeof(buf));
+
+    TEST_ASSERT(t != NULL);
+    TEST_ASSERT(i2cTransactionNew(SENSOR, NULL, 0, NULL, 0) == NULL);
+    TEST_ASSERT_EQ(i2cTransactionRun(i2c, NULL, 50, &count), I2C_ERROR_DEV);
+
+    size_t queue_size = i2c->queueSize;
+    I2C_DATA_QUEUE_t *own = i2c->dq;
+    for (int run = 0; run < 3; run++) {
+        slaves[0].reg[0x40] = run;
+        hw_reset();
+        count = 0;
+        TEST_ASSERT_EQ(i2cTransactionRun(i2c, t, 50, &count), I2C_ERROR_OK);
+        TEST_ASSERT_STR(hw.cmds, "RSTART WRITE(1) WRITE(1) RSTART WRITE(1) READ(7) READ(1,nak) STOP");
+        TEST_ASSERT_STR(bus_trace(), "S D0 40 S D1 R8 P");
+        TEST_ASSERT_EQ(count, sizeof(buf));
+        TEST_ASSERT_EQ(buf[0], run);
+        TEST_ASSERT(check_read(buf, &slaves[0], reg, sizeof(buf)));
+    }
+    /* the bus queue is neither used nor reallocated */
+    TEST_ASSERT(i2c->dq == own);
+    TEST_ASSERT_EQ(i2c->queueSize, queue_size);
+    TEST_ASSERT_EQ(i2c->queueCount, 0);
+
+    /* a failed run does not spoil the next */
+    slaves[0].addr = 0x69;
+    hw_reset();
+    TEST_ASSERT_EQ(i2cTransactionRun(i2c, t, 50, &count), I2C_ERROR_ACK);
+    slaves[0].addr = SENSOR;
+    hw_reset();
+    TEST_ASSERT_EQ(i2cTransactionRun(i2c, t, 50, &count), I2C_ERROR_OK);
+    TEST_ASSERT_STR(bus_trace(), "S D0 40 S D1 R8 P");
+    TEST_ASSERT_EQ(count, sizeof(buf));
+    i2cTransactionFree(t);
+    slaves[0].reg[0x40] = 0x40 ^ 0x5A;
+}
+
+static void test_setup_cycles(void)
+{
+    /* every traced register store takes 1 us of the manual clock */
+    uint8_t reg = 0x3B, buf[6];
+    hostClockManual(true);
+    hw_reset();
+    hw.us_per_store = 1;
+    TEST_ASSERT_EQ(i2cWriteRead(i2c, SENSOR, &reg, 1, buf, sizeof(buf), 50, NULL), I2C_ERROR_OK);
+    /* the stores of the setup, before the one to trans_start */
+    TEST_ASSERT_EQ(i2cGetSetupCycles(i2c), (hw.setup_stores - 1) * 240);
+    TEST_ASSERT(hw.setup_stores > 1);
+    hostClockManual(false);
+}
+
+/* ------------------------------------------------------------ benchmarks */
+
+static void bench_paths(void)
+{
+    uint8_t reg = 0x3B, buf[6];
+    unsigned n = hostIterations(2000);
+    uint32_t count;
+    i2c_transaction_t *t = i2cTransactionNew(SENSOR, &reg, 1, buf, sizeof(buf));
+    const char *name[] = { "queue", "writeRead", "transaction" };
+
+    for (int path = 0; path < 3; path++) {
+        unsigned stores = 0, isr = 0;
+        uint64_t cycles = 0;
+        uint64_t t0 = hostNowNs();
+        for (unsigned i = 0; i < n; i++) {
+            hw_reset();
+            if (path == 0) {
+                i2cWrite(i2c, SENSOR, &reg, 1, false, 50);
+                i2cRead(i2c, SENSOR, buf, sizeof(buf), true, 50, &count);
+            } else if (path == 1) {
+                i2cWriteRead(i2c, SENSOR, &reg, 1, buf, sizeof(buf), 50, &count);
+            } else {
+                i2cTransactionRun(i2c, t, 50, &count);
+            }
+            stores += hw.setup_stores;
+            isr += hw.isr_calls;
+            cycles += i2cGetSetupCycles(i2c);
+        }
+        uint64_t ns = hostNowNs() - t0;
+        BENCH("%-11s  %u register stores to trans_start, %u ISR runs, setup %.1f us, %.1f us per transaction (traced)",
+              name[path], stores / n, isr / n, cycles / 240.0 / n, ns / 1000.0 / n);
+    }
+
+    /* what the paths do before i2cProcQueue(), untraced */
+    trace_off();
+    I2C_DATA_QUEUE_t dq[I2C_TRANSACTION_MAX_DQ];
+    unsigned m = hostIterations(2000000);
+    uint64_t t0 = hostNowNs();
+    for (unsigned i = 0; i < m; i++) {
+        i2cAddQueueWrite(i2c, SENSOR, &reg, 1, false, NULL);
+        i2cAddQueueRead(i2c, SENSOR, buf, sizeof(buf), true, NULL);
+        i2cFlush(i2c);
+    }
+    uint64_t queue_ns = hostNowNs() - t0;
+    t0 = hostNowNs();
+    for (unsigned i = 0; i < m; i++) {
+        i2cBuildWriteRead(dq, SENSOR, &reg, 1, buf, sizeof(buf));
+        __asm__ volatile("" : : "r"(dq) : "memory");
+    }
+    uint64_t build_ns = hostNowNs() - t0;
+    /* the per element rewind i2cProcQueue() does for every path */
+    t0 = hostNowNs();
+    for (unsigned i = 0; i < m; i++) {
+        for (int k = 0; k < t->count; k++) {
+            I2C_DATA_QUEUE_t *tdq = &t->dq[k];
+            tdq->position = 0;
+            tdq->cmdBytesNeeded = tdq->length;
+            tdq->ctrl.startCmdSent = 0;
+            tdq->ctrl.addrCmdSent = 0;
+            tdq->ctrl.dataCmdSent = 0;
+            tdq->ctrl.stopCmdSent = 0;
+            tdq->ctrl.addrSent = 0;
+        }
+        __asm__ volatile("" : : "r"(t) : "memory");
+    }
+    uint64_t rewind_ns = hostNowNs() - t0;
+    BENCH("building the dq: queue %.1f ns, writeRead %.1f ns, transaction none (rewind %.1f ns)",
+          (double)queue_ns / m, (double)build_ns / m, (double)rewind_ns / m);
+    trace_on();
+    i2cTransactionFree(t);
+}
+
+int main(void)
+{
+    fill_sensor();
+    i2c = i2cInit(0, -1, -1, 400000);
+    TEST_ASSERT(i2c != NULL);
+    trace_on();
+
+    TEST_RUN(test_addresses);
+    TEST_RUN(test_register_read);
+    TEST_RUN(test_register_write);
+    TEST_RUN(test_ten_bit);
+    TEST_RUN(test_end_continuation);
+    TEST_RUN(test_errors);
+    TEST_RUN(test_transaction_reuse);
+    TEST_RUN(test_setup_cycles);
+    TEST_ASSERT(!livelock);
+    TEST_ASSERT_EQ(tx_overflow, 0);
+    TEST_RUN(bench_paths);
+
+    trace_off();
+    i2cRelease(i2c);
+    return TEST_EXIT();
+}
@@ -0,0 +1,501 @@
+/*
+ * LEDC fades and batched writes against a register fake.
+ *
+ * The fade engine is modelled from the registers the driver programs:
+ * duty_start latches duty, duty_inc, duty_num, duty_cycle and duty_scale,
+ * every PWM period the engine counts towards the next step, duty_rd shows
+ * the live duty and the duty_chng_end interrupt is raised after the last
+ * step. Stores into the LEDC block are traced to check what a batched
+ * write does and in which order.
+ */
+#include "host.h"
+#include "../../cores/esp32/esp32-hal-gpio.c"
+#include "../../cores/esp32/esp32-hal-matrix.c"
+#include "../../cores/esp32/esp32-hal-ledc.c"
+
+#include <math.h>
+
+/* ROM and DPORT helpers the driver links against */
+uint32_t esp_dport_access_reg_read(uint32_t reg) { return *(volatile uint32_t *)(uintptr_t)reg; }
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv)
+{
+    (void)gpio; (void)signal_idx; (void)out_inv; (void)oen_inv;
+}
+void gpio_matrix_in(uint32_t gpio, uint32_t signal_idx, bool inv) { (void)gpio; (void)signal_idx; (void)inv; }
+
+#define FADE_CHAN(chan) LEDC.channel_group[(chan) / 8].channel[(chan) % 8]
+
+/* ---------------------------------------------------------- engine model */
+
+static struct {
+    bool running;
+    bool inc;
+    uint32_t duty;      /* 21.4 like duty_rd */
+    uint32_t num, cycle, scale;
+    uint32_t count;     /* periods into the current step */
+    uint32_t periods;   /* since the ramp started */
+} engine[16];
+
+/* what the hardware does on duty_start */
+static void engine_latch(uint8_t chan)
+{
+    if (!FADE_CHAN(chan).conf1.duty_start)
+        return;
+    FADE_CHAN(chan).conf1.duty_start = 0;
+    engine[chan].running = true;
+    engine[chan].inc = FADE_CHAN(chan).conf1.duty_inc;
+    engine[chan].duty = FADE_CHAN(chan).duty.duty;
+    engine[chan].num = FADE_CHAN(chan).conf1.duty_num;
+    engine[chan].cycle = FADE_CHAN(chan).conf1.duty_cycle;
+    engine[chan].scale = FADE_CHAN(chan).conf1.duty_scale;
+    engine[chan].count = 0;
+    engine[chan].periods = 0;
+    FADE_CHAN(chan).duty_rd.duty_read = engine[chan].duty;
+}
+
+/* one PWM period of every channel, raising the interrupt of finished ramps */
+static void engine_period(void)
+{
+    uint32_t done = 0;
+    for (uint8_t chan = 0; chan < 16; chan++) {
+        engine_latch(chan);
+        if (!engine[chan].running)
+            continue;
+        engine[chan].periods++;
+        if (++engine[chan].count < engine[chan].cycle)
+            continue;
+        engine[chan].count = 0;
+        if (engine[chan].inc)
+            engine[chan].duty += engine[chan].scale << 4;
+        else
+            engine[chan].duty -= engine[chan].scale << 4;
+        FADE_CHAN(chan).duty_rd.duty_read = engine[chan].duty;
+        if (--engine[chan].num == 0) {
+            engine[chan].running = false;
+            done |= LEDC_FADE_INT(chan);
+        }
+    }
+    if (!done)
+        return;
+    LEDC.int_raw.val |= done;
+    LEDC.int_st.val = LEDC.int_raw.val & LEDC.int_ena.val;
+    if (LEDC.int_st.val)
+        hostIntrFire(ETS_LEDC_INTR_SOURCE);
+    LEDC.int_st.val = 0;
+}
+
+static uint32_t engine_run(uint8_t chan, uint32_t limit)
+{
+    uint32_t periods = 0;
+    engine_latch(chan);
+    while (engine[chan].running && periods < limit) {
+        engine_period();
+        periods++;
+    }
+    return periods;
+}
+
+typedef struct {
+    uintptr_t addr;
+    uint32_t value;
+} store_t;
+
+static store_t stores[4096];
+static volatile unsigned nstores;
+
+static volatile bool recording;
+
+static void ledc_store(uintptr_t addr, uint32_t value, void * arg)
+{
+    (void)arg;
+    /* int_clr is write only, every write clears raw bits */
+    if (addr == (uintptr_t)&LEDC.int_clr)
+        LEDC.int_raw.val &= ~value;
+    if (recording && nstores < 4096)
+        stores[nstores++] = (store_t){ addr, value };
+}
+
+static void model_on(void)
+{
+    nstores = 0;
+    hostPeriphTrace((uintptr_t)&LEDC, (uintptr_t)&LEDC + sizeof(LEDC), ledc_store, NULL);
+}
+
+static void model_off(void)
+{
+    recording = false;
+    hostPeriphUntrace();
+}
+
+static int store_chan(uintptr_t addr, size_t field)
+{
+    for (int chan = 0; chan < 16; chan++)
+        if (addr == (uintptr_t)&FADE_CHAN(chan) + field)
+            return chan;
+    return -1;
+}
+
+/* ------------------------------------------------------- legacy planner */
+
+/* ledcFadeParams() as first written: most steps, then floor(periods / num) */
+static bool legacyFadeParams(uint32_t from, uint32_t to, uint32_t periods, ledc_fade_params_t * params)
+{
+    uint32_t delta = (to > from) ? (to - from) : (from - to);
+    if (!delta || !periods || !params)
+        return false;
+    uint32_t num = delta;
+    if (num > periods)
+        num = periods;
+    if (num > LEDC_FADE_MAX)
+        num = LEDC_FADE_MAX;
+    uint32_t scale = delta / num;
+    if (scale > LEDC_FADE_MAX)
+        scale = LEDC_FADE_MAX;
+    num = delta / scale;
+    if (num > LEDC_FADE_MAX)
+        num = LEDC_FADE_MAX;
+    uint32_t cycle = periods / num;
+    if (cycle < 1)
+        cycle = 1;
+    else if (cycle > LEDC_FADE_MAX)
+        cycle = LEDC_FADE_MAX;
+    params->increase = (to > from);
+    params->start = params->increase ? (to - (num * scale)) : (to + (num * scale));
+    params->num = num;
+    params->cycle = cycle;
+    params->scale = scale;
+    return true;
+}
+
+static uint32_t rng = 47;
+
+static uint32_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+typedef struct {
+    double worst_time, mean_time;   /* |steps * cycle - periods| / periods */
+    double worst_jump, mean_jump;   /* |start - from| / |to - from| */
+    unsigned n, beyond;
+} plan_stats_t;
+
+static void plan_check(bool (*plan)(uint32_t, uint32_t, uint32_t, ledc_fade_params_t *),
+                       uint32_t from, uint32_t to, uint32_t periods, plan_stats_t * stats, bool strict)
+{
+    ledc_fade_params_t p;
+    TEST_ASSERT(plan(from, to, periods, &p));
+    uint32_t delta = to > from ? to - from : from - to;
+    if (strict) {
+        TEST_ASSERT(p.num >= 1 && p.num <= 1023);
+        TEST_ASSERT(p.cycle >= 1 && p.cycle <= 1023);
+        TEST_ASSERT(p.scale >= 1 && p.scale <= 1023);
+        TEST_ASSERT_EQ(p.increase, to > from);
+        /* ends on the target, starting between from and to */
+        TEST_ASSERT_EQ(p.increase ? p.start + p.num * p.scale : p.start - p.num * p.scale, to);
+        TEST_ASSERT(p.num * p.scale <= delta);
+    }
+    /* a few codes can not take longer than 1023 periods each, nor a few periods change more than 1023 codes each */
+    uint32_t most = delta < LEDC_FADE_MAX ? delta : LEDC_FADE_MAX;
+    uint32_t steps = periods < LEDC_FADE_MAX ? periods : LEDC_FADE_MAX;
+    if (periods > most * LEDC_FADE_MAX || delta > steps * LEDC_FADE_MAX) {
+        stats->beyond++;
+        return;
+    }
+    double time = fabs((double)p.num * p.cycle - periods) / periods;
+    double jump = (double)(delta - p.num * p.scale) / delta;
+    if (time > stats->worst_time)
+        stats->worst_time = time;
+    if (jump > stats->worst_jump)
+        stats->worst_jump = jump;
+    stats->mean_time += time;
+    stats->mean_jump += jump;
+    stats->n++;
+}
+
+/* ----------------------------------------------------------------- tests */
+
+static void test_fade_params(void)
+{
+    ledc_fade_params_t p;
+    TEST_ASSERT(!ledcFadeParams(100, 100, 1000, &p));
+    TEST_ASSERT(!ledcFadeParams(0, 100, 0, &p));
+    TEST_ASSERT(!ledcFadeParams(0, 100, 1000, NULL));
+
+    /* whole ramps end on the target, close to the time asked for */
+    TEST_ASSERT(ledcFadeParams(0, 255, 5000, &p));
+    TEST_ASSERT(p.start + p.num * p.scale == 255 && p.start < 255 / 40);
+    TEST_ASSERT(p.num * p.cycle >= 4950 && p.num * p.cycle <= 5050);
+    /* the first planner ran this in 1023 periods */
+    TEST_ASSERT(ledcFadeParams(8191, 0, 2000, &p));
+    TEST_ASSERT(!p.increase && p.start - p.num * p.scale == 0);
+    TEST_ASSERT(p.num * p.cycle >= 1960 && p.num * p.cycle <= 2040);
+    TEST_ASSERT(p.num >= 128);
+    TEST_ASSERT(ledcFadeParams(10, 11, 1, &p));
+    TEST_ASSERT(p.num == 1 && p.cycle == 1 && p.scale == 1 && p.start == 10);
+
+    /* duty resolutions 8 - 13 bits, fades of 100 to 100000 periods (20 s at 5 kHz) */
+    plan_stats_t stats = { 0 };
+    for (int i = 0; i < 200000; i++) {
+        uint32_t max = (1u << (8 + next_random() % 6)) - 1;
+        uint32_t from = next_random() % (max + 1), to = next_random() % (max + 1);
+        uint32_t periods = 100 + next_random() % ((i & 1) ? 5000 : 100000);
+        if (from == to)
+            continue;
+        plan_check(ledcFadeParams, from, to, periods, &stats, true);
+    }
+    TEST_ASSERT(stats.n > 150000);
+    TEST_ASSERT(stats.mean_time / stats.n < 0.005 && stats.worst_time < 0.15);
+    TEST_ASSERT(stats.mean_jump / stats.n < 0.001 && stats.worst_jump < 0.06);
+
+    /* the engine can not fade 2^20 codes in one step, nor stretch 8191 codes past 1023 * 1023 periods */
+    plan_check(ledcFadeParams, 0, (1 << 20) - 1, 100, &stats, false);
+    plan_check(ledcFadeParams, 0, 8191, 2000000, &stats, true);
+}
+
+static void plan_bench(const char * name, bool (*plan)(uint32_t, uint32_t, uint32_t, ledc_fade_params_t *))
+{
+    /* what sketches ask for: 5 kHz, 8 - 13 bits, 50 ms - 5 s */
+    plan_stats_t stats = { 0 };
+    rng = 1047;
+    for (int i = 0; i < 100000; i++) {
+        uint32_t max = (1u << (8 + next_random() % 6)) - 1;
+        uint32_t from = next_random() % (max + 1), to = next_random() % (max + 1);
+        uint32_t periods = 5 * (50 + next_random() % 4951);
+        if (from != to)
+            plan_check(plan, from, to, periods, &stats, false);
+    }
+    BENCH("%-16s duration off by %5.2f%% mean, %6.2f%% worst; start jump %5.2f%% mean, %5.2f%% worst (%u beyond the engine)",
+          name, stats.mean_time / stats.n * 100, stats.worst_time * 100,
+          stats.mean_jump / stats.n * 100, stats.worst_jump * 100, stats.beyond);
+}
+
+static volatile unsigned fade_done[16];
+
+static void on_fade_done(uint8_t chan, void * arg)
+{
+    TEST_ASSERT(arg == (void *)&fade_done);
+    fade_done[chan]++;
+}
+
+static void test_fade_engine(void)
+{
+    /* 5 kHz, 13 bits on a high and a low speed channel */
+    static const uint8_t chans[2] = { 2, 13 };
+    model_on();
+    for (int c = 0; c < 2; c++) {
+        uint8_t chan = chans[c];
+        double freq = ledcSetup(chan, 5000, 13);
+        TEST_ASSERT(fabs(freq - 5000) < 5);
+        ledcWrite(chan, 100);
+        engine_run(chan, 10);
+        TEST_ASSERT_EQ(ledcRead(chan), 100u);
+        TEST_ASSERT(!ledcFading(chan));
+
+        /* 400 ms is 2000 periods */
+        TEST_ASSERT(ledcFadeWithCallback(chan, 8000, 400, on_fade_done, (void *)&fade_done));
+        TEST_ASSERT(ledcFading(chan));
+        TEST_ASSERT(LEDC.int_ena.val & LEDC_FADE_INT(chan));
+        uint32_t periods = engine_run(chan, 100000);
+        TEST_ASSERT(periods >= 1960 && periods <= 2040);
+        TEST_ASSERT_EQ(FADE_CHAN(chan).duty_rd.duty_read >> 4, 8000u);
+        TEST_ASSERT_EQ(ledcRead(chan), 8000u);
+        TEST_ASSERT_EQ(fade_done[chan], 1u);
+        TEST_ASSERT(!ledcFading(chan));
+        TEST_ASSERT(!(LEDC.int_ena.val & LEDC_FADE_INT(chan)));
+
+        /* re-targeted halfway, the new ramp starts where the old one is */
+        TEST_ASSERT(ledcFade(chan, 0, 1000));
+        engine_run(chan, 2500);
+        uint32_t half = ledcRead(chan);
+        TEST_ASSERT(half > 3700 && half < 4300);
+        TEST_ASSERT(ledcFadeWithCallback(chan, 8191, 200, on_fade_done, (void *)&fade_done));
+        engine_latch(chan);
+        TEST_ASSERT(abs((int)(FADE_CHAN(chan).duty.duty >> 4) - (int)half) <= (8191 - (int)half) / 40);
+        periods = engine_run(chan, 100000);
+        TEST_ASSERT(periods >= 950 && periods <= 1050);
+        TEST_ASSERT_EQ(ledcRead(chan), 8191u);
+        TEST_ASSERT_EQ(fade_done[chan], 2u);
+
+        /* a write cancels a running fade, its callback never runs */
+        TEST_ASSERT(ledcFadeWithCallback(chan, 0, 500, on_fade_done, (void *)&fade_done));
+        engine_run(chan, 100);
+        ledcWrite(chan, 42);
+        TEST_ASSERT(!ledcFading(chan));
+        TEST_ASSERT(!(LEDC.int_ena.val & LEDC_FADE_INT(chan)));
+        engine_run(chan, 10000);
+        TEST_ASSERT_EQ(ledcRead(chan), 42u);
+        TEST_ASSERT_EQ(fade_done[chan], 2u);
+
+        /* nothing to fade: set at once, the callback runs right away */
+        TEST_ASSERT(ledcFadeWithCallback(chan, 42, 500, on_fade_done, (void *)&fade_done));
+        TEST_ASSERT_EQ(fade_done[chan], 3u);
+        TEST_ASSERT(ledcFadeWithCallback(chan, 4000, 0, on_fade_done, (void *)&fade_done));
+        TEST_ASSERT_EQ(fade_done[chan], 4u);
+        engine_run(chan, 10);
+        TEST_ASSERT_EQ(ledcRead(chan), 4000u);
+        TEST_ASSERT(!ledcFading(chan));
+    }
+    TEST_ASSERT(!ledcFade(16, 0, 100));
+    TEST_ASSERT(!ledcFading(16));
+    model_off();
+}
+
+static void test_fades_overlap(void)
+{
+    /* all 16 channels fade at once and end in their own time */
+    memset((void *)fade_done, 0, sizeof(fade_done));
+    model_on();
+    for (uint8_t chan = 0; chan < 16; chan += 2)
+        ledcSetup(chan, 1000, 10);
+    for (uint8_t chan = 0; chan < 16; chan++) {
+        ledcWrite(chan, chan & 1 ? 1023 : 0);
+        TEST_ASSERT(ledcFadeWithCallback(chan, chan & 1 ? 0 : 1023, 100 + chan * 50, on_fade_done, (void *)&fade_done));
+    }
+    unsigned periods = 0, finished = 0;
+    while (finished < 16 && periods < 10000) {
+        engine_period();
+        periods++;
+        for (uint8_t chan = 0; chan < 16; chan++) {
+            if (fade_done[chan] && engine[chan].periods) {
+                /* within 3% of 100 + chan * 50 ms at 1 kHz */
+                double want = 100 + chan * 50;
+                TEST_ASSERT(fabs(engine[chan].periods - want) <= want * 0.03);
+                TEST_ASSERT_EQ(ledcRead(chan), chan & 1 ? 0u : 1023u);
+                engine[chan].periods = 0;
+                finished++;
+            }
+        }
+    }
+    TEST_ASSERT_EQ(finished, 16u);
+    for (uint8_t chan = 0; chan < 16; chan++) {
+        TEST_ASSERT_EQ(fade_done[chan], 1u);
+        TEST_ASSERT(!ledcFading(chan));
+    }
+    model_off();
+}
+
+/* ------------------------------------------------------- batched writes */
+
+static void test_write_multi(void)
+{
+    model_on();
+    for (uint8_t chan = 0; chan < 16; chan += 2)
+        ledcSetup(chan, 5000, 12);
+    uint32_t duties[16];
+    for (int i = 0; i < 16; i++)
+        duties[i] = 100 * i + 7;
+
+    /* channels 1, 3, 8 and 15, values in channel order, 0 turns off */
+    uint16_t mask = BIT(1) | BIT(3) | BIT(8) | BIT(15);
+    duties[2] = 0;
+    recording = true;
+    ledcWriteMulti(mask, duties);
+    recording = false;
+    TEST_ASSERT_EQ(ledcRead(1), 7u);
+    TEST_ASSERT_EQ(ledcRead(3), 107u);
+    TEST_ASSERT_EQ(ledcRead(8), 0u);
+    TEST_ASSERT_EQ(ledcRead(15), 307u);
+    TEST_ASSERT(!FADE_CHAN(8).conf0.sig_out_en && FADE_CHAN(15).conf0.sig_out_en);
+
+    /* every duty is loaded before the first duty_start */
+    unsigned last_duty = 0, first_start = nstores, starts = 0;
+    for (unsigned i = 0; i < nstores; i++) {
+        int chan = store_chan(stores[i].addr, offsetof(ledc_dev_t, channel_group[0].channel[0].duty));
+        if (chan >= 0) {
+            TEST_ASSERT(mask & BIT(chan));
+            last_duty = i;
+        }
+        chan = store_chan(stores[i].addr, offsetof(ledc_dev_t, channel_group[0].channel[0].conf1));
+        if (chan >= 0 && (stores[i].value & LEDC_DUTY_START_HSCH0)) {
+            if (first_start == nstores)
+                first_start = i;
+            starts++;
+        }
+    }
+    TEST_ASSERT(last_duty < first_start);
+    TEST_ASSERT_EQ(starts, 3u);
+
+    /* a running fade is cancelled by the batch */
+    TEST_ASSERT(ledcFade(3, 4000, 500));
+    engine_run(3, 10);
+    ledcWriteMulti(BIT(3), duties);
+    TEST_ASSERT(!ledcFading(3));
+    engine_run(3, 10);
+    TEST_ASSERT_EQ(ledcRead(3), 7u);
+
+    ledcWriteMulti(0, duties);
+    ledcWriteMulti(BIT(3), NULL);
+    TEST_ASSERT_EQ(ledcRead(3), 7u);
+    model_off();
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+static void bench_fade_params(void)
+{
+    plan_bench("legacy params", legacyFadeParams);
+    plan_bench("ledcFadeParams", ledcFadeParams);
+
+    ledc_fade_params_t p;
+    unsigned n = hostIterations(2000000);
+    uint32_t sum = 0;
+    rng = 2047;
+    uint64_t t0 = hostNowNs();
+    for (unsigned i = 0; i < n; i++) {
+        uint32_t r = next_random();
+        ledcFadeParams(r & 0x1FFF, (r >> 13) & 0x1FFF, 250 + (r >> 26) * 400, &p);
+        sum += p.num;
+    }
+    double s = (hostNowNs() - t0) / 1e9;
+    BENCH("ledcFadeParams  %7.0f ns per plan (%u)", s * 1e9 / n, sum & 1);
+}
+
+static void bench_frame(void)
+{
+    /* one animation frame of 16 channels */
+    for (uint8_t chan = 0; chan < 16; chan += 2)
+        ledcSetup(chan, 5000, 12);
+    uint32_t duties[16];
+    unsigned n = hostIterations(200000);
+    for (int m = 0; m < 2; m++) {
+        model_on();
+        recording = true;
+        for (int i = 0; i < 16; i++)
+            duties[i] = i * 200 + 1;
+        if (m)
+            ledcWriteMulti(0xFFFF, duties);
+        else
+            for (uint8_t chan = 0; chan < 16; chan++)
+                ledcWrite(chan, duties[chan]);
+        model_off();
+        unsigned frame_stores = nstores;
+        uint64_t t0 = hostNowNs();
+        for (unsigned f = 0; f < n; f++) {
+            for (int i = 0; i < 16; i++)
+                duties[i] = (f * 7 + i * 200) & 0xFFF;
+            if (m)
+                ledcWriteMulti(0xFFFF, duties);
+            else
+                for (uint8_t chan = 0; chan < 16; chan++)
+                    ledcWrite(chan, duties[chan]);
+        }
+        double s = (hostNowNs() - t0) / 1e9;
+        BENCH("16 channels, %-14s %3u register stores, %6.2f us per frame",
+              m ? "ledcWriteMulti" : "16x ledcWrite", frame_stores, s * 1e6 / n);
+    }
+}
+
+int main(void)
+{
+    TEST_RUN(test_fade_params);
+    TEST_RUN(test_fade_engine);
+    TEST_RUN(test_fades_overlap);
+    TEST_RUN(test_write_multi);
+    TEST_RUN(bench_fade_params);
+    TEST_RUN(bench_frame);
+    return TEST_EXIT();
+}
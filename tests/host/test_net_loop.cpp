@@ -0,0 +1,350 @@
+/*
+ * NetLoop, one select() over servers and sockets, against the sketch loop
+ * that polls WiFiServer::available() for new connections.
+ *
+ * The tests drive real listening sockets on loopback and socket pairs from
+ * the main thread, which runs the loop. The benchmarks measure what the
+ * loop task costs with nothing to do, as CPU time of the thread over wall
+ * time, and how long a connection waits between connect() in a client
+ * thread and the accept callback. The host has one core here, as the ESP32
+ * application core is shared with the other tasks on it.
+ */
+#include "host.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <WiFi.h>
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/WiFi/src/WiFiServer.cpp"
+#include "../../libraries/WiFi/src/NetLoop.cpp"
+
+static uint16_t port_of(int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr*)&addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+static int connect_to(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ----------------------------------------------------------------- tests */
+
+static void test_accepts_every_pending_connection(void)
+{
+    WiFiServer http(0), telnet(0), custom(0);
+    http.begin();
+    telnet.begin();
+    custom.begin();
+    WiFiServer* servers[] = { &http, &telnet, &custom };
+    int accepted[3] = { 0, 0, 0 };
+    std::vector<WiFiClient> clients;
+
+    NetLoop net;
+    for (int s = 0; s < 3; s++) {
+        TEST_ASSERT(net.addServer(*servers[s], [&, s](WiFiClient client) {
+            TEST_ASSERT_EQ(port_of(client.fd()), port_of(servers[s]->fd()));
+            accepted[s]++;
+            clients.push_back(client);
+        }));
+    }
+    TEST_ASSERT_EQ(net.count(), 3);
+
+    /* select() reports a listener once, however many are waiting */
+    std::vector<int> fds;
+    for (int s = 0; s < 3; s++)
+        for (int i = 0; i <= s; i++)
+            fds.push_back(connect_to(port_of(servers[s]->fd())));
+    TEST_ASSERT_EQ(net.run(1000), 6);
+    TEST_ASSERT(accepted[0] == 1 && accepted[1] == 2 && accepted[2] == 3);
+
+    /* nothing more to do */
+    TEST_ASSERT_EQ(net.run(10), 0);
+
+    net.remove(telnet);
+    TEST_ASSERT_EQ(net.count(), 2);
+    fds.push_back(connect_to(port_of(telnet.fd())));
+    TEST_ASSERT_EQ(net.run(10), 0);
+    TEST_ASSERT_EQ(accepted[1], 2);
+
+    for (size_t i = 0; i < fds.size(); i++)
+        ::close(fds[i]);
+    for (size_t i = 0; i < clients.size(); i++)
+        clients[i].stop();
+}
+
+static void test_readable_and_writable(void)
+{
+    int a[2], b[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, a);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, b);
+    int readable = 0, writable = 0;
+    NetLoop net;
+    TEST_ASSERT(net.addSocket(a[0], [&](int fd) {
+        char buf[16];
+        TEST_ASSERT_EQ(fd, a[0]);
+        if (recv(fd, buf, sizeof(buf), 0) <= 0)
+            net.remove(fd);
+        readable++;
+    }, [&](int fd) {
+        TEST_ASSERT_EQ(fd, a[0]);
+        writable++;
+    }));
+
+    /* writable is only asked for while it is on */
+    TEST_ASSERT_EQ(net.run(10), 0);
+    net.setWritable(a[0], true);
+    TEST_ASSERT_EQ(net.run(10), 1);
+    TEST_ASSERT_EQ(writable, 1);
+    net.setWritable(a[0], false);
+
+    send(a[1], "x", 1, 0);
+    TEST_ASSERT_EQ(net.run(10), 1);
+    TEST_ASSERT(readable == 1 && writable == 1);
+
+    /* a callback removing a socket before its turn */
+    TEST_ASSERT(net.addSocket(b[0], [&](int fd) {
+        (void)fd;
+        TEST_ASSERT(false);
+    }));
+    net.remove(a[0]);
+    TEST_ASSERT(net.addSocket(a[0], [&](int fd) {
+        char buf[16];
+        recv(fd, buf, sizeof(buf), 0);
+        net.remove(b[0]);
+        readable++;
+    }));
+    send(a[1], "x", 1, 0);
+    send(b[1], "x", 1, 0);
+    TEST_ASSERT_EQ(net.run(10), 1);
+    TEST_ASSERT_EQ(readable, 2);
+    TEST_ASSERT_EQ(net.count(), 1);
+
+    /* the table holds NETLOOP_MAX_SOCKETS */
+    std::vector<int> fds;
+    while (net.count() < NETLOOP_MAX_SOCKETS) {
+        int s[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, s);
+        fds.push_back(s[0]);
+        fds.push_back(s[1]);
+        TEST_ASSERT(net.addSocket(s[0], [](int fd) { (void)fd; }));
+    }
+    TEST_ASSERT(!net.addSocket(b[0], [](int fd) { (void)fd; }));
+    /* registering again only replaces the callbacks */
+    TEST_ASSERT(net.addSocket(a[0], [](int fd) { (void)fd; }));
+    TEST_ASSERT_EQ(net.count(), NETLOOP_MAX_SOCKETS);
+
+    for (size_t i = 0; i < fds.size(); i++)
+        ::close(fds[i]);
+    ::close(a[0]);
+    ::close(a[1]);
+    ::close(b[0]);
+    ::close(b[1]);
+}
+
+static NetLoop* waking;
+
+static void* wake_later(void* arg)
+{
+    (void)arg;
+    delay(20);
+    waking->wake();
+    return NULL;
+}
+
+static void test_timeout_and_wake(void)
+{
+    WiFiServer server(0);
+    server.begin();
+    NetLoop net(true);
+    net.addServer(server, [](WiFiClient client) { (void)client; });
+
+    uint64_t t0 = hostNowNs();
+    TEST_ASSERT_EQ(net.run(50), 0);
+    uint64_t ms = (hostNowNs() - t0) / 1000000;
+    TEST_ASSERT(ms >= 49 && ms < 500);
+
+    /* another task ends a run without a limit */
+    waking = &net;
+    pthread_t thread;
+    t0 = hostNowNs();
+    pthread_create(&thread, NULL, wake_later, NULL);
+    TEST_ASSERT_EQ(net.run(), 0);
+    ms = (hostNowNs() - t0) / 1000000;
+    pthread_join(thread, NULL);
+    TEST_ASSERT(ms >= 19 && ms < 500);
+
+    /* the wake is used up */
+    TEST_ASSERT_EQ(net.run(10), 0);
+
+    /* without sockets a run only waits */
+    NetLoop empty;
+    t0 = hostNowNs();
+    TEST_ASSERT_EQ(empty.run(20), 0);
+    TEST_ASSERT((hostNowNs() - t0) / 1000000 >= 19);
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+enum Mode { POLL_BUSY, POLL_DELAY, NET_LOOP };
+static const char* const MODE_NAMES[] = { "poll available()", "poll + delay(1)", "NetLoop run()" };
+
+/* the sketch loop() serving three servers, one pass per step() */
+struct LoopTask {
+    WiFiServer* servers[3];
+    NetLoop net;
+    Mode mode;
+    std::function<void(WiFiClient)> onAccept;
+
+    void begin(Mode m, std::function<void(WiFiClient)> accept) {
+        mode = m;
+        onAccept = accept;
+        for (int s = 0; s < 3; s++) {
+            servers[s] = new WiFiServer(0);
+            servers[s]->begin();
+            if (mode == NET_LOOP)
+                net.addServer(*servers[s], onAccept);
+        }
+    }
+
+    void step() {
+        if (mode == NET_LOOP) {
+            net.run(1000);
+            return;
+        }
+        for (int s = 0; s < 3; s++) {
+            WiFiClient client = servers[s]->available();
+            if (client)
+                onAccept(client);
+        }
+        if (mode == POLL_DELAY)
+            delay(1);
+    }
+
+    void end() {
+        for (int s = 0; s < 3; s++) {
+            if (mode == NET_LOOP)
+                net.remove(*servers[s]);
+            servers[s]->end();
+            delete servers[s];
+        }
+    }
+};
+
+struct Connector {
+    uint16_t ports[3];
+    unsigned count;
+    std::atomic<uint64_t> started;
+    std::atomic<unsigned> accepted;
+    pthread_t thread;
+};
+
+/* connects every 2-4 ms to one of the servers and waits to be accepted */
+static void* connector_main(void* arg)
+{
+    Connector* c = (Connector*)arg;
+    for (unsigned i = 0; i < c->count; i++) {
+        struct timespec ts = { 0, (long)(2000000 + rand() % 2000000) };
+        nanosleep(&ts, NULL);
+        c->started = hostNowNs();
+        int fd = connect_to(c->ports[rand() % 3]);
+        while (c->accepted <= i) {
+            struct timespec poll = { 0, 50000 };
+            nanosleep(&poll, NULL);
+        }
+        ::close(fd);
+    }
+    return NULL;
+}
+
+static void bench_idle_cpu(void)
+{
+    for (int m = 0; m < 3; m++) {
+        LoopTask task;
+        task.begin((Mode)m, [](WiFiClient client) { (void)client; });
+        uint64_t wall = hostIterations(20) * 25000000ULL;
+        uint64_t t0 = hostNowNs(), cpu0 = thread_cpu_ns(), passes = 0;
+        do {
+            if (m == NET_LOOP)
+                task.net.run(wall / 1000000);
+            else
+                task.step();
+            passes++;
+        } while (hostNowNs() - t0 < wall);
+        double busy = (double)(thread_cpu_ns() - cpu0) / (hostNowNs() - t0);
+        BENCH("idle, 3 servers, %-17s %6.2f%% CPU, %9.0f passes/s",
+              MODE_NAMES[m], busy * 100, passes / ((hostNowNs() - t0) / 1e9));
+        task.end();
+    }
+}
+
+static void bench_accept_latency(void)
+{
+    for (int m = 0; m < 3; m++) {
+        Connector c;
+        c.count = hostIterations(400);
+        c.accepted = 0;
+        std::vector<double> us;
+        LoopTask task;
+        task.begin((Mode)m, [&](WiFiClient client) {
+            us.push_back((hostNowNs() - c.started) / 1e3);
+            client.stop();
+            c.accepted++;
+        });
+        for (int s = 0; s < 3; s++)
+            c.ports[s] = port_of(task.servers[s]->fd());
+        srand(44);
+        uint64_t t0 = hostNowNs(), cpu0 = thread_cpu_ns();
+        pthread_create(&c.thread, NULL, connector_main, &c);
+        while (c.accepted < c.count)
+            task.step();
+        pthread_join(c.thread, NULL);
+        double busy = (double)(thread_cpu_ns() - cpu0) / (hostNowNs() - t0);
+        task.end();
+
+        std::sort(us.begin(), us.end());
+        double sum = 0;
+        for (size_t i = 0; i < us.size(); i++)
+            sum += us[i];
+        BENCH("accept, %-17s mean %7.1f us, median %7.1f us, p99 %7.1f us, loop CPU %6.2f%%",
+              MODE_NAMES[m], sum / us.size(), us[us.size() / 2], us[us.size() * 99 / 100], busy * 100);
+    }
+}
+
+int main(void)
+{
+    /* lwIP reports a closed peer with an error, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+    TEST_RUN(test_accepts_every_pending_connection);
+    TEST_RUN(test_readable_and_writable);
+    TEST_RUN(test_timeout_and_wake);
+    TEST_RUN(bench_idle_cpu);
+    TEST_RUN(bench_accept_latency);
+    return TEST_EXIT();
+}
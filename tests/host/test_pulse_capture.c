@@ -0,0 +1,456 @@
+/*
+ * Deterministic simulation of the interrupt driven pulse capture.
+ *
+ * Edge timelines for several pins are merged and replayed on the manual
+ * clock: for every edge the pin level is set in GPIO.in, the pin's status
+ * bit is raised and the GPIO interrupt is fired after a modelled latency.
+ * The pulses read back are compared with the ones that were generated.
+ */
+#include <malloc.h>
+#include <pthread.h>
+
+#include "host.h"
+#include "../../cores/esp32/esp32-hal-gpio.c"
+#include "../../cores/esp32/wiring_pulse.c"
+
+#define MAX_EDGES 400000
+
+typedef struct {
+    uint32_t time;
+    uint8_t pin;
+    uint8_t level;
+} edge_t;
+
+static edge_t timeline[MAX_EDGES];
+static size_t timeline_len;
+
+static uint32_t lcg(void)
+{
+    static uint32_t x = 2024;
+    x = x * 1103515245 + 12345;
+    return x >> 8;
+}
+
+static void set_level(uint8_t pin, uint8_t level)
+{
+    volatile uint32_t *in = pin < 32 ? &GPIO.in : &GPIO.in1.val;
+    uint32_t bit = 1u << (pin & 31);
+    *in = level ? (*in | bit) : (*in & ~bit);
+}
+
+/* Raise the status bits of pins and run the GPIO ISR as the CPU would. */
+static void fire(uint64_t pins)
+{
+    GPIO.status = (uint32_t)pins;
+    GPIO.status1.val = (uint32_t)(pins >> 32);
+    hostIntrFire(ETS_GPIO_INTR_SOURCE);
+    GPIO.status = 0;
+    GPIO.status1.val = 0;
+}
+
+/* A square-ish wave on pin: high for high_us, low for low_us, n periods. */
+static void add_wave(uint8_t pin, uint32_t start, int n,
+                     uint32_t (*high_us)(int), uint32_t (*low_us)(int))
+{
+    uint32_t t = start;
+    for (int i = 0; i < n && timeline_len + 2 <= MAX_EDGES; i++) {
+        timeline[timeline_len++] = (edge_t){ t, pin, 1 };
+        t += high_us(i);
+        timeline[timeline_len++] = (edge_t){ t, pin, 0 };
+        t += low_us(i);
+    }
+}
+
+static int by_time(const void *a, const void *b)
+{
+    const edge_t *x = a, *y = b;
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+/* ultrasonic echo: 150 us .. 25 ms, one ping every 30 ms */
+static uint32_t echo_high(int i) { return 150 + (i * 7919u) % 24850; }
+static uint32_t echo_low(int i) { return 30000 - echo_high(i); }
+/* flow meter: 200 .. 1200 Hz, 50 % duty */
+static uint32_t flow_half(int i) { return 400 + (i * 37u) % 2100; }
+/* 20 kHz PWM at 30 % */
+static uint32_t pwm_high(int i) { return 15; }
+static uint32_t pwm_low(int i) { return 35; }
+/* random pulse train */
+static uint32_t rnd_a(int i) { return 20 + lcg() % 3000; }
+
+typedef struct {
+    uint8_t pin;
+    size_t pulses;
+    uint32_t max_err;
+    uint64_t sum_err;
+} channel_t;
+
+/*
+ * Replays the timeline. Edges that are less than the ISR latency apart are
+ * serviced by one interrupt, like the real shared GPIO interrupt. The
+ * reader drains all channels every read_every_us of simulated time.
+ */
+static void replay(channel_t *ch, int nch, uint32_t max_latency, uint32_t read_every_us,
+                   void (*check)(channel_t *, const pulse_t *, size_t))
+{
+    qsort(timeline, timeline_len, sizeof(edge_t), by_time);
+    uint32_t next_read = read_every_us;
+    pulse_t buf[64];
+    for (size_t i = 0; i < timeline_len;) {
+        uint32_t latency = max_latency ? 1 + lcg() % max_latency : 0;
+        uint32_t isr_at = timeline[i].time + latency;
+        uint64_t pins = 0;
+        while (i < timeline_len && timeline[i].time <= isr_at) {
+            set_level(timeline[i].pin, timeline[i].level);
+            pins |= 1ull << timeline[i].pin;
+            i++;
+        }
+        hostClockSet(isr_at);
+        fire(pins);
+        while (isr_at >= next_read || i == timeline_len) {
+            for (int c = 0; c < nch; c++) {
+                size_t n;
+                while ((n = readPulses(ch[c].pin, buf, 64))) {
+                    check(&ch[c], buf, n);
+                }
+            }
+            if (i == timeline_len) {
+                break;
+            }
+            next_read += read_every_us;
+        }
+    }
+}
+
+/* expected pulses per pin, in order */
+static edge_t *expect[GPIO_PIN_COUNT];
+static size_t expect_len[GPIO_PIN_COUNT], expect_pos[GPIO_PIN_COUNT];
+
+static void build_expectations(void)
+{
+    for (int p = 0; p < GPIO_PIN_COUNT; p++) {
+        free(expect[p]);
+        expect[p] = NULL;
+        expect_len[p] = expect_pos[p] = 0;
+    }
+    for (size_t i = 0; i < timeline_len; i++) {
+        uint8_t p = timeline[i].pin;
+        expect[p] = realloc(expect[p], (expect_len[p] + 1) * sizeof(edge_t));
+        expect[p][expect_len[p]++] = timeline[i];
+    }
+}
+
+static void check_pulses(channel_t *ch, const pulse_t *got, size_t n)
+{
+    for (size_t k = 0; k < n; k++) {
+        size_t e = expect_pos[ch->pin]++;
+        if (e + 1 >= expect_len[ch->pin]) {
+            TEST_ASSERT(!"more pulses than edges");
+            return;
+        }
+        const edge_t *a = &expect[ch->pin][e], *b = &expect[ch->pin][e + 1];
+        uint32_t want = b->time - a->time;
+        uint32_t err = got[k].width > want ? got[k].width - want : want - got[k].width;
+        TEST_ASSERT_EQ(got[k].level, a->level);
+        ch->pulses++;
+        ch->sum_err += err;
+        if (err > ch->max_err) {
+            ch->max_err = err;
+        }
+    }
+}
+
+static void start(channel_t *ch, int nch, size_t depth)
+{
+    for (int c = 0; c < nch; c++) {
+        pinMode(ch[c].pin, INPUT);
+        set_level(ch[c].pin, 0);
+        TEST_ASSERT(pulseCaptureBegin(ch[c].pin, depth));
+    }
+}
+
+static void stop(channel_t *ch, int nch)
+{
+    for (int c = 0; c < nch; c++) {
+        pulseCaptureEnd(ch[c].pin);
+    }
+}
+
+static void test_exact_without_latency(void)
+{
+    channel_t ch[] = { { 4 }, { 13 } };
+    timeline_len = 0;
+    add_wave(4, 1000, 100, echo_high, echo_low);
+    add_wave(13, 1003, 500, flow_half, flow_half);
+    build_expectations();
+    start(ch, 2, 64);
+    replay(ch, 2, 0, 1000, check_pulses);
+    for (int c = 0; c < 2; c++) {
+        TEST_ASSERT_EQ(ch[c].pulses, expect_len[ch[c].pin] - 1);
+        TEST_ASSERT_EQ(ch[c].max_err, 0);
+        TEST_ASSERT_EQ(pulseCaptureOverruns(ch[c].pin), 0);
+    }
+    stop(ch, 2);
+}
+
+static void test_four_channels_with_isr_latency(void)
+{
+    const uint32_t latency = 6;
+    channel_t ch[] = { { 4 }, { 13 }, { 27 }, { 34 } };
+    timeline_len = 0;
+    add_wave(4, 1000, 300, echo_high, echo_low);
+    add_wave(13, 1011, 5000, flow_half, flow_half);
+    add_wave(27, 1023, 90000, pwm_high, pwm_low);
+    add_wave(34, 1037, 2000, rnd_a, rnd_a);
+    build_expectations();
+    start(ch, 4, 512);
+    replay(ch, 4, latency, 2000, check_pulses);
+    for (int c = 0; c < 4; c++) {
+        TEST_ASSERT_EQ(ch[c].pulses, expect_len[ch[c].pin] - 1);
+        TEST_ASSERT(ch[c].max_err <= latency);
+        TEST_ASSERT_EQ(pulseCaptureOverruns(ch[c].pin), 0);
+        BENCH("pin %2u: %6zu pulses, error mean %.2f us max %u us (ISR latency 1..%u us)",
+              ch[c].pin, ch[c].pulses, (double)ch[c].sum_err / ch[c].pulses,
+              ch[c].max_err, latency);
+    }
+    stop(ch, 4);
+}
+
+static void test_overrun_breaks_pairing(void)
+{
+    const uint8_t pin = 5;
+    pinMode(pin, INPUT);
+    TEST_ASSERT(pulseCaptureBegin(pin, 8));
+    for (int i = 0; i < 20; i++) {
+        hostClockSet(10000 + i * 100);
+        set_level(pin, !(i & 1));
+        fire(1ull << pin);
+    }
+    TEST_ASSERT_EQ(pulseCaptureOverruns(pin), 12);
+    pulse_t p[16];
+    TEST_ASSERT_EQ(readPulses(pin, p, 16), 7);
+    for (int i = 0; i < 7; i++) {
+        TEST_ASSERT_EQ(p[i].width, 100);
+    }
+    /* the first edge after the lost ones starts a new pulse */
+    for (int i = 0; i < 3; i++) {
+        hostClockSet(20000 + i * 250);
+        set_level(pin, i & 1);
+        fire(1ull << pin);
+    }
+    TEST_ASSERT_EQ(readPulses(pin, p, 16), 2);
+    TEST_ASSERT_EQ(p[0].start, 20000);
+    TEST_ASSERT_EQ(p[0].width, 250);
+    TEST_ASSERT_EQ(p[0].level, 0);
+    pulseCaptureEnd(pin);
+}
+
+static void test_bounce_keeps_first_edge(void)
+{
+    const uint8_t pin = 18;
+    pinMode(pin, INPUT);
+    TEST_ASSERT(pulseCaptureBegin(pin, 16));
+    /* a glitch gives two interrupts that both sample the level high */
+    set_level(pin, 1);
+    hostClockSet(5000);
+    fire(1ull << pin);
+    hostClockSet(5001);
+    fire(1ull << pin);
+    set_level(pin, 0);
+    hostClockSet(5400);
+    fire(1ull << pin);
+    pulse_t p;
+    TEST_ASSERT_EQ(readPulses(pin, &p, 1), 1);
+    TEST_ASSERT_EQ(p.start, 5000);
+    TEST_ASSERT_EQ(p.width, 400);
+    TEST_ASSERT_EQ(p.level, 1);
+    pulseCaptureEnd(pin);
+}
+
+static void user_isr(void) {}
+
+static void test_refuses_pin_with_handler(void)
+{
+    attachInterrupt(19, user_isr, RISING);
+    TEST_ASSERT(!pulseCaptureBegin(19, 16));
+    TEST_ASSERT(__pinInterruptHandlers[19].fn == __onPinInterruptNoArg);
+    detachInterrupt(19);
+    TEST_ASSERT(pulseCaptureBegin(19, 16));
+    TEST_ASSERT(pulseCaptureBegin(19, 16));     /* already capturing */
+    pulseCaptureEnd(19);
+    TEST_ASSERT(!pulseCaptureBegin(24, 16));    /* no such pin */
+    TEST_ASSERT(!pulseCaptureBegin(19, 0));
+}
+
+static void test_pulse_in_async(void)
+{
+    const uint8_t pin = 21;
+    unsigned long w = 0;
+    pinMode(pin, INPUT);
+    set_level(pin, 0);
+    TEST_ASSERT(!pulseInAsync(pin, HIGH, &w));  /* starts capturing */
+    uint32_t t[] = { 100, 350, 1000, 1090 };
+    for (int i = 0; i < 4; i++) {
+        hostClockSet(t[i]);
+        set_level(pin, !(i & 1));
+        fire(1ull << pin);
+    }
+    TEST_ASSERT(pulseInAsync(pin, HIGH, &w));
+    TEST_ASSERT_EQ(w, 250);
+    TEST_ASSERT(pulseInAsync(pin, HIGH, &w));
+    TEST_ASSERT_EQ(w, 90);
+    TEST_ASSERT(!pulseInAsync(pin, HIGH, &w));
+    pulseCaptureEnd(pin);
+}
+
+static volatile bool feeding;
+
+static void *feed_pulse(void *arg)
+{
+    const uint8_t pin = 22;
+    vTaskDelay(5);
+    for (int i = 0; feeding; i++) {
+        hostClockAdvance(i & 1 ? 100 : 730);
+        set_level(pin, i & 1);
+        fire(1ull << pin);
+        vTaskDelay(1);
+    }
+    return NULL;
+}
+
+static void test_pulse_in_on_captured_pin(void)
+{
+    const uint8_t pin = 22;
+    pinMode(pin, INPUT);
+    set_level(pin, 0);
+    TEST_ASSERT(pulseCaptureBegin(pin, 64));
+    pthread_t t;
+    feeding = true;
+    pthread_create(&t, NULL, feed_pulse, NULL);
+    TEST_ASSERT_EQ(pulseIn(pin, HIGH, 1000000), 730);
+    feeding = false;
+    pthread_join(t, NULL);
+    pulseCaptureEnd(pin);
+}
+
+static volatile bool storming;
+
+static void *interrupt_storm(void *arg)
+{
+    while (storming) {
+        set_level(23, lcg() & 1);
+        fire(1ull << 23);
+    }
+    return NULL;
+}
+
+/* pulseCaptureEnd() must not free a ring the ISR is still filling */
+static void test_end_races_isr(void)
+{
+    pinMode(23, INPUT);
+    pthread_t t;
+    storming = true;
+    pthread_create(&t, NULL, interrupt_storm, NULL);
+    for (unsigned i = 0; i < hostIterations(20000); i++) {
+        TEST_ASSERT(pulseCaptureBegin(23, 4 + (i & 31)));
+        pulse_t p[4];
+        readPulses(23, p, 4);
+        pulseCaptureEnd(23);
+    }
+    storming = false;
+    pthread_join(t, NULL);
+    TEST_ASSERT(__pulseCaptures[23] == NULL);
+}
+
+/* a reader inside the capture keeps it alive across pulseCaptureEnd() */
+static void test_end_waits_for_reader(void)
+{
+    const uint8_t pin = 26;
+    pinMode(pin, INPUT);
+    TEST_ASSERT(pulseCaptureBegin(pin, 8));
+    pulse_capture_t *cap = __pulseCaptureGet(pin);
+    TEST_ASSERT(cap != NULL);
+    pulseCaptureEnd(pin);
+    TEST_ASSERT(__pulseCaptures[pin] == NULL);
+    TEST_ASSERT(cap->ended);
+    TEST_ASSERT_EQ(cap->users, 1);
+    TEST_ASSERT_EQ(cap->mask, 7);               /* not freed yet */
+    TEST_ASSERT_EQ(readPulses(pin, NULL, 0), 0);
+    pulse_t p;
+    TEST_ASSERT_EQ(readPulses(pin, &p, 1), 0);  /* ended for new readers */
+    TEST_ASSERT_EQ(pulseCaptureOverruns(pin), 0);
+    __pulseCapturePut(cap);                     /* the last reader frees it */
+    TEST_ASSERT(pulseCaptureBegin(pin, 8));
+    pulseCaptureEnd(pin);
+}
+
+static volatile bool reading;
+
+static void *pulse_reader(void *arg)
+{
+    pulse_t p[8];
+    while (reading) {
+        readPulses(23, p, 8);
+        pulseCaptureOverruns(23);
+    }
+    return NULL;
+}
+
+/* readPulses() on one task, begin/end on another, edges from a third;
+ * freed memory is poisoned so a read after free shows up */
+static void test_end_races_reader(void)
+{
+    pinMode(23, INPUT);
+    mallopt(M_PERTURB, 0xa5);
+    pthread_t isr, reader;
+    storming = reading = true;
+    pthread_create(&isr, NULL, interrupt_storm, NULL);
+    pthread_create(&reader, NULL, pulse_reader, NULL);
+    for (unsigned i = 0; i < hostIterations(20000); i++) {
+        TEST_ASSERT(pulseCaptureBegin(23, 4 + (i & 31)));
+        sched_yield();
+        pulseCaptureEnd(23);
+    }
+    storming = reading = false;
+    pthread_join(isr, NULL);
+    pthread_join(reader, NULL);
+    mallopt(M_PERTURB, 0);
+    TEST_ASSERT(__pulseCaptures[23] == NULL);
+}
+
+static void bench_isr_cost(void)
+{
+    const uint8_t pin = 25;
+    pinMode(pin, INPUT);
+    pulseCaptureBegin(pin, 1024);
+    pulse_t p[512];
+    unsigned n = hostIterations(2000000);
+    uint64_t t0 = hostNowNs();
+    for (unsigned i = 0; i < n; i++) {
+        set_level(pin, i & 1);
+        fire(1ull << pin);
+        if ((i & 511) == 511) {
+            readPulses(pin, p, 512);
+        }
+    }
+    BENCH("host cost per captured edge (ISR dispatch + ring + read): %.0f ns",
+          (double)(hostNowNs() - t0) / n);
+    pulseCaptureEnd(pin);
+}
+
+int main(void)
+{
+    hostClockManual(true);
+    TEST_RUN(test_exact_without_latency);
+    TEST_RUN(test_four_channels_with_isr_latency);
+    TEST_RUN(test_overrun_breaks_pairing);
+    TEST_RUN(test_bounce_keeps_first_edge);
+    TEST_RUN(test_refuses_pin_with_handler);
+    TEST_RUN(test_pulse_in_async);
+    TEST_RUN(test_pulse_in_on_captured_pin);
+    TEST_RUN(test_end_races_isr);
+    TEST_RUN(test_end_waits_for_reader);
+    TEST_RUN(test_end_races_reader);
+    TEST_RUN(bench_isr_cost);
+    return TEST_EXIT();
+}
@@ -0,0 +1,351 @@
+/*
+ * The SPI SD driver's sector cache and read-ahead against the simulated card.
+ *
+ * sd_diskio.cpp talks to common/sdcard_sim.cpp through SPIClass; FatFs and
+ * the VFS are the stand-ins in common/fatfs.c, so the tests drive
+ * ff_sd_read/write/ioctl the way FatFs does. Commands, blocks and time come from the simulator (25 MHz bus,
+ * the latencies in sdsim_timing).
+ */
+#include "host.h"
+#include "sdcard_sim.h"
+
+extern "C" {
+#include "../../libraries/SD/src/sd_diskio_crc.c"
+}
+#include "../../libraries/SD/src/sd_diskio.cpp"
+
+#define SECTORS     (64 * 1024)     /* 32 MB */
+#define FAT_START   32
+#define FAT_SECTORS 64
+#define DATA_START  (FAT_START + 2 * FAT_SECTORS)
+
+static uint8_t pdrv;
+
+static void card_begin(uint16_t lines, uint16_t readahead)
+{
+    sdsimInsert(SECTORS, true);
+    sdsimFormat(FAT_START, FAT_SECTORS);
+    pdrv = sdcard_init(5, &SPI, 25000000);
+    TEST_ASSERT_EQ(pdrv, 0);
+    if (lines || readahead) {
+        TEST_ASSERT(sdcard_cache(pdrv, lines, readahead, false));
+    }
+    TEST_ASSERT(sdcard_mount(pdrv, "/sd"));
+    TEST_ASSERT_EQ(sdcard_type(pdrv), CARD_SDHC);
+    TEST_ASSERT_EQ(sdcard_num_sectors(pdrv), SECTORS);
+    sdsimStats(NULL, true);
+}
+
+static void card_end(void)
+{
+    sdcard_unmount(pdrv);
+    sdcard_uninit(pdrv);
+}
+
+static void fill(uint8_t* buf, uint32_t sector, unsigned gen)
+{
+    for (int i = 0; i < 512; i++) {
+        buf[i] = (uint8_t)(sector * 7 + i + gen * 13);
+    }
+}
+
+static void test_init_and_plain_io(void)
+{
+    card_begin(0, 0);
+    uint8_t out[4 * 512], in[4 * 512];
+    for (int i = 0; i < 4; i++) {
+        fill(out + i * 512, 1000 + i, 1);
+    }
+    TEST_ASSERT_EQ(ff_sd_write(pdrv, out, 1000, 1), RES_OK);
+    TEST_ASSERT_EQ(ff_sd_write(pdrv, out + 512, 1001, 3), RES_OK);
+    TEST_ASSERT(!memcmp(sdsimSector(1000), out, 512));
+    TEST_ASSERT(!memcmp(sdsimSector(1003), out + 3 * 512, 512));
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, in, 1000, 1), RES_OK);
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, in + 512, 1001, 3), RES_OK);
+    TEST_ASSERT(!memcmp(in, out, sizeof(out)));
+
+    sdsim_stats_t st;
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[24], 1);
+    TEST_ASSERT_EQ(st.cmd[25], 1);
+    TEST_ASSERT_EQ(st.cmd[17], 1);
+    TEST_ASSERT_EQ(st.cmd[18], 1);
+    TEST_ASSERT_EQ(st.cmd[12], 1);
+    TEST_ASSERT_EQ(st.blocks_written, 4);
+    TEST_ASSERT_EQ(st.crc_errors, 0);
+    card_end();
+}
+
+/* random single and multi sector traffic against a reference copy */
+static void test_cache_model(void)
+{
+    static const uint16_t shapes[][2] = { { 1, 0 }, { 4, 2 }, { 16, 8 }, { 0, 8 } };
+    const uint32_t span = 96;   /* sectors from FAT_START, FAT and data */
+    static uint8_t ref[96 * 512];
+    uint8_t buf[8 * 512];
+    for (unsigned s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        card_begin(shapes[s][0], shapes[s][1]);
+        memset(ref, 0, sizeof(ref));
+        srand(33 + s);
+        unsigned ops = hostIterations(4000);
+        for (unsigned op = 0; op < ops; op++) {
+            uint32_t first = rand() % span;
+            int kind = rand() % 10;
+            UINT count = (kind == 0) ? 1 + rand() % 8 : 1;
+            if (first + count > span) {
+                count = span - first;
+            }
+            uint32_t sector = FAT_START + first;
+            if (kind < 5) {
+                if (rand() % 4 && first + 1 < span) {
+                    /* bias towards sequential runs so read-ahead is exercised */
+                    for (UINT i = 0; i < 4 && first + i < span; i++) {
+                        TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, sector + i, 1), RES_OK);
+                        TEST_ASSERT(!memcmp(buf, ref + (first + i) * 512, 512));
+                    }
+                } else {
+                    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, sector, count), RES_OK);
+                    TEST_ASSERT(!memcmp(buf, ref + first * 512, count * 512));
+                }
+            } else if (kind < 9) {
+                for (UINT i = 0; i < count; i++) {
+                    fill(buf + i * 512, sector + i, op);
+                }
+                TEST_ASSERT_EQ(ff_sd_write(pdrv, buf, sector, count), RES_OK);
+                memcpy(ref + first * 512, buf, count * 512);
+            } else {
+                TEST_ASSERT_EQ(ff_sd_ioctl(pdrv, CTRL_SYNC, NULL), RES_OK);
+                TEST_ASSERT(!memcmp(sdsimSector(FAT_START), ref, sizeof(ref)));
+            }
+        }
+        TEST_ASSERT_EQ(ff_sd_ioctl(pdrv, CTRL_SYNC, NULL), RES_OK);
+        TEST_ASSERT(!memcmp(sdsimSector(FAT_START), ref, sizeof(ref)));
+        sdsim_stats_t st;
+        sdsimStats(&st, false);
+        TEST_ASSERT_EQ(st.crc_errors, 0);
+        card_end();
+    }
+}
+
+static void test_write_back_on_sync(void)
+{
+    card_begin(8, 0);
+    uint8_t buf[512];
+    const uint32_t order[] = { 5000, 4000, 6000, 4001 };
+    for (int i = 0; i < 4; i++) {
+        fill(buf, order[i], 2);
+        TEST_ASSERT_EQ(ff_sd_write(pdrv, buf, order[i], 1), RES_OK);
+    }
+    fill(buf, 5000, 3);
+    TEST_ASSERT_EQ(ff_sd_write(pdrv, buf, 5000, 1), RES_OK);     /* rewrite stays in the cache */
+
+    sdsim_stats_t st;
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[24], 0);
+    TEST_ASSERT_EQ(sdsimSector(4000)[0], 0);
+
+    TEST_ASSERT_EQ(ff_sd_ioctl(pdrv, CTRL_SYNC, NULL), RES_OK);
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[24], 4);
+    fill(buf, 5000, 3);
+    TEST_ASSERT(!memcmp(sdsimSector(5000), buf, 512));
+    fill(buf, 4001, 2);
+    TEST_ASSERT(!memcmp(sdsimSector(4001), buf, 512));
+
+    /* nothing left to write */
+    TEST_ASSERT_EQ(ff_sd_ioctl(pdrv, CTRL_SYNC, NULL), RES_OK);
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[24], 4);
+
+    /* unmount writes the rest */
+    fill(buf, 7000, 4);
+    TEST_ASSERT_EQ(ff_sd_write(pdrv, buf, 7000, 1), RES_OK);
+    card_end();
+    TEST_ASSERT(!memcmp(sdsimSector(7000), buf, 512));
+}
+
+static void test_readahead(void)
+{
+    card_begin(4, 8);
+    uint8_t buf[512];
+    sdsim_stats_t st;
+    for (uint32_t s = 10000; s < 10000 + 2; s++) {
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, s, 1), RES_OK);
+    }
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[17], 2);
+    TEST_ASSERT_EQ(st.cmd[18], 0);
+
+    /* the third sequential read fills the window, the next 7 come from it */
+    for (uint32_t s = 10002; s < 10002 + 8; s++) {
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, s, 1), RES_OK);
+        TEST_ASSERT_EQ(buf[0], sdsimSector(s)[0]);
+    }
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[17], 2);
+    TEST_ASSERT_EQ(st.cmd[18], 1);
+    TEST_ASSERT_EQ(st.blocks_read, 2 + 8);
+
+    /* a random read in between does not start read-ahead */
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, 20000, 1), RES_OK);
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[17], 3);
+    TEST_ASSERT_EQ(st.cmd[18], 1);
+    card_end();
+}
+
+static void test_fat_lines_survive_data_misses(void)
+{
+    card_begin(8, 0);
+    uint8_t buf[512];
+    for (uint32_t s = FAT_START; s < FAT_START + 4; s++) {
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, s, 1), RES_OK);
+    }
+    /* scattered data reads, more than the cache holds */
+    for (uint32_t i = 0; i < 64; i++) {
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, DATA_START + i * 37, 1), RES_OK);
+    }
+    sdsim_stats_t st;
+    sdsimStats(&st, true);
+    for (uint32_t s = FAT_START; s < FAT_START + 4; s++) {
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, s, 1), RES_OK);
+    }
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[17], 0);
+    /* only half of the lines may be pinned */
+    for (uint32_t s = FAT_START + 4; s < FAT_START + 8; s++) {
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, s, 1), RES_OK);
+    }
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, DATA_START, 1), RES_OK);
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, DATA_START + 37, 1), RES_OK);
+    sdsimStats(&st, true);
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, DATA_START, 1), RES_OK);
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, DATA_START + 37, 1), RES_OK);
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[17], 0);
+    card_end();
+}
+
+static void test_corrupt_read_is_retried(void)
+{
+    card_begin(4, 0);
+    uint8_t buf[512];
+    fill(sdsimSector(3000), 3000, 5);
+    sdsimCorruptReads(1);
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, 3000, 1), RES_OK);
+    TEST_ASSERT(!memcmp(buf, sdsimSector(3000), 512));
+    sdsim_stats_t st;
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[17], 2);
+
+    /* a failed fill leaves no line behind */
+    sdsimCorruptReads(3);
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, 3001, 1), RES_ERROR);
+    fill(sdsimSector(3001), 3001, 6);
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, 3001, 1), RES_OK);
+    TEST_ASSERT(!memcmp(buf, sdsimSector(3001), 512));
+    card_end();
+}
+
+/*
+ * FatFs traffic for a data logger and a reader, with FF_FS_TINY=0 (a
+ * sector buffer per file plus the volume window for FAT and directory):
+ *
+ * - append: each 512 byte record is written into the file's next sector,
+ *   the cluster chain is followed in the FAT and, every 4 records (a 2 KB
+ *   cluster), the FAT entry is read, updated and written; f_sync rewrites
+ *   the directory entry and syncs the disk.
+ * - read: the file is read in 128 byte chunks, one single sector read per
+ *   sector, and the FAT is consulted at every cluster boundary.
+ */
+#define CLUSTER     4
+#define DIR_SECTOR  DATA_START
+
+static uint32_t log_sector(uint32_t record)
+{
+    return DATA_START + CLUSTER + record;
+}
+
+static void fat_link(uint32_t cluster, uint8_t* win)
+{
+    uint32_t sector = FAT_START + cluster / 128;
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, win, sector, 1), RES_OK);
+    win[(cluster % 128) * 4] = (uint8_t)(cluster + 1);
+    TEST_ASSERT_EQ(ff_sd_write(pdrv, win, sector, 1), RES_OK);
+    TEST_ASSERT_EQ(ff_sd_write(pdrv, win, sector + FAT_SECTORS, 1), RES_OK);
+}
+
+static void log_append(uint32_t records, unsigned sync_every)
+{
+    uint8_t win[512], data[512];
+    for (uint32_t r = 0; r < records; r++) {
+        fill(data, r, 7);
+        TEST_ASSERT_EQ(ff_sd_write(pdrv, data, log_sector(r), 1), RES_OK);
+        if (r % CLUSTER == CLUSTER - 1) {
+            fat_link(r / CLUSTER, win);
+        }
+        if (r % sync_every == sync_every - 1) {
+            TEST_ASSERT_EQ(ff_sd_read(pdrv, win, DIR_SECTOR, 1), RES_OK);
+            win[28] = (uint8_t)r;
+            TEST_ASSERT_EQ(ff_sd_write(pdrv, win, DIR_SECTOR, 1), RES_OK);
+            TEST_ASSERT_EQ(ff_sd_ioctl(pdrv, CTRL_SYNC, NULL), RES_OK);
+        }
+    }
+}
+
+static void log_read(uint32_t records)
+{
+    uint8_t win[512], data[512];
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, win, DIR_SECTOR, 1), RES_OK);
+    for (uint32_t r = 0; r < records; r++) {
+        if (r % CLUSTER == 0) {
+            TEST_ASSERT_EQ(ff_sd_read(pdrv, win, FAT_START + (r / CLUSTER) / 128, 1), RES_OK);
+        }
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, data, log_sector(r), 1), RES_OK);
+        TEST_ASSERT_EQ(data[1], (uint8_t)(r * 7 + 1 + 7 * 13));
+    }
+}
+
+static void bench_fatfs_traffic(void)
+{
+    static const struct {
+        uint16_t lines, readahead;
+        const char* label;
+    } shapes[] = {
+        { 0, 0, "no cache" },
+        { 16, 0, "16 lines" },
+        { 16, 8, "16 lines + 8 read-ahead" },
+    };
+    uint32_t records = hostIterations(2048);
+    for (unsigned s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        card_begin(shapes[s].lines, shapes[s].readahead);
+        sdsim_stats_t st;
+
+        log_append(records, 16);
+        TEST_ASSERT_EQ(ff_sd_ioctl(pdrv, CTRL_SYNC, NULL), RES_OK);
+        sdsimStats(&st, true);
+        BENCH("append, sync/8KB  %-24s CMD24 %5u  CMD17 %5u  %6.1f KB/s",
+              shapes[s].label, st.cmd[24], st.cmd[17], records * 0.5 / (st.ns / 1e9));
+
+        log_read(records);
+        sdsimStats(&st, true);
+        BENCH("read 128B chunks  %-24s CMD17 %5u  CMD18 %5u  %6.1f KB/s",
+              shapes[s].label, st.cmd[17], st.cmd[18], records * 0.5 / (st.ns / 1e9));
+        card_end();
+    }
+}
+
+int main(void)
+{
+    hostClockManual(true);
+
+    TEST_RUN(test_init_and_plain_io);
+    TEST_RUN(test_cache_model);
+    TEST_RUN(test_write_back_on_sync);
+    TEST_RUN(test_readahead);
+    TEST_RUN(test_fat_lines_survive_data_misses);
+    TEST_RUN(test_corrupt_read_is_retried);
+    TEST_RUN(bench_fatfs_traffic);
+
+    return TEST_EXIT();
+}
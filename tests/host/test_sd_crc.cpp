@@ -0,0 +1,328 @@
+/*
+ * The SD driver's CRC7/CRC16 and its burst polling for tokens and busy.
+ *
+ * The CRCs are checked against bit-by-bit references and the byte-table
+ * code they replaced. Polling runs against common/sdcard_sim.cpp, next to
+ * the per-byte token and busy loops the driver used before, which are kept
+ * below as the baseline.
+ */
+#include "host.h"
+#include "sdcard_sim.h"
+
+extern "C" {
+#include "../../libraries/SD/src/sd_diskio_crc.c"
+}
+#include "../../libraries/SD/src/sd_diskio.cpp"
+
+#define SECTORS (64 * 1024)
+
+static uint8_t ref_crc7(const uint8_t* p, int n)
+{
+    uint8_t crc = 0;
+    for (int i = 0; i < n; i++) {
+        for (int b = 7; b >= 0; b--) {
+            uint8_t bit = ((p[i] >> b) & 1) ^ ((crc >> 6) & 1);
+            crc = (crc << 1) & 0x7f;
+            if (bit) {
+                crc ^= 0x09;
+            }
+        }
+    }
+    return crc;
+}
+
+static uint16_t ref_crc16(const uint8_t* p, int n)
+{
+    uint16_t crc = 0;
+    for (int i = 0; i < n; i++) {
+        crc ^= (uint16_t)p[i] << 8;
+        for (int b = 0; b < 8; b++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+/* the byte-at-a-time CRC16 this replaced; the first table is the same */
+static unsigned short legacy_crc16(const char* data, int length)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    unsigned short crc = 0;
+    for (int i = 0; i < length; i++) {
+        crc = (crc << 8) ^ m_CRC16Table[0][((crc >> 8) ^ p[i]) & 0x00FF];
+    }
+    return crc;
+}
+
+static void random_bytes(uint8_t* p, int n)
+{
+    for (int i = 0; i < n; i++) {
+        p[i] = rand();
+    }
+}
+
+static void test_known_values(void)
+{
+    TEST_ASSERT_EQ(CRC16("123456789", 9), 0x31C3);     /* CRC-16/XMODEM check value */
+    TEST_ASSERT_EQ(CRC16("", 0), 0);
+    static const char block[512] = { 0 };
+    TEST_ASSERT_EQ(CRC16(block, 512), 0);
+    static char ones[512];
+    memset(ones, 0xFF, sizeof(ones));
+    TEST_ASSERT_EQ(CRC16(ones, 512), 0x7FA1);         /* SD spec example */
+
+    /* the fixed command CRCs from the SD spec */
+    const char cmd0[] = { 0x40, 0, 0, 0, 0 };
+    const char cmd8[] = { 0x48, 0, 0, 0x01, (char)0xAA };
+    const char cmd17[] = { 0x51, 0, 0, 0, 0 };
+    TEST_ASSERT_EQ((CRC7(cmd0, 5) << 1) | 1, 0x95);
+    TEST_ASSERT_EQ((CRC7(cmd8, 5) << 1) | 1, 0x87);
+    TEST_ASSERT_EQ((CRC7(cmd17, 5) << 1) | 1, 0x55);
+}
+
+static void test_crc_matches_reference(void)
+{
+    static uint8_t buf[1100];
+    srand(34);
+    unsigned rounds = hostIterations(20000);
+    for (unsigned r = 0; r < rounds; r++) {
+        int n = (r < 64) ? (int)r : rand() % (int)sizeof(buf);
+        int off = rand() % 8;       /* any alignment */
+        random_bytes(buf + off, n);
+        const char* p = (const char*)buf + off;
+        uint16_t want = ref_crc16(buf + off, n);
+        TEST_ASSERT_EQ(CRC16(p, n), want);
+        TEST_ASSERT_EQ(legacy_crc16(p, n), want);
+
+        /* incrementally, split anywhere */
+        int split = n ? rand() % (n + 1) : 0;
+        TEST_ASSERT_EQ(CRC16Update(CRC16Update(0, p, split), p + split, n - split), want);
+
+        int c = n < 6 ? n : 6;
+        TEST_ASSERT_EQ((uint8_t)CRC7(p, c), ref_crc7(buf + off, c));
+    }
+
+    /* CRC7 over every byte value, including those with the top bit set */
+    for (int v = 0; v < 256; v++) {
+        uint8_t cmd[5] = { (uint8_t)(0x40 | (v & 0x3f)), (uint8_t)v, (uint8_t)~v, (uint8_t)(v * 3), (uint8_t)(v ^ 0x5a) };
+        TEST_ASSERT_EQ((uint8_t)CRC7((const char*)cmd, 5), ref_crc7(cmd, 5));
+    }
+}
+
+static void bench_crc16(void)
+{
+    static uint8_t block[512];
+    random_bytes(block, sizeof(block));
+    unsigned blocks = hostIterations(200000);
+    volatile unsigned short sink = 0;
+
+    uint64_t t0 = hostNowNs();
+    for (unsigned i = 0; i < blocks; i++) {
+        block[0] = i;
+        sink ^= legacy_crc16((const char*)block, 512);
+    }
+    uint64_t legacy = hostNowNs() - t0;
+
+    t0 = hostNowNs();
+    for (unsigned i = 0; i < blocks; i++) {
+        block[0] = i;
+        sink ^= CRC16((const char*)block, 512);
+    }
+    uint64_t sliced = hostNowNs() - t0;
+    (void)sink;
+
+    BENCH("CRC16 512 B block: byte table %5.0f ns (%5.0f MB/s), slicing-by-8 %5.0f ns (%5.0f MB/s), %.1fx",
+          (double)legacy / blocks, 512.0 * blocks / legacy * 1e3,
+          (double)sliced / blocks, 512.0 * blocks / sliced * 1e3, (double)legacy / sliced);
+}
+
+/* ------------------------------------------------ polling, before and after */
+
+static uint8_t pdrv;
+
+static bool legacy_sdWait(uint8_t pdrv, int timeout)
+{
+    char resp;
+    uint32_t start = millis();
+    do {
+        resp = s_cards[pdrv]->spi->transfer(0xFF);
+    } while (resp == 0x00 && (millis() - start) < (unsigned int)timeout);
+    return (resp > 0x00);
+}
+
+static bool legacy_sdReadBytes(uint8_t pdrv, char* buffer, int length)
+{
+    char token;
+    unsigned short crc;
+    ardu_sdcard_t* card = s_cards[pdrv];
+
+    uint32_t start = millis();
+    do {
+        token = card->spi->transfer(0xFF);
+    } while (token == (char)0xFF && (millis() - start) < 500);
+
+    if (token != (char)0xFE) {
+        return false;
+    }
+
+    card->spi->transferBytes(NULL, (uint8_t*)buffer, length);
+    crc = card->spi->transfer16(0xFFFF);
+    return (!card->supports_crc || crc == legacy_crc16(buffer, length));
+}
+
+static char legacy_sdWriteBytes(uint8_t pdrv, const char* buffer, char token)
+{
+    ardu_sdcard_t* card = s_cards[pdrv];
+    unsigned short crc = (card->supports_crc) ? legacy_crc16(buffer, 512) : 0xFFFF;
+    if (!legacy_sdWait(pdrv, 500)) {
+        return false;
+    }
+    card->spi->write(token);
+    card->spi->writeBytes((uint8_t*)buffer, 512);
+    card->spi->write16(crc);
+    return (card->spi->transfer(0xFF) & 0x1F);
+}
+
+static void legacy_select(uint8_t pdrv)
+{
+    digitalWrite(s_cards[pdrv]->ssPin, LOW);
+    legacy_sdWait(pdrv, 300);
+}
+
+static bool legacy_read_sector(uint8_t pdrv, char* buffer, DWORD sector)
+{
+    AcquireSPI lock(s_cards[pdrv]);
+    legacy_select(pdrv);
+    bool ok = !sdCommand(pdrv, READ_BLOCK_SINGLE, sector, NULL) && legacy_sdReadBytes(pdrv, buffer, 512);
+    sdDeselectCard(pdrv);
+    return ok;
+}
+
+static bool legacy_write_sector(uint8_t pdrv, const char* buffer, DWORD sector)
+{
+    AcquireSPI lock(s_cards[pdrv]);
+    legacy_select(pdrv);
+    if (sdCommand(pdrv, WRITE_BLOCK_SINGLE, sector, NULL)) {
+        sdDeselectCard(pdrv);
+        return false;
+    }
+    char token = legacy_sdWriteBytes(pdrv, buffer, 0xFE);
+    sdDeselectCard(pdrv);
+    unsigned int resp;
+    legacy_select(pdrv);
+    char r = sdCommand(pdrv, SEND_STATUS, 0, &resp);
+    sdDeselectCard(pdrv);
+    return token == 0x05 && !r && !resp;
+}
+
+static void card_begin(void)
+{
+    sdsimInsert(SECTORS, true);
+    sdsimFormat(32, 64);
+    pdrv = sdcard_init(5, &SPI, 25000000);
+    TEST_ASSERT(sdcard_mount(pdrv, "/sd"));
+    sdsimStats(NULL, true);
+}
+
+static void card_end(void)
+{
+    sdcard_unmount(pdrv);
+    sdcard_uninit(pdrv);
+}
+
+/* blocks that follow each other with no gap must not be clocked into the previous read */
+static void test_back_to_back_blocks(void)
+{
+    sdsim_timing_t saved = sdsim_timing;
+    card_begin();
+    static uint8_t out[16 * 512], in[16 * 512];
+    random_bytes(out, sizeof(out));
+    memcpy(sdsimSector(2000), out, sizeof(out));
+    const uint32_t gaps[] = { 0, 1000, 20000 };
+    for (unsigned g = 0; g < 3; g++) {
+        sdsim_timing.read_access_ns = gaps[g];
+        sdsim_timing.read_next_ns = gaps[g];
+        memset(in, 0, sizeof(in));
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, in, 2000, 16), RES_OK);
+        TEST_ASSERT(!memcmp(in, out, sizeof(out)));
+        TEST_ASSERT_EQ(ff_sd_read(pdrv, in, 2001, 1), RES_OK);
+        TEST_ASSERT(!memcmp(in, out + 512, 512));
+    }
+    /* writes wait out busy in bursts */
+    for (unsigned g = 0; g < 3; g++) {
+        sdsim_timing.write_multi_ns = gaps[g];
+        sdsim_timing.write_single_ns = gaps[g];
+        TEST_ASSERT_EQ(ff_sd_write(pdrv, out, 3000, 16), RES_OK);
+        TEST_ASSERT_EQ(ff_sd_write(pdrv, out, 4000 + g, 1), RES_OK);
+    }
+    TEST_ASSERT(!memcmp(sdsimSector(3000), out, sizeof(out)));
+    TEST_ASSERT(!memcmp(sdsimSector(4002), out, 512));
+    sdsim_stats_t st;
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.crc_errors, 0);
+    card_end();
+    sdsim_timing = saved;
+}
+
+static void test_bad_crc_detected(void)
+{
+    card_begin();
+    uint8_t buf[512];
+    sdsimCorruptReads(1);
+    TEST_ASSERT_EQ(ff_sd_read(pdrv, buf, 100, 1), RES_OK);
+    sdsim_stats_t st;
+    sdsimStats(&st, false);
+    TEST_ASSERT_EQ(st.cmd[17], 2);      /* the corrupt block was read again */
+    card_end();
+}
+
+static void bench_polling(void)
+{
+    card_begin();
+    static char block[512];
+    random_bytes((uint8_t*)block, sizeof(block));
+    unsigned n = hostIterations(400);
+    sdsim_stats_t st;
+    const char* label[] = { "per-byte polling", "8-byte bursts" };
+    for (int burst = 0; burst < 2; burst++) {
+        sdsimStats(NULL, true);
+        for (unsigned i = 0; i < n; i++) {
+            if (burst) {
+                TEST_ASSERT_EQ(ff_sd_read(pdrv, (uint8_t*)block, 5000 + i, 1), RES_OK);
+            } else {
+                TEST_ASSERT(legacy_read_sector(pdrv, block, 5000 + i));
+            }
+        }
+        sdsimStats(&st, false);
+        BENCH("CMD17 read  %-16s %5.1f SPI calls/sector  %6.1f KB/s",
+              label[burst], (double)st.spi_calls / n, n * 0.5 / (st.ns / 1e9));
+
+        sdsimStats(NULL, true);
+        for (unsigned i = 0; i < n; i++) {
+            if (burst) {
+                TEST_ASSERT_EQ(ff_sd_write(pdrv, (const uint8_t*)block, 6000 + i, 1), RES_OK);
+            } else {
+                TEST_ASSERT(legacy_write_sector(pdrv, block, 6000 + i));
+            }
+        }
+        sdsimStats(&st, false);
+        BENCH("CMD24 write %-16s %5.1f SPI calls/sector  %6.1f KB/s",
+              label[burst], (double)st.spi_calls / n, n * 0.5 / (st.ns / 1e9));
+    }
+    TEST_ASSERT(!memcmp(sdsimSector(6000 + n - 1), block, 512));
+    card_end();
+}
+
+int main(void)
+{
+    hostClockManual(true);
+
+    TEST_RUN(test_known_values);
+    TEST_RUN(test_crc_matches_reference);
+    TEST_RUN(test_back_to_back_blocks);
+    TEST_RUN(test_bad_crc_detected);
+    TEST_RUN(bench_crc16);
+    TEST_RUN(bench_polling);
+
+    return TEST_EXIT();
+}
@@ -0,0 +1,434 @@
+/*
+ * Cluster-aligned logging on SD_MMC.
+ *
+ * The write path is modelled on FatFs's f_write() with a per-file sector
+ * buffer (FF_FS_TINY=0): whole sectors of a write go to the card as one
+ * multi-block command up to the end of the cluster, partial sectors go
+ * through the sector buffer, which has to be read first when the file
+ * already has data there (a preallocated file). Every disk command is
+ * recorded, so the test can check that writes of any size reach the card
+ * as whole, aligned clusters once a cluster-sized File buffer is set.
+ *
+ * SDMMCFS itself runs on a temporary directory with the IDF mount calls
+ * stubbed, for the mount configuration, clusterSize(), preallocate() and
+ * truncate().
+ */
+#include "host.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../../libraries/FS/src/FS.cpp"
+#include "../../libraries/FS/src/vfs_api.cpp"
+#include "../../libraries/SD_MMC/src/SD_MMC.cpp"
+
+#define SS 512
+
+/* SDMMC 4-bit at 40 MHz: 20 MB/s on the bus, plus a per-command card latency */
+#define BUS_NS_PER_SECTOR   25600
+#define READ_CMD_NS         150000
+#define WRITE_CMD_NS        500000
+
+class FatFileImpl : public FileImpl
+{
+public:
+    std::vector<uint8_t> disk;      /* the file's clusters as on the card */
+    uint32_t csize;                 /* sectors per cluster */
+    size_t objsize = 0;
+    size_t fptr = 0;
+    size_t allocated = 0;           /* bytes covered by the cluster chain */
+    uint8_t buf[SS];
+    long buf_sect = -1;
+    bool dirty = false;
+
+    unsigned reads = 0, writes = 0, multi = 0, fat_updates = 0;
+    unsigned sectors_written = 0;
+    unsigned misaligned = 0;        /* writes that are not whole, aligned clusters */
+    uint64_t ns = 0;
+
+    FatFileImpl(uint32_t csize, size_t capacity, size_t prealloc) : disk((capacity + SS - 1) / SS * SS), csize(csize)
+    {
+        objsize = prealloc;
+        allocated = (prealloc + csize * SS - 1) / (csize * SS) * csize * SS;
+    }
+
+    void disk_read(long sect)
+    {
+        reads++;
+        ns += READ_CMD_NS + BUS_NS_PER_SECTOR;
+        memcpy(buf, &disk[sect * SS], SS);
+    }
+    void disk_write(long sect, const uint8_t* data, unsigned count)
+    {
+        writes++;
+        multi += count > 1;
+        sectors_written += count;
+        if (count != csize || sect % csize) {
+            misaligned++;
+        }
+        ns += WRITE_CMD_NS + (uint64_t)count * BUS_NS_PER_SECTOR;
+        memcpy(&disk[sect * SS], data, count * SS);
+    }
+    bool sync_buffer()
+    {
+        if (dirty) {
+            disk_write(buf_sect, buf, 1);
+            dirty = false;
+        }
+        return true;
+    }
+
+    size_t write(const uint8_t* data, size_t size) override
+    {
+        size_t done = 0;
+        if (fptr + size > disk.size()) {
+            size = disk.size() - fptr;
+        }
+        while (done < size) {
+            size_t btw = size - done;
+            if (fptr % SS == 0) {
+                long sect = fptr / SS;
+                uint32_t csect = sect % csize;
+                if (csect == 0 && fptr >= allocated) {
+                    fat_updates++;      /* create_chain() */
+                    allocated += csize * SS;
+                }
+                sync_buffer();
+                uint32_t cc = btw / SS;
+                if (cc) {
+                    if (csect + cc > csize) {
+                        cc = csize - csect;
+                    }
+                    disk_write(sect, data + done, cc);
+                    if (buf_sect >= sect && buf_sect < (long)(sect + cc)) {
+                        memcpy(buf, data + done + (buf_sect - sect) * SS, SS);
+                    }
+                    fptr += cc * SS;
+                    done += cc * SS;
+                    objsize = fptr > objsize ? fptr : objsize;
+                    continue;
+                }
+                if (buf_sect != sect) {
+                    if (fptr < objsize) {
+                        disk_read(sect);
+                    }
+                    buf_sect = sect;
+                }
+            }
+            size_t wcnt = SS - fptr % SS;
+            wcnt = wcnt < btw ? wcnt : btw;
+            memcpy(buf + fptr % SS, data + done, wcnt);
+            dirty = true;
+            fptr += wcnt;
+            done += wcnt;
+            objsize = fptr > objsize ? fptr : objsize;
+        }
+        return done;
+    }
+    size_t read(uint8_t* data, size_t size) override
+    {
+        sync_buffer();
+        size_t n = fptr < objsize ? objsize - fptr : 0;
+        n = n < size ? n : size;
+        memcpy(data, &disk[fptr], n);
+        fptr += n;
+        return n;
+    }
+    bool seek(uint32_t pos, SeekMode mode) override
+    {
+        size_t target = mode == SeekSet ? pos : mode == SeekCur ? fptr + (int32_t)pos : objsize + (int32_t)pos;
+        if (target > disk.size()) {
+            return false;
+        }
+        /* f_lseek() loads the sector when the new position is inside one */
+        long sect = target / SS;
+        if (target % SS && sect != buf_sect) {
+            sync_buffer();
+            if (target < objsize) {
+                disk_read(sect);
+            }
+            buf_sect = sect;
+        }
+        fptr = target;
+        return true;
+    }
+    size_t position() const override { return fptr; }
+    size_t size() const override { return objsize; }
+    void flush() override { sync_buffer(); }
+    void close() override { sync_buffer(); }
+    time_t getLastWrite() override { return 0; }
+    const char* name() const override { return "/log.bin"; }
+    boolean isDirectory(void) override { return false; }
+    FileImplPtr openNextFile(const char* mode) override { return FileImplPtr(); }
+    void rewindDirectory(void) override { }
+    operator bool() override { return true; }
+};
+
+static uint32_t rng;
+
+static uint32_t rand_below(uint32_t n)
+{
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 8) % n;
+}
+
+static uint8_t pattern(size_t pos)
+{
+    return (uint8_t)(pos * 31 + (pos >> 9));
+}
+
+/* writes `total` bytes from `start` in chunks of 1..max_chunk bytes */
+static void log_chunks(File& f, size_t start, size_t total, size_t max_chunk)
+{
+    static uint8_t chunk[4096];
+    size_t pos = start;
+    while (pos < start + total) {
+        size_t len = 1 + rand_below(max_chunk);
+        if (len > start + total - pos) {
+            len = start + total - pos;
+        }
+        for (size_t i = 0; i < len; i++) {
+            chunk[i] = pattern(pos + i);
+        }
+        TEST_ASSERT_EQ(f.write(chunk, len), len);
+        pos += len;
+    }
+}
+
+static bool disk_matches(FatFileImpl* fat, size_t start, size_t total)
+{
+    for (size_t i = start; i < start + total; i++) {
+        if (fat->disk[i] != pattern(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_any_write_size_becomes_whole_clusters(void)
+{
+    const uint32_t csizes[] = { 8, 32, 64 };
+    const size_t chunks[] = { 1, 100, 700, 3000 };
+    for (unsigned c = 0; c < 3; c++) {
+        for (unsigned k = 0; k < 4; k++) {
+            size_t cluster = csizes[c] * SS;
+            size_t total = 8 * cluster + 1234;
+            std::shared_ptr<FatFileImpl> fat = std::make_shared<FatFileImpl>(csizes[c], total, total);
+            File f(fat);
+            TEST_ASSERT(f.setBufferSize(cluster));
+            rng = c * 10 + k + 1;
+            log_chunks(f, 0, total, chunks[k]);
+
+            /* all but the tail went out as whole clusters, no read-modify-write */
+            TEST_ASSERT_EQ(fat->misaligned, 0);
+            TEST_ASSERT_EQ(fat->writes, 8);
+            TEST_ASSERT_EQ(fat->reads, 0);
+            f.close();
+            TEST_ASSERT_EQ(fat->writes, 8 + 2);     /* the tail's 2 whole sectors, then the partial one */
+            TEST_ASSERT_EQ(fat->reads, 1);
+            TEST_ASSERT(disk_matches(fat.get(), 0, total));
+        }
+    }
+}
+
+/* appending from an odd position: one write up to the cluster boundary, then whole clusters */
+static void test_unaligned_start(void)
+{
+    const uint32_t csize = 16;
+    size_t cluster = csize * SS;
+    size_t start = 3 * cluster + 777;
+    size_t total = 6 * cluster;
+    std::shared_ptr<FatFileImpl> fat = std::make_shared<FatFileImpl>(csize, start + total + cluster, start + total + cluster);
+    File f(fat);
+    TEST_ASSERT(f.setBufferSize(cluster));
+    TEST_ASSERT(f.seek(start, SeekSet));
+    unsigned reads_after_seek = fat->reads;
+    rng = 99;
+    log_chunks(f, start, total, 600);
+    f.close();
+    TEST_ASSERT(disk_matches(fat.get(), start, total));
+    /*
+     * head: the partial sector f_lseek() loaded, then the rest of the
+     * cluster in one command; tail on close: one whole sector and a partial
+     * one, which is read first
+     */
+    TEST_ASSERT_EQ(fat->misaligned, 4);
+    TEST_ASSERT_EQ(fat->writes - fat->misaligned, 5);
+    TEST_ASSERT_EQ(fat->reads - reads_after_seek, 1);
+}
+
+/* -------------------------------------------------------------- SDMMCFS */
+
+static esp_vfs_fat_mount_config_t mount_config;
+static sdmmc_host_t mount_host;
+static sdmmc_card_t card;
+static bool mounted;
+
+extern "C" esp_err_t esp_vfs_fat_sdmmc_mount(const char* base_path, const sdmmc_host_t* host_config, const void* slot_config,
+                                             const esp_vfs_fat_mount_config_t* config, sdmmc_card_t** out_card)
+{
+    (void)slot_config;
+    if (mounted) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    mount_host = *host_config;
+    mount_config = *config;
+    FATFS* fs;
+    esp_vfs_fat_register(base_path, "0:", config->max_files, &fs);
+    fs->csize = config->allocation_unit_size ? config->allocation_unit_size / SS : 64;
+    fs->ssize = SS;
+    fs->n_fatent = 1000000;
+    fs->free_clst = 900000;
+    *out_card = &card;
+    mounted = true;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_vfs_fat_sdmmc_unmount(void)
+{
+    mounted = false;
+    return ESP_OK;
+}
+
+extern "C" {
+esp_err_t sdmmc_host_init() { return ESP_OK; }
+esp_err_t sdmmc_host_set_bus_width(int slot, size_t width) { return ESP_OK; }
+size_t sdmmc_host_get_slot_width(int slot) { return 4; }
+esp_err_t sdmmc_host_set_card_clk(int slot, uint32_t freq_khz) { return ESP_OK; }
+esp_err_t sdmmc_host_do_transaction(int slot, sdmmc_command_t* cmdinfo) { return ESP_OK; }
+esp_err_t sdmmc_host_deinit() { return ESP_OK; }
+esp_err_t sdmmc_host_io_int_enable(int slot) { return ESP_OK; }
+esp_err_t sdmmc_host_io_int_wait(int slot, TickType_t timeout_ticks) { return ESP_OK; }
+}
+
+static char root[64];
+
+static void test_mount_configuration(void)
+{
+    TEST_ASSERT(SD_MMC.begin(root));
+    TEST_ASSERT_EQ(mount_host.flags, SDMMC_HOST_FLAG_4BIT);
+    TEST_ASSERT_EQ(mount_host.slot, SDMMC_HOST_SLOT_1);
+    TEST_ASSERT_EQ(mount_host.max_freq_khz, SDMMC_FREQ_HIGHSPEED);
+    TEST_ASSERT_EQ(mount_config.max_files, 5);
+    TEST_ASSERT_EQ(mount_config.allocation_unit_size, 0);
+    TEST_ASSERT(!mount_config.format_if_mount_failed);
+    TEST_ASSERT_EQ(SD_MMC.clusterSize(), 32768);
+    SD_MMC.end();
+    TEST_ASSERT_EQ(SD_MMC.clusterSize(), 0);
+
+    TEST_ASSERT(SD_MMC.begin(root, true, true, SDMMC_FREQ_DEFAULT, 2, 16384));
+    TEST_ASSERT_EQ(mount_host.flags, SDMMC_HOST_FLAG_1BIT);
+    TEST_ASSERT_EQ(mount_host.max_freq_khz, SDMMC_FREQ_DEFAULT);
+    TEST_ASSERT_EQ(mount_config.max_files, 2);
+    TEST_ASSERT_EQ(mount_config.allocation_unit_size, 16384);
+    TEST_ASSERT(mount_config.format_if_mount_failed);
+    TEST_ASSERT_EQ(SD_MMC.clusterSize(), 16384);
+}
+
+static void test_preallocate_and_truncate(void)
+{
+    TEST_ASSERT(SD_MMC.preallocate("/log.bin", 100000));
+    File f = SD_MMC.open("/log.bin");
+    TEST_ASSERT_EQ(f.size(), 100000);
+    f.close();
+
+    /* logging into the preallocated file keeps its size until truncate() */
+    f = SD_MMC.open("/log.bin", "r+");
+    TEST_ASSERT(f.setBufferSize(SD_MMC.clusterSize()));
+    rng = 5;
+    log_chunks(f, 0, 40000, 700);
+    f.close();
+    TEST_ASSERT_EQ(SD_MMC.open("/log.bin").size(), 100000);
+    TEST_ASSERT(SD_MMC.truncate("/log.bin", 40000));
+    f = SD_MMC.open("/log.bin");
+    TEST_ASSERT_EQ(f.size(), 40000);
+    bool same = true;
+    for (size_t i = 0; i < 40000; i++) {
+        same &= f.read() == pattern(i);
+    }
+    TEST_ASSERT(same);
+    f.close();
+
+    /* an existing file keeps its data and only grows */
+    TEST_ASSERT(SD_MMC.preallocate("/log.bin", 50000));
+    f = SD_MMC.open("/log.bin");
+    TEST_ASSERT_EQ(f.size(), 50000);
+    TEST_ASSERT_EQ(f.read(), pattern(0));
+    f.close();
+    TEST_ASSERT(SD_MMC.preallocate("/log.bin", 10));
+    TEST_ASSERT_EQ(SD_MMC.open("/log.bin").size(), 50000);
+
+    TEST_ASSERT(!SD_MMC.preallocate("/log.bin", 0));
+    TEST_ASSERT(SD_MMC.remove("/log.bin"));
+    SD_MMC.end();
+    TEST_ASSERT(!SD_MMC.preallocate("/log.bin", 100));
+    TEST_ASSERT(!SD_MMC.truncate("/log.bin", 0));
+}
+
+/* -------------------------------------------------------------- benchmark */
+
+static void bench_logging(void)
+{
+    const uint32_t csize = 64;      /* 32 KB clusters */
+    size_t total = hostIterations(4 * 1024 * 1024);
+    total -= total % SS;
+    static const struct {
+        bool prealloc, buffered;
+        const char* label;
+    } runs[] = {
+        { false, false, "unbuffered, growing file" },
+        { true, false, "unbuffered, preallocated" },
+        { true, true, "cluster buffer, prealloc." },
+    };
+    for (unsigned r = 0; r < 3; r++) {
+        std::shared_ptr<FatFileImpl> fat = std::make_shared<FatFileImpl>(csize, total, runs[r].prealloc ? total : 0);
+        File f(fat);
+        if (runs[r].buffered) {
+            TEST_ASSERT(f.setBufferSize(csize * SS));
+        }
+        rng = 35;
+        log_chunks(f, 0, total, 700);
+        f.close();
+        TEST_ASSERT(disk_matches(fat.get(), 0, total));
+        BENCH("%-26s %5u writes (%4u multi-block) %5u reads %3u FAT updates  %5.1f sectors/write  %5.2f MB/s modelled",
+              runs[r].label, fat->writes, fat->multi, fat->reads, fat->fat_updates,
+              (double)fat->sectors_written / fat->writes, total / (fat->ns / 1e9) / 1e6);
+    }
+}
+
+static void cleanup(const char* dir)
+{
+    DIR* d = opendir(dir);
+    struct dirent* e;
+    while (d && (e = readdir(d))) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    if (d) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+int main(void)
+{
+    strcpy(root, "/tmp/sdmmc_XXXXXX");
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    TEST_RUN(test_any_write_size_becomes_whole_clusters);
+    TEST_RUN(test_unaligned_start);
+    TEST_RUN(test_mount_configuration);
+    TEST_RUN(test_preallocate_and_truncate);
+    TEST_RUN(bench_logging);
+
+    cleanup(root);
+    return TEST_EXIT();
+}
@@ -0,0 +1,292 @@
+/*
+ * TickerGroup against a simulated esp_timer.
+ *
+ * 10000 periodic tickers with periods of 10..1000 ms run for a stretch of
+ * simulated time, once on a TickerGroup and once as plain Tickers with an
+ * esp_timer each. Every callback compares the clock with the exact time it
+ * was due, so the lateness (jitter) the slack window adds is measured, not
+ * estimated, and the esp_timer stand-in counts how often each variant
+ * woke the timer task. Wall-clock time is only used for the per-operation
+ * overhead of the wheel itself.
+ */
+#include "host.h"
+#include "../../libraries/Ticker/src/TickerGroup.cpp"
+#include "../../libraries/Ticker/src/Ticker.cpp"
+
+#define NTICKERS 10000
+
+static struct {
+    int64_t start;          /* when it was attached */
+    uint32_t period_ms;
+    uint32_t fired;
+} sim[NTICKERS];
+
+static int64_t late_min, late_max, late_sum;
+static uint64_t late_n;
+
+static void on_tick(uint32_t i)
+{
+    int64_t due = sim[i].start + (int64_t)(sim[i].fired + 1) * sim[i].period_ms * 1000;
+    int64_t late = hostClockNow() - due;
+    late_min = late < late_min ? late : late_min;
+    late_max = late > late_max ? late : late_max;
+    late_sum += late;
+    late_n++;
+    sim[i].fired++;
+}
+
+static uint32_t rng = 12345;
+
+static uint32_t rand_below(uint32_t n)
+{
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 8) % n;
+}
+
+static void late_reset(void)
+{
+    late_min = INT64_MAX;
+    late_max = INT64_MIN;
+    late_sum = 0;
+    late_n = 0;
+}
+
+/* Attaches every ticker through `attach`, a few hundred microseconds apart. */
+template<typename Attach>
+static void attach_staggered(Attach attach)
+{
+    rng = 12345;
+    for (int i = 0; i < NTICKERS; i++) {
+        hostTimerRun(hostClockNow() + rand_below(300));
+        sim[i].start = hostClockNow();
+        sim[i].period_ms = 10 + rand_below(991);
+        sim[i].fired = 0;
+        attach(i);
+    }
+}
+
+/* Every period that ended more than `slack_us` before `end` has fired exactly once. */
+static void check_counts(int64_t end, int64_t slack_us)
+{
+    for (int i = 0; i < NTICKERS; i++) {
+        int64_t period = (int64_t)sim[i].period_ms * 1000;
+        uint32_t expect = (end - sim[i].start) / period;
+        bool last_pending = sim[i].start + expect * period > end - slack_us;
+        TEST_ASSERT(sim[i].fired == expect || (last_pending && sim[i].fired + 1 == expect));
+    }
+}
+
+static GroupTicker* group_tickers[NTICKERS];
+
+static void run_group(uint32_t slack_ms, int seconds)
+{
+    TickerGroup group(slack_ms);
+    for (int i = 0; i < NTICKERS; i++) {
+        group_tickers[i] = new GroupTicker(group);
+    }
+    host_timer_stats_t st;
+    hostTimerStats(NULL, true);
+
+    uint64_t t0 = hostNowNs();
+    attach_staggered([](int i) { group_tickers[i]->attach_ms(sim[i].period_ms, on_tick, (uint32_t)i); });
+    double attach_ns = (double)(hostNowNs() - t0) / NTICKERS;
+    TEST_ASSERT_EQ(group.count(), NTICKERS);
+
+    late_reset();
+    int64_t from = hostClockNow(), end = from + seconds * 1000000LL;
+    uint32_t runs = group.runs();
+    hostTimerStats(NULL, true);
+    t0 = hostNowNs();
+    hostTimerRun(end);
+    double run_ns = (double)(hostNowNs() - t0);
+    hostTimerStats(&st, false);
+    runs = group.runs() - runs;
+
+    check_counts(end, slack_ms * 1000);
+    TEST_ASSERT(late_min >= 0);
+    TEST_ASSERT(late_max < (int64_t)slack_ms * 1000);
+    TEST_ASSERT_EQ(st.created, 0);
+    /* one wakeup per batch, plus the ones that only cascade the wheel */
+    TEST_ASSERT(st.fired >= runs);
+
+    /* moving every ticker to a new period and dropping them again */
+    t0 = hostNowNs();
+    for (int i = 0; i < NTICKERS; i++) {
+        group_tickers[i]->attach_ms(sim[i].period_ms + 1, on_tick, (uint32_t)i);
+    }
+    double reattach_ns = (double)(hostNowNs() - t0) / NTICKERS;
+    t0 = hostNowNs();
+    for (int i = 0; i < NTICKERS; i++) {
+        group_tickers[i]->detach();
+    }
+    double detach_ns = (double)(hostNowNs() - t0) / NTICKERS;
+    TEST_ASSERT_EQ(group.count(), 0);
+    /* detach() leaves the alarm armed; it goes off once more, then the group is idle */
+    hostTimerRun(hostClockNow() + 2000000);
+    TEST_ASSERT(esp_timer_get_next_alarm() == INT64_MAX);
+
+    BENCH("TickerGroup slack %2u ms: %7.0f timer wakeups/s for %8.0f callbacks/s (%5.1f per wakeup)",
+          slack_ms, st.fired / (double)seconds, late_n / (double)seconds, (double)late_n / st.fired);
+    BENCH("TickerGroup slack %2u ms: late by mean %6.1f us, max %5lld us (never early)",
+          slack_ms, (double)late_sum / late_n, (long long)late_max);
+    BENCH("TickerGroup slack %2u ms: %5.1f ns/callback dispatched, attach %5.1f ns, re-attach %5.1f ns, detach %5.1f ns",
+          slack_ms, run_ns / late_n, attach_ns, reattach_ns, detach_ns);
+
+    for (int i = 0; i < NTICKERS; i++) {
+        delete group_tickers[i];
+    }
+}
+
+static void test_group_10k_slack_1ms(void)
+{
+    run_group(1, hostIterations(20));
+}
+
+static void test_group_10k_slack_10ms(void)
+{
+    run_group(10, hostIterations(20));
+}
+
+static Ticker* plain_tickers[NTICKERS];
+
+static void test_plain_tickers_10k(void)
+{
+    int seconds = hostIterations(20);
+    for (int i = 0; i < NTICKERS; i++) {
+        plain_tickers[i] = new Ticker();
+    }
+    host_timer_stats_t st, run;
+    hostTimerStats(NULL, true);
+    attach_staggered([](int i) { plain_tickers[i]->attach_ms(sim[i].period_ms, on_tick, (uint32_t)i); });
+
+    late_reset();
+    int64_t end = hostClockNow() + seconds * 1000000LL;
+    hostTimerStats(&st, false);
+    hostTimerRun(end);
+    hostTimerStats(&run, false);
+    run.fired -= st.fired;
+    check_counts(end, 0);
+    TEST_ASSERT_EQ(late_max, 0);
+
+    for (int i = 0; i < NTICKERS; i++) {
+        plain_tickers[i]->attach_ms(sim[i].period_ms + 1, on_tick, (uint32_t)i);
+    }
+    for (int i = 0; i < NTICKERS; i++) {
+        delete plain_tickers[i];
+    }
+    hostTimerStats(&st, false);
+    TEST_ASSERT_EQ(st.created, 2 * NTICKERS);
+    TEST_ASSERT_EQ(st.deleted, 2 * NTICKERS);
+    BENCH("Ticker x10000:          %7.0f timer wakeups/s for %8.0f callbacks/s, %u esp_timers created",
+          run.fired / (double)seconds, late_n / (double)seconds, st.created);
+}
+
+static int calls[4];
+
+static void count_call(uint32_t i)
+{
+    calls[i]++;
+}
+
+static void test_once_and_detach(void)
+{
+    TickerGroup group(1);
+    GroupTicker a(group), b(group);
+    memset(calls, 0, sizeof(calls));
+    int64_t t = hostClockNow();
+    a.once_ms(50, count_call, (uint32_t)0);
+    b.once_ms(50, count_call, (uint32_t)1);
+    TEST_ASSERT(a.active() && b.active());
+    b.detach();
+    TEST_ASSERT(!b.active());
+    hostTimerRun(t + 49000);
+    TEST_ASSERT_EQ(calls[0], 0);
+    hostTimerRun(t + 51000);
+    TEST_ASSERT_EQ(calls[0], 1);
+    TEST_ASSERT_EQ(calls[1], 0);
+    TEST_ASSERT(!a.active());
+    hostTimerRun(t + 200000);
+    TEST_ASSERT_EQ(calls[0], 1);
+    TEST_ASSERT_EQ(group.count(), 0);
+    TEST_ASSERT(esp_timer_get_next_alarm() == INT64_MAX);
+}
+
+static GroupTicker* batch[2];
+
+static void detach_other(uint32_t i)
+{
+    calls[i]++;
+    batch[!i]->detach();
+    batch[i]->once_ms(5, count_call, (uint32_t)(2 + i));
+}
+
+static void test_callback_detaches_batch_mate(void)
+{
+    TickerGroup group(10);
+    GroupTicker a(group), b(group);
+    batch[0] = &a;
+    batch[1] = &b;
+    memset(calls, 0, sizeof(calls));
+    int64_t t = hostClockNow();
+    a.once_ms(12, detach_other, (uint32_t)0);
+    b.once_ms(14, detach_other, (uint32_t)1);
+    hostTimerRun(t + 100000);
+    /* both are due in the same 10 ms tick, whichever runs first cancels the other */
+    TEST_ASSERT_EQ(calls[0] + calls[1], 1);
+    TEST_ASSERT_EQ(calls[2] + calls[3], 1);
+    TEST_ASSERT_EQ(group.count(), 0);
+}
+
+static void test_interval_beyond_wheel(void)
+{
+    TickerGroup group(1);
+    GroupTicker a(group);
+    memset(calls, 0, sizeof(calls));
+    host_timer_stats_t st;
+    hostTimerStats(NULL, true);
+    int64_t t = hostClockNow();
+    /* 64^4 ticks of 1 ms is about 4.66 h, this has to be parked and re-filed */
+    uint32_t five_hours = 5 * 3600 * 1000;
+    a.once_ms(five_hours, count_call, (uint32_t)0);
+    hostTimerRun(t + (int64_t)five_hours * 1000 - 1000);
+    TEST_ASSERT_EQ(calls[0], 0);
+    hostTimerRun(t + (int64_t)five_hours * 1000 + 1000);
+    TEST_ASSERT_EQ(calls[0], 1);
+    hostTimerStats(&st, false);
+    /* only cascades wake the timer until the last minute */
+    TEST_ASSERT(st.fired < 200);
+}
+
+static void test_dispatch_task(void)
+{
+    TickerGroup group(1);
+    GroupTicker a(group);
+    memset(calls, 0, sizeof(calls));
+    group.setDispatchTask(xTaskGetCurrentTaskHandle());
+    ulTaskNotifyTake(pdTRUE, 0);
+    int64_t t = hostClockNow();
+    a.attach_ms(10, count_call, (uint32_t)0);
+    hostTimerRun(t + 10000);
+    TEST_ASSERT_EQ(calls[0], 0);
+    TEST_ASSERT_EQ(ulTaskNotifyTake(pdTRUE, 0), 1);
+    group.handle();
+    TEST_ASSERT_EQ(calls[0], 1);
+    /* a late handle() catches up with one call, not a burst */
+    hostTimerRun(t + 55000);
+    group.handle();
+    TEST_ASSERT_EQ(calls[0], 2);
+    a.detach();
+}
+
+int main(void)
+{
+    hostClockManual(true);
+    TEST_RUN(test_once_and_detach);
+    TEST_RUN(test_callback_detaches_batch_mate);
+    TEST_RUN(test_interval_beyond_wheel);
+    TEST_RUN(test_dispatch_task);
+    TEST_RUN(test_group_10k_slack_1ms);
+    TEST_RUN(test_group_10k_slack_10ms);
+    TEST_RUN(test_plain_tickers_10k);
+    return TEST_EXIT();
+}
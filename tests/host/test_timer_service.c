@@ -0,0 +1,480 @@
+/*
+ * Timer service events against a simulated hardware timer.
+ *
+ * The counter of timer 0 is plain memory the test moves: the simulation
+ * steps it to the armed alarm plus the interrupt entry time, clears
+ * alarm_en the way the hardware does and calls the timer ISR. A callback
+ * can charge its own run time to the counter, so events falling due
+ * together, the rearm margin and missed periods show up as lateness
+ * against the deadline each run was due at. Deferred events run on the
+ * timer_svc task thread.
+ */
+#include "host.h"
+#include "../../cores/esp32/esp32-hal-timer.c"
+
+#include <pthread.h>
+#include <time.h>
+
+/* ROM and DPORT helpers the driver links against */
+uint32_t esp_dport_access_reg_read(uint32_t reg) { return *(volatile uint32_t *)(uintptr_t)reg; }
+void intr_matrix_set(int cpu_no, uint32_t model_num, uint32_t intr_num) { (void)cpu_no; (void)model_num; (void)intr_num; }
+
+#define TIMER       (TIMERG0.hw_timer[0])
+#define ENTRY_US    2       /* alarm to ISR */
+
+/* ------------------------------------------------------------ timer model */
+
+static uint64_t sim_now;
+static unsigned sim_isrs, sim_past_alarms;
+
+static void counter_set(uint64_t us)
+{
+    sim_now = us;
+    TIMER.cnt_high = (uint32_t)(us >> 32);
+    TIMER.cnt_low = (uint32_t)us;
+}
+
+static uint64_t sim_alarm(void)
+{
+    return ((uint64_t)TIMER.alarm_high << 32) | TIMER.alarm_low;
+}
+
+/* run the counter up to `until`, taking the interrupt at every alarm */
+static void sim_run(uint64_t until)
+{
+    while (TIMER.config.alarm_en && TIMER.config.edge_int_en && sim_alarm() <= until) {
+        uint64_t at = sim_alarm();
+        if (at < sim_now) {
+            /* armed behind the counter */
+            sim_past_alarms++;
+            at = sim_now;
+        }
+        counter_set(at + ENTRY_US);
+        TIMER.config.alarm_en = 0;
+        TIMERG0.int_st_timers.val = 1;
+        sim_isrs++;
+        hostIntrFire(ETS_TG0_T0_EDGE_INTR_SOURCE);
+        TIMERG0.int_st_timers.val = 0;
+    }
+    if (until > sim_now)
+        counter_set(until);
+}
+
+static void sim_begin(void)
+{
+    counter_set(0);
+    sim_isrs = 0;
+    sim_past_alarms = 0;
+    TEST_ASSERT(timerServiceBegin(0));
+    counter_set(0);
+}
+
+/* an event and what its runs looked like */
+typedef struct {
+    hw_timer_event_t ev;
+    uint64_t due;               /* deadline of the next run */
+    uint32_t cost;              /* us a run takes */
+    volatile unsigned runs;
+    unsigned skipped;           /* periods passed over */
+    uint64_t late_sum, late_max;
+    uint64_t last_run;
+    void (*then)(void *);       /* called at the end of a run */
+} probe_t;
+
+static unsigned order_len;
+static probe_t *order[4096];
+
+static void probe_run(void *arg)
+{
+    probe_t *p = arg;
+    uint64_t late = sim_now - p->due;
+    p->late_sum += late;
+    if (late > p->late_max)
+        p->late_max = late;
+    if (p->ev.period) {
+        p->skipped += (p->ev.deadline - p->due) / p->ev.period - 1;
+        p->due = p->ev.deadline;
+    }
+    p->last_run = sim_now;
+    p->runs++;
+    if (order_len < 4096)
+        order[order_len++] = p;
+    counter_set(sim_now + p->cost);
+    if (p->then)
+        p->then(p);
+}
+
+static void probe_start(probe_t *p, uint64_t us, bool periodic)
+{
+    if (p->ev.cb == NULL)
+        timerEventInit(&p->ev, probe_run, p, false);
+    p->due = sim_now + us;
+    TEST_ASSERT(timerEventStart(&p->ev, us, periodic));
+}
+
+/* ----------------------------------------------------------------- tests */
+
+static void test_arguments(void)
+{
+    probe_t p = { 0 };
+    timerEventInit(&p.ev, probe_run, &p, false);
+    TEST_ASSERT(!timerEventStart(&p.ev, 100, false));
+    TEST_ASSERT_EQ(timerServiceMicros(), 0);
+    sim_begin();
+    TEST_ASSERT(!timerEventStart(NULL, 100, false));
+    TEST_ASSERT(!timerEventStart(&p.ev, 0, true));
+    hw_timer_event_t bare;
+    timerEventInit(&bare, NULL, NULL, false);
+    TEST_ASSERT(!timerEventStart(&bare, 100, false));
+    TEST_ASSERT(!timerEventActive(&p.ev));
+    TEST_ASSERT(!timerEventActive(NULL));
+    timerEventStop(&p.ev);
+    timerEventStop(NULL);
+    counter_set(1234);
+    TEST_ASSERT_EQ(timerServiceMicros(), 1234);
+    /* a second begin keeps the running service */
+    TEST_ASSERT(timerServiceBegin(1));
+    TEST_ASSERT(__timerService.timer == &hw_timer[0]);
+    timerServiceEnd();
+}
+
+static void test_one_shots_in_order(void)
+{
+    static probe_t p[300];
+    memset(p, 0, sizeof(p));
+    order_len = 0;
+    sim_begin();
+    srand(49);
+    for (int i = 0; i < 300; i++)
+        probe_start(&p[i], 10 + rand() % 10000, false);
+    TEST_ASSERT_EQ(__timerService.count, 300);
+    TEST_ASSERT(TIMER.config.alarm_en);
+    sim_run(20000);
+
+    TEST_ASSERT_EQ(order_len, 300);
+    for (unsigned i = 1; i < order_len; i++)
+        TEST_ASSERT(order[i - 1]->due <= order[i]->due);
+    for (int i = 0; i < 300; i++) {
+        TEST_ASSERT_EQ(p[i].runs, 1);
+        /* at the alarm, or held back by the rearm margin */
+        TEST_ASSERT(p[i].late_max <= ENTRY_US + TIMER_SERVICE_MARGIN);
+        TEST_ASSERT(!timerEventActive(&p[i].ev));
+    }
+    TEST_ASSERT(sim_isrs <= 300);
+    TEST_ASSERT_EQ(sim_past_alarms, 0);
+    TEST_ASSERT(!TIMER.config.alarm_en);
+    timerServiceEnd();
+}
+
+static void stop_after_five(void *arg)
+{
+    probe_t *p = arg;
+    if (p->runs == 5)
+        timerEventStop(&p->ev);
+}
+
+static void test_periodic(void)
+{
+    probe_t a = { 0 }, b = { 0 }, c = { 0 };
+    sim_begin();
+
+    /* on time, every period */
+    probe_start(&a, 250, true);
+    /* stops itself */
+    c.then = stop_after_five;
+    probe_start(&c, 1000, true);
+    sim_run(10000 + 1);
+    TEST_ASSERT_EQ(a.runs, 40);
+    TEST_ASSERT_EQ(a.skipped, 0);
+    TEST_ASSERT_EQ(a.late_max, ENTRY_US);
+    TEST_ASSERT(timerEventActive(&a.ev));
+    TEST_ASSERT_EQ(c.runs, 5);
+    TEST_ASSERT(!timerEventActive(&c.ev));
+    timerEventStop(&a.ev);
+
+    /* longer than its period: skips to the next deadline instead of bursting */
+    b.cost = 250;
+    probe_start(&b, 100, true);
+    uint64_t start = sim_now;
+    sim_run(start + 10000);
+    TEST_ASSERT(b.skipped > 0);
+    TEST_ASSERT(b.runs * b.cost <= 10000 + b.cost);
+    TEST_ASSERT_EQ(b.due % 100, start % 100);
+    /* and leaves the ISR now and then */
+    TEST_ASSERT(sim_isrs >= b.runs / 2);
+    TEST_ASSERT_EQ(sim_past_alarms, 0);
+    timerServiceEnd();
+    TEST_ASSERT(!timerEventActive(&b.ev));
+}
+
+static probe_t *victim;
+
+static void stop_victim(void *arg)
+{
+    (void)arg;
+    timerEventStop(&victim->ev);
+}
+
+static void chain(void *arg)
+{
+    probe_t *p = arg;
+    if (p->runs < 10)
+        probe_start(p, 300, false);
+}
+
+static void test_stop_and_restart(void)
+{
+    probe_t a = { 0 }, b = { 0 }, c = { 0 };
+    sim_begin();
+
+    /* stopping the first event moves the alarm to the next one */
+    probe_start(&a, 100, false);
+    probe_start(&b, 500, false);
+    TEST_ASSERT_EQ(sim_alarm(), 100);
+    timerEventStop(&a.ev);
+    TEST_ASSERT_EQ(sim_alarm(), 500);
+    /* so does starting it again later */
+    probe_start(&a, 100, false);
+    TEST_ASSERT_EQ(sim_alarm(), 100);
+    probe_start(&a, 1000, false);
+    TEST_ASSERT_EQ(sim_alarm(), 500);
+    /* and earlier */
+    probe_start(&b, 50, false);
+    TEST_ASSERT_EQ(sim_alarm(), 50);
+    sim_run(2000);
+    TEST_ASSERT(a.runs == 1 && b.runs == 1);
+    TEST_ASSERT_EQ(sim_isrs, 2);
+
+    /* a callback stopping an event due at the same time */
+    a.runs = b.runs = 0;
+    victim = &b;
+    a.then = stop_victim;
+    probe_start(&a, 100, false);
+    probe_start(&b, 100, false);
+    sim_run(sim_now + 1000);
+    TEST_ASSERT(a.runs == 1 && b.runs == 0);
+
+    /* a one-shot starting itself again */
+    c.then = chain;
+    probe_start(&c, 300, false);
+    sim_run(sim_now + 10000);
+    TEST_ASSERT_EQ(c.runs, 10);
+    TEST_ASSERT_EQ(c.late_max, ENTRY_US);
+
+    /* nothing closer than the margin */
+    a.then = NULL;
+    a.late_max = 0;
+    probe_start(&a, 0, false);
+    TEST_ASSERT_EQ(sim_alarm(), sim_now + TIMER_SERVICE_MARGIN);
+    sim_run(sim_now + 100);
+    TEST_ASSERT_EQ(a.late_max, TIMER_SERVICE_MARGIN + ENTRY_US);
+    TEST_ASSERT_EQ(sim_past_alarms, 0);
+    timerServiceEnd();
+}
+
+static void test_heap_growth(void)
+{
+    static probe_t p[1024 + 1];
+    memset(p, 0, sizeof(p));
+    order_len = 0;
+    sim_begin();
+    srand(50);
+    for (int i = 0; i < 1024; i++)
+        probe_start(&p[i], 1 + rand() % 100000, false);
+    TEST_ASSERT_EQ(__timerService.capacity, 1024);
+    /* an ISR cannot grow the heap */
+    timerEventInit(&p[1024].ev, probe_run, &p[1024], false);
+    hostIsrEnter();
+    TEST_ASSERT(!timerEventStart(&p[1024].ev, 10, false));
+    hostIsrExit();
+    /* restarting a pending event needs no room */
+    p[0].due = sim_now + 5000;
+    TEST_ASSERT(timerEventStart(&p[0].ev, 5000, false));
+    sim_run(200000);
+    unsigned runs = 0;
+    for (int i = 0; i < 1024; i++)
+        runs += p[i].runs;
+    TEST_ASSERT_EQ(runs, 1024);
+    TEST_ASSERT_EQ(p[1024].runs, 0);
+    TEST_ASSERT_EQ(order_len, 1024);
+    for (unsigned i = 1; i < order_len; i++)
+        TEST_ASSERT(order[i - 1]->due <= order[i]->due);
+    timerServiceEnd();
+}
+
+/* --------------------------------------------------------- deferred runs */
+
+static volatile unsigned deferred_runs;
+static volatile bool deferred_hold, deferred_held;
+static pthread_t main_thread;
+static volatile bool ran_in_task;
+
+static void deferred_cb(void *arg)
+{
+    volatile unsigned *runs = arg;
+    ran_in_task = !pthread_equal(pthread_self(), main_thread);
+    if (runs == NULL) {
+        deferred_held = true;
+        while (deferred_hold) {
+            struct timespec ts = { 0, 100000 };
+            nanosleep(&ts, NULL);
+        }
+        return;
+    }
+    (*runs)++;
+    deferred_runs++;
+}
+
+static void wait_for(volatile unsigned *count, unsigned want)
+{
+    for (int i = 0; i < 2000 && *count < want; i++) {
+        struct timespec ts = { 0, 500000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void test_deferred(void)
+{
+    static hw_timer_event_t ev[TIMER_SERVICE_QUEUE_LEN + 8];
+    static volatile unsigned runs[TIMER_SERVICE_QUEUE_LEN + 8];
+    hw_timer_event_t hold;
+    main_thread = pthread_self();
+    sim_begin();
+
+    timerEventInit(&ev[0], deferred_cb, (void *)&runs[0], true);
+    TEST_ASSERT(timerEventStart(&ev[0], 100, false));
+    sim_run(200);
+    wait_for(&deferred_runs, 1);
+    TEST_ASSERT_EQ(runs[0], 1);
+    TEST_ASSERT(ran_in_task);
+
+    /* hold the task */
+    deferred_hold = true;
+    deferred_held = false;
+    timerEventInit(&hold, deferred_cb, NULL, true);
+    TEST_ASSERT(timerEventStart(&hold, 10, false));
+    sim_run(sim_now + 20);
+    for (int i = 0; i < 2000 && !deferred_held; i++) {
+        struct timespec ts = { 0, 500000 };
+        nanosleep(&ts, NULL);
+    }
+    TEST_ASSERT(deferred_held);
+
+    /* stopped while queued: not run */
+    runs[0] = 0;
+    TEST_ASSERT(timerEventStart(&ev[0], 10, false));
+    sim_run(sim_now + 20);
+    timerEventStop(&ev[0]);
+
+    /* the stopped run still holds a queue slot, TIMER_SERVICE_QUEUE_LEN - 1 more fit */
+    for (int i = 1; i < TIMER_SERVICE_QUEUE_LEN + 8; i++) {
+        timerEventInit(&ev[i], deferred_cb, (void *)&runs[i], true);
+        TEST_ASSERT(timerEventStart(&ev[i], 10 + i, false));
+    }
+    sim_run(sim_now + 100);
+    TEST_ASSERT_EQ(timerServiceMissed(), 8);
+    /* a run while the last one still waits is missed too */
+    TEST_ASSERT(timerEventStart(&ev[1], 10, false));
+    sim_run(sim_now + 20);
+    TEST_ASSERT_EQ(timerServiceMissed(), 9);
+
+    deferred_runs = 0;
+    deferred_hold = false;
+    wait_for(&deferred_runs, TIMER_SERVICE_QUEUE_LEN - 1);
+    struct timespec ts = { 0, 20000000 };
+    nanosleep(&ts, NULL);
+    TEST_ASSERT_EQ(deferred_runs, TIMER_SERVICE_QUEUE_LEN - 1);
+    TEST_ASSERT_EQ(runs[0], 0);
+    for (int i = 1; i < TIMER_SERVICE_QUEUE_LEN + 8; i++)
+        TEST_ASSERT_EQ(runs[i], i < TIMER_SERVICE_QUEUE_LEN ? 1 : 0);
+    timerServiceEnd();
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+/*
+ * n periodic events, periods 0.5 to 5 ms, each run taking 1 us of the
+ * simulated counter and the interrupt 2 us to enter. Lateness is the
+ * counter at the start of a run less the deadline it ran for.
+ */
+static void bench_jitter(void)
+{
+    static const unsigned counts[] = { 1, 16, 128, 1024 };
+    static probe_t p[1024];
+    for (size_t c = 0; c < 4; c++) {
+        unsigned n = counts[c];
+        uint64_t span = hostIterations(1000000);
+        memset(p, 0, sizeof(p));
+        sim_begin();
+        srand(51);
+        for (unsigned i = 0; i < n; i++) {
+            p[i].cost = 1;
+            probe_start(&p[i], 500 + rand() % 4500, true);
+        }
+        uint64_t runs = 0, sum = 0, max = 0, skipped = 0;
+        sim_run(span);
+        for (unsigned i = 0; i < n; i++) {
+            runs += p[i].runs;
+            sum += p[i].late_sum;
+            skipped += p[i].skipped;
+            if (p[i].late_max > max)
+                max = p[i].late_max;
+        }
+        BENCH("%4u events, %7.0f runs/s, %7.0f interrupts/s, late by %5.2f us mean, %3llu us worst, %llu periods skipped",
+              n, runs * 1e6 / span, sim_isrs * 1e6 / span, (double)sum / runs,
+              (unsigned long long)max, (unsigned long long)skipped);
+        TEST_ASSERT_EQ(sim_past_alarms, 0);
+        timerServiceEnd();
+    }
+}
+
+static void count_run(void *arg)
+{
+    (*(unsigned *)arg)++;
+}
+
+/* host time of the service itself: runs through the ISR, and start + stop */
+static void bench_throughput(void)
+{
+    static const unsigned counts[] = { 16, 256, 4096 };
+    static hw_timer_event_t ev[4096 + 1];
+    for (size_t c = 0; c < 3; c++) {
+        unsigned n = counts[c], runs = 0;
+        sim_begin();
+        srand(52);
+        for (unsigned i = 0; i < n; i++) {
+            timerEventInit(&ev[i], count_run, &runs, false);
+            timerEventStart(&ev[i], 100 + rand() % 10000, true);
+        }
+        uint64_t span = hostIterations(2000000);
+        uint64_t t0 = hostNowNs();
+        sim_run(span);
+        double run_ns = (double)(hostNowNs() - t0) / runs;
+
+        timerEventInit(&ev[n], count_run, &runs, false);
+        unsigned pairs = hostIterations(1000000);
+        t0 = hostNowNs();
+        for (unsigned i = 0; i < pairs; i++) {
+            timerEventStart(&ev[n], 100 + (i & 8191), false);
+            timerEventStop(&ev[n]);
+        }
+        double pair_ns = (double)(hostNowNs() - t0) / pairs;
+        BENCH("%4u events pending: %6.1f ns per run through the ISR, %6.1f ns per start + stop",
+              n, run_ns, pair_ns);
+        timerServiceEnd();
+    }
+}
+
+int main(void)
+{
+    hostClockManual(true);
+    TEST_RUN(test_arguments);
+    TEST_RUN(test_one_shots_in_order);
+    TEST_RUN(test_periodic);
+    TEST_RUN(test_stop_and_restart);
+    TEST_RUN(test_heap_growth);
+    TEST_RUN(test_deferred);
+    TEST_RUN(bench_jitter);
+    TEST_RUN(bench_throughput);
+    return TEST_EXIT();
+}
@@ -0,0 +1,642 @@
+/*
+ * UART frame mode and RS-485 driver enable against a model of the line.
+ *
+ * Byte timelines are played into a model of the receiver: a byte lands in
+ * the RX FIFO when its stop bit ends, rxfifo_full is raised at the
+ * threshold and rxfifo_tout once the line has been idle for rx_tout_thrhd
+ * character times with data left in the FIFO. Loads and stores of UART0
+ * and GPIO are traced, so a read of the FIFO register pops a byte, int_clr
+ * clears raw bits, written bytes leave one character time apart and the
+ * driver enable pin is followed on the GPIO output registers. The ISR runs
+ * on the manual clock at the moment the model raises the interrupt.
+ */
+#include "host.h"
+/* esp32-hal-uart.c has its own log_printf, the host one is in common/ */
+#define log_printf uart_log_printf
+#include "../../cores/esp32/esp32-hal-gpio.c"
+#include "../../cores/esp32/esp32-hal-matrix.c"
+#include "../../cores/esp32/esp32-hal-uart.c"
+
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* ROM and DPORT helpers the driver links against */
+uint32_t esp_dport_access_reg_read(uint32_t reg) { return *(volatile uint32_t *)(uintptr_t)reg; }
+void gpio_matrix_out(uint32_t gpio, uint32_t signal_idx, bool out_inv, bool oen_inv)
+{
+    (void)gpio; (void)signal_idx; (void)out_inv; (void)oen_inv;
+}
+void gpio_matrix_in(uint32_t gpio, uint32_t signal_idx, bool inv) { (void)gpio; (void)signal_idx; (void)inv; }
+void ets_install_putc1(void (*p)(char c)) { (void)p; }
+int ets_printf(const char *fmt, ...) { (void)fmt; return 0; }
+
+#define DE_PIN      4
+#define MAX_RX      65536
+#define MAX_TX      1024
+
+/* ------------------------------------------------------------ line model */
+
+typedef struct {
+    double at;          /* us, end of the stop bit */
+    uint8_t byte;
+    bool error;         /* framing error */
+} rx_event_t;
+
+static rx_event_t rx_events[MAX_RX];
+
+typedef struct {
+    double at;
+    bool level;
+} de_edge_t;
+
+static struct {
+    double now;         /* us, the clock follows it rounded up */
+    double symbol;      /* us per character */
+    /* receiver */
+    unsigned nrx, next_rx;
+    uint8_t fifo[UART_FIFO_LEN];
+    unsigned fifo_head, fifo_cnt;
+    unsigned overflows;
+    double rx_last;
+    bool tout_raised;
+    uint32_t full_thrhd, tout_thrhd, tout_en;
+    /* interrupts */
+    uint32_t raw, ena;
+    unsigned interrupts;
+    /* transmitter */
+    uint8_t tx[MAX_TX];
+    double tx_start[MAX_TX];
+    unsigned ntx;
+    double tx_busy_until;
+    bool tx_done_due;
+    /* driver enable pin */
+    uint32_t out;
+    de_edge_t de[64];
+    unsigned nde;
+} line;
+
+static void line_clock(double t)
+{
+    if (t > line.now)
+        line.now = t;
+    hostClockSet((int64_t)ceil(line.now));
+}
+
+static void tx_push(uint8_t c)
+{
+    if (line.ntx == MAX_TX)
+        return;
+    double start = line.now > line.tx_busy_until ? line.now : line.tx_busy_until;
+    line.tx[line.ntx] = c;
+    line.tx_start[line.ntx++] = start;
+    line.tx_busy_until = start + line.symbol;
+    line.tx_done_due = true;
+}
+
+/* bytes still waiting in the TX FIFO, the one being shifted out is not */
+static unsigned tx_queued(void)
+{
+    unsigned n = 0;
+    while (n < line.ntx && line.tx_start[line.ntx - 1 - n] > line.now)
+        n++;
+    return n;
+}
+
+static void line_store(uintptr_t addr, uint32_t value, void *arg)
+{
+    (void)arg;
+    if (addr == (uintptr_t)&UART0.int_clr) {
+        /* write only: clears raw bits and reads back as 0 */
+        line.raw &= ~value;
+        UART0.int_clr.val = 0;
+    } else if (addr == (uintptr_t)&UART0.int_ena) {
+        line.ena = value;
+    } else if (addr == (uintptr_t)&UART0.conf1) {
+        line.full_thrhd = UART0.conf1.rxfifo_full_thrhd;
+        line.tout_thrhd = UART0.conf1.rx_tout_thrhd;
+        line.tout_en = UART0.conf1.rx_tout_en;
+    } else if (addr == (uintptr_t)&UART0.fifo) {
+        tx_push(value & 0xff);
+    } else if (addr == (uintptr_t)&GPIO.out_w1ts || addr == (uintptr_t)&GPIO.out_w1tc) {
+        uint32_t out = addr == (uintptr_t)&GPIO.out_w1ts ? line.out | value : line.out & ~value;
+        bool level = (out >> DE_PIN) & 1;
+        if (level != ((line.out >> DE_PIN) & 1) && line.nde < 64)
+            line.de[line.nde++] = (de_edge_t){ line.now, level };
+        line.out = out;
+    }
+}
+
+static void line_load(uintptr_t addr, void *arg)
+{
+    (void)arg;
+    if (addr == (uintptr_t)&UART0.fifo) {
+        uint8_t c = 0;
+        if (line.fifo_cnt) {
+            c = line.fifo[line.fifo_head];
+            line.fifo_head = (line.fifo_head + 1) % UART_FIFO_LEN;
+            line.fifo_cnt--;
+        }
+        UART0.fifo.val = c;
+    } else if (addr == (uintptr_t)&UART0.int_raw) {
+        UART0.int_raw.val = line.raw;
+    } else if (addr == (uintptr_t)&UART0.int_st) {
+        UART0.int_st.val = line.raw & line.ena;
+    } else if (addr == (uintptr_t)&UART0.status) {
+        /* a writer spinning on a full TX FIFO waits for the next byte to start */
+        if (tx_queued() >= 0x7F)
+            line_clock(line.tx_start[line.ntx - 0x7F]);
+        UART0.status.rxfifo_cnt = line.fifo_cnt;
+        UART0.status.txfifo_cnt = tx_queued();
+        UART0.status.st_utx_out = line.now < line.tx_busy_until ? 2 : 0;
+    }
+}
+
+/* run the ISR while an enabled interrupt is raised */
+static void line_service(void)
+{
+    for (int i = 0; i < 4 && (line.raw & line.ena); i++) {
+        if (!hostIntrRegistered(ETS_UART0_INTR_SOURCE))
+            return;
+        line.interrupts++;
+        hostIntrFire(ETS_UART0_INTR_SOURCE);
+        if (line.full_thrhd && line.fifo_cnt >= line.full_thrhd)
+            line.raw |= UART_RXFIFO_FULL_INT_RAW;
+    }
+    /* the ISR acknowledges what it was raised for */
+    TEST_ASSERT(!(line.raw & line.ena));
+}
+
+/* play the timeline up to `until`, raising interrupts as the hardware would */
+static void line_run(double until)
+{
+    for (;;) {
+        double t = until;
+        int what = 0;
+        if (line.next_rx < line.nrx && rx_events[line.next_rx].at <= t) {
+            t = rx_events[line.next_rx].at;
+            what = 1;
+        }
+        if (line.fifo_cnt && line.tout_en && !line.tout_raised) {
+            double tout = line.rx_last + line.tout_thrhd * line.symbol;
+            if (tout < t || (tout == t && !what)) {
+                t = tout;
+                what = 2;
+            }
+        }
+        if (line.tx_done_due && line.tx_busy_until < t + (what ? 0 : 1e-9)) {
+            t = line.tx_busy_until;
+            what = 3;
+        }
+        if (!what)
+            break;
+        line_clock(t);
+        if (what == 1) {
+            rx_event_t *e = &rx_events[line.next_rx++];
+            if (line.fifo_cnt == UART_FIFO_LEN) {
+                line.overflows++;
+            } else {
+                line.fifo[(line.fifo_head + line.fifo_cnt++) % UART_FIFO_LEN] = e->byte;
+            }
+            line.rx_last = t;
+            line.tout_raised = false;
+            if (e->error)
+                line.raw |= UART_FRM_ERR_INT_RAW;
+            if (line.full_thrhd && line.fifo_cnt >= line.full_thrhd)
+                line.raw |= UART_RXFIFO_FULL_INT_RAW;
+        } else if (what == 2) {
+            line.tout_raised = true;
+            line.raw |= UART_RXFIFO_TOUT_INT_RAW;
+        } else {
+            line.tx_done_due = false;
+            line.raw |= UART_TX_DONE_INT_RAW;
+        }
+        line_service();
+    }
+    line_clock(until);
+}
+
+/* queue a frame whose first stop bit ends one character after t, returns its end */
+static double rx_frame(double t, const uint8_t *data, size_t len, double max_idle)
+{
+    for (size_t i = 0; i < len && line.nrx < MAX_RX; i++) {
+        double idle = i && max_idle > 0 ? max_idle * (rand() % 1001) / 1000.0 : 0;
+        t += (1 + idle) * line.symbol;
+        rx_events[line.nrx++] = (rx_event_t){ t, data[i], false };
+    }
+    return t;
+}
+
+static uart_t *line_begin(uint32_t baud)
+{
+    memset(&line, 0, sizeof(line));
+    hostClockManual(true);
+    hostClockSet(0);
+    hostPeriphTrace((uintptr_t)&UART0, (uintptr_t)&GPIO + sizeof(GPIO), line_store, NULL);
+    hostPeriphTraceLoads(line_load);
+    uart_t *uart = uartBegin(0, baud, SERIAL_8N1, 3, 1, 1024, false);
+    line.symbol = 10 * 1e6 / uartGetBaudRate(uart);
+    return uart;
+}
+
+static void line_end(uart_t *uart)
+{
+    uartEnd(uart);
+    hostPeriphUntrace();
+    hostClockManual(false);
+}
+
+static void fill(uint8_t *buf, size_t len, unsigned seed)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (uint8_t)(seed * 31 + i * 7);
+}
+
+/* ----------------------------------------------------------------- tests */
+
+static void test_frame_mode_arguments(void)
+{
+    uart_t *uart = line_begin(115200);
+    TEST_ASSERT(!uartSetFrameMode(NULL, 4, 64, 4));
+    TEST_ASSERT(!uartSetFrameMode(uart, 4, 0, 4));
+    TEST_ASSERT(!uartSetFrameMode(uart, 4, 64, 0));
+    TEST_ASSERT(!uartSetFrameMode(uart, 4, 64, 127));
+    TEST_ASSERT(!uartSetFrameMode(uart, 255, 64, 4));
+    TEST_ASSERT(uartSetFrameMode(uart, 4, 64, 4));
+    TEST_ASSERT_EQ(line.full_thrhd, UART_FRAME_FULL_THRHD);
+    TEST_ASSERT_EQ(line.tout_thrhd, 4);
+    TEST_ASSERT(line.ena & UART_RXFIFO_TOUT_INT_ENA);
+    TEST_ASSERT_EQ(uartFramesAvailable(uart), 0);
+    TEST_ASSERT_EQ(uartReadFrame(uart, NULL, 0, NULL, 0), 0);
+    /* the gap in time follows the baud rate */
+    TEST_ASSERT_EQ(uart->frames->gap_us, 347);
+    uartSetBaudRate(uart, 9600);
+    TEST_ASSERT_EQ(uart->frames->gap_us, 4166);
+    TEST_ASSERT(uartSetFrameMode(uart, 0, 0, 0));
+    TEST_ASSERT_EQ(line.full_thrhd, 1);
+    TEST_ASSERT(uart->frames == NULL);
+    line_end(uart);
+}
+
+/* frames up to and past the FIFO and frame size, idle inside below the gap */
+static void test_frames_by_gap(void)
+{
+    static const uint16_t lens[] = { 1, 8, 119, 120, 121, 127, 128, 129, 200, 256, 257, 300, 3 };
+    uint8_t data[300], got[300];
+    uart_t *uart = line_begin(115200);
+    TEST_ASSERT(uartSetFrameMode(uart, 4, 256, 4));
+    srand(48);
+
+    double t = 0;
+    for (size_t f = 0; f < sizeof(lens) / sizeof(lens[0]); f++) {
+        fill(data, lens[f], f);
+        /* up to 3.9 idle characters between bytes, 5 after the frame */
+        double end = rx_frame(t, data, lens[f], f & 1 ? 2.9 : 0);
+        line_run(end + 3.9 * line.symbol);
+        TEST_ASSERT_EQ(uartFramesAvailable(uart), 0);
+        line_run(end + 5 * line.symbol);
+        t = line.now;
+        TEST_ASSERT_EQ(uartFramesAvailable(uart), 1);
+
+        uart_frame_info_t info;
+        size_t n = uartReadFrame(uart, got, sizeof(got), &info, 0);
+        size_t want = lens[f] > 256 ? 256 : lens[f];
+        TEST_ASSERT_EQ(n, want);
+        TEST_ASSERT_EQ(info.len, want);
+        TEST_ASSERT_EQ(info.flags, lens[f] > 256 ? UART_FRAME_TRUNCATED : 0);
+        TEST_ASSERT(memcmp(got, data, want) == 0);
+        /* the time the last stop bit ended */
+        TEST_ASSERT(fabs(info.timestamp - end) <= 2);
+    }
+    TEST_ASSERT_EQ(line.overflows, 0);
+    TEST_ASSERT_EQ(uartFramesDropped(uart), 0);
+    /* the byte queue stays empty */
+    TEST_ASSERT_EQ(uartAvailable(uart), 0);
+    line_end(uart);
+}
+
+static void test_errors_and_full_ring(void)
+{
+    uint8_t data[64], got[64];
+    uart_t *uart = line_begin(115200);
+    TEST_ASSERT(uartSetFrameMode(uart, 4, 64, 4));
+
+    /* a framing error marks the frame it falls in, only that one */
+    fill(data, 20, 1);
+    double end = rx_frame(0, data, 20, 0);
+    rx_events[10].error = true;
+    end = rx_frame(end + 6 * line.symbol, data, 20, 0);
+    line_run(end + 6 * line.symbol);
+    uart_frame_info_t info;
+    TEST_ASSERT_EQ(uartReadFrame(uart, got, sizeof(got), &info, 0), 20);
+    TEST_ASSERT_EQ(info.flags, UART_FRAME_ERROR);
+    TEST_ASSERT_EQ(uartReadFrame(uart, got, sizeof(got), &info, 0), 20);
+    TEST_ASSERT_EQ(info.flags, 0);
+
+    /* a read buffer shorter than the frame */
+    end = rx_frame(line.now, data, 30, 0);
+    line_run(end + 6 * line.symbol);
+    TEST_ASSERT_EQ(uartReadFrame(uart, got, 10, &info, 0), 10);
+    TEST_ASSERT_EQ(info.flags, UART_FRAME_TRUNCATED);
+    TEST_ASSERT(memcmp(got, data, 10) == 0);
+
+    /* the ring holds 4 frames, later ones are counted and dropped */
+    end = line.now;
+    for (unsigned f = 0; f < 10; f++) {
+        fill(data, 8 + f, f);
+        end = rx_frame(end + 5 * line.symbol, data, 8 + f, 0);
+    }
+    line_run(end + 6 * line.symbol);
+    TEST_ASSERT_EQ(uartFramesAvailable(uart), 4);
+    TEST_ASSERT_EQ(uartFramesDropped(uart), 6);
+    for (unsigned f = 0; f < 4; f++) {
+        fill(data, 8 + f, f);
+        TEST_ASSERT_EQ(uartReadFrame(uart, got, sizeof(got), NULL, 0), 8 + f);
+        TEST_ASSERT(memcmp(got, data, 8 + f) == 0);
+    }
+    TEST_ASSERT_EQ(uartReadFrame(uart, got, sizeof(got), NULL, 0), 0);
+
+    /* and the ring is usable again */
+    fill(data, 12, 77);
+    end = rx_frame(line.now, data, 12, 0);
+    line_run(end + 6 * line.symbol);
+    TEST_ASSERT_EQ(uartReadFrame(uart, got, sizeof(got), NULL, 0), 12);
+    TEST_ASSERT(memcmp(got, data, 12) == 0);
+    line_end(uart);
+}
+
+/* without frame mode every byte is queued as before */
+static void test_byte_mode(void)
+{
+    uint8_t data[200];
+    uart_t *uart = line_begin(115200);
+    fill(data, sizeof(data), 3);
+    double end = rx_frame(0, data, sizeof(data), 1.5);
+    line_run(end + 10 * line.symbol);
+    TEST_ASSERT_EQ(uartAvailable(uart), sizeof(data));
+    for (size_t i = 0; i < sizeof(data); i++)
+        TEST_ASSERT_EQ(uartRead(uart), data[i]);
+    TEST_ASSERT_EQ(line.interrupts, sizeof(data));
+    TEST_ASSERT_EQ(uartFramesAvailable(uart), 0);
+    line_end(uart);
+}
+
+static uart_t *reader_uart;
+static _Atomic unsigned readers_done;
+static _Atomic size_t readers_got;
+
+static void *frame_reader(void *arg)
+{
+    (void)arg;
+    uint8_t buf[64];
+    readers_got += uartReadFrame(reader_uart, buf, sizeof(buf), NULL, 100000);
+    readers_done++;
+    return NULL;
+}
+
+/* readers blocked on the old frames return when the mode changes */
+static void test_mode_change_wakes_readers(void)
+{
+    uint8_t data[20], got[64];
+    mallopt(M_PERTURB, 0xa5);   /* freed frames read as garbage */
+    uart_t *uart = line_begin(115200);
+    TEST_ASSERT(uartSetFrameMode(uart, 4, 64, 4));
+    reader_uart = uart;
+    readers_done = 0;
+    readers_got = 0;
+    pthread_t t[3];
+    for (int i = 0; i < 3; i++)
+        pthread_create(&t[i], NULL, frame_reader, NULL);
+    struct timespec ts = { 0, 20000000 };
+    nanosleep(&ts, NULL);
+    TEST_ASSERT_EQ(readers_done, 0);
+
+    TEST_ASSERT(uartSetFrameMode(uart, 2, 32, 4));
+    for (int i = 0; i < 3; i++)
+        pthread_join(t[i], NULL);
+    TEST_ASSERT_EQ(readers_done, 3);
+    TEST_ASSERT_EQ(readers_got, 0);
+
+    /* the new frames work */
+    fill(data, sizeof(data), 9);
+    double end = rx_frame(line.now, data, sizeof(data), 0);
+    line_run(end + 5 * line.symbol);
+    TEST_ASSERT_EQ(uartReadFrame(uart, got, sizeof(got), NULL, 0), sizeof(data));
+    TEST_ASSERT(memcmp(got, data, sizeof(data)) == 0);
+
+    /* and so do frame mode off and uartEnd() with a reader waiting */
+    pthread_create(&t[0], NULL, frame_reader, NULL);
+    nanosleep(&ts, NULL);
+    TEST_ASSERT(uartSetFrameMode(uart, 0, 0, 0));
+    pthread_join(t[0], NULL);
+    TEST_ASSERT_EQ(readers_done, 4);
+    TEST_ASSERT(uartSetFrameMode(uart, 2, 32, 4));
+    pthread_create(&t[0], NULL, frame_reader, NULL);
+    nanosleep(&ts, NULL);
+    line_end(uart);
+    pthread_join(t[0], NULL);
+    TEST_ASSERT_EQ(readers_done, 5);
+    TEST_ASSERT_EQ(readers_got, 0);
+    mallopt(M_PERTURB, 0);
+}
+
+/* DE goes active before the first start bit and inactive after the last stop bit */
+static void check_de(unsigned from, unsigned first, unsigned last, bool active)
+{
+    TEST_ASSERT_EQ(line.nde, from + 2);
+    if (line.nde != from + 2)
+        return;
+    TEST_ASSERT_EQ(line.de[from].level, active);
+    TEST_ASSERT_EQ(line.de[from + 1].level, !active);
+    TEST_ASSERT(line.de[from].at <= line.tx_start[first]);
+    double end = line.tx_start[last] + line.symbol;
+    TEST_ASSERT(line.de[from + 1].at >= end && line.de[from + 1].at <= end + 1);
+}
+
+static void test_rs485_driver_enable(void)
+{
+    uint8_t data[300];
+    uart_t *uart = line_begin(115200);
+    uartSetRS485(uart, DE_PIN, true);
+    TEST_ASSERT_EQ(line.nde, 0);
+    TEST_ASSERT(!(line.ena & UART_TX_DONE_INT_ENA));
+
+    /* more than the TX FIFO holds */
+    fill(data, sizeof(data), 5);
+    line_clock(100);
+    uartWriteBuf(uart, data, sizeof(data));
+    TEST_ASSERT_EQ(line.ntx, sizeof(data));
+    TEST_ASSERT(memcmp(line.tx, data, sizeof(data)) == 0);
+    TEST_ASSERT(line.ena & UART_TX_DONE_INT_ENA);
+    line_run(line.tx_busy_until + 20 * line.symbol);
+    check_de(0, 0, sizeof(data) - 1, true);
+    TEST_ASSERT(!(line.ena & UART_TX_DONE_INT_ENA));
+
+    /* bytes written back to back share one DE pulse */
+    unsigned from = line.nde, first = line.ntx;
+    for (int i = 0; i < 3; i++)
+        uartWrite(uart, 'a' + i);
+    line_run(line.tx_busy_until + 20 * line.symbol);
+    check_de(from, first, line.ntx - 1, true);
+
+    /* and bytes further apart one each */
+    for (int i = 0; i < 3; i++) {
+        from = line.nde;
+        uartWrite(uart, 'x' + i);
+        line_run(line.tx_busy_until + 3 * line.symbol);
+        check_de(from, line.ntx - 1, line.ntx - 1, true);
+    }
+
+    /* active low */
+    uartSetRS485(uart, DE_PIN, false);
+    TEST_ASSERT(line.out & (1 << DE_PIN));
+    from = line.nde;
+    uartWriteBuf(uart, data, 10);
+    line_run(line.tx_busy_until + 20 * line.symbol);
+    check_de(from, line.ntx - 10, line.ntx - 1, false);
+
+    /* turning it off mid transfer releases the pin */
+    from = line.nde;
+    uartSetRS485(uart, DE_PIN, true);
+    uartWriteBuf(uart, data, 10);
+    uartSetRS485(uart, -1, true);
+    TEST_ASSERT(!(line.out & (1 << DE_PIN)));
+    TEST_ASSERT(!(line.ena & UART_TX_DONE_INT_ENA));
+    line_run(line.tx_busy_until + 20 * line.symbol);
+    TEST_ASSERT(!(line.out & (1 << DE_PIN)));
+    line_end(uart);
+}
+
+/* detaching RX keeps the tx_done interrupt the driver enable needs */
+static void test_rs485_after_rx_detach(void)
+{
+    uint8_t data[10];
+    uart_t *uart = line_begin(115200);
+    uartSetRS485(uart, DE_PIN, true);
+    uartDetachRx(uart);
+    TEST_ASSERT(hostIntrRegistered(ETS_UART0_INTR_SOURCE));
+    fill(data, sizeof(data), 3);
+    line_clock(100);
+    uartWriteBuf(uart, data, sizeof(data));
+    line_run(line.tx_busy_until + 20 * line.symbol);
+    check_de(0, 0, sizeof(data) - 1, true);
+    line_end(uart);
+    TEST_ASSERT(!hostIntrRegistered(ETS_UART0_INTR_SOURCE));
+    TEST_ASSERT(!(line.out & (1 << DE_PIN)));
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+/* interrupts taken per frame, bytes queued one by one against frame mode */
+static void bench_interrupts(void)
+{
+    static const uint16_t lens[] = { 8, 64, 256 };
+    uint8_t data[256], got[256];
+    for (int frames = 0; frames < 2; frames++) {
+        for (size_t l = 0; l < 3; l++) {
+            unsigned n = hostIterations(100);
+            uart_t *uart = line_begin(115200);
+            if (frames)
+                uartSetFrameMode(uart, 4, 256, 4);
+            srand(48);
+            double end = 0;
+            unsigned ok = 0;
+            for (unsigned f = 0; f < n; f++) {
+                fill(data, lens[l], f);
+                end = rx_frame(line.now, data, lens[l], 1.5);
+                line_run(end + 5 * line.symbol);
+                if (frames) {
+                    ok += uartReadFrame(uart, got, sizeof(got), NULL, 0) == lens[l];
+                } else {
+                    ok += uartAvailable(uart) == lens[l];
+                    while (uartAvailable(uart))
+                        uartRead(uart);
+                }
+            }
+            TEST_ASSERT_EQ(ok, n);
+            BENCH("%-11s %3u byte frames, %6.2f interrupts per frame",
+                  frames ? "frame mode" : "byte queue", lens[l], (double)line.interrupts / n);
+            line_end(uart);
+        }
+    }
+}
+
+/*
+ * Modbus RTU at 9600 baud, frames 3.5 to 6 characters apart, split by a
+ * sketch loop that polls available() and closes a frame once micros() says
+ * nothing came for 3.5 characters, against readFrame() in the same loop.
+ * The loop does other work for up to `busy` ms between passes.
+ */
+static void bench_frame_split(void)
+{
+    static const unsigned busys[] = { 0, 1, 2, 5 };
+    uint8_t data[64], got[1024];
+    for (int frames = 0; frames < 2; frames++) {
+        for (size_t b = 0; b < 4; b++) {
+            unsigned n = hostIterations(400);
+            uart_t *uart = line_begin(9600);
+            if (frames)
+                uartSetFrameMode(uart, 8, 256, 4);
+            srand(49);
+            double t = 0;
+            unsigned lens[400];
+            for (unsigned f = 0; f < n; f++) {
+                lens[f] = 8 + rand() % 24;
+                fill(data, lens[f], f);
+                /* 3.5 to 6 idle characters before the next frame */
+                t = rx_frame(t, data, lens[f], 0.5) + (3.5 + (rand() % 251) / 100.0) * line.symbol;
+            }
+            double gap = 3.5 * line.symbol;
+            unsigned good = 0, next = 0, reads = 0, len = 0;
+            int64_t last = 0;
+            while (line.now < t + 10 * line.symbol) {
+                line_run(line.now + 50 + (busys[b] ? rand() % (busys[b] * 1000) : 0));
+                size_t got_len = 0;
+                if (frames) {
+                    got_len = uartReadFrame(uart, got, sizeof(got), NULL, 0);
+                } else if (uartAvailable(uart)) {
+                    while (uartAvailable(uart)) {
+                        uint8_t c = uartRead(uart);
+                        if (len < sizeof(got))
+                            got[len++] = c;
+                    }
+                    last = micros();
+                } else if (len && micros() - last >= gap) {
+                    got_len = len;
+                    len = 0;
+                }
+                if (!got_len)
+                    continue;
+                /* a read that runs frames together uses them all up */
+                reads++;
+                if (next < n) {
+                    fill(data, lens[next], next);
+                    good += got_len == lens[next] && !memcmp(got, data, got_len);
+                }
+                for (size_t used = 0; next < n && used < got_len; next++)
+                    used += lens[next];
+            }
+            if (frames)
+                TEST_ASSERT_EQ(good, n);
+            BENCH("%-15s loop busy up to %u ms: %5.1f%% of %u frames read whole, %u reads",
+                  frames ? "readFrame()" : "poll + micros()", busys[b], 100.0 * good / n, n, reads);
+            line_end(uart);
+        }
+    }
+}
+
+int main(void)
+{
+    TEST_RUN(test_frame_mode_arguments);
+    TEST_RUN(test_frames_by_gap);
+    TEST_RUN(test_errors_and_full_ring);
+    TEST_RUN(test_byte_mode);
+    TEST_RUN(test_mode_change_wakes_readers);
+    TEST_RUN(test_rs485_driver_enable);
+    TEST_RUN(test_rs485_after_rx_detach);
+    TEST_RUN(bench_interrupts);
+    TEST_RUN(bench_frame_split);
+    return TEST_EXIT();
+}
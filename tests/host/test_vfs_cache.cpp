@@ -0,0 +1,365 @@
+/*
+ * The VFS layer's stat cache and open path against a slow backend.
+ *
+ * The file system is a temporary directory. Every path lookup the code
+ * makes (stat, fopen, opendir, unlink) is counted and made to take
+ * LOOKUP_US of real time, like a SPIFFS object lookup, so lookups per open
+ * are exact and opens/s reflect what the lookups cost. The open path this
+ * replaced is kept below as the baseline.
+ */
+#include "host.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../../libraries/FS/src/FS.cpp"
+
+#define LOOKUP_US 100
+
+static unsigned lookups;
+
+static void lookup(void)
+{
+    lookups++;
+    uint64_t end = hostNowNs() + LOOKUP_US * 1000;
+    while (hostNowNs() < end) {
+    }
+}
+
+static int slow_stat(const char* path, struct stat* st)
+{
+    lookup();
+    return stat(path, st);
+}
+
+static FILE* slow_fopen(const char* path, const char* mode)
+{
+    lookup();
+    return fopen(path, mode);
+}
+
+static DIR* slow_opendir(const char* path)
+{
+    lookup();
+    return opendir(path);
+}
+
+static int slow_unlink(const char* path)
+{
+    lookup();
+    return unlink(path);
+}
+
+#define stat(p, st)   slow_stat(p, st)
+#define fopen(p, m)   slow_fopen(p, m)
+#define opendir(p)    slow_opendir(p)
+#define unlink(p)     slow_unlink(p)
+#include "../../libraries/FS/src/vfs_api.cpp"
+
+/* VFSImpl::open() and the VFSFileImpl constructor before the cache: both built and stat'ed the path. */
+static FILE* legacy_open(const char* mountpoint, const char* path, const char* mode)
+{
+    char* temp = (char*)malloc(strlen(path) + strlen(mountpoint) + 2);
+    sprintf(temp, "%s%s", mountpoint, path);
+    struct stat st;
+    if (stat(temp, &st)) {
+        DIR* d = opendir(temp);
+        if (d) {
+            closedir(d);
+        }
+        free(temp);
+        return NULL;
+    }
+    free(temp);
+
+    temp = (char*)malloc(strlen(path) + strlen(mountpoint) + 1);
+    sprintf(temp, "%s%s", mountpoint, path);
+    char* name = strdup(path);
+    FILE* f = NULL;
+    if (!stat(temp, &st) && S_ISREG(st.st_mode)) {
+        f = fopen(temp, mode);
+    }
+    free(temp);
+    free(name);
+    return f;
+}
+
+static char root[64];
+static VFSImpl* vfs;
+static FS* disk;
+
+static void put(const char* path, size_t size)
+{
+    char full[VFS_PATH_MAX];
+    snprintf(full, sizeof(full), "%s%s", root, path);
+    FILE* f = ::fopen(full, "w");
+    for (size_t i = 0; i < size; i++) {
+        fputc('a' + i % 26, f);
+    }
+    fclose(f);
+}
+
+static void test_warm_open_takes_one_lookup(void)
+{
+    put("/a.txt", 100);
+    vfs->invalidateCache();
+    lookups = 0;
+    File f = disk->open("/a.txt");
+    TEST_ASSERT(f);
+    TEST_ASSERT_EQ(f.size(), 100);
+    f.close();
+    TEST_ASSERT_EQ(lookups, 2);     /* stat + fopen */
+    lookups = 0;
+    f = disk->open("/a.txt");
+    TEST_ASSERT_EQ(f.size(), 100);
+    f.close();
+    TEST_ASSERT_EQ(lookups, 1);     /* fopen only */
+    lookups = 0;
+    TEST_ASSERT(disk->exists("/a.txt"));
+    TEST_ASSERT_EQ(lookups, 0);
+}
+
+static void test_writes_invalidate(void)
+{
+    put("/w.txt", 100);
+    File f = disk->open("/w.txt");
+    TEST_ASSERT_EQ(f.size(), 100);
+    f.close();
+
+    f = disk->open("/w.txt", FILE_WRITE);
+    TEST_ASSERT_EQ(f.size(), 0);            /* truncated by "w" */
+    f.write((const uint8_t*)"hello world", 11);
+    TEST_ASSERT_EQ(f.size(), 11);
+    f.close();
+    f = disk->open("/w.txt");
+    TEST_ASSERT_EQ(f.size(), 11);
+    f.close();
+
+    f = disk->open("/w.txt", FILE_APPEND);
+    f.write((const uint8_t*)"!", 1);
+    f.close();
+    f = disk->open("/w.txt");
+    TEST_ASSERT_EQ(f.size(), 12);
+    f.close();
+
+    /* a file created through the cache after a cached miss */
+    TEST_ASSERT(!disk->exists("/new.txt"));
+    f = disk->open("/new.txt", FILE_WRITE);
+    f.write((const uint8_t*)"x", 1);
+    f.close();
+    TEST_ASSERT(disk->exists("/new.txt"));
+    f = disk->open("/new.txt");
+    TEST_ASSERT_EQ(f.size(), 1);
+    f.close();
+}
+
+static void test_remove_and_rename_invalidate(void)
+{
+    put("/r.txt", 10);
+    TEST_ASSERT(disk->exists("/r.txt"));
+    TEST_ASSERT(disk->remove("/r.txt"));
+    TEST_ASSERT(!disk->exists("/r.txt"));
+    TEST_ASSERT(!disk->open("/r.txt"));
+
+    put("/from.txt", 20);
+    put("/to.txt", 5);
+    TEST_ASSERT_EQ(disk->open("/to.txt").size(), 5);
+    TEST_ASSERT(disk->rename("/from.txt", "/to.txt"));
+    TEST_ASSERT(!disk->exists("/from.txt"));
+    TEST_ASSERT_EQ(disk->open("/to.txt").size(), 20);
+
+    /* renaming a directory moves the cached entries below it */
+    TEST_ASSERT(disk->mkdir("/d"));
+    put("/d/in.txt", 7);
+    TEST_ASSERT_EQ(disk->open("/d/in.txt").size(), 7);
+    TEST_ASSERT(!disk->exists("/e/in.txt"));
+    TEST_ASSERT(disk->rename("/d", "/e"));
+    TEST_ASSERT(!disk->open("/d/in.txt"));
+    TEST_ASSERT_EQ(disk->open("/e/in.txt").size(), 7);
+}
+
+static void test_missing_probe_cached(void)
+{
+    lookups = 0;
+    TEST_ASSERT(!disk->exists("/nope.gz"));
+    TEST_ASSERT_EQ(lookups, 2);     /* stat + opendir */
+    lookups = 0;
+    TEST_ASSERT(!disk->exists("/nope.gz"));
+    TEST_ASSERT(!disk->open("/nope.gz"));
+    TEST_ASSERT_EQ(lookups, 0);
+    File f = disk->open("/nope.gz", FILE_WRITE);
+    TEST_ASSERT(f && !f.isDirectory());
+    f.close();
+    TEST_ASSERT(disk->exists("/nope.gz"));
+    TEST_ASSERT(disk->remove("/nope.gz"));
+    TEST_ASSERT(!disk->exists("/nope.gz"));
+}
+
+/* a change made behind the VFSImpl shows once the entry is VFS_STAT_CACHE_TTL_MS old */
+static void test_outside_changes_expire(void)
+{
+    char full[VFS_PATH_MAX];
+    snprintf(full, sizeof(full), "%s/ext.txt", root);
+    TEST_ASSERT(!disk->exists("/ext.txt"));
+    put("/ext.txt", 10);
+    TEST_ASSERT(!disk->exists("/ext.txt"));         /* cached miss */
+    hostClockAdvance(VFS_STAT_CACHE_TTL_MS * 1000LL);
+    lookups = 0;
+    TEST_ASSERT(disk->exists("/ext.txt"));
+    TEST_ASSERT_EQ(lookups, 1);
+    TEST_ASSERT_EQ(disk->open("/ext.txt").size(), 10);
+
+    put("/ext.txt", 25);
+    TEST_ASSERT_EQ(disk->open("/ext.txt").size(), 10);  /* cached size */
+    hostClockAdvance(VFS_STAT_CACHE_TTL_MS * 1000LL);
+    TEST_ASSERT_EQ(disk->open("/ext.txt").size(), 25);
+
+    ::unlink(full);
+    hostClockAdvance(VFS_STAT_CACHE_TTL_MS * 1000LL);
+    TEST_ASSERT(!disk->exists("/ext.txt"));
+    TEST_ASSERT(!disk->open("/ext.txt"));
+}
+
+static void test_directories_and_long_paths(void)
+{
+    TEST_ASSERT(disk->mkdir("/dir"));
+    put("/dir/x.txt", 1);
+    File d = disk->open("/dir");
+    TEST_ASSERT(d && d.isDirectory());
+    /* the host lists "." and "..", which SPIFFS and FAT do not */
+    File x = d.openNextFile();
+    while (x && x.isDirectory()) {
+        x = d.openNextFile();
+    }
+    TEST_ASSERT(x && !strcmp(x.name(), "/dir/x.txt"));
+    TEST_ASSERT(disk->exists("/"));
+    TEST_ASSERT(disk->open("/").isDirectory());
+
+    char path[VFS_PATH_MAX + 8];
+    memset(path, 'p', sizeof(path) - 1);
+    path[0] = '/';
+    path[sizeof(path) - 1] = 0;
+    TEST_ASSERT(!disk->open(path));
+    TEST_ASSERT(!disk->exists(path));
+}
+
+#define ASSETS 21   /* index.html + 20 assets */
+
+static void asset_name(char* buf, int i)
+{
+    sprintf(buf, "/asset%02d.%s", i, i ? "js" : "html");
+}
+
+static void serve_page(bool legacy)
+{
+    static uint8_t buf[512];
+    char name[32];
+    for (int i = 0; i < ASSETS; i++) {
+        asset_name(name, i);
+        if (legacy) {
+            FILE* f = legacy_open(root, name, "r");
+            while (fread(buf, 1, sizeof(buf), f) > 0) {
+            }
+            ::fclose(f);
+        } else {
+            File f = disk->open(name);
+            while (f.read(buf, sizeof(buf)) > 0) {
+            }
+        }
+    }
+}
+
+static void bench_page_opens(void)
+{
+    char name[32];
+    for (int i = 0; i < ASSETS; i++) {
+        asset_name(name, i);
+        put(name, 2000);
+    }
+    unsigned pages = hostIterations(40);
+    const char* label[] = { "before (open + ctor stat)", "stat cache" };
+    for (int legacy = 1; legacy >= 0; legacy--) {
+        vfs->invalidateCache();
+        lookups = 0;
+        serve_page(legacy);
+        unsigned cold = lookups;
+        lookups = 0;
+        uint64_t t0 = hostNowNs();
+        for (unsigned p = 0; p < pages; p++) {
+            serve_page(legacy);
+        }
+        double secs = (hostNowNs() - t0) / 1e9;
+        double warm = (double)lookups / pages;
+        if (legacy) {
+            TEST_ASSERT_EQ(cold, 3 * ASSETS);
+        } else {
+            TEST_ASSERT_EQ(cold, 2 * ASSETS);
+            TEST_ASSERT_EQ(warm, ASSETS);
+        }
+        BENCH("%-26s %2u lookups first page, %4.1f per page after, %6.0f opens/s (%d us/lookup)",
+              label[!legacy], cold, warm, pages * ASSETS / secs, LOOKUP_US);
+    }
+
+    /* probing for a missing sibling, e.g. a pre-compressed .gz */
+    lookups = 0;
+    for (unsigned p = 0; p < pages; p++) {
+        TEST_ASSERT(!legacy_open(root, "/asset01.js.gz", "r"));
+    }
+    double before = (double)lookups / pages;
+    lookups = 0;
+    TEST_ASSERT(!disk->exists("/asset01.js.gz"));
+    unsigned first = lookups;
+    for (unsigned p = 1; p < pages; p++) {
+        TEST_ASSERT(!disk->exists("/asset01.js.gz"));
+    }
+    BENCH("missing .gz probe: %.0f lookups each before, now %u the first time and %u after",
+          before, first, lookups - first);
+}
+
+static void cleanup(const char* dir)
+{
+    DIR* d = ::opendir(dir);
+    struct dirent* e;
+    while (d && (e = readdir(d))) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if (e->d_type == DT_DIR) {
+            cleanup(path);
+        } else {
+            ::unlink(path);
+        }
+    }
+    if (d) {
+        closedir(d);
+    }
+    rmdir(dir);
+}
+
+int main(void)
+{
+    strcpy(root, "/tmp/vfs_cache_XXXXXX");
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    hostClockManual(true);          /* cache entries only expire when a test says so */
+    vfs = new VFSImpl();
+    disk = new FS(FSImplPtr(vfs));
+    vfs->mountpoint(root);
+
+    TEST_RUN(test_warm_open_takes_one_lookup);
+    TEST_RUN(test_writes_invalidate);
+    TEST_RUN(test_remove_and_rename_invalidate);
+    TEST_RUN(test_missing_probe_cached);
+    TEST_RUN(test_outside_changes_expire);
+    TEST_RUN(test_directories_and_long_paths);
+    TEST_RUN(bench_page_opens);
+
+    cleanup(root);
+    return TEST_EXIT();
+}
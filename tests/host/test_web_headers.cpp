@@ -0,0 +1,415 @@
+/*
+ * WebServer's fixed buffer response header builder against the String
+ * concatenation it replaced.
+ *
+ * The old sendHeader()/_prepareHeader()/send() are kept here as they were,
+ * on the same server, so both can answer the same random responses; what
+ * they put on the wire must match byte for byte. The server writes to one
+ * end of a socket pair and the test reads the other. _currentClientWrite()
+ * is overridden to count the writes, and malloc is interposed to count
+ * allocations per response. The benchmark answers a typical small JSON
+ * request both ways, with the writes discarded and over the socket pair.
+ */
+#include "host.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../../libraries/FS/src/FS.cpp"
+#include <WiFi.h>
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/WiFi/src/WiFiServer.cpp"
+#include "../../libraries/WebServer/src/WebServer.cpp"
+/* both files have a static Content_Type */
+#define Content_Type  Parsing_Content_Type
+#include "../../libraries/WebServer/src/Parsing.cpp"
+#undef Content_Type
+#include "../../libraries/WebServer/src/detail/UriRouter.cpp"
+#include "../../libraries/WebServer/src/detail/mimetable.cpp"
+
+/* ---------------------------------------------------------- allocations */
+
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+
+static __thread bool counting;
+static unsigned allocs;
+
+extern "C" void* malloc(size_t n)
+{
+    if (counting)
+        allocs++;
+    return __libc_malloc(n);
+}
+
+extern "C" void* calloc(size_t n, size_t size)
+{
+    if (counting)
+        allocs++;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* p, size_t n)
+{
+    if (counting)
+        allocs++;
+    return __libc_realloc(p, n);
+}
+
+/* --------------------------------------------------------------- server */
+
+class TestServer : public WebServer {
+public:
+    unsigned writes;
+    bool discard;           /* count the writes but send nothing */
+    int peer;
+
+    TestServer() : WebServer(0), writes(0), discard(false) {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        int size = 1 << 20;
+        setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        _currentClient = WiFiClient(sv[0]);
+        peer = sv[1];
+    }
+
+    ~TestServer() {
+        ::close(peer);
+    }
+
+    /* what handleClient() sets up before calling a handler */
+    void request(uint8_t version) {
+        _currentVersion = version;
+        _contentLength = CONTENT_LENGTH_NOT_SET;
+        _chunked = false;
+        writes = 0;
+    }
+
+    /* everything written since the last call */
+    std::string wire() {
+        std::string out;
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(peer, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            out.append(buf, n);
+        return out;
+    }
+
+    /* ---- the builder before, String concatenation */
+
+    String _legacyHeaders;
+
+    void legacySendHeader(const String& name, const String& value, bool first = false) {
+        String headerLine = name;
+        headerLine += F(": ");
+        headerLine += value;
+        headerLine += "\r\n";
+
+        if (first) {
+            _legacyHeaders = headerLine + _legacyHeaders;
+        }
+        else {
+            _legacyHeaders += headerLine;
+        }
+    }
+
+    void legacyPrepareHeader(String& response, int code, const char* content_type, size_t contentLength) {
+        response = String(F("HTTP/1.")) + String(_currentVersion) + ' ';
+        response += String(code);
+        response += ' ';
+        response += _responseCodeToString(code);
+        response += "\r\n";
+
+        using namespace mime;
+        if (!content_type)
+            content_type = mimeTable[html].mimeType;
+
+        legacySendHeader(String(F("Content-Type")), String(FPSTR(content_type)), true);
+        if (_contentLength == CONTENT_LENGTH_NOT_SET) {
+            legacySendHeader(String(FPSTR(Content_Length)), String(contentLength));
+        } else if (_contentLength != CONTENT_LENGTH_UNKNOWN) {
+            legacySendHeader(String(FPSTR(Content_Length)), String(_contentLength));
+        } else if(_contentLength == CONTENT_LENGTH_UNKNOWN && _currentVersion){ //HTTP/1.1 or above client
+          //let's do chunked
+          _chunked = true;
+          legacySendHeader(String(F("Accept-Ranges")),String(F("none")));
+          legacySendHeader(String(F("Transfer-Encoding")),String(F("chunked")));
+        }
+        legacySendHeader(String(F("Connection")), String(F("close")));
+
+        response += _legacyHeaders;
+        response += "\r\n";
+        _legacyHeaders = "";
+    }
+
+    void legacySendContent(const String& content) {
+        const char * footer = "\r\n";
+        size_t len = content.length();
+        if(_chunked) {
+            char * chunkSize = (char *)malloc(11);
+            if(chunkSize){
+                sprintf(chunkSize, "%x%s", (unsigned)len, footer);
+                _currentClientWrite(chunkSize, strlen(chunkSize));
+                free(chunkSize);
+            }
+        }
+        _currentClientWrite(content.c_str(), len);
+        if(_chunked){
+            _currentClient.write(footer, 2);
+            if (len == 0) {
+                _chunked = false;
+            }
+        }
+    }
+
+    void legacySend(int code, const char* content_type, const String& content) {
+        String header;
+        legacyPrepareHeader(header, code, content_type, content.length());
+        _currentClientWrite(header.c_str(), header.length());
+        if(content.length())
+            legacySendContent(content);
+    }
+
+protected:
+    size_t _currentClientWrite(const char* b, size_t l) override {
+        writes++;
+        return discard ? l : WebServer::_currentClientWrite(b, l);
+    }
+};
+
+/* ----------------------------------------------------------------- tests */
+
+static std::string random_token(size_t max)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_./;=, ";
+    std::string s;
+    for (size_t n = 1 + rand() % max; n > 0; n--)
+        s += chars[rand() % (sizeof(chars) - 1)];
+    return s;
+}
+
+static void test_same_bytes_as_before(void)
+{
+    TestServer server;
+    const int codes[] = { 200, 201, 204, 301, 304, 400, 404, 500, 299 };
+    const char* types[] = { NULL, "text/plain", "application/json", "text/html; charset=utf-8" };
+    const size_t lengths[] = { CONTENT_LENGTH_NOT_SET, CONTENT_LENGTH_UNKNOWN, 0 };
+    srand(43);
+    unsigned rounds = hostIterations(2000), single = 0;
+    for (unsigned round = 0; round < rounds; round++) {
+        uint8_t version = rand() % 4 ? 1 : 0;
+        int code = codes[rand() % 9];
+        const char* type = types[rand() % 4];
+        size_t length = lengths[rand() % 3];
+        std::vector<std::pair<std::string, std::string> > headers;
+        std::vector<bool> first;
+        for (int n = rand() % 8; n > 0; n--) {
+            headers.push_back(std::make_pair(random_token(20), random_token(40)));
+            first.push_back(rand() % 4 == 0);
+        }
+        std::string body = rand() % 4 ? random_token(rand() % 2 ? 64 : 2000) : "";
+        String content = body.c_str();
+        if (length == 0)
+            length = body.size();
+        /* a chunked response ends with an empty chunk */
+        bool chunked = length == CONTENT_LENGTH_UNKNOWN && version;
+
+        server.request(version);
+        if (length != CONTENT_LENGTH_NOT_SET)
+            server.setContentLength(length);
+        for (size_t i = 0; i < headers.size(); i++)
+            server.legacySendHeader(headers[i].first.c_str(), headers[i].second.c_str(), first[i]);
+        server.legacySend(code, type, content);
+        if (chunked)
+            server.legacySendContent("");
+        std::string before = server.wire();
+
+        server.request(version);
+        if (length != CONTENT_LENGTH_NOT_SET)
+            server.setContentLength(length);
+        for (size_t i = 0; i < headers.size(); i++) {
+            if (rand() % 2)
+                server.sendHeader(headers[i].first.c_str(), headers[i].second.c_str(), first[i]);
+            else
+                server.sendHeader(String(headers[i].first.c_str()), String(headers[i].second.c_str()), first[i]);
+        }
+        server.send(code, type, content);
+        unsigned writes = server.writes;
+        if (chunked)
+            server.sendContent("");
+        std::string after = server.wire();
+
+        if (before != after)
+            fprintf(stderr, "  round %u:\n%s\n---\n%s\n", round, before.c_str(), after.c_str());
+        TEST_ASSERT(before == after);
+        if (after.size() - (chunked ? 5 : 0) <= HTTP_HEADER_BUFLEN - HTTP_STATUS_LINE_MAX) {
+            TEST_ASSERT_EQ(writes, 1u);
+            single++;
+        }
+    }
+    TEST_ASSERT(single > rounds / 2);
+}
+
+static void test_one_write_for_small_replies(void)
+{
+    TestServer server;
+    server.request(1);
+    server.sendHeader("Cache-Control", "no-cache");
+    server.send(200, "application/json", "{\"ok\":true}");
+    TEST_ASSERT_EQ(server.writes, 1u);
+    TEST_ASSERT(server.wire() == "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: application/json\r\n"
+                                 "Cache-Control: no-cache\r\n"
+                                 "Content-Length: 11\r\n"
+                                 "Connection: close\r\n"
+                                 "\r\n"
+                                 "{\"ok\":true}");
+
+    /* chunked, the first chunk goes with the header */
+    server.request(1);
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "text/plain", "abc");
+    TEST_ASSERT_EQ(server.writes, 1u);
+    server.sendContent("de");
+    server.sendContent("");
+    TEST_ASSERT(server.wire() == "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: text/plain\r\n"
+                                 "Accept-Ranges: none\r\n"
+                                 "Transfer-Encoding: chunked\r\n"
+                                 "Connection: close\r\n"
+                                 "\r\n"
+                                 "3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n");
+
+    /* a body that does not fit goes out after the header */
+    server.request(1);
+    String big;
+    for (int i = 0; i < HTTP_HEADER_BUFLEN; i++)
+        big += (char)('a' + i % 26);
+    server.send(200, "text/plain", big);
+    TEST_ASSERT_EQ(server.writes, 2u);
+    std::string wire = server.wire();
+    TEST_ASSERT(wire.size() > (size_t)HTTP_HEADER_BUFLEN);
+    TEST_ASSERT(wire.compare(wire.size() - big.length(), big.length(), big.c_str()) == 0);
+}
+
+static void test_send_P_chunked(void)
+{
+    static const char page[] PROGMEM = "<p>hi</p>";
+    TestServer server;
+    /* the header used to go out as a chunk of its own */
+    server.request(1);
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send_P(200, PSTR("text/html"), page, sizeof(page) - 1);
+    server.sendContent("");
+    std::string wire = server.wire();
+    TEST_ASSERT(wire.compare(0, 17, "HTTP/1.1 200 OK\r\n") == 0);
+    TEST_ASSERT(wire.find("\r\n\r\n9\r\n<p>hi</p>\r\n0\r\n\r\n") != std::string::npos);
+
+    server.request(0);
+    server.send_P(200, PSTR("text/html"), page);
+    TEST_ASSERT_EQ(server.writes, 1u);
+    wire = server.wire();
+    TEST_ASSERT(wire.compare(0, 17, "HTTP/1.0 200 OK\r\n") == 0);
+    TEST_ASSERT(wire.find("Content-Length: 9\r\n") != std::string::npos);
+    TEST_ASSERT(wire.compare(wire.size() - 13, 13, "\r\n\r\n<p>hi</p>") == 0);
+}
+
+static void test_headers_that_do_not_fit(void)
+{
+    TestServer server;
+    server.request(1);
+    std::string value(60, 'v');
+    std::string expect = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n";
+    for (int i = 0; i < 30; i++) {
+        std::string name = "X-Header-" + std::to_string(i);
+        server.sendHeader(name.c_str(), value.c_str());
+        expect += name + ": " + value + "\r\n";
+    }
+    server.send(404, "text/plain", "gone");
+    expect += "Content-Length: 4\r\nConnection: close\r\n\r\ngone";
+    TEST_ASSERT(expect.size() > 2 * HTTP_HEADER_BUFLEN);
+    TEST_ASSERT(server.wire() == expect);
+
+    /* headers added in front spill over too, and the chunks still follow the block */
+    server.request(1);
+    for (int i = 0; i < 30; i++)
+        server.sendHeader(("X-Header-" + std::to_string(i)).c_str(), value.c_str(), i % 2);
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(200, "application/x-www-form-urlencoded; charset=utf-8", "gone");
+    server.sendContent("");
+    std::string wire = server.wire();
+    std::string start = "HTTP/1.1 200 OK\r\nContent-Type: application/x-www-form-urlencoded; charset=utf-8\r\nX-Header-29: ";
+    TEST_ASSERT(wire.compare(0, start.size(), start) == 0);
+    TEST_ASSERT(wire.find("X-Header-29: " + value + "\r\nX-Header-27: ") != std::string::npos);
+    TEST_ASSERT(wire.find("X-Header-1: " + value + "\r\nX-Header-0: " + value + "\r\nX-Header-2: ")
+                != std::string::npos);
+    TEST_ASSERT(wire.find("Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n4\r\ngone\r\n0\r\n\r\n")
+                != std::string::npos);
+
+    /* nothing is left over for the next response */
+    server.request(1);
+    server.send(200);
+    TEST_ASSERT(server.wire() == "HTTP/1.1 200 OK\r\n"
+                                 "Content-Type: text/html\r\n"
+                                 "Content-Length: 0\r\n"
+                                 "Connection: close\r\n"
+                                 "\r\n");
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+static void bench_responses(void)
+{
+    TestServer server;
+    String json = "{\"temperature\":21.5,\"humidity\":48,\"uptime\":123456,\"ok\":true}";
+    for (int wire = 0; wire < 2; wire++) {
+        server.discard = !wire;
+        double rate[2];
+        double per[2][2];
+        for (int legacy = 1; legacy >= 0; legacy--) {
+            uint64_t budget = hostIterations(20) * 10000000ULL;
+            unsigned n = 0, writes = 0;
+            allocs = 0;
+            uint64_t t0 = hostNowNs(), ns;
+            do {
+                server.request(1);
+                counting = true;
+                if (legacy) {
+                    server.legacySendHeader("Cache-Control", "no-cache");
+                    server.legacySendHeader("Access-Control-Allow-Origin", "*");
+                    server.legacySend(200, "application/json", json);
+                } else {
+                    server.sendHeader("Cache-Control", "no-cache");
+                    server.sendHeader("Access-Control-Allow-Origin", "*");
+                    server.send(200, "application/json", json);
+                }
+                counting = false;
+                writes += server.writes;
+                if (wire)
+                    server.wire();
+                n++;
+            } while ((ns = hostNowNs() - t0) < budget);
+            rate[legacy] = n / (ns / 1e9);
+            per[legacy][0] = (double)allocs / n;
+            per[legacy][1] = (double)writes / n;
+        }
+        BENCH("%-15s before %7.0f responses/s, %4.1f allocations, %.0f writes; "
+              "now %8.0f responses/s (%.1fx), %.1f allocations, %.0f write",
+              wire ? "socket pair" : "writes dropped", rate[1], per[1][0], per[1][1],
+              rate[0], rate[0] / rate[1], per[0][0], per[0][1]);
+        TEST_ASSERT(per[0][0] == 0 && per[0][1] == 1);
+    }
+}
+
+int main(void)
+{
+    TEST_RUN(test_same_bytes_as_before);
+    TEST_RUN(test_one_write_for_small_replies);
+    TEST_RUN(test_send_P_chunked);
+    TEST_RUN(test_headers_that_do_not_fit);
+    TEST_RUN(bench_responses);
+    return TEST_EXIT();
+}
@@ -0,0 +1,548 @@
+/*
+ * WebServer's block-based multipart/form-data parser against the byte at a
+ * time parser it replaced.
+ *
+ * Forms of random fields and files, with file data full of CRs, LFs,
+ * dashes and near misses of the delimiter, are written to one end of a
+ * socket pair in random pieces, each waited out before the next one, so
+ * the parser meets every split of a delimiter and of a header line. The
+ * parser runs on the other end through the protected _parseForm(). The
+ * benchmarks time the delimiter search over a buffer in memory, and a
+ * whole upload fed through the socket as fast as the writer can, against
+ * the old parser's file loop, kept here as it was.
+ */
+#include "host.h"
+
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../../libraries/FS/src/FS.cpp"
+#include <WiFi.h>
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/WiFi/src/WiFiServer.cpp"
+#include "../../libraries/WebServer/src/WebServer.cpp"
+/* both files have a static Content_Type */
+#define Content_Type  Parsing_Content_Type
+#include "../../libraries/WebServer/src/Parsing.cpp"
+#undef Content_Type
+#include "../../libraries/WebServer/src/detail/UriRouter.cpp"
+#include "../../libraries/WebServer/src/detail/mimetable.cpp"
+
+/* --------------------------------------------------------------- server */
+
+struct Upload {
+    std::string name, filename, type, data;
+    size_t total;
+    int writes;
+    bool ended, aborted;
+};
+
+static std::vector<Upload> uploads;
+static size_t largest_write;
+
+class TestServer : public WebServer {
+public:
+    TestServer() : WebServer(0) {
+        on("/upload", HTTP_POST, []() {}, [this]() { collect(); });
+    }
+
+    /* what _parseRequest() does for a multipart POST to /upload?query */
+    bool parse(WiFiClient& client, const String& boundary, uint32_t len, const String& query = String()) {
+        _currentMethod = HTTP_POST;
+        _currentUri = "/upload";
+        _currentHandler = _router.find(_currentMethod, _currentUri, _pathArgs);
+        _parseArguments(query);
+        return _parseForm(client, boundary, len);
+    }
+
+private:
+    void collect() {
+        HTTPUpload& u = upload();
+        switch (u.status) {
+        case UPLOAD_FILE_START:
+            uploads.push_back(Upload());
+            uploads.back().name = u.name.c_str();
+            uploads.back().filename = u.filename.c_str();
+            uploads.back().type = u.type.c_str();
+            uploads.back().total = 0;
+            uploads.back().writes = 0;
+            uploads.back().ended = false;
+            uploads.back().aborted = false;
+            break;
+        case UPLOAD_FILE_WRITE:
+            uploads.back().data.append((const char*)u.buf, u.currentSize);
+            uploads.back().writes++;
+            if (u.currentSize > largest_write)
+                largest_write = u.currentSize;
+            break;
+        case UPLOAD_FILE_END:
+            uploads.back().ended = true;
+            uploads.back().total = u.totalSize;
+            break;
+        case UPLOAD_FILE_ABORTED:
+            uploads.back().aborted = true;
+            break;
+        }
+    }
+};
+
+/* --------------------------------------------------------------- writer */
+
+struct Writer {
+    int fd;
+    int peer;               /* the parser's end, to see a piece taken */
+    std::string data;
+    size_t min_piece, max_piece;
+    bool wait;              /* for each piece to be read before the next */
+    pthread_t thread;
+};
+
+static void* writer_main(void* arg)
+{
+    Writer* w = (Writer*)arg;
+    size_t at = 0;
+    while (at < w->data.size()) {
+        size_t n = w->min_piece + rand() % (w->max_piece - w->min_piece + 1);
+        if (n > w->data.size() - at)
+            n = w->data.size() - at;
+        ssize_t sent = send(w->fd, w->data.data() + at, n, MSG_NOSIGNAL);
+        if (sent <= 0)
+            break;
+        at += sent;
+        /* the parser may stop early on a broken form, so give up after a while */
+        uint64_t deadline = hostNowNs() + 50000000ULL;
+        int queued;
+        while (w->wait && ioctl(w->peer, FIONREAD, &queued) == 0 && queued > 0 && hostNowNs() < deadline) {
+            struct timespec ts = { 0, 20000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* the parser's end of a socket pair with a writer thread feeding data */
+static int start_writer(Writer& w, const std::string& data, size_t min_piece, size_t max_piece, bool wait)
+{
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    w.fd = sv[0];
+    w.peer = sv[1];
+    w.data = data;
+    w.min_piece = min_piece;
+    w.max_piece = max_piece;
+    w.wait = wait;
+    pthread_create(&w.thread, NULL, writer_main, &w);
+    return sv[1];
+}
+
+static void stop_writer(Writer& w)
+{
+    pthread_join(w.thread, NULL);
+    close(w.fd);
+}
+
+/* ----------------------------------------------------------------- forms */
+
+struct Part {
+    std::string name, filename, type, data;
+    bool file;
+    bool type_first;        /* Content-Type before Content-Disposition */
+};
+
+static std::string random_boundary(void)
+{
+    static const char chars[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_";
+    std::string b = rand() % 2 ? "----WebKitFormBoundary" : "";
+    for (int n = 1 + rand() % 24; n > 0; n--)
+        b += chars[rand() % (sizeof(chars) - 1)];
+    return b;
+}
+
+/* bytes that keep the parser busy: line ends, dashes and starts of the delimiter */
+static std::string random_data(const std::string& boundary, size_t len, bool text)
+{
+    std::string d;
+    std::string delim = "\r\n--" + boundary;
+    while (d.size() < len) {
+        switch (rand() % 8) {
+        case 0:
+            d += delim.substr(0, 1 + rand() % (delim.size() - 1));
+            break;
+        case 1:
+            d += "\r\n";
+            break;
+        case 2:
+            d += rand() % 2 ? "\r" : "-";
+            break;
+        case 3:
+            d += "--" + boundary;
+            break;
+        default:
+            for (int n = rand() % 64; n > 0; n--)
+                d += text ? (char)(' ' + rand() % 95) : (char)(rand() % 256);
+        }
+    }
+    d.resize(len);
+    /* pieces may join up into the delimiter, which a sender never lets happen */
+    size_t at;
+    while ((at = d.find(delim)) != std::string::npos)
+        d[at] = 'x';
+    return d;
+}
+
+static std::string build_form(const std::string& boundary, const std::vector<Part>& parts)
+{
+    std::string body = "--" + boundary + "\r\n";
+    for (size_t i = 0; i < parts.size(); i++) {
+        const Part& p = parts[i];
+        std::string disposition = "Content-Disposition: form-data; name=\"" + p.name + "\"";
+        if (p.file)
+            disposition += "; filename=\"" + p.filename + "\"";
+        std::string type = p.type.empty() ? "" : "Content-Type: " + p.type + "\r\n";
+        body += p.type_first ? type + disposition + "\r\n" : disposition + "\r\n" + type;
+        body += "\r\n" + p.data + "\r\n--" + boundary;
+        body += i + 1 < parts.size() ? "\r\n" : "--\r\n";
+    }
+    return body;
+}
+
+/* one pass, as String::replace() does it */
+static std::string crlf_to_lf(std::string s)
+{
+    size_t at = 0;
+    while ((at = s.find("\r\n", at)) != std::string::npos)
+        s.replace(at++, 2, "\n");
+    return s;
+}
+
+/* ----------------------------------------------------------------- tests */
+
+static void test_random_forms(void)
+{
+    TestServer server;
+    srand(42);
+    unsigned rounds = hostIterations(100);
+    for (unsigned round = 0; round < rounds; round++) {
+        std::string boundary = random_boundary();
+        std::vector<Part> parts;
+        for (int n = 1 + rand() % 5; n > 0; n--) {
+            Part p;
+            p.file = rand() % 2;
+            p.name = std::string(p.file ? "file" : "field") + std::to_string(parts.size());
+            p.filename = p.file ? "f" + std::to_string(rand() % 100) + ".bin" : "";
+            p.type = rand() % 3 ? (p.file ? "application/octet-stream" : "text/plain") : "";
+            p.type_first = rand() % 2;
+            size_t len = rand() % 3 == 0 ? rand() % 8 : rand() % (p.file ? 6000 : 600);
+            p.data = random_data(boundary, len, !p.file);
+            parts.push_back(p);
+        }
+        std::string body = build_form(boundary, parts);
+
+        uploads.clear();
+        Writer w;
+        size_t max_piece = rand() % 2 ? 64 : 3000;
+        WiFiClient client(start_writer(w, body, 1, max_piece, true));
+        TEST_ASSERT(server.parse(client, boundary.c_str(), body.size(), "id=7"));
+        stop_writer(w);
+
+        size_t u = 0;
+        int fields = 0;
+        for (size_t i = 0; i < parts.size(); i++) {
+            const Part& p = parts[i];
+            if (p.file) {
+                TEST_ASSERT(u < uploads.size());
+                const Upload& got = uploads[u++];
+                TEST_ASSERT(got.name == p.name && got.filename == p.filename);
+                TEST_ASSERT(got.type == (p.type.empty() ? "text/plain" : p.type));
+                TEST_ASSERT(got.ended && !got.aborted);
+                TEST_ASSERT(got.data == p.data);
+                TEST_ASSERT_EQ(got.total, p.data.size());
+            } else {
+                TEST_ASSERT(server.argName(fields) == p.name.c_str());
+                TEST_ASSERT(server.arg(fields) == crlf_to_lf(p.data).c_str());
+                fields++;
+            }
+        }
+        TEST_ASSERT_EQ(u, uploads.size());
+        /* query arguments follow the form fields */
+        TEST_ASSERT_EQ(server.args(), fields + 1);
+        TEST_ASSERT(server.arg("id") == "7");
+    }
+    TEST_ASSERT(largest_write <= HTTP_UPLOAD_BUFLEN);
+}
+
+static void test_headers_in_any_order(void)
+{
+    TestServer server;
+    std::string body =
+        "\r\n"                                   /* blank lines before the first boundary */
+        "--XyZ\r\n"
+        "Content-Type: image/png\r\n"
+        "Content-Disposition: form-data; filename=\"a b.png\"; name=\"pic\"\r\n"
+        "\r\n"
+        "\x89PNG\r\n\x1a\n\r\n"
+        "--XyZ\r\n"
+        "content-disposition: form-data; name=\"note\"\r\n"
+        "\r\n"
+        "two\r\nlines\r\n"
+        "--XyZ--\r\n";
+    uploads.clear();
+    Writer w;
+    WiFiClient client(start_writer(w, body, 1, 7, true));
+    TEST_ASSERT(server.parse(client, "XyZ", body.size()));
+    stop_writer(w);
+    TEST_ASSERT_EQ(uploads.size(), 1u);
+    TEST_ASSERT(uploads[0].name == "pic" && uploads[0].filename == "a b.png");
+    TEST_ASSERT(uploads[0].type == "image/png");
+    TEST_ASSERT(uploads[0].data == std::string("\x89PNG\r\n\x1a\n", 8));
+    TEST_ASSERT(server.arg("note") == "two\nlines");
+}
+
+static void test_stops_at_content_length(void)
+{
+    TestServer server;
+    std::string body = "--b\r\nContent-Disposition: form-data; name=\"f\"; filename=\"x\"\r\n\r\n"
+                       "data\r\n--b--\r\n";
+    std::string next = "GET /next HTTP/1.1\r\n\r\n";
+    uploads.clear();
+    Writer w;
+    WiFiClient client(start_writer(w, body + next, body.size() + next.size(), body.size() + next.size(), false));
+    TEST_ASSERT(server.parse(client, "b", body.size()));
+    TEST_ASSERT(uploads.size() == 1 && uploads[0].data == "data");
+    stop_writer(w);
+    /* the next request is still there to be read */
+    std::string rest;
+    int c;
+    while ((c = client.read()) >= 0)
+        rest += (char)c;
+    TEST_ASSERT(rest == next);
+}
+
+static void test_broken_forms(void)
+{
+    TestServer server;
+    std::string file = "--b\r\nContent-Disposition: form-data; name=\"f\"; filename=\"x\"\r\n\r\n"
+                       + std::string(5000, 'z');
+
+    /* the body ends inside the file */
+    uploads.clear();
+    Writer w;
+    WiFiClient client(start_writer(w, file, 1, 3000, true));
+    TEST_ASSERT(!server.parse(client, "b", file.size()));
+    stop_writer(w);
+    TEST_ASSERT(uploads.size() == 1 && uploads[0].aborted && !uploads[0].ended);
+    TEST_ASSERT_EQ(uploads[0].data.size(), 5000u - 4);    /* the tail may have been a delimiter */
+
+    /* a different boundary */
+    std::string wrong = "--a\r\nContent-Disposition: form-data; name=\"f\"\r\n\r\nv\r\n--a--\r\n";
+    Writer w2;
+    WiFiClient client2(start_writer(w2, wrong, 1, 3000, true));
+    TEST_ASSERT(!server.parse(client2, "b", wrong.size()));
+    stop_writer(w2);
+
+    /* more fields than the argument array */
+    std::vector<Part> parts;
+    for (int i = 0; i < 40; i++) {
+        Part p;
+        p.file = false;
+        p.name = "k" + std::to_string(i);
+        p.data = std::to_string(i);
+        p.type_first = false;
+        parts.push_back(p);
+    }
+    std::string many = build_form("b", parts);
+    Writer w3;
+    WiFiClient client3(start_writer(w3, many, 1, 3000, true));
+    TEST_ASSERT(server.parse(client3, "b", many.size(), "q=1"));
+    stop_writer(w3);
+    TEST_ASSERT_EQ(server.args(), 32);
+    TEST_ASSERT(server.arg("k31") == "31");
+    TEST_ASSERT(!server.hasArg("k32") && !server.hasArg("q"));
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+/* the old _parseForm() file loop: one client.read() and one buffer write per byte */
+struct LegacySink {
+    uint8_t buf[HTTP_UPLOAD_BUFLEN];
+    size_t currentSize;
+    size_t totalSize;
+    unsigned writes;
+
+    void upload() {
+        writes++;
+    }
+
+    void writeByte(uint8_t b) {
+        if (currentSize == HTTP_UPLOAD_BUFLEN) {
+            upload();
+            totalSize += currentSize;
+            currentSize = 0;
+        }
+        buf[currentSize++] = b;
+    }
+};
+
+static uint8_t legacyReadByte(WiFiClient& client)
+{
+    int res = client.read();
+    if (res == -1) {
+        while (!client.available() && client.connected())
+            delay(2);
+        res = client.read();
+    }
+    return (uint8_t)res;
+}
+
+static bool legacy_parse(WiFiClient& client, const String& boundary, LegacySink& sink)
+{
+    String line = client.readStringUntil('\r');
+    client.readStringUntil('\n');
+    if (line != "--" + boundary)
+        return false;
+    line = client.readStringUntil('\r');        /* Content-Disposition */
+    client.readStringUntil('\n');
+    line = client.readStringUntil('\r');        /* Content-Type */
+    client.readStringUntil('\n');
+    client.readStringUntil('\r');
+    client.readStringUntil('\n');
+
+    uint8_t argByte = legacyReadByte(client);
+readfile:
+    while (argByte != 0x0D) {
+        if (!client.connected()) return false;
+        sink.writeByte(argByte);
+        argByte = legacyReadByte(client);
+    }
+    argByte = legacyReadByte(client);
+    if (argByte == 0x0A) {
+        argByte = legacyReadByte(client);
+        if ((char)argByte != '-') {
+            sink.writeByte(0x0D);
+            sink.writeByte(0x0A);
+            goto readfile;
+        } else {
+            argByte = legacyReadByte(client);
+            if ((char)argByte != '-') {
+                sink.writeByte(0x0D);
+                sink.writeByte(0x0A);
+                sink.writeByte((uint8_t)('-'));
+                goto readfile;
+            }
+        }
+        uint8_t endBuf[boundary.length() + 1];
+        client.readBytes(endBuf, boundary.length());
+        endBuf[boundary.length()] = 0;
+        if (strstr((const char*)endBuf, boundary.c_str()) != NULL) {
+            sink.upload();
+            sink.totalSize += sink.currentSize;
+            line = client.readStringUntil(0x0D);
+            client.readStringUntil(0x0A);
+            return true;
+        }
+        sink.writeByte(0x0D);
+        sink.writeByte(0x0A);
+        sink.writeByte((uint8_t)('-'));
+        sink.writeByte((uint8_t)('-'));
+        for (uint32_t i = 0; i < boundary.length(); i++)
+            sink.writeByte(endBuf[i]);
+        argByte = legacyReadByte(client);
+        goto readfile;
+    } else {
+        sink.writeByte(0x0D);
+        goto readfile;
+    }
+}
+
+static void bench_delimiter_search(void)
+{
+    std::string boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+    std::string delimiter = "\r\n--" + boundary;
+    std::string data = random_data(boundary, 1 << 20, false);
+    const uint8_t* d = (const uint8_t*)data.data();
+    const uint8_t* delim = (const uint8_t*)delimiter.data();
+    size_t m = delimiter.size();
+    uint8_t skip[256];
+    memset(skip, m, sizeof(skip));
+    for (size_t i = 0; i < m - 1; i++)
+        skip[(uint8_t)delimiter[i]] = m - 1 - i;
+
+    uint64_t budget = hostIterations(20) * 10000000ULL;
+    uint64_t t0 = hostNowNs(), ns;
+    size_t bytes = 0;
+    do {
+        TEST_ASSERT_EQ(findDelimiter(d, data.size(), delim, m, skip), -1);
+        bytes += data.size();
+    } while ((ns = hostNowNs() - t0) < budget);
+    double bmh = bytes / (ns / 1e3);
+
+    /* every CR compared against the delimiter, the way the byte loop looked at it */
+    t0 = hostNowNs();
+    bytes = 0;
+    do {
+        size_t found = 0;
+        for (size_t i = 0; i + m <= data.size(); i++)
+            if (d[i] == '\r' && memcmp(d + i, delim, m) == 0)
+                found++;
+        TEST_ASSERT_EQ(found, 0u);
+        bytes += data.size();
+    } while ((ns = hostNowNs() - t0) < budget);
+    double bytewise = bytes / (ns / 1e3);
+
+    BENCH("delimiter search, 1 MB with near misses: Horspool %7.0f MB/s, byte by byte %6.0f MB/s",
+          bmh, bytewise);
+}
+
+static void bench_upload(void)
+{
+    std::string boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+    size_t size = hostIterations(20) * (4u << 20) / 20;
+    std::string file;
+    file.reserve(size);
+    for (size_t i = 0; i < size; i++)
+        file += (char)(rand() % 256);
+    std::string body = "--" + boundary + "\r\n"
+                       "Content-Disposition: form-data; name=\"update\"; filename=\"firmware.bin\"\r\n"
+                       "Content-Type: application/octet-stream\r\n\r\n" + file + "\r\n--" + boundary + "--\r\n";
+
+    /* a TCP segment at a time, as fast as the writer can */
+    Writer w;
+    LegacySink sink = LegacySink();
+    uint64_t t0 = hostNowNs();
+    {
+        WiFiClient client(start_writer(w, body, 1436, 1436, false));
+        TEST_ASSERT(legacy_parse(client, boundary.c_str(), sink));
+    }
+    double before = size / ((hostNowNs() - t0) / 1e3);
+    stop_writer(w);
+    TEST_ASSERT_EQ(sink.totalSize, size);
+
+    TestServer server;
+    uploads.clear();
+    t0 = hostNowNs();
+    {
+        WiFiClient client(start_writer(w, body, 1436, 1436, false));
+        TEST_ASSERT(server.parse(client, boundary.c_str(), body.size()));
+    }
+    double after = size / ((hostNowNs() - t0) / 1e3);
+    stop_writer(w);
+    TEST_ASSERT(uploads.size() == 1 && uploads[0].data == file);
+
+    BENCH("%zu KB upload: byte by byte %5.1f MB/s, %u writes; blocks %6.1f MB/s (%.0fx), %d writes",
+          size >> 10, before, sink.writes, after, after / before, uploads[0].writes);
+}
+
+int main(void)
+{
+    TEST_RUN(test_random_forms);
+    TEST_RUN(test_headers_in_any_order);
+    TEST_RUN(test_stops_at_content_length);
+    TEST_RUN(test_broken_forms);
+    TEST_RUN(bench_delimiter_search);
+    TEST_RUN(bench_upload);
+    return TEST_EXIT();
+}
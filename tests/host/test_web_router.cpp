@@ -0,0 +1,365 @@
+/*
+ * WebServer's UriRouter: handler lookup by path segment tree against the
+ * canHandle() scan over the handler list it replaced.
+ *
+ * Routes are checked against the old scan for plain URIs, where the two
+ * must agree, and for the precedence and captures of {name} and *
+ * patterns. A WebServer then serves a small REST API over loopback to
+ * check pathArg() end to end; the server and client run in this thread
+ * with the manual clock stepped over the close wait, as in
+ * test_web_static. The benchmark looks up 10, 100 and 1000 routes.
+ */
+#include "host.h"
+
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "../../libraries/FS/src/FS.cpp"
+#include <WiFi.h>
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/WiFi/src/WiFiServer.cpp"
+#include "../../libraries/WebServer/src/WebServer.cpp"
+/* both files have a static Content_Type */
+#define Content_Type  Parsing_Content_Type
+#include "../../libraries/WebServer/src/Parsing.cpp"
+#undef Content_Type
+#include "../../libraries/WebServer/src/detail/UriRouter.cpp"
+#include "../../libraries/WebServer/src/detail/mimetable.cpp"
+
+/* ------------------------------------------------------------- handlers */
+
+/* FunctionRequestHandler before the router: a String copy and compare per call */
+class LegacyHandler : public RequestHandler {
+public:
+    LegacyHandler(const String& uri, HTTPMethod method) : _uri(uri), _method(method) {}
+
+    bool canHandle(HTTPMethod requestMethod, String requestUri) override {
+        if (_method != HTTP_ANY && _method != requestMethod)
+            return false;
+        if (requestUri != _uri)
+            return false;
+        return true;
+    }
+
+    String _uri;
+    HTTPMethod _method;
+};
+
+/* an addHandler() handler that takes every URI under a prefix */
+class PrefixHandler : public RequestHandler {
+public:
+    PrefixHandler(const String& prefix) : _prefix(prefix) {}
+
+    bool canHandle(HTTPMethod requestMethod, String requestUri) override {
+        (void)requestMethod;
+        return requestUri.startsWith(_prefix);
+    }
+
+    String _prefix;
+};
+
+/* the old lookup: first handler in registration order that can handle it */
+static RequestHandler* scan(RequestHandler* first, HTTPMethod method, const String& uri)
+{
+    RequestHandler* handler;
+    for (handler = first; handler; handler = handler->next()) {
+        if (handler->canHandle(method, uri))
+            break;
+    }
+    return handler;
+}
+
+static std::string joined(const std::vector<String>& args)
+{
+    std::string s;
+    for (size_t i = 0; i < args.size(); i++)
+        s += std::string(i ? "|" : "") + args[i].c_str();
+    return s;
+}
+
+/* --------------------------------------------------------------- tests */
+
+static void test_plain_uris_resolve_as_before(void)
+{
+    const char* segments[] = { "api", "v1", "sensor", "led", "status", "a", "ab", "" };
+    const HTTPMethod methods[] = { HTTP_GET, HTTP_POST, HTTP_ANY };
+    srand(41);
+    for (int round = 0; round < 200; round++) {
+        UriRouter router;
+        std::vector<RequestHandler*> handlers;
+        RequestHandler* first = NULL;
+        RequestHandler* last = NULL;
+        int n = 1 + rand() % 40;
+        for (int i = 0; i < n; i++) {
+            String uri;
+            for (int s = 1 + rand() % 4; s > 0; s--)
+                uri += String("/") + segments[rand() % 8];
+            RequestHandler* h;
+            if (rand() % 8 == 0) {
+                h = new PrefixHandler(uri);
+                router.addHandler(h);
+            } else {
+                HTTPMethod m = methods[rand() % 3];
+                h = new LegacyHandler(uri, m);
+                router.add(uri, m, h);
+            }
+            handlers.push_back(h);
+            if (last)
+                last->next(h);
+            else
+                first = h;
+            last = h;
+        }
+        for (int q = 0; q < 200; q++) {
+            String uri;
+            for (int s = 1 + rand() % 4; s > 0; s--)
+                uri += String("/") + segments[rand() % 8];
+            HTTPMethod m = methods[rand() % 2];
+            std::vector<String> args;
+            RequestHandler* found = router.find(m, uri, args);
+            TEST_ASSERT(found == scan(first, m, uri));
+            TEST_ASSERT(args.empty());
+        }
+        for (size_t i = 0; i < handlers.size(); i++)
+            delete handlers[i];
+    }
+}
+
+static void test_patterns(void)
+{
+    UriRouter router;
+    LegacyHandler id("", HTTP_GET), all("", HTTP_GET), api("", HTTP_GET), history("", HTTP_GET),
+                  files("", HTTP_GET), abd("", HTTP_GET), axc("", HTTP_GET), post("", HTTP_POST),
+                  deep("", HTTP_GET), root("", HTTP_GET);
+    router.add("/api/sensor/{id}", HTTP_GET, &id);
+    router.add("/api/sensor/all", HTTP_GET, &all);
+    router.add("/api/*", HTTP_GET, &api);
+    router.add("/api/sensor/{id}/history/{day}", HTTP_GET, &history);
+    router.add("/files/*", HTTP_ANY, &files);
+    router.add("/a/b/d", HTTP_GET, &abd);
+    router.add("/a/{x}/c", HTTP_GET, &axc);
+    router.add("/m", HTTP_POST, &post);
+    router.add("/{1}/{2}/{3}/{4}/{5}/{6}/{7}/{8}", HTTP_GET, &deep);
+    router.add("/", HTTP_GET, &root);
+
+    struct { HTTPMethod method; const char* uri; RequestHandler* handler; const char* args; } cases[] = {
+        { HTTP_GET,  "/api/sensor/42",              &id,      "42" },
+        { HTTP_GET,  "/api/sensor/all",             &all,     "" },         /* literal first */
+        { HTTP_GET,  "/api/sensor/42/history/mon",  &history, "42|mon" },
+        { HTTP_GET,  "/api/sensor/",                &api,     "sensor/" },  /* {id} is never empty */
+        { HTTP_GET,  "/api/other/x",                &api,     "other/x" },
+        { HTTP_GET,  "/api/sensor/42/x",            &api,     "sensor/42/x" },
+        { HTTP_POST, "/api/sensor/42",              NULL,     "" },
+        { HTTP_PUT,  "/files/",                     &files,   "" },
+        { HTTP_GET,  "/files/css/app.css",          &files,   "css/app.css" },
+        { HTTP_GET,  "/files",                      NULL,     "" },
+        { HTTP_GET,  "/a/b/d",                      &abd,     "" },
+        { HTTP_GET,  "/a/b/c",                      &axc,     "b" },        /* back from the literal b */
+        { HTTP_GET,  "/m",                          NULL,     "" },
+        { HTTP_POST, "/m",                          &post,    "" },
+        { HTTP_GET,  "/1/2/3/4/5/6/7/8",            &deep,    "1|2|3|4|5|6|7|8" },
+        { HTTP_GET,  "/",                           &root,    "" },
+        { HTTP_GET,  "",                            NULL,     "" },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        std::vector<String> args;
+        RequestHandler* found = router.find(cases[i].method, cases[i].uri, args);
+        if (found != cases[i].handler)
+            fprintf(stderr, "  %s\n", cases[i].uri);
+        TEST_ASSERT(found == cases[i].handler);
+        TEST_ASSERT(joined(args) == cases[i].args);
+    }
+
+    /* a handler added later can be reached for another method */
+    LegacyHandler get("", HTTP_GET);
+    router.add("/m", HTTP_GET, &get);
+    std::vector<String> args;
+    TEST_ASSERT(router.find(HTTP_GET, "/m", args) == &get);
+    TEST_ASSERT(router.find(HTTP_POST, "/m", args) == &post);
+
+    /* patterns match the same way in FunctionRequestHandler::canHandle() */
+    TEST_ASSERT(UriRouter::matches("/api/sensor/{id}", "/api/sensor/42"));
+    TEST_ASSERT(!UriRouter::matches("/api/sensor/{id}", "/api/sensor/"));
+    TEST_ASSERT(!UriRouter::matches("/api/sensor/{id}", "/api/sensor/42/x"));
+    TEST_ASSERT(UriRouter::matches("/files/*", "/files/a/b"));
+    TEST_ASSERT(!UriRouter::matches("/files/*", "/files"));
+    TEST_ASSERT(UriRouter::isPattern("/x/{id}") && UriRouter::isPattern("/x/*") && !UriRouter::isPattern("/x/y"));
+}
+
+static void test_earlier_fallback_wins(void)
+{
+    UriRouter router;
+    PrefixHandler early("/api/sensor/7"), late("/api/");
+    LegacyHandler id("", HTTP_GET);
+    router.addHandler(&early);
+    router.add("/api/sensor/{id}", HTTP_GET, &id);
+    router.addHandler(&late);
+    std::vector<String> args;
+    TEST_ASSERT(router.find(HTTP_GET, "/api/sensor/7", args) == &early);
+    TEST_ASSERT(args.empty());
+    TEST_ASSERT(router.find(HTTP_GET, "/api/sensor/8", args) == &id);
+    TEST_ASSERT(joined(args) == "8");
+    /* after the route only where the route does not match */
+    TEST_ASSERT(router.find(HTTP_POST, "/api/sensor/8", args) == &late);
+    TEST_ASSERT(args.empty());
+    TEST_ASSERT(router.find(HTTP_GET, "/api/other", args) == &late);
+}
+
+/* ---------------------------------------------------------- server, e2e */
+
+class TestServer : public WebServer {
+public:
+    TestServer() : WebServer(0) {}
+
+    uint16_t port() {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        getsockname(_server.fd(), (struct sockaddr*)&addr, &len);
+        return ntohs(addr.sin_port);
+    }
+};
+
+static TestServer* server;
+
+/* one request, served in this thread; the status and body, "" if none came */
+static std::string fetch(const char* method, const char* path, int* status)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server->port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    *status = 0;
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ::close(fd);
+        return "";
+    }
+    std::string req = std::string(method) + " " + path + " HTTP/1.1\r\nHost: esp32\r\nContent-Length: 0\r\n\r\n";
+    ::send(fd, req.data(), req.size(), 0);
+    std::string in;
+    size_t end = std::string::npos, length = 0;
+    uint64_t deadline = hostNowNs() + 2000000000ULL;
+    while (hostNowNs() < deadline) {
+        server->handleClient();
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+            in.append(buf, n);
+        if (end == std::string::npos && (end = in.find("\r\n\r\n")) != std::string::npos) {
+            end += 4;
+            *status = atoi(in.c_str() + 9);
+            size_t at = in.find("Content-Length: ");
+            length = at < end ? atoi(in.c_str() + at + 16) : 0;
+        }
+        if (end != std::string::npos && in.size() >= end + length)
+            break;
+    }
+    ::close(fd);
+    hostClockAdvance((HTTP_MAX_CLOSE_WAIT + 1) * 1000LL);
+    server->handleClient();
+    return end == std::string::npos ? "" : in.substr(end);
+}
+
+static void reply(void)
+{
+    String s = server->uri();
+    for (int i = 0; i < server->pathArgs(); i++)
+        s += " " + server->pathArg(i);
+    server->send(200, "text/plain", s);
+}
+
+static void test_rest_api(void)
+{
+    server = new TestServer();
+    server->on("/api/sensor/{id}", HTTP_GET, reply);
+    server->on("/api/sensor/{id}", HTTP_PUT, []() { server->send(204); });
+    server->on("/api/sensor/{id}/history/{day}", HTTP_GET, reply);
+    server->on("/api/status", reply);
+    server->on("/files/*", HTTP_GET, reply);
+    server->onNotFound([]() { server->send(404, "text/plain", "nope"); });
+    server->begin();
+
+    int status;
+    TEST_ASSERT(fetch("GET", "/api/sensor/42", &status) == "/api/sensor/42 42");
+    TEST_ASSERT_EQ(status, 200);
+    TEST_ASSERT(fetch("GET", "/api/sensor/42?unit=C", &status) == "/api/sensor/42 42");
+    TEST_ASSERT(fetch("GET", "/api/sensor/7/history/mon", &status) == "/api/sensor/7/history/mon 7 mon");
+    fetch("PUT", "/api/sensor/42", &status);
+    TEST_ASSERT_EQ(status, 204);
+    TEST_ASSERT(fetch("POST", "/api/status", &status) == "/api/status");
+    TEST_ASSERT(fetch("GET", "/files/css/app.css", &status) == "/files/css/app.css css/app.css");
+    TEST_ASSERT(fetch("GET", "/api/sensor", &status) == "nope");
+    TEST_ASSERT_EQ(status, 404);
+    /* no stale arguments from the last match */
+    TEST_ASSERT(fetch("GET", "/api/status", &status) == "/api/status");
+    delete server;
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+/* lookups per second of find over uris, for about 200 ms */
+template <typename F>
+static double rate(const std::vector<String>& uris, F find)
+{
+    uint64_t budget = hostIterations(20) * 10000000ULL;
+    uint64_t t0 = hostNowNs(), ns;
+    size_t n = 0, hits = 0;
+    do {
+        for (size_t i = 0; i < uris.size(); i++)
+            hits += find(uris[i]) != NULL;
+        n += uris.size();
+        ns = hostNowNs() - t0;
+    } while (ns < budget);
+    TEST_ASSERT_EQ(hits, n);
+    return n / (ns / 1e9);
+}
+
+static void bench_lookups(void)
+{
+    const int sizes[] = { 10, 100, 1000 };
+    for (size_t s = 0; s < 3; s++) {
+        int routes = sizes[s];
+        std::vector<LegacyHandler*> handlers;
+        RequestHandler* first = NULL;
+        UriRouter literal, patterns;
+        std::vector<String> plain, param;
+        for (int i = 0; i < routes; i++) {
+            String uri = String("/api/v1/endpoint") + i + "/state";
+            LegacyHandler* h = new LegacyHandler(uri, HTTP_GET);
+            if (first)
+                handlers.back()->next(h);
+            else
+                first = h;
+            handlers.push_back(h);
+            literal.add(uri, HTTP_GET, h);
+            patterns.add(String("/api/v1/endpoint") + i + "/{id}", HTTP_GET, h);
+        }
+        srand(41);
+        for (int i = 0; i < 1024; i++) {
+            int r = rand() % routes;
+            plain.push_back(String("/api/v1/endpoint") + r + "/state");
+            param.push_back(String("/api/v1/endpoint") + r + "/" + (rand() % 1000));
+        }
+        std::vector<String> args;
+        double before = rate(plain, [&](const String& u) { return scan(first, HTTP_GET, u); });
+        double tree = rate(plain, [&](const String& u) { return literal.find(HTTP_GET, u, args); });
+        double captured = rate(param, [&](const String& u) { return patterns.find(HTTP_GET, u, args); });
+        BENCH("%4d routes: canHandle() scan %6.2f M/s, router %5.2f M/s (%4.0fx), with {id} %5.2f M/s",
+              routes, before / 1e6, tree / 1e6, tree / before, captured / 1e6);
+        for (size_t i = 0; i < handlers.size(); i++)
+            delete handlers[i];
+    }
+}
+
+int main(void)
+{
+    hostClockManual(true);
+    TEST_RUN(test_plain_uris_resolve_as_before);
+    TEST_RUN(test_patterns);
+    TEST_RUN(test_earlier_fallback_wins);
+    TEST_RUN(test_rest_api);
+    TEST_RUN(bench_lookups);
+    return TEST_EXIT();
+}
@@ -0,0 +1,646 @@
+/*
+ * WebServer's static file handler serving a 30 asset single page app.
+ *
+ * The server and its clients run over loopback in this thread: a request
+ * is written, handleClient() is called until the response is in, and the
+ * client closes. The server only drops a client once HTTP_MAX_CLOSE_WAIT
+ * has passed, so the clock is manual and is stepped over that wait after
+ * each response. The files live in a temporary directory behind VFSImpl,
+ * with every stat, fopen and opendir counted, and in a second round made
+ * to take 100 us like a SPIFFS object lookup; readdir() skips "." and
+ * "..", which SPIFFS and FAT do not list. The handler this replaced is kept
+ * below as the baseline.
+ */
+#include "host.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <string>
+
+#include "../../libraries/FS/src/FS.cpp"
+
+static unsigned lookups;
+static unsigned lookup_us;     /* real time each lookup takes, 0 for the host's own */
+
+static void lookup(void)
+{
+    lookups++;
+    uint64_t end = hostNowNs() + lookup_us * 1000ULL;
+    while (hostNowNs() < end) {
+    }
+}
+
+static int counted_stat(const char* path, struct stat* st)
+{
+    lookup();
+    return stat(path, st);
+}
+
+static FILE* counted_fopen(const char* path, const char* mode)
+{
+    lookup();
+    return fopen(path, mode);
+}
+
+static DIR* counted_opendir(const char* path)
+{
+    lookup();
+    return opendir(path);
+}
+
+static struct dirent* listed_readdir(DIR* d)
+{
+    struct dirent* e;
+    while ((e = readdir(d)) && (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))) {
+    }
+    return e;
+}
+
+#define stat(p, st)   counted_stat(p, st)
+#define fopen(p, m)   counted_fopen(p, m)
+#define opendir(p)    counted_opendir(p)
+#define readdir(d)    listed_readdir(d)
+#include "../../libraries/FS/src/vfs_api.cpp"
+#undef stat
+#undef fopen
+#undef opendir
+#undef readdir
+
+#include <WiFi.h>
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/WiFi/src/WiFiServer.cpp"
+#include "../../libraries/WebServer/src/WebServer.cpp"
+/* both files have a static Content_Type */
+#define Content_Type  Parsing_Content_Type
+#include "../../libraries/WebServer/src/Parsing.cpp"
+#undef Content_Type
+#include "../../libraries/WebServer/src/detail/UriRouter.cpp"
+#include "../../libraries/WebServer/src/detail/mimetable.cpp"
+
+/*
+ * StaticRequestHandler before the index: exists() probes and a linear MIME
+ * scan. It took any existing path for a single file, which a directory on
+ * FAT or here is too; it gets the directory check of the new one, so it
+ * serves the tree at all.
+ */
+class LegacyStaticRequestHandler : public RequestHandler {
+public:
+    LegacyStaticRequestHandler(FS& fs, const char* path, const char* uri, const char* cache_header)
+    : _fs(fs)
+    , _uri(uri)
+    , _path(path)
+    , _cache_header(cache_header)
+    {
+        File f = fs.open(path, "r");
+        _isFile = f && !f.isDirectory();
+        _baseUriLength = _uri.length();
+    }
+
+    bool canHandle(HTTPMethod requestMethod, String requestUri) override  {
+        if (requestMethod != HTTP_GET)
+            return false;
+
+        if ((_isFile && requestUri != _uri) || !requestUri.startsWith(_uri))
+            return false;
+
+        return true;
+    }
+
+    bool handle(WebServer& server, HTTPMethod requestMethod, String requestUri) override {
+        if (!canHandle(requestMethod, requestUri))
+            return false;
+
+        String path(_path);
+
+        if (!_isFile) {
+            if (requestUri.endsWith("/"))
+              requestUri += "index.htm";
+            path += requestUri.substring(_baseUriLength);
+        }
+
+        String contentType = getContentType(path);
+
+        if (!path.endsWith(FPSTR(mimeTable[gz].endsWith)) && !_fs.exists(path))  {
+            String pathWithGz = path + FPSTR(mimeTable[gz].endsWith);
+            if(_fs.exists(pathWithGz))
+                path += FPSTR(mimeTable[gz].endsWith);
+        }
+
+        File f = _fs.open(path, "r");
+        if (!f)
+            return false;
+
+        if (_cache_header.length() != 0)
+            server.sendHeader("Cache-Control", _cache_header);
+
+        server.streamFile(f, contentType);
+        return true;
+    }
+
+    static String getContentType(const String& path) {
+        char buff[sizeof(mimeTable[0].mimeType)];
+        for (size_t i=0; i < sizeof(mimeTable)/sizeof(mimeTable[0])-1; i++) {
+            strcpy_P(buff, mimeTable[i].endsWith);
+            if (path.endsWith(buff)) {
+                strcpy_P(buff, mimeTable[i].mimeType);
+                return String(buff);
+            }
+        }
+        strcpy_P(buff, mimeTable[sizeof(mimeTable)/sizeof(mimeTable[0])-1].mimeType);
+        return String(buff);
+    }
+
+protected:
+    FS _fs;
+    String _uri;
+    String _path;
+    String _cache_header;
+    bool _isFile;
+    size_t _baseUriLength;
+};
+
+/* ------------------------------------------------------------ loopback */
+
+class TestServer : public WebServer {
+public:
+    TestServer() : WebServer(0) {}
+
+    uint16_t port() {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        getsockname(_server.fd(), (struct sockaddr*)&addr, &len);
+        return ntohs(addr.sin_port);
+    }
+};
+
+struct Response {
+    int status;
+    std::string head;
+    std::string body;
+
+    std::string header(const char* name) const {
+        std::string key = std::string("\r\n") + name + ": ";
+        size_t at = head.find(key);
+        if (at == std::string::npos)
+            return "";
+        at += key.size();
+        return head.substr(at, head.find("\r\n", at) - at);
+    }
+};
+
+static size_t page_bytes;
+
+/* GET path with extra header lines, true once a whole response came back */
+static bool fetch(TestServer& server, const char* path, const std::string& extra, Response& r)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server.port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ::close(fd);
+        return false;
+    }
+    std::string req = std::string("GET ") + path + " HTTP/1.1\r\nHost: esp32\r\n" + extra + "\r\n";
+    ::send(fd, req.data(), req.size(), 0);
+
+    std::string in;
+    size_t end = std::string::npos, length = 0;
+    uint64_t deadline = hostNowNs() + 2000000000ULL;
+    bool done = false;
+    while (!done && hostNowNs() < deadline) {
+        server.handleClient();
+        char buf[16384];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            in.append(buf, n);
+        }
+        if (end == std::string::npos && (end = in.find("\r\n\r\n")) != std::string::npos) {
+            end += 4;
+            r.head = in.substr(0, end);
+            r.status = atoi(r.head.c_str() + 9);
+            length = atoi(r.header("Content-Length").c_str());
+        }
+        done = end != std::string::npos && in.size() >= end + length;
+    }
+    ::close(fd);
+    if (done) {
+        r.body = in.substr(end);
+        page_bytes += in.size();
+    }
+    hostClockAdvance((HTTP_MAX_CLOSE_WAIT + 1) * 1000LL);
+    server.handleClient();
+    return done;
+}
+
+/* --------------------------------------------------------------- assets */
+
+static char root[64];
+static VFSImpl* vfs;
+static FS* disk;
+
+#define ASSETS 30
+
+struct Asset {
+    const char* uri;
+    const char* file;       /* as stored, may be the .gz */
+    const char* type;
+    size_t size;
+    std::string etag;
+};
+
+static Asset assets[ASSETS] = {
+    { "/", "/index.htm", "text/html", 3200 },
+    { "/css/app.css", "/css/app.css.gz", "text/css", 9100 },
+    { "/css/vendor.css", "/css/vendor.css.gz", "text/css", 21000 },
+    { "/css/theme.css", "/css/theme.css", "text/css", 2400 },
+    { "/css/print.css", "/css/print.css", "text/css", 700 },
+    { "/css/fonts.css", "/css/fonts.css", "text/css", 900 },
+    { "/js/app.js", "/js/app.js.gz", "application/javascript", 38000 },
+    { "/js/vendor.js", "/js/vendor.js.gz", "application/javascript", 61000 },
+    { "/js/chart.js", "/js/chart.js.gz", "application/javascript", 24000 },
+    { "/js/router.js", "/js/router.js", "application/javascript", 5200 },
+    { "/js/store.js", "/js/store.js", "application/javascript", 4100 },
+    { "/js/api.js", "/js/api.js", "application/javascript", 3300 },
+    { "/js/i18n.js", "/js/i18n.js", "application/javascript", 2900 },
+    { "/js/config.json", "/js/config.json", "application/json", 600 },
+    { "/manifest.appcache", "/manifest.appcache", "text/cache-manifest", 400 },
+    { "/favicon.ico", "/favicon.ico", "image/x-icon", 1150 },
+    { "/img/logo.svg", "/img/logo.svg", "image/svg+xml", 3800 },
+    { "/img/wifi.svg", "/img/wifi.svg", "image/svg+xml", 1200 },
+    { "/img/gear.svg", "/img/gear.svg", "image/svg+xml", 1100 },
+    { "/img/chip.png", "/img/chip.png", "image/png", 14000 },
+    { "/img/board.jpg", "/img/board.jpg", "image/jpeg", 32000 },
+    { "/img/spinner.gif", "/img/spinner.gif", "image/gif", 5600 },
+    { "/img/bg.png", "/img/bg.png", "image/png", 8800 },
+    { "/fonts/ui.woff2", "/fonts/ui.woff2", "application/font-woff2", 18000 },
+    { "/fonts/ui.woff", "/fonts/ui.woff", "application/font-woff", 23000 },
+    { "/fonts/icons.ttf", "/fonts/icons.ttf", "application/x-font-ttf", 12000 },
+    { "/fonts/icons.eot", "/fonts/icons.eot", "application/vnd.ms-fontobject", 12500 },
+    { "/docs/readme.txt", "/docs/readme.txt", "text/plain", 1800 },
+    { "/docs/manual.pdf", "/docs/manual.pdf", "application/pdf", 40000 },
+    { "/docs/data.xml", "/docs/data.xml", "text/xml", 2200 },
+};
+
+static const time_t MTIME = 1700000000;    /* Tue, 14 Nov 2023 22:13:20 GMT */
+
+static std::string content(const char* file, size_t size)
+{
+    std::string s(size, 0);
+    uint32_t x = 2166136261UL;
+    for (const char* p = file; *p; p++) {
+        x = (x ^ (uint8_t)*p) * 16777619UL;
+    }
+    for (size_t i = 0; i < size; i++) {
+        x = x * 1103515245 + 12345;
+        s[i] = (char)(x >> 16);
+    }
+    return s;
+}
+
+static void put(const char* file, const std::string& data, time_t mtime)
+{
+    std::string path = std::string(root) + file;
+    for (size_t at = path.find('/', strlen(root) + 1); at != std::string::npos; at = path.find('/', at + 1)) {
+        mkdir(path.substr(0, at).c_str(), 0755);
+    }
+    FILE* f = ::fopen(path.c_str(), "wb");
+    fwrite(data.data(), 1, data.size(), f);
+    ::fclose(f);
+    struct utimbuf t = { mtime, mtime };
+    utime(path.c_str(), &t);
+}
+
+static void make_assets(void)
+{
+    for (int i = 0; i < ASSETS; i++) {
+        put(assets[i].file, content(assets[i].file, assets[i].size), MTIME);
+    }
+    /* both variants: the plain file wins */
+    put("/js/both.js", content("/js/both.js", 1000), MTIME);
+    put("/js/both.js.gz", content("/js/both.js.gz", 500), MTIME);
+}
+
+static TestServer* indexed;
+static TestServer* legacy;
+
+/* --------------------------------------------------------------- tests */
+
+static void test_mime_lookup_matches_linear_scan(void)
+{
+    for (int i = 0; i < maxType; i++) {
+        String path = String("/dir/file") + mimeTable[i].endsWith;
+        TEST_ASSERT(StaticRequestHandler::getContentType(path) == LegacyStaticRequestHandler::getContentType(path));
+    }
+    const char* odd[] = { "/noext", "/a.b/c", "/x.HTML", "/x.", "/x.js.map", "/.htaccess", "/x.tar.gz", "/w.woff2" };
+    for (size_t i = 0; i < sizeof(odd) / sizeof(odd[0]); i++) {
+        TEST_ASSERT(StaticRequestHandler::getContentType(odd[i]) == LegacyStaticRequestHandler::getContentType(odd[i]));
+    }
+}
+
+/* the MD5 stand-in behind digest authentication */
+static void test_md5(void)
+{
+    String abc("abc"), empty(""), long_text;
+    for (int i = 0; i < 8; i++)
+        long_text += "1234567890";
+    TEST_ASSERT(md5str(abc) == "900150983cd24fb0d6963f7d28e17f72");
+    TEST_ASSERT(md5str(empty) == "d41d8cd98f00b204e9800998ecf8427e");
+    TEST_ASSERT(md5str(long_text) == "57edf4a22be3c955ac49da2e2107b67a");
+}
+
+static void test_serves_every_asset(void)
+{
+    for (int i = 0; i < ASSETS; i++) {
+        Response r;
+        TEST_ASSERT(fetch(*indexed, assets[i].uri, "", r));
+        TEST_ASSERT_EQ(r.status, 200);
+        TEST_ASSERT(r.body == content(assets[i].file, assets[i].size));
+        TEST_ASSERT(r.header("Content-Type") == assets[i].type);
+        TEST_ASSERT_EQ(atoi(r.header("Content-Length").c_str()), assets[i].size);
+        TEST_ASSERT(r.header("Cache-Control") == "max-age=60");
+        TEST_ASSERT(r.header("Last-Modified") == "Tue, 14 Nov 2023 22:13:20 GMT");
+        TEST_ASSERT(r.header("Accept-Ranges") == "bytes");
+        bool gz = strstr(assets[i].file, ".gz") != NULL;
+        TEST_ASSERT(r.header("Content-Encoding") == (gz ? "gzip" : ""));
+        assets[i].etag = r.header("ETag");
+        TEST_ASSERT(assets[i].etag.size() > 2 && assets[i].etag[0] == '"');
+
+        /* the old handler sends the same bytes and type */
+        Response old;
+        TEST_ASSERT(fetch(*legacy, assets[i].uri, "", old));
+        TEST_ASSERT(old.body == r.body);
+        TEST_ASSERT(old.header("Content-Type") == r.header("Content-Type"));
+        TEST_ASSERT(old.header("Content-Encoding") == r.header("Content-Encoding"));
+    }
+    Response r;
+    TEST_ASSERT(fetch(*indexed, "/js/both.js", "", r));
+    TEST_ASSERT(r.body == content("/js/both.js", 1000));
+    TEST_ASSERT(r.header("Content-Encoding") == "");
+    TEST_ASSERT(fetch(*indexed, "/js/missing.js", "", r));
+    TEST_ASSERT_EQ(r.status, 404);
+}
+
+static void test_conditional_requests(void)
+{
+    const Asset& a = assets[6];
+    Response r;
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-None-Match: " + a.etag + "\r\n", r));
+    TEST_ASSERT_EQ(r.status, 304);
+    TEST_ASSERT(r.body.empty());
+    TEST_ASSERT(r.header("ETag") == a.etag);
+
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-None-Match: \"x\", W/" + a.etag + "\r\n", r));
+    TEST_ASSERT_EQ(r.status, 304);
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-None-Match: *\r\n", r));
+    TEST_ASSERT_EQ(r.status, 304);
+
+    /* a tag that only contains the current one is not a match */
+    std::string inner = a.etag.substr(1, a.etag.size() - 2);
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-None-Match: \"" + inner + "0\"\r\n", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT_EQ(r.body.size(), a.size);
+
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-Modified-Since: Tue, 14 Nov 2023 22:13:20 GMT\r\n", r));
+    TEST_ASSERT_EQ(r.status, 304);
+    /* If-None-Match wins over If-Modified-Since */
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-None-Match: \"old\"\r\nIf-Modified-Since: Tue, 14 Nov 2023 22:13:20 GMT\r\n", r));
+    TEST_ASSERT_EQ(r.status, 200);
+}
+
+static void test_range_requests(void)
+{
+    const Asset& a = assets[3];
+    std::string all = content(a.file, a.size);
+    Response r;
+    TEST_ASSERT(fetch(*indexed, a.uri, "Range: bytes=10-19\r\n", r));
+    TEST_ASSERT_EQ(r.status, 206);
+    TEST_ASSERT(r.body == all.substr(10, 10));
+    TEST_ASSERT(r.header("Content-Range") == "bytes 10-19/2400");
+
+    TEST_ASSERT(fetch(*indexed, a.uri, "Range: bytes=-100\r\n", r));
+    TEST_ASSERT_EQ(r.status, 206);
+    TEST_ASSERT(r.body == all.substr(2300));
+    TEST_ASSERT(r.header("Content-Range") == "bytes 2300-2399/2400");
+
+    TEST_ASSERT(fetch(*indexed, a.uri, "Range: bytes=2000-\r\n", r));
+    TEST_ASSERT_EQ(r.status, 206);
+    TEST_ASSERT(r.body == all.substr(2000));
+
+    TEST_ASSERT(fetch(*indexed, a.uri, "Range: bytes=2000-99999\r\n", r));
+    TEST_ASSERT_EQ(r.status, 206);
+    TEST_ASSERT(r.header("Content-Range") == "bytes 2000-2399/2400");
+
+    TEST_ASSERT(fetch(*indexed, a.uri, "Range: bytes=2400-\r\n", r));
+    TEST_ASSERT_EQ(r.status, 416);
+    TEST_ASSERT(r.header("Content-Range") == "bytes */2400");
+    TEST_ASSERT(fetch(*indexed, a.uri, "Range: bytes=0-1,5-6\r\n", r));
+    TEST_ASSERT_EQ(r.status, 416);
+
+    /* a precompressed asset is ranged over the gzip bytes */
+    const Asset& z = assets[1];
+    TEST_ASSERT(fetch(*indexed, z.uri, "Range: bytes=0-99\r\n", r));
+    TEST_ASSERT_EQ(r.status, 206);
+    TEST_ASSERT(r.body == content(z.file, z.size).substr(0, 100));
+    TEST_ASSERT(r.header("Content-Encoding") == "gzip");
+}
+
+/* an upload handler replacing a file, through the FS like on the device */
+static void rewrite(const char* file, const std::string& data)
+{
+    File f = disk->open(file, FILE_WRITE);
+    f.write((const uint8_t*)data.data(), data.size());
+    f.close();
+}
+
+static void test_changed_and_new_files(void)
+{
+    Asset& a = assets[27];
+    Response r;
+    /* same size, written now */
+    rewrite(a.file, content("changed", a.size));
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-None-Match: " + a.etag + "\r\n", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT(r.body == content("changed", a.size));
+    std::string changed = r.header("ETag");
+    TEST_ASSERT(changed != a.etag);
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-None-Match: " + changed + "\r\n", r));
+    TEST_ASSERT_EQ(r.status, 304);
+
+    /* other size, most likely within the same second */
+    rewrite(a.file, content("shorter", 900));
+    TEST_ASSERT(fetch(*indexed, a.uri, "If-None-Match: " + changed + "\r\n", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT_EQ(r.body.size(), 900);
+    TEST_ASSERT(r.header("ETag") != changed);
+    /* put() goes around the FS and its stat cache */
+    put(a.file, content(a.file, a.size), MTIME);
+    vfs->invalidateCache();
+
+    /* added after serveStatic(): looked up per request */
+    put("/late.txt", content("/late.txt", 333), MTIME);
+    TEST_ASSERT(fetch(*indexed, "/late.txt", "", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT(r.body == content("/late.txt", 333));
+    TEST_ASSERT(r.header("Content-Type") == "text/plain");
+    put("/late.css.gz", content("/late.css.gz", 120), MTIME);
+    TEST_ASSERT(fetch(*indexed, "/late.css", "", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT(r.header("Content-Type") == "text/css");
+    TEST_ASSERT(r.header("Content-Encoding") == "gzip");
+    disk->remove("/late.txt");
+    disk->remove("/late.css.gz");
+}
+
+static void test_etag_without_mtime(void)
+{
+    /* a file system that keeps no times, like SPIFFS */
+    put("/notime.txt", content("/notime.txt", 50), 0);
+    TestServer server;
+    server.serveStatic("/", *disk, "/");
+    server.begin();
+    Response r;
+    TEST_ASSERT(fetch(server, "/notime.txt", "", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT(r.body == content("/notime.txt", 50));
+    TEST_ASSERT(r.header("Last-Modified") == "");
+    std::string etag = r.header("ETag");
+    TEST_ASSERT(etag.size() > 2);
+    TEST_ASSERT(fetch(server, "/notime.txt", "If-None-Match: " + etag + "\r\n", r));
+    TEST_ASSERT_EQ(r.status, 304);
+    TEST_ASSERT(r.header("ETag") == etag);
+    TEST_ASSERT(fetch(server, "/notime.txt", "If-Modified-Since: Thu, 01 Jan 1970 00:00:00 GMT\r\n", r));
+    TEST_ASSERT_EQ(r.status, 200);
+
+    /* replaced with another size: hashed again */
+    put("/notime.txt", content("replaced", 60), 0);
+    vfs->invalidateCache();
+    TEST_ASSERT(fetch(server, "/notime.txt", "If-None-Match: " + etag + "\r\n", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT(r.body == content("replaced", 60));
+    TEST_ASSERT(r.header("ETag") != etag);
+    TEST_ASSERT(fetch(server, "/notime.txt", "If-None-Match: " + r.header("ETag") + "\r\n", r));
+    TEST_ASSERT_EQ(r.status, 304);
+    disk->remove("/notime.txt");
+}
+
+static void test_single_file_uri(void)
+{
+    TestServer server;
+    server.serveStatic("/app", *disk, "/js/router.js");
+    server.serveStatic("/static", *disk, "/css");
+    server.begin();
+    Response r;
+    TEST_ASSERT(fetch(server, "/app", "", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT(r.body == content("/js/router.js", 5200));
+    TEST_ASSERT(fetch(server, "/app/x", "", r));
+    TEST_ASSERT_EQ(r.status, 404);
+    /* a directory is not a single file */
+    TEST_ASSERT(fetch(server, "/static/theme.css", "", r));
+    TEST_ASSERT_EQ(r.status, 200);
+    TEST_ASSERT(r.body == content("/css/theme.css", 2400));
+    TEST_ASSERT(fetch(server, "/static/app.css", "", r));
+    TEST_ASSERT(r.header("Content-Encoding") == "gzip");
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+static double load_page(TestServer& server, bool revisit, unsigned pages, unsigned* per_request, unsigned* codes)
+{
+    page_bytes = 0;
+    lookups = 0;
+    uint64_t t0 = hostNowNs();
+    for (unsigned p = 0; p < pages; p++) {
+        for (int i = 0; i < ASSETS; i++) {
+            Response r;
+            fetch(server, assets[i].uri, revisit ? "If-None-Match: " + assets[i].etag + "\r\n" : "", r);
+            *codes += r.status;
+        }
+    }
+    double s = (hostNowNs() - t0) / 1e9;
+    *per_request = lookups;
+    return pages * ASSETS / s;
+}
+
+static void bench_page_loads(void)
+{
+    unsigned pages = hostIterations(40);
+    const unsigned cost[] = { 0, 100 };
+    for (size_t c = 0; c < sizeof(cost) / sizeof(cost[0]); c++) {
+        lookup_us = cost[c];
+        unsigned codes, lookups_old, lookups_new, lookups_304;
+        size_t bytes_old, bytes_new, bytes_304;
+
+        codes = 0;
+        double old_rps = load_page(*legacy, false, pages, &lookups_old, &codes);
+        bytes_old = page_bytes / pages;
+        TEST_ASSERT_EQ(codes, 200 * ASSETS * pages);
+        codes = 0;
+        double new_rps = load_page(*indexed, false, pages, &lookups_new, &codes);
+        bytes_new = page_bytes / pages;
+        TEST_ASSERT_EQ(codes, 200 * ASSETS * pages);
+        codes = 0;
+        double rev_rps = load_page(*indexed, true, pages, &lookups_304, &codes);
+        bytes_304 = page_bytes / pages;
+        TEST_ASSERT_EQ(codes, 304 * ASSETS * pages);
+
+        double n = pages * ASSETS;
+        BENCH("%3u us/lookup, before, first visit:  %6.0f requests/s  %4.1f lookups/request  %6zu bytes/page",
+              cost[c], old_rps, lookups_old / n, bytes_old);
+        BENCH("%3u us/lookup, index, first visit:   %6.0f requests/s  %4.1f lookups/request  %6zu bytes/page",
+              cost[c], new_rps, lookups_new / n, bytes_new);
+        BENCH("%3u us/lookup, index, revisit (304): %6.0f requests/s  %4.1f lookups/request  %6zu bytes/page",
+              cost[c], rev_rps, lookups_304 / n, bytes_304);
+    }
+    lookup_us = 0;
+}
+
+int main(void)
+{
+    hostClockManual(true);
+    strcpy(root, "/tmp/web_static_XXXXXX");
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    vfs = new VFSImpl();
+    disk = new FS(FSImplPtr(vfs));
+    vfs->mountpoint(root);
+    make_assets();
+
+    indexed = new TestServer();
+    indexed->serveStatic("/", *disk, "/", "max-age=60");
+    indexed->begin();
+    legacy = new TestServer();
+    legacy->addHandler(new LegacyStaticRequestHandler(*disk, "/", "/", "max-age=60"));
+    legacy->begin();
+
+    TEST_RUN(test_md5);
+    TEST_RUN(test_mime_lookup_matches_linear_scan);
+    TEST_RUN(test_serves_every_asset);
+    TEST_RUN(test_conditional_requests);
+    TEST_RUN(test_range_requests);
+    TEST_RUN(test_changed_and_new_files);
+    TEST_RUN(test_etag_without_mtime);
+    TEST_RUN(test_single_file_uri);
+    TEST_RUN(bench_page_loads);
+
+    delete indexed;
+    delete legacy;
+    for (int i = 0; i < ASSETS; i++) {
+        disk->remove(assets[i].file);
+    }
+    disk->remove("/js/both.js");
+    disk->remove("/js/both.js.gz");
+    const char* dirs[] = { "/css", "/js", "/img", "/fonts", "/docs" };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        disk->rmdir(dirs[i]);
+    }
+    rmdir(root);
+    return TEST_EXIT();
+}
@@ -0,0 +1,403 @@
+/*
+ * WebServer's file-to-socket pump against the Stream copy it replaced.
+ *
+ * The handlers stream a 1 MB file from a stand-in for SPIFFS or an SD card,
+ * spending in real time what each read would cost there: CALL_US of CPU for
+ * the call, and for the 256 byte pages or 512 byte sectors not already held
+ * an access time plus the transfer at 2.5 MB/s, waited out the way a driver
+ * waits for its SPI transfer, leaving the CPU to the network. The client is a thread on the other end of a
+ * loopback connection, reading either as fast as it can or paced to 2 MB/s
+ * like a WiFi station. Both socket buffers are cut to lwIP's 5744 byte
+ * default, so a slow client fills them quickly. The server runs in the main
+ * thread; the clock is manual so the close wait can be stepped over.
+ */
+#include "host.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <string>
+
+#include "../../libraries/FS/src/FS.cpp"
+
+static unsigned selects;
+
+static int counted_select(int n, fd_set* r, fd_set* w, fd_set* e, struct timeval* tv)
+{
+    selects++;
+    return select(n, r, w, e, tv);
+}
+
+#include <WiFi.h>
+#define select(n, r, w, e, tv)  counted_select(n, r, w, e, tv)
+#include "../../libraries/WiFi/src/WiFiClient.cpp"
+#include "../../libraries/WiFi/src/WiFiServer.cpp"
+#include "../../libraries/WebServer/src/WebServer.cpp"
+#undef select
+/* both files have a static Content_Type */
+#define Content_Type  Parsing_Content_Type
+#include "../../libraries/WebServer/src/Parsing.cpp"
+#undef Content_Type
+#include "../../libraries/WebServer/src/detail/UriRouter.cpp"
+#include "../../libraries/WebServer/src/detail/mimetable.cpp"
+
+#define SOCKET_BUF  5744    /* CONFIG_TCP_SND_BUF_DEFAULT, CONFIG_TCP_WND_DEFAULT */
+
+static void spin_us(uint64_t us)
+{
+    uint64_t end = hostNowNs() + us * 1000;
+    while (hostNowNs() < end) {
+    }
+}
+
+/* blocked without the CPU, as on a DMA transfer; sleeps overshoot, so the
+   last stretch is spun */
+static void wait_us(uint64_t us)
+{
+    uint64_t end = hostNowNs() + us * 1000;
+    if (us > 200) {
+        struct timespec ts = { 0, (long)(us - 150) * 1000 };
+        nanosleep(&ts, NULL);
+    }
+    while (hostNowNs() < end) {
+    }
+}
+
+/* ------------------------------------------------------------- storage */
+
+struct Medium {
+    const char* name;
+    size_t block;           /* bytes the medium is read in */
+    unsigned access_us;     /* to start a read of one or more blocks */
+    double mb_s;            /* transfer once there */
+};
+
+static const Medium SPIFFS_FLASH = { "SPIFFS", 256, 20, 2.5 };
+static const Medium SD_CARD = { "SD", 512, 200, 2.5 };
+
+#define CALL_US 1           /* File::read() down to the driver, per call */
+
+static std::string payload;
+
+class SlowFileImpl : public FileImpl
+{
+public:
+    const Medium& medium;
+    size_t pos = 0;
+    size_t cached = (size_t)-1;     /* block the driver holds */
+    unsigned calls = 0;
+    size_t largest = 0;
+
+    SlowFileImpl(const Medium& m) : medium(m) { }
+
+    size_t read(uint8_t* buf, size_t size) override
+    {
+        size_t n = pos < payload.size() ? payload.size() - pos : 0;
+        n = n < size ? n : size;
+        calls++;
+        largest = n > largest ? n : largest;
+        spin_us(CALL_US);
+        uint64_t us = 0;
+        if (n) {
+            size_t first = pos / medium.block, last = (pos + n - 1) / medium.block;
+            if (first == cached)
+                first++;
+            if (first <= last)
+                us += medium.access_us + (uint64_t)((last - first + 1) * medium.block / medium.mb_s);
+            cached = last;
+        }
+        wait_us(us);
+        memcpy(buf, payload.data() + pos, n);
+        pos += n;
+        return n;
+    }
+    size_t write(const uint8_t* buf, size_t size) override { return 0; }
+    bool seek(uint32_t off, SeekMode mode) override
+    {
+        pos = mode == SeekSet ? off : mode == SeekCur ? pos + off : payload.size() + off;
+        return pos <= payload.size();
+    }
+    size_t position() const override { return pos; }
+    size_t size() const override { return payload.size(); }
+    void flush() override { }
+    void close() override { }
+    time_t getLastWrite() override { return 0; }
+    const char* name() const override { return "/big.bin"; }
+    boolean isDirectory(void) override { return false; }
+    FileImplPtr openNextFile(const char* mode) override { return FileImplPtr(); }
+    void rewindDirectory(void) override { }
+    operator bool() override { return true; }
+};
+
+/* -------------------------------------------------------------- server */
+
+class TestServer : public WebServer {
+public:
+    TestServer() : WebServer(0) {}
+
+    uint16_t port() {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        getsockname(_server.fd(), (struct sockaddr*)&addr, &len);
+        return ntohs(addr.sin_port);
+    }
+
+    int listener() { return _server.fd(); }
+
+    /* streamFile() before the pump: WiFiClient::write(Stream&) */
+    size_t legacyStreamFile(File& file, const String& contentType) {
+        _streamFileCore(file.size(), file.name(), contentType);
+        return _currentClient.write(file);
+    }
+};
+
+static TestServer* server;
+
+enum Mode { LEGACY, PUMP, CHUNKED };
+
+static Mode mode;
+static const Medium* medium;
+static size_t streamed;
+static std::shared_ptr<SlowFileImpl> source;
+
+static void handle_big(void)
+{
+    source = std::make_shared<SlowFileImpl>(*medium);
+    File f(source);
+    switch (mode) {
+    case LEGACY:
+        streamed = server->legacyStreamFile(f, "application/octet-stream");
+        break;
+    case PUMP:
+        streamed = server->streamFile(f, "application/octet-stream");
+        break;
+    case CHUNKED:
+        server->setContentLength(CONTENT_LENGTH_UNKNOWN);
+        server->send(200, "application/octet-stream", "");
+        streamed = server->streamContent(f);
+        break;
+    }
+}
+
+/* -------------------------------------------------------------- client */
+
+struct Reader {
+    double mb_s;            /* 0 reads as fast as it can */
+    size_t stop_after;      /* closes early once this much came in, 0 never */
+    std::string in;
+    size_t body;            /* where the body starts */
+    volatile bool done;
+};
+
+static bool response_complete(Reader& c)
+{
+    size_t end = c.in.find("\r\n\r\n");
+    if (end == std::string::npos)
+        return false;
+    c.body = end + 4;
+    std::string head = c.in.substr(0, c.body);
+    size_t at = head.find("Content-Length: ");
+    if (at != std::string::npos)
+        return c.in.size() >= c.body + (size_t)atol(head.c_str() + at + 16);
+    return c.in.size() >= c.body + 5 && !c.in.compare(c.in.size() - 5, 5, "0\r\n\r\n");
+}
+
+static void* client_thread(void* arg)
+{
+    Reader& c = *(Reader*)arg;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int size = SOCKET_BUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server->port());
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        const char req[] = "GET /big HTTP/1.1\r\nHost: esp32\r\n\r\n";
+        ::send(fd, req, sizeof(req) - 1, 0);
+        uint64_t t0 = hostNowNs();
+        uint64_t deadline = t0 + 30000000000ULL;
+        char buf[1460];
+        while (!response_complete(c) && hostNowNs() < deadline) {
+            if (c.stop_after && c.in.size() >= c.stop_after)
+                break;
+            size_t want = sizeof(buf);
+            if (c.mb_s) {
+                /* what the link has carried by now */
+                double allowed = (hostNowNs() - t0) / 1000.0 * c.mb_s - c.in.size();
+                if (allowed < (double)want) {
+                    wait_us(250);
+                    continue;
+                }
+            }
+            ssize_t n = recv(fd, buf, want, MSG_DONTWAIT);
+            if (n > 0)
+                c.in.append(buf, n);
+            else if (n == 0)
+                break;
+        }
+    }
+    ::close(fd);
+    c.done = true;
+    return NULL;
+}
+
+/* one request for /big, served in this thread, returns seconds taken */
+static double run(Reader& c)
+{
+    c.done = false;
+    c.in.clear();
+    streamed = 0;
+    selects = 0;
+    pthread_t t;
+    uint64_t t0 = hostNowNs();
+    pthread_create(&t, NULL, client_thread, &c);
+    while (!c.done) {
+        server->handleClient();
+    }
+    double s = (hostNowNs() - t0) / 1e9;
+    pthread_join(t, NULL);
+    hostClockAdvance((HTTP_MAX_CLOSE_WAIT + 1) * 1000LL);
+    server->handleClient();
+    return s;
+}
+
+/* the body of a chunked response, and the size of each chunk */
+static std::string dechunk(const std::string& in, size_t at, std::vector<size_t>& sizes)
+{
+    std::string out;
+    for (;;) {
+        size_t len = strtoul(in.c_str() + at, NULL, 16);
+        at = in.find("\r\n", at);
+        if (at == std::string::npos || len == 0)
+            break;
+        at += 2;
+        sizes.push_back(len);
+        out.append(in, at, len);
+        at += len;
+        if (in.compare(at, 2, "\r\n"))
+            break;
+        at += 2;
+    }
+    return out;
+}
+
+/* --------------------------------------------------------------- tests */
+
+static void test_every_path_sends_the_file(void)
+{
+    Reader c = { 0, 0 };
+    medium = &SD_CARD;
+    const Mode modes[] = { LEGACY, PUMP };
+    for (size_t i = 0; i < 2; i++) {
+        mode = modes[i];
+        run(c);
+        TEST_ASSERT(c.in.find("Content-Length: " + std::to_string(payload.size()) + "\r\n") != std::string::npos);
+        TEST_ASSERT(c.in.compare(c.body, std::string::npos, payload) == 0);
+        TEST_ASSERT_EQ(streamed, payload.size());
+    }
+    /* reads come in setStreamBuffer() blocks */
+    TEST_ASSERT_EQ(source->largest, HTTP_STREAM_CHUNK_SIZE);
+    TEST_ASSERT_EQ(source->calls, (payload.size() + HTTP_STREAM_CHUNK_SIZE - 1) / HTTP_STREAM_CHUNK_SIZE);
+    server->setStreamBuffer(16384);
+    run(c);
+    TEST_ASSERT(c.in.compare(c.body, std::string::npos, payload) == 0);
+    TEST_ASSERT_EQ(source->largest, 16384);
+    /* no PSRAM on the host, the buffers come from the heap */
+    server->setStreamBuffer(8192, true);
+    run(c);
+    TEST_ASSERT(c.in.compare(c.body, std::string::npos, payload) == 0);
+    TEST_ASSERT_EQ(source->largest, 8192);
+    server->setStreamBuffer(0);
+}
+
+static void test_chunked_blocks(void)
+{
+    Reader c = { 0, 0 };
+    medium = &SPIFFS_FLASH;
+    mode = CHUNKED;
+    server->setStreamBuffer(3000);
+    run(c);
+    TEST_ASSERT(c.in.find("Transfer-Encoding: chunked\r\n") != std::string::npos);
+    TEST_ASSERT(c.in.find("Content-Length") == std::string::npos);
+    std::vector<size_t> sizes;
+    TEST_ASSERT(dechunk(c.in, c.body, sizes) == payload);
+    TEST_ASSERT_EQ(sizes.size(), (payload.size() + 2999) / 3000);
+    for (size_t i = 0; i + 1 < sizes.size(); i++)
+        TEST_ASSERT_EQ(sizes[i], 3000);
+    TEST_ASSERT_EQ(streamed, payload.size());
+    /* nothing but the chunks and one terminating chunk */
+    size_t framed = 5;
+    for (size_t i = 0; i < sizes.size(); i++)
+        framed += snprintf(NULL, 0, "%zx\r\n", sizes[i]) + sizes[i] + 2;
+    TEST_ASSERT_EQ(c.in.size() - c.body, framed);
+    server->setStreamBuffer(0);
+}
+
+static void test_client_gone(void)
+{
+    Reader c = { 0, payload.size() / 4 };
+    medium = &SPIFFS_FLASH;
+    mode = PUMP;
+    double s = run(c);
+    TEST_ASSERT(streamed < payload.size());
+    TEST_ASSERT(s < 2.0);
+}
+
+/* ------------------------------------------------------------ benchmark */
+
+static void bench_serve(void)
+{
+    const Medium* media[] = { &SPIFFS_FLASH, &SD_CARD };
+    const double links[] = { 0, 2.0 };
+    struct { const char* label; Mode mode; size_t chunk; } variant[] = {
+        { "before (Stream copy)", LEGACY, 0 },
+        { "pump, 1436 B blocks", PUMP, 1436 },
+        { "pump, 4 KB blocks", PUMP, 4096 },
+        { "pump, 16 KB blocks", PUMP, 16384 },
+        { "pump, 4 KB chunked", CHUNKED, 4096 },
+    };
+    for (size_t l = 0; l < 2; l++) {
+        for (size_t m = 0; m < 2; m++) {
+            medium = media[m];
+            /* the file alone, read in 4 KB blocks */
+            double read_mb_s = 1.0 / ((CALL_US + medium->access_us) / 4096.0 + 1.0 / medium->mb_s);
+            for (size_t v = 0; v < sizeof(variant) / sizeof(variant[0]); v++) {
+                        Reader c = { links[l], 0 };
+                mode = variant[v].mode;
+                server->setStreamBuffer(variant[v].chunk);
+                double s = run(c);
+                TEST_ASSERT_EQ(streamed, payload.size());
+                char link[16];
+                snprintf(link, sizeof(link), links[l] ? "%.0f MB/s" : "loopback", links[l]);
+                BENCH("%-6s (reads %.2f MB/s) to %-8s %-21s %5.2f MB/s  %4u reads %5u selects",
+                      medium->name, read_mb_s, link, variant[v].label, payload.size() / s / 1e6,
+                      source->calls, selects);
+            }
+        }
+    }
+    server->setStreamBuffer(0);
+}
+
+int main(void)
+{
+    /* lwIP reports a closed peer with an error, not a signal */
+    signal(SIGPIPE, SIG_IGN);
+    hostClockManual(true);
+    payload.resize(hostIterations(1024) * 1024);
+    for (size_t i = 0; i < payload.size(); i++)
+        payload[i] = (char)(i * 2654435761u >> 24);
+
+    server = new TestServer();
+    server->on("/big", handle_big);
+    server->begin();
+    int size = SOCKET_BUF;
+    setsockopt(server->listener(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    TEST_RUN(test_every_path_sends_the_file);
+    TEST_RUN(test_chunked_blocks);
+    TEST_RUN(test_client_gone);
+    TEST_RUN(bench_serve);
+    delete server;
+    return TEST_EXIT();
+}
@@ -0,0 +1,74 @@
+/*
+ * String::replace() against the same replacement done on std::string.
+ *
+ * A replacement shorter than what it finds compacts the string in place,
+ * so every piece between matches is copied onto bytes it overlaps. The
+ * strings are long enough, and the matches sparse enough, for glibc's
+ * memcpy() to copy those pieces out of order, which is how the overlap
+ * showed up on the host; newlib's forward copy hid it on the chip.
+ */
+#include "host.h"
+
+#include <string>
+
+#include "WString.h"
+
+static std::string reference(std::string s, const std::string& find, const std::string& with)
+{
+    for (size_t at = s.find(find); at != std::string::npos; at = s.find(find, at + with.size()))
+        s.replace(at, find.size(), with);
+    return s;
+}
+
+static void check(const std::string& text, const char* find, const char* with)
+{
+    String s(text.c_str());
+    s.replace(find, with);
+    std::string want = reference(text, find, with);
+    TEST_ASSERT_EQ(s.length(), want.size());
+    TEST_ASSERT(want == s.c_str());
+}
+
+static std::string filler(size_t len, unsigned seed)
+{
+    std::string s;
+    for (size_t i = 0; i < len; i++)
+        s += 'a' + (seed + i * 7) % 26;
+    return s;
+}
+
+/* CRLF to LF over a form field value, as Parsing.cpp does */
+static void test_shrinking_replace_overlaps(void)
+{
+    static const size_t gaps[] = { 1, 15, 64, 300, 1000, 4000 };
+    for (size_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+        std::string text;
+        for (unsigned i = 0; i < 6; i++)
+            text += filler(gaps[g], i) + "\r\n";
+        check(text, "\r\n", "\n");
+        check("\r\n" + text + "tail", "\r\n", "");
+        check(text, "\r\n", "\n");
+    }
+    /* a long head before the first match and a long tail after the last */
+    check(filler(3000, 1) + "\r\n" + filler(3000, 2), "\r\n", "\n");
+    check(filler(5000, 3) + "<find>" + filler(20, 4) + "<find>" + filler(5000, 5), "<find>", "/");
+}
+
+static void test_same_and_growing_replace(void)
+{
+    std::string text;
+    for (unsigned i = 0; i < 8; i++)
+        text += filler(500, i) + "\n";
+    check(text, "\n", "|");
+    check(text, "\n", "\r\n");
+    check(text, "\n", "<br>\r\n");
+    check("", "\n", "");
+    check("no match here", "\n", "\r\n");
+}
+
+int main(void)
+{
+    TEST_RUN(test_shrinking_replace_overlaps);
+    TEST_RUN(test_same_and_growing_replace);
+    return TEST_EXIT();
+}